@@ -0,0 +1,16 @@
+# Compile the QI_MULTIVERSION kernels for several x86-64 levels and pick one at run-time (see
+# Source/Core/CPU.h), so one package runs on every node without -march=native
+option( QUIT_MULTIVERSION "Build hot kernels for SSE4.2, AVX2 and AVX-512 and choose at run-time" ON )
+if( QUIT_MULTIVERSION )
+  include( CheckCXXSourceCompiles )
+  check_cxx_source_compiles( "
+    __attribute__((target_clones(\"arch=x86-64-v4\", \"arch=x86-64-v3\", \"arch=x86-64-v2\", \"default\")))
+    int f(const int x) { return x + 1; }
+    int main() { return f(__builtin_cpu_supports(\"x86-64-v3\")) > 0 ? 0 : 1; }"
+    QUIT_HAVE_TARGET_CLONES )
+  if( QUIT_HAVE_TARGET_CLONES )
+    add_definitions( -DQI_MULTIVERSION_CLONES )
+  else()
+    message( STATUS "Compiler does not support target_clones for x86-64 levels, building the kernels for the baseline only" )
+  endif()
+endif()
@@ -0,0 +1,273 @@
+#!/bin/bash -e
+
+#
+# End-to-end throughput benchmark for the voxelwise fitting programs
+# By Tobias Wood
+#
+
+usage() {
+cat << END_USAGE
+Usage: $0 [options]
+
+Generates noisy phantoms with qinewimage and qisignal, then times the main
+fitting programs on them for each combination of thread count and mask
+fraction. The results are printed as JSON, with the voxels fitted per second,
+the parallel efficiency relative to the first thread count and the peak
+resident memory of each run.
+
+The fit time is the "Elapsed time" reported by each program, so reading and
+writing the images is not included. The QUIT programs must be on your PATH.
+
+Options:
+    -s SIZE     Phantom size, default "32,32,32"
+    -S SIZE     Phantom size for qimcdespot, which is much slower, default "8,8,8"
+    -t THREADS  Thread counts to test, default "1 2 4 8"
+    -f FRACS    Mask fractions to test, default "1.0 0.5 0.1"
+    -p PROGS    Programs to test, default all of:
+                qidespot1 qidespot2 qidespot2fm qimcdespot qimultiecho qi_ssfp_ellipse qi_lorentzian
+    -r REPEATS  Repeat each run and keep the fastest, default 1
+    -n NOISE    Noise level added to the phantoms, default 0.002
+    -o FILE     Write the JSON to FILE instead of stdout
+    -d DIR      Work in DIR and keep the files, default is a temporary directory that is removed
+END_USAGE
+exit 1;
+}
+
+SIZE="32,32,32"
+MCD_SIZE="8,8,8"
+THREADS="1 2 4 8"
+FRACTIONS="1.0 0.5 0.1"
+PROGRAMS="qidespot1 qidespot2 qidespot2fm qimcdespot qimultiecho qi_ssfp_ellipse qi_lorentzian"
+REPEATS=1
+NOISE="0.002"
+SEED=42
+OUT_FILE=""
+WORK_DIR=""
+
+while getopts "s:S:t:f:p:r:n:o:d:h" OPT; do
+    case $OPT in
+        s) SIZE="$OPTARG" ;;
+        S) MCD_SIZE="$OPTARG" ;;
+        t) THREADS="$OPTARG" ;;
+        f) FRACTIONS="$OPTARG" ;;
+        p) PROGRAMS="$OPTARG" ;;
+        r) REPEATS="$OPTARG" ;;
+        n) NOISE="$OPTARG" ;;
+        o) OUT_FILE="$(cd "$(dirname "$OPTARG")" && pwd)/$(basename "$OPTARG")" ;;
+        d) WORK_DIR="$OPTARG" ;;
+        *) usage ;;
+    esac
+done
+
+if [ -z "$WORK_DIR" ]; then
+    WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/qi_bench.XXXXXX")
+    trap 'rm -rf "$WORK_DIR"' EXIT
+fi
+mkdir -p "$WORK_DIR"
+cd "$WORK_DIR"
+
+export QUIT_EXT=NIFTI
+EXT=".nii"
+
+#
+# Peak RSS needs GNU time on Linux (-v), BSD time on macOS reports it with -l
+#
+if [[ $OSTYPE == darwin* ]]; then
+    TIME_CMD="/usr/bin/time -l"
+    RSS_PATTERN="maximum resident set size"
+    RSS_FIELD=1
+    RSS_SCALE=1024 # Bytes
+else
+    TIME_CMD="/usr/bin/time -v"
+    RSS_PATTERN="Maximum resident set size"
+    RSS_FIELD=NF
+    RSS_SCALE=1 # Already in KB
+fi
+if [ ! -x /usr/bin/time ]; then
+    echo "/usr/bin/time is required to measure peak memory" >&2
+    exit 1
+fi
+
+#
+# Phantoms. The sequences follow the ones in the tests.
+#
+make_phantoms() {
+    local S="$1"
+    local P="$2" # Prefix
+    qinewimage --size "$S" -f 1.0 ${P}PD$EXT
+    qinewimage --size "$S" -g "0 0.5 1.5" ${P}T1$EXT
+    qinewimage --size "$S" -g "1 0.025 0.125" ${P}T2$EXT
+    qinewimage --size "$S" -g "2 -150.0 150.0" ${P}f0$EXT
+    qinewimage --size "$S" -f 1.0 ${P}B1$EXT
+    # Each x column gets a separate integer value, so thresholding it selects whole columns
+    local NX=${S%%,*}
+    qinewimage --size "$S" -g "0 1 $NX" ${P}column$EXT
+}
+
+# Keep the last round(FRACTION * NX) columns of the image
+make_mask() {
+    local S="$1"
+    local P="$2"
+    local F="$3"
+    local NX=${S%%,*}
+    local LOWER=$(awk -v nx=$NX -v f=$F 'BEGIN { k = int(f * nx + 0.5); if (k < 1) k = 1; print nx - k + 0.5 }')
+    qimask ${P}column$EXT --lower=$LOWER --out=${P}mask_$F$EXT
+}
+
+# Voxels in a mask, found from the size and fraction the same way as make_mask
+mask_voxels() {
+    local S="$1"
+    local F="$2"
+    echo "$S" | awk -F, -v f=$F '{ k = int(f * $1 + 0.5); if (k < 1) k = 1; print k * $2 * $3 }'
+}
+
+SPGR_SEQ='"SPGR": { "TR": 0.0065, "FA": [3,4,5,6,7,9,13,18] }'
+SSFP_SEQ='"SSFP": { "TR": 0.005,
+                    "FA": [12,16,21,27,33,40,51,68,12,16,21,27,33,40,51,68],
+                    "PhaseInc": [180,180,180,180,180,180,180,180,0,0,0,0,0,0,0,0] }'
+FM_SEQ='"SSFP": { "TR": 0.005, "FA": [12,12,12,12,65,65,65,65], "PhaseInc": [0,90,180,270,0,90,180,270] }'
+ME_SEQ='"MultiEcho": { "TR": 2.5, "TE1": 0.005, "ESP": 0.005, "ETL": 16 }'
+ELLIPSE_SEQ='"TR": 0.01, "FA": [30], "PhaseInc": [180,240,300,0,60,120]'
+# There is no Z-spectrum model in qisignal, so the dark band of a finely phase-cycled SSFP
+# profile stands in for the saturation dip. The frequencies are in PPM.
+ZSPEC_SEQ='"SSFP": { "TR": 0.005, "FA": [30,30,30,30,30,30,30,30,30,30,30,30,30],
+                     "PhaseInc": [180,210,240,270,300,330,0,30,60,90,120,150,180] }'
+ZSPEC_FRQS='[-3,-2.5,-2,-1.5,-1,-0.5,0,0.5,1,1.5,2,2.5,3]'
+
+single_signal() {
+    local P="$1"
+    local OUT="$2"
+    local SEQ="$3"
+    shift 3
+    qisignal --model=1 --noise=$NOISE --seed=$SEED "$@" $OUT << END_SIG
+{
+    "PD": "${P}PD$EXT",
+    "T1": "${P}T1$EXT",
+    "T2": "${P}T2$EXT",
+    "f0": "${P}f0$EXT",
+    "B1": "${P}B1$EXT",
+    "SequenceGroup": { "sequences": [ { $SEQ } ] }
+}
+END_SIG
+}
+
+setup_program() {
+    case $1 in
+        qidespot1)
+            single_signal "" spgr$EXT "$SPGR_SEQ"
+            INPUTS="spgr$EXT"; STDIN="{ $SPGR_SEQ }"; ARGS="-b B1$EXT" ;;
+        qidespot2)
+            single_signal "" ssfp$EXT "$SSFP_SEQ"
+            INPUTS="T1$EXT ssfp$EXT"; STDIN="{ $SSFP_SEQ }"; ARGS="-b B1$EXT" ;;
+        qidespot2fm)
+            single_signal "" ssfp_fm$EXT "$FM_SEQ"
+            INPUTS="T1$EXT ssfp_fm$EXT"; STDIN="{ $FM_SEQ }"; ARGS="-b B1$EXT --asym" ;;
+        qimultiecho)
+            single_signal "" me$EXT "$ME_SEQ"
+            INPUTS="me$EXT"; STDIN="{ $ME_SEQ }"; ARGS="-al" ;;
+        qi_ssfp_ellipse)
+            single_signal "" ellipse$EXT "\"SSFPEcho\": { $ELLIPSE_SEQ }" --complex
+            INPUTS="ellipse$EXT"; STDIN="{ \"SSFPEllipse\": { $ELLIPSE_SEQ } }"; ARGS="--algo=d" ;;
+        qi_lorentzian)
+            single_signal "" zspec$EXT "$ZSPEC_SEQ"
+            INPUTS="zspec$EXT"; STDIN="{ \"freq\": $ZSPEC_FRQS }"; ARGS="" ;;
+        qimcdespot)
+            qinewimage --size "$MCD_SIZE" -f 0.465 mcd_T1_m$EXT
+            qinewimage --size "$MCD_SIZE" -f 0.026 mcd_T2_m$EXT
+            qinewimage --size "$MCD_SIZE" -f 1.070 mcd_T1_ie$EXT
+            qinewimage --size "$MCD_SIZE" -f 0.117 mcd_T2_ie$EXT
+            qinewimage --size "$MCD_SIZE" -f 4.0 mcd_T1_csf$EXT
+            qinewimage --size "$MCD_SIZE" -f 2.5 mcd_T2_csf$EXT
+            qinewimage --size "$MCD_SIZE" -f 0.18 mcd_tau_m$EXT
+            qinewimage --size "$MCD_SIZE" -g "0 0.05 0.25" mcd_f_m$EXT
+            qinewimage --size "$MCD_SIZE" -f 0.05 mcd_f_csf$EXT
+            qisignal --model=3 --noise=$NOISE --seed=$SEED mcd_spgr$EXT mcd_ssfp$EXT << END_SIG
+{
+    "PD": "mcd_PD$EXT", "T1_m": "mcd_T1_m$EXT", "T2_m": "mcd_T2_m$EXT",
+    "T1_ie": "mcd_T1_ie$EXT", "T2_ie": "mcd_T2_ie$EXT",
+    "T1_csf": "mcd_T1_csf$EXT", "T2_csf": "mcd_T2_csf$EXT",
+    "tau_m": "mcd_tau_m$EXT", "f_m": "mcd_f_m$EXT", "f_csf": "mcd_f_csf$EXT",
+    "f0": "mcd_f0$EXT", "B1": "mcd_B1$EXT",
+    "SequenceGroup": { "sequences": [ { $SPGR_SEQ }, { $SSFP_SEQ } ] }
+}
+END_SIG
+            INPUTS="mcd_spgr$EXT mcd_ssfp$EXT"
+            STDIN="{ \"SequenceGroup\": { \"sequences\": [ { $SPGR_SEQ }, { $SSFP_SEQ } ] } }"
+            ARGS="-M3 -b mcd_B1$EXT -f mcd_f0$EXT" ;;
+        *)
+            echo "Unknown program $1" >&2
+            exit 1 ;;
+    esac
+}
+
+echo "Generating phantoms in $WORK_DIR" >&2
+make_phantoms "$SIZE" ""
+make_phantoms "$MCD_SIZE" "mcd_"
+for F in $FRACTIONS; do
+    make_mask "$SIZE" "" $F
+    make_mask "$MCD_SIZE" "mcd_" $F
+done
+
+#
+# Run one program with one thread count and mask, printing the fit time and peak RSS in KB
+#
+run_one() {
+    local PROG="$1"
+    local T="$2"
+    local MASK="$3"
+    local BEST_TIME=""
+    local BEST_RSS=0
+    for R in $(seq $REPEATS); do
+        echo "$STDIN" | $TIME_CMD $PROG $INPUTS $ARGS -m $MASK -T $T --verbose > run.log 2> time.log
+        local FIT=$(sed -n 's/^Elapsed time was \([0-9.eE+-]*\)s$/\1/p' run.log | tail -n 1)
+        local RSS=$(grep "$RSS_PATTERN" time.log | awk -v s=$RSS_SCALE '{ print int($'$RSS_FIELD' / s) }')
+        if [ -z "$FIT" ]; then
+            echo "$PROG did not report an elapsed time, see $WORK_DIR/run.log" >&2
+            exit 1
+        fi
+        BEST_TIME=$(awk -v a="$BEST_TIME" -v b=$FIT 'BEGIN { print (a == "" || b < a) ? b : a }')
+        BEST_RSS=$(( RSS > BEST_RSS ? RSS : BEST_RSS ))
+    done
+    echo "$BEST_TIME $BEST_RSS"
+}
+
+JSON="{\n  \"size\": \"$SIZE\",\n  \"mcd_size\": \"$MCD_SIZE\",\n  \"noise\": $NOISE,\n  \"results\": ["
+SEP=""
+for PROG in $PROGRAMS; do
+    echo "Benchmarking $PROG" >&2
+    setup_program $PROG
+    if [ $PROG == "qimcdespot" ]; then
+        P="mcd_"; S="$MCD_SIZE"
+    else
+        P=""; S="$SIZE"
+    fi
+    for F in $FRACTIONS; do
+        VOXELS=$(mask_voxels "$S" $F)
+        BASE_RATE=""
+        BASE_THREADS=""
+        for T in $THREADS; do
+            read FIT RSS <<< "$(run_one $PROG $T ${P}mask_$F$EXT)"
+            if [ -z "$FIT" ]; then
+                exit 1
+            fi
+            RATE=$(awk -v v=$VOXELS -v t=$FIT 'BEGIN { printf "%.1f", (t > 0) ? v / t : 0 }')
+            if [ -z "$BASE_RATE" ]; then
+                BASE_RATE=$RATE
+                BASE_THREADS=$T
+            fi
+            # Speed-up over the first thread count, divided by the increase in threads
+            EFF=$(awk -v r=$RATE -v r0=$BASE_RATE -v t=$T -v t0=$BASE_THREADS 'BEGIN { printf "%.3f", (r0 > 0) ? (r / r0) / (t / t0) : 0 }')
+            echo "  $PROG threads=$T mask=$F: $RATE voxels/s, efficiency $EFF, peak RSS ${RSS}KB" >&2
+            JSON="$JSON$SEP\n    { \"program\": \"$PROG\", \"threads\": $T, \"mask_fraction\": $F, \"voxels\": $VOXELS,"
+            JSON="$JSON \"seconds\": $FIT, \"voxels_per_second\": $RATE, \"efficiency\": $EFF, \"peak_rss_kb\": $RSS }"
+            SEP=","
+        done
+    done
+done
+JSON="$JSON\n  ]\n}"
+
+if [ -n "$OUT_FILE" ]; then
+    echo -e "$JSON" > "$OUT_FILE"
+else
+    echo -e "$JSON"
+fi
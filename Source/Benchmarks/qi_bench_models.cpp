@@ -0,0 +1,115 @@
+/*
+ *  qi_bench_models.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <limits>
+
+#include "Args.h"
+#include "Counters.h"
+#include "SignalEquations.h"
+#include "Models.h"
+#include "SPGRSequence.h"
+#include "SSFPSequence.h"
+#include "SequenceGroup.h"
+#include "FixedSignal.h"
+
+/*
+ * Allocations are counted by AllocationCounter.cpp, which is compiled into this program. Where
+ * malloc cannot be wrapped (not glibc) they are reported as nan.
+ *
+ * Each evaluation changes one parameter slightly so nothing can be hoisted out of the loop, and
+ * accumulates the result so nothing can be thrown away.
+ */
+struct Result {
+    double ns, allocs, sum;
+};
+
+template<typename F>
+Result Bench(const size_t nEvals, const F &f) {
+    double sum = f(0); // Warm up
+    const uint64_t startAllocs = QI::Allocations();
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nEvals; i++) {
+        sum += f(i);
+    }
+    const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    const double allocs = QI::AllocationsCounted() ? static_cast<double>(QI::Allocations() - startAllocs) / nEvals
+                                                   : std::numeric_limits<double>::quiet_NaN();
+    return {elapsed / nEvals, allocs, sum};
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Times the signal equations and models for typical protocol sizes.\nhttp://github.com/spinicist/QUIT");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> evals(parser, "EVALS", "Evaluations per benchmark (default 100000)", {'n', "evals"}, 100000);
+    args::Flag     tsv(parser, "TSV", "Print tab-separated values without a header, for tracking over time", {"tsv"});
+    QI::ParseArgs(parser, argc, argv, verbose);
+    const size_t n = evals.Get();
+    const double d = 1e-9; // Per-evaluation parameter change
+
+    // Based on the protocol in the mcDESPOT tests
+    Eigen::ArrayXd spgrFA(8); spgrFA << 3, 4, 5, 6, 7, 9, 13, 18;
+    spgrFA *= M_PI / 180.;
+    Eigen::ArrayXd ssfpFA(16); ssfpFA << 12, 16, 21, 27, 33, 40, 51, 68, 12, 16, 21, 27, 33, 40, 51, 68;
+    ssfpFA *= M_PI / 180.;
+    Eigen::ArrayXd ssfpPhase(16); ssfpPhase << 180, 180, 180, 180, 180, 180, 180, 180, 0, 0, 0, 0, 0, 0, 0, 0;
+    ssfpPhase *= M_PI / 180.;
+    const QI::PhaseTable phi(ssfpPhase);
+    const double spgrTR = 0.0065, ssfpTR = 0.005;
+    Eigen::ArrayXd satFA = Eigen::ArrayXd::LinSpaced(10, 200, 1000) * M_PI / 180.;
+    Eigen::ArrayXd satf0 = Eigen::ArrayXd::LinSpaced(10, 1000, 20000);
+    const QI::TLineshape gauss = QI::GaussianLineshape();
+
+    auto spgr = std::make_shared<QI::SPGRSequence>();
+    spgr->TR = spgrTR; spgr->FA = spgrFA;
+    auto ssfp = std::make_shared<QI::SSFPSequence>();
+    ssfp->TR = ssfpTR; ssfp->FA = ssfpFA; ssfp->PhaseInc = ssfpPhase; ssfp->PhaseTrig = phi;
+    QI::SequenceGroup group;
+    group.addSequence(spgr);
+    group.addSequence(ssfp);
+    std::shared_ptr<QI::Model> mcd3 = std::make_shared<QI::MCD3>();
+    Eigen::VectorXd p3(12); p3 << 1.0, 0.465, 0.026, 1.070, 0.117, 4.0, 2.5, 0.18, 0.15, 0.05, 10., 1.0;
+    Eigen::ArrayXd groupMag(group.size());
+    const std::shared_ptr<const QI::FixedSignal> fixed3 = QI::MakeFixedSignal(mcd3, group);
+
+    const std::vector<std::pair<std::string, std::function<Result ()>>> benches{
+        {"One_SPGR",    [&]{ return Bench(n, [&](size_t i){ return QI::One_SPGR(spgrFA, spgrTR, 1., 1. + d*i, 1.).real().sum(); }); }},
+        {"One_SSFP",    [&]{ return Bench(n, [&](size_t i){ return QI::One_SSFP(ssfpFA, phi, ssfpTR, 1., 1. + d*i, 0.08, 10., 1.).real().sum(); }); }},
+        {"Two_SSFP",    [&]{ return Bench(n, [&](size_t i){ return QI::Two_SSFP(ssfpFA, phi, ssfpTR, 1., 0.465, 0.026, 1.070, 0.117, 0.18 + d*i, 0.15, 10., 10., 1.).real().sum(); }); }},
+        {"Three_SSFP",  [&]{ return Bench(n, [&](size_t i){ return QI::Three_SSFP(ssfpFA, phi, ssfpTR, 1., 0.465, 0.026, 1.070, 0.117, 4.0, 2.5, 0.18 + d*i, 0.15, 0.05, 10., 10., 10., 1.).real().sum(); }); }},
+        {"One_MPRAGE",  [&]{ return Bench(n, [&](size_t i){ return QI::One_MPRAGE(5.*M_PI/180., 0.008, 64, 32, 0.45, 1.2, 1., 1. + d*i, 1., 1.).real()[0]; }); }},
+        {"MT_SPGR",     [&]{ return Bench(n, [&](size_t i){ return QI::MT_SPGR(satFA, satf0, 0.03, 0.01, gauss, 1., 1.0, 0.05, 1.0, 12e-6 + 1e-15*i, 4.0, 0.15, 0., 1.).real().sum(); }); }},
+        {"Group signal (3C)", [&]{ return Bench(n, [&](size_t i){ p3[7] = 0.18 + d*i; return group.signal(mcd3, p3).real().sum(); }); }},
+        {"Group magnitude_into (3C)", [&]{ return Bench(n, [&](size_t i){ p3[7] = 0.18 + d*i; group.signal_magnitude_into(mcd3, p3, groupMag); return groupMag.sum(); }); }},
+        {"Fixed magnitude_into (3C)", [&]{ return Bench(n, [&](size_t i){ p3[7] = 0.18 + d*i; fixed3->magnitude_into(p3, groupMag); return groupMag.sum(); }); }}
+    };
+
+    if (!tsv) {
+        std::cout << std::left << std::setw(28) << "Benchmark" << std::right << std::setw(14) << "ns/eval" << std::setw(14) << "allocs/eval" << std::endl;
+    }
+    for (const auto &b : benches) {
+        const Result r = b.second();
+        if (verbose) std::cout << "Checksum for " << b.first << ": " << r.sum << std::endl;
+        if (tsv) {
+            std::cout << b.first << "\t" << r.ns << "\t" << r.allocs << std::endl;
+        } else {
+            std::cout << std::left << std::setw(28) << b.first << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(14) << r.ns << std::setw(14) << r.allocs << std::endl;
+        }
+    }
+    return EXIT_SUCCESS;
+}
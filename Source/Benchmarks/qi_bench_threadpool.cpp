@@ -0,0 +1,133 @@
+/*
+ *  qi_bench_threadpool.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <atomic>
+#include <queue>
+
+#include "ThreadPool.h"
+#include "Args.h"
+
+/*
+ * The previous QI::ThreadPool, a std::queue of std::function behind one mutex, kept here
+ * as the baseline to compare the lock-free queue against.
+ */
+class MutexThreadPool {
+    std::vector<std::thread> m_threads;
+    std::queue<std::function<void ()>> m_tasks;
+    std::mutex m_tasksMutex;
+    std::condition_variable m_queueCondition, m_threadCondition;
+    bool m_stopping = false;
+    size_t m_maxQueueMultiple = 1;
+
+    void invokeThread() {
+        std::function<void ()> task;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(m_tasksMutex);
+                m_threadCondition.wait(lock, [this]{ return !m_tasks.empty() || m_stopping; });
+                if (m_stopping && m_tasks.empty()) {
+                    return;
+                }
+                task = m_tasks.front();
+                m_tasks.pop();
+                m_queueCondition.notify_all();
+            }
+            task();
+        }
+    }
+
+public:
+    MutexThreadPool(const size_t nThreads) {
+        for (size_t i = 0; i < nThreads; i++) {
+            m_threads.emplace_back(std::thread(&MutexThreadPool::invokeThread, this));
+        }
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(m_tasksMutex);
+            m_stopping = true;
+        }
+        m_threadCondition.notify_all();
+        for (std::thread &t : m_threads) {
+            t.join();
+        }
+    }
+
+    void setMaxQueueMultiple(const int n) { m_maxQueueMultiple = n; }
+
+    void enqueue(std::function<void ()> f) {
+        {
+            std::unique_lock<std::mutex> lock(m_tasksMutex);
+            m_queueCondition.wait(lock, [this]{ return m_tasks.size() < m_maxQueueMultiple * m_threads.size(); });
+            m_tasks.push(f);
+        }
+        m_threadCondition.notify_one();
+    }
+};
+
+/*
+ * Enqueue nTasks tasks that each spin for taskWork iterations, and return tasks per second.
+ * The time includes starting and joining the pool.
+ */
+template<typename TPool>
+double Bench(const size_t nThreads, const size_t nTasks, const size_t taskWork, const int queueMultiple) {
+    std::atomic<size_t> done{0};
+    const auto start = std::chrono::steady_clock::now();
+    {
+        TPool pool(nThreads);
+        pool.setMaxQueueMultiple(queueMultiple);
+        for (size_t i = 0; i < nTasks; i++) {
+            pool.enqueue([&done, taskWork] {
+                volatile size_t x = 0;
+                for (size_t w = 0; w < taskWork; w++) {
+                    x += w;
+                }
+                done++;
+            });
+        }
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (done != nTasks) {
+        QI_FAIL("Only " << done << " of " << nTasks << " tasks completed");
+    }
+    return nTasks / elapsed;
+}
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Compares task throughput of QI::ThreadPool against a mutex-based queue.\nhttp://github.com/spinicist/QUIT");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Maximum number of threads (default=hardware limit)", {'T', "threads"}, 0);
+    args::ValueFlag<int> tasks(parser, "TASKS", "Number of tasks per run (default 1000000)", {'n', "tasks"}, 1000000);
+    args::ValueFlag<int> work(parser, "WORK", "Iterations of busy work per task (default 100)", {'w', "work"}, 100);
+    args::ValueFlag<int> multiple(parser, "MULTIPLE", "Queue limit as a multiple of the thread count (default 4)", {'q', "queue"}, 4);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    const size_t maxThreads = threads.Get() > 0 ? threads.Get() : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> counts;
+    for (size_t n = 1; n < maxThreads; n *= 2) {
+        counts.push_back(n);
+    }
+    counts.push_back(maxThreads);
+    std::cout << std::setw(8) << "Threads" << std::setw(20) << "Mutex tasks/s" << std::setw(20) << "Lock-free tasks/s" << std::setw(10) << "Speedup" << std::endl;
+    for (const size_t n : counts) {
+        const double mutexRate = Bench<MutexThreadPool>(n, tasks.Get(), work.Get(), multiple.Get());
+        const double lockFreeRate = Bench<QI::ThreadPool>(n, tasks.Get(), work.Get(), multiple.Get());
+        std::cout << std::setw(8) << n << std::setw(20) << static_cast<size_t>(mutexRate)
+                  << std::setw(20) << static_cast<size_t>(lockFreeRate)
+                  << std::setw(10) << std::setprecision(3) << (lockFreeRate / mutexRate) << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
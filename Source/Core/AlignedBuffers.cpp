@@ -0,0 +1,157 @@
+/*
+ *  AlignedBuffers.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdlib>
+#include <complex>
+#include <mutex>
+#include <algorithm>
+#include <typeinfo>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "itkImportImageContainer.h"
+#include "itkObjectFactoryBase.h"
+#include "itkVersion.h"
+#include "itkMacro.h"
+
+#include "AlignedBuffers.h"
+
+namespace QI {
+
+void *AlignedAllocate(const size_t bytes) {
+    const bool huge = bytes >= HugePageSize;
+    void *p = nullptr;
+    if (posix_memalign(&p, huge ? HugePageSize : CacheLineSize, std::max<size_t>(bytes, 1)) != 0) {
+        return nullptr;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (huge) {
+        // Only whole huge pages, the tail may share a page with other blocks. Failure is harmless.
+        madvise(p, bytes - (bytes % HugePageSize), MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+}
+
+void AlignedFree(void *p) {
+    std::free(p);
+}
+
+namespace {
+
+/*
+ * ITK allocates pixel containers with new[] and frees them with delete[], so both are replaced.
+ * A container can also be handed a buffer from elsewhere with SetImportPointer, which must still be
+ * freed the ITK way, so the container remembers which of its buffers it allocated. Reserve() makes
+ * the new buffer before freeing the old one, hence two.
+ */
+template<typename TElement>
+class AlignedImportImageContainer : public itk::ImportImageContainer<itk::SizeValueType, TElement> {
+public:
+    typedef AlignedImportImageContainer Self;
+    typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+    typedef typename Superclass::ElementIdentifier ElementIdentifier;
+
+    itkFactorylessNewMacro(Self);
+    itkTypeMacro(AlignedImportImageContainer, ImportImageContainer);
+
+protected:
+    AlignedImportImageContainer() {}
+    ~AlignedImportImageContainer() {
+        // The base destructor would only reach its own version of this
+        this->DeallocateManagedMemory();
+    }
+
+    TElement *AllocateElements(ElementIdentifier size, bool UseDefaultConstructor = false) const ITK_OVERRIDE {
+        TElement *data = static_cast<TElement *>(AlignedAllocate(size * sizeof(TElement)));
+        if (!data) {
+            throw itk::MemoryAllocationError(__FILE__, __LINE__, "Failed to allocate memory for image.", ITK_LOCATION);
+        }
+        if (UseDefaultConstructor) {
+            std::fill(data, data + size, TElement());
+        }
+        if (m_pending) m_allocated = m_pending;
+        m_pending = data;
+        return data;
+    }
+
+    void DeallocateManagedMemory() ITK_OVERRIDE {
+        TElement *p = this->GetImportPointer();
+        if (p && (p == m_allocated || p == m_pending)) {
+            // Let the base class forget the buffer without deleting it
+            const bool manage = this->GetContainerManageMemory();
+            this->SetContainerManageMemory(false);
+            Superclass::DeallocateManagedMemory();
+            this->SetContainerManageMemory(manage);
+            AlignedFree(p);
+            if (p == m_pending) m_pending = nullptr;
+        } else {
+            Superclass::DeallocateManagedMemory();
+        }
+        if (m_pending) {
+            m_allocated = m_pending; // About to be adopted by Reserve()
+            m_pending = nullptr;
+        } else {
+            m_allocated = nullptr;
+        }
+    }
+
+private:
+    mutable TElement *m_allocated = nullptr, *m_pending = nullptr;
+};
+
+class AlignedBufferFactory : public itk::ObjectFactoryBase {
+public:
+    typedef AlignedBufferFactory Self;
+    typedef itk::ObjectFactoryBase Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    typedef itk::SmartPointer<const Self> ConstPointer;
+
+    itkFactorylessNewMacro(Self);
+    itkTypeMacro(AlignedBufferFactory, ObjectFactoryBase);
+
+    const char *GetITKSourceVersion() const ITK_OVERRIDE { return ITK_SOURCE_VERSION; }
+    const char *GetDescription() const ITK_OVERRIDE { return "Cache-line and huge-page aligned image buffers"; }
+
+protected:
+    AlignedBufferFactory() {
+        Override<float>();
+        Override<double>();
+        Override<std::complex<float>>();
+        Override<std::complex<double>>();
+        Override<char>();
+        Override<unsigned char>();
+        Override<short>();
+        Override<unsigned short>();
+        Override<int>();
+        Override<unsigned int>();
+    }
+
+    template<typename TElement>
+    void Override() {
+        this->RegisterOverride(typeid(itk::ImportImageContainer<itk::SizeValueType, TElement>).name(),
+                               typeid(AlignedImportImageContainer<TElement>).name(),
+                               "Aligned image buffer", true,
+                               itk::CreateObjectFunction<AlignedImportImageContainer<TElement>>::New());
+    }
+};
+
+} // End anonymous namespace
+
+void UseAlignedBuffers() {
+    static std::once_flag once;
+    std::call_once(once, [] { itk::ObjectFactoryBase::RegisterFactory(AlignedBufferFactory::New()); });
+}
+
+} // End namespace QI
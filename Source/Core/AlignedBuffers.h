@@ -0,0 +1,41 @@
+/*
+ *  AlignedBuffers.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ALIGNEDBUFFERS_H
+#define QI_ALIGNEDBUFFERS_H
+
+#include <cstddef>
+
+namespace QI {
+
+const size_t CacheLineSize = 64;
+const size_t HugePageSize = size_t(2) << 20;
+
+/*
+ * Memory for large arrays. Every block starts on a cache line, so vectorised loops over it do not
+ * split loads, and blocks of a huge page or more start on a huge page and (on Linux) are advised
+ * to the kernel for transparent huge pages, which cuts TLB misses on multi-GB images. Blocks must
+ * be released with AlignedFree. Returns null if the memory is not available.
+ */
+void *AlignedAllocate(const size_t bytes);
+void AlignedFree(void *p);
+
+/*
+ * Registers an ITK object factory so the pixel containers of every image made from then on, by
+ * readers, filters (including ApplyAlgorithmFilter outputs) or New() + Allocate(), come from
+ * AlignedAllocate. Covers the scalar and complex pixel types QUIT uses, for both Image and
+ * VectorImage. Called by ParseArgs, and safe to call more than once.
+ */
+void UseAlignedBuffers();
+
+} // End namespace QI
+
+#endif // QI_ALIGNEDBUFFERS_H
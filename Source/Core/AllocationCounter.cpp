@@ -0,0 +1,51 @@
+/*
+ *  AllocationCounter.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Count every allocation by wrapping malloc (which operator new and Eigen both call). This replaces
+ * malloc for the whole process, so it is not part of qi_core. It is built as libqi_alloc_count to
+ * be preloaded into a program with LD_PRELOAD, and the benchmarks compile it in. QI::Allocations()
+ * finds qi_thread_allocations() through a weak reference either way.
+ *
+ * The counter uses initial-exec TLS, because the general model can itself call malloc. free() and
+ * the aligned allocators are left alone, glibc's free works on memory from __libc_malloc.
+ */
+#if defined(__GLIBC__)
+namespace {
+__thread uint64_t allocations __attribute__((tls_model("initial-exec"))) = 0;
+}
+
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+
+void *malloc(size_t n) throw() {
+    allocations++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) throw() {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) throw() {
+    allocations++;
+    return __libc_realloc(p, n);
+}
+
+uint64_t qi_thread_allocations() { return allocations; }
+}
+#endif
@@ -0,0 +1,81 @@
+/*
+ *  Arena.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <new>
+#include <algorithm>
+
+#include "Arena.h"
+#include "AlignedBuffers.h"
+
+namespace QI {
+
+Arena &Arena::Local() {
+    static thread_local Arena arena;
+    return arena;
+}
+
+Arena::~Arena() {
+    for (const Block &b : m_blocks) {
+        AlignedFree(b.data);
+    }
+}
+
+void *Arena::allocate(const size_t bytes) {
+    const size_t rounded = ((bytes + CacheLineSize - 1) / CacheLineSize) * CacheLineSize;
+    // Blocks after the current one are free, skip any that are too small
+    while (m_block < m_blocks.size() && m_offset + rounded > m_blocks[m_block].size) {
+        m_block++;
+        m_offset = 0;
+    }
+    if (m_block == m_blocks.size()) {
+        const size_t size = std::max(rounded, m_blocks.empty() ? FirstBlock : 2 * m_blocks.back().size);
+        void *data = AlignedAllocate(size);
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        m_blocks.push_back({static_cast<char *>(data), size});
+        m_offset = 0;
+    }
+    void *p = m_blocks[m_block].data + m_offset;
+    m_offset += rounded;
+    return p;
+}
+
+Arena::Mark Arena::mark() const {
+    return {m_block, m_offset};
+}
+
+void Arena::rewind(const Mark &m) {
+    m_block = m.block;
+    m_offset = m.offset;
+    if (m_block == 0 && m_offset == 0 && m_blocks.size() > 1) {
+        size_t total = 0;
+        for (const Block &b : m_blocks) {
+            total += b.size;
+            AlignedFree(b.data);
+        }
+        m_blocks.clear();
+        void *data = AlignedAllocate(total);
+        if (data) {
+            m_blocks.push_back({static_cast<char *>(data), total});
+        }
+    }
+}
+
+size_t Arena::capacity() const {
+    size_t total = 0;
+    for (const Block &b : m_blocks) {
+        total += b.size;
+    }
+    return total;
+}
+
+} // End namespace QI
@@ -0,0 +1,81 @@
+/*
+ *  Arena.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ARENA_H
+#define QI_ARENA_H
+
+#include <vector>
+#include <cstddef>
+#include <Eigen/Core>
+
+namespace QI {
+
+/*
+ * Scratch memory for the temporaries of signal equations and models, one per thread. Allocating
+ * only bumps an offset into the current block, and a QI::ArenaScope gives back everything
+ * allocated since it was opened. When the outermost scope closes, any extra blocks are merged
+ * into one of their total size, so after the first few voxels a fit does not call the system
+ * allocator for its scratch at all. Nothing allocated here may outlive its scope.
+ */
+class Arena {
+public:
+    static Arena &Local(); // The calling thread's
+
+    void *allocate(const size_t bytes); // Starts on a cache line
+
+    template<typename T>
+    Eigen::Map<Eigen::Array<T, Eigen::Dynamic, 1>, Eigen::AlignedMax> array(const Eigen::Index n) {
+        return Eigen::Map<Eigen::Array<T, Eigen::Dynamic, 1>, Eigen::AlignedMax>(static_cast<T *>(allocate(n * sizeof(T))), n);
+    }
+
+    struct Mark {
+        size_t block, offset;
+    };
+    Mark mark() const;
+    void rewind(const Mark &m);
+    size_t capacity() const; // Bytes in all blocks
+
+    Arena() = default;
+    ~Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+protected:
+    struct Block {
+        char *data;
+        size_t size;
+    };
+    std::vector<Block> m_blocks;
+    size_t m_block = 0, m_offset = 0;
+
+    static const size_t FirstBlock = 64 * 1024;
+};
+
+/*
+ * Everything the thread allocates from its arena while this exists is released when it ends.
+ * ApplyAlgorithmFilter opens one around each voxel, and kernels that use the arena open their own
+ * so they are also safe to call outside a fit.
+ */
+class ArenaScope {
+public:
+    ArenaScope() : m_arena(Arena::Local()), m_mark(m_arena.mark()) {}
+    ~ArenaScope() { m_arena.rewind(m_mark); }
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+protected:
+    Arena &m_arena;
+    const Arena::Mark m_mark;
+};
+
+} // End namespace QI
+
+#endif // QI_ARENA_H
@@ -12,19 +12,30 @@
 #ifndef QI_ARGS_H
 #define QI_ARGS_H
 
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
 #include "args.hxx"
 #include "Macro.h"
 #include "ImageTypes.h"
 #include "Util.h"
+#include "ResultCache.h"
+#include "AlignedBuffers.h"
+#include "Trace.h"
+#include "SharedQueue.h"
 
 namespace QI {
 
 void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::Flag &verbose) {
+    QI::UseAlignedBuffers(); // Before any image is read
     try {
         parser.ParseCLI(argc, argv);
+        QI::CheckCache(argc, argv, verbose);
         if (verbose) std::cout << "Starting " << argv[0] << " " << QI::GetVersion() << std::endl;
     } catch (args::Help) {
         std::cout << parser;
+        if (QI::ThrowOnExit()) throw QI::ExitRequest{EXIT_SUCCESS};
         exit(EXIT_SUCCESS);
     } catch (args::ParseError e) {
         QI_FAIL(e.what() << std::endl << parser);
@@ -93,6 +104,194 @@ TRegion RegionArg(const std::string &a) {
     return r;
 }
 
+/*
+ * --subregion and --voxel for programs built on ApplyAlgorithmFilter. Both only fit the voxels in a
+ * box, for --voxel a box of one voxel whose data, fit and solver progress are printed instead of
+ * writing any maps. Pass region() to QI::ReadImage or QI::ReadVectorImage to read only the box, it
+ * is empty without either option, so whole images are read.
+ */
+class SubregionArgs {
+public:
+    args::ValueFlag<std::string> subregion;
+    args::ValueFlag<std::string> voxel;
+
+    SubregionArgs(args::Group &group) :
+        subregion(group, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"}),
+        voxel(group, "I,J,K", "Only fit voxel I,J,K and print its data, fit and the solver's progress instead of writing maps", {"voxel"})
+    {}
+
+    bool requested() { return subregion || voxel; }
+    bool inspecting() { return voxel; }
+
+    QI::VolumeF::RegionType region() {
+        QI::VolumeF::RegionType r;
+        if (subregion && voxel) {
+            QI_FAIL("--subregion and --voxel cannot be used together");
+        } else if (subregion) {
+            r = RegionArg(subregion.Get());
+        } else if (voxel) {
+            std::istringstream iss(voxel.Get());
+            QI::VolumeF::IndexType index;
+            char sep = ',';
+            for (int i = 0; i < 3; i++) {
+                if ((i > 0 && !(iss >> sep)) || sep != ',' || !(iss >> index[i])) {
+                    QI_FAIL("Could not read voxel I,J,K from string: " << voxel.Get());
+                }
+            }
+            r.SetIndex(index);
+            r.SetSize({{1, 1, 1}});
+        }
+        return r;
+    }
+
+    template<typename TApply>
+    void Apply(TApply &apply) {
+        if (!requested()) {
+            return;
+        }
+        apply->SetSubregion(region());
+        if (voxel) {
+            apply->SetInspect(true);
+            QI::SetSolverTrace(true);
+        }
+    }
+};
+
+/*
+ * Options shared by programs built on ApplyAlgorithmFilter for checkpointing and for splitting one
+ * fit into shards of I/N (counted from 0), e.g. one per task of a cluster array job. Shards only
+ * write their results to a compact checkpoint file. Merge them with qi_merge_shards, then re-run the
+ * program with --checkpoint=MERGED --resume to write the full maps. --queue=DIR instead lets any number
+ * of jobs take chunks of the voxels as they are ready, each saving them to its own checkpoint file,
+ * for fits whose time per voxel varies too much for equal shards. --stats, --preview, --failures and
+ * --screen also live here as every program that takes these options is built on ApplyAlgorithmFilter.
+ */
+class CheckpointArgs {
+public:
+    args::ValueFlag<std::string> checkpoint;
+    args::Flag resume;
+    args::ValueFlag<std::string> shard;
+    args::ValueFlag<std::string> queue;
+    args::ValueFlag<std::string> stats;
+    args::ValueFlag<int> preview;
+    args::Flag failures;
+    args::ValueFlag<double> screen;
+    args::ValueFlag<double> noise;
+
+    CheckpointArgs(args::Group &group) :
+        checkpoint(group, "CHECKPOINT", "Periodically save fitted voxels to this file", {"checkpoint"}),
+        resume(group, "RESUME", "Skip voxels already fitted in the checkpoint file", {"resume"}),
+        shard(group, "SHARD", "Only fit shard I of N (I=0..N-1) of the voxels and save them to a checkpoint file", {"shard"}),
+        queue(group, "DIR", "Fit chunks of the voxels from a queue in this directory shared with other jobs and save them to a checkpoint file", {"queue"}),
+        stats(group, "STATS", "Write voxels, model evaluations, allocations and hardware counters per thread to this JSON file", {"stats"}),
+        preview(group, "N", "Only fit every N'th voxel along each axis, fill in the maps from them and estimate the full time", {"preview"}, 1),
+        failures(group, "FAILURES", "Write a map of the voxels the fit failed for, 1 for the voxel, 2 for its batch or 3 screened out", {"failures"}),
+        screen(group, "SNR", "Skip voxels with no input value above SNR times the noise level", {"screen"}),
+        noise(group, "SIGMA", "Noise level for --screen, default estimated from outside the mask", {"noise"})
+    {}
+
+    bool sharded() { return shard || queue; }
+
+    template<typename TApply>
+    void Apply(TApply &apply, const std::string &prefix) {
+        if (shard && queue) {
+            QI_FAIL("--shard and --queue cannot be used together");
+        }
+        if (shard) {
+            std::istringstream iss(shard.Get());
+            size_t index, count;
+            char sep;
+            if (!(iss >> index >> sep >> count) || sep != '/' || count == 0 || index >= count) {
+                QI_FAIL("Could not read shard I/N from string: " << shard.Get());
+            }
+            apply->SetShard(index, count);
+            apply->SetCheckpoint(checkpoint ? checkpoint.Get() :
+                                 prefix + "shard" + std::to_string(index) + "of" + std::to_string(count) + ".qik");
+        } else if (queue) {
+            apply->SetQueue(queue.Get());
+            apply->SetCheckpoint(checkpoint ? checkpoint.Get() :
+                                 prefix + "queue-" + QI::SharedQueue::ProcessName() + ".qik");
+        } else if (checkpoint) {
+            apply->SetCheckpoint(checkpoint.Get());
+        }
+        apply->SetResume(resume);
+        if (stats) {
+            apply->SetStats(stats.Get());
+        }
+        if (preview.Get() < 1) {
+            QI_FAIL("--preview must be at least 1");
+        }
+        apply->SetPreview(preview.Get());
+        apply->SetOutputFailures(failures);
+        if (noise && !screen) {
+            QI_FAIL("--noise needs --screen");
+        }
+        if (screen) {
+            if (screen.Get() <= 0 || (noise && noise.Get() <= 0)) {
+                QI_FAIL("--screen and --noise must be positive");
+            }
+            apply->SetScreen(screen.Get(), noise ? noise.Get() : 0);
+        }
+    }
+};
+
+/*
+ * Memory limit for programs built on ApplyAlgorithmFilter, e.g. on nodes shared between jobs. Sizes
+ * are a number with an optional K, M, G or T suffix, plain numbers are MB. --mem-limit defaults to
+ * $QUIT_MEM_LIMIT, without either there is no limit. Slabs() estimates the footprint from the
+ * filter's bytes per voxel and returns how many slabs along the last axis keep each one inside the
+ * limit, so programs that stream can pick their slab count and the rest can refuse to start.
+ */
+class MemoryArgs {
+public:
+    args::ValueFlag<std::string> limit;
+
+    MemoryArgs(args::Group &group) :
+        limit(group, "SIZE", "Keep the fit inside this much memory (e.g. 8G, plain numbers are MB), default $QUIT_MEM_LIMIT", {"mem-limit"})
+    {}
+
+    size_t bytes() {
+        const char *env = std::getenv("QUIT_MEM_LIMIT");
+        const std::string text = limit ? limit.Get() : (env ? env : "");
+        if (text.empty()) {
+            return 0;
+        }
+        std::istringstream iss(text);
+        double size;
+        std::string suffix;
+        if (!(iss >> size) || size <= 0) {
+            QI_FAIL("Could not read a memory size from string: " << text);
+        }
+        iss >> suffix;
+        const std::string units = "KMGT";
+        const size_t power = suffix.empty() ? 2 : units.find(std::toupper(suffix[0])) + 1;
+        if (power == 0 || suffix.size() > 2 || (suffix.size() == 2 && std::toupper(suffix[1]) != 'B')) {
+            QI_FAIL("Unknown memory size suffix in: " << text);
+        }
+        return static_cast<size_t>(size * std::pow(1024.0, power));
+    }
+
+    /* Slabs needed to fit in the limit, at least requested (0 for whole-volume), or 0 with no limit */
+    template<typename TApply>
+    size_t Slabs(TApply &apply, const size_t requested, const bool verbose, const size_t extraPerVoxel = 0) {
+        const size_t limitBytes = bytes();
+        if (limitBytes == 0) {
+            return requested;
+        }
+        apply->UpdateOutputInformation();
+        const auto region = apply->GetOutput(0)->GetLargestPossibleRegion();
+        const size_t planes = region.GetSize()[region.GetImageDimension() - 1];
+        const double total = static_cast<double>(region.GetNumberOfPixels()) * (apply->GetBytesPerVoxel() + extraPerVoxel);
+        const size_t needed = static_cast<size_t>(std::ceil(total / limitBytes));
+        if (verbose) std::cout << "Estimated memory " << (total / (1024 * 1024)) << " MB, limit " << (limitBytes / (1024 * 1024)) << " MB" << std::endl;
+        if (needed > planes) {
+            QI_FAIL("Estimated memory use of " << (total / (1024 * 1024)) << " MB does not fit in the limit of "
+                    << (limitBytes / (1024 * 1024)) << " MB even one plane at a time");
+        }
+        return std::max(requested, needed > 1 ? needed : size_t(0));
+    }
+};
+
 } // End namespace QI
 
 #endif // QI_ARGS_H
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+ *  CPU.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <ostream>
+#include "CPU.h"
+
+namespace QI {
+
+std::string CPUPath() {
+#ifdef QI_MULTIVERSION_CLONES
+    // The same order as the clones, so the same choice as their resolvers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("x86-64-v4")) return "x86-64-v4 (AVX-512)";
+    if (__builtin_cpu_supports("x86-64-v3")) return "x86-64-v3 (AVX2, FMA)";
+    if (__builtin_cpu_supports("x86-64-v2")) return "x86-64-v2 (SSE4.2)";
+    return "baseline";
+#else
+    return "baseline (built without multiversioning)";
+#endif
+}
+
+void CPUReport(std::ostream &os) {
+    os << "Kernel path: " << CPUPath() << "\n";
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    os << "CPU:        ";
+    // __builtin_cpu_supports only takes literals
+#define QI_CPU_FEATURE(f) if (__builtin_cpu_supports(f)) os << " " f
+    QI_CPU_FEATURE("sse4.2"); QI_CPU_FEATURE("avx"); QI_CPU_FEATURE("avx2"); QI_CPU_FEATURE("fma");
+    QI_CPU_FEATURE("avx512f"); QI_CPU_FEATURE("avx512vl"); QI_CPU_FEATURE("avx512bw"); QI_CPU_FEATURE("avx512dq");
+#undef QI_CPU_FEATURE
+    os << "\n";
+#endif
+    os << "Built for:  ";
+#if defined(__AVX512F__)
+    os << " avx512f";
+#elif defined(__AVX2__)
+    os << " avx2";
+#elif defined(__AVX__)
+    os << " avx";
+#elif defined(__SSE4_2__)
+    os << " sse4.2";
+#elif defined(__SSE2__)
+    os << " sse2";
+#else
+    os << " generic";
+#endif
+    os << " (Eigen and everything not multiversioned)" << std::endl;
+}
+
+} // End namespace QI
@@ -0,0 +1,39 @@
+/*
+ *  CPU.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_CPU_H
+#define QI_CPU_H
+
+#include <string>
+#include <iosfwd>
+
+/*
+ * The package is built for the baseline x86-64 instruction set, so it runs on every node. Hot
+ * kernels marked QI_MULTIVERSION are also compiled for the x86-64-v2 (SSE4.2), v3 (AVX2 and FMA,
+ * Haswell and Zen) and v4 (AVX-512, Skylake-X) levels, and the loader picks the best one the CPU
+ * supports the first time they are called. The kernels must be free, non-virtual functions, and
+ * only plain loops in them are widened; Eigen chooses its own SIMD width when it is compiled.
+ * QUIT_MULTIVERSION=OFF, or a compiler without target_clones, leaves the baseline only.
+ */
+#ifdef QI_MULTIVERSION_CLONES
+#define QI_MULTIVERSION __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#else
+#define QI_MULTIVERSION
+#endif
+
+namespace QI {
+
+std::string CPUPath();           // The clone of the QI_MULTIVERSION kernels used on this CPU
+void CPUReport(std::ostream &os); // The path, the CPU's features and the baseline it was built for
+
+} // End namespace QI
+
+#endif // QI_CPU_H
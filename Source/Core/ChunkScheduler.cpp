@@ -0,0 +1,104 @@
+/*
+ * ChunkScheduler.cpp
+ *
+ * Copyright (c) 2018 Tobias Wood
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include "ChunkScheduler.h"
+#include "Macro.h"
+
+namespace QI {
+
+ChunkScheduler::ChunkScheduler(const size_t total, const size_t nWorkers, const size_t minChunk, const size_t divisor) :
+    m_total(total), m_minChunk(std::max<size_t>(minChunk, 1)), m_divisor(std::max<size_t>(divisor, 1))
+{
+    if (nWorkers < 1) {
+        QI_EXCEPTION("Cannot construct a chunk scheduler with 0 workers");
+    }
+    const size_t share = total / nWorkers;
+    const size_t extra = total % nWorkers;
+    size_t start = 0;
+    for (size_t w = 0; w < nWorkers; w++) {
+        m_shares.emplace_back(new Share);
+        m_shares.back()->begin = start;
+        start += share + (w < extra ? 1 : 0);
+        m_shares.back()->end = start;
+    }
+}
+
+size_t ChunkScheduler::workers() const { return m_shares.size(); }
+
+void ChunkScheduler::initialShare(const size_t worker, size_t &begin, size_t &end) const {
+    // Same split as the constructor
+    const size_t nWorkers = m_shares.size();
+    const size_t share = m_total / nWorkers;
+    const size_t extra = m_total % nWorkers;
+    begin = worker * share + std::min(worker, extra);
+    end = begin + share + (worker < extra ? 1 : 0);
+}
+
+bool ChunkScheduler::next(const size_t worker, size_t &begin, size_t &end) {
+    while (true) {
+        { // Lock will exist in this scope
+            Share &s = *m_shares.at(worker);
+            std::unique_lock<std::mutex> lock(s.mutex);
+            const size_t remaining = s.end - s.begin;
+            if (remaining > 0) {
+                const size_t chunk = std::min(remaining, std::max(m_minChunk, remaining / m_divisor));
+                begin = s.begin;
+                end = s.begin + chunk;
+                s.begin = end;
+                return true;
+            }
+        }
+        if (!steal(worker)) {
+            return false;
+        }
+    }
+}
+
+bool ChunkScheduler::steal(const size_t worker) {
+    // Find the victim with the most work left. It may have changed by the time it
+    // is locked again for the steal, so re-check it then.
+    while (true) {
+        size_t victim = worker, most = 0;
+        for (size_t w = 0; w < m_shares.size(); w++) {
+            if (w == worker) continue;
+            std::unique_lock<std::mutex> lock(m_shares[w]->mutex);
+            const size_t remaining = m_shares[w]->end - m_shares[w]->begin;
+            if (remaining > most) {
+                most = remaining;
+                victim = w;
+            }
+        }
+        if (victim == worker) {
+            return false; // Nothing left anywhere
+        }
+        size_t stolen_begin, stolen_end;
+        {
+            std::unique_lock<std::mutex> lock(m_shares[victim]->mutex);
+            Share &v = *m_shares[victim];
+            const size_t remaining = v.end - v.begin;
+            if (remaining == 0) {
+                continue; // Beaten to it, try again
+            }
+            const size_t take = std::max<size_t>(remaining / 2, 1);
+            stolen_end = v.end;
+            stolen_begin = v.end - take;
+            v.end = stolen_begin;
+        }
+        Share &s = *m_shares[worker];
+        std::unique_lock<std::mutex> lock(s.mutex);
+        s.begin = stolen_begin;
+        s.end = stolen_end;
+        return true;
+    }
+}
+
+} // End namespace QI
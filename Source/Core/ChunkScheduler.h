@@ -0,0 +1,49 @@
+/*
+ * ChunkScheduler.h
+ *
+ * Copyright (c) 2018 Tobias Wood
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_CHUNK_SCHEDULER_H
+#define QI_CHUNK_SCHEDULER_H
+
+#include <mutex>
+#include <memory>
+#include <vector>
+
+namespace QI {
+
+/*
+ * Hands out chunks of the index range [0, total) to a fixed number of workers.
+ * Each worker starts with an equal contiguous share and takes progressively
+ * smaller chunks from the front of it. When a worker's share is exhausted it
+ * steals the back half of the largest remaining share, so unbalanced work
+ * (e.g. slow fits in the centre of a mask) is spread across all workers.
+ */
+class ChunkScheduler {
+private:
+    struct Share {
+        std::mutex mutex;
+        size_t begin = 0, end = 0;
+    };
+    std::vector<std::unique_ptr<Share>> m_shares;
+    size_t m_total, m_minChunk, m_divisor;
+
+    bool steal(const size_t worker);
+
+public:
+    ChunkScheduler(const size_t total, const size_t nWorkers, const size_t minChunk = 1, const size_t divisor = 8);
+
+    size_t workers() const;
+    void initialShare(const size_t worker, size_t &begin, size_t &end) const; //!< The range a worker starts with, before any chunks are taken or stolen
+    bool next(const size_t worker, size_t &begin, size_t &end); //!< Return false when there is no work left
+};
+
+} // End namespace QI
+
+#endif // QI_CHUNK_SCHEDULER_H
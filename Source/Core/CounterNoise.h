@@ -0,0 +1,67 @@
+/*
+ *  CounterNoise.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_COUNTERNOISE_H
+#define QI_COUNTERNOISE_H
+
+#include <cstdint>
+#include <cmath>
+#include <complex>
+#include <Eigen/Core>
+
+namespace QI {
+
+/*
+ * Complex Gaussian noise from a counter-based generator. The deviates for each sample are a hash
+ * of the seed, the stream (e.g. one per sequence), the voxel and the sample number, so the noise in a
+ * voxel does not depend on which thread simulated it or in which order. The hash is the
+ * SplitMix64 finaliser.
+ */
+class CounterNoise {
+public:
+    CounterNoise(const double sigma = 0., const uint64_t seed = 0) : m_sigma(sigma), m_seed(Mix(seed)) {}
+
+    double sigma() const { return m_sigma; }
+
+    // Column i of signals is voxel first + i
+    void add(Eigen::ArrayXXcd &signals, const uint64_t first, const uint64_t stream) const {
+        const uint64_t key = Mix(m_seed + stream);
+        const uint64_t n = signals.rows();
+        for (Eigen::Index v = 0; v < signals.cols(); v++) {
+            for (Eigen::Index j = 0; j < signals.rows(); j++) {
+                const uint64_t counter = 2 * ((first + v) * n + j);
+                // Box-Muller transform
+                const double r = (m_sigma / M_SQRT2) * sqrt(-2. * log(Uniform(key, counter)));
+                const double theta = 2. * M_PI * Uniform(key, counter + 1);
+                signals(j, v) += std::complex<double>(r * cos(theta), r * sin(theta));
+            }
+        }
+    }
+
+protected:
+    double m_sigma;
+    uint64_t m_seed;
+
+    static uint64_t Mix(uint64_t z) {
+        z += 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    // In (0, 1), so the log above is always finite
+    static double Uniform(const uint64_t key, const uint64_t counter) {
+        return ((Mix(key ^ Mix(counter)) >> 11) + 0.5) / 9007199254740992.0;
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_COUNTERNOISE_H
@@ -0,0 +1,86 @@
+/*
+ *  Counters.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Counters.h"
+
+/*
+ * Allocations are only counted when AllocationCounter.cpp is in the process, preloaded or linked
+ * in, since it replaces malloc. Otherwise the weak reference is null.
+ */
+extern "C" uint64_t qi_thread_allocations() __attribute__((weak));
+
+namespace QI {
+
+namespace {
+thread_local uint64_t evaluations = 0;
+}
+
+void CountEvaluation() { evaluations++; }
+uint64_t Evaluations() { return evaluations; }
+uint64_t Allocations() { return qi_thread_allocations ? qi_thread_allocations() : 0; }
+bool AllocationsCounted() { return qi_thread_allocations != nullptr; }
+
+#ifdef __linux__
+PerfCounters::PerfCounters() {
+    const uint64_t events[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < 3; i++) {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // This thread on any CPU
+        m_fd[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+}
+
+PerfCounters::~PerfCounters() {
+    for (int i = 0; i < 3; i++) {
+        if (m_fd[i] >= 0) close(m_fd[i]);
+    }
+}
+
+bool PerfCounters::valid() const {
+    return m_fd[0] >= 0 && m_fd[1] >= 0 && m_fd[2] >= 0;
+}
+
+void PerfCounters::read(uint64_t &cycles, uint64_t &instructions, uint64_t &cacheMisses) const {
+    uint64_t *values[3] = {&cycles, &instructions, &cacheMisses};
+    for (int i = 0; i < 3; i++) {
+        *values[i] = 0;
+        if (m_fd[i] >= 0 && ::read(m_fd[i], values[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+            *values[i] = 0;
+        }
+    }
+}
+#else
+PerfCounters::PerfCounters() {
+    m_fd[0] = m_fd[1] = m_fd[2] = -1;
+}
+PerfCounters::~PerfCounters() {}
+bool PerfCounters::valid() const { return false; }
+void PerfCounters::read(uint64_t &cycles, uint64_t &instructions, uint64_t &cacheMisses) const {
+    cycles = instructions = cacheMisses = 0;
+}
+#endif
+
+} // End namespace QI
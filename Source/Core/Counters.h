@@ -0,0 +1,48 @@
+/*
+ *  Counters.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_COUNTERS_H
+#define QI_COUNTERS_H
+
+#include <cstdint>
+
+namespace QI {
+
+/*
+ * Per-thread counts for --stats. Each is a running total for the calling thread, so the work
+ * done by a task is the difference between two reads on the thread that ran it.
+ */
+void CountEvaluation();       //!< Called by each sequence's signal functions
+uint64_t Evaluations();       //!< Model evaluations made by this thread
+uint64_t Allocations();       //!< Heap allocations made by this thread, if AllocationsCounted()
+bool AllocationsCounted();    //!< Only with libqi_alloc_count preloaded (glibc only), see AllocationCounter.cpp
+
+/*
+ * Hardware counters for the calling thread from perf_event_open, on Linux only. If the kernel
+ * does not allow them (see /proc/sys/kernel/perf_event_paranoid) valid() is false.
+ */
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    bool valid() const;
+    void read(uint64_t &cycles, uint64_t &instructions, uint64_t &cacheMisses) const; //!< Counts since construction
+
+private:
+    int m_fd[3];
+};
+
+} // End namespace QI
+
+#endif // QI_COUNTERS_H
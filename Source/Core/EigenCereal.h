@@ -56,6 +56,22 @@ namespace Eigen {
         ar(v[1]);
     }
 
+    template<typename Archive, typename T, int R, cereal::traits::EnableIf<!cereal::traits::is_text_archive<Archive>::value> = cereal::traits::sfinae>
+    inline void load(Archive &ar, Array<T, R, 1> &v) {
+        cereal::size_type n_rows;
+        ar(cereal::make_size_tag(n_rows));
+        if (v.rows() != static_cast<Index>(n_rows)) {
+            v.resize(n_rows, 1);
+        }
+        ar(cereal::binary_data(v.data(), n_rows * sizeof(T)));
+    }
+
+    template<typename Archive, typename T, int R, cereal::traits::EnableIf<!cereal::traits::is_text_archive<Archive>::value> = cereal::traits::sfinae>
+    inline void save(Archive &ar, const Array<T, R, 1> &v) {
+        ar(cereal::make_size_tag(static_cast<cereal::size_type>(v.rows())));
+        ar(cereal::binary_data(v.data(), v.rows() * sizeof(T)));
+    }
+
 } // end namespace Eigen
 
 namespace QI {
@@ -0,0 +1,85 @@
+/*
+ *  FFT.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <vector>
+#include <algorithm>
+#include <unsupported/Eigen/FFT>
+
+#include "FFT.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+FFT3D::FFT3D(const std::array<size_t, 3> &size) :
+    m_size(size)
+{
+    if (count() == 0) {
+        QI_EXCEPTION("Cannot transform a volume with a zero dimension");
+    }
+}
+
+const std::array<size_t, 3> &FFT3D::size() const { return m_size; }
+size_t FFT3D::count() const { return m_size[0] * m_size[1] * m_size[2]; }
+
+void FFT3D::forward(TComplex *data, const size_t nThreads) const { transform(data, false, nThreads); }
+void FFT3D::inverse(TComplex *data, const size_t nThreads) const { transform(data, true, nThreads); }
+
+/*
+ * The FFT objects keep their plans (twiddle factors) between lines, so each task makes one and
+ * uses it for all of its lines on every axis. The lines are copied out and back because the
+ * transforms cannot run in-place.
+ */
+void FFT3D::transform(TComplex *data, const bool inverse, const size_t nThreads) const {
+    size_t stride = 1;
+    for (int a = 0; a < 3; a++) {
+        const size_t n = m_size[a];
+        if (n > 1) {
+            const size_t nLines = count() / n;
+            const size_t nTasks = std::max<size_t>(1, std::min(nThreads, nLines));
+            ThreadPool::Global().run(nTasks, [&](const size_t t) {
+                Eigen::FFT<double> fft;
+                std::vector<TComplex> in(n), out(n);
+                for (size_t l = (nLines * t) / nTasks; l < (nLines * (t + 1)) / nTasks; l++) {
+                    TComplex *line = data + (l / stride) * stride * n + (l % stride);
+                    for (size_t i = 0; i < n; i++) {
+                        in[i] = line[i * stride];
+                    }
+                    if (inverse) {
+                        fft.inv(out.data(), in.data(), n);
+                    } else {
+                        fft.fwd(out.data(), in.data(), n);
+                    }
+                    for (size_t i = 0; i < n; i++) {
+                        line[i * stride] = out[i];
+                    }
+                }
+            });
+        }
+        stride *= n;
+    }
+}
+
+size_t FFT3D::GoodSize(const size_t n) {
+    for (size_t s = std::max<size_t>(n, 1); ; s++) {
+        size_t r = s;
+        for (const size_t p : {2, 3, 5}) {
+            while (r % p == 0) {
+                r /= p;
+            }
+        }
+        if (r == 1) {
+            return s;
+        }
+    }
+}
+
+} // End namespace QI
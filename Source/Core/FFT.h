@@ -0,0 +1,48 @@
+/*
+ *  FFT.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_FFT_H
+#define QI_FFT_H
+
+#include <array>
+#include <complex>
+
+namespace QI {
+
+/*
+ * Complex-to-complex 3D FFT of a volume stored x fastest, done as 1D transforms along each axis
+ * with Eigen's FFT module. One object can transform any number of volumes of the same size, from
+ * several threads at once. nThreads > 1 shares the lines of one transform over the global pool,
+ * so must not be used from inside a task on that pool.
+ */
+class FFT3D {
+public:
+    typedef std::complex<double> TComplex;
+
+    FFT3D(const std::array<size_t, 3> &size);
+
+    const std::array<size_t, 3> &size() const;
+    size_t count() const; // Number of voxels
+
+    void forward(TComplex *data, const size_t nThreads = 1) const;
+    void inverse(TComplex *data, const size_t nThreads = 1) const; // Scaled by 1/count()
+
+    static size_t GoodSize(const size_t n); // Smallest size >= n with no prime factor above 5
+
+protected:
+    std::array<size_t, 3> m_size;
+
+    void transform(TComplex *data, const bool inverse, const size_t nThreads) const;
+};
+
+} // End namespace QI
+
+#endif // QI_FFT_H
@@ -0,0 +1,38 @@
+/*
+ *  FastTrig.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_FASTTRIG_H
+#define QI_FASTTRIG_H
+
+#include <Eigen/Core>
+
+namespace QI {
+
+/*
+ * acos() of every element. The approximation (Abramowitz & Stegun 4.4.46) is within 2e-8 rad on
+ * [-1, 1], so for floats the total error is rounding, at most 6e-7 rad. It is only an abs, a sqrt,
+ * a degree 7 polynomial and a select, which Eigen vectorises, instead of a libm call per element.
+ * Values outside [-1, 1] give NaN, as std::acos does.
+ */
+template<typename Derived>
+Eigen::Array<typename Derived::Scalar, Eigen::Dynamic, 1> FastAcos(const Eigen::ArrayBase<Derived> &x) {
+    typedef typename Derived::Scalar T;
+    const Eigen::Array<T, Eigen::Dynamic, 1> a = x.abs();
+    const Eigen::Array<T, Eigen::Dynamic, 1> p =
+        ((((((T(-0.0012624911) * a + T(0.0066700901)) * a - T(0.0170881256)) * a + T(0.0308918810)) * a
+           - T(0.0501743046)) * a + T(0.0889789874)) * a - T(0.2145988016)) * a + T(1.5707963050);
+    const Eigen::Array<T, Eigen::Dynamic, 1> r = (T(1) - a).sqrt() * p;
+    return (x < T(0)).select(T(M_PI) - r, r);
+}
+
+} // End namespace QI
+
+#endif // QI_FASTTRIG_H
@@ -14,6 +14,12 @@
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "Macro.h"
 
 namespace QI {
 
@@ -78,4 +84,200 @@ Eigen::VectorXd RobustLeastSquares(const Eigen::MatrixXd &X, const Eigen::Vector
     return b;
 }
 
+template<int P>
+LinearDesign<P>::LinearDesign(const TDesign &X) :
+    m_X(X), m_QR(X)
+{
+    const Eigen::Index n = X.rows(), p = X.cols();
+    // As in RobustLeastSquares, the leverage is the row norms of the thin Q
+    Eigen::MatrixXd Q(n, p); Q.setIdentity();
+    Q = m_QR.householderQ() * Q;
+    m_corr = (1.0 - Q.array().square().rowwise().sum()).sqrt();
+    m_pairs.resize(n, p * (p + 1) / 2);
+    for (Eigen::Index k = 0, i = 0; k < p; k++) {
+        for (Eigen::Index l = k; l < p; l++, i++) {
+            m_pairs.col(i) = X.col(k).cwiseProduct(X.col(l));
+        }
+    }
+}
+
+template<int P>
+auto LinearDesign<P>::solve(const Eigen::MatrixXd &Y) const -> TCoeffs {
+    return m_QR.solve(Y);
+}
+
+template<int P>
+auto LinearDesign<P>::robust(const Eigen::MatrixXd &Y) const -> TCoeffs {
+    const Eigen::Index n = m_X.rows(), p = m_X.cols(), m = Y.cols();
+    const double tune = 1.345; // For Huber only
+    TCoeffs b = solve(Y);
+    Eigen::ArrayXd sig_lower(m);
+    for (Eigen::Index j = 0; j < m; j++) {
+        const double sig_y = standard_dev(Y.col(j).array());
+        sig_lower[j] = (sig_y == 0) ? 1.0 : 1e-6 * sig_y;
+    }
+    // RobustLeastSquares scales the rows of X and y by w, so the normal equations are weighted by w^2
+    Eigen::ArrayXXd r(n, m), w2(n, m);
+    Eigen::ArrayXd rj(n), sr(n);
+    Eigen::MatrixXd G, c;
+    Eigen::Matrix<double, P, P> A(p, p);
+    Eigen::Matrix<double, P, 1> b_prev(p);
+    std::vector<bool> active(m, true);
+    Eigen::Index remaining = m;
+    for (int iter = 1; (remaining > 0) && (iter < 20); iter++) {
+        r = (Y - m_X * b).array();
+        for (Eigen::Index j = 0; j < m; j++) {
+            if (active[j]) {
+                rj = r.col(j);
+                const double sig = mad_sigma(rj, sr, p); // Get Median Absolute Deviation
+                r.col(j) /= (tune * std::max(sig, sig_lower[j]) * m_corr);
+            }
+        }
+        w2 = (1 / r.abs().max(1)).square(); // Huber weights
+        G.noalias() = m_pairs.transpose() * w2.matrix();
+        c.noalias() = m_X.transpose() * (w2 * Y.array()).matrix();
+        for (Eigen::Index j = 0; j < m; j++) {
+            if (!active[j]) continue;
+            for (Eigen::Index k = 0, i = 0; k < p; k++) {
+                for (Eigen::Index l = k; l < p; l++, i++) {
+                    A(l, k) = G(i, j);
+                }
+            }
+            b_prev = b.col(j);
+            b.col(j) = A.template selfadjointView<Eigen::Lower>().llt().solve(c.col(j));
+            if (((b.col(j) - b_prev).array().abs() < sqrt(std::numeric_limits<double>::epsilon())).all()) {
+                active[j] = false;
+                remaining--;
+            }
+        }
+    }
+    return b;
+}
+
+template class LinearDesign<2>;
+template class LinearDesign<3>;
+template class LinearDesign<4>;
+template class LinearDesign<Eigen::Dynamic>;
+
+namespace {
+    const size_t BlockRows = 256;
+
+    struct NormalEquations {
+        Eigen::MatrixXd A; // Lower triangle only
+        Eigen::VectorXd c;
+        double sum_y = 0, sum_y2 = 0;
+        NormalEquations(const int n) : A(Eigen::MatrixXd::Zero(n, n)), c(Eigen::VectorXd::Zero(n)) {}
+    };
+}
+
+Eigen::VectorXd BlockedLeastSquares(const size_t nRows, const int nCols, const TBlockFunc &block,
+                                    const bool robust, const size_t nThreads) {
+    if (nRows <= size_t(nCols)) {
+        QI_EXCEPTION("Need more rows (" << nRows << ") than columns (" << nCols << ") for a least-squares fit");
+    }
+    ThreadPool &pool = ThreadPool::Global();
+    const size_t nBlocks = (nRows + BlockRows - 1) / BlockRows;
+    const size_t nTasks = std::max<size_t>(1, std::min(nThreads, nBlocks));
+    Eigen::LLT<Eigen::MatrixXd> unweighted;
+    std::vector<float> corr_fac, scaled; // Leverage correction and |scaled residual| per row
+
+    /*
+     * One pass over the rows. With b the residuals are stored, and with a scale > 0 they also set
+     * the Huber weights. The first pass with b works out the leverage from the unweighted fit.
+     */
+    auto pass = [&](const Eigen::VectorXd *b, const bool accumulate, const double scale) -> NormalEquations {
+        std::vector<NormalEquations> parts(nTasks, NormalEquations(nCols));
+        const bool leverage = b && corr_fac.empty();
+        if (leverage) {
+            corr_fac.resize(nRows);
+        }
+        if (b) {
+            scaled.resize(nRows);
+        }
+        pool.run(nTasks, [&](const size_t t) {
+            NormalEquations &ne = parts[t];
+            Eigen::MatrixXd X(BlockRows, nCols);
+            Eigen::VectorXd y(BlockRows);
+            Eigen::ArrayXd w(BlockRows);
+            for (size_t blk = (nBlocks * t) / nTasks; blk < (nBlocks * (t + 1)) / nTasks; blk++) {
+                const size_t first = blk * BlockRows;
+                const size_t n = std::min(BlockRows, nRows - first);
+                block(first, n, X, y);
+                auto Xn = X.topRows(n);
+                auto yn = y.head(n);
+                ne.sum_y += yn.sum();
+                ne.sum_y2 += yn.squaredNorm();
+                w.head(n).setOnes();
+                if (b) {
+                    if (leverage) {
+                        const Eigen::MatrixXd LX = unweighted.matrixL().solve(Xn.transpose());
+                        for (size_t i = 0; i < n; i++) {
+                            corr_fac[first + i] = std::sqrt(std::max(0., 1. - LX.col(i).squaredNorm()));
+                        }
+                    }
+                    const Eigen::VectorXd r = yn - Xn * (*b);
+                    for (size_t i = 0; i < n; i++) {
+                        const double u = std::abs(r[i]) / std::max<double>(corr_fac[first + i], std::numeric_limits<float>::epsilon());
+                        scaled[first + i] = u;
+                        if (scale > 0) {
+                            w[i] = 1. / std::max(1., u / scale);
+                        }
+                    }
+                }
+                if (accumulate) {
+                    const Eigen::MatrixXd wX = w.head(n).sqrt().matrix().asDiagonal() * Xn;
+                    ne.A.selfadjointView<Eigen::Lower>().rankUpdate(wX.transpose());
+                    ne.c.noalias() += Xn.transpose() * (w.head(n) * yn.array()).matrix();
+                }
+            }
+        });
+        NormalEquations total(nCols);
+        for (const auto &p : parts) {
+            total.A += p.A;
+            total.c += p.c;
+            total.sum_y += p.sum_y;
+            total.sum_y2 += p.sum_y2;
+        }
+        return total;
+    };
+    auto solve = [&](const NormalEquations &ne) -> Eigen::VectorXd {
+        const Eigen::LLT<Eigen::MatrixXd> llt = ne.A.selfadjointView<Eigen::Lower>().llt();
+        if (llt.info() != Eigen::Success) {
+            QI_EXCEPTION("Least-squares normal equations are not positive definite, the fit is under-determined");
+        }
+        return llt.solve(ne.c);
+    };
+    // Median Absolute Deviation of the scaled residuals, as in mad_sigma()
+    auto mad_scale = [&]() -> double {
+        std::vector<float> sr(scaled);
+        const size_t index = std::min(sr.size() - 1, (sr.size() + nCols) / 2);
+        std::nth_element(sr.begin(), sr.begin() + index, sr.end());
+        return sr[index] / 0.6745;
+    };
+
+    const NormalEquations first = pass(nullptr, true, 0);
+    unweighted = first.A.selfadjointView<Eigen::Lower>().llt();
+    if (unweighted.info() != Eigen::Success) {
+        QI_EXCEPTION("Least-squares normal equations are not positive definite, the fit is under-determined");
+    }
+    Eigen::VectorXd b = unweighted.solve(first.c);
+    if (!robust) {
+        return b;
+    }
+    // With thanks to gsl_multifit_robust & Matlab
+    const double sig_y = std::sqrt(std::max(0., (first.sum_y2 - first.sum_y * first.sum_y / nRows) / (nRows - 1)));
+    const double sig_lower = (sig_y == 0) ? 1.0 : 1e-6 * sig_y;
+    const double tune = 1.345; // For Huber only
+    pass(&b, false, 0);
+    for (int iter = 1; iter < 20; iter++) {
+        const double scale = tune * std::max(mad_scale(), sig_lower);
+        const Eigen::VectorXd b_prev = b;
+        b = solve(pass(&b, true, scale));
+        if (((b - b_prev).array().abs() < sqrt(std::numeric_limits<double>::epsilon())).all()) {
+            break;
+        }
+    }
+    return b;
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -13,6 +13,12 @@
 #define QI_FIT_H
 
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <map>
+#include <atomic>
+#include <functional>
 
 #include "Eigen/Dense"
 
@@ -21,6 +27,99 @@ namespace QI {
 Eigen::VectorXd LeastSquares(const Eigen::MatrixXd &X, const Eigen::VectorXd &y);
 Eigen::VectorXd RobustLeastSquares(const Eigen::MatrixXd &X, const Eigen::VectorXd &y);
 
+/*
+ * Least-squares fits that share one design matrix, e.g. the same linear model at every voxel. X is
+ * factorised once and each column of Y is a separate fit. P is the number of parameters, fixed sizes
+ * (2-4 are instantiated) keep the coefficients and normal equations on the stack. robust() is the
+ * Huber IRLS of RobustLeastSquares for all the columns together, each with its own weights. The
+ * leverage only depends on X so is shared, and the weighted normal equations of every column are
+ * assembled with two matrix products per iteration and solved by Cholesky.
+ */
+template<int P = Eigen::Dynamic>
+class LinearDesign {
+public:
+    typedef Eigen::Matrix<double, Eigen::Dynamic, P> TDesign;
+    typedef Eigen::Matrix<double, P, Eigen::Dynamic> TCoeffs;
+
+    LinearDesign() = default;
+    explicit LinearDesign(const TDesign &X);
+
+    TCoeffs solve(const Eigen::MatrixXd &Y) const;
+    TCoeffs robust(const Eigen::MatrixXd &Y) const;
+    const TDesign &design() const { return m_X; }
+
+private:
+    TDesign m_X;
+    Eigen::ColPivHouseholderQR<TDesign> m_QR;
+    Eigen::ArrayXd m_corr;   // Leverage correction for the robust residuals
+    Eigen::MatrixXd m_pairs; // Product of each pair of columns, for the weighted normal equations
+};
+
+template<int P>
+Eigen::Matrix<double, P, 1> LeastSquares(const Eigen::Matrix<double, Eigen::Dynamic, P> &X, const Eigen::VectorXd &y) {
+    return LinearDesign<P>(X).solve(y);
+}
+
+template<int P>
+Eigen::Matrix<double, P, 1> RobustLeastSquares(const Eigen::Matrix<double, Eigen::Dynamic, P> &X, const Eigen::VectorXd &y) {
+    return LinearDesign<P>(X).robust(y);
+}
+
+/*
+ * Least-squares for problems with too many rows to hold the design matrix. The rows are made on
+ * demand in blocks, block(first, n, X, y) fills the top n rows of X and y from row first, and is
+ * called from several threads at once. Each thread accumulates its own normal equations, which are
+ * summed and solved by Cholesky, so only O(cols^2) is kept. The robust (Huber) fit is IRLS, each
+ * iteration is a single pass that makes the rows once, weights them with the current residuals and
+ * the scale from the previous pass, and stores the residuals for the next scale.
+ */
+typedef std::function<void (const size_t first, const size_t n, Eigen::MatrixXd &X, Eigen::VectorXd &y)> TBlockFunc;
+Eigen::VectorXd BlockedLeastSquares(const size_t nRows, const int nCols, const TBlockFunc &block,
+                                    const bool robust, const size_t nThreads);
+
+/*
+ * Per-thread fit state for algorithms, whose apply() is const and called from every worker at
+ * once. For small fits building a ceres::Problem and its cost functions costs more than solving
+ * it, so instead each thread builds one context the first time it asks, and afterwards only the
+ * voxel data inside it needs to be reloaded. Contexts live as long as this object.
+ */
+template<typename TContext>
+class PerThread {
+public:
+    typedef std::function<TContext *(void)> TFactory;
+
+    PerThread(const TFactory &f) : m_factory(f), m_id(NextId()) {}
+    PerThread(const PerThread &) = delete;
+    PerThread &operator=(const PerThread &) = delete;
+
+    TContext &get() const {
+        // Remember the last context this thread used, so the usual case does not need the lock
+        static thread_local size_t cachedId = 0;
+        static thread_local TContext *cached = nullptr;
+        if (cachedId != m_id) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            std::unique_ptr<TContext> &context = m_contexts[std::this_thread::get_id()];
+            if (!context) {
+                context.reset(m_factory());
+            }
+            cached = context.get();
+            cachedId = m_id;
+        }
+        return *cached;
+    }
+
+private:
+    TFactory m_factory;
+    const size_t m_id; // Unique, unlike the address, so a cache can never point at a deleted context
+    mutable std::mutex m_mutex;
+    mutable std::map<std::thread::id, std::unique_ptr<TContext>> m_contexts;
+
+    static size_t NextId() {
+        static std::atomic<size_t> next{1};
+        return next++;
+    }
+};
+
 } // End namespace QI
 
 #endif // QI_FIT_H
\ No newline at end of file
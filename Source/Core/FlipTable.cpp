@@ -0,0 +1,53 @@
+/*
+ *  FlipTable.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cmath>
+#include "FlipTable.h"
+#include "Macro.h"
+
+namespace QI {
+
+FlipTable::FlipTable(const Eigen::ArrayXd &FA, const double maxB1, const double step) :
+    m_FA(FA), m_step(step)
+{
+    if (maxB1 <= 0 || step <= 0) {
+        QI_EXCEPTION("Flip-angle table must have a positive range and step");
+    }
+    const Eigen::Index n = static_cast<Eigen::Index>(std::ceil(maxB1 / step)) + 1;
+    m_sine.resize(FA.rows(), n);
+    m_cosine.resize(FA.rows(), n);
+    for (Eigen::Index i = 0; i < n; i++) {
+        m_sine.col(i) = (FA * (i * step)).sin();
+        m_cosine.col(i) = (FA * (i * step)).cos();
+    }
+}
+
+Eigen::Index FlipTable::size() const { return m_FA.rows(); }
+
+void FlipTable::operator()(const Eigen::Ref<const Eigen::ArrayXd> &B1, Eigen::ArrayXXd &sine, Eigen::ArrayXXd &cosine) const {
+    sine.resize(m_FA.rows(), B1.rows());
+    cosine.resize(m_FA.rows(), B1.rows());
+    const Eigen::Index last = m_sine.cols() - 1;
+    for (Eigen::Index v = 0; v < B1.rows(); v++) {
+        const double pos = B1[v] / m_step;
+        if (pos >= 0 && pos < last) { // Also false for NaN
+            const Eigen::Index i = static_cast<Eigen::Index>(pos);
+            const double f = pos - i;
+            sine.col(v) = (1 - f) * m_sine.col(i) + f * m_sine.col(i + 1);
+            cosine.col(v) = (1 - f) * m_cosine.col(i) + f * m_cosine.col(i + 1);
+        } else {
+            sine.col(v) = (m_FA * B1[v]).sin();
+            cosine.col(v) = (m_FA * B1[v]).cos();
+        }
+    }
+}
+
+} // End namespace QI
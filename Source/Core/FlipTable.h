@@ -0,0 +1,40 @@
+/*
+ *  FlipTable.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_FLIPTABLE_H
+#define QI_FLIPTABLE_H
+
+#include <Eigen/Dense>
+
+namespace QI {
+
+/*
+ * The sine and cosine of a fixed set of flip-angles scaled by B1, which are the only per-voxel
+ * trigonometry in the linearised DESPOT fits. They are tabulated once on a uniform B1 grid and
+ * linearly interpolated, which is accurate to about 1e-7 with the default step. B1 values outside
+ * the table are calculated directly.
+ */
+class FlipTable {
+public:
+    FlipTable(const Eigen::ArrayXd &FA, const double maxB1 = 3.0, const double step = 1e-3);
+    // Fill one column per voxel, one row per flip-angle
+    void operator()(const Eigen::Ref<const Eigen::ArrayXd> &B1, Eigen::ArrayXXd &sine, Eigen::ArrayXXd &cosine) const;
+    Eigen::Index size() const; // Number of flip-angles
+
+protected:
+    Eigen::ArrayXd m_FA;
+    double m_step;
+    Eigen::ArrayXXd m_sine, m_cosine; // One column per grid point
+};
+
+} // End namespace QI
+
+#endif // QI_FLIPTABLE_H
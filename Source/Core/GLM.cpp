@@ -0,0 +1,77 @@
+/*
+ *  GLM.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+
+#include "GLM.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+    const size_t BlockBytes = 256 * 1024; // Of voxel data per GEMM, so it stays in L2 cache
+}
+
+GLMContrasts::GLMContrasts(const Eigen::MatrixXd &design, const Eigen::MatrixXd &contrasts) {
+    if (design.cols() != contrasts.cols()) {
+        QI_EXCEPTION("Number of columns in design matrix (" << design.cols() << ") does not match contrasts (" << contrasts.cols() << ")");
+    }
+    Eigen::ColPivHouseholderQR<Eigen::MatrixXd> QR(design);
+    if (QR.rank() < design.cols()) {
+        QI_EXCEPTION("Design matrix is rank deficient (rank " << QR.rank() << " with " << design.cols() << " columns)");
+    }
+    m_pinv = QR.solve(Eigen::MatrixXd::Identity(design.rows(), design.rows()));
+    m_mat = contrasts * m_pinv;
+    m_matf = m_mat.cast<float>();
+    m_basis = QR.householderQ() * Eigen::MatrixXd::Identity(design.rows(), design.cols());
+    m_variances = (m_mat * m_mat.transpose()).diagonal(); // pinv pinv' = (D'D)^-1
+}
+
+Eigen::Index GLMContrasts::subjects() const { return m_mat.cols(); }
+Eigen::Index GLMContrasts::contrasts() const { return m_mat.rows(); }
+const Eigen::MatrixXd &GLMContrasts::pseudoInverse() const { return m_pinv; }
+const Eigen::MatrixXd &GLMContrasts::matrix() const { return m_mat; }
+const Eigen::MatrixXd &GLMContrasts::basis() const { return m_basis; }
+const Eigen::VectorXd &GLMContrasts::variances() const { return m_variances; }
+Eigen::Index GLMContrasts::dof() const { return m_pinv.cols() - m_pinv.rows(); }
+
+void GLMContrasts::apply(const float *data, const size_t nVox, const std::vector<float *> &out,
+                         const bool fraction, const float *mask, const size_t nThreads) const
+{
+    if (out.size() != size_t(contrasts())) {
+        QI_EXCEPTION("Need " << contrasts() << " output volumes, was given " << out.size());
+    }
+    const Eigen::Index nSub = subjects(), nCon = contrasts();
+    const size_t block = std::max<size_t>(16, BlockBytes / (sizeof(float) * nSub));
+    const size_t nBlocks = (nVox + block - 1) / block;
+    const size_t nTasks = std::max<size_t>(1, std::min(nThreads, nBlocks));
+    ThreadPool::Global().run(nTasks, [&](const size_t t) {
+        Eigen::MatrixXf result(nCon, block);
+        for (size_t b = (nBlocks * t) / nTasks; b < (nBlocks * (t + 1)) / nTasks; b++) {
+            const size_t v0 = b * block;
+            const size_t n = std::min(block, nVox - v0);
+            Eigen::Map<const Eigen::MatrixXf> Y(data + v0 * nSub, nSub, n);
+            result.leftCols(n).noalias() = m_matf * Y;
+            if (fraction) {
+                result.leftCols(n).array().rowwise() /= Y.colwise().mean().array();
+            }
+            for (size_t v = 0; v < n; v++) {
+                const bool inside = !mask || mask[v0 + v] != 0;
+                for (Eigen::Index c = 0; c < nCon; c++) {
+                    out[c][v0 + v] = inside ? result(c, v) : 0.f;
+                }
+            }
+        }
+    });
+}
+
+} // End namespace QI
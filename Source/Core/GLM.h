@@ -0,0 +1,56 @@
+/*
+ *  GLM.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_GLM_H
+#define QI_GLM_H
+
+#include <vector>
+#include <Eigen/Dense>
+
+namespace QI {
+
+/*
+ * Contrasts of a General Linear Model fitted at every voxel of a cohort. The cohort is treated as
+ * one subjects x voxels matrix, which is exactly the layout of a VectorImage buffer, so blocks of
+ * voxels can be multiplied in place by the contrasts x subjects matrix c * pinv(D). The pseudo-
+ * inverse comes from a column-pivoted QR of the design itself, instead of inverting D'D which
+ * squares its condition number.
+ */
+class GLMContrasts {
+public:
+    GLMContrasts(const Eigen::MatrixXd &design, const Eigen::MatrixXd &contrasts);
+
+    Eigen::Index subjects() const;
+    Eigen::Index contrasts() const;
+    const Eigen::MatrixXd &pseudoInverse() const; // Covariates x subjects
+    const Eigen::MatrixXd &matrix() const;        // Contrasts x subjects
+    const Eigen::MatrixXd &basis() const;         // Orthonormal basis for the columns of D, subjects x covariates
+    const Eigen::VectorXd &variances() const;     // c (D'D)^-1 c' for each contrast, i.e. var(c b) / sigma^2
+    Eigen::Index dof() const;                     // Residual degrees of freedom
+
+    /*
+     * data is subjects x nVox (column-major) and out has one volume per contrast. Voxels that are
+     * zero in mask (if given) are set to zero. The voxels are multiplied in blocks that fit in
+     * cache, shared between nThreads tasks on the global pool, which must not be called from
+     * inside a task on that pool.
+     */
+    void apply(const float *data, const size_t nVox, const std::vector<float *> &out,
+               const bool fraction, const float *mask, const size_t nThreads) const;
+
+protected:
+    Eigen::MatrixXd m_pinv, m_mat, m_basis;
+    Eigen::VectorXd m_variances;
+    Eigen::MatrixXf m_matf;
+};
+
+} // End namespace QI
+
+#endif // QI_GLM_H
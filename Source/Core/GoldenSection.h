@@ -13,12 +13,66 @@
 #define QI_GOLDENSECTION_H
 
 #include <cmath>
-#include <functional>
+#include <Eigen/Core>
 
 namespace QI {
 
-double GoldenSectionSearch(std::function<double(double)> f, double a, double b, const double tol);
+typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
+
+/*
+ * Minimise f over [a, b]. f is a template parameter so the call inlines, and each step re-uses
+ * the interior point it keeps, so there is one evaluation per iteration.
+ */
+template<typename F>
+double GoldenSectionSearch(F &&f, double a, double b, const double tol) {
+    const double gr = (std::sqrt(5.0) + 1.0) / 2.0;
+    double c = b - (b - a) / gr;
+    double d = a + (b - a) / gr;
+    double fc = f(c), fd = f(d);
+    while (std::fabs(c - d) > tol) {
+        if (fc < fd) {
+            b = d;
+            d = c; fd = fc;
+            c = b - (b - a) / gr; fc = f(c);
+        } else {
+            a = c;
+            c = d; fc = fd;
+            d = a + (b - a) / gr; fd = f(d);
+        }
+    }
+    return (b + a) / 2.0;
+}
+
+/*
+ * Lock-step version for many independent brackets, e.g. one per voxel. f is called with the next
+ * point of every bracket at once and returns all of their values, so it can be vectorised across
+ * the brackets. Every bracket shrinks by the same factor each iteration, so this runs until the
+ * widest one has converged, and the others end up narrower than tol.
+ */
+template<typename F>
+Eigen::ArrayXd GoldenSectionSearch(F &&f, Eigen::ArrayXd a, Eigen::ArrayXd b, const double tol) {
+    const double gr = (std::sqrt(5.0) + 1.0) / 2.0;
+    Eigen::ArrayXd c = b - (b - a) / gr;
+    Eigen::ArrayXd d = a + (b - a) / gr;
+    Eigen::ArrayXd fc = f(c), fd = f(d);
+    Eigen::ArrayXd x(a.rows()), fx(a.rows()), kept(a.rows()), fkept(a.rows());
+    ArrayXb left(a.rows());
+    while (((c - d).abs() > tol).any()) {
+        left = fc < fd;
+        b = left.select(d, b);
+        a = left.select(a, c);
+        x = left.select(b - (b - a) / gr, a + (b - a) / gr);
+        fx = f(x);
+        kept = left.select(c, d);
+        fkept = left.select(fc, fd);
+        c = left.select(x, kept);
+        fc = left.select(fx, fkept);
+        d = left.select(kept, x);
+        fd = left.select(fkept, fx);
+    }
+    return (b + a) / 2.0;
+}
 
 } // End namespace QI
 
-#endif // QI_GOLDENSECTION_H
\ No newline at end of file
+#endif // QI_GOLDENSECTION_H
@@ -20,6 +20,7 @@ namespace QI {
 typedef itk::Image<unsigned char, 3> VolumeUC;
 typedef itk::Image<int, 3> VolumeI;
 typedef itk::Image<unsigned int, 3> VolumeUI;
+typedef itk::VectorImage<short, 3> VectorVolumeS; // Raw scanner integers, see ReadInt16VectorImage
 
 typedef itk::Image<float, 3> VolumeF;
 typedef itk::Image<float, 4> SeriesF;
@@ -12,6 +12,14 @@
 #include "Kernels.h"
 
 namespace QI {
+
+double FilterKernel::profile(const int, const double, const double, const double) const {
+    QI_EXCEPTION("Kernel " << *this << " is not separable");
+}
+double FilterKernel::radial(const double) const {
+    QI_EXCEPTION("Kernel " << *this << " is not radial");
+}
+
 TukeyKernel::TukeyKernel() {}
 TukeyKernel::TukeyKernel(std::istream &istr) {
     if (!istr.eof()) {
@@ -26,7 +34,9 @@ void TukeyKernel::print(std::ostream &ostr) const {
     ostr << "Tukey," << m_a << "," << m_q;
 }
 double TukeyKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
-    const double r = sqrt(((pos / sz).square()).sum() / 3);
+    return radial(sqrt(((pos / sz).square()).sum() / 3));
+}
+double TukeyKernel::radial(const double r) const {
     const double v = (r <= (1 - m_a)) ? 1 : 0.5*((1+m_q)+(1-m_q)*cos(M_PI*(r - (1 - m_a))/m_a));
     return v;
 }
@@ -45,7 +55,9 @@ void HammingKernel::print(std::ostream &ostr) const {
     ostr << "Hamming," << m_a << "," << m_b;
 }
 double HammingKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
-    const double r = sqrt(((pos / sz).square()).sum() / 3);
+    return radial(sqrt(((pos / sz).square()).sum() / 3));
+}
+double HammingKernel::radial(const double r) const {
     const double v = m_a - m_b*cos(M_PI*(1.+r));
     return v;
 }
@@ -77,6 +89,11 @@ double GaussKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, c
     const double v = exp(-r2/2.);
     return v;
 }
+double GaussKernel::profile(const int dim, const double pos, const double sz, const double sp) const {
+    static const double M = 2. * sqrt(2.*log(2.)) / M_PI;
+    const double sigma_k = M * sz * sp / m_fwhm[dim];
+    return exp(-(pos/sigma_k)*(pos/sigma_k)/2.);
+}
 
 BlackmanKernel::BlackmanKernel() {
     calc_constants();
@@ -98,7 +115,9 @@ void BlackmanKernel::print(std::ostream &ostr) const {
     ostr << "Blackman," << m_alpha;
 }
 double BlackmanKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
-    const double r = sqrt(((pos / sz).square() / 3).sum());
+    return radial(sqrt(((pos / sz).square() / 3).sum()));
+}
+double BlackmanKernel::radial(const double r) const {
     const double v = m_a0 - m_a1*cos(M_PI*(1.+r)) + m_a2*cos(2.*M_PI*(1.+r));
     return v;
 }
@@ -117,10 +136,15 @@ RectKernel::RectKernel(std::istream &istr) {
     }
 }
 void RectKernel::print(std::ostream &ostr) const {
-    ostr << "FixFSE," << m_dim << "," << m_width << "," << m_val_inside << "," << m_val_outside;
+    ostr << "Rectangle," << m_dim << "," << m_width << "," << m_val_inside << "," << m_val_outside;
 }
 double RectKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
-    if (fabs(pos[m_dim]) > m_width) {
+    return profile(m_dim, pos[m_dim], sz[m_dim], sp[m_dim]);
+}
+double RectKernel::profile(const int dim, const double pos, const double sz, const double sp) const {
+    if (dim != m_dim) {
+        return 1;
+    } else if (fabs(pos) > m_width) {
         return m_val_outside;
     } else {
         return m_val_inside;
@@ -149,9 +173,15 @@ void FixFSEKernel::print(std::ostream &ostr) const {
 }
 double FixFSEKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
     const int dim = abs(m_dim);
+    return profile(dim, pos[dim], sz[dim], sp[dim]);
+}
+double FixFSEKernel::profile(const int dim, const double pos, const double sz, const double sp) const {
+    if (dim != abs(m_dim)) {
+        return 1;
+    }
     const int dir = m_dim > 0 ? 1 : -1;
-    const int n_trains = 2 * sz[dim] / m_etl;
-    const int n_echo = floor((dir*pos[dim] + sz[dim] - (m_etl / 2) + 2) / n_trains);
+    const int n_trains = 2 * sz / m_etl;
+    const int n_echo = floor((dir*pos + sz - (m_etl / 2) + 2) / n_trains);
     // At this point, center of kspace is at m_etl / 2. Shift to make it kzero
     const int n_shifted = n_echo - (m_etl / 2) + m_kzero;
     // Wrap negative echoes to end of train
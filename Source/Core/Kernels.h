@@ -25,8 +25,19 @@ class FilterKernel {
 protected:
 
 public:
+    virtual ~FilterKernel() {}
     virtual void print(std::ostream &ostr) const = 0;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const = 0;
+
+    /*
+     * Most kernels are either a product of 1D profiles along each axis, or a function of the
+     * normalised radius r = sqrt(sum((pos/sz)^2)/3). Filling a volume with those only needs
+     * profile() along each axis, or a table of radial() values, instead of value() per voxel.
+     */
+    enum class Shape { General, Separable, Radial };
+    virtual Shape shape() const { return Shape::General; }
+    virtual double profile(const int dim, const double pos, const double sz, const double sp) const; // Separable only
+    virtual double radial(const double r) const; // Radial only
 };
 
 class TukeyKernel : public FilterKernel
@@ -40,6 +51,8 @@ class TukeyKernel : public FilterKernel
     TukeyKernel(std::istream &istr);
     virtual void print(std::ostream &ostr) const override;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class HammingKernel : public FilterKernel
@@ -53,6 +66,8 @@ class HammingKernel : public FilterKernel
     HammingKernel(std::istream &istr);
     virtual void print(std::ostream &ostr) const override;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class GaussKernel : public FilterKernel
@@ -65,6 +80,8 @@ class GaussKernel : public FilterKernel
     GaussKernel(std::istream &istr);
     virtual void print(std::ostream &ostr) const override;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Separable; }
+    virtual double profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 class BlackmanKernel : public FilterKernel
@@ -78,6 +95,8 @@ class BlackmanKernel : public FilterKernel
     BlackmanKernel(std::istream &istr);
     virtual void print(std::ostream &ostr) const override;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Radial; }
+    virtual double radial(const double r) const override;
 };
 
 class RectKernel : public FilterKernel {
@@ -92,6 +111,8 @@ public:
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Separable; }
+    virtual double profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 class FixFSEKernel : public FilterKernel {
@@ -106,6 +127,8 @@ public:
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual Shape shape() const override { return Shape::Separable; }
+    virtual double profile(const int dim, const double pos, const double sz, const double sp) const override;
 };
 
 std::shared_ptr<FilterKernel> ReadKernel(const std::string &str);
@@ -0,0 +1,176 @@
+/*
+ *  LevenbergMarquardt.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_LEVENBERGMARQUARDT_H
+#define QI_LEVENBERGMARQUARDT_H
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <Eigen/Dense>
+#include "ceres/jet.h"
+
+#include "Macro.h"
+
+namespace QI {
+
+/*
+ * Levenberg-Marquardt for models with a small, fixed number of parameters and analytic
+ * derivatives. The model hands back one residual and its gradient at a time, so JᵀJ and Jᵀr are
+ * summed directly into fixed-size matrices and nothing is allocated. TModel must provide:
+ *
+ *   size_t size() const;                          // Number of residuals
+ *   bool valid(const TParams &p) const;           // Reject steps outside the model's domain
+ *   double residual(const size_t i, const TParams &p, TParams &gradient) const;
+ *
+ * Parameters can be kept inside a box [lower, upper]. The start is moved into the box, and each
+ * step is cut back to it. A parameter on a bound whose gradient points out of the box is held for
+ * that step. The starting point must be valid. Returns the number of accepted steps.
+ */
+template<int NP, typename TModel>
+int LevenbergMarquardt(const TModel &model, Eigen::Matrix<double, NP, 1> &p,
+                       const Eigen::Matrix<double, NP, 1> &lower, const Eigen::Matrix<double, NP, 1> &upper,
+                       const int maxIterations, const double tolerance = 1e-8)
+{
+    typedef Eigen::Matrix<double, NP, 1> TParams;
+    typedef Eigen::Matrix<double, NP, NP> THessian;
+    auto accumulate = [&](const TParams &q, THessian &JtJ, TParams &Jtr) -> double {
+        JtJ.setZero();
+        Jtr.setZero();
+        TParams g;
+        double cost = 0;
+        for (size_t i = 0; i < model.size(); i++) {
+            const double r = model.residual(i, q, g);
+            JtJ.noalias() += g * g.transpose();
+            Jtr += r * g;
+            cost += r * r;
+        }
+        return cost;
+    };
+
+    p = p.cwiseMax(lower).cwiseMin(upper);
+    THessian JtJ, newJtJ;
+    TParams Jtr, newJtr;
+    double cost = accumulate(p, JtJ, Jtr);
+    double lambda = 1e-3;
+    for (int it = 0; it < maxIterations; it++) {
+        for (;;) {
+            THessian A = JtJ;
+            A.diagonal() += lambda * JtJ.diagonal().cwiseMax(1e-12);
+            TParams g = Jtr;
+            for (int k = 0; k < NP; k++) {
+                if ((p[k] <= lower[k] && Jtr[k] > 0) || (p[k] >= upper[k] && Jtr[k] < 0)) {
+                    g[k] = 0;
+                    A.row(k).setZero();
+                    A.col(k).setZero();
+                    A(k, k) = 1;
+                }
+            }
+            TParams step = A.ldlt().solve(-g);
+            TParams q = p + step;
+            for (int k = 0; k < NP; k++) {
+                if (q[k] < lower[k] || q[k] > upper[k]) {
+                    q[k] = std::min(std::max(q[k], lower[k]), upper[k]);
+                    step[k] = q[k] - p[k];
+                }
+            }
+            if (model.valid(q)) {
+                const double newCost = accumulate(q, newJtJ, newJtr);
+                if (newCost < cost) {
+                    const bool converged = (cost - newCost) <= tolerance * cost ||
+                                           step.norm() <= tolerance * (p.norm() + tolerance);
+                    p = q;
+                    cost = newCost;
+                    JtJ = newJtJ;
+                    Jtr = newJtr;
+                    lambda = std::max(lambda / 10, 1e-12);
+                    if (converged) {
+                        return it + 1;
+                    }
+                    break;
+                }
+            }
+            lambda *= 10;
+            if (lambda > 1e16) { // No downhill step left, so this is the minimum
+                return it;
+            }
+        }
+    }
+    return maxIterations;
+}
+
+template<int NP, typename TModel>
+int LevenbergMarquardt(const TModel &model, Eigen::Matrix<double, NP, 1> &p, const int maxIterations,
+                       const double tolerance = 1e-8)
+{
+    typedef Eigen::Matrix<double, NP, 1> TParams;
+    return LevenbergMarquardt<NP>(model, p, TParams::Constant(-std::numeric_limits<double>::infinity()),
+                                  TParams::Constant(std::numeric_limits<double>::infinity()), maxIterations, tolerance);
+}
+
+/*
+ * A model for LevenbergMarquardt from the functor ceres::AutoDiffCostFunction would take, with
+ * one block of NP parameters:
+ *
+ *   template<typename T> bool operator()(const T *const p, T *residuals) const;
+ *
+ * The derivatives come from ceres::Jet. Each point is evaluated once for all the residuals and
+ * kept for the calls that follow, in fixed-size storage for up to MaxResiduals. A point is valid
+ * if the functor succeeds and everything it returns is finite.
+ */
+template<int NP, typename TFunctor, int MaxResiduals = 32>
+class AutoDiffModel {
+public:
+    typedef Eigen::Matrix<double, NP, 1> TParams;
+
+    AutoDiffModel(const TFunctor &f, const size_t n) : m_functor(f), m_size(n) {
+        if (n > static_cast<size_t>(MaxResiduals)) {
+            QI_EXCEPTION("Automatic derivatives were sized for at most " << MaxResiduals << " residuals, asked for " << n);
+        }
+    }
+
+    size_t size() const { return m_size; }
+    bool valid(const TParams &p) const { return evaluate(p); }
+    double residual(const size_t i, const TParams &p, TParams &gradient) const {
+        evaluate(p);
+        gradient = m_residuals[i].v;
+        return m_residuals[i].a;
+    }
+
+protected:
+    typedef ceres::Jet<double, NP> TJet;
+    const TFunctor &m_functor;
+    const size_t m_size;
+    mutable TJet m_residuals[MaxResiduals];
+    mutable TParams m_point;
+    mutable bool m_evaluated = false, m_valid = false;
+
+    bool evaluate(const TParams &p) const {
+        if (m_evaluated && p == m_point) {
+            return m_valid;
+        }
+        TJet q[NP];
+        for (int k = 0; k < NP; k++) {
+            q[k] = TJet(p[k], k);
+        }
+        m_valid = m_functor(static_cast<const TJet *>(q), m_residuals);
+        for (size_t i = 0; m_valid && i < m_size; i++) {
+            m_valid = std::isfinite(m_residuals[i].a) && m_residuals[i].v.allFinite();
+        }
+        m_point = p;
+        m_evaluated = true;
+        return m_valid;
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_LEVENBERGMARQUARDT_H
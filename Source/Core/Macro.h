@@ -36,10 +36,33 @@
     throw(std::runtime_error(message.str()));                 \
 }
 
-#define QI_FAIL( x )             \
-{                                \
-    std::cerr << x << std::endl; \
-    exit(EXIT_FAILURE);          \
+namespace QI {
+// Set by QI_FAIL, so exit handlers (e.g. the result cache) can tell a failure from a normal exit
+inline bool &FailedFlag() {
+    static bool failed = false;
+    return failed;
+}
+
+/*
+ * When programs run inside qi_pipeline --serve the process has to outlive them, so there QI_FAIL
+ * (and --help) throw this with the exit code instead of calling exit(). It is deliberately not a
+ * std::exception, so a program's own handlers do not catch it.
+ */
+struct ExitRequest {
+    int code;
+};
+inline bool &ThrowOnExit() {
+    static bool t = false;
+    return t;
+}
+}
+
+#define QI_FAIL( x )                                                  \
+{                                                                     \
+    std::cerr << x << std::endl;                                      \
+    QI::FailedFlag() = true;                                          \
+    if (QI::ThrowOnExit()) throw QI::ExitRequest{EXIT_FAILURE};       \
+    exit(EXIT_FAILURE);                                               \
 }
 
 #define QI_DB( x ) std::cout << "\n" << #x << ": " << x << std::endl;
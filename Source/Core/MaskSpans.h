@@ -0,0 +1,106 @@
+/*
+ *  MaskSpans.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_MASKSPANS_H
+#define QI_MASKSPANS_H
+
+#include <vector>
+
+#include "itkImageRegion.h"
+#include "itkImageScanlineConstIterator.h"
+
+namespace QI {
+
+/*
+ * A mask stored as the runs of consecutive in-mask voxels along x within a region. The mask image
+ * is read once when this is built, after that a masked pass jumps from one span to the next and
+ * never visits the background. Any non-zero mask value is inside. Without a mask image the whole
+ * region is one span per line, so consumers need only one loop.
+ */
+template<unsigned int D>
+class MaskSpans {
+public:
+    typedef itk::ImageRegion<D> TRegion;
+    typedef typename TRegion::IndexType TIndex;
+    struct Span {
+        TIndex start;
+        size_t length;
+    };
+    typedef typename std::vector<Span>::const_iterator const_iterator;
+
+    template<typename TMask>
+    MaskSpans(const TMask *mask, const TRegion &region) :
+        m_count(0)
+    {
+        if (region.GetNumberOfPixels() == 0) {
+            return;
+        }
+        if (!mask) {
+            const size_t line = region.GetSize()[0];
+            for (size_t l = 0; l < region.GetNumberOfPixels() / line; l++) {
+                TIndex start = region.GetIndex();
+                size_t rest = l;
+                for (unsigned int d = 1; d < D; d++) {
+                    start[d] += rest % region.GetSize()[d];
+                    rest /= region.GetSize()[d];
+                }
+                m_spans.push_back({start, line});
+            }
+            m_count = region.GetNumberOfPixels();
+            return;
+        }
+        itk::ImageScanlineConstIterator<TMask> it(mask, region);
+        while (!it.IsAtEnd()) {
+            bool inside = false;
+            while (!it.IsAtEndOfLine()) {
+                if (it.Get()) {
+                    if (inside) {
+                        m_spans.back().length++;
+                    } else {
+                        m_spans.push_back({it.GetIndex(), 1});
+                        inside = true;
+                    }
+                    m_count++;
+                } else {
+                    inside = false;
+                }
+                ++it;
+            }
+            it.NextLine();
+        }
+    }
+
+    const_iterator begin() const { return m_spans.begin(); }
+    const_iterator end() const { return m_spans.end(); }
+    size_t spans() const { return m_spans.size(); }
+    size_t count() const { return m_count; } // Voxels inside the mask
+
+    /*
+     * Calls f(index) for every voxel inside the mask, in scanline order
+     */
+    template<typename F>
+    void forEach(F &&f) const {
+        for (const Span &span : m_spans) {
+            TIndex index = span.start;
+            for (size_t i = 0; i < span.length; i++, index[0]++) {
+                f(index);
+            }
+        }
+    }
+
+protected:
+    std::vector<Span> m_spans;
+    size_t m_count;
+};
+
+} // End namespace QI
+
+#endif // QI_MASKSPANS_H
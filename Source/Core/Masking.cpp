@@ -11,51 +11,358 @@
 
 #include "Masking.h"
 
-#include <limits>
-
-#include "itkBinaryThresholdImageFilter.h"
-#include "itkOtsuThresholdImageFilter.h"
-#include "itkConnectedComponentImageFilter.h"
-#include "itkLabelShapeKeepNObjectsImageFilter.h"
-#include "itkRelabelComponentImageFilter.h"
+#include <cmath>
+#include <algorithm>
+#include <numeric>
 
+#include "ThreadPool.h"
+#include "AlignedBuffers.h"
 #include "Macro.h"
 
 namespace QI {
 
-VolumeI::Pointer ThresholdMask(const VolumeF::Pointer &img, const float lower, const float upper) {
-    typedef itk::BinaryThresholdImageFilter<VolumeF, VolumeI> TThreshFilter;
-    auto threshold = TThreshFilter::New();
-    threshold->SetInput(img);
-    threshold->SetLowerThreshold(lower);
-    threshold->SetUpperThreshold(upper);
-    threshold->SetInsideValue(1);
-    threshold->SetOutsideValue(0);
-    threshold->Update();
-    VolumeI::Pointer mask = threshold->GetOutput();
-    mask->DisconnectPipeline();
+BitMask::BitMask(const std::array<size_t, 3> &size) :
+    m_size(size),
+    m_words((voxels() + 63) / 64, 0)
+{}
+
+const std::array<size_t, 3> &BitMask::size() const { return m_size; }
+size_t BitMask::voxels() const { return m_size[0] * m_size[1] * m_size[2]; }
+
+size_t BitMask::count() const {
+    size_t n = 0;
+    for (const uint64_t w : m_words) {
+        n += __builtin_popcountll(w);
+    }
+    return n;
+}
+
+namespace {
+
+std::array<size_t, 3> RegionSize(const itk::ImageBase<3> *img) {
+    const auto &size = img->GetBufferedRegion().GetSize();
+    return {{size[0], size[1], size[2]}};
+}
+
+BitMask NonZero(const VolumeI::Pointer &img) {
+    BitMask mask(RegionSize(img.GetPointer()));
+    const int *data = img->GetBufferPointer();
+    for (size_t i = 0; i < mask.voxels(); i++) {
+        if (data[i]) {
+            mask.set(i);
+        }
+    }
     return mask;
 }
 
-VolumeI::Pointer OtsuMask(const VolumeF::Pointer &img) {
-    auto otsuFilter = itk::OtsuThresholdImageFilter<VolumeF, VolumeI>::New();
-    otsuFilter->SetInput(img);
-    otsuFilter->SetOutsideValue(1);
-    otsuFilter->SetInsideValue(0);
-    otsuFilter->Update();
-    VolumeI::Pointer mask = otsuFilter->GetOutput();
-    mask->DisconnectPipeline();
+/*
+ * Lower envelope of the parabolas rooted at the finite samples of f, then read off at every
+ * sample. v and z are scratch space for n and n + 1 elements.
+ */
+void Distance1D(const float *f, float *d, const size_t n, size_t *v, double *z) {
+    const double inf = std::numeric_limits<double>::infinity();
+    long k = -1;
+    for (size_t q = 0; q < n; q++) {
+        if (std::isinf(f[q])) {
+            continue;
+        }
+        if (k < 0) {
+            k = 0;
+        } else {
+            double s;
+            while (true) {
+                const double p = v[k];
+                s = ((f[q] + double(q) * q) - (f[v[k]] + p * p)) / (2. * q - 2. * p);
+                if (s > z[k]) {
+                    break;
+                }
+                k--;
+            }
+            k++;
+            z[k] = s;
+        }
+        v[k] = q;
+        if (k == 0) {
+            z[0] = -inf;
+        }
+        z[k + 1] = inf;
+    }
+    if (k < 0) {
+        std::fill(d, d + n, std::numeric_limits<float>::infinity());
+        return;
+    }
+    k = 0;
+    for (size_t q = 0; q < n; q++) {
+        while (z[k + 1] < q) {
+            k++;
+        }
+        const double dq = double(q) - v[k];
+        d[q] = dq * dq + f[v[k]];
+    }
+}
+
+const size_t LinesPerBatch = CacheLineSize / sizeof(float);
+
+} // End anonymous namespace
+
+BitMask ThresholdBits(const VolumeF::Pointer &img, const float lower, const float upper) {
+    BitMask mask(RegionSize(img.GetPointer()));
+    const float *data = img->GetBufferPointer();
+    for (size_t i = 0; i < mask.voxels(); i++) {
+        if (data[i] >= lower && data[i] <= upper) {
+            mask.set(i);
+        }
+    }
     return mask;
 }
 
+/*
+ * Maximises the between-class variance over a histogram of the finite voxels, and returns the
+ * top edge of the last background bin.
+ */
+float OtsuThreshold(const VolumeF::Pointer &img, const int bins) {
+    const float *data = img->GetBufferPointer();
+    const size_t n = img->GetBufferedRegion().GetNumberOfPixels();
+    float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+    for (size_t i = 0; i < n; i++) {
+        if (std::isfinite(data[i])) {
+            lo = std::min(lo, data[i]);
+            hi = std::max(hi, data[i]);
+        }
+    }
+    if (!(hi > lo)) {
+        return lo;
+    }
+    const double width = (double(hi) - lo) / bins;
+    std::vector<double> histogram(bins, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (std::isfinite(data[i])) {
+            histogram[std::min(bins - 1, int((data[i] - lo) / width))]++;
+        }
+    }
+    double total = 0, sum_all = 0;
+    for (int b = 0; b < bins; b++) {
+        total += histogram[b];
+        sum_all += b * histogram[b];
+    }
+    double w0 = 0, sum0 = 0, best = -1;
+    int best_bin = 0;
+    for (int b = 0; b < bins; b++) {
+        w0 += histogram[b];
+        sum0 += b * histogram[b];
+        const double w1 = total - w0;
+        if (w0 == 0) {
+            continue;
+        }
+        if (w1 == 0) {
+            break;
+        }
+        const double m0 = sum0 / w0, m1 = (sum_all - sum0) / w1;
+        const double between = w0 * w1 * (m0 - m1) * (m0 - m1);
+        if (between > best) {
+            best = between;
+            best_bin = b;
+        }
+    }
+    return lo + (best_bin + 1) * width;
+}
+
+VolumeI::Pointer MaskImage(const BitMask &mask, const itk::ImageBase<3> *reference) {
+    if (RegionSize(reference) != mask.size()) {
+        QI_EXCEPTION("Mask and reference image are different sizes");
+    }
+    VolumeI::Pointer img = VolumeI::New();
+    img->SetRegions(reference->GetBufferedRegion());
+    img->SetSpacing(reference->GetSpacing());
+    img->SetOrigin(reference->GetOrigin());
+    img->SetDirection(reference->GetDirection());
+    img->Allocate();
+    int *data = img->GetBufferPointer();
+    for (size_t i = 0; i < mask.voxels(); i++) {
+        data[i] = mask.get(i);
+    }
+    return img;
+}
+
+std::vector<float> SquaredDistance(const BitMask &mask, const bool to_set) {
+    const auto &size = mask.size();
+    const size_t n = mask.voxels();
+    std::vector<float> distance(n);
+    for (size_t i = 0; i < n; i++) {
+        distance[i] = (mask.get(i) == to_set) ? 0 : std::numeric_limits<float>::infinity();
+    }
+    ThreadPool &pool = ThreadPool::Global();
+    size_t stride = 1;
+    for (int a = 0; a < 3; a++) {
+        const size_t len = size[a];
+        if (len > 1) {
+            const size_t nLines = n / len;
+            const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nLines));
+            /*
+             * Along y and z each element of a line is in a different row or slice, so neighbouring
+             * lines, which are next to each other in x, are gathered and scattered together and
+             * each cache line of the volume is only fetched once per pass.
+             */
+            const size_t batch = (stride > 1) ? LinesPerBatch : 1;
+            pool.run(nTasks, [&](const size_t t) {
+                std::vector<float> in(len * batch), out(len * batch);
+                std::vector<size_t> v(len);
+                std::vector<double> z(len + 1);
+                const size_t last = (nLines * (t + 1)) / nTasks;
+                for (size_t l = (nLines * t) / nTasks; l < last;) {
+                    const size_t count = std::min(std::min(batch, stride - (l % stride)), last - l);
+                    float *line = distance.data() + (l / stride) * stride * len + (l % stride);
+                    for (size_t i = 0; i < len; i++) {
+                        for (size_t k = 0; k < count; k++) {
+                            in[k * len + i] = line[i * stride + k];
+                        }
+                    }
+                    for (size_t k = 0; k < count; k++) {
+                        Distance1D(&in[k * len], &out[k * len], len, v.data(), z.data());
+                    }
+                    for (size_t i = 0; i < len; i++) {
+                        for (size_t k = 0; k < count; k++) {
+                            line[i * stride + k] = out[k * len + i];
+                        }
+                    }
+                    l += count;
+                }
+            });
+        }
+        stride *= len;
+    }
+    return distance;
+}
+
+BitMask BeyondDistance(const std::vector<float> &sq_distance, const std::array<size_t, 3> &size, const float radius) {
+    BitMask mask(size);
+    const float r2 = radius * radius;
+    for (size_t i = 0; i < mask.voxels(); i++) {
+        if (sq_distance[i] > r2) {
+            mask.set(i);
+        }
+    }
+    return mask;
+}
+
+BitMask Erode(const BitMask &mask, const float radius) {
+    return BeyondDistance(SquaredDistance(mask, false), mask.size(), radius);
+}
+
+BitMask Dilate(const BitMask &mask, const float radius) {
+    const std::vector<float> distance = SquaredDistance(mask, true);
+    BitMask dilated(mask.size());
+    const float r2 = radius * radius;
+    for (size_t i = 0; i < mask.voxels(); i++) {
+        if (distance[i] <= r2) {
+            dilated.set(i);
+        }
+    }
+    return dilated;
+}
+
+BitMask Close(const BitMask &mask, const float radius) {
+    return Erode(Dilate(mask, radius), radius);
+}
+
+/*
+ * A voxel takes the provisional label of its x neighbour, or a new one, and is merged with its
+ * y and z neighbours. The provisional labels are then resolved in one more pass.
+ */
+std::vector<size_t> Components(const BitMask &mask, std::vector<uint32_t> &labels) {
+    const size_t nx = mask.size()[0], nxy = nx * mask.size()[1], n = mask.voxels();
+    labels.assign(n, 0);
+    std::vector<uint32_t> parent(1, 0);
+    std::vector<size_t> sizes(1, 0);
+    auto find = [&](uint32_t l) -> uint32_t {
+        while (parent[l] != l) {
+            parent[l] = parent[parent[l]];
+            l = parent[l];
+        }
+        return l;
+    };
+    auto unite = [&](const uint32_t a, const uint32_t b) {
+        uint32_t ra = find(a), rb = find(b);
+        if (ra != rb) {
+            if (sizes[ra] < sizes[rb]) {
+                std::swap(ra, rb);
+            }
+            parent[rb] = ra;
+            sizes[ra] += sizes[rb];
+        }
+    };
+    for (size_t i = 0; i < n; i++) {
+        if (!mask.get(i)) {
+            continue;
+        }
+        uint32_t l = 0;
+        auto merge = [&](const uint32_t m) {
+            if (m) {
+                if (l) {
+                    unite(l, m);
+                } else {
+                    l = m;
+                }
+            }
+        };
+        if (i % nx > 0)         merge(labels[i - 1]);
+        if ((i % nxy) >= nx)    merge(labels[i - nx]);
+        if (i >= nxy)           merge(labels[i - nxy]);
+        if (l == 0) {
+            l = parent.size();
+            parent.push_back(l);
+            sizes.push_back(0);
+        }
+        labels[i] = l;
+        sizes[find(l)]++;
+    }
+    std::vector<uint32_t> roots;
+    for (uint32_t l = 1; l < parent.size(); l++) {
+        if (find(l) == l) {
+            roots.push_back(l);
+        }
+    }
+    std::stable_sort(roots.begin(), roots.end(), [&](const uint32_t a, const uint32_t b) { return sizes[a] > sizes[b]; });
+    std::vector<uint32_t> final_label(parent.size(), 0);
+    std::vector<size_t> final_sizes(roots.size());
+    for (size_t r = 0; r < roots.size(); r++) {
+        final_label[roots[r]] = r + 1;
+        final_sizes[r] = sizes[roots[r]];
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (labels[i]) {
+            labels[i] = final_label[find(labels[i])];
+        }
+    }
+    return final_sizes;
+}
+
+BitMask LargestComponent(const BitMask &mask, size_t &size) {
+    std::vector<uint32_t> labels;
+    const std::vector<size_t> sizes = Components(mask, labels);
+    size = sizes.empty() ? 0 : sizes[0];
+    BitMask largest(mask.size());
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (labels[i] == 1) {
+            largest.set(i);
+        }
+    }
+    return largest;
+}
+
+VolumeI::Pointer ThresholdMask(const VolumeF::Pointer &img, const float lower, const float upper) {
+    return MaskImage(ThresholdBits(img, lower, upper), img.GetPointer());
+}
+
+VolumeI::Pointer OtsuMask(const VolumeF::Pointer &img) {
+    const float threshold = OtsuThreshold(img);
+    return ThresholdMask(img, std::nextafter(threshold, std::numeric_limits<float>::infinity()));
+}
+
 std::vector<float> FindLabels(const QI::VolumeI::Pointer &mask, const int size_threshold, const int to_keep, QI::VolumeI::Pointer &labels) {
-    auto CC = itk::ConnectedComponentImageFilter<QI::VolumeI, QI::VolumeI>::New();
-    auto relabel = itk::RelabelComponentImageFilter<QI::VolumeI, QI::VolumeI>::New();
-    CC->SetInput(mask);
-    relabel->SetInput(CC->GetOutput());
-    relabel->Update();
-    // Relabel sorts on size by default, so now work out how many make the size threshold
-    auto label_sizes = relabel->GetSizeOfObjectsInPixels();
+    std::vector<uint32_t> components;
+    const std::vector<size_t> label_sizes = Components(NonZero(mask), components);
+    // Components are sorted on size, so now work out how many make the size threshold
     std::vector<float> kept_sizes;
     for (int i = 0; i < to_keep && i < label_sizes.size(); i++) {
         if (label_sizes[i] < size_threshold) {
@@ -66,16 +373,16 @@ std::vector<float> FindLabels(const QI::VolumeI::Pointer &mask, const int size_t
     if (kept_sizes.size() == 0) {
         QI_EXCEPTION("No labels found in mask");
     }
-
-    typedef itk::LabelShapeKeepNObjectsImageFilter<QI::VolumeI> TKeepN;
-    TKeepN::Pointer keepN = TKeepN::New();
-    keepN->SetInput(relabel->GetOutput());
-    keepN->SetBackgroundValue(0);
-    keepN->SetNumberOfObjects(kept_sizes.size());
-    keepN->SetAttribute(TKeepN::LabelObjectType::NUMBER_OF_PIXELS);
-    keepN->Update();
-    labels = keepN->GetOutput();
-    labels->DisconnectPipeline();
+    labels = VolumeI::New();
+    labels->SetRegions(mask->GetBufferedRegion());
+    labels->SetSpacing(mask->GetSpacing());
+    labels->SetOrigin(mask->GetOrigin());
+    labels->SetDirection(mask->GetDirection());
+    labels->Allocate();
+    int *data = labels->GetBufferPointer();
+    for (size_t i = 0; i < components.size(); i++) {
+        data[i] = (components[i] <= kept_sizes.size()) ? components[i] : 0;
+    }
     return kept_sizes;
 }
 
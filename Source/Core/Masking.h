@@ -12,10 +12,62 @@
 #ifndef QUIT_MASKING_H
 #define QUIT_MASKING_H
 
+#include <array>
+#include <vector>
+#include <limits>
+#include <cstdint>
+
 #include "ImageTypes.h"
 
 namespace QI {
 
+/*
+ * A binary volume stored x fastest at one bit per voxel, so the intermediate masks of a
+ * pipeline are 32 times smaller than a VolumeI. Writes to neighbouring voxels can share a word,
+ * so only fill one from a single thread.
+ */
+class BitMask {
+public:
+    BitMask(const std::array<size_t, 3> &size);
+
+    const std::array<size_t, 3> &size() const;
+    size_t voxels() const;
+    size_t count() const; // Number of voxels set
+
+    bool get(const size_t i) const { return (m_words[i >> 6] >> (i & 63)) & 1; }
+    void set(const size_t i) { m_words[i >> 6] |= (uint64_t(1) << (i & 63)); }
+    void clear(const size_t i) { m_words[i >> 6] &= ~(uint64_t(1) << (i & 63)); }
+
+protected:
+    std::array<size_t, 3> m_size;
+    std::vector<uint64_t> m_words;
+};
+
+BitMask ThresholdBits(const QI::VolumeF::Pointer &img,
+                      const float lower,
+                      const float upper = std::numeric_limits<float>::infinity());
+float OtsuThreshold(const QI::VolumeF::Pointer &img, const int bins = 128); // Voxels above this are foreground
+VolumeI::Pointer MaskImage(const BitMask &mask, const itk::ImageBase<3> *reference); // 1 inside, 0 outside
+
+/*
+ * Exact squared Euclidean distance in voxels from each voxel to the nearest voxel that is set
+ * (to_set) or clear. Voxels outside the volume do not count. Separable, after Felzenszwalb &
+ * Huttenlocher, Theory of Computing 8 2012, with the lines shared over the global pool.
+ */
+std::vector<float> SquaredDistance(const BitMask &mask, const bool to_set);
+BitMask BeyondDistance(const std::vector<float> &sq_distance, const std::array<size_t, 3> &size, const float radius);
+BitMask Erode(const BitMask &mask, const float radius);  // Ball of radius in voxels
+BitMask Dilate(const BitMask &mask, const float radius);
+BitMask Close(const BitMask &mask, const float radius);
+
+/*
+ * Face-connected components of a mask in one pass with union-find, sizes accumulated as they
+ * merge. Labels are numbered from 1 in descending order of size, 0 is background, and the sizes
+ * (in voxels) of label l are in element l - 1.
+ */
+std::vector<size_t> Components(const BitMask &mask, std::vector<uint32_t> &labels);
+BitMask LargestComponent(const BitMask &mask, size_t &size);
+
 VolumeI::Pointer ThresholdMask(const QI::VolumeF::Pointer &img,
                                const float lower,
                                const float upper = std::numeric_limits<float>::infinity());
@@ -24,4 +76,4 @@ std::vector<float> FindLabels(const QI::VolumeI::Pointer &mask, const int size_t
 
 } // End namespace QI
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+/*
+ *  NNLS.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "NNLS.h"
+
+namespace QI {
+
+namespace {
+
+/*
+ * Unconstrained solution on the passive set, zero elsewhere
+ */
+void PassiveSolve(const Eigen::MatrixXd &G, const Eigen::VectorXd &g, const ArrayXb &passive,
+                  std::vector<Eigen::Index> &indices, Eigen::VectorXd &s)
+{
+    indices.clear();
+    for (Eigen::Index i = 0; i < passive.rows(); i++) {
+        if (passive[i]) indices.push_back(i);
+    }
+    const Eigen::Index np = indices.size();
+    Eigen::MatrixXd Gp(np, np);
+    Eigen::VectorXd gp(np);
+    for (Eigen::Index i = 0; i < np; i++) {
+        gp[i] = g[indices[i]];
+        for (Eigen::Index j = 0; j < np; j++) {
+            Gp(i, j) = G(indices[i], indices[j]);
+        }
+    }
+    const Eigen::VectorXd sp = Gp.ldlt().solve(gp);
+    s.setZero();
+    for (Eigen::Index i = 0; i < np; i++) {
+        s[indices[i]] = sp[i];
+    }
+}
+
+} // End anonymous namespace
+
+int NNLS(const Eigen::MatrixXd &G, const Eigen::VectorXd &g, Eigen::VectorXd &x, ArrayXb &passive,
+         const int maxIterations)
+{
+    const Eigen::Index n = g.rows();
+    const double tol = 10 * std::numeric_limits<double>::epsilon() * G.diagonal().maxCoeff() * n;
+    if (passive.rows() != n) {
+        passive = ArrayXb::Constant(n, false);
+    }
+    x = Eigen::VectorXd::Zero(n);
+    Eigen::VectorXd s(n);
+    std::vector<Eigen::Index> indices;
+    indices.reserve(n);
+    int solves = 0;
+    bool warm = passive.any(); // Start with the inner loop to make the warm start feasible
+    while (solves < maxIterations) {
+        if (!warm) {
+            const Eigen::VectorXd w = g - G * x;
+            Eigen::Index best = -1;
+            double wmax = tol;
+            for (Eigen::Index i = 0; i < n; i++) {
+                if (!passive[i] && w[i] > wmax) {
+                    wmax = w[i];
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                break; // The KKT conditions hold
+            }
+            passive[best] = true;
+        }
+        warm = false;
+        for (;;) {
+            PassiveSolve(G, g, passive, indices, s);
+            solves++;
+            double alpha = std::numeric_limits<double>::infinity();
+            for (const auto i : indices) {
+                if (s[i] <= tol) {
+                    alpha = std::min(alpha, (x[i] > s[i]) ? x[i] / (x[i] - s[i]) : 0.);
+                }
+            }
+            if (alpha == std::numeric_limits<double>::infinity() || solves >= maxIterations) {
+                break;
+            }
+            x += alpha * (s - x);
+            for (const auto i : indices) {
+                if (x[i] <= tol) {
+                    passive[i] = false;
+                    x[i] = 0;
+                }
+            }
+        }
+        x = s.cwiseMax(0.);
+    }
+    return solves;
+}
+
+double NNLSCost(const Eigen::MatrixXd &G, const Eigen::VectorXd &g, const double btb, const Eigen::VectorXd &x) {
+    return std::max(0., x.dot(G * x) - 2 * x.dot(g) + btb);
+}
+
+} // End namespace QI
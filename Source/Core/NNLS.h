@@ -0,0 +1,38 @@
+/*
+ *  NNLS.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_NNLS_H
+#define QI_NNLS_H
+
+#include <Eigen/Dense>
+
+namespace QI {
+
+typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
+
+/*
+ * Non-negative least-squares with the fast active-set method of Bro & De Jong, which only needs
+ * the normal equations G = AᵀA (plus μI for Tikhonov regularisation) and g = Aᵀb. G can then be
+ * computed once for a whole dictionary. On entry passive holds the components expected to be
+ * non-zero, e.g. from a similar problem, which often removes most of the iterations, and on exit
+ * it holds those of the solution. Returns the number of least-squares solves.
+ */
+int NNLS(const Eigen::MatrixXd &G, const Eigen::VectorXd &g, Eigen::VectorXd &x, ArrayXb &passive,
+         const int maxIterations = 500);
+
+/*
+ * The residual |Ax - b|² from the normal equations, without A or b
+ */
+double NNLSCost(const Eigen::MatrixXd &G, const Eigen::VectorXd &g, const double btb, const Eigen::VectorXd &x);
+
+} // End namespace QI
+
+#endif // QI_NNLS_H
@@ -0,0 +1,172 @@
+/*
+ *  Pack.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstring>
+#include "Pack.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+enum : uint8_t { Stored = 0, ShuffledLZ = 1 };
+
+const size_t MinMatch = 4;
+const size_t LastLiterals = 5;  // As LZ4, the last bytes are always literals
+const size_t MatchLimit = 12;   // and no match starts this close to the end
+const size_t MaxOffset = 65535;
+const int HashBits = 12;
+
+inline uint32_t Read32(const uint8_t *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t Hash(const uint32_t v) {
+    return (v * 2654435761u) >> (32 - HashBits);
+}
+
+void PutLength(size_t length, std::vector<uint8_t> &out) {
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<uint8_t>(length));
+}
+
+/* One sequence of the LZ4 block format, literals then (unless this is the last) a match */
+void PutSequence(const uint8_t *literals, const size_t nLiterals, const size_t offset, const size_t matchLength,
+                 std::vector<uint8_t> &out) {
+    const size_t extra = matchLength ? matchLength - MinMatch : 0;
+    out.push_back(static_cast<uint8_t>(((nLiterals < 15 ? nLiterals : 15) << 4) | (extra < 15 ? extra : 15)));
+    if (nLiterals >= 15) PutLength(nLiterals - 15, out);
+    out.insert(out.end(), literals, literals + nLiterals);
+    if (matchLength) {
+        out.push_back(static_cast<uint8_t>(offset & 0xFF));
+        out.push_back(static_cast<uint8_t>(offset >> 8));
+        if (extra >= 15) PutLength(extra - 15, out);
+    }
+}
+
+/* Greedy matching on a hash of the next four bytes. The search skips faster through data that does not match. */
+void Compress(const uint8_t *src, const size_t n, std::vector<uint8_t> &out) {
+    size_t anchor = 0;
+    if (n > MatchLimit) {
+        std::vector<uint32_t> table(size_t(1) << HashBits, 0);
+        const size_t limit = n - MatchLimit;
+        size_t ip = 1;
+        while (ip < limit) {
+            const uint32_t v = Read32(src + ip);
+            const uint32_t h = Hash(v);
+            const size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(ip);
+            if (ip - candidate <= MaxOffset && Read32(src + candidate) == v) {
+                size_t length = MinMatch;
+                while (ip + length < n - LastLiterals && src[candidate + length] == src[ip + length]) {
+                    length++;
+                }
+                PutSequence(src + anchor, ip - anchor, ip - candidate, length, out);
+                ip += length;
+                anchor = ip;
+            } else {
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+    PutSequence(src + anchor, n - anchor, 0, 0, out);
+}
+
+size_t GetLength(const uint8_t *src, const size_t size, size_t &ip) {
+    size_t length = 0;
+    uint8_t b;
+    do {
+        if (ip >= size) QI_EXCEPTION("Packed data is truncated");
+        b = src[ip++];
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+void Decompress(const uint8_t *src, const size_t size, uint8_t *dst, const size_t n) {
+    size_t ip = 0, op = 0;
+    while (ip < size) {
+        const uint8_t token = src[ip++];
+        size_t nLiterals = token >> 4;
+        if (nLiterals == 15) nLiterals += GetLength(src, size, ip);
+        if (ip + nLiterals > size || op + nLiterals > n) QI_EXCEPTION("Packed data is corrupt");
+        std::memcpy(dst + op, src + ip, nLiterals);
+        ip += nLiterals;
+        op += nLiterals;
+        if (ip == size) break; // The last sequence has no match
+        if (ip + 2 > size) QI_EXCEPTION("Packed data is truncated");
+        const size_t offset = src[ip] | (size_t(src[ip + 1]) << 8);
+        ip += 2;
+        size_t length = (token & 15) + MinMatch;
+        if ((token & 15) == 15) length += GetLength(src, size, ip);
+        if (offset == 0 || offset > op || op + length > n) QI_EXCEPTION("Packed data is corrupt");
+        const uint8_t *match = dst + op - offset;
+        if (offset >= length) {
+            std::memcpy(dst + op, match, length);
+        } else {
+            // The match overlaps what it writes, e.g. a run of one byte, so copy forwards
+            for (size_t i = 0; i < length; i++) {
+                dst[op + i] = match[i];
+            }
+        }
+        op += length;
+    }
+    if (op != n) QI_EXCEPTION("Packed data unpacked to " << op << " bytes instead of " << n);
+}
+
+} // End anonymous namespace
+
+void PackBytes(const void *data, const size_t count, const size_t width, std::vector<uint8_t> &packed) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    const size_t n = count * width;
+    std::vector<uint8_t> shuffled(n);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t b = 0; b < width; b++) {
+            shuffled[b * count + i] = bytes[i * width + b];
+        }
+    }
+    packed.clear();
+    packed.push_back(ShuffledLZ);
+    Compress(shuffled.data(), n, packed);
+    if (packed.size() > n) {
+        packed.assign(1, Stored);
+        packed.insert(packed.end(), bytes, bytes + n);
+    }
+}
+
+void UnpackBytes(const uint8_t *packed, const size_t size, void *data, const size_t count, const size_t width,
+                 std::vector<uint8_t> &scratch) {
+    const size_t n = count * width;
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    if (size == 0) QI_EXCEPTION("Packed data is empty");
+    if (packed[0] == Stored) {
+        if (size != n + 1) QI_EXCEPTION("Packed data holds " << size - 1 << " bytes instead of " << n);
+        std::memcpy(bytes, packed + 1, n);
+        return;
+    } else if (packed[0] != ShuffledLZ) {
+        QI_EXCEPTION("Packed data has unknown format " << int(packed[0]));
+    }
+    std::vector<uint8_t> &shuffled = scratch;
+    shuffled.resize(n);
+    Decompress(packed + 1, size - 1, shuffled.data(), n);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t b = 0; b < width; b++) {
+            bytes[i * width + b] = shuffled[b * count + i];
+        }
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,37 @@
+/*
+ *  Pack.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PACK_H
+#define QI_PACK_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace QI {
+
+/*
+ * Fast lossless compression of arrays of numbers held in memory, e.g. image data. The bytes of
+ * the count values of width bytes each are first shuffled so byte b of every value is together,
+ * which puts the slowly changing sign and exponent bytes of floats next to each other, and then
+ * compressed with a byte-oriented LZ77 in the LZ4 block format. If that does not make the data
+ * smaller it is stored as it is, so packing never costs more than one byte.
+ */
+void PackBytes(const void *data, const size_t count, const size_t width, std::vector<uint8_t> &packed);
+
+/* Unpacks into data, which must hold the count values of width bytes that were packed. Scratch is
+ * for the shuffled bytes, so unpacking many arrays in turn can re-use it instead of allocating. */
+void UnpackBytes(const uint8_t *packed, const size_t size, void *data, const size_t count, const size_t width,
+                 std::vector<uint8_t> &scratch);
+
+} // End namespace QI
+
+#endif // QI_PACK_H
@@ -18,34 +18,162 @@
 #include <iostream>
 #include <atomic>
 #include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <algorithm>
 
 #include <Eigen/Dense>
 
 #include "Util.h"
+#include "ThreadPool.h"
 
 namespace QI {
 
 typedef Eigen::Array<bool, Eigen::Dynamic, 1> ArrayXb;
 
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x, Eigen::ArrayXd::Index N);
-std::vector<size_t> index_partial_sort(const Eigen::Ref<Eigen::ArrayXd> &x, Eigen::ArrayXd::Index N)
+/*
+ * The indices of the N smallest values of x, in order, in the first N entries of indices. Only the
+ * best N are sorted, and indices is reused so nothing is allocated once it is big enough. Equal
+ * values are ordered by index, so the result does not depend on how the work was split.
+ */
+inline void index_partial_sort(const Eigen::Ref<const Eigen::ArrayXd> &x, const Eigen::Index N, std::vector<size_t> &indices)
 {
-	eigen_assert(x.size() >= N);
-    std::vector<size_t> allIndices(x.size()), indices(N);
-    for(size_t i = 0; i < allIndices.size(); i++) {
-		allIndices[i] = i;
+    eigen_assert(x.size() >= N);
+    indices.resize(x.size());
+    for (size_t i = 0; i < indices.size(); i++) {
+        indices[i] = i;
     }
-	partial_sort(allIndices.begin(), allIndices.begin() + N, allIndices.end(),
-	             [&x](size_t i1, size_t i2) { return x[i1] < x[i2]; });
-    for (Eigen::ArrayXd::Index i = 0; i < N; i++) {
-		indices[i] = allIndices[i];
-	}
-    return indices;
+    auto cmp = [&x](size_t i1, size_t i2) { return x[i1] < x[i2] || (x[i1] == x[i2] && i1 < i2); };
+    if (N < x.size()) {
+        std::nth_element(indices.begin(), indices.begin() + N, indices.end(), cmp);
+    }
+    std::sort(indices.begin(), indices.begin() + N, cmp);
+}
+
+/*
+ * The same, with x split over the global pool in chunks of grain values. Each chunk picks its own
+ * best N, and the best N overall are picked from those candidates. Not from inside a task of the
+ * pool, as it waits for the chunks.
+ */
+inline void index_partial_sort(const Eigen::Ref<const Eigen::ArrayXd> &x, const Eigen::Index N, std::vector<size_t> &indices,
+                               std::vector<size_t> &candidates, const size_t grain)
+{
+    eigen_assert(x.size() >= N);
+    const size_t n = x.size();
+    const size_t chunk = std::max<size_t>(grain, N);
+    if (n <= chunk) {
+        index_partial_sort(x, N, indices);
+        return;
+    }
+    indices.resize(n);
+    auto cmp = [&x](size_t i1, size_t i2) { return x[i1] < x[i2] || (x[i1] == x[i2] && i1 < i2); };
+    ThreadPool::Global().parallelFor(0, n, chunk, [&](const size_t first, const size_t last) {
+        for (size_t i = first; i < last; i++) {
+            indices[i] = i;
+        }
+        if (first + N < last) {
+            std::nth_element(indices.begin() + first, indices.begin() + first + N, indices.begin() + last, cmp);
+        }
+    });
+    candidates.clear();
+    for (size_t first = 0; first < n; first += chunk) {
+        const size_t keep = std::min<size_t>(N, n - first);
+        candidates.insert(candidates.end(), indices.begin() + first, indices.begin() + first + keep);
+    }
+    std::nth_element(candidates.begin(), candidates.begin() + N, candidates.end(), cmp);
+    std::sort(candidates.begin(), candidates.begin() + N, cmp);
+    std::copy(candidates.begin(), candidates.begin() + N, indices.begin());
 }
 
+/*
+ * Counter-based generator producing doubles in [0,1). Each output is a hash of the key and its
+ * position in the stream, so seeding costs one hash and there is no state shared between streams.
+ * Give each voxel its own stream with VoxelSeed, then its samples do not depend on which thread
+ * fits it or in which order. The hash is the SplitMix64 finaliser, as in CounterNoise.
+ */
+class BatchRNG {
+    uint64_t m_key, m_counter = 0;
+
+public:
+    static uint64_t Mix(uint64_t z) {
+        z += 0x9E3779B97F4A7C15ULL;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    explicit BatchRNG(const uint64_t seed) : m_key(Mix(seed)) {}
+
+    // The outputs do not depend on each other, so this loop can be vectorised
+    void uniform(double *out, const size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = at(m_counter + i);
+        }
+        m_counter += n;
+    }
+
+    // Box-Muller, one pair of uniforms for each pair of normals. Works in place, as it is also
+    // called for single values when re-drawing samples outside the bounds.
+    void normal(double *out, const size_t n) {
+        const size_t half = (n + 1) / 2;
+        for (size_t i = 0; i < n; i++) {
+            const size_t j = (i < half) ? i : i - half;
+            const double r = std::sqrt(-2. * std::log(1. - at(m_counter + j))); // 1 - u1 is in (0,1]
+            const double theta = (2. * M_PI) * at(m_counter + half + j);
+            out[i] = (i < half) ? r * std::cos(theta) : r * std::sin(theta);
+        }
+        m_counter += 2 * half;
+    }
+
+private:
+    double at(const uint64_t i) const {
+        return (Mix(m_key ^ Mix(i)) >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+/*
+ * The seed for one voxel's generator, from the seed for the whole image and the voxel's index.
+ * Stage separates several optimisations of the same voxel.
+ */
+template<typename TIndex>
+uint64_t VoxelSeed(const uint64_t seed, const TIndex &index, const uint64_t stage = 0) {
+    uint64_t s = BatchRNG::Mix(seed + stage);
+    for (unsigned int d = 0; d < TIndex::IndexDimension; d++) {
+        s = BatchRNG::Mix(s ^ static_cast<uint64_t>(index[d]));
+    }
+    return s;
+}
+
+/*
+ * Radical inverse of i in the given base, the i'th point of a Halton sequence along one dimension
+ */
+inline double RadicalInverse(size_t i, const unsigned base) {
+    const double inv = 1.0 / base;
+    double f = inv, r = 0;
+    while (i > 0) {
+        r += f * (i % base);
+        i /= base;
+        f *= inv;
+    }
+    return r;
+}
+
+/*
+ * Functors can provide batch(samples, residuals) to evaluate every sample of a contraction at
+ * once (one sample per column), otherwise operator() is called for each sample. Both arguments are
+ * blocks of the workspace, so take them as Eigen::Ref to avoid a copy.
+ */
+template<typename F>
+class HasBatch {
+    template<typename T> static auto test(int) -> decltype(std::declval<const T &>().batch(std::declval<const Eigen::Ref<const Eigen::ArrayXXd> &>(), std::declval<Eigen::Ref<Eigen::ArrayXd>>()), std::true_type());
+    template<typename> static std::false_type test(...);
+public:
+    static const bool value = decltype(test<F>(0))::value;
+};
+
 enum class RCStatus {
 	NotStarted = -1,
-	Converged, NoImprovement, IterationLimit, ErrorInvalid, ErrorResidual
+	Converged, NoImprovement, IterationLimit, ErrorInvalid, ErrorResidual, Plateau
 };
 
 std::ostream& operator<<(std::ostream &os, const RCStatus &s) {
@@ -56,28 +184,61 @@ std::ostream& operator<<(std::ostream &os, const RCStatus &s) {
 		case RCStatus::IterationLimit: os << "Reached iteration limit"; break;
 		case RCStatus::ErrorInvalid: os << "Could not generate valid sample"; break;
 		case RCStatus::ErrorResidual: os << "Infinite residual found"; break;
+		case RCStatus::Plateau: os << "Best residual stopped improving"; break;
 	}
 	return os;
 }
 
+/*
+ * The buffers region contraction works in. They only grow, so if each thread passes the same
+ * workspace to every optimisation it runs (e.g. from QI::PerThread) then after the first voxel
+ * nothing is allocated. A workspace is in use from begin() until result(), so problems driven in
+ * lock-step need one each.
+ */
+struct RCWorkspace {
+    Eigen::ArrayXXd samples, retained;               // Parameters x samples, parameters x retained
+    Eigen::ArrayXd residuals, retainedRes, mu, sigma, result, width, previousBest, previousWidth, haltonShift;
+    Eigen::VectorXd sample;                          // For functors and constraints that take one vector
+    std::vector<size_t> indices, candidates;         // For sorting the residuals
+
+    void reserve(const Eigen::Index nP, const Eigen::Index nS, const Eigen::Index nR) {
+        if (samples.rows() != nP || samples.cols() < nS) samples.resize(nP, nS);
+        if (retained.rows() != nP || retained.cols() != nR) retained.resize(nP, nR);
+        if (residuals.size() < nS) residuals.resize(nS);
+        retainedRes.resize(nR);
+        for (Eigen::ArrayXd *a : {&mu, &sigma, &result, &width, &previousBest, &previousWidth, &haltonShift}) {
+            a->resize(nP);
+        }
+        sample.resize(nP);
+        indices.reserve(nS);
+    }
+};
+
 template <typename Functor_t>
 class RegionContraction {
 	private:
 		Functor_t &m_f;
-        std::mt19937_64 m_rng;
+        BatchRNG m_rng;
         Eigen::ArrayXXd m_startBounds, m_currentBounds;
         Eigen::ArrayXd m_threshes;
-		size_t m_nS, m_nR, m_maxContractions, m_contractions;
-		double m_expand, m_SoS;
+		size_t m_nS, m_nR, m_maxContractions, m_contractions, m_samplesUsed = 0;
+		double m_expand, m_SoS, m_plateau = 1e-3;
 		RCStatus m_status;
-		bool m_gaussian, m_debug;
+		bool m_gaussian, m_debug, m_adaptive = false, m_quasi = false;
+		size_t m_haltonIndex = 0;
+		size_t m_parallelGrain = 0; // Samples per task when split over the pool, 0 for never
+		// State of the current optimisation, kept between the steps
+		RCWorkspace m_ownWorkspace, *m_ws = &m_ownWorkspace;
+		size_t m_nSCurrent = 0;
+		double m_previousBestRes = 0;
+		bool m_running = false;
 
     public:
         RegionContraction(Functor_t &f,
                           const Eigen::Ref<Eigen::ArrayXXd> &startBounds, const Eigen::ArrayXd &thresh,
                           const int nS = 5000, const int nR = 50, const int maxContractions = 10,
-                          const double expand = 0., const bool gauss = false, const bool debug = false, const int seed = -1) :
-                m_f(f), m_startBounds(startBounds), m_currentBounds(startBounds),
+                          const double expand = 0., const bool gauss = false, const bool debug = false, const uint64_t seed = 0) :
+                m_f(f), m_rng(seed), m_startBounds(startBounds), m_currentBounds(startBounds),
                 m_threshes(thresh), m_nS(nS), m_nR(nR),
                 m_maxContractions(maxContractions), m_contractions(0), m_expand(expand),
                 m_status(RCStatus::NotStarted), m_gaussian(gauss), m_debug(debug)
@@ -86,13 +247,9 @@ class RegionContraction {
 			eigen_assert(startBounds.cols() == 2);
 			eigen_assert(thresh.rows() == f.inputs());
 			eigen_assert((thresh >= 0.).all() && (thresh <= 1.).all());
-
-			if (seed < 0) {
-                m_rng = std::mt19937_64(RandomSeed());
-			} else {
-                m_rng = std::mt19937_64(seed);
-			}
 		}
+		RegionContraction(const RegionContraction &) = delete; // m_ws may point inside
+		RegionContraction &operator=(const RegionContraction &) = delete;
 		
         const Eigen::ArrayXXd &startBounds() const { return m_startBounds; }
         void setBounds(const Eigen::Ref<Eigen::ArrayXXd> &b) {
@@ -107,28 +264,150 @@ class RegionContraction {
 			m_threshes = t;
 		}
         size_t   contractions() const { return m_contractions; }
+        size_t   samplesUsed() const { return m_samplesUsed; } //!< Samples evaluated by the last optimise()
+
+        /*
+         * In adaptive mode the number of samples for each contraction follows how much the last
+         * one shrank the region, between max(4 nR, nS / 8) and 2 nS, and the optimisation stops
+         * when the best residual improves by less than the plateau fraction.
+         */
+        void setAdaptive(const bool a, const double plateau = 1e-3) { m_adaptive = a; m_plateau = plateau; }
+
+        /*
+         * Draw the uniform samples from a Halton sequence instead, which covers the region more
+         * evenly for the same number of samples. Each optimise() applies a random shift (a
+         * Cranley-Patterson rotation) so different voxels do not see the same points.
+         */
+        void setQuasiRandom(const bool q) { m_quasi = q; }
+
+        /*
+         * Split the evaluation of each contraction's samples, and picking the best of them, over the
+         * global pool in tasks of grain samples. This only happens outside the pool, i.e. when the
+         * caller has chosen to parallelise within a voxel rather than over voxels (ApplyAlgorithmFilter
+         * does when it has fewer voxels than threads). The functor must then be safe to call from
+         * several threads at once. Samples are still drawn in order, so the result is unchanged.
+         */
+        void setParallel(const size_t grain) { m_parallelGrain = grain; }
         RCStatus       status() const { return m_status; }
         const Eigen::ArrayXXd &currentBounds() const { return m_currentBounds; }
 		const double   SoS() const { return m_SoS; }
         Eigen::ArrayXd startWidth() const { return m_startBounds.col(1) - m_startBounds.col(0); }
         Eigen::ArrayXd width() const { return m_currentBounds.col(1) - m_currentBounds.col(0); }
         Eigen::ArrayXd midPoint() const { return (m_currentBounds.rowwise().sum() / 2.); }
-		
-        void optimise(Eigen::Ref<Eigen::ArrayXd> params) {
-            static std::atomic<bool> finiteWarning(false);
-            static std::atomic<bool> constraintWarning(false);
+
+    protected:
+        /*
+         * Fill every column of block with a sample, uniform within the current bounds or from a
+         * normal distribution truncated to them. Parameters with a non-finite sigma are set to mu.
+         */
+        void draw(Eigen::Ref<Eigen::ArrayXXd> block, const bool gaussian) {
+            eigen_assert(block.cols() == 1 || block.outerStride() == block.rows());
+            RCWorkspace &ws = *m_ws;
+            if (!gaussian) {
+                ws.width = m_currentBounds.col(1) - m_currentBounds.col(0);
+            }
+            if (!gaussian && m_quasi) {
+                static const unsigned Primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                                                  59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131};
+                eigen_assert(block.rows() <= 32);
+                for (Eigen::Index s = 0; s < block.cols(); s++) {
+                    m_haltonIndex++;
+                    for (Eigen::Index p = 0; p < block.rows(); p++) {
+                        const double u = RadicalInverse(m_haltonIndex, Primes[p]) + ws.haltonShift[p];
+                        block(p, s) = (u < 1.) ? u : u - 1.;
+                    }
+                }
+                block = (block.colwise() * ws.width).colwise() + m_currentBounds.col(0);
+            } else if (!gaussian) {
+                m_rng.uniform(block.data(), block.size());
+                block = (block.colwise() * ws.width).colwise() + m_currentBounds.col(0);
+            } else {
+                m_rng.normal(block.data(), block.size());
+                block = (block.colwise() * ws.sigma).colwise() + ws.mu;
+                for (Eigen::Index p = 0; p < block.rows(); p++) {
+                    if (!std::isfinite(ws.sigma[p])) {
+                        block.row(p).setConstant(ws.mu[p]);
+                        continue;
+                    }
+                    for (Eigen::Index s = 0; s < block.cols(); s++) {
+                        while ((block(p, s) < m_currentBounds(p, 0)) || (block(p, s) > m_currentBounds(p, 1))) {
+                            double z;
+                            m_rng.normal(&z, 1);
+                            block(p, s) = ws.mu[p] + ws.sigma[p] * z;
+                        }
+                    }
+                }
+            }
+        }
+
+        bool parallel() const {
+            return m_parallelGrain > 0 && m_nSCurrent > m_parallelGrain && !ThreadPool::InWorker() &&
+                   ThreadPool::Global().size() > 1;
+        }
+
+        void evaluate(std::true_type) {
+            if (parallel()) {
+                ThreadPool::Global().parallelFor(0, m_nSCurrent, m_parallelGrain, [this](const size_t first, const size_t last) {
+                    m_f.batch(m_ws->samples.middleCols(first, last - first), m_ws->residuals.segment(first, last - first));
+                });
+            } else {
+                m_f.batch(m_ws->samples.leftCols(m_nSCurrent), m_ws->residuals.head(m_nSCurrent));
+            }
+        }
+        void evaluate(std::false_type) {
+            if (parallel()) {
+                ThreadPool::Global().parallelFor(0, m_nSCurrent, m_parallelGrain, [this](const size_t first, const size_t last) {
+                    Eigen::VectorXd sample(m_ws->samples.rows());
+                    for (size_t s = first; s < last; s++) {
+                        sample = m_ws->samples.col(s).matrix();
+                        m_ws->residuals[s] = m_f(sample);
+                    }
+                });
+            } else {
+                for (size_t s = 0; s < m_nSCurrent; s++) {
+                    m_ws->sample = m_ws->samples.col(s).matrix();
+                    m_ws->residuals[s] = m_f(m_ws->sample);
+                }
+            }
+        }
+
+    public:
+        /*
+         * Optimise one problem, or drive several in lock-step (e.g. to evaluate the samples of many
+         * voxels in one call) with begin(), then nextSamples() until it returns false, passing the
+         * residuals of those samples to update() each time, and finally result(). Without a
+         * workspace the optimiser uses its own, which is allocated afresh for every object.
+         */
+        void optimise(Eigen::Ref<Eigen::ArrayXd> params) { optimise(params, m_ownWorkspace); }
+        void optimise(Eigen::Ref<Eigen::ArrayXd> params, RCWorkspace &ws) {
+            if (begin(ws)) {
+                while (nextSamples()) {
+                    evaluate(std::integral_constant<bool, HasBatch<Functor_t>::value>());
+                    update(m_ws->residuals.head(m_nSCurrent));
+                }
+            }
+            result(params);
+        }
+
+        // False if the start bounds do not make sense, result() is then zero
+        bool begin() { return begin(m_ownWorkspace); }
+        bool begin(RCWorkspace &ws) {
             static std::atomic<bool> boundsWarning(false);
             std::mutex warn_mtx;
 
-			eigen_assert(m_f.inputs() == params.size());
-			int nP = static_cast<int>(params.size());
-            Eigen::ArrayXXd samples(m_f.inputs(), m_nS);
-            Eigen::ArrayXXd retained(m_f.inputs(), m_nR);
-            Eigen::ArrayXd residuals(m_nS);
-            Eigen::ArrayXd retainedRes(m_nR);
-            Eigen::ArrayXd gauss_mu(m_f.inputs()), gauss_sigma(m_f.inputs());
-            std::vector<size_t> indices(m_nR);
+            m_ws = &ws;
+            ws.reserve(m_f.inputs(), m_adaptive ? std::max(2 * m_nS, 4 * m_nR) : m_nS, m_nR);
+            ws.retained.col(0).setConstant(std::numeric_limits<double>::quiet_NaN()); // Never equal to the first best
 			m_currentBounds = m_startBounds;
+			m_samplesUsed = 0;
+			m_contractions = 0;
+			m_running = false;
+			if (m_quasi) {
+				m_haltonIndex = 0;
+				m_rng.uniform(ws.haltonShift.data(), ws.haltonShift.size());
+			}
+			m_nSCurrent = m_nS;
+			m_previousBestRes = std::numeric_limits<double>::infinity();
 			if ((m_startBounds != m_startBounds).any() ||
                 (m_startBounds >= std::numeric_limits<double>::infinity()).any() ||
 			    (m_startBounds.col(1) < m_startBounds.col(0)).any()) {
@@ -140,10 +419,9 @@ class RegionContraction {
                     std::cerr << "This warning will only be printed once." << std::endl;
 				}
 				warn_mtx.unlock();
-				params.setZero();
+				ws.result.setZero();
 				m_status = RCStatus::ErrorInvalid;
-
-				return;
+				return false;
 			}
 
 			if (m_debug) {
@@ -151,133 +429,167 @@ class RegionContraction {
                 std::cout << "START REGION CONTRACTION" << std::endl;
                 std::cout << "Start Boundaries: " << std::endl << m_startBounds.transpose() << std::endl;
 			}
-			
-            std::uniform_real_distribution<double> uniform(0., 1.);
 			m_status = RCStatus::IterationLimit;
-			for (m_contractions = 0; m_contractions < m_maxContractions; m_contractions++) {
-				size_t startSample = 0;
-				/*if (m_contractions > 0) {
-					// Keep the retained samples to prevent boundary contracting too fast
-					for (size_t s = 0; s < m_nR; s++) {
-						samples.col(s) = retained.col(s);
-						residuals.col(s) = retainedRes.col(s);
-					}
-					startSample = m_nR;
-				}*/
-				for (size_t s = startSample; s < m_nS; s++) {
-                    Eigen::ArrayXd tempSample(nP);
-					size_t nTries = 0;
-					do {
-						if (!m_gaussian || (m_contractions == 0)) {
-							for (int p = 0; p < nP; p++) {
-								tempSample(p) = uniform(m_rng);
-							}
-							tempSample *= width();
-							tempSample += m_currentBounds.col(0);
-						} else {
-							for (int p = 0; p < nP; p++) {
-                                if (std::isfinite(gauss_sigma(p))) {
-                                    std::normal_distribution<double> gauss(gauss_mu(p), gauss_sigma(p));
-									do {
-										tempSample(p) = gauss(m_rng);
-									} while ((tempSample(p) < m_currentBounds(p, 0)) || (tempSample(p) > m_currentBounds(p, 1)));
-								} else {
-									tempSample(p) = gauss_mu(p);
-								}
-							}
-						}
-						nTries++;
-						if (nTries > 100) {
-							warn_mtx.lock();
-							if (!constraintWarning) {
-								constraintWarning = true;
-                                std::cerr << "Warning: Cannot fulfill sample constraints after " << std::to_string(nTries) << " attempts, giving up." << std::endl
-                                          << "Last attempt was: " << tempSample.transpose() << std::endl
-                                          << "This warning will only be printed once." << std::endl;
-							}
-							warn_mtx.unlock();
-							params.setZero();
-							m_status = RCStatus::ErrorInvalid;
-							return;
-						}
-					} while (!m_f.constraint(tempSample));
-					
-                    residuals[s] = m_f(tempSample);
-                    if (!std::isfinite(residuals[s])) {
-						warn_mtx.lock();
-						if (!finiteWarning) {
-							finiteWarning = true;
-							std::cout << "Warning: Non-finite residual found!" << std::endl
-                                      << "Result may be meaningless. This warning will only be printed once." << std::endl
-                                      << "Parameters were " << tempSample.transpose() << std::endl;
-						}
-						warn_mtx.unlock();
-						params = retained.col(0);
-						m_status = RCStatus::ErrorResidual;
-						return;
-					}
-					samples.col(s) = tempSample;
-				}
-                indices = index_partial_sort(residuals, m_nR);
-                Eigen::ArrayXd previousBest = retained.col(0);
-				for (size_t i = 0; i < m_nR; i++) {
-					retained.col(i) = samples.col(indices[i]);
-                    retainedRes(i) = residuals(indices[i]);
-				}
-				// Find the min and max for each parameter in the top nR samples
-				m_currentBounds.col(0) = retained.rowwise().minCoeff();
-				m_currentBounds.col(1) = retained.rowwise().maxCoeff();
-				if (m_gaussian) {
-					gauss_mu = retained.rowwise().mean();
-					gauss_sigma = ((retained.colwise() - gauss_mu).square().rowwise().sum() / (m_f.inputs() - 1)).sqrt();
-				}
-				if (m_debug) {
-                    std::cout << "CONTRACTION:    " << m_contractions << std::endl
-                              << "Retained best: " << retainedRes.minCoeff() << " Worst: " << retainedRes.maxCoeff() << std::endl
-                              << "All best:      " << residuals.minCoeff() << " Worst: " << residuals.maxCoeff() << std::endl
-                              << "Current width%: " << (width() / startWidth()).transpose() << std::endl;
-					//cout << "Thresh        : " << m_threshes.transpose() << std::endl;
-					//cout << "Width < Thresh: " << (width() <= (m_threshes * startWidth())).transpose() << std::endl;
-					//cout << "Converged:      " << (width() <= (m_threshes * startWidth())).all() << std::endl;
-					if (m_gaussian) {
-                        std::cout << "Gaussian mu:    " << gauss_mu.transpose() << std::endl
-                                  << "Gaussian sigma%:"<<  (gauss_sigma / startWidth()).transpose() << std::endl;
-					}
-				}
-				// Terminate if all the desired parameters have converged
-				if ((width() <= (m_threshes * startWidth())).all()) {
-					m_status = RCStatus::Converged;
-					m_contractions++; // Just to give an accurate contraction count.
-					break;
-				} else if ((previousBest == retained.col(0)).all()) {
-					m_status = RCStatus::NoImprovement;
-					m_contractions++; // Just to give an accurate contraction count.
-					break;
-				}
-				
-				if (m_expand != 0) {
-					// Expand the boundaries back out in case we just missed a minima,
-					// but don't go past initial boundaries
-                    Eigen::ArrayXd tempW = width(); // Because altering .col(0) will change width
-					m_currentBounds.col(0) = (m_currentBounds.col(0) - tempW * m_expand).max(m_startBounds.col(0));
-					m_currentBounds.col(1) = (m_currentBounds.col(1) + tempW * m_expand).min(m_startBounds.col(1));
-					if (m_debug) {
-                        std::cout << "Width expanded to: " << width().transpose() << std::endl;
-					}
-				}
-			}
+			m_running = true;
+			return true;
+        }
 
-			if (m_gaussian) {
-				params = gauss_mu;
-			} else {
-				// Return the best evaluated solution so far
-				params = retained.col(0);
-			}
-            m_SoS = retainedRes(0);
-			if (m_debug) {
+        // Draw the next contraction's samples into samples(), false once the optimisation is over
+        bool nextSamples() {
+            static std::atomic<bool> constraintWarning(false);
+            std::mutex warn_mtx;
+
+            if (!m_running || m_contractions >= m_maxContractions) {
+                finish();
+                return false;
+            }
+            RCWorkspace &ws = *m_ws;
+            const bool gaussian = m_gaussian && (m_contractions > 0);
+            draw(ws.samples.leftCols(m_nSCurrent), gaussian);
+            // Constraints are rare and cheap to check, so only re-draw the samples that fail
+            for (size_t s = 0; s < m_nSCurrent; s++) {
+                size_t nTries = 1;
+                ws.sample = ws.samples.col(s).matrix();
+                while (!m_f.constraint(ws.sample)) {
+                    nTries++;
+                    if (nTries > 100) {
+                        warn_mtx.lock();
+                        if (!constraintWarning) {
+                            constraintWarning = true;
+                            std::cerr << "Warning: Cannot fulfill sample constraints after " << std::to_string(nTries) << " attempts, giving up." << std::endl
+                                      << "Last attempt was: " << ws.samples.col(s).transpose() << std::endl
+                                      << "This warning will only be printed once." << std::endl;
+                        }
+                        warn_mtx.unlock();
+                        ws.result.setZero();
+                        m_status = RCStatus::ErrorInvalid;
+                        m_running = false;
+                        return false;
+                    }
+                    draw(ws.samples.col(s), gaussian);
+                    ws.sample = ws.samples.col(s).matrix();
+                }
+            }
+            return true;
+        }
+        Eigen::Ref<const Eigen::ArrayXXd> samples() const { return m_ws->samples.leftCols(m_nSCurrent); }
+
+        // Contract around the best of samples(), given the residual of each. Returns true when done.
+        bool update(const Eigen::Ref<const Eigen::ArrayXd> &residuals) {
+            static std::atomic<bool> finiteWarning(false);
+            std::mutex warn_mtx;
+
+            RCWorkspace &ws = *m_ws;
+            eigen_assert(static_cast<size_t>(residuals.rows()) == m_nSCurrent);
+            m_samplesUsed += m_nSCurrent;
+            Eigen::Index bad;
+            if (!residuals.isFinite().all()) {
+                (!residuals.isFinite()).maxCoeff(&bad);
+                warn_mtx.lock();
+                if (!finiteWarning) {
+                    finiteWarning = true;
+                    std::cout << "Warning: Non-finite residual found!" << std::endl
+                              << "Result may be meaningless. This warning will only be printed once." << std::endl
+                              << "Parameters were " << ws.samples.col(bad).transpose() << std::endl;
+                }
+                warn_mtx.unlock();
+                ws.result = ws.retained.col(0);
+                m_status = RCStatus::ErrorResidual;
+                m_running = false;
+                return true;
+            }
+            if (parallel()) {
+                index_partial_sort(residuals, m_nR, ws.indices, ws.candidates, m_parallelGrain);
+            } else {
+                index_partial_sort(residuals, m_nR, ws.indices);
+            }
+            ws.previousBest = ws.retained.col(0);
+            ws.previousWidth = m_currentBounds.col(1) - m_currentBounds.col(0);
+            for (size_t i = 0; i < m_nR; i++) {
+                ws.retained.col(i) = ws.samples.col(ws.indices[i]);
+                ws.retainedRes(i) = residuals(ws.indices[i]);
+            }
+            // Find the min and max for each parameter in the top nR samples
+            m_currentBounds.col(0) = ws.retained.rowwise().minCoeff();
+            m_currentBounds.col(1) = ws.retained.rowwise().maxCoeff();
+            ws.width = m_currentBounds.col(1) - m_currentBounds.col(0);
+            if (m_gaussian) {
+                ws.mu = ws.retained.rowwise().mean();
+                ws.sigma = ((ws.retained.colwise() - ws.mu).square().rowwise().sum() / (m_f.inputs() - 1)).sqrt();
+            }
+            if (m_debug) {
+                std::cout << "CONTRACTION:    " << m_contractions << std::endl
+                          << "Retained best: " << ws.retainedRes.minCoeff() << " Worst: " << ws.retainedRes.maxCoeff() << std::endl
+                          << "All best:      " << residuals.minCoeff() << " Worst: " << residuals.maxCoeff() << std::endl
+                          << "Current width%: " << (width() / startWidth()).transpose() << std::endl;
+                if (m_gaussian) {
+                    std::cout << "Gaussian mu:    " << ws.mu.transpose() << std::endl
+                              << "Gaussian sigma%:"<<  (ws.sigma / startWidth()).transpose() << std::endl;
+                }
+            }
+            // Terminate if all the desired parameters have converged
+            m_contractions++; // Counts this one even when stopping, to give an accurate count
+            if ((ws.width <= (m_threshes * (m_startBounds.col(1) - m_startBounds.col(0)))).all()) {
+                m_status = RCStatus::Converged;
+            } else if ((ws.previousBest == ws.retained.col(0)).all()) {
+                m_status = RCStatus::NoImprovement;
+            } else if (m_adaptive && std::isfinite(m_previousBestRes) && (m_previousBestRes - ws.retainedRes(0)) <= m_plateau * m_previousBestRes) {
+                m_status = RCStatus::Plateau;
+            }
+            if (m_status != RCStatus::IterationLimit) {
+                finish();
+                return true;
+            }
+            m_previousBestRes = ws.retainedRes(0);
+            if (m_adaptive) {
+                // A region that halves keeps the same density with the same number of samples
+                const Eigen::Index nFree = (ws.previousWidth > 0).count();
+                if (nFree > 0) {
+                    const double shrink = ((ws.previousWidth > 0).select(ws.width / ws.previousWidth, 0.)).sum() / nFree;
+                    const size_t lowest = std::max(4 * m_nR, m_nS / 8);
+                    m_nSCurrent = std::max(lowest, std::min(2 * m_nS, static_cast<size_t>(2. * shrink * m_nS)));
+                }
+                if (m_debug) std::cout << "Next contraction will use " << m_nSCurrent << " samples" << std::endl;
+            }
+
+            if (m_expand != 0) {
+                // Expand the boundaries back out in case we just missed a minima,
+                // but don't go past initial boundaries
+                m_currentBounds.col(0) = (m_currentBounds.col(0) - ws.width * m_expand).max(m_startBounds.col(0));
+                m_currentBounds.col(1) = (m_currentBounds.col(1) + ws.width * m_expand).min(m_startBounds.col(1));
+                if (m_debug) {
+                    std::cout << "Width expanded to: " << width().transpose() << std::endl;
+                }
+            }
+            if (m_contractions >= m_maxContractions) {
+                finish();
+                return true;
+            }
+            return false;
+        }
+
+        void result(Eigen::Ref<Eigen::ArrayXd> params) const {
+            eigen_assert(m_f.inputs() == params.size());
+            params = m_ws->result;
+        }
+
+    protected:
+        // The Gaussian mean, or the best evaluated solution so far
+        void finish() {
+            if (!m_running) {
+                return;
+            }
+            m_running = false;
+            if (m_gaussian) {
+                m_ws->result = m_ws->mu;
+            } else {
+                m_ws->result = m_ws->retained.col(0);
+            }
+            m_SoS = m_ws->retainedRes(0);
+            if (m_debug) {
                 std::cout << "Finished, contractions = " << m_contractions << std::endl;
-			}
-		}
+            }
+        }
 };
 
 } // End namespace QI
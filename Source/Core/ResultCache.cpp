@@ -0,0 +1,365 @@
+/*
+ *  ResultCache.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "ResultCache.h"
+#include "Macro.h"
+#include "Util.h"
+
+namespace QI {
+
+namespace {
+
+/*
+ * FNV-1a over 64-bit words, with a fold of the high half into the low half each step because
+ * a multiply only carries upwards. Strong enough to tell images apart, and runs at memory speed.
+ */
+typedef uint64_t THash;
+const THash HashStart = 14695981039346656037ULL;
+
+THash HashBytes(const char *data, const size_t n, THash h = HashStart) {
+    const THash prime = 1099511628211ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t w;
+        std::memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * prime;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++) {
+        h = (h ^ static_cast<unsigned char>(data[i])) * prime;
+    }
+    return h;
+}
+
+THash HashString(const std::string &s, const THash h = HashStart) {
+    // Hash the length too, so a list of strings cannot be confused with a different split
+    const uint64_t length = s.size();
+    return HashBytes(s.data(), s.size(), HashBytes(reinterpret_cast<const char *>(&length), sizeof(length), h));
+}
+
+bool HashFile(const std::string &path, THash &h) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::vector<char> buffer(1 << 20); // A multiple of the word size, so chunks chain exactly
+    h = HashStart;
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        h = HashBytes(buffer.data(), file.gcount(), h);
+    }
+    return true;
+}
+
+std::string Hex(const THash h) {
+    std::ostringstream s;
+    s << std::hex << std::setw(16) << std::setfill('0') << h;
+    return s.str();
+}
+
+bool IsFile(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool CopyFile(const std::string &from, const std::string &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    if (!in || !out) {
+        return false;
+    }
+    out << in.rdbuf();
+    return static_cast<bool>(out);
+}
+
+void RemoveEntry(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (dirent *e = readdir(d)) {
+        if (std::strcmp(e->d_name, ".") != 0 && std::strcmp(e->d_name, "..") != 0) {
+            unlink((dir + "/" + e->d_name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+// Serves stdin to the program, first any bytes already read to check an entry, and keeps a copy
+class RecordingInput : public std::streambuf {
+public:
+    RecordingInput(std::streambuf *source, const std::string &pending) : m_source(source), m_pending(pending) {}
+    const std::string &recorded() const { return m_recorded; }
+
+protected:
+    std::streambuf *m_source;
+    std::string m_pending, m_chunk, m_recorded;
+
+    int_type underflow() override {
+        if (!m_pending.empty()) {
+            m_chunk.swap(m_pending);
+            m_pending.clear();
+        } else {
+            // One character at a time, so interactive input is not held up waiting for a full buffer
+            const int_type c = m_source->sbumpc();
+            if (traits_type::eq_int_type(c, traits_type::eof())) {
+                return traits_type::eof();
+            }
+            m_chunk.assign(1, traits_type::to_char_type(c));
+        }
+        m_recorded += m_chunk;
+        setg(&m_chunk[0], &m_chunk[0], &m_chunk[0] + m_chunk.size());
+        return traits_type::to_int_type(m_chunk[0]);
+    }
+};
+
+// Passes stdout through unchanged and keeps a copy to replay on a hit
+class RecordingOutput : public std::streambuf {
+public:
+    RecordingOutput(std::streambuf *sink) : m_sink(sink) {}
+    std::string recorded() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_recorded;
+    }
+
+protected:
+    std::streambuf *m_sink;
+    std::mutex m_mutex; // Progress monitors print from worker threads
+    std::string m_recorded;
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_recorded += traits_type::to_char_type(c);
+        return m_sink->sputc(traits_type::to_char_type(c));
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_recorded.append(s, n);
+        return m_sink->sputn(s, n);
+    }
+    int sync() override { return m_sink->pubsync(); }
+};
+
+struct Cache {
+    std::mutex mutex; // Outputs can be written from the threads of a WriteQueue
+    bool disabled = false, active = false, verbose = false;
+    std::string root, dir;
+    std::vector<std::string> inputs, outputs;
+    std::unique_ptr<RecordingInput> in;
+    std::unique_ptr<RecordingOutput> out;
+    std::streambuf *original_in = nullptr, *original_out = nullptr;
+};
+
+Cache &TheCache() {
+    static Cache cache;
+    return cache;
+}
+
+void AddUnique(std::vector<std::string> &list, const std::string &path) {
+    if (std::find(list.begin(), list.end(), path) == list.end()) {
+        list.push_back(path);
+    }
+}
+
+/*
+ * An entry is a directory named by the key holding a manifest, the outputs (output0 etc.), stdout
+ * and the part of stdin that was read. The manifest lists whether stdin was read, then each input
+ * with its hash and each output with its number.
+ */
+bool UseEntry(const std::string &dir, std::string &pending, const bool verbose) {
+    std::ifstream manifest(dir + "/manifest");
+    if (!manifest) {
+        return false;
+    }
+    bool read_stdin = false;
+    std::string word;
+    std::vector<std::string> outputs;
+    while (manifest >> word) {
+        std::string value, path;
+        manifest >> value;
+        std::getline(manifest >> std::ws, path);
+        if (word == "stdin") {
+            read_stdin = (value == "1");
+        } else if (word == "input") {
+            THash h;
+            if (!HashFile(path, h) || Hex(h) != value) {
+                if (verbose) std::cout << "Cached result is out of date, " << path << " has changed" << std::endl;
+                return false;
+            }
+        } else if (word == "output") {
+            outputs.push_back(path);
+        }
+    }
+    if (read_stdin) {
+        // The run only depends on the bytes it read, so it is enough that stdin starts with them
+        if (isatty(STDIN_FILENO)) {
+            return false;
+        }
+        std::ifstream recorded(dir + "/stdin", std::ios::binary);
+        const std::string expected((std::istreambuf_iterator<char>(recorded)), std::istreambuf_iterator<char>());
+        pending.resize(expected.size());
+        pending.resize(std::cin.rdbuf()->sgetn(&pending[0], expected.size()));
+        if (pending != expected) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < outputs.size(); i++) {
+        const std::string cached = dir + "/output" + std::to_string(i);
+        unlink(outputs[i].c_str());
+        if (link(cached.c_str(), outputs[i].c_str()) != 0 && !CopyFile(cached, outputs[i])) {
+            QI_FAIL("Could not restore cached output " << outputs[i] << " from " << cached);
+        }
+    }
+    if (verbose) std::cout << "Restored " << outputs.size() << " outputs from cache entry " << dir << std::endl;
+    std::ifstream recorded(dir + "/stdout", std::ios::binary);
+    std::cout << recorded.rdbuf() << std::flush;
+    return true;
+}
+
+void StoreEntry() {
+    Cache &c = TheCache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (!c.active) {
+        return;
+    }
+    c.active = false;
+    std::cin.rdbuf(c.original_in);
+    std::cout.flush();
+    std::cout.rdbuf(c.original_out);
+    const bool read_stdin = !c.in->recorded().empty();
+    if (FailedFlag() || c.outputs.empty() || (read_stdin && isatty(STDIN_FILENO))) {
+        return;
+    }
+    mkdir(c.root.c_str(), 0777);
+    const std::string temp = c.dir + ".tmp" + std::to_string(getpid());
+    if (mkdir(temp.c_str(), 0777) != 0) {
+        return;
+    }
+    std::ofstream manifest(temp + "/manifest");
+    manifest << "stdin " << (read_stdin ? 1 : 0) << " -\n";
+    for (const auto &path : c.inputs) {
+        THash h;
+        if (std::find(c.outputs.begin(), c.outputs.end(), path) == c.outputs.end() && HashFile(path, h)) {
+            manifest << "input " << Hex(h) << " " << path << "\n";
+        }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < c.outputs.size(); i++) {
+        ok = ok && CopyFile(c.outputs[i], temp + "/output" + std::to_string(i));
+        manifest << "output " << i << " " << c.outputs[i] << "\n";
+    }
+    manifest.close();
+    std::ofstream(temp + "/stdin", std::ios::binary) << c.in->recorded();
+    std::ofstream(temp + "/stdout", std::ios::binary) << c.out->recorded();
+    if (ok && manifest) {
+        RemoveEntry(c.dir); // An out of date entry for the same key
+        ok = (rename(temp.c_str(), c.dir.c_str()) == 0);
+    }
+    if (!ok) {
+        RemoveEntry(temp);
+    }
+}
+
+} // End anonymous namespace
+
+void DisableCache() { TheCache().disabled = true; }
+
+void CheckCache(int argc, char **argv, const bool verbose) {
+    Cache &c = TheCache();
+    const char *root = std::getenv("QUIT_CACHE");
+    if (c.disabled || c.active || !root || !*root) {
+        return;
+    }
+    THash key = HashString(GetVersion());
+    const std::string program(argv[0]);
+    key = HashString(program.substr(program.find_last_of('/') == std::string::npos ? 0 : program.find_last_of('/') + 1), key);
+    for (const char *env : {"QUIT_EXT", "QUIT_GZIP_THREADS"}) {
+        key = HashString(std::getenv(env) ? std::getenv(env) : "", key);
+    }
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        if (arg.find("mem:") != std::string::npos) {
+            return; // Images in memory can change without the arguments changing
+        }
+        key = HashString(arg, key);
+        /*
+         * Files named alone or as the value of --option=FILE are checked like the images read,
+         * rather than being part of the key, because some of them will be this run's outputs
+         */
+        const size_t equals = arg.find('=');
+        for (const std::string &path : {arg, equals == std::string::npos ? std::string() : arg.substr(equals + 1)}) {
+            if (!path.empty() && IsFile(path)) {
+                AddUnique(c.inputs, path);
+            }
+        }
+    }
+    c.root = root;
+    c.dir = c.root + "/" + Hex(key);
+    c.verbose = verbose;
+    std::string pending;
+    if (UseEntry(c.dir, pending, verbose)) {
+        exit(EXIT_SUCCESS);
+    }
+    if (verbose) std::cout << "No cached result, will store this run in " << c.dir << std::endl;
+    c.original_in = std::cin.rdbuf();
+    c.original_out = std::cout.rdbuf();
+    c.in.reset(new RecordingInput(c.original_in, pending));
+    c.out.reset(new RecordingOutput(c.original_out));
+    std::cin.rdbuf(c.in.get());
+    std::cout.rdbuf(c.out.get());
+    c.active = true;
+    atexit(StoreEntry);
+}
+
+void CacheInput(const std::string &path) {
+    Cache &c = TheCache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (c.active) {
+        AddUnique(c.inputs, path);
+    }
+}
+
+void CacheOutput(const std::string &path) {
+    /*
+     * Restored outputs share their file with the cache, so an existing file with other links is
+     * removed first instead of being overwritten in place. This applies with the cache disabled too.
+     */
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        unlink(path.c_str());
+    }
+    Cache &c = TheCache();
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (c.active) {
+        AddUnique(c.outputs, path);
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,34 @@
+/*
+ *  ResultCache.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_RESULTCACHE_H
+#define QI_RESULTCACHE_H
+
+#include <string>
+
+namespace QI {
+
+/*
+ * Opt-in cache of program results, enabled by setting QUIT_CACHE to a directory. A run is keyed
+ * on the QUIT version, the program and its arguments, and QUIT_EXT / QUIT_GZIP_THREADS. Each entry
+ * also records the contents of the files named in the arguments, the images the run read and the
+ * part of stdin it consumed, and is only used if those are unchanged. On a hit the
+ * outputs are hard-linked into place and the (recorded) stdout is replayed, so the run finishes
+ * at once. Results are stored when the program exits, unless it failed or wrote no files.
+ */
+void CheckCache(int argc, char **argv, const bool verbose); //!< Called by ParseArgs, exits on a hit
+void DisableCache();                                        //!< For qi_pipeline, whose stages share one process
+void CacheInput(const std::string &path);                   //!< Record a file that the result depends on
+void CacheOutput(const std::string &path);                  //!< Record a file that is about to be written
+
+} // End namespace QI
+
+#endif // QI_RESULTCACHE_H
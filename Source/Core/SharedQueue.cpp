@@ -0,0 +1,94 @@
+/*
+ * SharedQueue.cpp
+ *
+ * Copyright (c) 2018 Tobias Wood
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <fstream>
+#include <algorithm>
+#include <sstream>
+#include <cerrno>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+
+#include "SharedQueue.h"
+#include "Macro.h"
+
+namespace QI {
+
+SharedQueue::SharedQueue(const std::string &dir, const size_t total, const size_t chunk) :
+    m_dir(dir), m_total(total), m_chunk(chunk)
+{
+    if (m_chunk == 0) {
+        QI_EXCEPTION("Queue chunks must hold at least one item");
+    }
+    if (mkdir(m_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        QI_EXCEPTION("Could not create queue directory " << m_dir);
+    }
+    // Written to a file of our own and then linked into place, so nobody reads a half-written job
+    std::ostringstream job;
+    job << m_total << " " << m_chunk;
+    const std::string jobPath = m_dir + "/job";
+    const std::string temp = jobPath + ".tmp" + ProcessName();
+    {
+        std::ofstream out(temp);
+        out << job.str() << std::endl;
+        if (!out) {
+            QI_EXCEPTION("Could not write to queue directory " << m_dir);
+        }
+    }
+    const bool created = (link(temp.c_str(), jobPath.c_str()) == 0);
+    const int linkError = errno;
+    unlink(temp.c_str());
+    if (!created && linkError != EEXIST) {
+        QI_EXCEPTION("Could not create the job file in queue directory " << m_dir);
+    }
+    std::ifstream in(jobPath);
+    std::string existing;
+    std::getline(in, existing);
+    if (existing != job.str()) {
+        QI_EXCEPTION("Queue directory " << m_dir << " holds a different job (" << existing << "), use a new directory for each fit");
+    }
+}
+
+size_t SharedQueue::chunks() const { return (m_total + m_chunk - 1) / m_chunk; }
+
+bool SharedQueue::next(size_t &begin, size_t &end) {
+    // Every chunk before m_next has been tried, so no process needs to look at them again
+    while (m_next < chunks()) {
+        const size_t c = m_next++;
+        const std::string path = m_dir + "/" + std::to_string(c) + ".claim";
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0) {
+            // The claim is the file itself, who made it is only for people to read
+            const std::string name = ProcessName() + "\n";
+            const ssize_t written = write(fd, name.data(), name.size());
+            (void)written;
+            close(fd);
+            begin = c * m_chunk;
+            end = std::min(m_total, begin + m_chunk);
+            return true;
+        }
+        if (errno != EEXIST) {
+            QI_EXCEPTION("Could not claim chunk " << c << " in queue directory " << m_dir);
+        }
+    }
+    return false;
+}
+
+std::string SharedQueue::ProcessName() {
+    char host[HOST_NAME_MAX + 1] = {0};
+    if (gethostname(host, sizeof(host) - 1) != 0) {
+        host[0] = 0;
+    }
+    return std::string(host[0] ? host : "localhost") + "-" + std::to_string(static_cast<long>(getpid()));
+}
+
+} // End namespace QI
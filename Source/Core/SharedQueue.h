@@ -0,0 +1,42 @@
+/*
+ * SharedQueue.h
+ *
+ * Copyright (c) 2018 Tobias Wood
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_SHARED_QUEUE_H
+#define QI_SHARED_QUEUE_H
+
+#include <string>
+
+namespace QI {
+
+/*
+ * Hands out the chunks of a job to every process sharing a directory, e.g. jobs on the nodes of a
+ * cluster with a shared filesystem, so each takes the next chunk when it is ready instead of a
+ * fixed share. A chunk is claimed by creating its file in the directory, which only one process
+ * can do, so there is no server and jobs can start or be killed at any time. The first process
+ * records the size of the job, any other with a different job there throws.
+ */
+class SharedQueue {
+public:
+    SharedQueue(const std::string &dir, const size_t total, const size_t chunk);
+
+    size_t chunks() const;
+    bool next(size_t &begin, size_t &end); //!< Claims the next chunk [begin, end), false when all have been claimed
+
+    static std::string ProcessName(); //!< host-pid, unique to this process among those sharing a queue
+
+private:
+    std::string m_dir;
+    size_t m_total, m_chunk, m_next = 0;
+};
+
+} // End namespace QI
+
+#endif // QI_SHARED_QUEUE_H
@@ -13,6 +13,7 @@
 #include "Macro.h"
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 
 namespace QI {
 
@@ -44,12 +45,58 @@ SplineInterpolator::SplineInterpolator(Eigen::ArrayXd const &x, Eigen::ArrayXd c
 
 double SplineInterpolator::operator()(const double &x) const {
     const double sx = scale(x);
+    const Eigen::Index n = m_table.rows();
+    if ((n > 1) && (sx >= 0.) && (sx <= 1.)) {
+        const double u = sx * (n - 1);
+        const Eigen::Index i = std::min<Eigen::Index>(static_cast<Eigen::Index>(u), n - 2);
+        const double t = u - i;
+        const double p0 = m_table[std::max<Eigen::Index>(i - 1, 0)];
+        const double p1 = m_table[i];
+        const double p2 = m_table[i + 1];
+        const double p3 = m_table[std::min<Eigen::Index>(i + 2, n - 1)];
+        return p1 + 0.5 * t * ((p2 - p0) + t * ((2.*p0 - 5.*p1 + 4.*p2 - p3) + t * (3.*(p1 - p2) + p3 - p0)));
+    }
     const double val = m_spline(sx)[0];
     return val;
 }
 
+Eigen::ArrayXd SplineInterpolator::operator()(const Eigen::ArrayXd &x) const {
+    Eigen::ArrayXd vals(x.rows());
+    for (Eigen::Index i = 0; i < x.rows(); i++) {
+        vals[i] = (*this)(x[i]);
+    }
+    return vals;
+}
+
+void SplineInterpolator::resample(const int n) {
+    if (n < 2) {
+        QI_FAIL("Spline must be resampled to at least 2 points");
+    }
+    m_table.resize(n);
+    for (int i = 0; i < n; i++) {
+        m_table[i] = m_spline(static_cast<double>(i) / (n - 1))[0];
+    }
+}
+
 double SplineInterpolator::scale(const double &x) const {
     return (x - m_min) / m_width;
 }
 
+SplineWeights::SplineWeights(Eigen::ArrayXd const &x, const int n) {
+    for (Eigen::Index j = 0; j < x.rows(); j++) {
+        m_basis.push_back(SplineInterpolator(x, Eigen::VectorXd::Unit(x.rows(), j).array()));
+        m_basis.back().resample(n);
+    }
+}
+
+Eigen::MatrixXd SplineWeights::operator()(const Eigen::ArrayXd &xi) const {
+    Eigen::MatrixXd weights(xi.rows(), m_basis.size());
+    for (size_t j = 0; j < m_basis.size(); j++) {
+        weights.col(j) = m_basis[j](xi).matrix();
+    }
+    return weights;
+}
+
+Eigen::Index SplineWeights::size() const { return m_basis.size(); }
+
 } // End namespace QI
\ No newline at end of file
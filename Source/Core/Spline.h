@@ -13,6 +13,7 @@
 #define QI_SPLINE_H
 
 #include <iostream>
+#include <vector>
 
 #include "Eigen/Dense"
 #include <unsupported/Eigen/Splines>
@@ -22,6 +23,11 @@ namespace QI {
 /*
  * Eigen spline objects aren't very friendly. Wrap them in a class to do the required
  * scaling and transposes to get them working.
+ *
+ * Evaluating an Eigen spline searches the knots and runs de Boor's recursion every time, which
+ * is slow when it is done per voxel. resample() tabulates the spline on a uniform grid over the
+ * knot range, after which points inside that range are found by Catmull-Rom interpolation of the
+ * table. Points outside it still use the spline itself.
  */
 class SplineInterpolator {
 public:
@@ -30,14 +36,33 @@ public:
     SplineInterpolator();
     SplineInterpolator(Eigen::ArrayXd const &x, Eigen::ArrayXd const &y);
     double operator()(const double &x) const;
+    Eigen::ArrayXd operator()(const Eigen::ArrayXd &x) const;
+    void resample(const int n = 1024);
 
 protected:
     TSpline m_spline;
     double m_min;
     double m_width;
+    Eigen::ArrayXd m_table; // Uniform samples over [m_min, m_min + m_width], empty if not resampled
     double scale(const double &x) const;
 };
 
+/*
+ * For fixed knots an interpolating spline is linear in the data, so its value anywhere is a
+ * weighted sum of the data points. The weights for data point j are the spline through the unit
+ * vector e_j, and these are built (and resampled) once so that any number of data sets sharing
+ * the same knots can be interpolated with a matrix product instead of a spline fit each.
+ */
+class SplineWeights {
+public:
+    SplineWeights(Eigen::ArrayXd const &x, const int n = 1024);
+    Eigen::MatrixXd operator()(const Eigen::ArrayXd &xi) const; // Row i holds the weights for xi[i]
+    Eigen::Index size() const; // Number of knots
+
+protected:
+    std::vector<SplineInterpolator> m_basis;
+};
+
 } // End namespace QI
 
 #endif // QI_SPLINE_H
\ No newline at end of file
@@ -0,0 +1,151 @@
+/*
+ *  TaskGraph.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+
+#include "TaskGraph.h"
+#include "Macro.h"
+
+namespace QI {
+
+TaskGraph::TaskGraph(ThreadPool &pool) : m_pool(pool) {}
+
+TaskGraph::~TaskGraph() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [this]{ return m_pending == 0 && m_draining == 0; });
+}
+
+auto TaskGraph::add(TFunc &&f, const std::vector<TTask> &after) -> TTask {
+    TTask t;
+    size_t spawn;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        t = m_nodes.size();
+        m_nodes.emplace_back();
+        Node &node = m_nodes.back();
+        node.f = std::move(f);
+        for (const TTask a : after) {
+            if (a >= t) {
+                QI_EXCEPTION("Task " << t << " cannot come after task " << a << ", which has not been added");
+            }
+            Node &before = m_nodes[a];
+            if (before.done) {
+                node.skip = node.skip || before.skip;
+            } else {
+                node.waiting++;
+                before.next.push_back(t);
+            }
+        }
+        m_pending++;
+        spawn = 0;
+        if (node.waiting == 0) {
+            m_ready.push_back(t);
+            spawn = reserveDrainers(1);
+        }
+    }
+    startDrainers(spawn);
+    return t;
+}
+
+/*
+ * Drainers queued or running never outnumber the pool's threads, and the pool's queue holds one
+ * task per thread, so enqueueing them cannot wait as long as the pool only runs this graph.
+ */
+size_t TaskGraph::reserveDrainers(const size_t wanted) {
+    const size_t spare = m_pool.size() - std::min(m_draining, m_pool.size());
+    const size_t n = std::min(wanted, spare);
+    m_draining += n;
+    return n;
+}
+
+void TaskGraph::startDrainers(const size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        m_pool.enqueue([this] { this->drain(); });
+    }
+}
+
+void TaskGraph::drain() {
+    while (true) {
+        TTask t;
+        bool skip;
+        TFunc *f;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_ready.empty()) {
+                m_draining--;
+                m_finished.notify_all();
+                return;
+            }
+            t = m_ready.front();
+            m_ready.pop_front();
+            skip = m_nodes[t].skip;
+            f = &m_nodes[t].f;
+        }
+        bool failed = skip;
+        if (!skip) {
+            try {
+                (*f)();
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (!m_error) m_error = std::current_exception();
+                failed = true;
+            }
+        }
+        finish(t, failed);
+    }
+}
+
+void TaskGraph::finish(const TTask t, const bool failed) {
+    size_t spawn;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        Node &node = m_nodes[t];
+        node.done = true;
+        node.skip = failed;
+        node.f = nullptr; // Release anything the task held
+        size_t ready = 0;
+        for (const TTask n : node.next) {
+            Node &after = m_nodes[n];
+            after.skip = after.skip || failed;
+            if (--after.waiting == 0) {
+                m_ready.push_back(n);
+                ready++;
+            }
+        }
+        // The worker that called this takes the first, other free threads can take the rest
+        spawn = (ready > 1) ? reserveDrainers(ready - 1) : 0;
+        m_pending--;
+        m_finished.notify_all();
+    }
+    startDrainers(spawn);
+}
+
+void TaskGraph::waitFor(const std::vector<TTask> &tasks) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [&] {
+        for (const TTask t : tasks) {
+            if (!m_nodes.at(t).done) return false;
+        }
+        return true;
+    });
+}
+
+void TaskGraph::wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [this]{ return m_pending == 0; });
+    if (m_error) {
+        std::exception_ptr error = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,72 @@
+/*
+ *  TaskGraph.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_TASKGRAPH_H
+#define QI_TASKGRAPH_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+#include "ThreadPool.h"
+
+namespace QI {
+
+/*
+ * Coarse tasks that run on a pool once the tasks they come after have finished, so the stages of
+ * a program (read, convert, fit, write) can overlap instead of running one after another in main().
+ * Tasks can be added while earlier ones run. If a task throws, the tasks after it are skipped and
+ * wait() rethrows the first exception. A task that itself waits on a pool, e.g. a fit on the global
+ * pool, must not run on that same pool, so give stages like that a pool of their own.
+ *
+ * Ready tasks go on an unbounded list that the graph's workers drain. A worker is only enqueued
+ * for a ready task while the graph has fewer workers than the pool has threads, so with a pool of
+ * its own the graph never waits on the pool's bounded queue, and independent tasks run together.
+ */
+class TaskGraph {
+public:
+    typedef size_t TTask;
+    typedef std::function<void (void)> TFunc;
+
+    TaskGraph(ThreadPool &pool);
+    ~TaskGraph(); //!< Waits, but ignores failures, call wait() to see them
+
+    TTask add(TFunc &&f, const std::vector<TTask> &after = {});
+    void waitFor(const std::vector<TTask> &tasks); //!< Blocks until these have finished or been skipped
+    void wait(); //!< Blocks until every task has finished, and throws if any failed
+
+protected:
+    struct Node {
+        TFunc f;
+        size_t waiting = 0;
+        bool done = false, skip = false;
+        std::vector<TTask> next;
+    };
+    ThreadPool &m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_finished;
+    std::deque<Node> m_nodes; // References stay valid as tasks are added
+    std::deque<TTask> m_ready;
+    size_t m_pending = 0, m_draining = 0;
+    std::exception_ptr m_error;
+
+    size_t reserveDrainers(const size_t wanted); //!< Call with the lock held
+    void startDrainers(const size_t n);
+    void drain();
+    void finish(const TTask t, const bool failed);
+};
+
+} // End namespace QI
+
+#endif // QI_TASKGRAPH_H
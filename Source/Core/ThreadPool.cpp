@@ -7,74 +7,249 @@
  *  License, v. 2.0. If a copy of the MPL was not distributed with this
  *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
  *
- *  Adapted from http://alexagafonov.com/2015/05/05/thread-pool-implementation-in-c-11/
+ *  The task queue is a bounded multi-producer multi-consumer ring buffer after
+ *  http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
  */
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "ThreadPool.h"
 #include "Macro.h"
+#include "Trace.h"
+#include "itkMultiThreader.h"
 
 namespace QI {
-    
-    ThreadPool::ThreadPool(const size_t nThreads, const bool d) : m_stopping(false), m_debug(d) {
+
+    namespace {
+        const size_t SlotsPerThread = 64; // Ring capacity, the enqueue limit is set by m_maxQueued
+        const int SpinCount = 64; // Times a worker yields looking for work before it sleeps
+        std::mutex globalMutex;
+        size_t globalThreads = 0;
+        bool globalStarted = false;
+        bool globalPin = false;
+        thread_local bool inWorker = false;
+
+        /*
+         * Bind each thread to one CPU from the set this process is allowed to run on, in order, so
+         * on Linux's usual numbering the threads fill one socket before spilling onto the next.
+         */
+        void PinThreads(std::vector<std::thread> &threads, const bool debug) {
+#ifdef __linux__
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+                std::cerr << "WARNING: Could not read CPU affinity, threads will not be pinned" << std::endl;
+                return;
+            }
+            std::vector<int> cpus;
+            for (int c = 0; c < CPU_SETSIZE; c++) {
+                if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+            }
+            if (cpus.size() < threads.size()) {
+                std::cerr << "WARNING: More threads than CPUs, some CPUs will be shared" << std::endl;
+            }
+            for (size_t i = 0; i < threads.size(); i++) {
+                cpu_set_t cpu;
+                CPU_ZERO(&cpu);
+                CPU_SET(cpus[i % cpus.size()], &cpu);
+                if (pthread_setaffinity_np(threads[i].native_handle(), sizeof(cpu), &cpu) != 0) {
+                    std::cerr << "WARNING: Could not pin thread " << i << " to CPU " << cpus[i % cpus.size()] << std::endl;
+                } else if (debug) {
+                    std::cout << "Pinned thread " << threads[i].get_id() << " to CPU " << cpus[i % cpus.size()] << std::endl;
+                }
+            }
+#else
+            std::cerr << "WARNING: Thread pinning is only supported on Linux" << std::endl;
+#endif
+        }
+    }
+
+    ThreadPool::ThreadPool(const size_t nThreads, const bool d, const bool pin) : m_debug(d), m_maxQueued(nThreads) {
         if (nThreads < 1) {
             QI_EXCEPTION("Cannot construct a thread pool with 0 threads");
         }
-        if (m_debug) std::cout << "Constructing thread pool with " << nThreads << " threads" << std::endl;
+        size_t capacity = 2;
+        while (capacity < SlotsPerThread * nThreads) {
+            capacity *= 2;
+        }
+        m_slots.reset(new Slot[capacity]);
+        m_mask = capacity - 1;
+        for (size_t i = 0; i < capacity; i++) {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        if (m_debug) std::cout << "Constructing thread pool with " << nThreads << " threads and " << capacity << " slots" << std::endl;
         for (size_t i = 0; i < nThreads; i++) {
             m_threads.emplace_back(std::thread(&ThreadPool::invokeThread, this));
             if (m_debug) std::cout << "Emplaced thread " << m_threads.back().get_id() << std::endl;
         }
+        if (pin) {
+            PinThreads(m_threads, m_debug);
+        }
     }
-    
+
     ThreadPool::~ThreadPool() {
         if (m_debug) std::cout << "Destructing thread pool" << std::endl;
         { // Lock will exist in this scope
-            std::unique_lock<std::mutex> lock(m_tasksMutex);
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
             m_stopping = true;
         }
-        m_threadCondition.notify_all();
+        m_wakeCondition.notify_all();
         for (std::thread &t : m_threads) {
             if (m_debug) std::cout << "Joining thread " << t.get_id() << std::endl;
             t.join();
         }
-        m_threads.empty();
         if (m_debug) std::cout << "Destructed thread pool" << std::endl;
     }
-    
+
     void ThreadPool::setDebug(const bool d) { m_debug = d; }
-    void ThreadPool::setMaxQueueMultiple(const int n) { m_maxQueueMultiple = n; }
-    
-    void ThreadPool::enqueue(TFunc f) {
-        { // Lock will exist in this scope
-            std::unique_lock<std::mutex> tLock(m_tasksMutex);
-            if (m_debug) {
-                std::cout << "Checking for space for task " << &f << std::endl;
-                std::cout << "Threads size " << m_threads.size() << " Tasks size " << m_tasks.size() << " Max size " << m_maxQueueMultiple * m_threads.size() << std::endl;
+    void ThreadPool::setMaxQueueMultiple(const int n) {
+        m_maxQueued = std::max<long>(1, std::min<long>(n * m_threads.size(), m_mask + 1));
+    }
+    size_t ThreadPool::size() const { return m_threads.size(); }
+
+    void ThreadPool::SetGlobalThreads(const size_t nThreads) {
+        std::unique_lock<std::mutex> lock(globalMutex);
+        const size_t n = nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency());
+        if (globalStarted) {
+            if (n != globalThreads) {
+                std::cerr << "WARNING: Global thread pool already started with " << globalThreads
+                          << " threads, ignoring request for " << n << std::endl;
             }
-            m_queueCondition.wait(tLock, [this]{ return m_tasks.size() < m_maxQueueMultiple * m_threads.size(); });
-            m_tasks.push(f);
-            if (m_debug) std::cout << "Pushed task " << &f << std::endl;
+            return;
         }
-        m_threadCondition.notify_one(); // Wake up a thread
+        globalThreads = n;
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads(n);
     }
-    
-    void ThreadPool::invokeThread() {
-        TFunc task;
+
+    bool ThreadPool::InWorker() { return inWorker; }
+
+    void ThreadPool::SetGlobalPinning(const bool pin) {
+        std::unique_lock<std::mutex> lock(globalMutex);
+        if (globalStarted) {
+            if (pin != globalPin) {
+                std::cerr << "WARNING: Global thread pool already started, ignoring change to pinning" << std::endl;
+            }
+            return;
+        }
+        globalPin = pin;
+    }
+
+    ThreadPool &ThreadPool::Global() {
+        {
+            std::unique_lock<std::mutex> lock(globalMutex);
+            if (!globalStarted) {
+                if (globalThreads == 0) {
+                    globalThreads = std::max(1u, std::thread::hardware_concurrency());
+                }
+                globalStarted = true;
+            }
+        }
+        static ThreadPool pool(globalThreads, false, globalPin);
+        return pool;
+    }
+
+    /*
+     * Reserve a place in the queue (waiting while it is at the limit) and then claim the next
+     * slot. The slot is not visible to the workers until publish() is called.
+     */
+    ThreadPool::Slot &ThreadPool::claim() {
+        long queued = m_queued.load();
+        while (true) {
+            if (queued >= m_maxQueued) {
+                std::this_thread::yield();
+                queued = m_queued.load();
+            } else if (m_queued.compare_exchange_weak(queued, queued + 1)) {
+                break;
+            }
+        }
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
         while (true) {
-            { // Lock will exist in this scope
-                std::unique_lock<std::mutex> lock(m_tasksMutex);
-                m_threadCondition.wait(lock, [this]{ return !m_tasks.empty() || m_stopping; });
-                if (m_stopping && m_tasks.empty()) {
-                    return;
+            Slot &slot = m_slots[pos & m_mask];
+            const size_t seq = slot.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return slot;
                 }
-                task = m_tasks.front();
-                m_tasks.pop();
-                m_queueCondition.notify_all(); // Wake up main thread if something is waiting to enqueue
+            } else if (diff < 0) {
+                // A worker is still moving the task out of this slot
+                std::this_thread::yield();
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            } else {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void ThreadPool::publish(Slot &slot) {
+        const size_t pos = slot.sequence.load(std::memory_order_relaxed);
+        slot.sequence.store(pos + 1, std::memory_order_release);
+        if (m_sleepers.load() > 0) {
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wakeCondition.notify_one();
+        }
+    }
+
+    /*
+     * Move the task at the front of the queue into task and free the slot straight away, so a
+     * long-running task does not stop producers from re-using it. Returns false if empty.
+     */
+    bool ThreadPool::pop(Task &task) {
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = m_slots[pos & m_mask];
+            const size_t seq = slot.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.task.relocate(&task.storage, &slot.task.storage);
+                    task.invoke = slot.task.invoke;
+                    task.relocate = slot.task.relocate;
+                    task.destroy = slot.task.destroy;
+                    slot.sequence.store(pos + m_mask + 1, std::memory_order_release);
+                    m_queued--;
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void ThreadPool::invokeThread() {
+        inWorker = true;
+        Task task;
+        while (true) {
+            if (pop(task)) {
                 if (m_debug) std::cout << "Starting task " << &task << std::endl;
+                {
+                    const TraceSpan span("pool", "task");
+                    task.invoke(&task.storage);
+                }
+                task.destroy(&task.storage);
+                continue;
+            }
+            if (m_stopping && m_queued == 0) {
+                break;
             }
-            task();
+            // A task may have been reserved but not yet published, so spin briefly before sleeping
+            for (int i = 0; i < SpinCount && m_queued == 0 && !m_stopping; i++) {
+                std::this_thread::yield();
+            }
+            if (m_queued > 0) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_sleepers++;
+            m_wakeCondition.wait(lock, [this]{ return m_queued > 0 || m_stopping; });
+            m_sleepers--;
         }
         if (m_debug) std::cout << "Thread stopped" << std::endl;
     }
-    
- } // End namespace QI
\ No newline at end of file
+
+ } // End namespace QI
@@ -7,9 +7,10 @@
  *  License, v. 2.0. If a copy of the MPL was not distributed with this
  *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
  *
- *  Adapted from http://alexagafonov.com/2015/05/05/thread-pool-implementation-in-c-11/
+ *  The task queue is a bounded multi-producer multi-consumer ring buffer after
+ *  http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
  */
- 
+
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
@@ -19,34 +20,169 @@
 #include <condition_variable>
 #include <functional>
 #include <vector>
-#include <queue>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <future>
+#include <exception>
+#include <algorithm>
 
 namespace QI {
-    
+
 class ThreadPool {
-    
-private:
-    std::vector<std::thread> m_threads;
-    std::queue<std::function<void ()>> m_tasks;
-    std::mutex m_tasksMutex;
-    std::condition_variable m_queueCondition, m_threadCondition;
-    bool m_stopping, m_debug;
-    int  m_maxQueueMultiple = 1;
-    
-    void invokeThread();
-    
 public:
     typedef std::function<void (void)> TFunc;
-    
-    ThreadPool(const size_t nThreads, const bool debug = false);
+
+    ThreadPool(const size_t nThreads, const bool debug = false, const bool pin = false); //!< pin binds thread i to the i'th allowed CPU
     ~ThreadPool();
-    
-    void enqueue(TFunc f);
+
+    template<typename F>
+    void enqueue(F &&f); //!< Blocks while the queue is full
+    template<typename F>
+    void run(const size_t nTasks, const F &task); //!< Runs task(t) for t < nTasks and waits for them all, not from inside a task
+    template<typename F>
+    auto async(F &&f) -> std::future<typename std::result_of<typename std::decay<F>::type()>::type>; //!< Enqueues f, its result or exception arrive in the future
+    template<typename F>
+    void parallelFor(const size_t begin, const size_t end, const size_t grain, const F &f); //!< f(first, last) over chunks of grain, waits and rethrows the first exception
     void setDebug(const bool d);
     void setMaxQueueMultiple(const int n);
+    size_t size() const;
+
+    /*
+     * One pool is shared by every filter in the process, so chained stages do not each start
+     * and join their own threads. It is started on first use and then lives until exit.
+     * SetGlobalThreads() (0 = hardware limit) only has an effect before that, and also limits
+     * ITK's own multi-threaded filters to the same number of threads.
+     */
+    static void SetGlobalThreads(const size_t nThreads);
+    static void SetGlobalPinning(const bool pin);
+    static ThreadPool &Global();
+
+    /*
+     * True on a thread of any pool. Code that can split its own work over the global pool (e.g.
+     * one voxel's samples) checks this first, as a task cannot wait for other tasks of its pool.
+     */
+    static bool InWorker();
+
+private:
+    /*
+     * Type-erased task stored directly in the queue, so enqueueing a lambda does not
+     * allocate. Anything larger than TaskStorage (e.g. lambdas capturing big objects by
+     * value) will fail to compile, capture by reference or pointer instead.
+     */
+    static const size_t TaskStorage = 64;
+    struct Task {
+        std::aligned_storage<TaskStorage, alignof(std::max_align_t)>::type storage;
+        void (*invoke)(void *) = nullptr;
+        void (*relocate)(void *dst, void *src) = nullptr; // Move-construct into dst and destroy src
+        void (*destroy)(void *) = nullptr;
+    };
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Task task;
+    };
+
+    std::vector<std::thread> m_threads;
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    // Padding keeps the producer and consumer positions on separate cache-lines
+    std::atomic<size_t> m_enqueuePos{0};
+    char m_pad0[64];
+    std::atomic<size_t> m_dequeuePos{0};
+    char m_pad1[64];
+    std::atomic<long> m_queued{0};
+    std::atomic<int> m_sleepers{0};
+    std::atomic<bool> m_stopping{false};
+    std::mutex m_sleepMutex; // Only taken when a worker has run out of work, or to wake one
+    std::condition_variable m_wakeCondition;
+    bool m_debug;
+    long m_maxQueued;
+
+    Slot &claim();
+    void publish(Slot &slot);
+    bool pop(Task &task);
+    void invokeThread();
 };
-    
-    
+
+template<typename F>
+void ThreadPool::enqueue(F &&f) {
+    typedef typename std::decay<F>::type TF;
+    static_assert(sizeof(TF) <= TaskStorage, "Task is too large to store in the ThreadPool queue");
+    static_assert(alignof(TF) <= alignof(std::max_align_t), "Task is over-aligned for the ThreadPool queue");
+    Slot &slot = claim();
+    new (&slot.task.storage) TF(std::forward<F>(f));
+    slot.task.invoke = [](void *p) { (*static_cast<TF *>(p))(); };
+    slot.task.relocate = [](void *dst, void *src) {
+        new (dst) TF(std::move(*static_cast<TF *>(src)));
+        static_cast<TF *>(src)->~TF();
+    };
+    slot.task.destroy = [](void *p) { static_cast<TF *>(p)->~TF(); };
+    publish(slot);
+}
+
+template<typename F>
+void ThreadPool::run(const size_t nTasks, const F &task) {
+    if (nTasks == 1) {
+        task(0);
+        return;
+    }
+    struct {
+        size_t running;
+        std::mutex mutex;
+        std::condition_variable condition;
+    } sync;
+    sync.running = nTasks;
+    for (size_t t = 0; t < nTasks; t++) {
+        enqueue([t, &task, &sync] {
+            task(t);
+            std::unique_lock<std::mutex> lock(sync.mutex);
+            if (--sync.running == 0) {
+                sync.condition.notify_all();
+            }
+        });
+    }
+    std::unique_lock<std::mutex> lock(sync.mutex);
+    sync.condition.wait(lock, [&sync]{ return sync.running == 0; });
+}
+
+/*
+ * The packaged_task is too big for the queue, so it is held by a shared_ptr. That costs an
+ * allocation per call, so use this for coarse stages (e.g. reading a file) and not per voxel.
+ */
+template<typename F>
+auto ThreadPool::async(F &&f) -> std::future<typename std::result_of<typename std::decay<F>::type()>::type> {
+    typedef typename std::result_of<typename std::decay<F>::type()>::type TResult;
+    auto task = std::make_shared<std::packaged_task<TResult()>>(std::forward<F>(f));
+    std::future<TResult> result = task->get_future();
+    enqueue([task] { (*task)(); });
+    return result;
+}
+
+template<typename F>
+void ThreadPool::parallelFor(const size_t begin, const size_t end, const size_t grain, const F &f) {
+    if (end <= begin) {
+        return;
+    }
+    const size_t step = std::max<size_t>(grain, 1);
+    const size_t nChunks = (end - begin + step - 1) / step;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    run(nChunks, [&](const size_t c) {
+        const size_t first = begin + c * step;
+        try {
+            f(first, std::min(first + step, end));
+        } catch (...) {
+            std::unique_lock<std::mutex> lock(errorMutex);
+            if (!error) error = std::current_exception();
+        }
+    });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
 } // End namespace QI
 
-#endif // End THREAD_POOL_H
\ No newline at end of file
+#endif // End THREAD_POOL_H
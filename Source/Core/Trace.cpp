@@ -0,0 +1,155 @@
+/*
+ *  Trace.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+
+#include "Trace.h"
+
+namespace QI {
+
+namespace {
+
+struct Event {
+    const char *category, *name;
+    std::string detail;
+    int64_t start, end; // Nanoseconds since the trace started
+};
+
+/*
+ * Each thread appends to its own buffer. The mutex is only contended while the trace is written
+ * at exit, when pool threads may still be finishing a task.
+ */
+struct ThreadBuffer {
+    size_t id;
+    std::mutex mutex;
+    std::vector<Event> events;
+};
+
+struct Tracer {
+    std::string path;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers; // Never shrinks, so thread_local pointers stay valid
+};
+
+Tracer *TheTracer() {
+    // Leaked deliberately, the trace is written by an exit handler after statics may be gone
+    static Tracer *tracer = nullptr;
+    static std::once_flag once;
+    std::call_once(once, []{
+        const char *env = std::getenv("QUIT_TRACE");
+        if (env && *env) {
+            tracer = new Tracer;
+            tracer->path = env;
+            std::atexit([]{
+                Tracer *t = TheTracer();
+                std::ofstream file(t->path);
+                if (!file) {
+                    std::cerr << "WARNING: Could not write trace to " << t->path << std::endl;
+                    return;
+                }
+                const long pid = static_cast<long>(getpid());
+                file << "{\"traceEvents\":[\n";
+                bool first = true;
+                std::unique_lock<std::mutex> lock(t->mutex);
+                for (const auto &buffer : t->buffers) {
+                    std::unique_lock<std::mutex> bufferLock(buffer->mutex);
+                    for (const Event &e : buffer->events) {
+                        if (!first) file << ",\n";
+                        first = false;
+                        file << "{\"cat\":\"" << e.category << "\",\"name\":\"" << e.name << "\",\"ph\":\"X\""
+                             << ",\"pid\":" << pid << ",\"tid\":" << buffer->id
+                             << ",\"ts\":" << (e.start / 1000) << "." << (e.start % 1000 / 100)
+                             << ",\"dur\":" << ((e.end - e.start) / 1000) << "." << ((e.end - e.start) % 1000 / 100);
+                        if (!e.detail.empty()) {
+                            file << ",\"args\":{\"detail\":\"";
+                            for (const char c : e.detail) {
+                                if (c == '"' || c == '\\') file << '\\' << c;
+                                else if (static_cast<unsigned char>(c) >= 0x20) file << c;
+                            }
+                            file << "\"}";
+                        }
+                        file << "}";
+                    }
+                }
+                file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+            });
+        }
+    });
+    return tracer;
+}
+
+int64_t Now(const Tracer *t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t->origin).count();
+}
+
+ThreadBuffer &LocalBuffer(Tracer *t) {
+    thread_local ThreadBuffer *buffer = nullptr;
+    if (!buffer) {
+        std::unique_lock<std::mutex> lock(t->mutex);
+        t->buffers.emplace_back(new ThreadBuffer);
+        buffer = t->buffers.back().get();
+        buffer->id = t->buffers.size() - 1;
+    }
+    return *buffer;
+}
+
+std::atomic<bool> solverTrace{false};
+
+} // End anonymous namespace
+
+bool SolverTrace() {
+    return solverTrace.load(std::memory_order_relaxed);
+}
+
+void SetSolverTrace(const bool t) {
+    solverTrace.store(t, std::memory_order_relaxed);
+}
+
+bool TraceEnabled() {
+    return TheTracer() != nullptr;
+}
+
+TraceSpan::TraceSpan(const char *category, const char *name) :
+    m_category(category), m_name(name), m_start(0), m_active(TraceEnabled())
+{
+    if (m_active) m_start = Now(TheTracer());
+}
+
+TraceSpan::TraceSpan(const char *category, const char *name, const std::string &detail) :
+    m_category(category), m_name(name), m_start(0), m_active(TraceEnabled())
+{
+    if (m_active) {
+        m_detail = detail;
+        m_start = Now(TheTracer());
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (m_active) {
+        Tracer *t = TheTracer();
+        const int64_t end = Now(t);
+        ThreadBuffer &buffer = LocalBuffer(t);
+        std::unique_lock<std::mutex> lock(buffer.mutex);
+        buffer.events.push_back(Event{m_category, m_name, std::move(m_detail), m_start, end});
+    }
+}
+
+} // End namespace QI
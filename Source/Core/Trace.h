@@ -0,0 +1,52 @@
+/*
+ *  Trace.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_TRACE_H
+#define QI_TRACE_H
+
+#include <string>
+#include <cstdint>
+
+namespace QI {
+
+/*
+ * Lightweight tracing of where the wall time goes. If QUIT_TRACE is set to a file name, every
+ * TraceSpan is recorded (per thread, so spans on the pool do not contend) and the whole trace is
+ * written at exit in the Chrome trace event format, which chrome://tracing or ui.perfetto.dev
+ * can display. Otherwise a span costs one test of a flag.
+ */
+bool TraceEnabled();
+
+class TraceSpan {
+public:
+    TraceSpan(const char *category, const char *name);
+    TraceSpan(const char *category, const char *name, const std::string &detail); //!< e.g. the file being read
+    ~TraceSpan();
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *m_category, *m_name;
+    std::string m_detail;
+    int64_t m_start;
+    bool m_active;
+};
+
+/*
+ * Whether solvers should print their progress (e.g. Ceres' per-iteration log or each contraction of
+ * RegionContraction), as for --voxel, which only fits one voxel. Off unless set.
+ */
+bool SolverTrace();
+void SetSolverTrace(const bool t);
+
+} // End namespace QI
+
+#endif // QI_TRACE_H
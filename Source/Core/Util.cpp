@@ -94,16 +94,10 @@ std::string Basename(const std::string &path) {
 
 std::mt19937_64::result_type RandomSeed() {
     static std::random_device rd;
-    static std::mt19937_64 rng;
-    static bool init = false;
-    std::mutex seed_mtx;
-    if (!init) {
-        rng = std::mt19937_64(rd());
-    }
-    seed_mtx.lock();
-    std::mt19937_64::result_type r = rng();
-    seed_mtx.unlock();
-    return r;
+    static std::mt19937_64 rng(rd());
+    static std::mutex seed_mtx;
+    std::unique_lock<std::mutex> lock(seed_mtx);
+    return rng();
 }
 
 // From Knuth, surprised this isn't in STL
@@ -139,7 +133,22 @@ void GenericMonitor::Execute(itk::Object *caller, const itk::EventObject &event)
 void GenericMonitor::Execute(const itk::Object *object, const itk::EventObject &event) {
     const itk::ProcessObject *filter = static_cast<const itk::ProcessObject *>(object);
     if (typeid(event) == typeid(itk::ProgressEvent)) {
-        std::cout << "Progress: " << round(filter->GetProgress()*100) << "% complete" << std::endl;
+        const auto now = std::chrono::steady_clock::now();
+        if (!m_started) {
+            m_start = now;
+            m_started = true;
+        }
+        const double progress = filter->GetProgress();
+        const double elapsed = std::chrono::duration<double>(now - m_start).count();
+        std::cout << "Progress: " << round(progress*100) << "% complete";
+        const VoxelCounter *counter = dynamic_cast<const VoxelCounter *>(filter);
+        if (counter && elapsed > 0) {
+            std::cout << ", " << round(counter->GetVoxelsDone() / elapsed) << " voxels/s";
+        }
+        if (progress > 0 && progress < 1 && elapsed > 0) {
+            std::cout << ", ETA " << round(elapsed * (1 - progress) / progress) << "s";
+        }
+        std::cout << std::endl;
     } else {
         std::cout << "Received event: " << typeid(event).name() << std::endl;
     }
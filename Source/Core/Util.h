@@ -20,6 +20,7 @@
 #include <functional>
 #include <mutex>
 #include <vector>
+#include <chrono>
 
 #include <Eigen/Core>
 
@@ -55,6 +56,16 @@ std::mt19937_64::result_type RandomSeed();          //!< Thread-safe random seed
 unsigned long long Choose(unsigned long long n, unsigned long long k); //!< From Knuth, surprised this isn't in STL
 Eigen::ArrayXXd ReadArrayFile(const std::string &path);
 
+/*
+ * Filters that process a known number of voxels can expose the count so that
+ * GenericMonitor can report throughput
+ */
+class VoxelCounter {
+public:
+    virtual size_t GetVoxelsDone() const = 0;
+    virtual size_t GetVoxelsTotal() const = 0;
+};
+
 class GenericMonitor : public itk::Command {
 public:
     typedef GenericMonitor          Self;
@@ -64,6 +75,8 @@ public:
     itkNewMacro(Self);
 protected:
     GenericMonitor() {}
+    bool m_started = false;
+    std::chrono::steady_clock::time_point m_start;
 public:
     void Execute(itk::Object *caller, const itk::EventObject &event) ITK_OVERRIDE;
     void Execute(const itk::Object *object, const itk::EventObject &event) ITK_OVERRIDE;
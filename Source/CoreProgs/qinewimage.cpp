@@ -14,11 +14,13 @@
 #include <random>
 
 #include "itkImage.h"
-#include "itkImageLinearIteratorWithIndex.h"
+#include "itkImageFileWriter.h"
 
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
+#include "ThreadPool.h"
+#include "PatternImageSource.h"
 
 /*
  * Define arguments globally because I am lazy
@@ -33,6 +35,8 @@ args::Positional<std::string> fName(parser, "OUTPUT", "Output filename");
 
 args::HelpFlag help(parser, "HELP", "Show this help menu", {'h', "help"});
 args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+args::ValueFlag<int> slabs(parser, "SLABS", "Generate and write the image in this many slabs (needs an uncompressed format)", {"slabs"}, 1);
 args::ValueFlag<int> dims_arg(parser, "DIMS", "Image dimension, default 3", {'d', "dims"}, 3);
 args::ValueFlag<std::string> size_arg(parser, "SIZE", "Image size", {'s', "size"});
 args::ValueFlag<std::string> spacing_arg(parser, "SPACING", "Voxel spacing", {'p', "spacing"});
@@ -50,8 +54,7 @@ void make_image() {
     using SizeType = typename ImageType::SizeType;
     using SpacingType = typename ImageType::SpacingType;
     using PointType = typename ImageType::PointType;
-    auto newimg = ImageType::New();
-    RegionType  imgRegion;
+    auto source = itk::PatternImageSource<ImageType>::New();
     IndexType   imgIndex;   imgIndex.Fill(0);
     SizeType    imgSize;    imgSize.Fill(1);
     SpacingType imgSpacing; imgSpacing.Fill(1.0);
@@ -66,69 +69,50 @@ void make_image() {
         std::cout << "Spacing: " << imgSpacing << std::endl;
         std::cout << "Origin:  " << imgOrigin << std::endl;
     }
-    enum class FillTypes { Fill, Gradient, Steps };
-    FillTypes fillType = FillTypes::Fill;
-    float startVal = 0, deltaVal = 0, stopVal = 0;
-    int stepLength = 1, fillDim = 0;
     if (fill_arg) {
-        fillType = FillTypes::Fill;
-        startVal = std::stod(fill_arg.Get());
-        if (verbose) std::cout << "Fill with constant value: " << startVal << std::endl;
+        const float value = std::stod(fill_arg.Get());
+        source->SetFill(value);
+        if (verbose) std::cout << "Fill with constant value: " << value << std::endl;
     } else if (grad_arg) {
-        fillType = FillTypes::Gradient;
         std::istringstream stream(grad_arg.Get());
+        int fillDim;
+        float startVal, stopVal;
         stream >> fillDim;
         stream >> startVal;
         stream >> stopVal;
-        deltaVal = (stopVal - startVal) / (imgSize[fillDim] - 1);
-        stepLength = 1;
+        source->SetGradient(fillDim, startVal, stopVal);
         if (verbose) std::cout << "Fill with gradient " << startVal << "-" << stopVal << " on dim " << fillDim << std::endl;
     } else if (steps_arg) {
-        fillType = FillTypes::Steps;
         std::istringstream stream(steps_arg.Get());
+        int fillDim, steps;
+        float startVal, stopVal;
         stream >> fillDim;
         stream >> startVal;
         stream >> stopVal;
-        int steps;
         stream >> steps;
         if (steps < 2) {
             QI_FAIL("Must have more than 1 step, only have " << steps);
         }
-        stepLength = imgSize[fillDim] / steps;
-        deltaVal = (stopVal - startVal) / (steps - 1);
+        source->SetSteps(fillDim, startVal, stopVal, steps);
         if (verbose) std::cout << "Fill with " << steps << " steps " << startVal << "-" << stopVal << " on dim " << fillDim << std::endl;
     }
-    if (verbose) std::cout << "Step length is " << stepLength << " delta value is " << deltaVal << std::endl;
-    imgRegion.SetIndex(imgIndex);
-    imgRegion.SetSize(imgSize);
-    newimg->SetRegions(imgRegion);
-    newimg->SetSpacing(imgSpacing);
-    newimg->SetOrigin(imgOrigin);
-    newimg->Allocate();
+    if (wrap_arg) source->SetWrap(wrap_arg.Get());
+    source->SetRegion(RegionType(imgIndex, imgSize));
+    source->SetSpacing(imgSpacing);
+    source->SetOrigin(imgOrigin);
 
-    if (fillDim >= dim) QI_FAIL("Fill dimension is larger than image dimension");
-    itk::ImageLinearIteratorWithIndex<ImageType> it(newimg, imgRegion);
-    it.SetDirection(fillDim);
-    if (verbose) std::cout << "Filling..." << std::endl;
-    it.GoToBegin();
-    while (!it.IsAtEnd()) {
-        float val = startVal;
-        while (!it.IsAtEndOfLine()) {
-            it.Set(val);
-            ++it;
-            if (fillType == FillTypes::Gradient) {
-                val += deltaVal;
-            } else if ((it.GetIndex()[fillDim] % stepLength) == 0) {
-                val += deltaVal;
-            }
-            if (wrap_arg) {
-                val = fmod(val, wrap_arg.Get());
-            }
-        }
-    it.NextLine();
-    }
     if (verbose) std::cout << "Writing file to: " << QI::CheckPos(fName) << std::endl;
-    QI::WriteImage(newimg, QI::CheckPos(fName));
+    if (slabs.Get() > 1) {
+        // Each slab is generated only when the writer asks for it
+        QI::CacheOutput(QI::CheckPos(fName));
+        auto file = itk::ImageFileWriter<ImageType>::New();
+        file->SetFileName(QI::CheckPos(fName));
+        file->SetInput(source->GetOutput());
+        file->SetNumberOfStreamDivisions(slabs.Get());
+        file->Update();
+    } else {
+        QI::WriteImage(source->GetOutput(), QI::CheckPos(fName));
+    }
 }
 
 //******************************************************************************
@@ -137,6 +121,7 @@ void make_image() {
 int main(int argc, char **argv) {
 
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
     if (dims_arg.Get() == 3) {
         make_image<3>();
     } else if (dims_arg.Get() == 4) {
@@ -0,0 +1,53 @@
+/*
+ *  qisequence.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+
+#include "Args.h"
+#include "Util.h"
+#include "SequenceCereal.h"
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Reads a sequence file (JSON) from stdin and checks it. Can save a binary copy\n"
+                                "that any QUIT program will read on stdin in place of the JSON, which is\n"
+                                "quicker to load when the same sequence is used for many jobs.\n"
+                                "http://github.com/spinicist/QUIT");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<std::string> binary_path(parser, "FILE", "Save the sequence in binary form to FILE", {"save-binary"});
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    cereal::JSONInputArchive input(std::cin);
+    const std::string name = input.getNodeName();
+    if (verbose) std::cout << "Reading sequence: " << name << std::endl;
+    std::shared_ptr<QI::SequenceBase> sequence = QI::NewSequence(name);
+    input(cereal::make_nvp(name, *sequence));
+    if (binary_path) {
+        if (verbose) std::cout << "Writing binary sequence: " << binary_path.Get() << std::endl;
+        QI::CacheOutput(binary_path.Get());
+        std::ofstream file(binary_path.Get(), std::ios::binary | std::ios::trunc);
+        if (!file) {
+            QI_FAIL("Could not open " << binary_path.Get() << " for writing");
+        }
+        QI::WriteSequenceBinary(*sequence, file);
+    } else {
+        {
+            cereal::JSONOutputArchive output(std::cout);
+            output(cereal::make_nvp(name, *sequence));
+        }
+        std::cout << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
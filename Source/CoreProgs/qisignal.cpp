@@ -12,19 +12,22 @@
 
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <vector>
 #include <Eigen/Dense>
 
 #include "itkImageToImageFilter.h"
 #include "itkTimeProbe.h"
-#include "itkResampleImageFilter.h"
-#include "itkLinearInterpolateImageFunction.h"
 #include "itkProgressReporter.h"
 
 #include "VectorToImageFilter.h"
+#include "GridResampler.h"
 
 #include "Model.h"
 #include "Util.h"
 #include "ThreadPool.h"
+#include "MaskSpans.h"
+#include "CounterNoise.h"
 #include "Args.h"
 #include "ImageIO.h"
 
@@ -47,7 +50,8 @@ class SignalsFilter : public itk::ImageToImageFilter<TImage, TCVImage> {
 protected:
     std::shared_ptr<QI::SequenceBase> m_sequence;
     std::shared_ptr<QI::Model> m_model;
-    double m_sigma = 0.0;
+    QI::CounterNoise m_noise;
+    uint64_t m_stream = 0;
     itk::TimeProbe m_clock;
     itk::RealTimeClock::TimeStampType m_meanTime = 0.0, m_totalTime = 0.0;
     itk::SizeValueType m_evaluations = 0;
@@ -89,8 +93,9 @@ public:
         return dynamic_cast<TCVImage *>(this->ProcessObject::GetOutput(0));
     }
 
-    void SetSequence(std::shared_ptr<QI::SequenceBase> s) {
+    void SetSequence(std::shared_ptr<QI::SequenceBase> s, const uint64_t stream = 0) {
         m_sequence = s;
+        m_stream = stream;
         this->SetNumberOfRequiredOutputs(1);
         this->SetNthOutput(0, this->MakeOutput(0));
     }
@@ -98,7 +103,7 @@ public:
         m_model = m;
         this->SetNumberOfRequiredInputs(1);
     }
-    void SetSigma(const double s) { m_sigma = s; }
+    void SetNoise(const QI::CounterNoise &n) { m_noise = n; }
 
     itk::RealTimeClock::TimeStampType GetTotalTime() const { return m_totalTime; }
     itk::RealTimeClock::TimeStampType GetMeanTime() const { return m_meanTime; }
@@ -121,61 +126,48 @@ protected:
     SignalsFilter() {}
     ~SignalsFilter(){}
 
+    // Each span of the mask is simulated with one call to the sequence
     void ThreadedGenerateData(const OutputImageRegionType &region, itk::ThreadIdType threadId) ITK_OVERRIDE {
-        std::vector<itk::ImageRegionConstIterator<TImage>> inIters(m_model->nParameters());
-        for (size_t i = 0; i < m_model->nParameters(); i++) {
-            if (this->GetInput(i))
-                inIters[i] = itk::ImageRegionConstIterator<TImage>(this->GetInput(i), region);
-        }
-        typename TImage::ConstPointer mask = this->GetMask();
-        itk::ImageRegionConstIterator<TImage> maskIter;
-        if (mask) {
-            maskIter = itk::ImageRegionConstIterator<TImage>(mask, region);
-        }
-        itk::ImageRegionIterator<TCVImage> outputIter(this->GetOutput(), region);
-        
-        if (threadId == 0)
+        const auto output = this->GetOutput();
+        const QI::MaskSpans<3> spans(this->GetMask().GetPointer(), region);
+        const size_t nPars = m_model->nParameters();
+        if (threadId == 0) {
             m_clock.Reset();
-        while(!outputIter.IsAtEnd()) {
-            if (!mask || maskIter.Get()) {
-                if (threadId == 0) {
-                    m_clock.Start();
-                }
-                Eigen::VectorXd parameters = m_model->Default();
-                for (size_t i = 0; i < inIters.size(); i++) {
-                    if (this->GetInput(i))
-                        parameters[i] = inIters[i].Get();
-                }
-                Eigen::VectorXcd allData = m_sequence->signal(m_model, parameters);
-                if (m_sigma != 0.0) {
-                    Eigen::VectorXcd noise(m_sequence->size());
-                    // Simple Box Muller transform
-                    Eigen::ArrayXd U = (Eigen::ArrayXd::Random(m_sequence->size()) * 0.5) + 0.5;
-                    Eigen::ArrayXd V = (Eigen::ArrayXd::Random(m_sequence->size()) * 0.5) + 0.5;
-                    noise.real() = (m_sigma / M_SQRT2) * (-2. * U.log()).sqrt() * cos(2. * M_PI * V);
-                    noise.imag() = (m_sigma / M_SQRT2) * (-2. * V.log()).sqrt() * sin(2. * M_PI * U);
-                    allData += noise;
-                }
-                Eigen::VectorXcf floatData = allData.cast<std::complex<float>>();
-                itk::VariableLengthVector<std::complex<float>> dataVector(floatData.data(), m_sequence->size());
-                outputIter.Set(dataVector);
-                if (threadId == 0) {
-                    m_clock.Stop();
+        }
+        itk::SizeValueType voxels = 0;
+        for (const auto &span : spans) {
+            if (threadId == 0) {
+                m_clock.Start();
+            }
+            Eigen::ArrayXXd parameters = m_model->Default().replicate(1, span.length);
+            for (size_t i = 0; i < nPars; i++) {
+                const auto input = this->GetInput(i);
+                if (input) {
+                    TRegion::IndexType index = span.start;
+                    for (size_t v = 0; v < span.length; v++, index[0]++) {
+                        parameters(i, v) = input->GetPixel(index);
+                    }
                 }
             }
-            if (mask) {
-                ++maskIter;
+            Eigen::ArrayXXcd signals = m_sequence->signals(m_model, parameters);
+            if (m_noise.sigma() != 0.0) {
+                m_noise.add(signals, output->GetLargestPossibleRegion().ComputeOffset(span.start), m_stream);
+            }
+            const Eigen::ArrayXXcf floatSignals = signals.cast<std::complex<float>>();
+            TRegion::IndexType index = span.start;
+            for (size_t v = 0; v < span.length; v++, index[0]++) {
+                const itk::VariableLengthVector<std::complex<float>> dataVector(const_cast<std::complex<float> *>(floatSignals.col(v).data()), m_sequence->size());
+                output->SetPixel(index, dataVector);
             }
-            for (size_t i = 0; i < m_model->nParameters(); i++) {
-                if (this->GetInput(i))
-                    ++inIters[i];
+            voxels += span.length;
+            if (threadId == 0) {
+                m_clock.Stop();
             }
-            ++outputIter;
         }
         if (threadId == 0) {
-            m_evaluations = m_clock.GetNumberOfStops();
-            m_meanTime = m_clock.GetMean();
+            m_evaluations = voxels;
             m_totalTime = m_clock.GetTotal();
+            m_meanTime = voxels ? m_totalTime / voxels : 0.;
         }
     }
 
@@ -196,6 +188,95 @@ private:
     void operator=(const Self &);  //purposely not implemented
 };
 
+QI::SequenceGroup ReadSequences(cereal::JSONInputArchive &input, const size_t nFiles, const bool verbose) {
+    if (verbose) std::cout << "Reading sequences" << std::endl;
+    auto sequences = QI::ReadSequence<QI::SequenceGroup>(input, false);
+    if (verbose) {
+        std::cout << "Found " << sequences.count() << " sequences to generate" << std::endl;
+        cereal::JSONOutputArchive archive(std::cout); // cereal archives do not flush their output until destructed
+        archive(cereal::make_nvp("SequenceGroup", sequences));
+    }
+    if (nFiles != sequences.count()) {
+        QI_FAIL("Input filenames size " << nFiles << " does not match sequences size " << sequences.count());
+    }
+    return sequences;
+}
+
+/*
+ * Pure simulation, no images. Each parameter in the input is a list of values (empty for the
+ * default) and every combination of them is simulated. Each sequence is written as a text table
+ * with one row per combination, the parameters followed by the signals (real and imaginary parts
+ * in complex mode). The noise is the same as for a volume with the combinations as its voxels.
+ */
+int SimulateGrid(const std::shared_ptr<QI::Model> &model, cereal::JSONInputArchive &input,
+                 const QI::CounterNoise &noise, const std::vector<std::string> &filenames,
+                 const std::string &prefix, const bool complex, const bool verbose)
+{
+    const size_t nPars = model->nParameters();
+    std::vector<Eigen::ArrayXd> values(nPars);
+    size_t nPoints = 1;
+    for (size_t i = 0; i < nPars; i++) {
+        QI::ReadCereal(input, model->ParameterNames()[i], values[i]);
+        if (values[i].rows() == 0) {
+            values[i] = Eigen::ArrayXd::Constant(1, model->Default()[i]);
+        }
+        nPoints *= values[i].rows();
+    }
+    Eigen::ArrayXXd parameters(nPars, nPoints);
+    for (size_t p = 0; p < nPoints; p++) {
+        size_t rest = p;
+        for (size_t i = 0; i < nPars; i++) {
+            parameters(i, p) = values[i][rest % values[i].rows()];
+            rest /= values[i].rows();
+        }
+    }
+    if (verbose) std::cout << "Simulating " << nPoints << " parameter combinations" << std::endl;
+    auto sequences = ReadSequences(input, filenames.size(), verbose);
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    for (size_t s = 0; s < sequences.count(); s++) {
+        const auto &sequence = sequences[s];
+        if (verbose) std::cout << "Simulating sequence: " << sequence->name() << std::endl;
+        Eigen::ArrayXXcd signals(sequence->size(), nPoints);
+        const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nPoints));
+        pool.run(nTasks, [&](const size_t t) {
+            const size_t start = (nPoints * t) / nTasks;
+            const size_t count = (nPoints * (t + 1)) / nTasks - start;
+            Eigen::ArrayXXcd block = sequence->signals(model, parameters.middleCols(start, count));
+            if (noise.sigma() != 0.0) {
+                noise.add(block, start, s);
+            }
+            signals.middleCols(start, count) = block;
+        });
+        const std::string path = prefix + filenames[s];
+        if (verbose) std::cout << "Saving table: " << path << std::endl;
+        QI::CacheOutput(path);
+        std::ofstream file(path);
+        if (!file) {
+            QI_FAIL("Could not open " << path << " for writing");
+        }
+        file << "#";
+        for (const auto &name : model->ParameterNames()) {
+            file << " " << name;
+        }
+        file << " " << sequence->name() << "\n";
+        for (size_t p = 0; p < nPoints; p++) {
+            for (size_t i = 0; i < nPars; i++) {
+                file << (i ? " " : "") << parameters(i, p);
+            }
+            for (Eigen::Index j = 0; j < signals.rows(); j++) {
+                if (complex) {
+                    file << " " << signals(j, p).real() << " " << signals(j, p).imag();
+                } else {
+                    file << " " << std::abs(signals(j, p));
+                }
+            }
+            file << "\n";
+        }
+    }
+    if (verbose) std::cout << "Finished all sequences." << std::endl;
+    return EXIT_SUCCESS;
+}
+
 /*
  * Main
  */
@@ -215,6 +296,7 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> seed(parser, "SEED", "Seed noise RNG with specific value", {'s', "seed"}, -1);
     args::ValueFlag<int> model_arg(parser, "MODEL", "Choose number of components in model 1/2/3, default 1", {'M',"model"}, 1);
     args::Flag     complex(parser, "COMPLEX", "Save complex images", {'x',"complex"});
+    args::Flag     grid(parser, "GRID", "Simulate every combination of the parameter values in the input and write text tables instead of images", {"grid"});
     QI::ParseArgs(parser, argc, argv, verbose);
     if (!filenames) {
         std::cerr << "No output filenames specified. Use --help to see usage." << std::endl;
@@ -230,10 +312,12 @@ int main(int argc, char **argv) {
     }
     if (verbose) std::cout << "Using " << model->Name() << " model." << std::endl;
 
-    if (seed) {
-        std::srand(seed.Get());
-    } else {
-        std::srand((unsigned int) time(0));
+    const QI::CounterNoise noise_generator(noise.Get(), seed ? seed.Get() : QI::RandomSeed());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
+    cereal::JSONInputArchive input(std::cin);
+    if (grid) {
+        return SimulateGrid(model, input, noise_generator, filenames.Get(), outarg.Get(), complex, verbose);
     }
 
     /***************************************************************************
@@ -241,8 +325,7 @@ int main(int argc, char **argv) {
      **************************************************************************/
     SignalsFilter::Pointer calcSignal = SignalsFilter::New();
     calcSignal->SetModel(model);
-    calcSignal->SetSigma(noise.Get());
-    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
+    calcSignal->SetNoise(noise_generator);
     if (mask) {
         if (verbose) std::cout << "Reading mask: " << mask.Get() << std::endl;
         calcSignal->SetMask(QI::ReadImage(mask.Get()));
@@ -258,54 +341,53 @@ int main(int argc, char **argv) {
         calcSignal->AddObserver(itk::ProgressEvent(), monitor);
     }
     if (verbose) std::cout << "Reading model parameter filenames" << std::endl;
-    cereal::JSONInputArchive input(std::cin);
+    std::vector<size_t> indices;
+    std::vector<QI::VolumeF::Pointer> params;
     for (size_t i = 0; i < model->nParameters(); i++) {
         std::string par_filename;
         std::string par_name = model->ParameterNames()[i];
         QI::ReadCereal(input, par_name, par_filename);
         if (par_filename != "") {
             if (verbose) std::cout << "Opening " << par_filename << std::endl;
-            QI::VolumeF::Pointer param = QI::ReadImage(par_filename);
-            if (reference) {
-                if (verbose) std::cout << "Resampling to reference" << std::endl;
-                typedef itk::ResampleImageFilter<QI::VolumeF, QI::VolumeF, double> TResampler;
-                typedef itk::LinearInterpolateImageFunction<QI::VolumeF, double> TInterp;
-                typename TInterp::Pointer interp = TInterp::New();
-                interp->SetInputImage(param);
-                typename TResampler::Pointer resamp = TResampler::New();
-                resamp->SetInput(param);
-                resamp->SetInterpolator(interp);
-                resamp->SetDefaultPixelValue(0.);
-                resamp->SetOutputParametersFromImage(reference);
-                resamp->Update();
-                QI::VolumeF::Pointer rparam = resamp->GetOutput();
-                rparam->DisconnectPipeline();   
-                calcSignal->SetInput(i, rparam);
-            } else { 
-                calcSignal->SetInput(i, param);
-            }
+            indices.push_back(i);
+            params.push_back(QI::ReadImage(par_filename));
         } else {
             if (verbose) std::cout << "Using default " << par_name << " value: " << model->Default()[i] << std::endl;
         }
     }
+    if (reference) {
+        // Maps on the same grid share one set of interpolation weights and are resampled together
+        std::vector<bool> done(params.size(), false);
+        for (size_t p = 0; p < params.size(); p++) {
+            if (done[p]) continue;
+            if (verbose) std::cout << "Resampling to reference" << std::endl;
+            const QI::GridResampler resampler(params[p].GetPointer(), reference.GetPointer());
+            std::vector<size_t> group;
+            std::vector<const QI::VolumeF *> images;
+            for (size_t q = p; q < params.size(); q++) {
+                if (!done[q] && resampler.matches(params[q].GetPointer())) {
+                    done[q] = true;
+                    group.push_back(q);
+                    images.push_back(params[q].GetPointer());
+                }
+            }
+            const auto resampled = resampler.apply(images);
+            for (size_t g = 0; g < group.size(); g++) {
+                params[group[g]] = resampled[g];
+            }
+        }
+    }
+    for (size_t p = 0; p < params.size(); p++) {
+        calcSignal->SetInput(indices[p], params[p]);
+    }
 
     /***************************************************************************
      * Set up sequences
      **************************************************************************/
-    if (verbose) std::cout << "Reading sequences" << std::endl;
-    auto sequences = QI::ReadSequence<QI::SequenceGroup>(input, false);
-    if (verbose) {
-        std::cout << "Found " << sequences.count() << " sequences to generate" << std::endl;
-        cereal::JSONOutputArchive archive(std::cout); // cereal archives do not flush their output until destructed
-        archive(cereal::make_nvp("SequenceGroup", sequences));
-    }
-    if (filenames.Get().size() != sequences.count()) {
-        QI_FAIL("Input filenames size " << filenames.Get().size()
-                << " does not match sequences size " << sequences.count());
-    }
+    auto sequences = ReadSequences(input, filenames.Get().size(), verbose);
     for (size_t i = 0; i < sequences.count(); i++) {
         if (verbose) std::cout << "Simulating sequence: " << sequences[i]->name() << std::endl;
-        calcSignal->SetSequence(sequences[i]);
+        calcSignal->SetSequence(sequences[i], i);
         calcSignal->Update();
         QI::VectorVolumeXF::Pointer output = calcSignal->GetOutput();
         output->DisconnectPipeline();
@@ -2,19 +2,40 @@
 #define APPLYALGOFILTER_H
 
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <fstream>
+#include <cstdint>
+#include <Eigen/Core>
 #include "itkImageToImageFilter.h"
 #include "itkVariableLengthVector.h"
 #include "itkVectorImage.h"
 #include "itkTimeProbe.h"
+#include "itkDefaultConvertPixelTraits.h"
 #include "ThreadPool.h"
+#include "ChunkScheduler.h"
+#include "SharedQueue.h"
+#include "PixelBuffers.h"
+#include "PackedImage.h"
+#include "Util.h"
 
 namespace itk{
 
+/*
+ * Checkpoint files are a small header followed by one fixed-size record per completed voxel:
+ * the voxel offset, each output, the residual, the all-residuals (if requested) and the
+ * iterations. Records are appended in any order. A truncated final record (e.g. from a job
+ * being killed mid-write) is ignored when resuming. The header is the magic, then the number of voxels
+ * in the image and the record size, both uint64_t.
+ */
+static const char CheckpointMagic[8] = {'Q', 'I', 'C', 'K', 'P', 'T', '0', '1'};
+
 template<typename TInputImage_,
          typename TOutputImage_,
          typename TConstImage_,
          typename TMaskImage_>
-class ApplyAlgorithmFilter : public ImageToImageFilter<TInputImage_, TOutputImage_> {
+class ApplyAlgorithmFilter : public ImageToImageFilter<TInputImage_, TOutputImage_>, public QI::VoxelCounter {
 public:
     typedef TInputImage_  TInputImage;
     typedef TOutputImage_ TOutputImage;
@@ -22,10 +43,17 @@ public:
     typedef TMaskImage_   TMaskImage;
 
     typedef typename TInputImage::PixelType  TInputPixel;
+    typedef typename TInputPixel::ValueType  TInputValue;
     typedef typename TOutputImage::PixelType TOutputPixel;
     typedef typename TConstImage::PixelType  TConstPixel;
+    typedef typename DefaultConvertPixelTraits<TOutputPixel>::ComponentType TOutputValue;
     typedef int TIterations;
     typedef Image<TIterations, TInputImage::ImageDimension> TIterationsImage;
+    typedef float TTiming;
+    typedef Image<TTiming, TInputImage::ImageDimension> TTimingImage;
+    typedef unsigned char TFailure; // 0 fitted, 1 the voxel failed, 2 the batch it was in failed, 3 screened out
+    typedef Image<TFailure, TInputImage::ImageDimension> TFailuresImage;
+    typedef VectorImage<TOutputValue, TInputImage::ImageDimension> TInterleavedImage;
 
     typedef ApplyAlgorithmFilter                          Self;
     typedef ImageToImageFilter<TInputImage, TOutputImage> Superclass;
@@ -43,6 +71,12 @@ public:
         using TConst = TConstPixel;
         using TIndex = ApplyAlgorithmFilter::TIndex;           // Make TIndex available to algorithm subclasses
         using TIterations = ApplyAlgorithmFilter::TIterations; // Make TIterations available to algorithm subclasses
+        /* Blocks of voxels for applyBatch, one column per voxel */
+        using TInputBlock  = Eigen::Map<const Eigen::Matrix<TInputValue, Eigen::Dynamic, Eigen::Dynamic>>;
+        using TConstBlock  = Eigen::Map<const Eigen::Array<TConstPixel, 1, Eigen::Dynamic>>;
+        using TOutputBlock = Eigen::Map<Eigen::Matrix<TOutputValue, Eigen::Dynamic, Eigen::Dynamic>>;
+        using TResidsBlock = Eigen::Map<Eigen::Matrix<TInputValue, Eigen::Dynamic, Eigen::Dynamic>>;
+        using TIterationsBlock = Eigen::Map<Eigen::Array<TIterations, 1, Eigen::Dynamic>>;
         virtual size_t numInputs() const = 0;  // The number of inputs that will be concatenated into the data vector
         virtual size_t numConsts() const = 0;  // Number of constant input parameters/variables
         virtual size_t numOutputs() const = 0; // Number of output parameters/variables
@@ -55,7 +89,50 @@ public:
                            std::vector<TOutput> &outputs,
                            TOutput &residual, TInput &resids,
                            TIterations &iterations) const = 0; // Apply the algorithm to the data from one voxel. Return false to indicate algorithm failed.
+                                                               // With warm-starting or initial maps outputs holds initial values on entry, or zero() if there are none.
         virtual TOutput zero() const = 0; // Hack, to supply a zero for masked voxels
+        /* Optional batch interface. Algorithms that can process many voxels at once (e.g. linear fits)
+         * should override both of these. Inputs are (data size x voxels), outputs and the residual are
+         * (output size x voxels), resids is (data size x voxels) or empty if not requested. */
+        virtual bool hasBatch() const { return false; }
+        virtual bool applyBatch(const std::vector<TInputBlock> &inputs,
+                                const std::vector<TConstBlock> &consts,
+                                std::vector<TOutputBlock> &outputs,
+                                TOutputBlock &residual, TResidsBlock &resids,
+                                TIterationsBlock &iterations) const { return false; }
+        /* The same, with the index of each voxel in the block, for algorithms that need it (e.g. to seed
+         * a random number generator per voxel). The filter calls this one, which defaults to applyBatch. */
+        virtual bool applyIndexedBatch(const TIndex *indices,
+                                       const std::vector<TInputBlock> &inputs,
+                                       const std::vector<TConstBlock> &consts,
+                                       std::vector<TOutputBlock> &outputs,
+                                       TOutputBlock &residual, TResidsBlock &resids,
+                                       TIterationsBlock &iterations) const {
+            return applyBatch(inputs, consts, outputs, residual, resids, iterations);
+        }
+        /* With SetMultigrid, called between the coarse and fine passes with the output images, in which
+         * only the lattice voxels (index start + spacing * n) have been fitted so far, e.g. to narrow the
+         * search for the fine pass. Only the buffered region of the images can be read. */
+        virtual void latticeFitted(const std::vector<const TOutputImage *> &outputs, const TOutputImage *residual,
+                                   const TIndex &start, const size_t spacing) {}
+        /* Algorithms that can split the work of one voxel over the global pool themselves, when they are
+         * not already running on it (see QI::ThreadPool::InWorker), return true. With fewer voxels than
+         * threads the filter then fits them one after another on the calling thread, so each fit can use
+         * every thread, instead of giving each voxel one worker and leaving the rest idle. */
+        virtual bool parallelWithinVoxel() const { return false; }
+        /* Set by the filter before fitting. Outputs that will not be stored need not be computed, in
+         * particular the residual. Everything is wanted until then. */
+        void setWanted(const std::vector<bool> &outputs, const bool residual, const bool iterations) {
+            m_wantOutputs = outputs;
+            m_wantResidual = residual;
+            m_wantIterations = iterations;
+        }
+        bool wantsOutput(const size_t i) const { return i >= m_wantOutputs.size() || m_wantOutputs[i]; }
+        bool wantsResidual() const { return m_wantResidual; }
+        bool wantsIterations() const { return m_wantIterations; }
+    private:
+        std::vector<bool> m_wantOutputs;
+        bool m_wantResidual = true, m_wantIterations = true;
     };
 
     void SetAlgorithm(const std::shared_ptr<Algorithm> &a);
@@ -63,23 +140,77 @@ public:
 
     void SetInput(unsigned int i, const TInputImage *img) override;
     typename TInputImage::ConstPointer GetInput(const size_t i) const;
+    /* Fit input i from an image packed in memory, the workers unpack a brick at a time. Input i is
+     * then the packed image's header, which has no buffer. SetInput() replaces it. */
+    void SetPackedInput(const size_t i, const std::shared_ptr<const QI::PackedImage<TInputImage>> &packed);
+    const QI::PackedImage<TInputImage> *GetPackedInput(const size_t i) const; // Null unless input i is packed
     void SetConst(const size_t i, const TConstImage *img);
     typename TConstImage::ConstPointer GetConst(const size_t i) const;
     void SetMask(const TMaskImage *mask);
     typename TMaskImage::ConstPointer GetMask() const;
 
     void SetPoolsize(const size_t nThreads);
-    void SetSplitsPerThread(const size_t nSplits);
+    void SetPin(const bool p); // Pin worker threads to CPUs and zero each output region from the worker that will fit it
     void SetSubregion(const TRegion &sr); 
+    /* Print the data and consts of every voxel before fitting it and the fit afterwards, to look at a
+     * few voxels (--voxel). The residual and iterations are then always kept. */
+    void SetInspect(const bool i);
     void SetVerbose(const bool v);
     void SetOutputAllResiduals(const bool r); 
+    void SetOutputTiming(const bool t); // Record the wall-clock nanoseconds spent on each voxel
+    void SetOutputFailures(const bool f); // Mark the voxels the algorithm failed for, see TFailure
+    /* Only the outputs a program asks for before Update() are allocated and stored, and the algorithm
+     * is told it can skip the rest. The residual and iteration maps are off unless requested, and all
+     * parameter maps are on unless skipped. Checkpoints store every map and multigrid reads them back,
+     * so with either of those all of them are kept. */
+    void SetOutputResidual(const bool r);
+    void SetOutputIterations(const bool i);
+    void SetSkipOutput(const size_t i, const bool skip = true);
+    /* Write every parameter map into one image instead, with the outputs of each voxel next to each
+     * other (output i at components i*outputSize onwards), so the workers store a voxel in one place.
+     * GetOutput() then has no buffer. Cannot be combined with checkpoints or multigrid. */
+    void SetInterleaved(const bool i);
+    void SetWarmStart(const bool w); // Pass each voxel the fit of its neighbour along the scanline as initial values
+    void SetMultigrid(const size_t factor); // Fit every factor'th voxel along each axis first and seed the rest from them
+    /* Only fit every factor'th voxel along each axis and copy each fit to the voxels of its cell, for
+     * a quick look at the maps in about 1/factor^D of the time. GetTotalTime() is then the preview
+     * time, GetExtrapolatedTime() what the full fit should take. Not for checkpoints, multigrid or
+     * streaming, whose cells would not all be in one pass. */
+    void SetPreview(const size_t factor);
+    void SetInitial(const size_t i, const TOutputImage *img); // Start each voxel from this map of output i, e.g. the fit to the previous time-point
+    void SetCheckpoint(const std::string &path); // Periodically save completed voxels to this file
+    void SetResume(const bool r); // Restore voxels already in the checkpoint file and skip them
+    void SetShard(const size_t index, const size_t count); // Only process shard index (from 0) of count equal-sized shards of the voxels
+    void SetQueue(const std::string &dir); // Take chunks of the voxels from a queue shared with other processes, see QI::SharedQueue
+    void SetSparse(const bool s); // Gather voxels into dense blocks before applying the algorithm, always true if the algorithm has a batch interface
+    void SetScreen(const double snr, const double noise = 0); // Skip voxels whose largest input value is below snr times the noise, estimated from the background if 0
+    /* Only fit the voxels where select is non-zero, starting from the initial maps (SetInitial), e.g.
+     * the poor fits of an earlier run. The rest of the mask keeps the earlier run's results, the
+     * initial maps and this residual and these iterations (either may be null for zeros), so the
+     * outputs are that run with the selected voxels patched. Not for shards, queues, preview or multigrid. */
+    void SetRefit(const TMaskImage *select, const TOutputImage *residual, const TIterationsImage *iterations);
+    void SetStats(const std::string &path); // Write per-worker counts of voxels, model evaluations, allocations & hardware counters to this JSON file
     
     TOutputImage     *GetOutput(const size_t i);
     TOutputImage     *GetResidualOutput();
     TInputImage      *GetAllResidualsOutput();
     TIterationsImage *GetIterationsOutput();
+    TTimingImage     *GetTimingOutput();
+    TFailuresImage   *GetFailuresOutput();
+    TInterleavedImage *GetInterleavedOutput();
 
+    /* Bytes per voxel of the inputs, consts & mask set so far and the outputs that will be allocated,
+     * for sizing streamed slabs. Per-voxel scratch and the algorithm's own tables are not included. */
+    size_t GetBytesPerVoxel() const;
     RealTimeClock::TimeStampType GetTotalTime() const;
+    RealTimeClock::TimeStampType GetExtrapolatedTime() const; // With SetPreview, the same as GetTotalTime() otherwise
+    const std::vector<size_t> &GetWorkerVoxels() const; // Voxels processed by each worker in the last Update
+    const std::vector<double> &GetWorkerTimes() const;  // Seconds each worker spent processing
+    size_t GetFailures() const; // Voxels the algorithm failed for in the last Update
+    size_t GetScreened() const; // Voxels skipped by the screen in the last Update
+    size_t GetRefitted() const; // Voxels selected for the re-fit in the last Update
+    size_t GetVoxelsDone() const override;
+    size_t GetVoxelsTotal() const override;
 
 protected:
     ApplyAlgorithmFilter();
@@ -87,20 +218,106 @@ protected:
     DataObject::Pointer MakeOutput(ProcessObject::DataObjectPointerArraySizeType idx) ITK_OVERRIDE;
 
     std::shared_ptr<Algorithm> m_algorithm;
-    bool m_verbose = false, m_hasSubregion = false, m_allResiduals = false;
-    size_t m_poolsize = 1, m_splitsPerThread = 1;
+    bool m_verbose = false, m_hasSubregion = false, m_allResiduals = false, m_timing = false, m_sparse = false, m_pin = false;
+    bool m_failures = false, m_inspect = false;
+    bool m_warmStart = false, m_seedFromLattice = false;
+    bool m_residual = false, m_iterations = false, m_interleaved = false;
+    std::vector<bool> m_skip; // Parameter maps not needed, may be shorter than the outputs
+    size_t m_multigrid = 1, m_preview = 1;
+    std::vector<typename TOutputImage::ConstPointer> m_initial; // Empty, or one per output (null for none)
+    std::vector<std::shared_ptr<const QI::PackedImage<TInputImage>>> m_packed; // Empty, or one per input (null for an image)
+    size_t m_poolsize = 1;
     TRegion m_subregion;
 
-    RealTimeClock::TimeStampType m_elapsedTime = 0.0;
+    RealTimeClock::TimeStampType m_elapsedTime = 0.0, m_extrapolatedTime = 0.0;
+    std::vector<size_t> m_workerVoxels;
+    std::vector<double> m_workerTimes;
+    /* Each worker only counts its own failures and keeps the first few indices, so failing voxels
+     * cost no locking or output in the loop. GenerateData then prints one summary. */
+    struct WorkerFailures {
+        size_t count = 0;
+        std::vector<TIndex> first;
+    };
+    std::vector<WorkerFailures> m_workerFailures;
+    std::atomic<size_t> m_voxelsDone{0};
+    size_t m_voxelsTotal = 0;
+    std::string m_checkpointPath;
+    bool m_resume = false;
+    size_t m_shardIndex = 0, m_shardCount = 1;
+    std::string m_queuePath;
+    double m_screenSNR = 0, m_screenNoise = 0;
+    std::vector<TIndex> m_screened;
+    typename TMaskImage::ConstPointer m_refit;
+    typename TOutputImage::ConstPointer m_refitResidual;
+    typename TIterationsImage::ConstPointer m_refitIterations;
+    std::vector<TIndex> m_kept; // Voxels outside the re-fit selection
+    size_t m_refitted = 0;
+    std::ofstream m_checkpointFile;
+    std::mutex m_checkpointMutex;
+    // Totals for --stats, kept across Updates so a streamed fit reports every slab
+    struct WorkerStats {
+        size_t voxels = 0;
+        double seconds = 0;
+        uint64_t evaluations = 0, allocations = 0, cycles = 0, instructions = 0, cacheMisses = 0;
+        bool perf = true;
+    };
+    std::string m_statsPath;
+    std::vector<WorkerStats> m_stats;
+    double m_statsElapsed = 0;
     static const int ResidualOutputOffset = 0;
     static const int IterationsOutputOffset = 1;
     static const int AllResidualsOutputOffset = 2;
-    static const int ExtraOutputs = 3;
+    static const int TimingOutputOffset = 3;
+    static const int InterleavedOutputOffset = 4;
+    static const int FailuresOutputOffset = 5;
+    static const int ExtraOutputs = 6;
+    static const size_t FailuresReported = 10; // Voxel indices listed in the failure summary
+    static const size_t BlockSize = 256; // Voxels gathered at once in sparse mode
+    static const size_t ProgressFlush = 64; // Voxels each worker processes before updating the shared count
+    static const size_t ScreenGrain = 4096; // Voxels per task when screening
+    static const size_t QueueChunk = 16384; // Voxels claimed at once from a shared queue
+    static const size_t CheckpointFlush = 1024; // Voxels each worker buffers before appending to the checkpoint
+    typedef QI::BufferOffsets<TInputImage::ImageDimension> TOffsets; // Voxel offsets for the workers' PixelBuffers
+
+    void RunWorkers(const std::vector<TIndex> &voxels, const bool firstTouch);
+    void RunWorker(const std::vector<TIndex> &voxels, QI::ChunkScheduler &scheduler, const size_t worker);
+    static bool ScanlineNeighbours(const TIndex &a, const TIndex &b);
+    static bool OnLattice(const TIndex &index, const TIndex &start, const size_t spacing);
+    static TIndex LatticeIndex(const TIndex &index, const TIndex &start, const size_t spacing);
+    template<typename TImage> static void CopyFromLattice(TImage *img, const std::vector<TIndex> &voxels,
+                                                          const TIndex &start, const size_t spacing);
+    bool FirstTouch() const;
+    bool KeepOutput(const size_t i) const;
+    bool KeepResidual() const;
+    bool KeepIterations() const;
+    QI::PixelBuffer<TOutputImage> OutputBuffer(const size_t i, TOffsets &offsets);
+    void InitialOutputs(const TIndex &index, std::vector<TOutputPixel> &outputs) const;
+    void SeedOutputs(const TIndex &index, const bool neighbourFitted, const TIndex &latticeStart,
+                     const std::vector<TOutputImage *> &outputImages, std::vector<TOutputPixel> &outputs) const;
+    void FirstTouchOutputs(const std::vector<TIndex> &voxels, const QI::ChunkScheduler &scheduler, const size_t worker);
+    template<typename TImage> static void ZeroPixels(TImage *img, const size_t first, const size_t last);
+    size_t CheckpointRecordSize() const;
+    std::vector<bool> ReadCheckpoint();
+    void OpenCheckpoint(const std::vector<bool> &restored);
+    void AppendCheckpoint(std::vector<char> &buffer, const TIndex &index);
+    void FlushCheckpoint(std::vector<char> &buffer, const bool force = false);
+    void WriteStats() const;
+    void RecordFailure(const size_t worker, const TIndex &index);
+    void ReportFailures() const;
+    double EstimateNoise() const;
+    void Screen(std::vector<TIndex> &voxels);
+    void SelectRefit(std::vector<TIndex> &voxels);
+    void PatchKept();
+    void InspectData(const TIndex &index) const;
+    void InspectFit(const TIndex &index);
 
+    /* Doing my own threading, so GenerateData hands out chunks of voxels to each worker */
     virtual void GenerateData() ITK_OVERRIDE;
-    /* Doing my own threading so override both of these */
     virtual void GenerateOutputInformation() ITK_OVERRIDE;
-    virtual void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE;
+    virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    virtual void AllocateOutputs() ITK_OVERRIDE;
+    virtual void ThreadedGenerateVoxels(const std::vector<TIndex> &voxels, QI::ChunkScheduler &scheduler, const size_t worker);
+    virtual void ThreadedGenerateBlocks(const std::vector<TIndex> &voxels, QI::ChunkScheduler &scheduler, const size_t worker);
 
 private:
     ApplyAlgorithmFilter(const Self &); //purposely not implemented
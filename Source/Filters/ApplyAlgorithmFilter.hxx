@@ -1,14 +1,19 @@
 #ifndef APPLYALGORITHMFILTER_HXX
 #define APPLYALGORITHMFILTER_HXX
 
+#include <chrono>
+#include <thread>
+#include <cmath>
 #include "itkObjectFactory.h"
-#include "itkImageRegionIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkImageRegionConstIterator.h"
 #include "itkProgressReporter.h"
-#include "itkImageRegionSplitterSlowDimension.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
 
 #include "ApplyAlgorithmFilter.h"
+#include "MaskSpans.h"
+#include "ResultCache.h"
+#include "Trace.h"
+#include "Counters.h"
+#include "Arena.h"
 
 namespace itk {
 
@@ -24,7 +29,7 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetAlgorithm(const std::shared_ptr<Al
     // Inputs go: Data 0, Data 1, ..., Mask, Const 0, Const 1, ...
     // Only the data inputs are required, the others are optional
     this->SetNumberOfRequiredInputs(a->numInputs());
-    // Outputs go: Parameter 0, Parameter 1, ..., AllResiduals, Residual, Iterations
+    // Outputs go: Parameter 0, Parameter 1, ..., Residual, Iterations, AllResiduals, Timing, Interleaved, Failures
     // Need to be this way because at some ITK assumes 1st output is of TOutputImage
     this->SetNumberOfRequiredOutputs(m_algorithm->numOutputs()+ExtraOutputs);
     for (size_t i = 0; i < (m_algorithm->numOutputs()+ExtraOutputs); i++) {
@@ -42,15 +47,13 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetPoolsize(const size_t n) {
     } else {
         m_poolsize = std::thread::hardware_concurrency();
     }
+    QI::ThreadPool::SetGlobalThreads(m_poolsize);
 }
 
 template<typename TI, typename TO, typename TC, typename TM>
-void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetSplitsPerThread(const size_t n) {
-    if (n > 0) {
-        m_splitsPerThread = n;
-    } else {
-        m_splitsPerThread = m_poolsize;
-    }
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetPin(const bool p) {
+    m_pin = p;
+    QI::ThreadPool::SetGlobalPinning(p);
 }
 
 template<typename TI, typename TO, typename TC, typename TM>
@@ -60,24 +63,203 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetSubregion(const TRegion &sr) {
     m_hasSubregion = true;
 }
 
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetInspect(const bool i) { m_inspect = i; }
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetVerbose(const bool v) { m_verbose = v; }
 
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetCheckpoint(const std::string &path) { m_checkpointPath = path; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetResume(const bool r) { m_resume = r; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetShard(const size_t index, const size_t count) {
+    if (count == 0 || index >= count) {
+        itkExceptionMacro("Invalid shard " << index << " of " << count);
+    }
+    m_shardIndex = index;
+    m_shardCount = count;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetSparse(const bool s) { m_sparse = s; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetStats(const std::string &path) { m_statsPath = path; }
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetOutputAllResiduals(const bool r) { m_allResiduals = r; }
 
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetOutputTiming(const bool t) { m_timing = t; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetQueue(const std::string &dir) { m_queuePath = dir; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetScreen(const double snr, const double noise) {
+    if (snr < 0 || noise < 0) {
+        itkExceptionMacro("Screen SNR and noise level must not be negative");
+    }
+    m_screenSNR = snr;
+    m_screenNoise = noise;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetRefit(const TMaskImage *select, const TOutputImage *residual,
+                                                    const TIterationsImage *iterations) {
+    m_refit = select;
+    m_refitResidual = residual;
+    m_refitIterations = iterations;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetOutputFailures(const bool f) { m_failures = f; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetOutputResidual(const bool r) { m_residual = r; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetOutputIterations(const bool i) { m_iterations = i; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetSkipOutput(const size_t i, const bool skip) {
+    if (i >= m_skip.size()) {
+        m_skip.resize(i + 1, false);
+    }
+    m_skip[i] = skip;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetInterleaved(const bool i) { m_interleaved = i; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::KeepOutput(const size_t i) const {
+    return !(i < m_skip.size() && m_skip[i]) || !m_checkpointPath.empty() || m_multigrid > 1;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::KeepResidual() const {
+    return m_residual || m_inspect || !m_checkpointPath.empty() || m_multigrid > 1;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::KeepIterations() const {
+    return m_iterations || m_inspect || !m_checkpointPath.empty();
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::OutputBuffer(const size_t i, TOffsets &offsets) -> QI::PixelBuffer<TOutputImage> {
+    if (m_interleaved) {
+        const size_t size = m_algorithm->outputSize();
+        return QI::PixelBuffer<TOutputImage>(this->GetInterleavedOutput(), offsets, i * size, size);
+    }
+    return QI::PixelBuffer<TOutputImage>(this->GetOutput(i), offsets);
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetWarmStart(const bool w) { m_warmStart = w; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetMultigrid(const size_t factor) { m_multigrid = std::max<size_t>(factor, 1); }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetPreview(const size_t factor) { m_preview = std::max<size_t>(factor, 1); }
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetInitial(const size_t i, const TOutputImage *img) {
+    if (i >= m_algorithm->numOutputs()) {
+        itkExceptionMacro("Requested initial output " << i << " does not exist (" << m_algorithm->numOutputs() << " outputs)");
+    }
+    m_initial.resize(m_algorithm->numOutputs());
+    m_initial[i] = img;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetBytesPerVoxel() const {
+    const size_t outputBytes = m_algorithm->outputSize() * sizeof(TOutputValue);
+    size_t bytes = m_algorithm->dataSize() * sizeof(TInputValue);
+    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+        const auto *packed = GetPackedInput(i);
+        if (packed) {
+            const size_t pixels = packed->header()->GetBufferedRegion().GetNumberOfPixels();
+            bytes -= packed->components() * sizeof(TInputValue);
+            bytes += pixels ? (packed->bytes() + pixels - 1) / pixels : 0;
+        }
+    }
+    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+        if (this->GetConst(i)) bytes += sizeof(TConstPixel);
+    }
+    if (this->GetMask()) bytes += sizeof(typename TMaskImage::PixelType);
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        if (m_interleaved || KeepOutput(i)) bytes += outputBytes;
+    }
+    if (KeepResidual()) bytes += outputBytes;
+    if (KeepIterations()) bytes += sizeof(TIterations);
+    if (m_allResiduals) bytes += m_algorithm->dataSize() * sizeof(TInputValue);
+    if (m_timing) bytes += sizeof(TTiming);
+    if (m_failures) bytes += sizeof(TFailure);
+    return bytes;
+}
+
 template<typename TI, typename TO, typename TC, typename TM>
 RealTimeClock::TimeStampType ApplyAlgorithmFilter<TI, TO, TC, TM>::GetTotalTime() const { return m_elapsedTime; }
 
+template<typename TI, typename TO, typename TC, typename TM>
+RealTimeClock::TimeStampType ApplyAlgorithmFilter<TI, TO, TC, TM>::GetExtrapolatedTime() const { return m_extrapolatedTime; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+const std::vector<size_t> &ApplyAlgorithmFilter<TI, TO, TC, TM>::GetWorkerVoxels() const { return m_workerVoxels; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+const std::vector<double> &ApplyAlgorithmFilter<TI, TO, TC, TM>::GetWorkerTimes() const { return m_workerTimes; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetFailures() const {
+    size_t total = 0;
+    for (const auto &f : m_workerFailures) total += f.count;
+    return total;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetScreened() const { return m_screened.size(); }
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetRefitted() const { return m_refitted; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetVoxelsDone() const { return m_voxelsDone; }
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::GetVoxelsTotal() const { return m_voxelsTotal; }
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetInput(unsigned int i, const TInputImage *image) {
     if (i < m_algorithm->numInputs()) {
         this->SetNthInput(i, const_cast<TInputImage*>(image));
+        if (i < m_packed.size()) {
+            m_packed[i].reset();
+        }
     } else {
         itkExceptionMacro("Requested input " << i << " does not exist (" << m_algorithm->numInputs() << " inputs)");
     }
 }
 
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetPackedInput(const size_t i, const std::shared_ptr<const QI::PackedImage<TInputImage>> &packed) {
+    this->SetInput(i, packed->header());
+    m_packed.resize(m_algorithm->numInputs());
+    m_packed[i] = packed;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::GetPackedInput(const size_t i) const -> const QI::PackedImage<TInputImage> * {
+    return i < m_packed.size() ? m_packed[i].get() : nullptr;
+}
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::SetConst(const size_t i, const TConstImage *image) {
     if (i < m_algorithm->numConsts()) {
@@ -130,6 +312,15 @@ DataObject::Pointer ApplyAlgorithmFilter<TI, TO, TC, TM>::MakeOutput(ProcessObje
     } else if (idx == (m_algorithm->numOutputs() + IterationsOutputOffset)) {
         auto img = TIterationsImage::New();
         output = img;
+    } else if (idx == (m_algorithm->numOutputs() + TimingOutputOffset)) {
+        auto img = TTimingImage::New();
+        output = img;
+    } else if (idx == (m_algorithm->numOutputs() + InterleavedOutputOffset)) {
+        auto img = TInterleavedImage::New();
+        output = img;
+    } else if (idx == (m_algorithm->numOutputs() + FailuresOutputOffset)) {
+        auto img = TFailuresImage::New();
+        output = img;
     } else {
         itkExceptionMacro("Attempted to create output " << idx << ", index too high");
     }
@@ -160,6 +351,21 @@ auto ApplyAlgorithmFilter<TI, TO, TC, TM>::GetIterationsOutput() -> TIterationsI
     return dynamic_cast<TIterationsImage *>(this->ProcessObject::GetOutput(m_algorithm->numOutputs()+IterationsOutputOffset));
 }
 
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::GetTimingOutput() -> TTimingImage *{
+    return dynamic_cast<TTimingImage *>(this->ProcessObject::GetOutput(m_algorithm->numOutputs()+TimingOutputOffset));
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::GetInterleavedOutput() -> TInterleavedImage *{
+    return dynamic_cast<TInterleavedImage *>(this->ProcessObject::GetOutput(m_algorithm->numOutputs()+InterleavedOutputOffset));
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::GetFailuresOutput() -> TFailuresImage *{
+    return dynamic_cast<TFailuresImage *>(this->ProcessObject::GetOutput(m_algorithm->numOutputs()+FailuresOutputOffset));
+}
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateOutputInformation() {
     Superclass::GenerateOutputInformation();
@@ -173,183 +379,1224 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateOutputInformation() {
     if (size == 0) {
         itkExceptionMacro("Total input size cannot be 0");
     }
+    if (m_interleaved && (!m_checkpointPath.empty() || m_multigrid > 1)) {
+        itkExceptionMacro("Interleaved outputs cannot be used with checkpoints or multigrid, which read the separate maps");
+    }
+    if (m_preview > 1 && (!m_checkpointPath.empty() || m_multigrid > 1)) {
+        itkExceptionMacro("Preview cannot be combined with checkpoints or multigrid");
+    }
+    if (m_algorithm->hasBatch() && (m_warmStart || m_multigrid > 1 || !m_initial.empty())) {
+        itkExceptionMacro("Warm starts, multigrid and initial maps need a per-voxel algorithm, this one fits whole blocks from scratch");
+    }
 
     auto input     = this->GetInput(0);
     auto region    = input->GetLargestPossibleRegion();
     auto spacing   = input->GetSpacing();
     auto origin    = input->GetOrigin();
     auto direction = input->GetDirection();
-    if (m_verbose) std::cout << "Allocating output memory" << std::endl;
-    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
-        auto op = this->GetOutput(i);
-        op->SetRegions(region);
+    for (size_t i = 0; i < this->GetNumberOfOutputs(); i++) {
+        auto op = static_cast<ImageBase<TInputImage::ImageDimension> *>(this->ProcessObject::GetOutput(i));
+        op->SetLargestPossibleRegion(region);
         op->SetSpacing(spacing);
         op->SetOrigin(origin);
         op->SetDirection(direction);
-        op->SetNumberOfComponentsPerPixel(m_algorithm->outputSize());
-        op->Allocate(true);
-        if (m_verbose) std::cout << "Allocated output " << i << std::endl;
     }
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        this->GetOutput(i)->SetNumberOfComponentsPerPixel(m_algorithm->outputSize());
+    }
+    this->GetResidualOutput()->SetNumberOfComponentsPerPixel(m_algorithm->outputSize());
+    this->GetAllResidualsOutput()->SetNumberOfComponentsPerPixel(size);
+    this->GetInterleavedOutput()->SetNumberOfComponentsPerPixel(m_algorithm->numOutputs() * m_algorithm->outputSize());
+}
+
+/*
+ * With a subregion only that part of the inputs is needed, so a reader upstream only reads that
+ * much. Inputs that were read over part of the image (QI::ReadImage with a region) must cover it.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    if (!m_hasSubregion) {
+        return;
+    }
+    TRegion region = this->GetResidualOutput()->GetRequestedRegion();
+    if (!region.Crop(m_subregion)) {
+        region = m_subregion; // Nothing in this slab is fitted, but the region must not be empty
+    }
+    for (size_t i = 0; i < this->GetNumberOfIndexedInputs(); i++) {
+        auto input = dynamic_cast<ImageBase<TInputImage::ImageDimension> *>(this->ProcessObject::GetInput(i));
+        if (input) {
+            input->SetRequestedRegion(region);
+        }
+    }
+}
+
+/*
+ * Only the requested region of each output is allocated, so when a writer streams the outputs
+ * in slabs the memory used is bounded by the slab size instead of the whole volume. Outputs that
+ * were not asked for keep the region, for the offsets, but get no buffer.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::AllocateOutputs() {
+    const auto region = this->GetResidualOutput()->GetRequestedRegion();
+    if (m_verbose) std::cout << "Allocating output memory for region: " << region.GetIndex() << " " << region.GetSize() << std::endl;
+    const bool firstTouch = FirstTouch();
+    const auto allocate = [&](ImageBase<TInputImage::ImageDimension> *op, const bool keep) {
+        op->SetBufferedRegion(region);
+        if (keep) {
+            op->Allocate(!firstTouch); // Otherwise the workers zero their own parts
+        }
+    };
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        allocate(this->GetOutput(i), KeepOutput(i) && !m_interleaved);
+    }
+    allocate(this->GetInterleavedOutput(), m_interleaved);
+    allocate(this->GetResidualOutput(), KeepResidual());
+    allocate(this->GetIterationsOutput(), KeepIterations());
     if (m_allResiduals) {
-        if (m_verbose) std::cout << "Allocating residuals memory" << std::endl;
-        auto r = this->GetAllResidualsOutput();
-        r->SetRegions(region);
-        r->SetSpacing(spacing);
-        r->SetOrigin(origin);
-        r->SetDirection(direction);
-        r->SetNumberOfComponentsPerPixel(size);
-        r->Allocate(true);
-    }
-    if (m_verbose) std::cout << "Allocating total residual memory" << std::endl;
-    auto r = this->GetResidualOutput();
-    r->SetRegions(region);
-    r->SetSpacing(spacing);
-    r->SetOrigin(origin);
-    r->SetDirection(direction);
-    r->SetNumberOfComponentsPerPixel(m_algorithm->outputSize());
-    r->Allocate(true);
-    if (m_verbose) std::cout << "Allocating iterations memory" << std::endl;
-    auto i = this->GetIterationsOutput();
-    i->SetRegions(region);
-    i->SetSpacing(spacing);
-    i->SetOrigin(origin);
-    i->SetDirection(direction);
-    i->Allocate(true);
+        allocate(this->GetAllResidualsOutput(), true);
+    }
+    if (m_timing) {
+        allocate(this->GetTimingOutput(), true);
+    }
+    if (m_failures) {
+        allocate(this->GetFailuresOutput(), true);
+    }
 }
 
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateData() {
-    auto fullRegion = this->GetInput(0)->GetLargestPossibleRegion();
+    const QI::TraceSpan span("fit", "ApplyAlgorithm");
+    this->AllocateOutputs();
+    auto fullRegion = this->GetResidualOutput()->GetRequestedRegion();
+    const bool streaming = (fullRegion != this->GetResidualOutput()->GetLargestPossibleRegion());
+    bool overlaps = true;
     if (m_hasSubregion) {
-        if (fullRegion.IsInside(m_subregion)) {
-            fullRegion = m_subregion;
-        } else {
+        if (!this->GetInput(0)->GetLargestPossibleRegion().IsInside(m_subregion)) {
             itkExceptionMacro("Specified subregion is not entirely inside image.");
         }
+        overlaps = fullRegion.Crop(m_subregion); // False if this slab is entirely outside the subregion
+    }
+    if (overlaps) {
+        const auto covers = [&](const ImageBase<TInputImage::ImageDimension> *img) {
+            return !img || img->GetBufferedRegion().IsInside(fullRegion);
+        };
+        for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+            if (!GetPackedInput(i) && !covers(this->GetInput(i))) {
+                itkExceptionMacro("Input " << i << " was not read over all of the region to fit");
+            }
+        }
+        for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+            if (!covers(this->GetConst(i))) {
+                itkExceptionMacro("Const " << i << " was not read over all of the region to fit");
+            }
+        }
+        if (!covers(this->GetMask())) {
+            itkExceptionMacro("The mask was not read over all of the region to fit");
+        }
     }
 
-    auto splitter = ImageRegionSplitterSlowDimension::New();
-    auto splits = splitter->GetNumberOfSplits(fullRegion, m_poolsize * m_splitsPerThread);
-    if (m_verbose) std::cout << "Number of splits: " << splits << std::endl;
+    // Compact the voxels to process into a list. Outputs are zero-initialised
+    // so masked-out voxels do not need to be visited.
+    std::vector<TIndex> voxels;
+    if (overlaps) {
+        const QI::MaskSpans<TIndex::IndexDimension> spans(this->GetMask().GetPointer(), fullRegion);
+        voxels.reserve(spans.count());
+        spans.forEach([&](const TIndex &index) { voxels.push_back(index); });
+    }
+    for (const auto &img : m_initial) {
+        if (img && img->GetLargestPossibleRegion() != this->GetInput(0)->GetLargestPossibleRegion()) {
+            itkExceptionMacro("Initial map is not the same size as the input");
+        }
+    }
+    SelectRefit(voxels);
+    if (m_shardCount > 1) {
+        // Split by voxel count rather than bounding box so every shard has a similar amount of work
+        const size_t shardBegin = voxels.size() * m_shardIndex / m_shardCount;
+        const size_t shardEnd = voxels.size() * (m_shardIndex + 1) / m_shardCount;
+        if (m_verbose) std::cout << "Shard " << m_shardIndex << " of " << m_shardCount << ": voxels " << shardBegin << " to " << shardEnd << std::endl;
+        voxels = std::vector<TIndex>(voxels.begin() + shardBegin, voxels.begin() + shardEnd);
+    }
+    if (!m_checkpointPath.empty()) {
+        if (streaming) {
+            itkExceptionMacro("Checkpoints cannot be used while streaming");
+        }
+        std::vector<bool> restored;
+        if (m_resume) {
+            restored = ReadCheckpoint();
+        }
+        OpenCheckpoint(restored);
+        if (!restored.empty()) {
+            TOutputImage *residualImage = this->GetResidualOutput();
+            voxels.erase(std::remove_if(voxels.begin(), voxels.end(),
+                                        [&](const TIndex &index) { return restored[residualImage->ComputeOffset(index)]; }),
+                         voxels.end());
+        }
+    } else if (m_shardCount > 1 || !m_queuePath.empty()) {
+        itkExceptionMacro("Sharding requires a checkpoint file to store the results");
+    }
+    if (!m_queuePath.empty()) {
+        // Every process must build the same list for the chunks to mean the same voxels
+        if (m_resume || m_shardCount > 1 || m_preview > 1 || m_multigrid > 1) {
+            itkExceptionMacro("A shared queue cannot be combined with resume, shards, preview or multigrid");
+        }
+    }
+    Screen(voxels);
+    if (m_verbose) std::cout << "Voxels to process: " << voxels.size() << std::endl;
+    const std::vector<TIndex> inspected = m_inspect ? voxels : std::vector<TIndex>();
+    for (const auto &index : inspected) {
+        InspectData(index);
+    }
+
+    m_voxelsTotal = voxels.size();
+    m_voxelsDone = 0;
+    m_workerVoxels.assign(m_poolsize, 0);
+    m_workerTimes.assign(m_poolsize, 0.0);
+    m_workerFailures.assign(m_poolsize, WorkerFailures());
+    if (!m_statsPath.empty()) {
+        m_stats.resize(m_poolsize);
+    }
+    m_seedFromLattice = false;
+    std::vector<bool> wanted(m_algorithm->numOutputs());
+    for (size_t i = 0; i < wanted.size(); i++) {
+        wanted[i] = KeepOutput(i);
+    }
+    m_algorithm->setWanted(wanted, KeepResidual() || m_allResiduals, KeepIterations());
     TimeProbe clock;
     clock.Start();
-    {   // Use scope-based instantiation to wait for the threadpool to stop
-        QI::ThreadPool threadPool(m_poolsize);
-        for (auto split = 0; split < splits; split++) {
-            auto task = [=] {
-                auto thread_region = fullRegion;
-                splitter->GetSplit(split, splits, thread_region);
-                this->ThreadedGenerateData(thread_region, split);
-            };
-            threadPool.enqueue(task);
-            if (m_verbose) std::cout << "Starting split " << split << std::endl;
+    const TIndex &start = this->GetResidualOutput()->GetLargestPossibleRegion().GetIndex();
+    const size_t allVoxels = voxels.size();
+    if (m_preview > 1) {
+        if (streaming) {
+            itkExceptionMacro("Preview cannot be used while streaming");
+        }
+        // Cells start at the corner of the subregion, so every cell that is processed has its fit
+        const TIndex &cellStart = fullRegion.GetIndex();
+        const auto rest = std::stable_partition(voxels.begin(), voxels.end(),
+                                                [&](const TIndex &index) { return OnLattice(index, cellStart, m_preview); });
+        const std::vector<TIndex> cells(rest, voxels.end());
+        voxels.erase(rest, voxels.end());
+        m_voxelsTotal = voxels.size();
+        if (m_verbose) std::cout << "Preview: fitting " << voxels.size() << " of " << allVoxels << " voxels" << std::endl;
+        RunWorkers(voxels, FirstTouch());
+        for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+            CopyFromLattice(this->GetOutput(i), cells, cellStart, m_preview);
+        }
+        CopyFromLattice(this->GetInterleavedOutput(), cells, cellStart, m_preview);
+        CopyFromLattice(this->GetResidualOutput(), cells, cellStart, m_preview);
+        CopyFromLattice(this->GetIterationsOutput(), cells, cellStart, m_preview);
+        if (m_allResiduals) {
+            CopyFromLattice(this->GetAllResidualsOutput(), cells, cellStart, m_preview);
+        }
+        if (m_timing) {
+            CopyFromLattice(this->GetTimingOutput(), cells, cellStart, m_preview);
+        }
+        if (m_failures) {
+            CopyFromLattice(this->GetFailuresOutput(), cells, cellStart, m_preview);
         }
+    } else if (m_multigrid > 1) {
+        if (streaming) {
+            itkExceptionMacro("Multigrid cannot be used while streaming");
+        }
+        // Fit a coarse lattice first, the remaining voxels then start from the nearest lattice voxel
+        const auto fine = std::stable_partition(voxels.begin(), voxels.end(),
+                                                [&](const TIndex &index) { return OnLattice(index, start, m_multigrid); });
+        const std::vector<TIndex> coarse(voxels.begin(), fine);
+        voxels.erase(voxels.begin(), fine);
+        if (m_verbose) std::cout << "Coarse pass: " << coarse.size() << " voxels" << std::endl;
+        RunWorkers(coarse, FirstTouch());
+        std::vector<const TOutputImage *> latticeOutputs;
+        for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+            latticeOutputs.push_back(this->GetOutput(i));
+        }
+        m_algorithm->latticeFitted(latticeOutputs, this->GetResidualOutput(), start, m_multigrid);
+        m_seedFromLattice = true;
+        if (m_verbose) std::cout << "Fine pass: " << voxels.size() << " voxels" << std::endl;
+        RunWorkers(voxels, false);
+    } else if (!m_queuePath.empty()) {
+        // Each chunk is fitted by the whole pool, the other processes sharing the queue take the rest
+        QI::SharedQueue queue(m_queuePath, voxels.size(), QueueChunk);
+        size_t begin, end, claimed = 0;
+        std::vector<TIndex> chunk;
+        while (queue.next(begin, end)) {
+            chunk.assign(voxels.begin() + begin, voxels.begin() + end);
+            RunWorkers(chunk, false);
+            claimed++;
+        }
+        if (m_verbose) std::cout << "Fitted " << claimed << " of " << queue.chunks() << " chunks from the queue" << std::endl;
+    } else {
+        RunWorkers(voxels, FirstTouch());
     }
     clock.Stop();
     m_elapsedTime = clock.GetTotal();
-    if (m_verbose) std::cout << "Finished all splits" << std::endl;
+    m_extrapolatedTime = m_elapsedTime;
+    if (m_preview > 1) {
+        // The copies are negligible, so the time scales with the voxels that were fitted
+        m_extrapolatedTime = voxels.empty() ? 0.0 : m_elapsedTime * allVoxels / voxels.size();
+        std::cout << "Preview fitted " << voxels.size() << " of " << allVoxels << " voxels in " << m_elapsedTime
+                  << "s, a full fit should take about " << m_extrapolatedTime << "s" << std::endl;
+    }
+    if (m_checkpointFile.is_open()) {
+        m_checkpointFile.close();
+    }
+    for (const auto &index : inspected) {
+        InspectFit(index);
+    }
+    PatchKept();
+    if (m_failures) {
+        // After the workers, as with first-touch they zero the whole buffer
+        TFailuresImage *failuresImage = this->GetFailuresOutput();
+        for (const TIndex &index : m_screened) {
+            failuresImage->SetPixel(index, 3);
+        }
+    }
+    ReportFailures();
+    if (!m_statsPath.empty()) {
+        for (size_t worker = 0; worker < m_poolsize; worker++) {
+            m_stats[worker].voxels += m_workerVoxels[worker];
+            m_stats[worker].seconds += m_workerTimes[worker];
+        }
+        m_statsElapsed += m_elapsedTime;
+        WriteStats();
+    }
+    if (m_verbose) {
+        std::cout << "Finished all workers" << std::endl;
+        for (size_t worker = 0; worker < m_poolsize; worker++) {
+            std::cout << "Worker " << worker << ": " << m_workerVoxels[worker] << " voxels in " << m_workerTimes[worker] << "s";
+            if (m_workerTimes[worker] > 0) {
+                std::cout << ", " << static_cast<size_t>(m_workerVoxels[worker] / m_workerTimes[worker]) << " voxels/s";
+            }
+            std::cout << std::endl;
+        }
+    }
 }
 
 template<typename TI, typename TO, typename TC, typename TM>
-void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) {
-    ImageRegionConstIterator<TMaskImage> maskIter;
-    const auto mask = this->GetMask();
-    if (mask) {
-        maskIter = ImageRegionConstIterator<TMaskImage>(mask, region);
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::RunWorkers(const std::vector<TIndex> &voxels, const bool firstTouch) {
+    if (m_algorithm->parallelWithinVoxel() && voxels.size() < m_poolsize && !firstTouch) {
+        // Too few voxels to give every worker one, so fit them here and let each fit use the pool
+        if (m_verbose) std::cout << "Fitting " << voxels.size() << " voxels one at a time, each over " << m_poolsize << " threads" << std::endl;
+        QI::ChunkScheduler scheduler(voxels.size(), 1);
+        const auto workerStart = std::chrono::steady_clock::now();
+        RunWorker(voxels, scheduler, 0);
+        m_workerTimes[0] += std::chrono::duration<double>(std::chrono::steady_clock::now() - workerStart).count();
+        this->UpdateProgress(1.0f);
+        return;
     }
-    
-    std::vector<ImageRegionConstIterator<TInputImage>> dataIters(m_algorithm->numInputs());
-    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
-        dataIters[i] = ImageRegionConstIterator<TInputImage>(this->GetInput(i), region);
+    QI::ChunkScheduler scheduler(voxels.size(), m_poolsize);
+    // The workers run on the process-wide pool, count them down to know when they have all finished
+    QI::ThreadPool &threadPool = QI::ThreadPool::Global();
+    if (firstTouch) {
+        // Every part must be zeroed before any worker fits, otherwise a steal could be overwritten.
+        // A separate run() waits for that without the workers waiting on each other, which would
+        // hang if some of the pool's threads were busy elsewhere.
+        threadPool.run(m_poolsize, [&](const size_t worker) { this->FirstTouchOutputs(voxels, scheduler, worker); });
+    }
+    struct {
+        size_t running;
+        std::mutex mutex;
+        std::condition_variable condition;
+    } sync;
+    sync.running = m_poolsize;
+    for (size_t worker = 0; worker < m_poolsize; worker++) {
+        auto task = [=, &voxels, &scheduler, &sync] {
+            const auto workerStart = std::chrono::steady_clock::now();
+            this->RunWorker(voxels, scheduler, worker);
+            m_workerTimes[worker] += std::chrono::duration<double>(std::chrono::steady_clock::now() - workerStart).count();
+            std::unique_lock<std::mutex> lock(sync.mutex);
+            if (--sync.running == 0) {
+                sync.condition.notify_all();
+            }
+        };
+        threadPool.enqueue(task);
+        if (m_verbose) std::cout << "Starting worker " << worker << std::endl;
     }
+    // Report progress from this thread while the workers run, once per percent
+    size_t lastPercent = 0;
+    {
+        std::unique_lock<std::mutex> lock(sync.mutex);
+        while (!sync.condition.wait_for(lock, std::chrono::milliseconds(100), [&sync]{ return sync.running == 0; })) {
+            const size_t percent = (100 * m_voxelsDone) / std::max<size_t>(1, m_voxelsTotal);
+            if (percent > lastPercent) {
+                lastPercent = percent;
+                this->UpdateProgress(static_cast<float>(m_voxelsDone) / m_voxelsTotal);
+            }
+        }
+    }
+}
 
-    std::vector<ImageRegionConstIterator<TConstImage>> constIters(m_algorithm->numConsts());
-    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
-        typename TConstImage::ConstPointer c = this->GetConst(i);
-        if (c) {
-            constIters[i] = ImageRegionConstIterator<TConstImage>(c, region);
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::RunWorker(const std::vector<TIndex> &voxels, QI::ChunkScheduler &scheduler, const size_t worker) {
+    if (m_statsPath.empty()) {
+        this->ThreadedGenerateVoxels(voxels, scheduler, worker);
+        return;
+    }
+    // The counters are per thread, and a worker runs start to finish on one thread
+    const QI::PerfCounters perf;
+    const uint64_t evaluations = QI::Evaluations(), allocations = QI::Allocations();
+    this->ThreadedGenerateVoxels(voxels, scheduler, worker);
+    WorkerStats &stats = m_stats[worker];
+    stats.evaluations += QI::Evaluations() - evaluations;
+    stats.allocations += QI::Allocations() - allocations;
+    uint64_t cycles, instructions, cacheMisses;
+    perf.read(cycles, instructions, cacheMisses);
+    stats.cycles += cycles;
+    stats.instructions += instructions;
+    stats.cacheMisses += cacheMisses;
+    stats.perf = stats.perf && perf.valid();
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::ScanlineNeighbours(const TIndex &a, const TIndex &b) {
+    if (b[0] != a[0] + 1) {
+        return false;
+    }
+    for (unsigned int d = 1; d < TIndex::IndexDimension; d++) {
+        if (b[d] != a[d]) {
+            return false;
         }
     }
-    std::vector<ImageRegionIterator<TOutputImage>> outputIters(m_algorithm->numOutputs());
+    return true;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::OnLattice(const TIndex &index, const TIndex &start, const size_t spacing) {
+    for (unsigned int d = 0; d < TIndex::IndexDimension; d++) {
+        if ((index[d] - start[d]) % static_cast<typename TIndex::IndexValueType>(spacing) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+auto ApplyAlgorithmFilter<TI, TO, TC, TM>::LatticeIndex(const TIndex &index, const TIndex &start, const size_t spacing) -> TIndex {
+    TIndex lattice = index;
+    for (unsigned int d = 0; d < TIndex::IndexDimension; d++) {
+        lattice[d] -= (index[d] - start[d]) % static_cast<typename TIndex::IndexValueType>(spacing);
+    }
+    return lattice;
+}
+
+/*
+ * For SetPreview, give each voxel in a cell the pixel of the lattice voxel at its corner. That voxel
+ * may be masked, in which case it was never fitted and the cell stays zero like the mask.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+template<typename TImage>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::CopyFromLattice(TImage *img, const std::vector<TIndex> &voxels,
+                                                           const TIndex &start, const size_t spacing) {
+    auto *buffer = img->GetBufferPointer();
+    if (!buffer) return; // Not requested
+    const size_t components = img->GetNumberOfComponentsPerPixel();
+    for (const TIndex &index : voxels) {
+        const auto *from = buffer + img->ComputeOffset(LatticeIndex(index, start, spacing)) * components;
+        std::copy(from, from + components, buffer + img->ComputeOffset(index) * components);
+    }
+}
+
+/*
+ * First-touch zeroes the outputs on the pool before the fit, which only spreads the pages if the
+ * pool has a thread per worker, and cannot run from inside a pool task. Restored checkpoint voxels
+ * are written before the workers start, so it is skipped then. Otherwise Allocate() zeroes them.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+bool ApplyAlgorithmFilter<TI, TO, TC, TM>::FirstTouch() const {
+    return m_pin && !m_resume && m_queuePath.empty() && !QI::ThreadPool::InWorker() &&
+           (m_poolsize <= QI::ThreadPool::Global().size());
+}
+
+/*
+ * Zero the part of each output buffer covering this worker's initial share of the voxels, so on
+ * NUMA machines those pages are placed on the node of the (pinned) thread that will fit them.
+ * The parts run from one share's first voxel to the next's so together they cover masked voxels too.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::FirstTouchOutputs(const std::vector<TIndex> &voxels,
+                                                             const QI::ChunkScheduler &scheduler,
+                                                             const size_t worker) {
+    TOutputImage *residualImage = this->GetResidualOutput();
+    const size_t nPixels = residualImage->GetBufferedRegion().GetNumberOfPixels();
+    const auto offset = [&](const size_t v) -> size_t {
+        return v < voxels.size() ? residualImage->ComputeOffset(voxels[v]) : nPixels;
+    };
+    size_t begin, end;
+    scheduler.initialShare(worker, begin, end);
+    const size_t first = (worker == 0) ? 0 : offset(begin);
+    const size_t last = (worker == scheduler.workers() - 1) ? nPixels : offset(end);
     for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
-        outputIters[i] = ImageRegionIterator<TOutputImage>(this->GetOutput(i), region);
+        ZeroPixels(this->GetOutput(i), first, last);
     }
-    ImageRegionIterator<TInputImage> allResidualsIter;
+    ZeroPixels(this->GetInterleavedOutput(), first, last);
+    ZeroPixels(residualImage, first, last);
+    ZeroPixels(this->GetIterationsOutput(), first, last);
     if (m_allResiduals) {
-        allResidualsIter = ImageRegionIterator<TInputImage>(this->GetAllResidualsOutput(), region);
+        ZeroPixels(this->GetAllResidualsOutput(), first, last);
     }
-    // Keep the index on this one to report voxel locations where algorithm fails.
-    ImageRegionIteratorWithIndex<TOutputImage> residualIter(this->GetResidualOutput(), region);
-    ImageRegionIterator<TIterationsImage> iterationsIter(this->GetIterationsOutput(), region);
+    if (m_timing) {
+        ZeroPixels(this->GetTimingOutput(), first, last);
+    }
+    if (m_failures) {
+        ZeroPixels(this->GetFailuresOutput(), first, last);
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+template<typename TImage>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::ZeroPixels(TImage *img, const size_t first, const size_t last) {
+    const size_t components = img->GetNumberOfComponentsPerPixel();
+    auto *buffer = img->GetBufferPointer();
+    if (!buffer) return; // Not requested
+    std::fill(buffer + first * components, buffer + last * components, typename TImage::InternalPixelType());
+}
 
-    while(!dataIters[0].IsAtEnd()) {
-        if (!mask || maskIter.Get()) {
-            std::vector<TInputPixel> inputs(m_algorithm->numInputs());
-            std::vector<TOutputPixel> outputs(m_algorithm->numOutputs());
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::InitialOutputs(const TIndex &index, std::vector<TOutputPixel> &outputs) const {
+    for (size_t i = 0; i < outputs.size(); i++) {
+        outputs[i] = m_initial[i] ? m_initial[i]->GetPixel(index) : m_algorithm->zero();
+    }
+}
+
+/*
+ * With warm-starting the outputs still hold the fit of the previous voxel. Only keep it if that was
+ * the neighbour along the scanline, otherwise seed from the lattice. Initial maps are the same voxel
+ * from an earlier fit, so always closer than either.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SeedOutputs(const TIndex &index, const bool neighbourFitted, const TIndex &latticeStart,
+                                                       const std::vector<TOutputImage *> &outputImages,
+                                                       std::vector<TOutputPixel> &outputs) const {
+    if (!m_initial.empty()) {
+        InitialOutputs(index, outputs);
+    } else if (!(m_warmStart && neighbourFitted)) {
+        if (m_seedFromLattice) {
+            const TIndex lattice = LatticeIndex(index, latticeStart, m_multigrid);
             for (size_t i = 0; i < outputs.size(); i++) {
-                outputs[i] = m_algorithm->zero();
+                outputs[i] = outputImages[i]->GetPixel(lattice);
             }
-            std::vector<TConstPixel> constants = m_algorithm->defaultConsts();
-            for (size_t i = 0; i < constIters.size(); i++) {
-                if (this->GetConst(i)) {
-                    constants[i] = constIters[i].Get();
-                }
+        } else {
+            for (size_t i = 0; i < outputs.size(); i++) {
+                outputs[i] = m_algorithm->zero();
             }
-            TOutputPixel residual = m_algorithm->zero();
-            TInputPixel resids;
-            if (m_allResiduals) {
-                resids.SetSize(this->GetAllResidualsOutput()->GetNumberOfComponentsPerPixel());
-            } else {
-                resids.SetSize(0);
+        }
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateVoxels(const std::vector<TIndex> &voxels,
+                                                                  QI::ChunkScheduler &scheduler,
+                                                                  const size_t worker) {
+    if (m_sparse || m_algorithm->hasBatch()) {
+        ThreadedGenerateBlocks(voxels, scheduler, worker);
+        return;
+    }
+    // Resolve every buffer once, each voxel then costs one offset per distinct buffered region
+    TOffsets offsets;
+    std::vector<QI::PixelBuffer<const TInputImage>> dataBuffers;
+    std::vector<QI::BrickReader<TInputImage>> packedBuffers;
+    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+        dataBuffers.emplace_back(this->GetInput(i).GetPointer(), offsets);
+        packedBuffers.emplace_back(GetPackedInput(i), offsets);
+    }
+    std::vector<QI::PixelBuffer<const TConstImage>> constBuffers;
+    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+        constBuffers.emplace_back(this->GetConst(i).GetPointer(), offsets);
+    }
+    std::vector<TOutputImage *> outputImages(m_algorithm->numOutputs());
+    std::vector<QI::PixelBuffer<TOutputImage>> outputBuffers;
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        outputImages[i] = this->GetOutput(i);
+        outputBuffers.push_back(OutputBuffer(i, offsets));
+    }
+    const TIndex latticeStart = this->GetResidualOutput()->GetLargestPossibleRegion().GetIndex();
+    const QI::PixelBuffer<TInputImage> allResidualsBuffer = m_allResiduals ? QI::PixelBuffer<TInputImage>(this->GetAllResidualsOutput(), offsets) : QI::PixelBuffer<TInputImage>();
+    const QI::PixelBuffer<TOutputImage> residualBuffer(this->GetResidualOutput(), offsets);
+    const QI::PixelBuffer<TIterationsImage> iterationsBuffer(this->GetIterationsOutput(), offsets);
+    const QI::PixelBuffer<TTimingImage> timingBuffer = m_timing ? QI::PixelBuffer<TTimingImage>(this->GetTimingOutput(), offsets) : QI::PixelBuffer<TTimingImage>();
+    const QI::PixelBuffer<TFailuresImage> failuresBuffer = m_failures ? QI::PixelBuffer<TFailuresImage>(this->GetFailuresOutput(), offsets) : QI::PixelBuffer<TFailuresImage>();
+
+    // Per-worker scratch, re-used for every voxel so the loop below does not allocate. The inputs
+    // point straight at the image buffers, the algorithm only reads them.
+    std::vector<TInputPixel> inputs(m_algorithm->numInputs());
+    std::vector<TOutputPixel> outputs(m_algorithm->numOutputs());
+    const std::vector<TConstPixel> defaultConsts = m_algorithm->defaultConsts();
+    std::vector<TConstPixel> constants = defaultConsts;
+    TInputPixel resids;
+    resids.SetSize(m_allResiduals ? allResidualsBuffer.components() : 0);
+    const TOutputPixel zero = m_algorithm->zero();
+    TOutputPixel residual = zero;
+
+    const bool checkpoint = m_checkpointFile.is_open();
+    std::vector<char> checkpointBuffer;
+    size_t begin, end, done = 0, processed = 0;
+    TIndex previous;
+    bool previousFitted = false;
+    while (scheduler.next(worker, begin, end)) {
+        for (size_t v = begin; v < end; v++) {
+            const QI::ArenaScope scratch; // Signal equations' temporaries are released each voxel
+            const TIndex &index = voxels[v];
+            offsets.locate(index);
+            SeedOutputs(index, previousFitted && ScanlineNeighbours(previous, index), latticeStart, outputImages, outputs);
+            for (size_t i = 0; i < constBuffers.size(); i++) {
+                constants[i] = constBuffers[i].valid() ? *constBuffers[i].at(offsets) : defaultConsts[i];
             }
+            residual = zero;
+            resids.Fill(0.);
             TIterations iterations{0};
 
-            for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
-                inputs[i] = dataIters[i].Get();
+            for (size_t i = 0; i < dataBuffers.size(); i++) {
+                const TInputValue *px = packedBuffers[i].valid() ? packedBuffers[i].at(offsets) : dataBuffers[i].at(offsets);
+                inputs[i].SetData(const_cast<TInputValue *>(px), dataBuffers[i].components(), false);
             }
-            bool success = m_algorithm->apply(inputs, constants, residualIter.GetIndex(),
+            const auto voxelStart = std::chrono::steady_clock::now();
+            bool success = m_algorithm->apply(inputs, constants, index,
                                               outputs, residual, resids, iterations);
+            if (timingBuffer.valid()) {
+                *timingBuffer.at(offsets) = std::chrono::duration<TTiming, std::nano>(std::chrono::steady_clock::now() - voxelStart).count();
+            }
             if (!success) {
-                std::cerr << "Algorithm failed for voxel: " << residualIter.GetIndex() << std::endl;
+                RecordFailure(worker, index);
             }
-            for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
-                outputIters[i].Set(outputs[i]);
+            if (failuresBuffer.valid()) {
+                *failuresBuffer.at(offsets) = success ? 0 : 1;
             }
-            residualIter.Set(residual);
+            previous = index;
+            previousFitted = success;
+            for (size_t i = 0; i < outputBuffers.size(); i++) {
+                outputBuffers[i].set(offsets, outputs[i]);
+            }
+            residualBuffer.set(offsets, residual);
             if (m_allResiduals) {
-                allResidualsIter.Set(resids);
+                allResidualsBuffer.set(offsets, resids);
             }
-            iterationsIter.Set(iterations);
-        } else {
-            for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
-                outputIters[i].Set(m_algorithm->zero());
+            if (iterationsBuffer.valid()) {
+                *iterationsBuffer.at(offsets) = iterations;
             }
-            if (m_allResiduals) {
-                VariableLengthVector<float> residZeros(m_algorithm->dataSize()); residZeros.Fill(0.);
-                allResidualsIter.Set(residZeros);
+            if (checkpoint) {
+                AppendCheckpoint(checkpointBuffer, index);
+                FlushCheckpoint(checkpointBuffer);
             }
-            residualIter.Set(m_algorithm->zero());
-            iterationsIter.Set(0);
+            processed++;
+            if (++done == ProgressFlush) {
+                m_voxelsDone += done;
+                done = 0;
+            }
+        }
+    }
+    if (checkpoint) {
+        FlushCheckpoint(checkpointBuffer, true);
+    }
+    m_voxelsDone += done;
+    m_workerVoxels[worker] += processed;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateBlocks(const std::vector<TIndex> &voxels,
+                                                                  QI::ChunkScheduler &scheduler,
+                                                                  const size_t worker) {
+    // As in ThreadedGenerateVoxels, the buffers are resolved once and share an offset per region
+    TOffsets offsets;
+    std::vector<QI::PixelBuffer<const TInputImage>> dataBuffers;
+    std::vector<QI::BrickReader<TInputImage>> packedBuffers;
+    std::vector<size_t> inputSizes(m_algorithm->numInputs());
+    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+        dataBuffers.emplace_back(this->GetInput(i).GetPointer(), offsets);
+        packedBuffers.emplace_back(GetPackedInput(i), offsets);
+        inputSizes[i] = dataBuffers[i].components();
+    }
+    std::vector<QI::PixelBuffer<const TConstImage>> constBuffers;
+    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+        constBuffers.emplace_back(this->GetConst(i).GetPointer(), offsets);
+    }
+    std::vector<TOutputImage *> outputImages(m_algorithm->numOutputs());
+    std::vector<QI::PixelBuffer<TOutputImage>> outputBuffers;
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        outputImages[i] = this->GetOutput(i);
+        outputBuffers.push_back(OutputBuffer(i, offsets));
+    }
+    const TIndex latticeStart = this->GetResidualOutput()->GetLargestPossibleRegion().GetIndex();
+    const QI::PixelBuffer<TInputImage> allResidualsBuffer = m_allResiduals ? QI::PixelBuffer<TInputImage>(this->GetAllResidualsOutput(), offsets) : QI::PixelBuffer<TInputImage>();
+    const QI::PixelBuffer<TOutputImage> residualBuffer(this->GetResidualOutput(), offsets);
+    const QI::PixelBuffer<TIterationsImage> iterationsBuffer(this->GetIterationsOutput(), offsets);
+    const QI::PixelBuffer<TTimingImage> timingBuffer = m_timing ? QI::PixelBuffer<TTimingImage>(this->GetTimingOutput(), offsets) : QI::PixelBuffer<TTimingImage>();
+    const QI::PixelBuffer<TFailuresImage> failuresBuffer = m_failures ? QI::PixelBuffer<TFailuresImage>(this->GetFailuresOutput(), offsets) : QI::PixelBuffer<TFailuresImage>();
+    const size_t residsSize = allResidualsBuffer.components();
+
+    const size_t outputSize = m_algorithm->outputSize();
+    typedef DefaultConvertPixelTraits<TOutputPixel> TOutputTraits;
+
+    // Dense structure-of-arrays copy of one block of voxels. Each input, output and the residual is
+    // stored as a (components x voxels) column-major array, each const as one array
+    const TOutputPixel zero = m_algorithm->zero();
+    const std::vector<TConstPixel> defaultConsts = m_algorithm->defaultConsts();
+    std::vector<std::vector<TInputValue>> blockInputs(dataBuffers.size());
+    for (size_t i = 0; i < dataBuffers.size(); i++) {
+        blockInputs[i].resize(inputSizes[i] * BlockSize);
+    }
+    std::vector<std::vector<TConstPixel>> blockConsts(constBuffers.size(), std::vector<TConstPixel>(BlockSize));
+    std::vector<std::vector<TOutputValue>> blockOutputs(outputBuffers.size(), std::vector<TOutputValue>(outputSize * BlockSize));
+    std::vector<TOutputValue> blockResidual(outputSize * BlockSize);
+    std::vector<TInputValue> blockResids(residsSize * BlockSize);
+    std::vector<TIterations> blockIterations(BlockSize);
+    std::vector<TTiming> blockTimes(BlockSize);
+    std::vector<TFailure> blockFailures(BlockSize);
+
+    // Per-voxel views into the block for the Algorithm interface
+    std::vector<TInputPixel> inputs(dataBuffers.size());
+    std::vector<TOutputPixel> outputs(outputBuffers.size());
+    std::vector<TConstPixel> constants = defaultConsts;
+    TInputPixel resids;
+    TOutputPixel residual = zero;
+
+    // Eigen views of the whole block for the batch interface
+    typedef typename Algorithm::TInputBlock TInputBlock;
+    typedef typename Algorithm::TConstBlock TConstBlock;
+    typedef typename Algorithm::TOutputBlock TOutputBlock;
+    std::vector<TInputBlock> batchInputs;
+    std::vector<TConstBlock> batchConsts;
+    std::vector<TOutputBlock> batchOutputs;
+    batchInputs.reserve(dataBuffers.size());
+    batchConsts.reserve(constBuffers.size());
+    batchOutputs.reserve(outputBuffers.size());
+
+    const bool checkpoint = m_checkpointFile.is_open();
+    std::vector<char> checkpointBuffer;
+    size_t begin, end;
+    TIndex previous;
+    bool previousFitted = false;
+    while (scheduler.next(worker, begin, end)) {
+        for (size_t start = begin; start < end; start += BlockSize) {
+            const QI::ArenaScope scratch; // Released each block
+            const size_t count = (end - start) < BlockSize ? (end - start) : BlockSize;
+            // Gather
+            for (size_t v = 0; v < count; v++) {
+                offsets.locate(voxels[start + v]);
+                for (size_t i = 0; i < dataBuffers.size(); i++) {
+                    const TInputValue *px = packedBuffers[i].valid() ? packedBuffers[i].at(offsets) : dataBuffers[i].at(offsets);
+                    std::copy(px, px + inputSizes[i], &blockInputs[i][v * inputSizes[i]]);
+                }
+                for (size_t i = 0; i < constBuffers.size(); i++) {
+                    blockConsts[i][v] = constBuffers[i].valid() ? *constBuffers[i].at(offsets) : defaultConsts[i];
+                }
+            }
+            // Apply
+            std::fill(blockResids.begin(), blockResids.begin() + count * residsSize, TInputValue(0));
+            if (m_algorithm->hasBatch()) {
+                batchInputs.clear();
+                batchConsts.clear();
+                batchOutputs.clear();
+                for (size_t i = 0; i < dataBuffers.size(); i++) {
+                    batchInputs.emplace_back(blockInputs[i].data(), inputSizes[i], count);
+                }
+                for (size_t i = 0; i < constBuffers.size(); i++) {
+                    batchConsts.emplace_back(blockConsts[i].data(), 1, count);
+                }
+                for (size_t i = 0; i < outputBuffers.size(); i++) {
+                    batchOutputs.emplace_back(blockOutputs[i].data(), outputSize, count);
+                    batchOutputs.back().setZero();
+                }
+                TOutputBlock batchResidual(blockResidual.data(), outputSize, count);
+                batchResidual.setZero();
+                typename Algorithm::TResidsBlock batchResids(blockResids.data(), residsSize, count);
+                typename Algorithm::TIterationsBlock batchIterations(blockIterations.data(), 1, count);
+                batchIterations.setZero();
+                const auto batchStart = std::chrono::steady_clock::now();
+                bool success = m_algorithm->applyIndexedBatch(&voxels[start], batchInputs, batchConsts, batchOutputs,
+                                                              batchResidual, batchResids, batchIterations);
+                // The batch interface can only report the average cost of a voxel in the block
+                const TTiming batchTime = std::chrono::duration<TTiming, std::nano>(std::chrono::steady_clock::now() - batchStart).count();
+                std::fill(blockTimes.begin(), blockTimes.begin() + count, batchTime / count);
+                // Nor which voxels of a failed block were at fault, so all of them are marked
+                std::fill(blockFailures.begin(), blockFailures.begin() + count, success ? 0 : 2);
+                if (!success) {
+                    for (size_t v = 0; v < count; v++) {
+                        RecordFailure(worker, voxels[start + v]);
+                    }
+                }
+            } else {
+                for (size_t v = 0; v < count; v++) {
+                    for (size_t i = 0; i < inputs.size(); i++) {
+                        inputs[i].SetData(&blockInputs[i][v * inputSizes[i]], inputSizes[i], false);
+                    }
+                    for (size_t i = 0; i < constBuffers.size(); i++) {
+                        constants[i] = blockConsts[i][v];
+                    }
+                    const TIndex &index = voxels[start + v];
+                    SeedOutputs(index, previousFitted && ScanlineNeighbours(previous, index), latticeStart, outputImages, outputs);
+                    residual = zero;
+                    if (m_allResiduals) {
+                        resids.SetData(&blockResids[v * residsSize], residsSize, false);
+                    } else {
+                        resids.SetSize(0);
+                    }
+                    TIterations iterations{0};
+                    const auto voxelStart = std::chrono::steady_clock::now();
+                    bool success = m_algorithm->apply(inputs, constants, index,
+                                                      outputs, residual, resids, iterations);
+                    blockTimes[v] = std::chrono::duration<TTiming, std::nano>(std::chrono::steady_clock::now() - voxelStart).count();
+                    blockFailures[v] = success ? 0 : 1;
+                    if (!success) {
+                        RecordFailure(worker, index);
+                    }
+                    previous = index;
+                    previousFitted = success;
+                    for (size_t k = 0; k < outputSize; k++) {
+                        for (size_t i = 0; i < outputs.size(); i++) {
+                            blockOutputs[i][v * outputSize + k] = TOutputTraits::GetNthComponent(k, outputs[i]);
+                        }
+                        blockResidual[v * outputSize + k] = TOutputTraits::GetNthComponent(k, residual);
+                    }
+                    blockIterations[v] = iterations;
+                }
+            }
+            // Scatter
+            for (size_t v = 0; v < count; v++) {
+                const TIndex &index = voxels[start + v];
+                offsets.locate(index);
+                for (size_t i = 0; i < outputBuffers.size(); i++) {
+                    if (outputBuffers[i].valid()) {
+                        const TOutputValue *px = &blockOutputs[i][v * outputSize];
+                        std::copy(px, px + outputSize, outputBuffers[i].at(offsets));
+                    }
+                }
+                if (residualBuffer.valid()) {
+                    std::copy(&blockResidual[v * outputSize], &blockResidual[v * outputSize] + outputSize, residualBuffer.at(offsets));
+                }
+                if (m_allResiduals) {
+                    std::copy(&blockResids[v * residsSize], &blockResids[v * residsSize] + residsSize, allResidualsBuffer.at(offsets));
+                }
+                if (iterationsBuffer.valid()) {
+                    *iterationsBuffer.at(offsets) = blockIterations[v];
+                }
+                if (timingBuffer.valid()) {
+                    *timingBuffer.at(offsets) = blockTimes[v];
+                }
+                if (failuresBuffer.valid()) {
+                    *failuresBuffer.at(offsets) = blockFailures[v];
+                }
+                if (checkpoint) {
+                    AppendCheckpoint(checkpointBuffer, index);
+                }
+            }
+            if (checkpoint) {
+                FlushCheckpoint(checkpointBuffer);
+            }
+            m_voxelsDone += count;
+            m_workerVoxels[worker] += count;
+        }
+    }
+    if (checkpoint) {
+        FlushCheckpoint(checkpointBuffer, true);
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+size_t ApplyAlgorithmFilter<TI, TO, TC, TM>::CheckpointRecordSize() const {
+    const size_t residsSize = m_allResiduals ? m_algorithm->dataSize() : 0;
+    return sizeof(uint64_t) +
+           (m_algorithm->numOutputs() + 1) * m_algorithm->outputSize() * sizeof(TOutputValue) +
+           residsSize * sizeof(TInputValue) +
+           sizeof(TIterations);
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+std::vector<bool> ApplyAlgorithmFilter<TI, TO, TC, TM>::ReadCheckpoint() {
+    typedef DefaultConvertPixelTraits<TOutputPixel> TOutputTraits;
+    TOutputImage *residualImage = this->GetResidualOutput();
+    const uint64_t totalVoxels = residualImage->GetLargestPossibleRegion().GetNumberOfPixels();
+    std::vector<bool> restored;
+    std::ifstream file(m_checkpointPath, std::ios::binary);
+    if (!file) {
+        if (m_verbose) std::cout << "No checkpoint found at " << m_checkpointPath << ", starting from scratch" << std::endl;
+        return restored;
+    }
+    char magic[8];
+    uint64_t header[2];
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!file || !std::equal(magic, magic + 8, CheckpointMagic) ||
+        header[0] != totalVoxels || header[1] != CheckpointRecordSize()) {
+        itkExceptionMacro("Checkpoint file " << m_checkpointPath << " does not match this image and algorithm");
+    }
+    restored.resize(totalVoxels, false);
+    const size_t outputSize = m_algorithm->outputSize();
+    const size_t residsSize = m_allResiduals ? m_algorithm->dataSize() : 0;
+    std::vector<char> record(CheckpointRecordSize());
+    TOutputPixel px = m_algorithm->zero();
+    TInputPixel resids(residsSize);
+    size_t count = 0;
+    while (file.read(record.data(), record.size())) {
+        const char *ptr = record.data();
+        uint64_t offset;
+        std::copy(ptr, ptr + sizeof(offset), reinterpret_cast<char *>(&offset));
+        ptr += sizeof(offset);
+        if (offset >= totalVoxels) {
+            itkExceptionMacro("Corrupt record in checkpoint file " << m_checkpointPath);
         }
-        
-        if (this->GetMask())
-            ++maskIter;
+        const TIndex index = residualImage->ComputeIndex(offset);
+        for (size_t i = 0; i <= m_algorithm->numOutputs(); i++) {
+            for (size_t k = 0; k < outputSize; k++) {
+                TOutputValue v;
+                std::copy(ptr, ptr + sizeof(v), reinterpret_cast<char *>(&v));
+                ptr += sizeof(v);
+                TOutputTraits::SetNthComponent(k, px, v);
+            }
+            if (i < m_algorithm->numOutputs()) {
+                this->GetOutput(i)->SetPixel(index, px);
+            } else {
+                residualImage->SetPixel(index, px);
+            }
+        }
+        if (residsSize) {
+            std::copy(ptr, ptr + residsSize * sizeof(TInputValue), reinterpret_cast<char *>(resids.GetDataPointer()));
+            ptr += residsSize * sizeof(TInputValue);
+            this->GetAllResidualsOutput()->SetPixel(index, resids);
+        }
+        TIterations its;
+        std::copy(ptr, ptr + sizeof(its), reinterpret_cast<char *>(&its));
+        this->GetIterationsOutput()->SetPixel(index, its);
+        restored[offset] = true;
+        count++;
+    }
+    if (m_verbose) std::cout << "Restored " << count << " voxels from checkpoint " << m_checkpointPath << std::endl;
+    return restored;
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::OpenCheckpoint(const std::vector<bool> &restored) {
+    // Re-write the file from scratch, so any truncated record left by a killed job is dropped
+    QI::CacheOutput(m_checkpointPath);
+    m_checkpointFile.open(m_checkpointPath, std::ios::binary | std::ios::trunc);
+    if (!m_checkpointFile) {
+        itkExceptionMacro("Could not open checkpoint file " << m_checkpointPath);
+    }
+    TOutputImage *residualImage = this->GetResidualOutput();
+    const uint64_t header[2] = {residualImage->GetLargestPossibleRegion().GetNumberOfPixels(), CheckpointRecordSize()};
+    m_checkpointFile.write(CheckpointMagic, sizeof(CheckpointMagic));
+    m_checkpointFile.write(reinterpret_cast<const char *>(header), sizeof(header));
+    std::vector<char> buffer;
+    for (size_t offset = 0; offset < restored.size(); offset++) {
+        if (restored[offset]) {
+            AppendCheckpoint(buffer, residualImage->ComputeIndex(offset));
+        }
+    }
+    m_checkpointFile.write(buffer.data(), buffer.size());
+    m_checkpointFile.flush();
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::AppendCheckpoint(std::vector<char> &buffer, const TIndex &index) {
+    typedef DefaultConvertPixelTraits<TOutputPixel> TOutputTraits;
+    const auto append = [&buffer](const char *p, const size_t n) { buffer.insert(buffer.end(), p, p + n); };
+    const uint64_t offset = this->GetResidualOutput()->ComputeOffset(index);
+    append(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    for (size_t i = 0; i <= m_algorithm->numOutputs(); i++) {
+        const TOutputPixel px = (i < m_algorithm->numOutputs()) ? this->GetOutput(i)->GetPixel(index) :
+                                                                   this->GetResidualOutput()->GetPixel(index);
+        for (size_t k = 0; k < m_algorithm->outputSize(); k++) {
+            const TOutputValue v = TOutputTraits::GetNthComponent(k, px);
+            append(reinterpret_cast<const char *>(&v), sizeof(v));
+        }
+    }
+    if (m_allResiduals) {
+        const TInputPixel r = this->GetAllResidualsOutput()->GetPixel(index);
+        append(reinterpret_cast<const char *>(r.GetDataPointer()), r.Size() * sizeof(TInputValue));
+    }
+    const TIterations its = this->GetIterationsOutput()->GetPixel(index);
+    append(reinterpret_cast<const char *>(&its), sizeof(its));
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::FlushCheckpoint(std::vector<char> &buffer, const bool force) {
+    if (buffer.empty() || (!force && buffer.size() < CheckpointFlush * CheckpointRecordSize())) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(m_checkpointMutex);
+    m_checkpointFile.write(buffer.data(), buffer.size());
+    m_checkpointFile.flush();
+    buffer.clear();
+}
+
+/*
+ * One object for the whole fit, then one per worker. Counts that are not available (allocations
+ * off glibc, hardware counters if the kernel does not allow them) are null.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::WriteStats() const {
+    WorkerStats total;
+    for (const WorkerStats &w : m_stats) {
+        total.voxels += w.voxels;
+        total.seconds += w.seconds;
+        total.evaluations += w.evaluations;
+        total.allocations += w.allocations;
+        total.cycles += w.cycles;
+        total.instructions += w.instructions;
+        total.cacheMisses += w.cacheMisses;
+        total.perf = total.perf && w.perf;
+    }
+    const bool allocations = QI::AllocationsCounted();
+    const auto perVoxel = [](const uint64_t n, const size_t voxels) { return voxels ? static_cast<double>(n) / voxels : 0.0; };
+    const auto counts = [&](std::ostream &out, const WorkerStats &w, const std::string &indent) {
+        out << indent << "\"voxels\": " << w.voxels << ",\n"
+            << indent << "\"seconds\": " << w.seconds << ",\n"
+            << indent << "\"voxels_per_second\": " << (w.seconds > 0 ? w.voxels / w.seconds : 0.0) << ",\n"
+            << indent << "\"model_evaluations\": " << w.evaluations << ",\n"
+            << indent << "\"evaluations_per_voxel\": " << perVoxel(w.evaluations, w.voxels) << ",\n";
+        if (allocations) {
+            out << indent << "\"allocations\": " << w.allocations << ",\n"
+                << indent << "\"allocations_per_voxel\": " << perVoxel(w.allocations, w.voxels) << ",\n";
+        } else {
+            out << indent << "\"allocations\": null,\n" << indent << "\"allocations_per_voxel\": null,\n";
+        }
+        if (w.perf) {
+            out << indent << "\"cycles\": " << w.cycles << ",\n"
+                << indent << "\"instructions\": " << w.instructions << ",\n"
+                << indent << "\"cache_misses\": " << w.cacheMisses << ",\n"
+                << indent << "\"ipc\": " << (w.cycles ? static_cast<double>(w.instructions) / w.cycles : 0.0);
+        } else {
+            out << indent << "\"cycles\": null,\n" << indent << "\"instructions\": null,\n"
+                << indent << "\"cache_misses\": null,\n" << indent << "\"ipc\": null";
+        }
+    };
+    QI::CacheOutput(m_statsPath);
+    std::ofstream file(m_statsPath);
+    file << "{\n    \"elapsed_seconds\": " << m_statsElapsed << ",\n    \"threads\": " << m_stats.size() << ",\n";
+    counts(file, total, "    ");
+    file << ",\n    \"workers\": [\n";
+    for (size_t i = 0; i < m_stats.size(); i++) {
+        file << "        {\n";
+        counts(file, m_stats[i], "            ");
+        file << "\n        }" << (i + 1 < m_stats.size() ? "," : "") << "\n";
+    }
+    file << "    ]\n}\n";
+    if (!file) {
+        itkExceptionMacro("Failed to write statistics to " << m_statsPath);
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::RecordFailure(const size_t worker, const TIndex &index) {
+    WorkerFailures &f = m_workerFailures[worker];
+    if (f.first.size() < FailuresReported) {
+        f.first.push_back(index);
+    }
+    f.count++;
+}
+
+/*
+ * One line for the whole Update however many voxels failed, instead of one per voxel from every
+ * worker. The examples are the first few each worker met, sorted so the output is reproducible.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::ReportFailures() const {
+    const size_t failures = GetFailures();
+    if (failures == 0) return;
+    std::vector<TIndex> examples;
+    for (const auto &f : m_workerFailures) {
+        examples.insert(examples.end(), f.first.begin(), f.first.end());
+    }
+    std::sort(examples.begin(), examples.end(), [](const TIndex &a, const TIndex &b) {
+        for (int d = TIndex::IndexDimension - 1; d >= 0; d--) { // In buffer order
+            if (a[d] != b[d]) return a[d] < b[d];
+        }
+        return false;
+    });
+    if (examples.size() > FailuresReported) {
+        examples.resize(FailuresReported);
+    }
+    std::cerr << "Algorithm failed for " << failures << " of " << m_voxelsTotal << " voxels, e.g.";
+    for (const TIndex &index : examples) {
+        std::cerr << " " << index;
+    }
+    std::cerr << std::endl;
+}
+
+/*
+ * Outside the mask there is only noise. On magnitude images it is Rayleigh distributed, with mean
+ * square 2 sigma^2 (as for the real and imaginary parts of complex data), so that gives the sigma
+ * of the underlying Gaussian. Exact zeros are left out, they are padding or already masked.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+double ApplyAlgorithmFilter<TI, TO, TC, TM>::EstimateNoise() const {
+    const TMaskImage *mask = this->GetMask();
+    if (!mask) {
+        itkExceptionMacro("Estimating the noise for the screen needs a mask, or give the noise level");
+    }
+    const TInputImage *input = this->GetInput(0);
+    TRegion region = mask->GetBufferedRegion();
+    if (!region.Crop(input->GetBufferedRegion())) {
+        itkExceptionMacro("The mask and input 0 do not overlap");
+    }
+    TOffsets offsets;
+    const QI::PixelBuffer<const TInputImage> buffer(input, offsets);
+    QI::BrickReader<TInputImage> packed(GetPackedInput(0), offsets);
+    double sum = 0;
+    size_t count = 0;
+    for (ImageRegionConstIteratorWithIndex<TMaskImage> it(mask, region); !it.IsAtEnd(); ++it) {
+        if (it.Get()) continue;
+        offsets.locate(it.GetIndex());
+        const TInputValue *px = packed.valid() ? packed.at(offsets) : buffer.at(offsets);
+        for (size_t k = 0; k < buffer.components(); k++) {
+            const double a = std::abs(px[k]);
+            if (a > 0) {
+                sum += a * a;
+                count++;
+            }
+        }
+    }
+    if (count == 0) {
+        itkExceptionMacro("No background outside the mask to estimate the noise from, give the noise level");
+    }
+    return std::sqrt(sum / (2. * count));
+}
+
+/*
+ * A voxel whose largest input value (in magnitude, over every component of every input) is within
+ * a few sigma of the noise has nothing to fit, and its fit usually runs to the iteration limit or
+ * fails. Those are dropped before the workers start and marked 3 in the failures map.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::Screen(std::vector<TIndex> &voxels) {
+    m_screened.clear();
+    if (m_screenSNR <= 0 || voxels.empty()) return;
+    const double noise = (m_screenNoise > 0) ? m_screenNoise : EstimateNoise();
+    const double threshold = m_screenSNR * noise;
+    std::vector<char> keep(voxels.size());
+    QI::ThreadPool::Global().parallelFor(0, voxels.size(), ScreenGrain, [&](const size_t first, const size_t last) {
+        TOffsets offsets;
+        std::vector<QI::PixelBuffer<const TInputImage>> dataBuffers;
+        std::vector<QI::BrickReader<TInputImage>> packedBuffers;
         for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
-            ++dataIters[i];
+            dataBuffers.emplace_back(this->GetInput(i).GetPointer(), offsets);
+            packedBuffers.emplace_back(GetPackedInput(i), offsets);
         }
-        for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
-            if (this->GetConst(i))
-                ++constIters[i];
+        for (size_t v = first; v < last; v++) {
+            offsets.locate(voxels[v]);
+            double peak = 0;
+            for (size_t i = 0; i < dataBuffers.size(); i++) {
+                const TInputValue *px = packedBuffers[i].valid() ? packedBuffers[i].at(offsets) : dataBuffers[i].at(offsets);
+                for (size_t k = 0; k < dataBuffers[i].components(); k++) {
+                    peak = std::max(peak, static_cast<double>(std::abs(px[k])));
+                }
+            }
+            keep[v] = (peak >= threshold);
+        }
+    });
+    size_t kept = 0;
+    for (size_t v = 0; v < voxels.size(); v++) {
+        if (keep[v]) {
+            voxels[kept++] = voxels[v];
+        } else {
+            m_screened.push_back(voxels[v]);
+        }
+    }
+    voxels.resize(kept);
+    if (m_verbose) {
+        std::cout << "Screened out " << m_screened.size() << " of " << keep.size() << " voxels with no input above "
+                  << m_screenSNR << " times the noise level of " << noise << std::endl;
+    }
+}
+
+/*
+ * For SetRefit, split the masked voxels into those to fit again and those that keep the results of
+ * the earlier run. Before sharding and checkpoints, so those only ever see the selected voxels.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::SelectRefit(std::vector<TIndex> &voxels) {
+    m_kept.clear();
+    m_refitted = 0;
+    if (!m_refit) return;
+    if (m_initial.empty()) {
+        itkExceptionMacro("A re-fit needs the earlier maps as initial values");
+    }
+    if (m_shardCount > 1 || !m_queuePath.empty() || m_preview > 1 || m_multigrid > 1) {
+        itkExceptionMacro("A re-fit cannot be combined with shards, a queue, preview or multigrid");
+    }
+    const auto region = this->GetInput(0)->GetLargestPossibleRegion();
+    const auto sameSize = [&](const ImageBase<TInputImage::ImageDimension> *img) {
+        return !img || img->GetLargestPossibleRegion() == region;
+    };
+    if (!sameSize(m_refit) || !sameSize(m_refitResidual) || !sameSize(m_refitIterations)) {
+        itkExceptionMacro("The re-fit selection, residual and iterations must be the same size as the input");
+    }
+    const auto kept = std::stable_partition(voxels.begin(), voxels.end(),
+                                            [&](const TIndex &index) { return m_refit->GetPixel(index) != 0; });
+    m_kept.assign(kept, voxels.end());
+    voxels.erase(kept, voxels.end());
+    m_refitted = voxels.size();
+    if (m_verbose) std::cout << "Re-fitting " << voxels.size() << " of " << voxels.size() + m_kept.size() << " voxels" << std::endl;
+}
+
+/*
+ * Copy the earlier results into the voxels that were not re-fitted. After the workers, as with
+ * first-touch they zero the whole buffer.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::PatchKept() {
+    if (m_kept.empty()) return;
+    TOffsets offsets;
+    std::vector<QI::PixelBuffer<TOutputImage>> outputs;
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        outputs.push_back(OutputBuffer(i, offsets));
+    }
+    const QI::PixelBuffer<TOutputImage> residual(this->GetResidualOutput(), offsets);
+    const QI::PixelBuffer<TIterationsImage> iterations(this->GetIterationsOutput(), offsets);
+    const TOutputPixel zero = m_algorithm->zero();
+    for (const TIndex &index : m_kept) {
+        offsets.locate(index);
+        for (size_t i = 0; i < outputs.size(); i++) {
+            outputs[i].set(offsets, m_initial[i] ? m_initial[i]->GetPixel(index) : zero);
+        }
+        residual.set(offsets, m_refitResidual ? m_refitResidual->GetPixel(index) : zero);
+        iterations.set(offsets, m_refitIterations ? m_refitIterations->GetPixel(index) : TIterations(0));
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::InspectData(const TIndex &index) const {
+    std::cout << "Voxel " << index << std::endl;
+    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+        std::cout << "Input " << i << ": ";
+        if (GetPackedInput(i)) {
+            std::cout << "(packed)" << std::endl;
+        } else {
+            std::cout << this->GetInput(i)->GetPixel(index) << std::endl;
+        }
+    }
+    const std::vector<TConstPixel> defaults = m_algorithm->defaultConsts();
+    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+        const auto c = this->GetConst(i);
+        std::cout << "Const " << i << ": ";
+        if (c) {
+            std::cout << c->GetPixel(index) << std::endl;
+        } else {
+            std::cout << defaults[i] << " (default)" << std::endl;
         }
+    }
+}
+
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::InspectFit(const TIndex &index) {
+    std::cout << "Fit of voxel " << index << std::endl;
+    if (m_interleaved) {
+        std::cout << "Outputs: " << this->GetInterleavedOutput()->GetPixel(index) << std::endl;
+    } else {
         for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
-            ++outputIters[i];
+            if (KeepOutput(i)) {
+                std::cout << "Output " << i << ": " << this->GetOutput(i)->GetPixel(index) << std::endl;
+            }
         }
-        if (m_allResiduals)
-            ++allResidualsIter;
-        ++residualIter;
-        ++iterationsIter;
+    }
+    std::cout << "Residual: " << this->GetResidualOutput()->GetPixel(index) << std::endl;
+    if (m_allResiduals) {
+        std::cout << "All residuals: " << this->GetAllResidualsOutput()->GetPixel(index) << std::endl;
+    }
+    std::cout << "Iterations: " << this->GetIterationsOutput()->GetPixel(index) << std::endl;
+    if (m_failures) {
+        std::cout << "Failed: " << int(this->GetFailuresOutput()->GetPixel(index)) << std::endl;
     }
 }
+
 } // namespace ITK
 
 #endif // APPLYALGORITHMFILTER_HXX
@@ -0,0 +1,80 @@
+/*
+ *  ElementwiseMap.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ELEMENTWISEMAP_H
+#define QI_ELEMENTWISEMAP_H
+
+#include <algorithm>
+#include <Eigen/Core>
+#include "itkExtractImageFilter.h"
+#include "ImageTypes.h"
+#include "ThreadPool.h"
+
+namespace QI {
+
+/*
+ * Pure arithmetic on the volumes of a series (ratios, MTRs) does not need ApplyAlgorithmFilter,
+ * with its per-voxel gather and virtual call. The volumes of a SeriesF are contiguous, so the same
+ * block of voxels from each can be mapped as Eigen arrays and combined in one vectorised loop.
+ */
+const size_t ElementwiseBlockSize = 4096;
+
+// Runs f(start, length) over blocks of the n voxels, with each thread taking a contiguous share
+template<typename F>
+void ElementwiseMap(const size_t n, const F &f) {
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), n / ElementwiseBlockSize));
+    pool.run(nTasks, [&](const size_t t) {
+        const size_t end = (n * (t + 1)) / nTasks;
+        for (size_t i = (n * t) / nTasks; i < end; i += ElementwiseBlockSize) {
+            f(i, std::min(ElementwiseBlockSize, end - i));
+        }
+    });
+}
+
+inline size_t VoxelsPerVolume(const SeriesF *series) {
+    const SeriesF::SizeType size = series->GetLargestPossibleRegion().GetSize();
+    return size[0] * size[1] * size[2];
+}
+
+// An empty volume with the geometry of the first three dimensions of the series
+inline VolumeF::Pointer NewVolumeLike(const SeriesF *series) {
+    auto extract = itk::ExtractImageFilter<SeriesF, VolumeF>::New();
+    auto region = series->GetLargestPossibleRegion();
+    region.GetModifiableSize()[3] = 0;
+    region.GetModifiableIndex()[3] = 0;
+    extract->SetExtractionRegion(region);
+    extract->SetInput(series);
+    extract->SetDirectionCollapseToSubmatrix();
+    extract->UpdateOutputInformation();
+    VolumeF::Pointer v = VolumeF::New();
+    v->CopyInformation(extract->GetOutput());
+    v->SetRegions(extract->GetOutput()->GetLargestPossibleRegion());
+    v->Allocate();
+    return v;
+}
+
+// Voxels start to start + length of one volume of the series
+inline Eigen::Map<const Eigen::ArrayXf> VolumeBlock(const SeriesF *series, const size_t volume, const size_t start, const size_t length) {
+    return Eigen::Map<const Eigen::ArrayXf>(series->GetBufferPointer() + volume * VoxelsPerVolume(series) + start, length);
+}
+
+inline Eigen::Map<Eigen::ArrayXf> VolumeBlock(VolumeF *volume, const size_t start, const size_t length) {
+    return Eigen::Map<Eigen::ArrayXf>(volume->GetBufferPointer() + start, length);
+}
+
+inline Eigen::Map<const Eigen::ArrayXf> VolumeBlock(const VolumeF *volume, const size_t start, const size_t length) {
+    return Eigen::Map<const Eigen::ArrayXf>(volume->GetBufferPointer() + start, length);
+}
+
+} // End namespace QI
+
+#endif // QI_ELEMENTWISEMAP_H
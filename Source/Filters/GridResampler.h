@@ -0,0 +1,209 @@
+/*
+ *  GridResampler.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_GRIDRESAMPLER_H
+#define QI_GRIDRESAMPLER_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <Eigen/Dense>
+
+#include "itkImage.h"
+#include "Macro.h"
+#include "ThreadPool.h"
+
+namespace QI {
+
+/*
+ * Resamples images from one grid onto another, as itk::ResampleImageFilter with a linear or
+ * nearest-neighbour interpolator and an affine (e.g. rigid) transform would. The transform maps
+ * points of the output grid to the input grid, as in ITK. Where each output voxel falls in the
+ * input, and its interpolation weights, are worked out once when this is made. Any number of
+ * images on the input grid are then resampled together in one pass, which only reads the cached
+ * weights. Voxels that fall outside the input are 0. Both steps run on the global pool unless
+ * threaded is false, which is needed inside a task of that pool as it cannot wait on itself.
+ */
+class GridResampler {
+public:
+    enum class Interpolation { Linear, Nearest };
+    typedef itk::ImageBase<3> TGeometry;
+    typedef Eigen::Matrix3d TMatrix;
+    typedef Eigen::Vector3d TVector;
+
+    GridResampler(const TGeometry *input, const TGeometry *output,
+                  const Interpolation interpolation = Interpolation::Linear,
+                  const TMatrix &matrix = TMatrix::Identity(), const TVector &offset = TVector::Zero(),
+                  const bool threaded = true) :
+        m_interpolation(interpolation)
+    {
+        m_inRegion = input->GetLargestPossibleRegion();
+        m_inSpacing = input->GetSpacing();
+        m_inOrigin = input->GetOrigin();
+        m_inDirection = input->GetDirection();
+        m_outRegion = output->GetLargestPossibleRegion();
+        m_outSpacing = output->GetSpacing();
+        m_outOrigin = output->GetOrigin();
+        m_outDirection = output->GetDirection();
+
+        // Continuous input index = A * output index + b
+        TMatrix inM, outM;
+        TVector inO, outO;
+        for (int i = 0; i < 3; i++) {
+            inO[i] = m_inOrigin[i];
+            outO[i] = m_outOrigin[i];
+            for (int j = 0; j < 3; j++) {
+                inM(i, j) = m_inDirection(i, j) * m_inSpacing[j];
+                outM(i, j) = m_outDirection(i, j) * m_outSpacing[j];
+            }
+        }
+        const TMatrix inverse = inM.inverse();
+        const TMatrix A = inverse * matrix * outM;
+        const TVector b = inverse * (matrix * outO + offset - inO);
+
+        const auto inStart = m_inRegion.GetIndex();
+        const auto inSize = m_inRegion.GetSize();
+        const auto outStart = m_outRegion.GetIndex();
+        const auto outSize = m_outRegion.GetSize();
+        const int64_t stride[3] = {1, static_cast<int64_t>(inSize[0]), static_cast<int64_t>(inSize[0] * inSize[1])};
+        const size_t slice = outSize[0] * outSize[1];
+        m_weights.resize(slice * outSize[2]);
+        const auto task = [&](const size_t first, const size_t last) {
+            for (size_t z = first; z < last; z++) {
+                for (size_t y = 0; y < outSize[1]; y++) {
+                    for (size_t x = 0; x < outSize[0]; x++) {
+                        const TVector j(static_cast<double>(outStart[0] + x), static_cast<double>(outStart[1] + y),
+                                        static_cast<double>(outStart[2] + z));
+                        const TVector c = A * j + b;
+                        Weight &w = m_weights[z * slice + y * outSize[0] + x];
+                        w.base = 0;
+                        w.steps = 0;
+                        for (int d = 0; d < 3; d++) {
+                            const double rel = c[d] - inStart[d];
+                            // The same test as itk::ImageFunction::IsInsideBuffer
+                            if (!(rel >= -0.5 && rel < inSize[d] - 0.5)) {
+                                w.base = -1;
+                                break;
+                            }
+                            if (m_interpolation == Interpolation::Nearest) {
+                                w.base += static_cast<int64_t>(std::floor(rel + 0.5)) * stride[d];
+                            } else {
+                                // Neighbours past the edge are clamped, as itk::LinearInterpolateImageFunction
+                                const int64_t i0 = static_cast<int64_t>(std::floor(rel));
+                                const int64_t lo = std::max<int64_t>(0, i0);
+                                const int64_t hi = std::min<int64_t>(inSize[d] - 1, i0 + 1);
+                                w.base += lo * stride[d];
+                                w.frac[d] = static_cast<float>(rel - i0);
+                                if (hi > lo) w.steps |= (1 << d);
+                            }
+                        }
+                    }
+                }
+            }
+        };
+        if (threaded) {
+            ThreadPool::Global().parallelFor(0, outSize[2], 1, task);
+        } else {
+            task(0, outSize[2]);
+        }
+        m_strides[0] = stride[0];
+        m_strides[1] = stride[1];
+        m_strides[2] = stride[2];
+    }
+
+    // True if images with this geometry can be resampled with these weights
+    bool matches(const TGeometry *input) const {
+        return input->GetLargestPossibleRegion() == m_inRegion && input->GetSpacing() == m_inSpacing &&
+               input->GetOrigin() == m_inOrigin && input->GetDirection() == m_inDirection;
+    }
+
+    // Resample every image in one pass
+    template<typename TImage>
+    std::vector<typename TImage::Pointer> apply(const std::vector<const TImage *> &images, const bool threaded = true) const {
+        typedef typename TImage::PixelType TPixel;
+        std::vector<typename TImage::Pointer> outputs;
+        std::vector<const TPixel *> src;
+        std::vector<TPixel *> dst;
+        for (const TImage *img : images) {
+            if (!matches(img) || img->GetBufferedRegion() != m_inRegion) {
+                QI_EXCEPTION("Image to resample is not on the grid the weights were made for");
+            }
+            typename TImage::Pointer out = TImage::New();
+            out->SetRegions(m_outRegion);
+            out->SetSpacing(m_outSpacing);
+            out->SetOrigin(m_outOrigin);
+            out->SetDirection(m_outDirection);
+            out->Allocate();
+            src.push_back(img->GetBufferPointer());
+            dst.push_back(out->GetBufferPointer());
+            outputs.push_back(out);
+        }
+        const auto task = [&](const size_t first, const size_t last) {
+            for (size_t v = first; v < last; v++) {
+                const Weight &w = m_weights[v];
+                for (size_t i = 0; i < src.size(); i++) {
+                    dst[i][v] = (w.base < 0) ? TPixel(0) : interpolate(src[i], w);
+                }
+            }
+        };
+        if (threaded) {
+            ThreadPool::Global().parallelFor(0, m_weights.size(), BlockSize, task);
+        } else {
+            task(0, m_weights.size());
+        }
+        return outputs;
+    }
+
+    template<typename TImage>
+    typename TImage::Pointer apply(const TImage *image, const bool threaded = true) const {
+        return apply(std::vector<const TImage *>{image}, threaded).front();
+    }
+
+protected:
+    struct Weight {
+        int64_t base;     // Input offset of the first neighbour, -1 if outside
+        float frac[3];    // Distance from it along each axis (linear only)
+        uint8_t steps;    // Bit d set if the second neighbour along axis d is a different voxel
+    };
+    static const size_t BlockSize = 4096; // Output voxels per task
+
+    Interpolation m_interpolation;
+    TGeometry::RegionType m_inRegion, m_outRegion;
+    TGeometry::SpacingType m_inSpacing, m_outSpacing;
+    TGeometry::PointType m_inOrigin, m_outOrigin;
+    TGeometry::DirectionType m_inDirection, m_outDirection;
+    int64_t m_strides[3];
+    std::vector<Weight> m_weights;
+
+    template<typename TPixel>
+    TPixel interpolate(const TPixel *in, const Weight &w) const {
+        if (m_interpolation == Interpolation::Nearest) {
+            return in[w.base];
+        }
+        const int64_t dx = (w.steps & 1) ? m_strides[0] : 0;
+        const int64_t dy = (w.steps & 2) ? m_strides[1] : 0;
+        const int64_t dz = (w.steps & 4) ? m_strides[2] : 0;
+        const TPixel *p = in + w.base;
+        const double fx = w.frac[0], fy = w.frac[1], fz = w.frac[2];
+        const double c00 = p[0] + fx * (p[dx] - p[0]);
+        const double c10 = p[dy] + fx * (p[dy + dx] - p[dy]);
+        const double c01 = p[dz] + fx * (p[dz + dx] - p[dz]);
+        const double c11 = p[dz + dy] + fx * (p[dz + dy + dx] - p[dz + dy]);
+        const double c0 = c00 + fy * (c10 - c00);
+        const double c1 = c01 + fy * (c11 - c01);
+        return static_cast<TPixel>(c0 + fz * (c1 - c0));
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_GRIDRESAMPLER_H
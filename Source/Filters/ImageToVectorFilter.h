@@ -3,8 +3,7 @@
 
 #include "itkVectorImage.h"
 #include "itkImageToImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkComposeImageFilter.h"
+#include "itkImageRegionConstIterator.h"
 
 namespace itk {
 
@@ -29,16 +28,13 @@ public:
     itkSetMacro(BlockSize, size_t);
 
 protected:
-	typedef ExtractImageFilter<TInput, TVolume>  ExtractType;
-	typedef ComposeImageFilter<TVolume, TOutput> ComposeType;
-
-    typename ComposeType::Pointer m_compose;
     size_t m_BlockStart, m_BlockSize;
 
 	ImageToVectorFilter();
 	~ImageToVectorFilter(){}
 
     void GenerateOutputInformation() ITK_OVERRIDE; // Because output will be different dimension to input
+    void GenerateInputRequestedRegion() ITK_OVERRIDE; // Only read the volumes in the block for the requested region, so this can stream
     void GenerateData() ITK_OVERRIDE; // Does the work
 	//DataObject::Pointer MakeOutput(unsigned int idx); // Create the Output
 
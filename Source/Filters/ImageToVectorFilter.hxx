@@ -1,11 +1,12 @@
 #ifndef IMAGETOVECTORFILTER_HXX
 #define IMAGETOVECTORFILTER_HXX
 
+#include "Trace.h"
+
 namespace itk {
 
 template<typename TInput>
 ImageToVectorFilter<TInput>::ImageToVectorFilter() {
-	m_compose = ComposeType::New();
     m_BlockStart = 0;
     m_BlockSize = 0;
 }
@@ -50,29 +51,48 @@ void ImageToVectorFilter<TInput>::GenerateOutputInformation() {
     //std::cout << "END " << __PRETTY_FUNCTION__ << std::endl;
 }
 
+template<typename TInput>
+void ImageToVectorFilter<TInput>::GenerateInputRequestedRegion() {
+    typename TInput::Pointer inputPtr = const_cast<TInput *>(this->GetInput());
+    if (!inputPtr) {
+        return;
+    }
+    const auto outputRegion = this->GetOutput()->GetRequestedRegion();
+    typename TInput::RegionType inputRegion;
+    for (int i = 0; i < OutputDimension; i++) {
+        inputRegion.SetIndex(i, outputRegion.GetIndex()[i]);
+        inputRegion.SetSize(i, outputRegion.GetSize()[i]);
+    }
+    inputRegion.SetIndex(OutputDimension, inputPtr->GetLargestPossibleRegion().GetIndex()[OutputDimension] + m_BlockStart);
+    inputRegion.SetSize(OutputDimension, m_BlockSize);
+    inputPtr->SetRequestedRegion(inputRegion);
+}
+
 template<typename TInput>
 void ImageToVectorFilter<TInput>::GenerateData() {
     //std::cout << __PRETTY_FUNCTION__ << std::endl;
+    const QI::TraceSpan span("convert", "ImageToVector");
 	auto input = this->GetInput();
-	auto region = input->GetLargestPossibleRegion();
     size_t blockEnd = m_BlockStart + m_BlockSize;
-    size_t inputLength = region.GetSize()[OutputDimension];
+    size_t inputLength = input->GetLargestPossibleRegion().GetSize()[OutputDimension];
     if (blockEnd > inputLength) {
         itkExceptionMacro("Block end " << blockEnd << " would be greater than input length (" << inputLength << ")");
     }
-    region.GetModifiableSize()[OutputDimension] = 0;
-    for (int i = 0; i < m_BlockSize; i ++) {
-        region.GetModifiableIndex()[OutputDimension] = i + m_BlockStart;
-        //std::cout << region << std::endl;
-		auto volume = ExtractType::New();
-		volume->SetExtractionRegion(region);
-		volume->SetInput(input);
-		volume->SetDirectionCollapseToSubmatrix();
-		volume->Update();
-		m_compose->SetInput(i, volume->GetOutput());
-	}
-	m_compose->Update();
-	this->GraftOutput(m_compose->GetOutput());
+    this->AllocateOutputs();
+    auto output = this->GetOutput();
+    // Copy each volume of the block straight into the interleaved vector buffer. Both iterate
+    // the same 3D region in the same order, so voxel v of each volume is pixel v of the output.
+    typename TInput::RegionType volumeRegion = input->GetRequestedRegion();
+    volumeRegion.SetSize(OutputDimension, 1);
+    TPixel *outBuffer = output->GetBufferPointer();
+    for (size_t i = 0; i < m_BlockSize; i++) {
+        volumeRegion.SetIndex(OutputDimension, input->GetLargestPossibleRegion().GetIndex()[OutputDimension] + m_BlockStart + i);
+        ImageRegionConstIterator<TInput> it(input, volumeRegion);
+        size_t v = 0;
+        for (it.GoToBegin(); !it.IsAtEnd(); ++it, ++v) {
+            outBuffer[v * m_BlockSize + i] = it.Get();
+        }
+    }
     //std::cout << "END " << __PRETTY_FUNCTION__ << std::endl;
 }
 
@@ -0,0 +1,192 @@
+/*
+ *  PackedImage.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PACKEDIMAGE_H
+#define QI_PACKEDIMAGE_H
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#include "itkImage.h"
+#include "itkVectorImage.h"
+#include "Macro.h"
+#include "Pack.h"
+#include "PixelBuffers.h"
+
+namespace QI {
+
+/*
+ * The buffer of an image held losslessly compressed (see PackBytes) in bricks of consecutive
+ * pixels, each with all of its components, so a large input can stay in memory for a fit at a
+ * fraction of its size. The header is an image with the same information and regions but no
+ * buffer, for filters that need the geometry. Packing is done here, on the calling thread, so
+ * the original image can be released as soon as this exists. Scanner data can instead keep its
+ * 16-bit integers, which are only converted to values as each brick is unpacked.
+ */
+template<typename TImage>
+class PackedImage {
+public:
+    typedef typename TImage::InternalPixelType TValue;
+    typedef itk::VectorImage<int16_t, TImage::ImageDimension> TIntegerImage;
+    static const size_t DefaultBrick = 4096; // Pixels per brick
+
+    PackedImage(const TImage *image, const size_t brick = DefaultBrick) :
+        m_width(sizeof(TValue))
+    {
+        const TValue *data = image->GetBufferPointer();
+        if (!data) {
+            QI_EXCEPTION("Only an image in memory can be packed");
+        }
+        setup(image, brick);
+        for (size_t b = 0; b < m_bricks.size(); b++) {
+            store(b, data + b * m_brick * m_components, true);
+        }
+    }
+
+    /*
+     * Keeps the 16-bit integers of a scanner file (see ReadInt16VectorImage) instead of their
+     * values, so each brick holds half the bytes of floats before any packing, and the values are
+     * slope * stored + inter when the brick is unpacked. Without compress the bricks are only
+     * copied, and unpacking is just the conversion.
+     */
+    PackedImage(const TIntegerImage *image, const double slope, const double inter,
+                const bool compress = true, const size_t brick = DefaultBrick) :
+        m_width(sizeof(int16_t)), m_integers(true), m_slope(slope), m_inter(inter)
+    {
+        const int16_t *data = image->GetBufferPointer();
+        if (!data) {
+            QI_EXCEPTION("Only an image in memory can be packed");
+        }
+        setup(image, brick);
+        for (size_t b = 0; b < m_bricks.size(); b++) {
+            store(b, data + b * m_brick * m_components, compress);
+        }
+    }
+
+    const TImage *header() const { return m_header.GetPointer(); }
+    size_t components() const { return m_components; }
+    size_t brick() const { return m_brick; }
+    size_t bricks() const { return m_bricks.size(); }
+    size_t pixels(const size_t b) const { return std::min(m_brick, m_pixels - b * m_brick); }
+    size_t bytes() const { return m_bytes; } // Packed size of all the bricks
+    double ratio() const { return m_bytes ? double(m_pixels * m_components * sizeof(TValue)) / m_bytes : 1.0; }
+    bool integers() const { return m_integers; } // Bricks hold 16-bit integers, converted when unpacked
+
+    // Unpacks every value of brick b into values
+    void unpack(const size_t b, TValue *values, std::vector<uint8_t> &scratch) const {
+        const size_t count = pixels(b) * m_components;
+        if (!m_integers) {
+            UnpackBytes(m_bricks[b].data(), m_bricks[b].size(), values, count, sizeof(TValue), scratch);
+            return;
+        }
+        const int16_t *stored;
+        if (m_packed[b]) {
+            // The integers go at the start of values, and are converted from the last one back so
+            // each is read before the wider value that replaces it covers its bytes
+            UnpackBytes(m_bricks[b].data(), m_bricks[b].size(), values, count, sizeof(int16_t), scratch);
+            stored = reinterpret_cast<const int16_t *>(values);
+            for (size_t i = count; i-- > 0;) {
+                const int16_t v = stored[i];
+                values[i] = static_cast<TValue>(m_slope * v + m_inter);
+            }
+        } else {
+            stored = reinterpret_cast<const int16_t *>(m_bricks[b].data());
+            for (size_t i = 0; i < count; i++) {
+                values[i] = static_cast<TValue>(m_slope * stored[i] + m_inter);
+            }
+        }
+    }
+
+private:
+    typename TImage::ConstPointer m_header;
+    size_t m_components = 0, m_pixels = 0, m_brick = 0, m_bytes = 0, m_width;
+    bool m_integers = false;
+    double m_slope = 1, m_inter = 0;
+    std::vector<std::vector<uint8_t>> m_bricks;
+    std::vector<bool> m_packed; // Per brick, false if it was copied without PackBytes
+
+    template<typename TSource>
+    void setup(const TSource *image, const size_t brick) {
+        static_assert(sizeof(TValue) >= sizeof(int16_t), "Values must be at least as wide as the integers");
+        if (brick == 0) {
+            QI_EXCEPTION("Bricks must hold at least one pixel");
+        }
+        m_components = image->GetNumberOfComponentsPerPixel();
+        m_pixels = image->GetBufferedRegion().GetNumberOfPixels();
+        m_brick = brick;
+        typename TImage::Pointer header = TImage::New();
+        header->CopyInformation(image);
+        header->SetRequestedRegion(image->GetRequestedRegion());
+        header->SetBufferedRegion(image->GetBufferedRegion());
+        header->SetNumberOfComponentsPerPixel(m_components);
+        m_header = header;
+        m_bricks.resize((m_pixels + m_brick - 1) / m_brick);
+        m_packed.resize(m_bricks.size());
+    }
+
+    void store(const size_t b, const void *data, const bool compress) {
+        const size_t count = pixels(b) * m_components;
+        if (compress) {
+            PackBytes(data, count, m_width, m_bricks[b]);
+        } else {
+            const uint8_t *bytes = static_cast<const uint8_t *>(data);
+            m_bricks[b].assign(bytes, bytes + count * m_width);
+        }
+        m_bricks[b].shrink_to_fit();
+        m_packed[b] = compress;
+        m_bytes += m_bricks[b].size();
+    }
+};
+
+/*
+ * A worker's view of a packed image, as a PixelBuffer gives of an image. The last brick read is
+ * kept unpacked, so voxels visited in buffer order only unpack each brick once. A default (or null)
+ * reader is for inputs that are not packed.
+ */
+template<typename TImage>
+class BrickReader {
+public:
+    typedef typename PackedImage<TImage>::TValue TValue;
+
+    BrickReader() = default;
+    template<unsigned int D>
+    BrickReader(const PackedImage<TImage> *packed, BufferOffsets<D> &offsets) :
+        m_packed(packed),
+        m_slot(packed ? offsets.add(packed->header()) : 0),
+        m_values(packed ? packed->brick() * packed->components() : 0)
+    {}
+
+    bool valid() const { return m_packed != nullptr; }
+
+    template<unsigned int D>
+    const TValue *at(const BufferOffsets<D> &offsets) {
+        const size_t pixel = offsets[m_slot];
+        const size_t b = pixel / m_packed->brick();
+        if (b != m_current) {
+            m_packed->unpack(b, m_values.data(), m_scratch);
+            m_current = b;
+        }
+        return m_values.data() + (pixel - b * m_packed->brick()) * m_packed->components();
+    }
+
+private:
+    const PackedImage<TImage> *m_packed = nullptr;
+    size_t m_slot = 0;
+    size_t m_current = std::numeric_limits<size_t>::max();
+    std::vector<TValue> m_values;
+    std::vector<uint8_t> m_scratch;
+};
+
+} // End namespace QI
+
+#endif // QI_PACKEDIMAGE_H
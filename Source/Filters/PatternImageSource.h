@@ -0,0 +1,76 @@
+/*
+ *  PatternImageSource.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef PATTERNIMAGESOURCE_H
+#define PATTERNIMAGESOURCE_H
+
+#include "itkImageSource.h"
+
+namespace itk {
+
+/*
+ * Generates the simple patterns of qinewimage (a constant, a gradient or steps along one axis,
+ * optionally wrapped) procedurally. Every voxel is a function of its index alone, so only the
+ * requested region is allocated and filled, which lets a streaming writer or downstream filter
+ * pull the image a slab at a time. The lines of each region are shared over the global pool.
+ */
+template<typename TImage>
+class PatternImageSource : public ImageSource<TImage> {
+public:
+    static const unsigned int ImageDimension = TImage::ImageDimension;
+    typedef typename TImage::PixelType   TPixel;
+    typedef typename TImage::RegionType  TRegion;
+    typedef typename TImage::SpacingType TSpacing;
+    typedef typename TImage::PointType   TPoint;
+
+    typedef PatternImageSource   Self;
+    typedef ImageSource<TImage>  Superclass;
+    typedef SmartPointer<Self>   Pointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(PatternImageSource, ImageSource);
+
+    enum class Pattern { Fill, Gradient, Steps };
+
+    void SetRegion(const TRegion &r);
+    void SetSpacing(const TSpacing &s);
+    void SetOrigin(const TPoint &o);
+    void SetFill(const double value);
+    void SetGradient(const unsigned int dim, const double low, const double high);
+    void SetSteps(const unsigned int dim, const double low, const double high, const int steps);
+    void SetWrap(const double wrap); // 0 to disable
+
+protected:
+    TRegion  m_region;
+    TSpacing m_spacing;
+    TPoint   m_origin;
+    Pattern  m_pattern = Pattern::Fill;
+    unsigned int m_dim = 0;
+    double m_low = 0, m_high = 0, m_wrap = 0;
+    int m_steps = 1;
+
+    PatternImageSource();
+    ~PatternImageSource(){}
+
+    void GenerateOutputInformation() ITK_OVERRIDE;
+    void GenerateData() ITK_OVERRIDE;
+    double value(const IndexValueType i) const; // Value at index i along the pattern axis
+
+private:
+    PatternImageSource(const Self &); //purposely not implemented
+    void operator=(const Self &);  //purposely not implemented
+};
+
+} // End namespace itk
+
+#include "PatternImageSource.hxx"
+
+#endif // PATTERNIMAGESOURCE_H
@@ -0,0 +1,139 @@
+/*
+ *  PatternImageSource.hxx
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef PATTERNIMAGESOURCE_HXX
+#define PATTERNIMAGESOURCE_HXX
+
+#include <cmath>
+#include <algorithm>
+#include "ThreadPool.h"
+
+namespace itk {
+
+template<typename TImage>
+PatternImageSource<TImage>::PatternImageSource() {
+    typename TRegion::IndexType index; index.Fill(0);
+    typename TRegion::SizeType size; size.Fill(1);
+    m_region.SetIndex(index);
+    m_region.SetSize(size);
+    m_spacing.Fill(1.0);
+    m_origin.Fill(0.);
+}
+
+template<typename TImage>
+void PatternImageSource<TImage>::SetRegion(const TRegion &r) { m_region = r; this->Modified(); }
+template<typename TImage>
+void PatternImageSource<TImage>::SetSpacing(const TSpacing &s) { m_spacing = s; this->Modified(); }
+template<typename TImage>
+void PatternImageSource<TImage>::SetOrigin(const TPoint &o) { m_origin = o; this->Modified(); }
+template<typename TImage>
+void PatternImageSource<TImage>::SetWrap(const double w) { m_wrap = w; this->Modified(); }
+
+template<typename TImage>
+void PatternImageSource<TImage>::SetFill(const double value) {
+    m_pattern = Pattern::Fill;
+    m_dim = 0;
+    m_low = m_high = value;
+    this->Modified();
+}
+
+template<typename TImage>
+void PatternImageSource<TImage>::SetGradient(const unsigned int dim, const double low, const double high) {
+    m_pattern = Pattern::Gradient;
+    m_dim = dim;
+    m_low = low;
+    m_high = high;
+    this->Modified();
+}
+
+template<typename TImage>
+void PatternImageSource<TImage>::SetSteps(const unsigned int dim, const double low, const double high, const int steps) {
+    if (steps < 2) {
+        itkExceptionMacro("Must have more than 1 step, only have " << steps);
+    }
+    m_pattern = Pattern::Steps;
+    m_dim = dim;
+    m_low = low;
+    m_high = high;
+    m_steps = steps;
+    this->Modified();
+}
+
+template<typename TImage>
+void PatternImageSource<TImage>::GenerateOutputInformation() {
+    if (m_dim >= ImageDimension) {
+        itkExceptionMacro("Fill dimension is larger than image dimension");
+    }
+    if (m_pattern == Pattern::Steps && m_region.GetSize()[m_dim] < static_cast<SizeValueType>(m_steps)) {
+        itkExceptionMacro("Cannot fit " << m_steps << " steps into " << m_region.GetSize()[m_dim] << " voxels");
+    }
+    TImage *output = this->GetOutput();
+    output->SetLargestPossibleRegion(m_region);
+    output->SetSpacing(m_spacing);
+    output->SetOrigin(m_origin);
+}
+
+template<typename TImage>
+double PatternImageSource<TImage>::value(const IndexValueType i) const {
+    const SizeValueType n = m_region.GetSize()[m_dim];
+    double v = m_low;
+    switch (m_pattern) {
+    case Pattern::Fill: break;
+    case Pattern::Gradient:
+        if (n > 1) {
+            v += i * (m_high - m_low) / (n - 1);
+        }
+        break;
+    case Pattern::Steps:
+        v += (i / static_cast<IndexValueType>(n / m_steps)) * (m_high - m_low) / (m_steps - 1);
+        break;
+    }
+    return (m_wrap != 0) ? std::fmod(v, m_wrap) : v;
+}
+
+/*
+ * AllocateOutputs() buffers exactly the requested region, so each of its lines along the first
+ * axis is contiguous and its index can be worked out from its number.
+ */
+template<typename TImage>
+void PatternImageSource<TImage>::GenerateData() {
+    this->AllocateOutputs();
+    TImage *output = this->GetOutput();
+    const TRegion region = output->GetRequestedRegion();
+    const SizeValueType nx = region.GetSize()[0];
+    const size_t nLines = region.GetNumberOfPixels() / nx;
+    const IndexValueType start = m_region.GetIndex()[m_dim];
+    TPixel *buffer = output->GetBufferPointer();
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nLines));
+    pool.run(nTasks, [&](const size_t t) {
+        for (size_t l = (nLines * t) / nTasks; l < (nLines * (t + 1)) / nTasks; l++) {
+            typename TRegion::IndexType index = region.GetIndex();
+            size_t rest = l;
+            for (unsigned int d = 1; d < ImageDimension; d++) {
+                index[d] += rest % region.GetSize()[d];
+                rest /= region.GetSize()[d];
+            }
+            TPixel *line = buffer + l * nx;
+            if (m_dim == 0) {
+                for (SizeValueType i = 0; i < nx; i++) {
+                    line[i] = static_cast<TPixel>(value(index[0] + static_cast<IndexValueType>(i) - start));
+                }
+            } else {
+                std::fill(line, line + nx, static_cast<TPixel>(value(index[m_dim] - start)));
+            }
+        }
+    });
+}
+
+} // End namespace itk
+
+#endif // PATTERNIMAGESOURCE_HXX
@@ -0,0 +1,132 @@
+/*
+ *  PixelBuffers.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PIXELBUFFERS_H
+#define QI_PIXELBUFFERS_H
+
+#include <vector>
+#include <type_traits>
+
+#include "itkImageRegion.h"
+#include "itkDefaultConvertPixelTraits.h"
+
+namespace QI {
+
+/*
+ * Offset of one voxel in each of the distinct buffered regions of a set of images. Images that are
+ * buffered over the same region (normally all the inputs, and all the outputs) share one slot, so
+ * locate() does the index arithmetic once per region instead of once per image as GetPixel does.
+ */
+template<unsigned int D>
+class BufferOffsets {
+public:
+    typedef itk::ImageRegion<D> TRegion;
+    typedef typename TRegion::IndexType TIndex;
+
+    template<typename TImage>
+    size_t add(const TImage *image) {
+        const TRegion &region = image->GetBufferedRegion();
+        for (size_t r = 0; r < m_regions.size(); r++) {
+            if (m_regions[r] == region) return r;
+        }
+        m_regions.push_back(region);
+        Stride stride;
+        size_t s = 1;
+        for (unsigned int d = 0; d < D; d++) {
+            stride.s[d] = s;
+            s *= region.GetSize()[d];
+        }
+        m_strides.push_back(stride);
+        m_offsets.push_back(0);
+        return m_regions.size() - 1;
+    }
+
+    void locate(const TIndex &index) {
+        for (size_t r = 0; r < m_regions.size(); r++) {
+            const TIndex &start = m_regions[r].GetIndex();
+            size_t offset = 0;
+            for (unsigned int d = 0; d < D; d++) {
+                offset += (index[d] - start[d]) * m_strides[r].s[d];
+            }
+            m_offsets[r] = offset;
+        }
+    }
+
+    size_t operator[](const size_t slot) const { return m_offsets[slot]; }
+
+private:
+    struct Stride { size_t s[D]; };
+    std::vector<TRegion> m_regions;
+    std::vector<Stride> m_strides;
+    std::vector<size_t> m_offsets;
+};
+
+/*
+ * The buffer of an image resolved once, so each pixel is a plain slice of components at the offset
+ * from BufferOffsets. Vector pixels need no VariableLengthVector, and reading a const image gives
+ * a const pointer. A default (or null) buffer is for optional images, e.g. consts with no map.
+ * A slice is a run of the components of another image with the same value type, so one output of
+ * an interleaved image can be used as if it were an image of its own.
+ */
+template<typename TImage>
+class PixelBuffer {
+public:
+    typedef typename std::remove_const<TImage>::type TMutableImage;
+    typedef typename std::conditional<std::is_const<TImage>::value,
+                                      const typename TMutableImage::InternalPixelType,
+                                      typename TMutableImage::InternalPixelType>::type TValue;
+
+    PixelBuffer() = default;
+    template<unsigned int D>
+    PixelBuffer(TImage *image, BufferOffsets<D> &offsets) :
+        m_data(image ? image->GetBufferPointer() : nullptr),
+        m_components(image ? image->GetNumberOfComponentsPerPixel() : 0),
+        m_slot(image ? offsets.add(image) : 0),
+        m_stride(m_components)
+    {}
+    template<typename TOther, unsigned int D>
+    PixelBuffer(TOther *image, BufferOffsets<D> &offsets, const size_t first, const size_t count) :
+        m_data((image && image->GetBufferPointer()) ? image->GetBufferPointer() + first : nullptr),
+        m_components(image ? count : 0),
+        m_slot(image ? offsets.add(image) : 0),
+        m_stride(image ? image->GetNumberOfComponentsPerPixel() : 0)
+    {
+        static_assert(std::is_same<typename std::remove_const<TOther>::type::InternalPixelType,
+                                   typename TMutableImage::InternalPixelType>::value,
+                      "A slice must have the same value type as the image");
+    }
+
+    bool valid() const { return m_data != nullptr; }
+    size_t components() const { return m_components; }
+
+    template<unsigned int D>
+    TValue *at(const BufferOffsets<D> &offsets) const { return m_data + offsets[m_slot] * m_stride; }
+
+    // Writes an ITK pixel (scalar or vector) with the same number of components, if there is a buffer
+    template<unsigned int D, typename TPixel>
+    void set(const BufferOffsets<D> &offsets, const TPixel &px) const {
+        if (!m_data) return;
+        TValue *p = at(offsets);
+        for (size_t k = 0; k < m_components; k++) {
+            p[k] = itk::DefaultConvertPixelTraits<TPixel>::GetNthComponent(k, px);
+        }
+    }
+
+private:
+    TValue *m_data = nullptr;
+    size_t m_components = 0;
+    size_t m_slot = 0;
+    size_t m_stride = 0; // Components per pixel in the buffer, more than m_components for a slice
+};
+
+} // End namespace QI
+
+#endif // QI_PIXELBUFFERS_H
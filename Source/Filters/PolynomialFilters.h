@@ -0,0 +1,227 @@
+/*
+ *  PolynomialFilters.h
+ *
+ *  Copyright (c) 2016 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_POLYNOMIALFILTERS_H
+#define QI_POLYNOMIALFILTERS_H
+
+#include <vector>
+#include <algorithm>
+#include "Eigen/Dense"
+
+#include "itkImageToImageFilter.h"
+#include "itkImageSource.h"
+#include "itkImageMomentsCalculator.h"
+#include "ImageTypes.h"
+#include "Polynomial.h"
+#include "MaskSpans.h"
+#include "Fit.h"
+#include "ThreadPool.h"
+
+namespace itk {
+
+/*
+ * Fits a 3D polynomial in physical space, relative to a center point, to the voxels within the
+ * mask (or the whole image)
+ */
+class PolynomialFitImageFilter : public ImageToImageFilter<QI::VolumeF, QI::VolumeF> {
+public:
+    /** Standard class typedefs. */
+    typedef QI::VolumeF     TImage;
+
+    typedef PolynomialFitImageFilter           Self;
+    typedef ImageToImageFilter<TImage, TImage> Superclass;
+    typedef SmartPointer<Self>                 Pointer;
+    typedef typename TImage::RegionType        RegionType;
+
+    itkNewMacro(Self);
+    itkTypeMacro(Self, Superclass);
+
+    itkSetMacro(Robust, bool);
+    itkGetMacro(Robust, bool);
+
+    //void SetInput(const TImage *img) ITK_OVERRIDE      { this->SetNthInput(0, const_cast<TImage*>(img)); }
+    //typename TImage::ConstPointer GetInput() const { return static_cast<const TImage *>(this->ProcessObject::GetInput(0)); }
+
+    const QI::Polynomial<3> &GetPolynomial() const { return m_poly; } 
+    void SetPolynomial(const QI::Polynomial<3> &p) { m_poly = p; }
+    void SetMask(const TImage *mask) { this->SetNthInput(1, const_cast<TImage*>(mask)); }
+    void SetCenter(const itk::Point<double, 3>& v) { m_center = v; }
+    typename TImage::ConstPointer GetMask() const { return static_cast<const TImage *>(this->ProcessObject::GetInput(1)); }
+    void GenerateOutputInformation() ITK_OVERRIDE {
+        Superclass::GenerateOutputInformation();
+        auto op = this->GetOutput();
+        op->SetRegions(this->GetInput()->GetLargestPossibleRegion());
+        op->Allocate();
+    }
+
+protected:
+    QI::Polynomial<3> m_poly;
+    itk::Point<double, 3> m_center;
+    bool m_Robust;
+
+    PolynomialFitImageFilter() {
+        this->SetNumberOfRequiredInputs(1);
+        m_center.Fill(0.0);
+    }
+    ~PolynomialFitImageFilter() {}
+
+    void GenerateData() ITK_OVERRIDE {
+        typename TImage::ConstPointer input = this->GetInput();
+        auto region = input->GetLargestPossibleRegion();
+
+        // Rows are only made a block at a time, so find the span holding the first row of each
+        const QI::MaskSpans<3> spans(this->GetMask().GetPointer(), region);
+        const std::vector<QI::MaskSpans<3>::Span> span_list(spans.begin(), spans.end());
+        std::vector<size_t> span_first(1, 0);
+        for (const auto &span : span_list) {
+            span_first.push_back(span_first.back() + span.length);
+        }
+        auto block = [&](const size_t first, const size_t n, Eigen::MatrixXd &X, Eigen::VectorXd &y) {
+            QI::Polynomial<3> poly(m_poly);
+            size_t s = std::upper_bound(span_first.begin(), span_first.end(), first) - span_first.begin() - 1;
+            size_t offset = first - span_first[s];
+            for (size_t row = 0; row < n; row++, offset++) {
+                while (offset == span_list[s].length) {
+                    s++;
+                    offset = 0;
+                }
+                TImage::IndexType index = span_list[s].start;
+                index[0] += offset;
+                TImage::PointType p, p2;
+                input->TransformIndexToPhysicalPoint(index, p);
+                p2 = p - m_center;
+                Eigen::Vector3d ep(p2[0], p2[1], p2[2]);
+                X.row(row) = poly.terms(ep).matrix().transpose();
+                y[row] = input->GetPixel(index);
+            }
+        };
+        Eigen::VectorXd b = QI::BlockedLeastSquares(spans.count(), m_poly.nterms(), block, m_Robust,
+                                                    QI::ThreadPool::Global().size());
+        m_poly.setCoeffs(b);
+    }
+
+private:
+    PolynomialFitImageFilter(const Self &); //purposely not implemented
+    void operator=(const Self &);  //purposely not implemented
+};
+
+/*
+ * Evaluates a 3D polynomial in the space of a reference image, within the mask if one is given
+ */
+class PolynomialImage : public ImageSource<QI::VolumeF> {
+public:
+    typedef QI::VolumeF            TImage;
+    typedef PolynomialImage        Self;
+    typedef ImageSource<TImage>    Superclass;
+    typedef SmartPointer<Self>     Pointer;
+
+    itkNewMacro(Self);
+    itkTypeMacro(Self, ImageSource);
+
+    void SetReferenceImage(const SmartPointer<TImage> img) {
+        m_reference = img;
+    }
+
+    void SetPolynomial(const QI::Polynomial<3> &p) { m_poly = p; }
+    void SetMask(const TImage *mask) { this->SetNthInput(1, const_cast<TImage*>(mask)); }
+    void SetCenter(const itk::Point<double, 3>& v) { m_center = v; }
+    typename TImage::ConstPointer GetMask() const { return static_cast<const TImage *>(this->ProcessObject::GetInput(1)); }
+    
+    void GenerateOutputInformation() ITK_OVERRIDE {
+        Superclass::GenerateOutputInformation();
+        auto output = this->GetOutput();
+        output->SetRegions(m_reference->GetLargestPossibleRegion());
+        output->SetSpacing(m_reference->GetSpacing());
+        output->SetDirection(m_reference->GetDirection());
+        output->SetOrigin(m_reference->GetOrigin());
+        output->Allocate();
+    }
+
+protected:
+    SmartPointer<TImage> m_reference;
+    itk::Point<double, 3> m_center;
+    QI::Polynomial<3> m_poly;
+
+    PolynomialImage(){
+        m_center.Fill(0.0);
+    }
+    ~PolynomialImage(){}
+    /*
+     * Each span of the mask (or each line without one) is filled with Polynomial::line(),
+     * with the spans shared over the thread pool.
+     */
+    void GenerateData() ITK_OVERRIDE {
+        typename TImage::Pointer output = this->GetOutput();
+        const auto region = output->GetLargestPossibleRegion();
+        output->FillBuffer(0);
+        const QI::MaskSpans<3> spans(this->GetMask().GetPointer(), region);
+        const std::vector<QI::MaskSpans<3>::Span> span_list(spans.begin(), spans.end());
+        auto point = [&](const TImage::IndexType &index) -> Eigen::Vector3d {
+            TImage::PointType p;
+            m_reference->TransformIndexToPhysicalPoint(index, p);
+            return Eigen::Vector3d(p[0] - m_center[0], p[1] - m_center[1], p[2] - m_center[2]);
+        };
+        TImage::IndexType next = region.GetIndex();
+        next[0]++;
+        const Eigen::Vector3d step = point(next) - point(region.GetIndex());
+        QI::ThreadPool &pool = QI::ThreadPool::Global();
+        const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), span_list.size()));
+        pool.run(nTasks, [&](const size_t t) {
+            for (size_t s = (span_list.size() * t) / nTasks; s < (span_list.size() * (t + 1)) / nTasks; s++) {
+                const auto &span = span_list[s];
+                m_poly.line(point(span.start), step, span.length, output->GetBufferPointer() + output->ComputeOffset(span.start));
+            }
+        });
+    }
+
+private:
+    PolynomialImage(const Self &);
+    void operator=(const Self &);
+};
+
+} // End namespace itk
+
+namespace QI {
+
+/*
+ * Fits a polynomial of the given order to the image within the mask, centered on the mask's
+ * center of gravity, and evaluates it over the whole image, so it is smoothed and extrapolated in
+ * one step (as qipolyfit followed by qipolyimg)
+ */
+inline VolumeF::Pointer PolynomialSmooth(const VolumeF::Pointer &image, const VolumeF::Pointer &mask,
+                                         const int order, const bool robust = false) {
+    itk::Point<double, 3> center; center.Fill(0.0);
+    if (mask) {
+        auto moments = itk::ImageMomentsCalculator<VolumeF>::New();
+        moments->SetImage(mask);
+        moments->Compute();
+        center = -moments->GetCenterOfGravity(); // ITK seems to put a minus sign on CoG
+    }
+    auto fit = itk::PolynomialFitImageFilter::New();
+    fit->SetInput(image);
+    if (mask) fit->SetMask(mask);
+    fit->SetPolynomial(Polynomial<3>(order));
+    fit->SetRobust(robust);
+    fit->SetCenter(center);
+    fit->Update();
+    auto poly = itk::PolynomialImage::New();
+    poly->SetReferenceImage(image);
+    poly->SetPolynomial(fit->GetPolynomial());
+    poly->SetCenter(center);
+    poly->Update();
+    VolumeF::Pointer output = poly->GetOutput();
+    output->DisconnectPipeline();
+    return output;
+}
+
+} // End namespace QI
+
+#endif // QI_POLYNOMIALFILTERS_H
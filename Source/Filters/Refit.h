@@ -0,0 +1,134 @@
+/*
+ *  Refit.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_REFIT_H
+#define QI_REFIT_H
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <type_traits>
+
+#include "Macro.h"
+#include "Args.h"
+#include "ImageIO.h"
+
+namespace QI {
+
+/*
+ * Options for programs built on ApplyAlgorithmFilter to fit only some voxels of an earlier run
+ * again, e.g. those with a high residual or that used all their iterations, with a bigger budget.
+ * The selection is a comma-separated list of terms NAME>VALUE (or >=, <, <=), any of which selects
+ * a voxel, where NAME is one of the maps the earlier run wrote with the output prefix given to
+ * --refit. Its maps start the selected voxels and are kept for the others, so the outputs can
+ * overwrite them.
+ */
+class RefitArgs {
+public:
+    args::ValueFlag<std::string> prefix;
+    args::ValueFlag<std::string> select;
+
+    RefitArgs(args::Group &group) :
+        prefix(group, "PREFIX", "Fit the voxels chosen by --select again, starting from and keeping the rest of the maps written with output prefix PREFIX", {"refit"}),
+        select(group, "EXPR", "Voxels to fit again, e.g. residual>0.05,iterations>=4 (any term selects a voxel)", {"select"})
+    {}
+
+    bool requested() { return prefix; }
+
+    /*
+     * The maps are the output prefix, then stem (e.g. the model name), then the name. outputs has
+     * the name of the map of each of the filter's outputs, residual and iterations the names of
+     * those maps. The residual, and the maps named in scaled, were written divided by output 0
+     * (QI::WriteScaledImage), so are multiplied by it again.
+     */
+    template<typename TApply>
+    void Apply(TApply &apply, const std::string &stem, const std::vector<std::string> &outputs, const std::string &residual,
+               const std::string &iterations, const std::vector<std::string> &scaled,
+               const QI::VolumeF::RegionType &region, const bool verbose) {
+        typedef typename std::remove_reference<decltype(*apply)>::type TFilter;
+        typedef typename TFilter::TOutputImage TOutputImage;
+        typedef typename TFilter::TMaskImage TMaskImage;
+        typedef typename TFilter::TIterationsImage TIterationsImage;
+        if (!select) {
+            QI_FAIL("--refit needs --select to choose the voxels");
+        }
+        const std::string from = prefix.Get() + stem;
+        if (verbose) std::cout << "Re-fitting " << select.Get() << " of the maps with prefix: " << from << std::endl;
+        std::vector<typename TOutputImage::Pointer> maps;
+        for (size_t i = 0; i < outputs.size(); i++) {
+            maps.push_back(QI::ReadImage<TOutputImage>(from + outputs[i] + QI::OutExt(), region));
+        }
+        auto unscale = [&](TOutputImage *img) {
+            auto *px = img->GetBufferPointer();
+            const auto *by = maps[0]->GetBufferPointer();
+            const size_t n = img->GetPixelContainer()->Size();
+            if (n != maps[0]->GetPixelContainer()->Size()) {
+                QI_FAIL("Scaled maps of the earlier fit are not the same size as " << outputs[0]);
+            }
+            for (size_t k = 0; k < n; k++) px[k] *= by[k];
+        };
+        for (size_t i = 0; i < outputs.size(); i++) {
+            if (std::find(scaled.begin(), scaled.end(), outputs[i]) != scaled.end()) {
+                unscale(maps[i]);
+            }
+            apply->SetInitial(i, maps[i]);
+        }
+        const typename TOutputImage::Pointer residuals = QI::ReadImage<TOutputImage>(from + residual + QI::OutExt(), region);
+        unscale(residuals);
+        const typename TIterationsImage::Pointer its = QI::ReadImage<TIterationsImage>(from + iterations + QI::OutExt(), region);
+
+        // Each term is compared over the whole buffer, and the first map read becomes the selection
+        typename TMaskImage::Pointer selection;
+        std::vector<char> selected;
+        std::istringstream terms(select.Get());
+        std::string term;
+        while (std::getline(terms, term, ',')) {
+            const size_t op = term.find_first_of("<>");
+            if (op == 0 || op == std::string::npos) {
+                QI_FAIL("Could not read re-fit term NAME>VALUE from: " << term);
+            }
+            const bool greater = term[op] == '>';
+            const bool equal = (op + 1 < term.size()) && term[op + 1] == '=';
+            const std::string name = term.substr(0, op);
+            double value;
+            std::istringstream vs(term.substr(op + (equal ? 2 : 1)));
+            if (!(vs >> value) || !(vs >> std::ws).eof()) {
+                QI_FAIL("Could not read the value of re-fit term: " << term);
+            }
+            typename TMaskImage::Pointer map = QI::ReadImage<TMaskImage>(from + name + QI::OutExt(), region);
+            const auto *px = map->GetBufferPointer();
+            const size_t n = map->GetPixelContainer()->Size();
+            if (selection && n != selected.size()) {
+                QI_FAIL("Re-fit map " << name << " is not the same size as the others");
+            }
+            selected.resize(n, 0);
+            for (size_t k = 0; k < n; k++) {
+                const double x = px[k];
+                selected[k] |= greater ? (equal ? x >= value : x > value) : (equal ? x <= value : x < value);
+            }
+            if (!selection) selection = map;
+        }
+        if (!selection) {
+            QI_FAIL("No terms in re-fit selection: " << select.Get());
+        }
+        auto *px = selection->GetBufferPointer();
+        for (size_t k = 0; k < selected.size(); k++) {
+            px[k] = selected[k];
+        }
+        apply->SetRefit(selection, residuals, its);
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_REFIT_H
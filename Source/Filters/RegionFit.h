@@ -0,0 +1,297 @@
+/*
+ *  RegionFit.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_REGIONFIT_H
+#define QI_REGIONFIT_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <cmath>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <type_traits>
+
+#include "itkImage.h"
+#include "itkDefaultConvertPixelTraits.h"
+#include "Macro.h"
+#include "Args.h"
+#include "ThreadPool.h"
+
+namespace QI {
+
+/*
+ * Fits the algorithm of an ApplyAlgorithmFilter once per label of a label image, to the mean (or
+ * median) signal of the voxels with that label, instead of once per voxel. Constants are combined
+ * the same way, and each label's fit is given the index of its first voxel. With bootstrap > 0 the
+ * voxels of each label are also resampled with replacement that many times and each resample is
+ * fitted, the standard deviation of those fits is the uncertainty. The resamples are seeded by the
+ * label so the table is reproducible. Label 0 and voxels outside the mask are skipped. Labels are
+ * fitted in parallel on the global pool, unless there are fewer than threads and the algorithm can
+ * split a fit over the pool itself.
+ */
+template<typename TFilter>
+class RegionFit {
+public:
+    typedef typename TFilter::Algorithm    TAlgorithm;
+    typedef typename TFilter::TInputImage  TInputImage;
+    typedef typename TFilter::TConstImage  TConstImage;
+    typedef typename TFilter::TInputValue  TInputValue;
+    typedef typename TFilter::TConstPixel  TConstValue;
+    typedef typename TFilter::TOutputValue TOutputValue;
+    typedef typename TAlgorithm::TInput    TInput;
+    typedef typename TAlgorithm::TOutput   TOutput;
+    typedef itk::Image<int, TInputImage::ImageDimension> TLabelImage;
+
+    struct Result {
+        int label = 0;
+        size_t voxels = 0;
+        bool success = false;
+        std::vector<double> values;    // Each component of each output, then of the residual
+        std::vector<double> deviation; // The same from the bootstrap, empty without one
+    };
+
+    RegionFit(TFilter *apply, const TLabelImage *labels, const bool median, const size_t bootstrap) :
+        m_algorithm(apply->GetAlgorithm()), m_labels(labels), m_median(median), m_bootstrap(bootstrap)
+    {
+        const auto region = labels->GetBufferedRegion();
+        const auto *mask = apply->GetMask().GetPointer();
+        for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+            const TInputImage *input = apply->GetInput(i).GetPointer();
+            if (input->GetBufferedRegion() != region) {
+                QI_EXCEPTION("Label image does not cover the same voxels as input " << i);
+            }
+            if (!input->GetBufferPointer()) {
+                QI_EXCEPTION("Input " << i << " is packed, regions can only be fitted from images");
+            }
+            m_inputs.push_back(input);
+        }
+        for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+            const TConstImage *c = apply->GetConst(i).GetPointer();
+            if (c && c->GetBufferedRegion() != region) {
+                QI_EXCEPTION("Label image does not cover the same voxels as constant " << i);
+            }
+            m_consts.push_back(c);
+        }
+        if (mask && mask->GetBufferedRegion() != region) {
+            QI_EXCEPTION("Label image does not cover the same voxels as the mask");
+        }
+        const int *l = labels->GetBufferPointer();
+        const auto *m = mask ? mask->GetBufferPointer() : nullptr;
+        for (size_t v = 0; v < region.GetNumberOfPixels(); v++) {
+            if (l[v] != 0 && (!m || m[v])) {
+                m_voxels[l[v]].push_back(v);
+            }
+        }
+    }
+
+    size_t labels() const { return m_voxels.size(); }
+
+    std::vector<Result> fit() const {
+        std::vector<std::pair<int, const std::vector<size_t> *>> labels;
+        for (const auto &kv : m_voxels) {
+            labels.push_back(std::make_pair(kv.first, &kv.second));
+        }
+        std::vector<Result> results(labels.size());
+        if (m_algorithm->parallelWithinVoxel() && labels.size() < ThreadPool::Global().size()) {
+            // As ApplyAlgorithmFilter, with few labels each fit is better off with the whole pool
+            for (size_t r = 0; r < labels.size(); r++) {
+                results[r] = fitLabel(labels[r].first, *labels[r].second);
+            }
+            return results;
+        }
+        std::exception_ptr error;
+        std::mutex errorMutex;
+        ThreadPool::Global().run(labels.size(), [&](const size_t r) {
+            try {
+                results[r] = fitLabel(labels[r].first, *labels[r].second);
+            } catch (...) {
+                std::unique_lock<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+            }
+        });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return results;
+    }
+
+    /* One row per label, the output names are suffixed with the component when outputs are vectors */
+    void write(std::ostream &os, const std::vector<Result> &results, const std::vector<std::string> &names) const {
+        std::vector<std::string> columns;
+        for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+            addColumns(columns, i < names.size() ? names[i] : "output" + std::to_string(i));
+        }
+        addColumns(columns, "residual");
+        os << "label,voxels";
+        for (const auto &c : columns) os << "," << c;
+        if (m_bootstrap) {
+            for (const auto &c : columns) os << "," << c << "_sd";
+        }
+        os << ",success\n";
+        for (const Result &r : results) {
+            os << r.label << "," << r.voxels;
+            for (const double v : r.values) os << "," << v;
+            for (const double d : r.deviation) os << "," << d;
+            os << "," << r.success << "\n";
+        }
+    }
+
+protected:
+    std::shared_ptr<const TAlgorithm> m_algorithm;
+    const TLabelImage *m_labels;
+    bool m_median;
+    size_t m_bootstrap;
+    std::vector<const TInputImage *> m_inputs;
+    std::vector<const TConstImage *> m_consts;
+    std::map<int, std::vector<size_t>> m_voxels; // Buffer offsets of each label
+
+    void addColumns(std::vector<std::string> &columns, const std::string &name) const {
+        const size_t size = m_algorithm->outputSize();
+        for (size_t k = 0; k < size; k++) {
+            columns.push_back(size > 1 ? name + "_" + std::to_string(k) : name);
+        }
+    }
+
+    double combine(std::vector<double> &values) const {
+        if (m_median) {
+            const auto mid = values.begin() + values.size() / 2;
+            std::nth_element(values.begin(), mid, values.end());
+            double median = *mid;
+            if (values.size() % 2 == 0) {
+                median = 0.5 * (median + *std::max_element(values.begin(), mid));
+            }
+            return median;
+        }
+        double sum = 0;
+        for (const double v : values) sum += v;
+        return sum / values.size();
+    }
+
+    /* Combined signals and constants of these voxels, fitted, with the outputs then the residual flattened */
+    bool fitVoxels(const std::vector<size_t> &voxels, std::vector<double> &values) const {
+        std::vector<double> gathered(voxels.size());
+        std::vector<TInput> inputs(m_inputs.size());
+        for (size_t i = 0; i < m_inputs.size(); i++) {
+            const size_t components = m_inputs[i]->GetNumberOfComponentsPerPixel();
+            const TInputValue *data = m_inputs[i]->GetBufferPointer();
+            inputs[i].SetSize(components);
+            for (size_t k = 0; k < components; k++) {
+                for (size_t v = 0; v < voxels.size(); v++) {
+                    gathered[v] = data[voxels[v] * components + k];
+                }
+                inputs[i][k] = static_cast<TInputValue>(combine(gathered));
+            }
+        }
+        const std::vector<TConstValue> defaults = m_algorithm->defaultConsts();
+        std::vector<TConstValue> consts(m_consts.size());
+        for (size_t i = 0; i < m_consts.size(); i++) {
+            if (m_consts[i]) {
+                const TConstValue *data = m_consts[i]->GetBufferPointer();
+                for (size_t v = 0; v < voxels.size(); v++) {
+                    gathered[v] = data[voxels[v]];
+                }
+                consts[i] = static_cast<TConstValue>(combine(gathered));
+            } else {
+                consts[i] = defaults[i];
+            }
+        }
+        std::vector<TOutput> outputs(m_algorithm->numOutputs(), m_algorithm->zero());
+        TOutput residual = m_algorithm->zero();
+        TInput resids;
+        resids.SetSize(0);
+        typename TAlgorithm::TIterations iterations{0};
+        const auto index = m_labels->ComputeIndex(voxels.front());
+        const bool success = m_algorithm->apply(inputs, consts, index, outputs, residual, resids, iterations);
+        values.clear();
+        for (const TOutput &o : outputs) {
+            for (size_t k = 0; k < m_algorithm->outputSize(); k++) {
+                values.push_back(itk::DefaultConvertPixelTraits<TOutput>::GetNthComponent(k, o));
+            }
+        }
+        for (size_t k = 0; k < m_algorithm->outputSize(); k++) {
+            values.push_back(itk::DefaultConvertPixelTraits<TOutput>::GetNthComponent(k, residual));
+        }
+        return success;
+    }
+
+    Result fitLabel(const int label, const std::vector<size_t> &voxels) const {
+        Result result;
+        result.label = label;
+        result.voxels = voxels.size();
+        result.success = fitVoxels(voxels, result.values);
+        if (m_bootstrap) {
+            std::mt19937 rng(static_cast<unsigned int>(label));
+            std::uniform_int_distribution<size_t> pick(0, voxels.size() - 1);
+            std::vector<size_t> sample(voxels.size());
+            std::vector<double> values, sum(result.values.size(), 0), sumSq(result.values.size(), 0);
+            for (size_t b = 0; b < m_bootstrap; b++) {
+                for (auto &s : sample) s = voxels[pick(rng)];
+                fitVoxels(sample, values);
+                for (size_t c = 0; c < values.size(); c++) {
+                    sum[c] += values[c];
+                    sumSq[c] += values[c] * values[c];
+                }
+            }
+            for (size_t c = 0; c < sum.size(); c++) {
+                const double mean = sum[c] / m_bootstrap;
+                result.deviation.push_back(m_bootstrap > 1 ? std::sqrt(std::max(0., (sumSq[c] - m_bootstrap * mean * mean) / (m_bootstrap - 1))) : 0.);
+            }
+        }
+        return result;
+    }
+};
+
+/*
+ * Options for programs built on ApplyAlgorithmFilter to fit regions instead of voxels. The table
+ * has a row per label, written to the output prefix with regions.csv.
+ */
+class RegionArgs {
+public:
+    args::ValueFlag<std::string> labels;
+    args::Flag median;
+    args::ValueFlag<int> bootstrap;
+
+    RegionArgs(args::Group &group) :
+        labels(group, "LABELS", "Fit the combined signal of each label in this image once, and write a table instead of maps", {"regions"}),
+        median(group, "MEDIAN", "Combine the voxels of each label with the median instead of the mean", {"region-median"}),
+        bootstrap(group, "N", "Resample the voxels of each label N times for the standard deviation of each region's fit", {"bootstrap"}, 0)
+    {}
+
+    bool requested() { return labels; }
+
+    template<typename TApply, typename TLabels>
+    void Fit(TApply &apply, const TLabels &labelImage, const std::vector<std::string> &names,
+             const std::string &prefix, const bool verbose) {
+        if (bootstrap.Get() < 0) {
+            QI_FAIL("--bootstrap must be at least 0");
+        }
+        typedef typename std::remove_reference<decltype(*apply)>::type TFilter;
+        const RegionFit<TFilter> regions(apply.GetPointer(), labelImage.GetPointer(), median, bootstrap.Get());
+        if (verbose) std::cout << "Fitting " << regions.labels() << " regions" << std::endl;
+        const auto results = regions.fit();
+        const std::string path = prefix + "regions.csv";
+        std::ofstream file(path);
+        if (!file) {
+            QI_FAIL("Could not open " << path << " for writing");
+        }
+        regions.write(file, results, names);
+        if (verbose) std::cout << "Wrote " << path << std::endl;
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_REGIONFIT_H
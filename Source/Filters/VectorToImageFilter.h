@@ -3,8 +3,6 @@
 
 #include "itkImageToImageFilter.h"
 #include "itkVectorImage.h"
-#include "itkVectorIndexSelectionCastImageFilter.h"
-#include "itkTileImageFilter.h"
 
 namespace itk {
 
@@ -26,19 +24,25 @@ public:
 	itkNewMacro(Self);
 	itkTypeMacro(Self, Superclass);
 
-    void SetInput(const TInput *img) ITK_OVERRIDE;
-    
-protected:
-	typedef itk::VectorIndexSelectionCastImageFilter<TInput, TVolume> TIndexer;
-	typedef itk::TileImageFilter<TVolume, TOutput> TTiler;
-	typename TTiler::Pointer m_tiler;
-	std::vector<typename TIndexer::Pointer> m_indexers;
+    /*
+     * Copies components [first, first + count) of the interleaved buffer of voxels pixels into
+     * count consecutive volumes. Works in tiles of voxels and components that fit in cache, so
+     * neither side is read or written with a long stride, split over the global pool unless
+     * called from one of its tasks.
+     */
+    static void Transpose(const TPixel *in, const size_t voxels, const size_t components,
+                          const size_t first, const size_t count, TPixel *out);
 
-	VectorToImageFilter();
+protected:
+	VectorToImageFilter() {}
 	~VectorToImageFilter(){}
 
     void GenerateOutputInformation() ITK_OVERRIDE; // Because output will be different dimension to input
-    void GenerateData() ITK_OVERRIDE; // Don't need a GenerateData, just call m_tiler->Update()
+    void GenerateInputRequestedRegion() ITK_OVERRIDE;
+    void EnlargeOutputRequestedRegion(DataObject *output) ITK_OVERRIDE; // Whole image only
+    void GenerateData() ITK_OVERRIDE;
+
+    static const size_t TileVoxels = 256, TileComponents = 16;
 
 private:
 	VectorToImageFilter(const Self &); //purposely not implemented
@@ -1,35 +1,12 @@
 #ifndef VECTORTOIMAGEFILTER_HXX
 #define VECTORTOIMAGEFILTER_HXX
 
-namespace itk {
+#include <algorithm>
 
-template<typename TInput>
-VectorToImageFilter<TInput>::VectorToImageFilter() {
-	m_tiler = TTiler::New();
-}
+#include "Trace.h"
+#include "ThreadPool.h"
 
-template<typename TInput>
-void VectorToImageFilter<TInput>::SetInput(const TInput *img) {
-    Superclass::SetInput(img);
-    
-    auto in  = this->GetInput();
-    if (!in) {
-        return;
-    }
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = in->GetNumberOfComponentsPerPixel();
-    m_tiler->SetLayout(layout);
-    m_indexers.resize(in->GetNumberOfComponentsPerPixel());
-    for (size_t i =0; i < in->GetNumberOfComponentsPerPixel(); i++) {
-        m_indexers[i] = TIndexer::New();
-        m_indexers[i]->SetIndex(i);
-        m_indexers[i]->SetInput(in);
-        m_tiler->SetInput(i, m_indexers[i]->GetOutput());
-    }
-    m_tiler->UpdateLargestPossibleRegion();
-    this->GraftOutput(m_tiler->GetOutput());
-}
+namespace itk {
 
 template<typename TInput>
 void VectorToImageFilter<TInput>::GenerateOutputInformation() {
@@ -71,19 +48,54 @@ void VectorToImageFilter<TInput>::GenerateOutputInformation() {
     out->SetLargestPossibleRegion(outRegion);
 }
 
+template<typename TInput>
+void VectorToImageFilter<TInput>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    TInput *input = const_cast<TInput *>(this->GetInput());
+    if (input) {
+        input->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+template<typename TInput>
+void VectorToImageFilter<TInput>::EnlargeOutputRequestedRegion(DataObject *output) {
+    Superclass::EnlargeOutputRequestedRegion(output);
+    output->SetRequestedRegionToLargestPossibleRegion();
+}
+
+template<typename TInput>
+void VectorToImageFilter<TInput>::Transpose(const TPixel *in, const size_t voxels, const size_t components,
+                                            const size_t first, const size_t count, TPixel *out) {
+    auto task = [&](const size_t v0, const size_t v1) {
+        for (size_t tv = v0; tv < v1; tv += TileVoxels) {
+            const size_t tvEnd = std::min(tv + TileVoxels, v1);
+            for (size_t tc = 0; tc < count; tc += TileComponents) {
+                const size_t tcEnd = std::min(tc + TileComponents, count);
+                for (size_t c = tc; c < tcEnd; c++) {
+                    const TPixel *src = in + first + c;
+                    TPixel *dst = out + c * voxels;
+                    for (size_t v = tv; v < tvEnd; v++) {
+                        dst[v] = src[v * components];
+                    }
+                }
+            }
+        }
+    };
+    if (QI::ThreadPool::InWorker()) {
+        task(0, voxels);
+    } else {
+        QI::ThreadPool::Global().parallelFor(0, voxels, TileVoxels * 64, task);
+    }
+}
+
 template<typename TInput>
 void VectorToImageFilter<TInput>::GenerateData() {
-    typename TInput::Pointer input = TInput::New();
-    input->Graft(const_cast<TInput *>(this->GetInput()));
-    auto spacing = this->GetOutput()->GetSpacing();
-    auto direction = this->GetOutput()->GetDirection();
-    auto origin = this->GetOutput()->GetOrigin();
-    m_tiler->UpdateLargestPossibleRegion();
-    this->GraftOutput(m_tiler->GetOutput());
-    // Reset space information because tiler messes it up
-    this->GetOutput()->SetSpacing(spacing);
-    this->GetOutput()->SetDirection(direction);
-    this->GetOutput()->SetOrigin(origin);
+    const QI::TraceSpan span("convert", "VectorToImage");
+    const TInput *input = this->GetInput();
+    this->AllocateOutputs();
+    const size_t components = input->GetNumberOfComponentsPerPixel();
+    Transpose(input->GetBufferPointer(), input->GetBufferedRegion().GetNumberOfPixels(),
+              components, 0, components, this->GetOutput()->GetBufferPointer());
 }
 
 } // End namespace itk
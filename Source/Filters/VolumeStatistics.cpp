@@ -0,0 +1,206 @@
+/*
+ *  VolumeStatistics.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "VolumeStatistics.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+VolumeStatistics::VolumeStatistics(const bool minmax, const std::vector<double> &percentiles) :
+    m_minmax(minmax)
+{
+    for (const double p : percentiles) {
+        if (p < 0 || p > 100) {
+            QI_EXCEPTION("Percentile " << p << " is not between 0 and 100");
+        }
+        m_percentiles.push_back(p / 100.);
+    }
+}
+
+size_t VolumeStatistics::volumes() const { return m_volumes; }
+
+void VolumeStatistics::add(const QI::VolumeF *vol) {
+    if (vol->GetBufferedRegion() != vol->GetLargestPossibleRegion()) {
+        QI_EXCEPTION("Statistics need whole volumes");
+    }
+    if (!m_geometry) {
+        m_geometry = QI::VolumeF::New();
+        m_geometry->CopyInformation(vol);
+        m_voxels = vol->GetLargestPossibleRegion().GetNumberOfPixels();
+        m_count.assign(m_voxels, 0);
+        m_mean.assign(m_voxels, 0.);
+        m_m2.assign(m_voxels, 0.);
+        if (m_minmax) {
+            m_min.assign(m_voxels, std::numeric_limits<float>::infinity());
+            m_max.assign(m_voxels, -std::numeric_limits<float>::infinity());
+        }
+        m_heights.assign(m_voxels * m_percentiles.size() * 5, 0.f);
+        m_positions.assign(m_voxels * m_percentiles.size() * 5, 0);
+    } else if (vol->GetLargestPossibleRegion().GetSize() != m_geometry->GetLargestPossibleRegion().GetSize()) {
+        QI_EXCEPTION("Volume " << (m_volumes + 1) << " is not the same size as the first");
+    }
+    const float *in = vol->GetBufferPointer();
+    auto task = [&](const size_t first, const size_t last) {
+        for (size_t v = first; v < last; v++) {
+            if (std::isfinite(in[v])) {
+                addVoxel(v, in[v]);
+            }
+        }
+    };
+    if (ThreadPool::InWorker()) {
+        task(0, m_voxels);
+    } else {
+        ThreadPool::Global().parallelFor(0, m_voxels, Grain, task);
+    }
+    m_volumes++;
+}
+
+void VolumeStatistics::addVoxel(const size_t v, const float x) {
+    const uint32_t c = m_count[v]++; // Values before this one
+    const double delta = x - m_mean[v];
+    m_mean[v] += delta / (c + 1);
+    m_m2[v] += delta * (x - m_mean[v]);
+    if (m_minmax) {
+        m_min[v] = std::min(m_min[v], x);
+        m_max[v] = std::max(m_max[v], x);
+    }
+    for (size_t p = 0; p < m_percentiles.size(); p++) {
+        float *q = &m_heights[(v * m_percentiles.size() + p) * 5];
+        uint32_t *n = &m_positions[(v * m_percentiles.size() + p) * 5];
+        if (c < 5) {
+            // The first five values are kept sorted, and become the markers
+            size_t i = c;
+            while (i > 0 && q[i - 1] > x) {
+                q[i] = q[i - 1];
+                i--;
+            }
+            q[i] = x;
+            for (size_t j = 0; j <= c; j++) n[j] = j + 1;
+            continue;
+        }
+        size_t k;
+        if (x < q[0]) {
+            q[0] = x;
+            k = 0;
+        } else if (x >= q[4]) {
+            q[4] = x;
+            k = 3;
+        } else {
+            k = 0;
+            while (x >= q[k + 1]) k++;
+        }
+        for (size_t i = k + 1; i < 5; i++) n[i]++;
+        const double f = m_percentiles[p];
+        const double d[5] = {0, f / 2, f, (1 + f) / 2, 1};
+        for (size_t i = 1; i < 4; i++) {
+            const double desired = 1 + c * d[i]; // 1 + (values - 1) * d
+            const double off = desired - n[i];
+            const long below = static_cast<long>(n[i - 1]) - n[i], above = static_cast<long>(n[i + 1]) - n[i];
+            if ((off >= 1 && above > 1) || (off <= -1 && below < -1)) {
+                const int s = off > 0 ? 1 : -1;
+                const double qm = q[i - 1], qi = q[i], qp = q[i + 1];
+                const double nm = n[i - 1], ni = n[i], np = n[i + 1];
+                const double parabolic = qi + s / (np - nm) * ((ni - nm + s) * (qp - qi) / (np - ni) +
+                                                               (np - ni - s) * (qi - qm) / (ni - nm));
+                if (qm < parabolic && parabolic < qp) {
+                    q[i] = parabolic;
+                } else {
+                    q[i] = qi + s * (q[i + s] - qi) / (static_cast<double>(n[i + s]) - ni);
+                }
+                n[i] += s;
+            }
+        }
+    }
+}
+
+QI::VolumeF::Pointer VolumeStatistics::newVolume() const {
+    if (!m_geometry) {
+        QI_EXCEPTION("No volumes were added to the statistics");
+    }
+    QI::VolumeF::Pointer out = QI::VolumeF::New();
+    out->CopyInformation(m_geometry);
+    out->SetRegions(m_geometry->GetLargestPossibleRegion());
+    out->Allocate();
+    return out;
+}
+
+QI::VolumeF::Pointer VolumeStatistics::mean() const {
+    QI::VolumeF::Pointer out = newVolume();
+    float *px = out->GetBufferPointer();
+    for (size_t v = 0; v < m_voxels; v++) {
+        px[v] = m_mean[v];
+    }
+    return out;
+}
+
+QI::VolumeF::Pointer VolumeStatistics::sd() const {
+    QI::VolumeF::Pointer out = newVolume();
+    float *px = out->GetBufferPointer();
+    for (size_t v = 0; v < m_voxels; v++) {
+        px[v] = (m_count[v] > 1) ? std::sqrt(m_m2[v] / (m_count[v] - 1)) : 0.f;
+    }
+    return out;
+}
+
+QI::VolumeF::Pointer VolumeStatistics::min() const {
+    if (!m_minmax) {
+        QI_EXCEPTION("Minimum was not asked for");
+    }
+    QI::VolumeF::Pointer out = newVolume();
+    float *px = out->GetBufferPointer();
+    for (size_t v = 0; v < m_voxels; v++) {
+        px[v] = m_count[v] ? m_min[v] : 0.f;
+    }
+    return out;
+}
+
+QI::VolumeF::Pointer VolumeStatistics::max() const {
+    if (!m_minmax) {
+        QI_EXCEPTION("Maximum was not asked for");
+    }
+    QI::VolumeF::Pointer out = newVolume();
+    float *px = out->GetBufferPointer();
+    for (size_t v = 0; v < m_voxels; v++) {
+        px[v] = m_count[v] ? m_max[v] : 0.f;
+    }
+    return out;
+}
+
+QI::VolumeF::Pointer VolumeStatistics::percentile(const size_t p) const {
+    if (p >= m_percentiles.size()) {
+        QI_EXCEPTION("Percentile " << p << " was not asked for");
+    }
+    QI::VolumeF::Pointer out = newVolume();
+    float *px = out->GetBufferPointer();
+    for (size_t v = 0; v < m_voxels; v++) {
+        const float *q = &m_heights[(v * m_percentiles.size() + p) * 5];
+        const uint32_t c = m_count[v];
+        if (c == 0) {
+            px[v] = 0.f;
+        } else if (c < 5) {
+            // Interpolate between the sorted values, as the estimator has not started
+            const double pos = m_percentiles[p] * (c - 1);
+            const size_t i = std::min<size_t>(static_cast<size_t>(pos), c - 1);
+            const size_t j = std::min<size_t>(i + 1, c - 1);
+            px[v] = q[i] + (pos - i) * (q[j] - q[i]);
+        } else {
+            px[v] = q[2];
+        }
+    }
+    return out;
+}
+
+} // End namespace QI
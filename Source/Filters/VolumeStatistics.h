@@ -0,0 +1,62 @@
+/*
+ *  VolumeStatistics.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_VOLUMESTATISTICS_H
+#define QI_VOLUMESTATISTICS_H
+
+#include <vector>
+#include <cstdint>
+
+#include "ImageTypes.h"
+
+namespace QI {
+
+/*
+ * Voxelwise statistics over a set of volumes that are added one at a time, so memory does not
+ * grow with the number of volumes (unlike itk::MeanImageFilter, which needs them all as inputs).
+ * The mean and variance are updated with Welford's method, the minimum and maximum if asked for,
+ * and each percentile with the P-squared estimator (Jain & Chlamtac 1985), which keeps five
+ * markers per voxel and is exact up to five volumes. Values that are not finite are skipped, so
+ * voxels can have different counts. Each volume is added over the global pool.
+ */
+class VolumeStatistics {
+public:
+    VolumeStatistics(const bool minmax = false, const std::vector<double> &percentiles = std::vector<double>());
+
+    void add(const QI::VolumeF *vol); // The first volume fixes the size and geometry
+    size_t volumes() const;
+
+    QI::VolumeF::Pointer mean() const;
+    QI::VolumeF::Pointer sd() const;  // Sample standard deviation, 0 for voxels with less than two values
+    QI::VolumeF::Pointer min() const;
+    QI::VolumeF::Pointer max() const;
+    QI::VolumeF::Pointer percentile(const size_t p) const; // In the order given to the constructor
+
+protected:
+    QI::VolumeF::Pointer newVolume() const;
+    void addVoxel(const size_t v, const float x);
+
+    bool m_minmax;
+    std::vector<double> m_percentiles; // As fractions
+    size_t m_volumes = 0, m_voxels = 0;
+    QI::VolumeF::Pointer m_geometry; // Information of the first volume, no buffer
+    std::vector<uint32_t> m_count;
+    std::vector<double> m_mean, m_m2;
+    std::vector<float> m_min, m_max;
+    std::vector<float> m_heights;      // 5 markers per percentile per voxel
+    std::vector<uint32_t> m_positions;
+
+    static const size_t Grain = 16384; // Voxels per task
+};
+
+} // End namespace QI
+
+#endif // QI_VOLUMESTATISTICS_H
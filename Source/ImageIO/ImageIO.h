@@ -12,21 +12,43 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
+#include <vector>
 #include "ImageTypes.h"
+#include "itkImageIOBase.h"
 
 namespace QI {
 
+/*
+ * Residual and debugging images rarely need full precision. Int16 stores real images as 16-bit
+ * integers spanning the image's range, with the slope & intercept in the NIfTI header so any
+ * reader (including ITK) gets the rounded values back as floats. NIfTI only has one slope for the
+ * whole file, not one per volume. Complex and integer images, and other formats, are written as is.
+ */
+enum class Storage { Native, Int16 };
+const Storage &AuxiliaryStorage(); //!< Storage for residual and debug outputs, from $QUIT_AUX_STORAGE (FLOAT or INT16)
+
+extern auto ReadImageHeader(const std::string &path) -> itk::ImageIOBase::Pointer; // Does not read any voxels
+
 template<typename TImg = QI::VolumeF>
 extern auto ReadImage(const std::string &path) -> typename TImg::Pointer;
 
+/*
+ * Only reads the voxels inside region, e.g. for --subregion or --voxel. Formats that can stream
+ * (e.g. uncompressed NIfTI) then only read those bytes, others are read whole and cropped. The
+ * image keeps the full extent as its largest possible region, but only region is buffered. An
+ * empty region reads the whole image, as do images kept in memory.
+ */
+template<typename TImg = QI::VolumeF>
+extern auto ReadImage(const std::string &path, const typename TImg::RegionType &region) -> typename TImg::Pointer;
+
 template<typename TImg = QI::VolumeF>
 extern auto ReadMagnitudeImage(const std::string &path) -> typename TImg::Pointer;
 
 template<typename TImg>
-extern void WriteImage(const TImg *ptr, const std::string &path);
+extern void WriteImage(const TImg *ptr, const std::string &path, const Storage storage = Storage::Native);
 
 template<typename TImg>
-extern void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path);
+extern void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path, const Storage storage = Storage::Native);
 
 template<typename TImg>
 extern void WriteMagnitudeImage(const TImg *ptr, const std::string &path);
@@ -43,11 +65,25 @@ extern void WriteScaledImage(const itk::SmartPointer<TImg> &ptr, const itk::Smar
 template<typename TPixel = float>
 extern auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer;
 
+template<typename TPixel = float>
+extern auto ReadVectorImage(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<TPixel, 3>::Pointer;
+
+/*
+ * Scanner data is usually stored as 16-bit integers with a NIfTI scl_slope & scl_inter, and as
+ * floats takes twice the memory. For an int16 or uint16 NIfTI-1 file this reads the integers as
+ * they are stored, interleaved per voxel as ReadVectorImage does, and sets slope and inter so the
+ * values are slope * stored + inter (uint16 is shifted to fit, with the shift moved into inter).
+ * Returns null for any other file, which should then be read with ReadVectorImage. An empty region
+ * reads the whole image.
+ */
+extern auto ReadInt16VectorImage(const std::string &path, const QI::VolumeF::RegionType &region,
+                                 double &slope, double &inter) -> QI::VectorVolumeS::Pointer;
+
 template<typename TVImg>
-extern void WriteVectorImage(const TVImg *img, const std::string &path);
+extern void WriteVectorImage(const TVImg *img, const std::string &path, const Storage storage = Storage::Native);
 
 template<typename TVImg>
-extern void WriteVectorImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path);
+extern void WriteVectorImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path, const Storage storage = Storage::Native);
 
 template<typename TVImg>
 extern void WriteVectorMagnitudeImage(const TVImg *img, const std::string &path);
@@ -56,10 +92,34 @@ template<typename TVImg>
 extern void WriteVectorMagnitudeImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path);
 
 template<typename TVImg>
-extern void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path);
+extern void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path, const Storage storage = Storage::Native);
 
 template<typename TVImg>
-extern void WriteScaledVectorImage(const itk::SmartPointer<TVImg> &ptr, const itk::SmartPointer<QI::VolumeF> &sptr, const std::string &path);
+extern void WriteScaledVectorImage(const itk::SmartPointer<TVImg> &ptr, const itk::SmartPointer<QI::VolumeF> &sptr, const std::string &path, const Storage storage = Storage::Native);
+
+/*
+ * Replaces the sform, qform and voxel sizes of an existing, uncompressed, native-endian NIfTI-1
+ * file in place, without touching the voxels. The geometry is in ITK's (LPS) convention. Returns
+ * false, leaving the file unchanged, for any other kind of file.
+ */
+extern bool RewriteNiftiGeometry(const std::string &path, const QI::VolumeF::DirectionType &direction,
+                                 const QI::VolumeF::SpacingType &spacing, const QI::VolumeF::PointType &origin);
+
+/*
+ * Many volumes of the same size in one 4D file, e.g. every output of a fit, so they are written
+ * and read in one go. The volume names are kept in a JSON sidecar with the image extension
+ * replaced by .json.
+ */
+extern void WriteStack(const std::vector<QI::VolumeF::Pointer> &vols, const std::vector<std::string> &names, const std::string &path);
+extern auto ReadStack(const std::string &path, std::vector<std::string> &names) -> QI::SeriesF::Pointer;
+extern auto ReadStackVolume(const std::string &path, const std::string &name) -> QI::VolumeF::Pointer;
+
+/*
+ * One volume per component of an image whose values for each voxel are next to each other, e.g.
+ * the interleaved maps of a fit. The copy goes in blocks of voxels, so each block is read from
+ * memory once and written to every volume.
+ */
+extern auto SplitInterleaved(const QI::VectorVolumeF *img) -> std::vector<QI::VolumeF::Pointer>;
 
 } // End namespace QUIT
 
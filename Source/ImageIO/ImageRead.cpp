@@ -12,19 +12,189 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define QI_HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "itkImageFileReader.h"
+#include "itkImageIOFactory.h"
+#include "itkNiftiImageIO.h"
+#include "itkImportImageContainer.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "MemoryStore.h"
+#include "ResultCache.h"
 #include "Macro.h"
+#include "Trace.h"
 
 namespace QI {
 
+namespace {
+
+// NIfTI-1 datatype codes for the pixel types that can be mapped without conversion
+template<typename T> struct NiftiType { static const short code = 0; };
+template<> struct NiftiType<unsigned char> { static const short code = 2; };
+template<> struct NiftiType<int> { static const short code = 8; };
+template<> struct NiftiType<float> { static const short code = 16; };
+template<> struct NiftiType<double> { static const short code = 64; };
+template<> struct NiftiType<std::complex<float>> { static const short code = 32; };
+template<> struct NiftiType<std::complex<double>> { static const short code = 1792; };
+
+#ifdef QI_HAVE_MMAP
+/*
+ * Pixel container over a privately mapped file. Pages are shared with the page cache (and so with
+ * other processes reading the same file) until written to, when they are copied.
+ */
+template<typename TElement>
+class MappedContainer : public itk::ImportImageContainer<itk::SizeValueType, TElement> {
+public:
+    typedef MappedContainer Self;
+    typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+    typedef itk::SmartPointer<Self> Pointer;
+    itkNewMacro(Self);
+    itkTypeMacro(MappedContainer, ImportImageContainer);
+
+    void Map(void *base, const size_t length, TElement *data, const size_t n) {
+        m_base = base;
+        m_length = length;
+        this->SetImportPointer(data, n, false);
+    }
+
+protected:
+    MappedContainer() {}
+    ~MappedContainer() {
+        if (m_base) munmap(m_base, m_length);
+    }
+
+    void *m_base = nullptr;
+    size_t m_length = 0;
+
+private:
+    MappedContainer(const Self &);
+    void operator=(const Self &);
+};
+#endif
+
+/*
+ * Map an uncompressed, native-endian NIfTI-1 file whose data needs no type conversion or scaling
+ * straight into the image. Returns nullptr if the file does not qualify, so it can be read normally.
+ */
+template<typename TImg>
+auto MapImage(const std::string &path, const TImg *info) -> typename TImg::Pointer {
+#ifdef QI_HAVE_MMAP
+    typedef typename TImg::PixelType TPixel;
+    if (NiftiType<TPixel>::code == 0 || path.size() < 4 || path.compare(path.size() - 4, 4, ".nii") != 0) {
+        return nullptr;
+    }
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    unsigned char header[348];
+    if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+        close(fd);
+        return nullptr;
+    }
+    int32_t sizeof_hdr;
+    int16_t dim[8], datatype;
+    float vox_offset, scl_slope, scl_inter;
+    std::memcpy(&sizeof_hdr, header, 4);
+    std::memcpy(dim, header + 40, 16);
+    std::memcpy(&datatype, header + 70, 2);
+    std::memcpy(&vox_offset, header + 108, 4);
+    std::memcpy(&scl_slope, header + 112, 4);
+    std::memcpy(&scl_inter, header + 116, 4);
+    size_t voxels = 1;
+    for (int d = 1; d <= dim[0] && d < 8; d++) {
+        voxels *= std::max<int16_t>(dim[d], 1);
+    }
+    const size_t offset = static_cast<size_t>(vox_offset);
+    const bool scaled = (scl_slope != 0 && scl_slope != 1) || (scl_slope != 0 && scl_inter != 0);
+    if (sizeof_hdr != 348 || std::memcmp(header + 344, "n+1", 4) != 0 || dim[0] < 1 || dim[0] > 4 || datatype != NiftiType<TPixel>::code || scaled ||
+        voxels != info->GetLargestPossibleRegion().GetNumberOfPixels() || (offset % alignof(TPixel)) != 0 ||
+        static_cast<size_t>(st.st_size) < offset + voxels * sizeof(TPixel)) {
+        close(fd);
+        return nullptr;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    auto container = MappedContainer<TPixel>::New();
+    container->Map(base, st.st_size, reinterpret_cast<TPixel *>(static_cast<char *>(base) + offset), voxels);
+    typename TImg::Pointer img = TImg::New();
+    img->CopyInformation(info);
+    img->SetRegions(info->GetLargestPossibleRegion());
+    img->SetPixelContainer(container);
+    return img;
+#else
+    return nullptr;
+#endif
+}
+
+} // End anonymous namespace
+
+/*
+ * NIfTI files are by far the most common, so they skip the factory, which otherwise asks every
+ * registered ImageIO in turn whether it can read the file (each opening it to check).
+ */
+auto ReadImageHeader(const std::string &path) -> itk::ImageIOBase::Pointer {
+    CacheInput(path);
+    itk::ImageIOBase::Pointer io;
+    const size_t slash = path.find_last_of('/');
+    const std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    const size_t dot = name.find('.');
+    const std::string ext = (dot == std::string::npos) ? "" : name.substr(dot);
+    if (ext == ".nii" || ext == ".nii.gz" || ext == ".hdr" || ext == ".img" || ext == ".img.gz") {
+        itk::NiftiImageIO::Pointer nifti = itk::NiftiImageIO::New();
+        if (nifti->CanReadFile(path.c_str())) {
+            io = nifti;
+        }
+    }
+    if (!io) {
+        io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::ReadMode);
+    }
+    if (!io) {
+        QI_EXCEPTION("Could not open: " << path);
+    }
+    io->SetFileName(path);
+    io->ReadImageInformation();
+    return io;
+}
+
+/*
+ * Uncompressed NIfTI files are memory-mapped (copy-on-write) where possible, so start-up does
+ * not copy the data and jobs reading the same file share its pages. Gzipped files written with
+ * QUIT_GZIP_THREADS set are first inflated in parallel to a temporary file, which is then mapped.
+ * Everything else goes through ITK.
+ */
 template<typename TImg>
 auto ReadImage(const std::string &path) -> typename TImg::Pointer {
+    const TraceSpan span("io", "read", path);
+    if (IsMemoryPath(path)) {
+        return CopyMemoryImage<TImg>(path);
+    }
     typedef itk::ImageFileReader<TImg> TReader;
+    const GzipInput input(path);
     typename TReader::Pointer file = TReader::New();
-    file->SetFileName(path);
+    file->SetFileName(input.path());
+    file->UpdateOutputInformation();
+    if (std::string(file->GetImageIO()->GetNameOfClass()) == "NiftiImageIO") {
+        typename TImg::Pointer mapped = MapImage<TImg>(input.path(), file->GetOutput());
+        if (mapped) {
+            return mapped;
+        }
+    }
     file->Update();
     typename TImg::Pointer img = file->GetOutput();
     if (!img) {
@@ -34,6 +204,30 @@ auto ReadImage(const std::string &path) -> typename TImg::Pointer {
     return img;
 }
 
+template<typename TImg>
+auto ReadImage(const std::string &path, const typename TImg::RegionType &region) -> typename TImg::Pointer {
+    if (region.GetNumberOfPixels() == 0 || IsMemoryPath(path)) {
+        return ReadImage<TImg>(path);
+    }
+    const TraceSpan span("io", "read region", path);
+    typedef itk::ImageFileReader<TImg> TReader;
+    const GzipInput input(path);
+    typename TReader::Pointer file = TReader::New();
+    file->SetFileName(input.path());
+    file->UpdateOutputInformation();
+    typename TImg::Pointer img = file->GetOutput();
+    if (!img->GetLargestPossibleRegion().IsInside(region)) {
+        QI_EXCEPTION("Region " << region.GetIndex() << " " << region.GetSize() << " is not inside file: " << path);
+    }
+    img->SetRequestedRegion(region);
+    file->Update();
+    if (!img->GetBufferedRegion().IsInside(region)) {
+        QI_EXCEPTION("Failed to read region " << region.GetIndex() << " " << region.GetSize() << " of file: " << path);
+    }
+    img->DisconnectPipeline();
+    return img;
+}
+
 template<typename TImg>
 auto ReadMagnitudeImage(const std::string &path) -> typename TImg::Pointer {
     typedef itk::Image<std::complex<typename TImg::PixelType>, TImg::ImageDimension> TComplex;
@@ -56,6 +250,12 @@ template auto ReadImage<SeriesF>(const std::string &path) -> typename SeriesF::P
 template auto ReadImage<SeriesD>(const std::string &path) -> typename SeriesD::Pointer;
 template auto ReadImage<SeriesXF>(const std::string &path) -> typename SeriesXF::Pointer;
 template auto ReadImage<SeriesXD>(const std::string &path) -> typename SeriesXD::Pointer;
+template auto ReadImage<VolumeF>(const std::string &path, const VolumeF::RegionType &region) -> typename VolumeF::Pointer;
+template auto ReadImage<VolumeD>(const std::string &path, const VolumeD::RegionType &region) -> typename VolumeD::Pointer;
+template auto ReadImage<VolumeXF>(const std::string &path, const VolumeXF::RegionType &region) -> typename VolumeXF::Pointer;
+template auto ReadImage<VolumeXD>(const std::string &path, const VolumeXD::RegionType &region) -> typename VolumeXD::Pointer;
+template auto ReadImage<VolumeI>(const std::string &path, const VolumeI::RegionType &region) -> typename VolumeI::Pointer;
+template auto ReadImage<VolumeUC>(const std::string &path, const VolumeUC::RegionType &region) -> typename VolumeUC::Pointer;
 template auto ReadMagnitudeImage<VolumeF>(const std::string &path) -> typename VolumeF::Pointer;
 template auto ReadMagnitudeImage<SeriesF>(const std::string &path) -> typename SeriesF::Pointer;
 
@@ -0,0 +1,189 @@
+/*
+ *  ImageStack.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include "ImageIO.h"
+#include "MemoryStore.h"
+#include "Macro.h"
+#include "ResultCache.h"
+#include "ThreadPool.h"
+
+namespace QI {
+
+namespace {
+
+/*
+ * The names sit next to the image with its extension (e.g. .nii.gz) replaced by .json
+ */
+std::string NamesPath(const std::string &path) {
+    const size_t slash = path.find_last_of('/');
+    const size_t dot = path.find('.', slash == std::string::npos ? 0 : slash + 1);
+    return path.substr(0, dot) + ".json";
+}
+
+VolumeF::Pointer ExtractVolume(const SeriesF *stack, const size_t v) {
+    const SeriesF::RegionType region = stack->GetBufferedRegion();
+    VolumeF::RegionType volRegion;
+    VolumeF::SpacingType spacing;
+    VolumeF::PointType origin;
+    VolumeF::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        volRegion.SetIndex(i, region.GetIndex()[i]);
+        volRegion.SetSize(i, region.GetSize()[i]);
+        spacing[i] = stack->GetSpacing()[i];
+        origin[i] = stack->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction(i, j) = stack->GetDirection()(i, j);
+        }
+    }
+    VolumeF::Pointer vol = VolumeF::New();
+    vol->SetRegions(volRegion);
+    vol->SetSpacing(spacing);
+    vol->SetOrigin(origin);
+    vol->SetDirection(direction);
+    vol->Allocate();
+    const size_t nVox = volRegion.GetNumberOfPixels();
+    const float *start = stack->GetBufferPointer() + v * nVox;
+    std::copy(start, start + nVox, vol->GetBufferPointer());
+    return vol;
+}
+
+const size_t SplitBlock = 4096; // Voxels per block in SplitInterleaved, sized to stay in cache
+
+} // End anonymous namespace
+
+void WriteStack(const std::vector<VolumeF::Pointer> &vols, const std::vector<std::string> &names, const std::string &path) {
+    if (vols.empty() || vols.size() != names.size()) {
+        QI_EXCEPTION("Need one name for each of the " << vols.size() << " volumes in stack " << path);
+    }
+    const VolumeF *first = vols.front();
+    const VolumeF::RegionType volRegion = first->GetBufferedRegion();
+    for (const auto &v : vols) {
+        if (v->GetBufferedRegion() != volRegion) {
+            QI_EXCEPTION("All volumes in stack " << path << " must be the same size");
+        }
+    }
+    SeriesF::RegionType region;
+    SeriesF::SpacingType spacing;
+    SeriesF::PointType origin;
+    SeriesF::DirectionType direction;
+    direction.SetIdentity();
+    for (int i = 0; i < 3; i++) {
+        region.SetIndex(i, volRegion.GetIndex()[i]);
+        region.SetSize(i, volRegion.GetSize()[i]);
+        spacing[i] = first->GetSpacing()[i];
+        origin[i] = first->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction(i, j) = first->GetDirection()(i, j);
+        }
+    }
+    region.SetIndex(3, 0);
+    region.SetSize(3, vols.size());
+    spacing[3] = 1;
+    origin[3] = 0;
+    SeriesF::Pointer stack = SeriesF::New();
+    stack->SetRegions(region);
+    stack->SetSpacing(spacing);
+    stack->SetOrigin(origin);
+    stack->SetDirection(direction);
+    stack->Allocate();
+    const size_t nVox = volRegion.GetNumberOfPixels();
+    for (size_t v = 0; v < vols.size(); v++) {
+        std::copy(vols[v]->GetBufferPointer(), vols[v]->GetBufferPointer() + nVox, stack->GetBufferPointer() + v * nVox);
+    }
+    WriteImage(stack.GetPointer(), path);
+    if (IsMemoryPath(path)) {
+        std::ostringstream text;
+        {
+            cereal::JSONOutputArchive archive(text);
+            archive(cereal::make_nvp("volumes", names));
+        }
+        SetMemoryText(NamesPath(path), text.str());
+        return;
+    }
+    CacheOutput(NamesPath(path));
+    std::ofstream file(NamesPath(path));
+    {
+        cereal::JSONOutputArchive archive(file);
+        archive(cereal::make_nvp("volumes", names));
+    }
+    if (!file) {
+        QI_EXCEPTION("Failed to write volume names for stack " << path);
+    }
+}
+
+auto ReadStack(const std::string &path, std::vector<std::string> &names) -> SeriesF::Pointer {
+    SeriesF::Pointer stack = ReadImage<SeriesF>(path);
+    if (IsMemoryPath(path)) {
+        std::istringstream text(GetMemoryText(NamesPath(path)));
+        cereal::JSONInputArchive archive(text);
+        archive(cereal::make_nvp("volumes", names));
+    } else {
+        CacheInput(NamesPath(path));
+        std::ifstream file(NamesPath(path));
+        if (!file) {
+            QI_EXCEPTION("Could not open volume names for stack " << path << " from " << NamesPath(path));
+        }
+        cereal::JSONInputArchive archive(file);
+        archive(cereal::make_nvp("volumes", names));
+    }
+    if (names.size() != stack->GetLargestPossibleRegion().GetSize()[3]) {
+        QI_EXCEPTION("Stack " << path << " has " << stack->GetLargestPossibleRegion().GetSize()[3] << " volumes but " << names.size() << " names");
+    }
+    return stack;
+}
+
+auto ReadStackVolume(const std::string &path, const std::string &name) -> VolumeF::Pointer {
+    std::vector<std::string> names;
+    SeriesF::Pointer stack = ReadStack(path, names);
+    const auto it = std::find(names.begin(), names.end(), name);
+    if (it == names.end()) {
+        QI_EXCEPTION("Stack " << path << " does not contain a volume named " << name);
+    }
+    return ExtractVolume(stack, it - names.begin());
+}
+
+auto SplitInterleaved(const VectorVolumeF *img) -> std::vector<VolumeF::Pointer> {
+    const size_t nComponents = img->GetNumberOfComponentsPerPixel();
+    const VolumeF::RegionType region = img->GetBufferedRegion();
+    const size_t nVox = region.GetNumberOfPixels();
+    std::vector<VolumeF::Pointer> vols(nComponents);
+    std::vector<float *> dest(nComponents);
+    for (size_t c = 0; c < nComponents; c++) {
+        vols[c] = VolumeF::New();
+        vols[c]->SetRegions(region);
+        vols[c]->SetSpacing(img->GetSpacing());
+        vols[c]->SetOrigin(img->GetOrigin());
+        vols[c]->SetDirection(img->GetDirection());
+        vols[c]->Allocate();
+        dest[c] = vols[c]->GetBufferPointer();
+    }
+    const float *src = img->GetBufferPointer();
+    ThreadPool::Global().parallelFor(0, nVox, SplitBlock, [&](const size_t first, const size_t last) {
+        for (size_t c = 0; c < nComponents; c++) {
+            for (size_t v = first; v < last; v++) {
+                dest[c][v] = src[v * nComponents + c];
+            }
+        }
+    });
+    return vols;
+}
+
+} // End namespace QI
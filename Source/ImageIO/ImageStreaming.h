@@ -0,0 +1,240 @@
+/*
+ *  ImageStreaming.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_IMAGESTREAMING_H
+#define QUIT_IMAGESTREAMING_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <limits>
+#include <memory>
+
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIORegion.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+
+#include "ImageTypes.h"
+#include "ImageToVectorFilter.h"
+#include "Macro.h"
+#include "ResultCache.h"
+#include "ThreadPool.h"
+#include "TaskGraph.h"
+
+namespace QI {
+
+/*
+ * Streamed equivalent of ReadVectorImage. The reader and conversion stay connected to the
+ * pipeline so only the slabs requested downstream are read from disk. This object must stay
+ * alive until the pipeline has finished.
+ */
+template<typename TPixel = float>
+class VectorImageStream {
+public:
+    typedef itk::Image<TPixel, 4> TSeries;
+    typedef itk::VectorImage<TPixel, 3> TVector;
+    typedef itk::ImageFileReader<TSeries> TReader;
+    typedef itk::ImageToVectorFilter<TSeries> TToVector;
+
+    VectorImageStream(const std::string &path) {
+        CacheInput(path);
+        m_reader = TReader::New();
+        m_reader->SetFileName(path);
+        m_convert = TToVector::New();
+        m_convert->SetInput(m_reader->GetOutput());
+        m_convert->UpdateOutputInformation();
+    }
+
+    TVector *GetOutput() { return m_convert->GetOutput(); }
+
+protected:
+    typename TReader::Pointer m_reader;
+    typename TToVector::Pointer m_convert;
+};
+
+/*
+ * Writes an image holding one slab of a larger image into that part of the file at path, which is
+ * created with the full size of the larger image if it does not exist.
+ */
+template<typename TImage>
+void PasteRegion(TImage *slabImage, const typename TImage::RegionType &slab, const std::string &path) {
+    CacheOutput(path);
+    typedef itk::ImageFileWriter<TImage> TWriter;
+    itk::ImageIORegion ioRegion(TImage::ImageDimension);
+    for (unsigned int i = 0; i < TImage::ImageDimension; i++) {
+        ioRegion.SetIndex(i, slab.GetIndex()[i] - slabImage->GetLargestPossibleRegion().GetIndex()[i]);
+        ioRegion.SetSize(i, slab.GetSize()[i]);
+    }
+    typename TWriter::Pointer file = TWriter::New();
+    file->SetFileName(path);
+    file->SetInput(slabImage);
+    file->SetIORegion(ioRegion);
+    file->Update();
+}
+
+/*
+ * Writes the outputs of a voxelwise filter one slab (along the last spatial axis) at a time.
+ * For each slab the first image updates the filter for that slab only, the rest re-use the
+ * same buffers, and each slab is pasted into its output file. Peak memory is hence bounded by
+ * the slab size rather than the whole volume. Pasting requires an output format whose ImageIO can
+ * stream writes (see itk::ImageIOBase::CanStreamWrite), which rules out compressed files.
+ *
+ * The pastes run on threads of their own (one per output, up to the hardware limit) while the next
+ * slab is fitted, each after the previous paste into the same file, so different files are pasted
+ * at the same time. Only one slab's copies wait to be pasted at a time, so this holds one slab more
+ * than writing in turn would.
+ */
+class SlabWriter {
+public:
+    typedef QI::VolumeF::RegionType TRegion;
+
+    SlabWriter(const size_t slabs, const bool verbose) :
+        m_slabs(slabs), m_verbose(verbose)
+    {}
+
+    template<typename TPixel>
+    void Add(itk::Image<TPixel, 3> *img, const std::string &path, QI::VolumeF *scale = nullptr) {
+        typedef itk::Image<TPixel, 3> TImage;
+        m_writes.push_back([=](const TRegion &slab) -> TPaste {
+            img->SetRequestedRegion(slab);
+            img->Update();
+            if (scale) {
+                scale->SetRequestedRegion(slab);
+                scale->Update();
+            }
+            auto out = TImage::New();
+            out->CopyInformation(img);
+            out->SetBufferedRegion(slab);
+            out->SetRequestedRegion(slab);
+            out->Allocate();
+            itk::ImageRegionConstIteratorWithIndex<TImage> it(img, slab);
+            for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+                out->SetPixel(it.GetIndex(), Scale(it.Get(), scale, it.GetIndex()));
+            }
+            return [=] { PasteRegion<TImage>(out, slab, path); };
+        });
+    }
+
+    template<typename TPixel>
+    void Add(itk::VectorImage<TPixel, 3> *img, const std::string &path, QI::VolumeF *scale = nullptr) {
+        typedef itk::VectorImage<TPixel, 3> TVector;
+        typedef itk::Image<TPixel, 4> TSeries;
+        m_writes.push_back([=](const TRegion &slab) -> TPaste {
+            img->SetRequestedRegion(slab);
+            img->Update();
+            if (scale) {
+                scale->SetRequestedRegion(slab);
+                scale->Update();
+            }
+            const size_t nvols = img->GetNumberOfComponentsPerPixel();
+            typename TSeries::RegionType largest, slab4;
+            typename TSeries::SpacingType spacing;
+            typename TSeries::PointType origin;
+            typename TSeries::DirectionType direction;
+            spacing.Fill(1);
+            origin.Fill(0);
+            direction.SetIdentity();
+            for (int i = 0; i < 3; i++) {
+                largest.SetIndex(i, img->GetLargestPossibleRegion().GetIndex()[i]);
+                largest.SetSize(i, img->GetLargestPossibleRegion().GetSize()[i]);
+                slab4.SetIndex(i, slab.GetIndex()[i]);
+                slab4.SetSize(i, slab.GetSize()[i]);
+                spacing[i] = img->GetSpacing()[i];
+                origin[i] = img->GetOrigin()[i];
+                for (int j = 0; j < 3; j++) {
+                    direction[i][j] = img->GetDirection()[i][j];
+                }
+            }
+            largest.SetIndex(3, 0);
+            largest.SetSize(3, nvols);
+            slab4.SetIndex(3, 0);
+            slab4.SetSize(3, nvols);
+            auto out = TSeries::New();
+            out->SetLargestPossibleRegion(largest);
+            out->SetBufferedRegion(slab4);
+            out->SetRequestedRegion(slab4);
+            out->SetSpacing(spacing);
+            out->SetOrigin(origin);
+            out->SetDirection(direction);
+            out->Allocate();
+            itk::ImageRegionConstIteratorWithIndex<TVector> it(img, slab);
+            for (it.GoToBegin(); !it.IsAtEnd(); ++it) {
+                const auto px = it.Get();
+                typename TSeries::IndexType idx4;
+                for (int i = 0; i < 3; i++) {
+                    idx4[i] = it.GetIndex()[i];
+                }
+                for (size_t v = 0; v < nvols; v++) {
+                    idx4[3] = v;
+                    out->SetPixel(idx4, Scale(px[v], scale, it.GetIndex()));
+                }
+            }
+            return [=] { PasteRegion<TSeries>(out, slab4, path); };
+        });
+    }
+
+    void Write(const TRegion &region) {
+        const int axis = TRegion::ImageDimension - 1;
+        const size_t length = region.GetSize()[axis];
+        const size_t slabs = std::max<size_t>(1, std::min(m_slabs, length));
+        const size_t threads = std::min<size_t>(m_writes.size(), std::max(1u, std::thread::hardware_concurrency()));
+        m_graph.reset(); // Before its pool
+        m_pool.reset(new ThreadPool(std::max<size_t>(1, threads)));
+        m_graph.reset(new TaskGraph(*m_pool));
+        std::vector<TaskGraph::TTask> previous, pastes;
+        for (size_t s = 0; s < slabs; s++) {
+            TRegion slab = region;
+            const size_t start = (length * s) / slabs;
+            const size_t end = (length * (s + 1)) / slabs;
+            slab.SetIndex(axis, region.GetIndex()[axis] + start);
+            slab.SetSize(axis, end - start);
+            if (m_verbose) std::cout << "Processing slab " << (s + 1) << " of " << slabs << std::endl;
+            // Wait for the slab before last, so only one is queued while this one is fitted
+            m_graph->waitFor(previous);
+            previous = pastes;
+            for (size_t w = 0; w < m_writes.size(); w++) {
+                TPaste paste = m_writes[w](slab);
+                if (s == 0) {
+                    pastes.push_back(m_graph->add(std::move(paste)));
+                } else {
+                    pastes[w] = m_graph->add(std::move(paste), {previous[w]});
+                }
+            }
+        }
+        m_graph->wait();
+    }
+
+protected:
+    size_t m_slabs;
+    bool m_verbose;
+    typedef std::function<void ()> TPaste;
+    std::vector<std::function<TPaste (const TRegion &)>> m_writes;
+    std::unique_ptr<ThreadPool> m_pool;
+    std::unique_ptr<TaskGraph> m_graph; // After the pool, so it finishes before the pool joins
+
+    // Matches itk::DivideImageFilter, which is used by the non-streamed WriteScaledImage
+    template<typename TValue>
+    static TValue Scale(const TValue &v, const QI::VolumeF *scale, const TRegion::IndexType &index) {
+        if (!scale) {
+            return v;
+        }
+        const float s = scale->GetPixel(index);
+        if (s == 0) {
+            return std::numeric_limits<TValue>::max();
+        }
+        return static_cast<TValue>(v / s);
+    }
+};
+
+} // End namespace QI
+
+#endif // QUIT_IMAGESTREAMING_H
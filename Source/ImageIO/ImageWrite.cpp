@@ -10,28 +10,228 @@
  */
 
 #include <string>
+#include <iostream>
+#include <cstdint>
+#include <limits>
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <type_traits>
 
 #include "itkImageFileWriter.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkDivideImageFilter.h"
 
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "MemoryStore.h"
 #include "Macro.h"
+#include "Trace.h"
 
 namespace QI {
 
+const Storage &AuxiliaryStorage() {
+    static const Storage storage = []() -> Storage {
+        const char *env = getenv("QUIT_AUX_STORAGE");
+        if (!env || std::string(env) == "FLOAT") {
+            return Storage::Native;
+        } else if (std::string(env) == "INT16") {
+            return Storage::Int16;
+        } else {
+            std::cerr << "Environment variable QUIT_AUX_STORAGE is not valid, defaulting to FLOAT" << std::endl;
+            return Storage::Native;
+        }
+    }();
+    return storage;
+}
+
+namespace {
+
+bool EndsWith(const std::string &s, const std::string &end) {
+    return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+}
+
+template<typename TImg>
+bool WriteInt16(const TImg *, const std::string &, std::false_type) {
+    return false;
+}
+
+/*
+ * ITK always writes a slope of 1, so the scaling is patched into the uncompressed header
+ * afterwards (which is why .nii.gz always goes through a temporary file here).
+ */
+template<typename TImg>
+bool WriteInt16(const TImg *img, const std::string &path, std::true_type) {
+    if (!EndsWith(path, ".nii") && !EndsWith(path, ".nii.gz")) {
+        return false;
+    }
+    typedef typename TImg::PixelType TPixel;
+    const size_t n = img->GetBufferedRegion().GetNumberOfPixels();
+    const TPixel *in = img->GetBufferPointer();
+    double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+    for (size_t i = 0; i < n; i++) {
+        if (std::isfinite(in[i])) {
+            lo = std::min<double>(lo, in[i]);
+            hi = std::max<double>(hi, in[i]);
+        }
+    }
+    if (!std::isfinite(lo)) {
+        lo = hi = 0;
+    }
+    const double limit = std::numeric_limits<int16_t>::max();
+    const float slope = (hi > lo) ? (hi - lo) / (2 * limit) : 1;
+    const float inter = (hi + lo) / 2;
+    typedef itk::Image<int16_t, TImg::ImageDimension> TShort;
+    typename TShort::Pointer q = TShort::New();
+    q->CopyInformation(img);
+    q->SetRegions(img->GetBufferedRegion());
+    q->Allocate();
+    int16_t *out = q->GetBufferPointer();
+    for (size_t i = 0; i < n; i++) {
+        // NaN has no integer representation, so it becomes the intercept
+        const double v = std::isnan(in[i]) ? 0 : std::round((in[i] - inter) / slope);
+        out[i] = static_cast<int16_t>(std::max(-limit, std::min(limit, v)));
+    }
+    GzipOutput output(path, true);
+    typedef itk::ImageFileWriter<TShort> TWriter;
+    typename TWriter::Pointer file = TWriter::New();
+    file->SetFileName(output.path());
+    file->SetInput(q);
+    file->Update();
+    {
+        std::fstream header(output.path(), std::ios::in | std::ios::out | std::ios::binary);
+        header.seekp(112); // scl_slope then scl_inter
+        header.write(reinterpret_cast<const char *>(&slope), sizeof(float));
+        header.write(reinterpret_cast<const char *>(&inter), sizeof(float));
+        if (!header) {
+            QI_EXCEPTION("Failed to write intensity scaling to file: " << path);
+        }
+    }
+    output.finish();
+    return true;
+}
+
+} // End anonymous namespace
+
+/*
+ * The header offsets are from nifti1.h. NIfTI is RAS where ITK is LPS, so the first two rows of
+ * the matrix and offset change sign. The quaternion follows nifti_mat44_to_quatern(), with the
+ * handedness stored in pixdim[0] (qfac).
+ */
+bool RewriteNiftiGeometry(const std::string &path, const VolumeF::DirectionType &direction,
+                          const VolumeF::SpacingType &spacing, const VolumeF::PointType &origin)
+{
+    if (!EndsWith(path, ".nii")) {
+        return false;
+    }
+    std::fstream header(path, std::ios::in | std::ios::out | std::ios::binary);
+    int32_t sizeof_hdr = 0;
+    char magic[4] = {0, 0, 0, 0};
+    header.read(reinterpret_cast<char *>(&sizeof_hdr), sizeof(sizeof_hdr));
+    header.seekg(344);
+    header.read(magic, 4);
+    if (!header || sizeof_hdr != 348 || std::string(magic, 4) != std::string("n+1\0", 4)) {
+        return false;
+    }
+    double R[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            R[i][j] = ((i < 2) ? -1 : 1) * direction[i][j];
+        }
+    }
+    const float offset[3] = {static_cast<float>(-origin[0]), static_cast<float>(-origin[1]), static_cast<float>(origin[2])};
+    float srow[3][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            srow[i][j] = R[i][j] * spacing[j];
+        }
+        srow[i][3] = offset[i];
+    }
+    const double det = R[0][0]*(R[1][1]*R[2][2] - R[1][2]*R[2][1]) -
+                       R[0][1]*(R[1][0]*R[2][2] - R[1][2]*R[2][0]) +
+                       R[0][2]*(R[1][0]*R[2][1] - R[1][1]*R[2][0]);
+    const float qfac = (det < 0) ? -1 : 1;
+    if (det < 0) {
+        for (int i = 0; i < 3; i++) {
+            R[i][2] = -R[i][2];
+        }
+    }
+    double a = R[0][0] + R[1][1] + R[2][2] + 1, b, c, d;
+    if (a > 0.5) {
+        a = 0.5 * sqrt(a);
+        b = 0.25 * (R[2][1] - R[1][2]) / a;
+        c = 0.25 * (R[0][2] - R[2][0]) / a;
+        d = 0.25 * (R[1][0] - R[0][1]) / a;
+    } else {
+        const double xd = 1 + R[0][0] - (R[1][1] + R[2][2]);
+        const double yd = 1 + R[1][1] - (R[0][0] + R[2][2]);
+        const double zd = 1 + R[2][2] - (R[0][0] + R[1][1]);
+        if (xd > 1) {
+            b = 0.5 * sqrt(xd);
+            c = 0.25 * (R[0][1] + R[1][0]) / b;
+            d = 0.25 * (R[0][2] + R[2][0]) / b;
+            a = 0.25 * (R[2][1] - R[1][2]) / b;
+        } else if (yd > 1) {
+            c = 0.5 * sqrt(yd);
+            b = 0.25 * (R[0][1] + R[1][0]) / c;
+            d = 0.25 * (R[1][2] + R[2][1]) / c;
+            a = 0.25 * (R[0][2] - R[2][0]) / c;
+        } else {
+            d = 0.5 * sqrt(zd);
+            b = 0.25 * (R[0][2] + R[2][0]) / d;
+            c = 0.25 * (R[1][2] + R[2][1]) / d;
+            a = 0.25 * (R[1][0] - R[0][1]) / d;
+        }
+        if (a < 0) {
+            b = -b; c = -c; d = -d;
+        }
+    }
+    const float pixdim[4] = {qfac, static_cast<float>(spacing[0]), static_cast<float>(spacing[1]), static_cast<float>(spacing[2])};
+    const float quatern[3] = {static_cast<float>(b), static_cast<float>(c), static_cast<float>(d)};
+    int16_t codes[2];
+    header.seekg(252); // qform_code then sform_code
+    header.read(reinterpret_cast<char *>(codes), sizeof(codes));
+    for (auto &code : codes) {
+        if (code == 0) code = 1; // NIFTI_XFORM_SCANNER_ANAT, as ITK writes
+    }
+    header.seekp(76);
+    header.write(reinterpret_cast<const char *>(pixdim), sizeof(pixdim));
+    header.seekp(252);
+    header.write(reinterpret_cast<const char *>(codes), sizeof(codes));
+    header.write(reinterpret_cast<const char *>(quatern), sizeof(quatern));
+    header.write(reinterpret_cast<const char *>(offset), sizeof(offset));
+    header.write(reinterpret_cast<const char *>(srow), sizeof(srow));
+    if (!header) {
+        QI_EXCEPTION("Failed to write geometry to file: " << path);
+    }
+    return true;
+}
+
 template<typename TImg>
-void WriteImage(const TImg *ptr, const std::string &path) {
+void WriteImage(const TImg *ptr, const std::string &path, const Storage storage) {
+    const TraceSpan span("io", "write", path);
+    if (IsMemoryPath(path)) {
+        // Keep the pixels, but not the pipeline that made them
+        typename TImg::Pointer stored = TImg::New();
+        stored->Graft(ptr);
+        SetMemoryImage(path, stored.GetPointer());
+        return;
+    }
+    if (storage == Storage::Int16 && WriteInt16(ptr, path, std::is_floating_point<typename TImg::PixelType>())) {
+        return;
+    }
     typedef itk::ImageFileWriter<TImg> TWriter;
+    GzipOutput output(path);
     typename TWriter::Pointer file = TWriter::New();
-    file->SetFileName(path);
+    file->SetFileName(output.path());
     file->SetInput(ptr);
     file->Update();
+    output.finish();
 }
 
 template<typename TImg>
-void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path) {
-    WriteImage<TImg>(ptr.GetPointer(), path);
+void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path, const Storage storage) {
+    WriteImage<TImg>(ptr.GetPointer(), path, storage);
 }
 
 template<typename TImg>
@@ -63,22 +263,22 @@ void WriteScaledImage(const itk::SmartPointer<TImg> &ptr, const itk::SmartPointe
     WriteScaledImage<TImg>(ptr.GetPointer(), sptr.GetPointer(), path);
 }
 
-template void WriteImage<VolumeF>(const VolumeF *ptr, const std::string &path);
-template void WriteImage<VolumeXF>(const VolumeXF *ptr, const std::string &path);
-template void WriteImage<VolumeD>(const VolumeD *ptr, const std::string &path);
-template void WriteImage<VolumeI>(const VolumeI *ptr, const std::string &path);
-template void WriteImage<VolumeUC>(const VolumeUC *ptr, const std::string &path);
-template void WriteImage<SeriesF>(const SeriesF *ptr, const std::string &path);
-template void WriteImage<SeriesD>(const SeriesD *ptr, const std::string &path);
-template void WriteImage<SeriesXF>(const SeriesXF *ptr, const std::string &path);
-template void WriteImage<SeriesXD>(const SeriesXD *ptr, const std::string &path);
-template void WriteImage<VolumeF>(const itk::SmartPointer<VolumeF> ptr, const std::string &path);
-template void WriteImage<VolumeD>(const itk::SmartPointer<VolumeD> ptr, const std::string &path);
-template void WriteImage<VolumeI>(const itk::SmartPointer<VolumeI> ptr, const std::string &path);
-template void WriteImage<SeriesF>(const itk::SmartPointer<SeriesF> ptr, const std::string &path);
-template void WriteImage<SeriesD>(const itk::SmartPointer<SeriesD> ptr, const std::string &path);
-template void WriteImage<SeriesXF>(const itk::SmartPointer<SeriesXF> ptr, const std::string &path);
-template void WriteImage<SeriesXD>(const itk::SmartPointer<SeriesXD> ptr, const std::string &path);
+template void WriteImage<VolumeF>(const VolumeF *ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeXF>(const VolumeXF *ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeD>(const VolumeD *ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeI>(const VolumeI *ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeUC>(const VolumeUC *ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesF>(const SeriesF *ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesD>(const SeriesD *ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesXF>(const SeriesXF *ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesXD>(const SeriesXD *ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeF>(const itk::SmartPointer<VolumeF> ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeD>(const itk::SmartPointer<VolumeD> ptr, const std::string &path, const Storage storage);
+template void WriteImage<VolumeI>(const itk::SmartPointer<VolumeI> ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesF>(const itk::SmartPointer<SeriesF> ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesD>(const itk::SmartPointer<SeriesD> ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesXF>(const itk::SmartPointer<SeriesXF> ptr, const std::string &path, const Storage storage);
+template void WriteImage<SeriesXD>(const itk::SmartPointer<SeriesXD> ptr, const std::string &path, const Storage storage);
 template void WriteScaledImage<VolumeF>(const VolumeF *img, const VolumeF *simg, const std::string &path);
 template void WriteScaledImage<VolumeF>(const itk::SmartPointer<VolumeF> &ptr, const itk::SmartPointer<VolumeF> &sptr, const std::string &path);
 template void WriteMagnitudeImage<VolumeXF>(const VolumeXF *ptr, const std::string &path);
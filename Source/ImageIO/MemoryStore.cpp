@@ -0,0 +1,84 @@
+/*
+ *  MemoryStore.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <map>
+#include <mutex>
+#include "MemoryStore.h"
+
+namespace QI {
+
+namespace {
+
+// Writes can come from the threads of a WriteQueue
+struct Store {
+    std::mutex mutex;
+    std::map<std::string, itk::DataObject::ConstPointer> images;
+    std::map<std::string, std::string> texts;
+};
+
+Store &TheStore() {
+    static Store store;
+    return store;
+}
+
+} // End anonymous namespace
+
+bool IsMemoryPath(const std::string &path) {
+    return path.compare(0, 4, "mem:") == 0;
+}
+
+void SetMemoryImage(const std::string &path, const itk::DataObject *img) {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.images[path] = img;
+}
+
+auto GetMemoryImage(const std::string &path) -> itk::DataObject::ConstPointer {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    const auto it = s.images.find(path);
+    if (it == s.images.end()) {
+        QI_EXCEPTION("No image has been written to " << path);
+    }
+    return it->second;
+}
+
+void SetMemoryText(const std::string &path, const std::string &text) {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.texts[path] = text;
+}
+
+auto GetMemoryText(const std::string &path) -> std::string {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    const auto it = s.texts.find(path);
+    if (it == s.texts.end()) {
+        QI_EXCEPTION("No text has been written to " << path);
+    }
+    return it->second;
+}
+
+void ForgetMemory(const std::string &path) {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.images.erase(path);
+    s.texts.erase(path);
+}
+
+void ForgetAllMemory() {
+    Store &s = TheStore();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.images.clear();
+    s.texts.clear();
+}
+
+} // End namespace QI
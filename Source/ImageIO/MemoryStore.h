@@ -0,0 +1,56 @@
+/*
+ *  MemoryStore.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_MEMORYSTORE_H
+#define QUIT_MEMORYSTORE_H
+
+#include <string>
+#include "itkDataObject.h"
+#include "itkImageDuplicator.h"
+#include "Macro.h"
+
+namespace QI {
+
+/*
+ * Paths starting with mem: are never touched on disk, the image and text IO functions keep
+ * them in this process instead, so the programs run by qi_pipeline can hand their outputs to
+ * each other. Images are stored as written, so must not change afterwards, and every read gets
+ * its own copy. The pixel type and dimension read must be the ones written (the 4D series of a
+ * vector image can be read back as either).
+ */
+bool IsMemoryPath(const std::string &path);
+void SetMemoryImage(const std::string &path, const itk::DataObject *img);
+auto GetMemoryImage(const std::string &path) -> itk::DataObject::ConstPointer;
+void SetMemoryText(const std::string &path, const std::string &text);
+auto GetMemoryText(const std::string &path) -> std::string;
+void ForgetMemory(const std::string &path); //!< Frees an image or text once nothing will read it again
+void ForgetAllMemory();                     //!< Frees everything, e.g. between the subjects of a batch
+
+template<typename TImg>
+auto MemoryImage(const std::string &path) -> typename TImg::ConstPointer {
+    typename TImg::ConstPointer img = dynamic_cast<const TImg *>(GetMemoryImage(path).GetPointer());
+    if (!img) {
+        QI_EXCEPTION("Image in " << path << " does not have the pixel type or dimension it was read as");
+    }
+    return img;
+}
+
+template<typename TImg>
+auto CopyMemoryImage(const std::string &path) -> typename TImg::Pointer {
+    auto duplicator = itk::ImageDuplicator<TImg>::New();
+    duplicator->SetInputImage(MemoryImage<TImg>(path));
+    duplicator->Update();
+    return duplicator->GetOutput();
+}
+
+} // End namespace QI
+
+#endif // QUIT_MEMORYSTORE_H
@@ -0,0 +1,303 @@
+/*
+ *  ParallelGzip.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <cstdlib>
+#include <cstdint>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "itk_zlib.h"
+
+#include "ParallelGzip.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+#include "ResultCache.h"
+#include "Trace.h"
+
+namespace QI {
+
+namespace {
+
+const size_t BlockSize = 1 << 20;   // Uncompressed bytes per gzip member
+const size_t HeaderSize = 20;       // Fixed gzip header (10), XLEN (2) and our subfield (8)
+const size_t TrailerSize = 8;       // CRC32 and ISIZE
+const unsigned char FEXTRA = 4;
+const unsigned char SubfieldID[2] = {'Q', 'I'};
+
+void PutLE(unsigned char *p, const uint32_t v, const int n = 4) {
+    for (int i = 0; i < n; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+uint32_t GetLE(const unsigned char *p, const int n = 4) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    return v;
+}
+
+bool EndsWith(const std::string &s, const std::string &end) {
+    return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+}
+
+/*
+ * The suffix is kept so ITK (and MapImage) still recognise the temporary file as NIfTI.
+ */
+std::string TempNifti() {
+    const char *dir = getenv("TMPDIR");
+    std::string pattern = std::string(dir ? dir : "/tmp") + "/quit_XXXXXX.nii";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    const int fd = mkstemps(name.data(), 4);
+    if (fd < 0) {
+        QI_EXCEPTION("Could not create temporary file " << pattern);
+    }
+    close(fd);
+    return std::string(name.data());
+}
+
+} // End anonymous namespace
+
+size_t GzipThreads() {
+    static const char *env = getenv("QUIT_GZIP_THREADS");
+    static const long n = (env && *env) ? std::max(0l, strtol(env, nullptr, 10)) : -1;
+    if (n < 0) {
+        return 0;
+    } else if (n == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    } else {
+        return n;
+    }
+}
+
+/*
+ * Each block is read and deflated by a worker. The members are only kept in memory until they
+ * can be written in order, so at most the compressed size of the file is held at once.
+ */
+void CompressFile(const std::string &in, const std::string &out, const size_t nThreads) {
+    const TraceSpan span("io", "deflate", out);
+    const int fd = open(in.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        QI_EXCEPTION("Could not open file for compression: " << in);
+    }
+    const size_t size = st.st_size;
+    const size_t nBlocks = std::max<size_t>(1, (size + BlockSize - 1) / BlockSize);
+    struct {
+        int fd;
+        size_t size;
+        std::vector<std::vector<unsigned char>> members;
+        std::atomic<bool> failed{false};
+    } job;
+    job.fd = fd;
+    job.size = size;
+    job.members.resize(nBlocks);
+    {
+        ThreadPool pool(nThreads);
+        for (size_t b = 0; b < nBlocks; b++) {
+            pool.enqueue([&job, b] {
+                const size_t offset = b * BlockSize;
+                const size_t n = std::min(BlockSize, job.size - offset);
+                std::vector<unsigned char> data(n);
+                if (n > 0 && pread(job.fd, data.data(), n, offset) != static_cast<ssize_t>(n)) {
+                    job.failed = true;
+                    return;
+                }
+                z_stream z{};
+                if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                    job.failed = true;
+                    return;
+                }
+                std::vector<unsigned char> &m = job.members[b];
+                m.resize(HeaderSize + deflateBound(&z, n) + TrailerSize);
+                z.next_in = data.data();
+                z.avail_in = n;
+                z.next_out = m.data() + HeaderSize;
+                z.avail_out = m.size() - HeaderSize - TrailerSize;
+                const int result = deflate(&z, Z_FINISH);
+                const size_t deflated = z.total_out;
+                deflateEnd(&z);
+                if (result != Z_STREAM_END) {
+                    job.failed = true;
+                    return;
+                }
+                m.resize(HeaderSize + deflated + TrailerSize);
+                const unsigned char header[12] = {0x1f, 0x8b, Z_DEFLATED, FEXTRA, 0, 0, 0, 0, 0, 0xff, 8, 0};
+                std::copy(header, header + 12, m.begin());
+                m[12] = SubfieldID[0];
+                m[13] = SubfieldID[1];
+                PutLE(&m[14], 4, 2);
+                PutLE(&m[16], m.size());
+                PutLE(&m[HeaderSize + deflated], crc32(0L, data.data(), n));
+                PutLE(&m[HeaderSize + deflated + 4], n);
+            });
+        }
+    } // Pool destructor waits for the remaining blocks
+    close(fd);
+    if (job.failed) {
+        QI_EXCEPTION("Failed to compress file: " << in);
+    }
+    std::ofstream file(out, std::ios::binary | std::ios::trunc);
+    for (const auto &m : job.members) {
+        file.write(reinterpret_cast<const char *>(m.data()), m.size());
+    }
+    if (!file) {
+        QI_EXCEPTION("Failed to write file: " << out);
+    }
+}
+
+/*
+ * Walk the member headers first, so anything that does not have our layout all the way to the
+ * end of the file is rejected before any output is written. The uncompressed offset of each
+ * member follows from the ISIZE fields, so the workers can write straight into the output.
+ */
+bool DecompressFile(const std::string &in, const std::string &out, const size_t nThreads) {
+    const TraceSpan span("io", "inflate", in);
+    std::ifstream file(in, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    const size_t size = file.tellg();
+    std::vector<unsigned char> gz(size);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(gz.data()), size)) {
+        return false;
+    }
+    std::vector<size_t> starts, offsets;
+    size_t pos = 0, total = 0;
+    while (pos < size) {
+        const unsigned char *h = gz.data() + pos;
+        if ((size - pos) < (HeaderSize + TrailerSize) ||
+            h[0] != 0x1f || h[1] != 0x8b || h[2] != Z_DEFLATED || h[3] != FEXTRA ||
+            GetLE(h + 10, 2) != 8 || h[12] != SubfieldID[0] || h[13] != SubfieldID[1] || GetLE(h + 14, 2) != 4) {
+            return false;
+        }
+        const size_t length = GetLE(h + 16);
+        if (length < (HeaderSize + TrailerSize) || length > (size - pos)) {
+            return false;
+        }
+        starts.push_back(pos);
+        offsets.push_back(total);
+        total += GetLE(h + length - 4);
+        pos += length;
+    }
+    if (starts.empty()) {
+        return false;
+    }
+    const int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        QI_EXCEPTION("Could not open file for decompression: " << out);
+    }
+    struct {
+        int fd;
+        const unsigned char *gz;
+        const size_t *starts, *offsets;
+        std::atomic<bool> failed{false};
+    } job;
+    job.fd = fd;
+    job.gz = gz.data();
+    job.starts = starts.data();
+    job.offsets = offsets.data();
+    {
+        ThreadPool pool(nThreads);
+        for (size_t b = 0; b < starts.size(); b++) {
+            pool.enqueue([&job, b] {
+                const unsigned char *m = job.gz + job.starts[b];
+                const size_t length = GetLE(m + 16);
+                const size_t n = GetLE(m + length - 4);
+                std::vector<unsigned char> data(std::max<size_t>(n, 1)); // inflate() needs somewhere to write, even if empty
+                z_stream z{};
+                if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+                    job.failed = true;
+                    return;
+                }
+                z.next_in = const_cast<unsigned char *>(m + HeaderSize);
+                z.avail_in = length - HeaderSize - TrailerSize;
+                z.next_out = data.data();
+                z.avail_out = data.size();
+                const int result = inflate(&z, Z_FINISH);
+                const bool complete = (result == Z_STREAM_END) && (z.total_out == n);
+                inflateEnd(&z);
+                if (!complete || crc32(0L, data.data(), n) != GetLE(m + length - 8) ||
+                    (n > 0 && pwrite(job.fd, data.data(), n, job.offsets[b]) != static_cast<ssize_t>(n))) {
+                    job.failed = true;
+                }
+            });
+        }
+    }
+    close(fd);
+    if (job.failed) {
+        QI_EXCEPTION("Failed to decompress file: " << in);
+    }
+    return true;
+}
+
+GzipOutput::GzipOutput(const std::string &path, const bool always) : m_path(path) {
+    CacheOutput(path);
+    if ((always || GzipThreads() > 0) && EndsWith(path, ".nii.gz")) {
+        m_temp = TempNifti();
+    }
+}
+
+GzipOutput::~GzipOutput() {
+    if (!m_temp.empty()) {
+        unlink(m_temp.c_str());
+    }
+}
+
+const std::string &GzipOutput::path() const {
+    return m_temp.empty() ? m_path : m_temp;
+}
+
+void GzipOutput::finish() {
+    if (!m_temp.empty()) {
+        CompressFile(m_temp, m_path, std::max<size_t>(1, GzipThreads()));
+    }
+}
+
+GzipInput::GzipInput(const std::string &path) : m_path(path) {
+    CacheInput(path);
+    if (GzipThreads() > 0 && EndsWith(path, ".nii.gz")) {
+        m_temp = TempNifti();
+        bool decompressed = false;
+        try {
+            decompressed = DecompressFile(path, m_temp, GzipThreads());
+        } catch (...) {
+            unlink(m_temp.c_str());
+            throw;
+        }
+        if (!decompressed) {
+            unlink(m_temp.c_str());
+            m_temp.clear();
+        }
+    }
+}
+
+GzipInput::~GzipInput() {
+    if (!m_temp.empty()) {
+        unlink(m_temp.c_str());
+    }
+}
+
+const std::string &GzipInput::path() const {
+    return m_temp.empty() ? m_path : m_temp;
+}
+
+} // End namespace QI
@@ -0,0 +1,62 @@
+/*
+ *  ParallelGzip.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_PARALLELGZIP_H
+#define QUIT_PARALLELGZIP_H
+
+#include <string>
+
+namespace QI {
+
+/*
+ * Multi-threaded gzip for .nii.gz files, switched on by the QUIT_GZIP_THREADS environment
+ * variable (0 = hardware limit). Files are written as a series of independently deflated gzip
+ * members, in the same way as BGZF, each with an extra field recording its compressed length.
+ * This remains a valid gzip file that any reader (including FSL & SPM) can open, but QUIT can
+ * find the members without inflating them and so decompress them in parallel too. Gzip files
+ * without the extra field are left to ITK.
+ */
+size_t GzipThreads(); // 0 if parallel gzip is switched off
+
+void CompressFile(const std::string &in, const std::string &out, const size_t nThreads);
+bool DecompressFile(const std::string &in, const std::string &out, const size_t nThreads); // false if in was not written by CompressFile
+
+/*
+ * ITK can only write uncompressed files quickly, so point it at path() and then call finish()
+ * to compress that into the real file. When parallel gzip does not apply path() is the real file,
+ * unless always is set, in which case .nii.gz files are compressed here even with one thread.
+ */
+class GzipOutput {
+public:
+    GzipOutput(const std::string &path, const bool always = false);
+    ~GzipOutput(); // Removes the temporary file
+    const std::string &path() const;
+    void finish();
+protected:
+    std::string m_path, m_temp;
+};
+
+/*
+ * Decompresses in parallel to a temporary file if possible, path() is then that file and is
+ * removed on destruction. Otherwise path() is the original file.
+ */
+class GzipInput {
+public:
+    GzipInput(const std::string &path);
+    ~GzipInput();
+    const std::string &path() const;
+protected:
+    std::string m_path, m_temp;
+};
+
+} // End namespace QI
+
+#endif // QUIT_PARALLELGZIP_H
@@ -12,29 +12,299 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
-#include "ImageToVectorFilter.h"
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include "itkImageFileReader.h"
+#include "itk_zlib.h"
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "MemoryStore.h"
 #include "Macro.h"
+#include "Trace.h"
 
 namespace QI {
 
+namespace {
+    const size_t ReadChunkBytes = 64 * 1024 * 1024; // Volumes read from disk at once, if the format can stream
+    const size_t TransposeBlock = 256; // Voxels interleaved at once, so the output block stays in cache
+    const int16_t NiftiInt16 = 4, NiftiUInt16 = 512; // NIfTI-1 datatype codes
+
+    /*
+     * The parts of a NIfTI-1 header needed to read the voxels directly. gzread passes uncompressed
+     * files through as they are, so this reads both. Files of the other endianness are not
+     * recognised, and are left to ITK.
+     */
+    struct NiftiLayout {
+        int16_t dim[8], datatype;
+        float vox_offset, scl_slope, scl_inter;
+    };
+
+    bool ReadNiftiLayout(gzFile file, NiftiLayout &nifti) {
+        unsigned char header[348];
+        if (gzread(file, header, sizeof(header)) != static_cast<int>(sizeof(header))) {
+            return false;
+        }
+        int32_t sizeof_hdr;
+        std::memcpy(&sizeof_hdr, header, 4);
+        std::memcpy(nifti.dim, header + 40, 16);
+        std::memcpy(&nifti.datatype, header + 70, 2);
+        std::memcpy(&nifti.vox_offset, header + 108, 4);
+        std::memcpy(&nifti.scl_slope, header + 112, 4);
+        std::memcpy(&nifti.scl_inter, header + 116, 4);
+        return sizeof_hdr == 348 && std::memcmp(header + 344, "n+1", 4) == 0;
+    }
+
+    // gzread takes an int, so large reads go in pieces
+    bool ReadBytes(gzFile file, void *data, const size_t bytes) {
+        char *out = static_cast<char *>(data);
+        for (size_t done = 0; done < bytes;) {
+            const unsigned int n = static_cast<unsigned int>(std::min<size_t>(bytes - done, INT_MAX));
+            if (gzread(file, out + done, n) != static_cast<int>(n)) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+}
+
+/*
+ * An empty vector image with the geometry of the first three dimensions of the series, and one
+ * component per volume, buffered over part or all of it.
+ */
+template<typename TPixel, typename TSeriesPixel>
+auto NewVectorLike(const itk::Image<TSeriesPixel, 4> *series, const itk::ImageRegion<3> &buffered) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    typedef itk::VectorImage<TPixel, 3> TVector;
+    const typename itk::Image<TSeriesPixel, 4>::RegionType largest = series->GetLargestPossibleRegion();
+    typename TVector::Pointer vols = TVector::New();
+    vols->SetLargestPossibleRegion(largest.Slice(3));
+    vols->SetBufferedRegion(buffered);
+    vols->SetRequestedRegion(buffered);
+    typename TVector::SpacingType spacing;
+    typename TVector::PointType origin;
+    typename TVector::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        spacing[i] = series->GetSpacing()[i];
+        origin[i] = series->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = series->GetDirection()[i][j];
+        }
+    }
+    vols->SetSpacing(spacing);
+    vols->SetOrigin(origin);
+    vols->SetDirection(direction);
+    vols->SetNumberOfComponentsPerPixel(largest.GetSize()[3]);
+    vols->Allocate();
+    return vols;
+}
+
+/*
+ * Interleaves n consecutive volumes of nVox voxels from in, starting at volume start of the
+ * nVols in out.
+ */
+template<typename TPixel>
+void Interleave(const TPixel *in, const size_t nVox, const size_t start, const size_t n, const size_t nVols, TPixel *out) {
+    for (size_t v0 = 0; v0 < nVox; v0 += TransposeBlock) {
+        const size_t v1 = std::min(v0 + TransposeBlock, nVox);
+        for (size_t t = 0; t < n; t++) {
+            const TPixel *vol = in + t * nVox;
+            for (size_t v = v0; v < v1; v++) {
+                out[v * nVols + start + t] = vol[v];
+            }
+        }
+    }
+}
+
+/*
+ * Reads the series straight into the interleaved VectorImage buffer a few volumes at a time, so
+ * for formats that can stream (e.g. uncompressed NIfTI) the whole 4D image is never held as well.
+ * Formats that cannot stream (e.g. gzipped) are read in one go, as before, unless they could be
+ * inflated to a temporary file by GzipInput. Vector images kept in memory are stored as series.
+ */
 template<typename TPixel>
 auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer {
     typedef itk::Image<TPixel, 4> TSeries;
     typedef itk::VectorImage<TPixel, 3> TVector;
-    typedef itk::ImageToVectorFilter<TSeries> TToVector;
-    
-    auto img = ReadImage<TSeries>(path);
-    auto convert = TToVector::New();
-    convert->SetInput(img);
-    convert->Update();
-    typename TVector::Pointer vols = convert->GetOutput();
-    vols->DisconnectPipeline();
+    typedef itk::ImageFileReader<TSeries> TReader;
+
+    const TraceSpan span("io", "read", path);
+    if (IsMemoryPath(path)) {
+        typename TSeries::ConstPointer series = MemoryImage<TSeries>(path);
+        typename TVector::Pointer vols = NewVectorLike<TPixel, TPixel>(series, series->GetLargestPossibleRegion().Slice(3));
+        const size_t nVols = vols->GetNumberOfComponentsPerPixel();
+        const size_t nVox = vols->GetLargestPossibleRegion().GetNumberOfPixels();
+        Interleave(series->GetBufferPointer(), nVox, 0, nVols, nVols, vols->GetBufferPointer());
+        return vols;
+    }
+
+    const GzipInput input(path);
+    typename TReader::Pointer file = TReader::New();
+    file->SetFileName(input.path());
+    file->UpdateOutputInformation();
+    typename TSeries::Pointer series = file->GetOutput();
+    const typename TSeries::RegionType largest = series->GetLargestPossibleRegion();
+    const size_t nVols = largest.GetSize()[3];
+    typename TVector::Pointer vols = NewVectorLike<TPixel, TPixel>(series, largest.Slice(3));
+
+    const size_t nVox = vols->GetLargestPossibleRegion().GetNumberOfPixels();
+    size_t chunk = nVols;
+    if (file->GetImageIO()->CanStreamRead()) {
+        chunk = std::max<size_t>(1, ReadChunkBytes / (nVox * sizeof(TPixel)));
+    }
+    TPixel *out = vols->GetBufferPointer();
+    for (size_t start = 0; start < nVols; start += chunk) {
+        const size_t n = std::min(chunk, nVols - start);
+        typename TSeries::RegionType region = largest;
+        region.SetIndex(3, largest.GetIndex()[3] + start);
+        region.SetSize(3, n);
+        series->SetRequestedRegion(region);
+        file->Update();
+        const typename TSeries::RegionType buffered = series->GetBufferedRegion();
+        if (!buffered.IsInside(region)) {
+            QI_EXCEPTION("Failed to read volumes " << start << " to " << (start + n) << " of file: " << path);
+        }
+        const TPixel *in = series->GetBufferPointer() + (region.GetIndex()[3] - buffered.GetIndex()[3]) * nVox;
+        Interleave(in, nVox, start, n, nVols, out);
+    }
+    return vols;
+}
+
+/*
+ * The series is read over the region and every volume in one go, which is small enough for the
+ * regions this is meant for.
+ */
+template<typename TPixel>
+auto ReadVectorImage(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    typedef itk::Image<TPixel, 4> TSeries;
+    typedef itk::VectorImage<TPixel, 3> TVector;
+    typedef itk::ImageFileReader<TSeries> TReader;
+
+    if (region.GetNumberOfPixels() == 0 || IsMemoryPath(path)) {
+        return ReadVectorImage<TPixel>(path);
+    }
+    const TraceSpan span("io", "read region", path);
+    const GzipInput input(path);
+    typename TReader::Pointer file = TReader::New();
+    file->SetFileName(input.path());
+    file->UpdateOutputInformation();
+    typename TSeries::Pointer series = file->GetOutput();
+    const typename TSeries::RegionType largest = series->GetLargestPossibleRegion();
+    if (!largest.Slice(3).IsInside(region)) {
+        QI_EXCEPTION("Region " << region.GetIndex() << " " << region.GetSize() << " is not inside file: " << path);
+    }
+    typename TSeries::RegionType wanted = largest;
+    for (int i = 0; i < 3; i++) {
+        wanted.SetIndex(i, region.GetIndex()[i]);
+        wanted.SetSize(i, region.GetSize()[i]);
+    }
+    series->SetRequestedRegion(wanted);
+    file->Update();
+    if (series->GetBufferedRegion() != wanted) {
+        QI_EXCEPTION("Failed to read region " << region.GetIndex() << " " << region.GetSize() << " of file: " << path);
+    }
+    typename TVector::Pointer vols = NewVectorLike<TPixel, TPixel>(series, region);
+    const size_t nVols = vols->GetNumberOfComponentsPerPixel();
+    Interleave(series->GetBufferPointer(), region.GetNumberOfPixels(), 0, nVols, nVols, vols->GetBufferPointer());
+    return vols;
+}
+
+// Copies the part of a volume of the largest region that is inside region
+template<typename TPixel>
+void Crop(const TPixel *in, const itk::ImageRegion<3> &largest, const itk::ImageRegion<3> &region, TPixel *out) {
+    const size_t nx = largest.GetSize()[0], ny = largest.GetSize()[1];
+    const size_t rx = region.GetSize()[0];
+    const size_t x0 = region.GetIndex()[0] - largest.GetIndex()[0];
+    const size_t y0 = region.GetIndex()[1] - largest.GetIndex()[1];
+    const size_t z0 = region.GetIndex()[2] - largest.GetIndex()[2];
+    for (size_t k = 0; k < region.GetSize()[2]; k++) {
+        for (size_t j = 0; j < region.GetSize()[1]; j++) {
+            std::memcpy(out, in + ((z0 + k) * ny + y0 + j) * nx + x0, rx * sizeof(TPixel));
+            out += rx;
+        }
+    }
+}
+
+/*
+ * ITK would scale the integers to floats, so the voxels are read here, a few volumes at a time
+ * as in ReadVectorImage, and only the geometry comes from ITK.
+ */
+auto ReadInt16VectorImage(const std::string &path, const QI::VolumeF::RegionType &region,
+                          double &slope, double &inter) -> QI::VectorVolumeS::Pointer {
+    if (IsMemoryPath(path)) {
+        return nullptr;
+    }
+    const GzipInput input(path);
+    gzFile file = gzopen(input.path().c_str(), "rb");
+    if (!file) {
+        return nullptr;
+    }
+    struct Closer { gzFile f; ~Closer() { gzclose(f); } } closer{file};
+    NiftiLayout nifti;
+    if (!ReadNiftiLayout(file, nifti) || (nifti.datatype != NiftiInt16 && nifti.datatype != NiftiUInt16) ||
+        nifti.dim[0] < 3 || nifti.dim[0] > 4) {
+        return nullptr;
+    }
+    const TraceSpan span("io", "read int16", path);
+    typedef itk::ImageFileReader<QI::SeriesF> TReader;
+    TReader::Pointer reader = TReader::New();
+    reader->SetFileName(input.path());
+    reader->UpdateOutputInformation();
+    const QI::SeriesF *series = reader->GetOutput();
+    const itk::ImageRegion<3> largest = series->GetLargestPossibleRegion().Slice(3);
+    const itk::ImageRegion<3> wanted = (region.GetNumberOfPixels() == 0) ? largest : region;
+    if (!largest.IsInside(wanted)) {
+        QI_EXCEPTION("Region " << region.GetIndex() << " " << region.GetSize() << " is not inside file: " << path);
+    }
+    QI::VectorVolumeS::Pointer vols = NewVectorLike<short, float>(series, wanted);
+    const size_t nVols = vols->GetNumberOfComponentsPerPixel();
+    const size_t nVox = largest.GetNumberOfPixels();
+    const size_t wantedVox = wanted.GetNumberOfPixels();
+    if (nVox != static_cast<size_t>(nifti.dim[1]) * nifti.dim[2] * nifti.dim[3] ||
+        nVols != (nifti.dim[0] == 4 ? static_cast<size_t>(nifti.dim[4]) : 1)) {
+        QI_EXCEPTION("Header does not match the image size of file: " << path);
+    }
+    // A slope of 0 means the integers are the values
+    slope = (nifti.scl_slope != 0) ? nifti.scl_slope : 1.0;
+    inter = (nifti.scl_slope != 0) ? nifti.scl_inter : 0.0;
+    const bool shift = (nifti.datatype == NiftiUInt16);
+    if (shift) {
+        inter += 32768 * slope;
+    }
+    if (gzseek(file, static_cast<z_off_t>(nifti.vox_offset), SEEK_SET) < 0) {
+        QI_EXCEPTION("Failed to find the voxels of file: " << path);
+    }
+    const size_t chunk = std::min(nVols, std::max<size_t>(1, ReadChunkBytes / (nVox * sizeof(short))));
+    std::vector<short> in(chunk * nVox);
+    std::vector<short> cropped(wanted == largest ? 0 : chunk * wantedVox);
+    short *out = vols->GetBufferPointer();
+    for (size_t start = 0; start < nVols; start += chunk) {
+        const size_t n = std::min(chunk, nVols - start);
+        if (!ReadBytes(file, in.data(), n * nVox * sizeof(short))) {
+            QI_EXCEPTION("Failed to read volumes " << start << " to " << (start + n) << " of file: " << path);
+        }
+        if (shift) {
+            for (size_t i = 0; i < n * nVox; i++) {
+                in[i] = static_cast<short>(static_cast<int>(static_cast<uint16_t>(in[i])) - 32768);
+            }
+        }
+        const short *vol = in.data();
+        if (!cropped.empty()) {
+            for (size_t t = 0; t < n; t++) {
+                Crop(in.data() + t * nVox, largest, wanted, cropped.data() + t * wantedVox);
+            }
+            vol = cropped.data();
+        }
+        Interleave(vol, wantedVox, start, n, nVols, out);
+    }
     return vols;
 }
 
 template auto ReadVectorImage<float>(const std::string &path) -> typename itk::VectorImage<float, 3>::Pointer;
 template auto ReadVectorImage<std::complex<float>>(const std::string &path) -> typename itk::VectorImage<std::complex<float>, 3>::Pointer;
+template auto ReadVectorImage<float>(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<float, 3>::Pointer;
+template auto ReadVectorImage<std::complex<float>>(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<std::complex<float>, 3>::Pointer;
 
 } // End namespace QUIT
 
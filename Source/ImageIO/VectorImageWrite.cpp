@@ -10,6 +10,8 @@
  */
 
 #include <string>
+#include <cstdio>
+#include <algorithm>
 
 #include "itkImageFileWriter.h"
 #include "itkComplexToModulusImageFilter.h"
@@ -18,23 +20,89 @@
 #include "VectorToImageFilter.h"
 
 #include "ImageIO.h"
+#include "ImageStreaming.h"
+#include "MemoryStore.h"
 #include "Macro.h"
+#include "Trace.h"
 
 namespace QI {
 
+namespace {
+    const size_t WriteChunkBytes = 64 * 1024 * 1024; // Volumes converted and written at once
+
+    bool EndsWith(const std::string &s, const std::string &end) {
+        return s.size() >= end.size() && s.compare(s.size() - end.size(), end.size(), end) == 0;
+    }
+
+    /*
+     * Uncompressed NIfTI can be written a region at a time, so instead of converting the whole
+     * image to 4D first, a chunk of volumes at a time is transposed out of the vector image and
+     * pasted into the file.
+     */
+    template<typename TVImg>
+    void WriteVolumes(const TVImg *img, const std::string &path) {
+        typedef typename TVImg::InternalPixelType TPixel;
+        typedef itk::Image<TPixel, 4> TSeries;
+        const TraceSpan span("io", "write", path);
+        const size_t nVols = img->GetNumberOfComponentsPerPixel();
+        const size_t nVox = img->GetBufferedRegion().GetNumberOfPixels();
+        const size_t chunk = std::min(nVols, std::max<size_t>(1, WriteChunkBytes / (nVox * sizeof(TPixel))));
+        typename TSeries::RegionType largest;
+        typename TSeries::SpacingType spacing;
+        typename TSeries::PointType origin;
+        typename TSeries::DirectionType direction;
+        spacing.Fill(1);
+        origin.Fill(0);
+        direction.SetIdentity();
+        for (int i = 0; i < 3; i++) {
+            largest.SetIndex(i, img->GetLargestPossibleRegion().GetIndex()[i]);
+            largest.SetSize(i, img->GetLargestPossibleRegion().GetSize()[i]);
+            spacing[i] = img->GetSpacing()[i];
+            origin[i] = img->GetOrigin()[i];
+            for (int j = 0; j < 3; j++) {
+                direction[i][j] = img->GetDirection()[i][j];
+            }
+        }
+        largest.SetIndex(3, 0);
+        largest.SetSize(3, nVols);
+        auto out = TSeries::New();
+        out->SetLargestPossibleRegion(largest);
+        out->SetSpacing(spacing);
+        out->SetOrigin(origin);
+        out->SetDirection(direction);
+        // The first paste creates the file, so one left by an earlier run must not be pasted into
+        std::remove(path.c_str());
+        for (size_t start = 0; start < nVols; start += chunk) {
+            typename TSeries::RegionType region = largest;
+            region.SetIndex(3, start);
+            region.SetSize(3, std::min(chunk, nVols - start));
+            out->SetBufferedRegion(region);
+            out->SetRequestedRegion(region);
+            out->Allocate();
+            itk::VectorToImageFilter<TVImg>::Transpose(img->GetBufferPointer(), nVox, nVols, start, region.GetSize()[3], out->GetBufferPointer());
+            PasteRegion<TSeries>(out, region, path);
+        }
+    }
+}
+
 template<typename TVImg>
-void WriteVectorImage(const TVImg *img, const std::string &path) {
+void WriteVectorImage(const TVImg *img, const std::string &path, const Storage storage) {
     using TToSeries = itk::VectorToImageFilter<TVImg>;
 
+    if (storage == Storage::Native && !IsMemoryPath(path) && EndsWith(path, ".nii") &&
+        img->GetBufferedRegion() == img->GetLargestPossibleRegion()) {
+        WriteVolumes(img, path);
+        return;
+    }
     typename TToSeries::Pointer convert = TToSeries::New();
     convert->SetInput(img);
     convert->Update();
-    WriteImage(convert->GetOutput(), path);
+    WriteImage(convert->GetOutput(), path, storage);
 }
 
 template<typename TVImg>
-void WriteVectorImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path) {
-    WriteVectorImage(ptr.GetPointer(), path);
+void WriteVectorImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path, const Storage storage) {
+    WriteVectorImage(ptr.GetPointer(), path, storage);
 }
 
 template<typename TVImg>
@@ -59,25 +127,25 @@ void WriteVectorMagnitudeImage(const itk::SmartPointer<TVImg> &ptr, const std::s
 }
 
 template<typename TVImg>
-void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path) {
+void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path, const Storage storage) {
     auto scaleFilter = itk::DivideImageFilter<TVImg, QI::VolumeF, TVImg>::New();
     scaleFilter->SetInput1(img);
     scaleFilter->SetInput2(simg);
     scaleFilter->Update();
-    WriteVectorImage(scaleFilter->GetOutput(), path);
+    WriteVectorImage(scaleFilter->GetOutput(), path, storage);
 }
 
 template<typename TVImg>
-void WriteScaledVectorImage(const itk::SmartPointer<TVImg> &ptr, const itk::SmartPointer<QI::VolumeF> &sptr, const std::string &path) {
-    WriteScaledVectorImage(ptr.GetPointer(), sptr.GetPointer(), path);
+void WriteScaledVectorImage(const itk::SmartPointer<TVImg> &ptr, const itk::SmartPointer<QI::VolumeF> &sptr, const std::string &path, const Storage storage) {
+    WriteScaledVectorImage(ptr.GetPointer(), sptr.GetPointer(), path, storage);
 }
 
-template void WriteVectorImage<VectorVolumeF>(const VectorVolumeF *img, const std::string &path);
-template void WriteVectorImage<VectorVolumeXF>(const VectorVolumeXF *img, const std::string &path);
-template void WriteVectorImage<VectorVolumeF>(const itk::SmartPointer<VectorVolumeF> &ptr, const std::string &path);
-template void WriteVectorImage<VectorVolumeXF>(const itk::SmartPointer<VectorVolumeXF> &ptr, const std::string &path);
+template void WriteVectorImage<VectorVolumeF>(const VectorVolumeF *img, const std::string &path, const Storage storage);
+template void WriteVectorImage<VectorVolumeXF>(const VectorVolumeXF *img, const std::string &path, const Storage storage);
+template void WriteVectorImage<VectorVolumeF>(const itk::SmartPointer<VectorVolumeF> &ptr, const std::string &path, const Storage storage);
+template void WriteVectorImage<VectorVolumeXF>(const itk::SmartPointer<VectorVolumeXF> &ptr, const std::string &path, const Storage storage);
 template void WriteVectorMagnitudeImage<VectorVolumeXF>(const VectorVolumeXF *ptr, const std::string &path);
 template void WriteVectorMagnitudeImage<VectorVolumeXF>(const itk::SmartPointer<VectorVolumeXF> &ptr, const std::string &path);
-template void WriteScaledVectorImage<VectorVolumeF>(const VectorVolumeF *img, const VolumeF *simg, const std::string &path);
-template void WriteScaledVectorImage<VectorVolumeF>(const itk::SmartPointer<VectorVolumeF> &ptr, const itk::SmartPointer<VolumeF> &sptr, const std::string &path);
+template void WriteScaledVectorImage<VectorVolumeF>(const VectorVolumeF *img, const VolumeF *simg, const std::string &path, const Storage storage);
+template void WriteScaledVectorImage<VectorVolumeF>(const itk::SmartPointer<VectorVolumeF> &ptr, const itk::SmartPointer<VolumeF> &sptr, const std::string &path, const Storage storage);
 } // End namespace QUIT
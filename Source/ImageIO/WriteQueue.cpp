@@ -0,0 +1,75 @@
+/*
+ *  WriteQueue.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <stdexcept>
+#include <algorithm>
+#include <sstream>
+
+#include "WriteQueue.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+/*
+ * The writers get their own pool rather than the global one, so queued writes can overlap
+ * with any later processing that is using the global pool.
+ */
+WriteQueue::WriteQueue(const size_t nThreads) :
+    m_pool(new ThreadPool(nThreads > 0 ? nThreads : std::max(1u, std::thread::hardware_concurrency())))
+{}
+
+WriteQueue::~WriteQueue() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this]{ return m_pending == 0; });
+}
+
+void WriteQueue::enqueue(const std::string &path, std::function<void ()> &&write) {
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_pending++;
+    }
+    // The path and the write together are too big for the pool's queue, so they go in one function
+    std::function<void ()> task = [this, path, write] {
+        std::string error;
+        try {
+            write();
+        } catch (const std::exception &e) {
+            error = e.what();
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!error.empty()) {
+            m_errors.push_back(path + ": " + error);
+        }
+        if (--m_pending == 0) {
+            m_done.notify_all();
+        }
+    };
+    m_pool->enqueue(std::move(task));
+}
+
+void WriteQueue::wait() {
+    std::vector<std::string> errors;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this]{ return m_pending == 0; });
+        errors.swap(m_errors);
+    }
+    if (!errors.empty()) {
+        std::ostringstream joined;
+        for (const std::string &e : errors) {
+            joined << e << "\n";
+        }
+        QI_EXCEPTION("Failed to write " << errors.size() << " output images:\n" << joined.str());
+    }
+}
+
+} // End namespace QI
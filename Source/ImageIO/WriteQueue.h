@@ -0,0 +1,91 @@
+/*
+ *  WriteQueue.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QUIT_WRITEQUEUE_H
+#define QUIT_WRITEQUEUE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+#include "ImageTypes.h"
+#include "ImageIO.h"
+
+namespace QI {
+
+class ThreadPool;
+
+/*
+ * Writes finished output images on background threads, so the maps of a fit are written (and
+ * compressed) concurrently instead of one after another. Each image is grafted onto a new
+ * image without a source before it is queued, so the writers never touch the upstream
+ * pipeline, but the pixel buffers are shared and must not be modified until wait() returns.
+ */
+class WriteQueue {
+public:
+    WriteQueue(const size_t nThreads = 0); // 0 = hardware limit
+    ~WriteQueue(); // Waits, but ignores failures, call wait() to see them
+
+    template<typename TImg> void WriteImage(const TImg *img, const std::string &path);
+    template<typename TImg> void WriteScaledImage(const TImg *img, const QI::VolumeF *simg, const std::string &path);
+    template<typename TVImg> void WriteVectorImage(const TVImg *img, const std::string &path, const Storage storage = Storage::Native);
+    template<typename TVImg> void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path, const Storage storage = Storage::Native);
+
+    void wait(); // Blocks until every queued write has finished, and throws if any failed
+
+protected:
+    size_t m_pending = 0;
+    std::vector<std::string> m_errors; // One per failed write, with its path
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::unique_ptr<ThreadPool> m_pool; // Last, so it is joined before the members above go
+
+    void enqueue(const std::string &path, std::function<void ()> &&write);
+
+    template<typename TImg> static typename TImg::Pointer Detach(const TImg *img) {
+        typename TImg::Pointer copy = TImg::New();
+        copy->Graft(img);
+        return copy;
+    }
+};
+
+template<typename TImg>
+void WriteQueue::WriteImage(const TImg *img, const std::string &path) {
+    typename TImg::Pointer copy = Detach(img);
+    enqueue(path, [copy, path] { QI::WriteImage(copy.GetPointer(), path); });
+}
+
+template<typename TImg>
+void WriteQueue::WriteScaledImage(const TImg *img, const QI::VolumeF *simg, const std::string &path) {
+    typename TImg::Pointer copy = Detach(img);
+    QI::VolumeF::Pointer scale = Detach(simg);
+    enqueue(path, [copy, scale, path] { QI::WriteScaledImage(copy.GetPointer(), scale.GetPointer(), path); });
+}
+
+template<typename TVImg>
+void WriteQueue::WriteVectorImage(const TVImg *img, const std::string &path, const Storage storage) {
+    typename TVImg::Pointer copy = Detach(img);
+    enqueue(path, [copy, path, storage] { QI::WriteVectorImage(copy.GetPointer(), path, storage); });
+}
+
+template<typename TVImg>
+void WriteQueue::WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path, const Storage storage) {
+    typename TVImg::Pointer copy = Detach(img);
+    QI::VolumeF::Pointer scale = Detach(simg);
+    enqueue(path, [copy, scale, path, storage] { QI::WriteScaledVectorImage(copy.GetPointer(), scale.GetPointer(), path, storage); });
+}
+
+} // End namespace QI
+
+#endif // QUIT_WRITEQUEUE_H
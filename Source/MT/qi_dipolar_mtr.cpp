@@ -13,10 +13,25 @@
 #include <string>
 
 #include "ApplyTypes.h"
+#include "ElementwiseMap.h"
+#include "ThreadPool.h"
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
 
+/*
+ * Inputs are Sat+, Sat+-, Unsat, Sat-+, Sat-. Works on single voxels or on Eigen arrays of them.
+ */
+template<typename TIn, typename TOut>
+void DMTRKernel(const TIn &sp, const TIn &spm, const TIn &u, const TIn &smp, const TIn &sm,
+                TOut &mtr, TOut &emtr, TOut &dmtr, TOut &mta)
+{
+    mtr  = 100.f * (1.f - (smp + sm) / (2.f * u));
+    emtr = 100.f * (1.f - (sp + spm) / (2.f * u));
+    dmtr = emtr - mtr;
+    mta  = 100.f * (1.f - (smp - sm) / u);
+}
+
 class DMTR : public QI::ApplyF::Algorithm {
 public:
     size_t numInputs() const override { return 1; }
@@ -38,10 +53,8 @@ public:
                std::vector<TOutput> &outputs, TConst &residual,
                TInput &resids, TIterations &its) const override
     {
-        outputs[0] = 100. * (1. - (inputs[0][3] + inputs[0][4]) / (2. * inputs[0][2]));
-        outputs[1] = 100. * (1. - (inputs[0][0] + inputs[0][1]) / (2. * inputs[0][2]));
-        outputs[2] = outputs[1] - outputs[0];
-        outputs[3] = 100. * (1. - (inputs[0][3] - inputs[0][4]) / inputs[0][2]);
+        DMTRKernel(inputs[0][0], inputs[0][1], inputs[0][2], inputs[0][3], inputs[0][4],
+                   outputs[0], outputs[1], outputs[2], outputs[3]);
         return true;
     }
 };
@@ -56,35 +69,81 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> out_prefix(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
-    if (verbose) std::cout << "Opening MT file " << QI::CheckPos(input_file) << std::endl;
-    auto volumes = QI::ReadVectorImage(QI::CheckPos(input_file));
     auto algo = std::make_shared<DMTR>();
+    const std::string outPrefix = out_prefix.Get() + "DMT_";
+    if (!subregion.requested() && !checkpoint.checkpoint && !checkpoint.shard) {
+        // Nothing needs the voxel-by-voxel filter, so work straight through the contiguous volumes
+        QI::ThreadPool::SetGlobalThreads(threads.Get());
+        if (verbose) std::cout << "Opening MT file " << QI::CheckPos(input_file) << std::endl;
+        auto series = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_file));
+        if (series->GetLargestPossibleRegion().GetSize()[3] != algo->dataSize()) {
+            QI_FAIL("Input file " << input_file.Get() << " must have " << algo->dataSize() << " volumes");
+        }
+        QI::VolumeF::Pointer mask_img = mask ? QI::ReadImage(mask.Get()) : QI::VolumeF::Pointer();
+        std::vector<QI::VolumeF::Pointer> outputs;
+        for (size_t o = 0; o < algo->numOutputs(); o++) {
+            outputs.push_back(QI::NewVolumeLike(series));
+        }
+        if (verbose) std::cout << "Processing" << std::endl;
+        QI::ElementwiseMap(QI::VoxelsPerVolume(series), [&](const size_t i, const size_t len) {
+            auto mtr = QI::VolumeBlock(outputs[0], i, len);
+            auto emtr = QI::VolumeBlock(outputs[1], i, len);
+            auto dmtr = QI::VolumeBlock(outputs[2], i, len);
+            auto mta = QI::VolumeBlock(outputs[3], i, len);
+            DMTRKernel(QI::VolumeBlock(series, 0, i, len), QI::VolumeBlock(series, 1, i, len), QI::VolumeBlock(series, 2, i, len),
+                       QI::VolumeBlock(series, 3, i, len), QI::VolumeBlock(series, 4, i, len), mtr, emtr, dmtr, mta);
+            if (mask_img) {
+                const Eigen::ArrayXf inside = (QI::VolumeBlock(mask_img, i, len) > 0.f).cast<float>();
+                for (auto &o : outputs) {
+                    QI::VolumeBlock(o, i, len) *= inside;
+                }
+            }
+        });
+        for (size_t o = 0; o < algo->numOutputs(); o++) {
+            if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(o) + QI::OutExt() << std::endl;
+            QI::WriteImage(outputs[o], outPrefix + algo->names().at(o) + QI::OutExt());
+        }
+        if (verbose) std::cout << "Finished." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    if (verbose) std::cout << "Opening MT file " << QI::CheckPos(input_file) << std::endl;
+    auto volumes = QI::ReadVectorImage(QI::CheckPos(input_file), subregion.region());
     auto apply = QI::ApplyF::New();
     apply->SetAlgorithm(algo);
     apply->SetPoolsize(threads.Get());
     apply->SetInput(0, volumes);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, out_prefix.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
     }
-    std::string outPrefix = out_prefix.Get() + "DMT_";
     for (int i = 0; i < algo->numOutputs(); i++) {
         if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
         QI::WriteImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
     }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
@@ -10,6 +10,8 @@
  */
 
 #include <iostream>
+#include <vector>
+#include <string>
 #include <Eigen/Dense>
 #include "ceres/ceres.h"
 
@@ -18,38 +20,150 @@
 #include "ImageIO.h"
 #include "IO.h"
 #include "ApplyTypes.h"
+#include "Fit.h"
 #include "EigenCereal.h"
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
 
-Eigen::ArrayXd Lorentzian(const double f0, const double fwhm, const double A, const Eigen::ArrayXd &f) {
-    Eigen::ArrayXd x = (f0 - f) / (fwhm/2);
-    Eigen::ArrayXd s = A / (1. + x.square());
-    return s;
-}
-
-class ZCost {
+/*
+ * Residuals of PD * (1 - L(f)) against the Z-spectrum, with the Jacobian worked out by hand. The
+ * number of parameters is fixed, so Ceres can size everything at compile time, and only the number
+ * of residuals depends on the frequency window.
+ */
+class ZCost : public ceres::SizedCostFunction<ceres::DYNAMIC, 4> {
 private:
-    Eigen::ArrayXd m_frqs, m_zspec;
+    const Eigen::ArrayXd m_frqs;
+    const Eigen::ArrayXd &m_zspec;
 public:
 
     ZCost(const Eigen::ArrayXd &f, const Eigen::ArrayXd &z) :
           m_frqs(f), m_zspec(z)
-    {}
+    {
+        set_num_residuals(m_frqs.size());
+    }
+
+    bool Evaluate(double const* const* parameters, double* resids, double** jacobians) const override {
+        const double *p = parameters[0];
+        const double f0 = p[0], fwhm = p[1], A = p[2], PD = p[3];
+        for (Eigen::Index i = 0; i < m_frqs.size(); i++) {
+            const double x = (f0 - m_frqs[i]) / (fwhm/2.);
+            const double d = 1. / (1. + x*x);
+            const double L = A * d;
+            resids[i] = PD * (1. - L) - m_zspec[i];
+            if (jacobians && jacobians[0]) {
+                double *J = jacobians[0] + 4*i;
+                const double dLdx = -2. * A * x * d * d;
+                J[0] = -PD * dLdx * 2. / fwhm;
+                J[1] =  PD * dLdx * x / fwhm;
+                J[2] = -PD * d;
+                J[3] = 1. - L;
+            }
+        }
+        return true;
+    }
+};
+
+/*
+ * As ZCost, but for the sum of NP Lorentzian pools sharing one PD. Parameters are PD, then the
+ * f0, FWHM and amplitude of each pool in turn, with water first.
+ */
+template<int NP>
+class MultiZCost : public ceres::SizedCostFunction<ceres::DYNAMIC, 1 + 3*NP> {
+private:
+    const Eigen::ArrayXd m_frqs;
+    const Eigen::ArrayXd &m_zspec;
+public:
+
+    MultiZCost(const Eigen::ArrayXd &f, const Eigen::ArrayXd &z) :
+          m_frqs(f), m_zspec(z)
+    {
+        this->set_num_residuals(m_frqs.size());
+    }
 
-    bool operator() (double const* const* p, double* resids) const {
-        const Eigen::ArrayXd L = Lorentzian(p[0][0], p[0][1], p[0][2], m_frqs);
-        const Eigen::ArrayXd invL = p[0][3] * (1. - L);
-        Eigen::Map<Eigen::ArrayXd> r(resids, m_frqs.size());
-        r = (invL - m_zspec);
+    bool Evaluate(double const* const* parameters, double* resids, double** jacobians) const override {
+        const double *p = parameters[0];
+        const double PD = p[0];
+        for (Eigen::Index i = 0; i < m_frqs.size(); i++) {
+            double *J = (jacobians && jacobians[0]) ? jacobians[0] + (1 + 3*NP)*i : nullptr;
+            double sum = 0;
+            for (int k = 0; k < NP; k++) {
+                const double f0 = p[1 + 3*k], fwhm = p[2 + 3*k], A = p[3 + 3*k];
+                const double x = (f0 - m_frqs[i]) / (fwhm/2.);
+                const double d = 1. / (1. + x*x);
+                sum += A * d;
+                if (J) {
+                    const double dLdx = -2. * A * x * d * d;
+                    J[1 + 3*k] = -PD * dLdx * 2. / fwhm;
+                    J[2 + 3*k] =  PD * dLdx * x / fwhm;
+                    J[3 + 3*k] = -PD * d;
+                }
+            }
+            resids[i] = PD * (1. - sum) - m_zspec[i];
+            if (J) {
+                J[0] = 1. - sum;
+            }
+        }
         return true;
     }
 };
 
+/*
+ * Starting values and bounds for one of the extra pools. Frequencies are relative to water, so
+ * they follow the B0 shift found by the water fit.
+ */
+struct Pool {
+    std::string name;
+    double f0, fwhm, A;
+    double f0_min, f0_max, fwhm_min, fwhm_max;
+
+    template<typename Archive>
+    void serialize(Archive &ar) {
+        ar(CEREAL_NVP(name), CEREAL_NVP(f0), CEREAL_NVP(fwhm), CEREAL_NVP(A),
+           CEREAL_NVP(f0_min), CEREAL_NVP(f0_max), CEREAL_NVP(fwhm_min), CEREAL_NVP(fwhm_max));
+    }
+};
+
 class LorentzFit : public QI::ApplyF::Algorithm {
 protected:
     Eigen::ArrayXd m_zfrqs;
+    Eigen::ArrayXf::Index m_start, m_size; // Only fit the Lorentzian between -2 and +2 PPM
+
+    // The problem is built once per thread, each voxel only reloads the Z-spectrum
+    struct Context {
+        Eigen::ArrayXd zspec;
+        Eigen::Array4d p;
+        ceres::Problem problem;
+        ceres::Solver::Options options;
+
+        Context(const Eigen::ArrayXd &frqs) : zspec(frqs.size()) {
+            problem.AddResidualBlock(new ZCost(frqs, zspec), NULL, p.data());
+            problem.SetParameterLowerBound(p.data(), 0, -2.0);
+            problem.SetParameterUpperBound(p.data(), 0, 2.0);
+            problem.SetParameterLowerBound(p.data(), 1, 0.001);
+            problem.SetParameterUpperBound(p.data(), 1, 100.0);
+            problem.SetParameterLowerBound(p.data(), 2, 0.1);
+            problem.SetParameterUpperBound(p.data(), 2, 1.0);
+            problem.SetParameterLowerBound(p.data(), 3, 0.1);
+            problem.SetParameterUpperBound(p.data(), 3, 10.0);
+            options.max_num_iterations = 50;
+            options.function_tolerance = 1e-5;
+            options.gradient_tolerance = 1e-6;
+            options.parameter_tolerance = 1e-4;
+        }
+    };
+    QI::PerThread<Context> m_contexts{[this]{ return new Context(m_zfrqs.segment(m_start, m_size).cast<double>()); }};
 
 public:
-    LorentzFit(const Eigen::ArrayXd &zf) : m_zfrqs(zf) { }
+    LorentzFit(const Eigen::ArrayXd &zf) : m_zfrqs(zf) {
+        // Find closest indices to -2/+2 PPM
+        Eigen::ArrayXf::Index indP2, indM2;
+        (m_zfrqs + 2.0).abs().minCoeff(&indM2);
+        (m_zfrqs - 2.0).abs().minCoeff(&indP2);
+        if (indM2 > indP2)
+            std::swap(indM2, indP2);
+        m_start = indM2;
+        m_size = indP2 - indM2;
+    }
     size_t numInputs() const override { return 1; }
     size_t numConsts() const override { return 0; }
     size_t numOutputs() const override { return 4; }
@@ -60,53 +174,153 @@ public:
         return def;
     }
     TOutput zero() const override { return 0; }
-    const std::vector<std::string> & names() const {
+    virtual const std::vector<std::string> & names() const {
         static std::vector<std::string> _names = {"f0", "w", "sat", "PD"};
         return _names;
     }
+
+    // Fits water between -2 and +2 PPM, returns f0, w, sat and PD (scaled back) and the cost
+    Eigen::Array4d fitWater(const Eigen::Map<const Eigen::ArrayXf> &z_spec, double &cost) const {
+        const double scale = z_spec.segment(m_start, m_size).maxCoeff();
+        Context &ctx = m_contexts.get();
+        ctx.zspec = z_spec.segment(m_start, m_size).cast<double>() / scale;
+        Eigen::Array4d &p = ctx.p;
+        p << 0.0, 2.0, 0.9, 2.0;
+        ceres::Solver::Summary summary;
+        ceres::Solve(ctx.options, &ctx.problem, &summary);
+        cost = summary.final_cost;
+        return Eigen::Array4d(p[0], p[1], p[2], p[3] * scale);
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override
     {
         const Eigen::Map<const Eigen::ArrayXf> z_spec(inputs[0].GetDataPointer(), m_zfrqs.size());
+        double cost;
+        const Eigen::Array4d p = fitWater(z_spec, cost);
+        for (int i = 0; i < 4; i++) {
+            outputs.at(i) = p[i];
+        }
+        residual = cost;
+        return true;
+    }
+};
 
-        // Find closest indices to -2/+2 PPM and only fit Lorentzian between them
-        Eigen::ArrayXf::Index indP2, indM2;
-        (m_zfrqs + 2.0).abs().minCoeff(&indM2);
-        (m_zfrqs - 2.0).abs().minCoeff(&indP2);
-        if (indM2 > indP2)
-            std::swap(indM2, indP2);
-        Eigen::ArrayXf::Index sz = indP2 - indM2;
-        const double scale = z_spec.segment(indM2,sz).maxCoeff();
-        auto *cost = new ceres::DynamicNumericDiffCostFunction<ZCost>(new ZCost(m_zfrqs.segment(indM2,sz).cast<double>(), z_spec.segment(indM2,sz).cast<double>() / scale));
-        cost->AddParameterBlock(4);
-        cost->SetNumResiduals(sz);
-        Eigen::Array4d p{0.0, 2.0, 0.9, 2.0};
+/*
+ * Fits water and NP - 1 other pools (e.g. MT, APT, NOE) to the whole Z-spectrum. Each voxel
+ * starts from the single-pool water fit, which also sets the B0 shift for the other pools.
+ */
+template<int NP>
+class MultiLorentzFit : public LorentzFit {
+protected:
+    typedef Eigen::Matrix<double, 1 + 3*NP, 1> TParameters;
+    std::vector<Pool> m_pools;
+    std::vector<std::string> m_names;
+
+    struct MultiContext {
+        Eigen::ArrayXd zspec;
+        TParameters p;
         ceres::Problem problem;
-        problem.AddResidualBlock(cost, NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, -2.0);
-        problem.SetParameterUpperBound(p.data(), 0, 2.0);
-        problem.SetParameterLowerBound(p.data(), 1, 0.001);
-        problem.SetParameterUpperBound(p.data(), 1, 100.0);
-        problem.SetParameterLowerBound(p.data(), 2, 0.1);
-        problem.SetParameterUpperBound(p.data(), 2, 1.0);
-        problem.SetParameterLowerBound(p.data(), 3, 0.1);
-        problem.SetParameterUpperBound(p.data(), 3, 10.0);
         ceres::Solver::Options options;
+
+        MultiContext(const Eigen::ArrayXd &frqs, const std::vector<Pool> &pools) : zspec(frqs.size()) {
+            problem.AddResidualBlock(new MultiZCost<NP>(frqs, zspec), NULL, p.data());
+            problem.SetParameterLowerBound(p.data(), 0, 0.1);
+            problem.SetParameterUpperBound(p.data(), 0, 10.0);
+            problem.SetParameterLowerBound(p.data(), 1, -2.0);
+            problem.SetParameterUpperBound(p.data(), 1, 2.0);
+            problem.SetParameterLowerBound(p.data(), 2, 0.001);
+            problem.SetParameterUpperBound(p.data(), 2, 100.0);
+            problem.SetParameterLowerBound(p.data(), 3, 0.1);
+            problem.SetParameterUpperBound(p.data(), 3, 1.0);
+            for (int k = 1; k < NP; k++) {
+                problem.SetParameterLowerBound(p.data(), 2 + 3*k, pools[k - 1].fwhm_min);
+                problem.SetParameterUpperBound(p.data(), 2 + 3*k, pools[k - 1].fwhm_max);
+                problem.SetParameterLowerBound(p.data(), 3 + 3*k, 0.0);
+                problem.SetParameterUpperBound(p.data(), 3 + 3*k, 1.0);
+            }
+            options.max_num_iterations = 100;
+            options.function_tolerance = 1e-6;
+            options.gradient_tolerance = 1e-7;
+            options.parameter_tolerance = 1e-5;
+        }
+    };
+    QI::PerThread<MultiContext> m_multi{[this]{ return new MultiContext(m_zfrqs, m_pools); }};
+
+public:
+    MultiLorentzFit(const Eigen::ArrayXd &zf, const std::vector<Pool> &pools) :
+        LorentzFit(zf), m_pools(pools), m_names(LorentzFit::names())
+    {
+        if (m_pools.size() != NP - 1) {
+            QI_FAIL("Expected " << NP - 1 << " extra pools, got " << m_pools.size());
+        }
+        for (const auto &pool : m_pools) {
+            for (const auto &par : {"_f0", "_w", "_A"}) {
+                m_names.push_back(pool.name + par);
+            }
+        }
+    }
+    size_t numOutputs() const override { return 1 + 3*NP; }
+    const std::vector<std::string> & names() const override { return m_names; }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TOutput &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        const Eigen::Map<const Eigen::ArrayXf> z_spec(inputs[0].GetDataPointer(), m_zfrqs.size());
+        double cost;
+        const Eigen::Array4d water = fitWater(z_spec, cost);
+        const double scale = z_spec.maxCoeff();
+        MultiContext &ctx = m_multi.get();
+        ctx.zspec = z_spec.cast<double>() / scale;
+        TParameters &p = ctx.p;
+        p[0] = water[3] / scale;
+        p[1] = water[0];
+        p[2] = water[1];
+        p[3] = water[2];
+        for (int k = 1; k < NP; k++) {
+            const Pool &pool = m_pools[k - 1];
+            p[1 + 3*k] = water[0] + pool.f0;
+            p[2 + 3*k] = pool.fwhm;
+            p[3 + 3*k] = pool.A;
+            ctx.problem.SetParameterLowerBound(p.data(), 1 + 3*k, water[0] + pool.f0_min);
+            ctx.problem.SetParameterUpperBound(p.data(), 1 + 3*k, water[0] + pool.f0_max);
+        }
+        // The water fit only saw part of the spectrum, so make sure it starts inside the bounds
+        p = p.cwiseMax(lowerBounds(ctx)).cwiseMin(upperBounds(ctx));
         ceres::Solver::Summary summary;
-        options.max_num_iterations = 50;
-        options.function_tolerance = 1e-5;
-        options.gradient_tolerance = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        ceres::Solve(options, &problem, &summary);
-        outputs.at(0) = p[0];
-        outputs.at(1) = p[1];
-        outputs.at(2) = p[2];
-        outputs.at(3) = p[3] * scale;
+        ceres::Solve(ctx.options, &ctx.problem, &summary);
+        outputs.at(0) = p[1];
+        outputs.at(1) = p[2];
+        outputs.at(2) = p[3];
+        outputs.at(3) = p[0] * scale;
+        for (int k = 1; k < NP; k++) {
+            outputs.at(1 + 3*k) = p[1 + 3*k] - p[1];
+            outputs.at(2 + 3*k) = p[2 + 3*k];
+            outputs.at(3 + 3*k) = p[3 + 3*k];
+        }
         residual = summary.final_cost;
         return true;
     }
+
+protected:
+    TParameters lowerBounds(MultiContext &ctx) const {
+        TParameters b;
+        for (int i = 0; i < b.rows(); i++) {
+            b[i] = ctx.problem.GetParameterLowerBound(ctx.p.data(), i);
+        }
+        return b;
+    }
+    TParameters upperBounds(MultiContext &ctx) const {
+        TParameters b;
+        for (int i = 0; i < b.rows(); i++) {
+            b[i] = ctx.problem.GetParameterUpperBound(ctx.p.data(), i);
+        }
+        return b;
+    }
 };
 
 
@@ -120,30 +334,52 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> outarg(parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    args::Flag     pools(parser, "POOLS", "Also fit the extra pools listed in the input to the whole spectrum", {'p', "pools"});
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     if (verbose) std::cout << "Opening file: " << QI::CheckPos(input_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path), subregion.region());
 
     cereal::JSONInputArchive input(std::cin);
     if (verbose) std::cout << "Enter Z-Spectrum Frequencies: " << std::endl;
     Eigen::ArrayXd z_frqs; QI::ReadCereal(input, "freq", z_frqs);
-    std::shared_ptr<LorentzFit> algo = std::make_shared<LorentzFit>(z_frqs);
+    std::shared_ptr<LorentzFit> algo;
+    if (pools) {
+        std::vector<Pool> extra; QI::ReadCereal(input, "pools", extra);
+        if (verbose) std::cout << "Fitting water and " << extra.size() << " extra pools" << std::endl;
+        switch (extra.size()) {
+        case 1: algo = std::make_shared<MultiLorentzFit<2>>(z_frqs, extra); break;
+        case 2: algo = std::make_shared<MultiLorentzFit<3>>(z_frqs, extra); break;
+        case 3: algo = std::make_shared<MultiLorentzFit<4>>(z_frqs, extra); break;
+        case 4: algo = std::make_shared<MultiLorentzFit<5>>(z_frqs, extra); break;
+        default: QI_FAIL("Between 1 and 4 extra pools are supported, input had " << extra.size());
+        }
+    } else {
+        algo = std::make_shared<LorentzFit>(z_frqs);
+    }
     auto apply = QI::ApplyF::New();
     apply->SetAlgorithm(algo);
     apply->SetPoolsize(threads.Get());
     apply->SetInput(0, data);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
+    apply->SetOutputResidual(true);
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing output." << std::endl;
@@ -153,6 +389,9 @@ int main(int argc, char **argv) {
         QI::WriteImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
     }
     QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
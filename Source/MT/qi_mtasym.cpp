@@ -19,17 +19,28 @@
 #include "Spline.h"
 #include "ApplyTypes.h"
 
+/*
+ * Every voxel shares the same Z-spectrum frequencies, so the spline weights are built once and
+ * the asymmetry becomes a matrix-vector product per voxel. With no f0 shift the whole asymmetry
+ * matrix is precomputed, otherwise it is assembled from the resampled weights for each voxel.
+ */
 class MTAsym : public QI::ApplyVectorF::Algorithm {
 protected:
     Eigen::ArrayXd m_zfrqs, m_afrqs;
+    QI::SplineWeights m_weights;
+    Eigen::MatrixXd m_asym; // Positive minus negative offset weights for f0 = 0
     TOutput m_zero;
     
 public:
     MTAsym(const Eigen::ArrayXf &zf, const Eigen::ArrayXf &af) :
-        m_zfrqs(zf.cast<double>()), m_afrqs(af.cast<double>())
+        m_zfrqs(zf.cast<double>()), m_afrqs(af.cast<double>()), m_weights(m_zfrqs)
     {
+        m_asym = asymmetry(0.);
         m_zero = TOutput(m_afrqs.rows()); m_zero.Fill(0.);
     }
+    Eigen::MatrixXd asymmetry(const double f0) const {
+        return m_weights(m_afrqs - f0) - m_weights(f0 - m_afrqs);
+    }
     size_t numInputs() const override { return 1; }
     size_t numConsts() const override { return 1; }
     size_t numOutputs() const override { return 1; }
@@ -53,16 +64,12 @@ public:
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override
     {
-        const Eigen::Map<const Eigen::ArrayXf> zdata(inputs[0].GetDataPointer(), m_zfrqs.rows());
-        QI::SplineInterpolator zspec(m_zfrqs, zdata.cast<double>());
-        double ref = zdata[0];
-        double f0 = consts.at(0);
+        const Eigen::Map<const Eigen::VectorXf> zdata(inputs[0].GetDataPointer(), m_zfrqs.rows());
+        const double ref = zdata[0];
+        const double f0 = consts.at(0);
+        const Eigen::VectorXd asym = ((f0 == 0.) ? m_asym : asymmetry(f0)) * zdata.cast<double>();
         for (int f = 0; f < m_afrqs.rows(); f++) {
-            const double pfrq = m_afrqs[f] - f0;
-            const double nfrq = f0 - m_afrqs[f];
-            const double pos = zspec(pfrq);
-            const double neg = zspec(nfrq);
-            outputs.at(0)[f] = ((pos - neg)/ref);
+            outputs.at(0)[f] = asym[f] / ref;
         }
         return true;
     }
@@ -80,11 +87,12 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> f0(parser, "OFF RESONANCE", "Specify off-resonance frequency", {'f', "f0"});
-    args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     if (verbose) std::cout << "Opening file: " << QI::CheckPos(input_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path), subregion.region());
 
     if (verbose) std::cout << "Enter Z-Spectrum Frequencies: " << std::endl;
     Eigen::ArrayXf z_frqs; QI::ReadArray(std::cin, z_frqs);
@@ -97,21 +105,27 @@ int main(int argc, char **argv) {
     apply->SetInput(0, data);
     if (mask) {
         if (verbose) std::cout << "Setting mask image: " << mask.Get() << std::endl;
-        apply->SetMask(QI::ReadImage(mask.Get()));
+        apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
     }
     if (f0) {
         if (verbose) std::cout << "Setting f0 image: " << f0.Get() << std::endl;
-        apply->SetConst(0, QI::ReadImage(f0.Get()));
-    }
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
+        apply->SetConst(0, QI::ReadImage(f0.Get(), subregion.region()));
     }
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing output." << std::endl;
@@ -120,7 +134,9 @@ int main(int argc, char **argv) {
     for (int i = 0; i < algo->numOutputs(); i++) {
         QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
     }
-    
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
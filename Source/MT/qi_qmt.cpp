@@ -0,0 +1,315 @@
+/*
+ *  qi_qmt.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <limits>
+#include <Eigen/Dense>
+#include "ceres/ceres.h"
+
+#include "Util.h"
+#include "ImageIO.h"
+#include "Args.h"
+#include "RegionFit.h"
+#include "qMT.h"
+#include "Lineshape.h"
+#include "ApplyTypes.h"
+#include "SPGRSequence.h"
+#include "SequenceCereal.h"
+#include "Fit.h"
+
+/*
+ * Everything in the signal that does not depend on the free parameters, once per voxel. The
+ * saturation offsets include the voxel's f0 and the saturation power is scaled by its B1.
+ */
+struct QMTTerms {
+    Eigen::ArrayXd offsets;  // sat_f0 + f0
+    Eigen::ArrayXd omega2;   // (B1 * omega_cwpe)^2
+    Eigen::ArrayXd ratio;    // (B1 * omega_cwpe / (2 pi offset))^2, the direct saturation of the free pool
+    double R1obs = 1.0, R1r = 1.0;
+};
+
+/*
+ * The signal of MT_SPGR in Signals/SPGR.cpp with the constant terms taken from QMTTerms. R1f is
+ * not free, it follows from the observed R1 and the exchange (Henkelman et al 1993), which leaves
+ * PD, T2f, T2r, kf and F.
+ */
+class QMTFunctor {
+private:
+    const Eigen::ArrayXd &m_data;
+    const QMTTerms &m_terms;
+    const QI::TabulatedLineshape &m_lineshape;
+
+public:
+    QMTFunctor(const Eigen::ArrayXd &d, const QMTTerms &t, const QI::TabulatedLineshape &g) :
+        m_data(d), m_terms(t), m_lineshape(g)
+    {}
+
+    static double R1f(const QMTTerms &t, const double kf, const double F) {
+        return t.R1obs - kf * (t.R1r - t.R1obs) / (t.R1r - t.R1obs + kf / F);
+    }
+
+    // Signal for PD = 1, so the best PD for the other parameters has a closed form
+    static bool signal(const QMTTerms &t, const QI::TabulatedLineshape &g, const double T2f, const double T2r,
+                       const double kf, const double F, Eigen::ArrayXd &s) {
+        const double R1f = QMTFunctor::R1f(t, kf, F);
+        if (!(R1f > 0)) return false;
+        const double R1r = t.R1r;
+        const double kr = kf / F;
+        const Eigen::ArrayXd W = t.omega2 * g(t.offsets, T2r);
+        s = F * (R1r*kr/R1f + W + R1r + kr) /
+            (kf*(R1r + W) + (1.0 + t.ratio / (R1f * T2f))*(W + R1r + kr));
+        return true;
+    }
+
+    bool operator()(const double *const p, double *r) const {
+        Eigen::ArrayXd s;
+        if (!signal(m_terms, m_lineshape, p[1], p[2], p[3], p[4], s)) return false;
+        Eigen::Map<Eigen::ArrayXd>(r, m_data.size()) = p[0] * s - m_data;
+        return true;
+    }
+};
+
+class QMTAlgo : public QI::ApplyF::Algorithm {
+protected:
+    QI::SPGRMTSequence m_sequence;
+    QI::TabulatedLineshape m_lineshape;
+    Eigen::ArrayXd m_omega2;  // omega_cwpe^2 at nominal B1
+    Eigen::ArrayXd m_ratio;   // omega_cwpe^2 / (2 pi sat_f0)^2 at nominal B1 and f0
+    Eigen::ArrayXXd m_bounds; // PD, T2f, T2r, kf, F
+    Eigen::ArrayXd m_start;
+    double m_T1r;
+    bool m_debug = false;
+
+    // The problem is built once per thread, each voxel only reloads the data and its QMTTerms
+    struct Context {
+        Eigen::ArrayXd data;
+        QMTTerms terms;
+        Eigen::Matrix<double, 5, 1> p;
+        ceres::Problem problem;
+        ceres::Solver::Options options;
+
+        Context(const QMTAlgo &algo) : data(algo.m_sequence.size()) {
+            terms.R1r = 1. / algo.m_T1r;
+            auto *cost = new ceres::NumericDiffCostFunction<QMTFunctor, ceres::CENTRAL, ceres::DYNAMIC, 5>(
+                new QMTFunctor(data, terms, algo.m_lineshape), ceres::TAKE_OWNERSHIP, data.size());
+            problem.AddResidualBlock(cost, NULL, p.data());
+            for (int i = 0; i < 5; i++) {
+                problem.SetParameterLowerBound(p.data(), i, algo.m_bounds(i, 0));
+                if (std::isfinite(algo.m_bounds(i, 1))) problem.SetParameterUpperBound(p.data(), i, algo.m_bounds(i, 1));
+            }
+            options.max_num_iterations = 50;
+            options.function_tolerance = 1e-6;
+            options.gradient_tolerance = 1e-7;
+            options.parameter_tolerance = 1e-5;
+            if (!algo.m_debug && !QI::SolverTrace()) options.logging_type = ceres::SILENT;
+            options.minimizer_progress_to_stdout = QI::SolverTrace();
+        }
+    };
+    QI::PerThread<Context> m_contexts{[this]{ return new Context(*this); }};
+
+public:
+    QMTAlgo(const QI::SPGRMTSequence &s, const QI::TabulatedLineshape &g, const double T1r, const bool d) :
+        m_sequence(s), m_lineshape(g), m_T1r(T1r), m_debug(d)
+    {
+        m_omega2 = m_sequence.omega_cwpe().square();
+        m_ratio = m_omega2 / (2. * M_PI * m_sequence.sat_f0).square();
+        const QI::qMT model;
+        const Eigen::ArrayXXd b = model.Bounds(QI::FieldStrength::Three);
+        const Eigen::ArrayXd def = model.Default(QI::FieldStrength::Three);
+        m_bounds.resize(5, 2);
+        m_start.resize(5);
+        m_bounds.row(0) << 0., std::numeric_limits<double>::infinity(); // Data is scaled to its maximum
+        m_start[0] = 1.;
+        const int index[4] = {2, 4, 5, 6}; // T2f, T2r, kf and F in the model
+        for (int i = 0; i < 4; i++) {
+            m_bounds.row(i + 1) = b.row(index[i]);
+            m_start[i + 1] = def[index[i]];
+        }
+    }
+
+    size_t numInputs() const override  { return 1; }
+    size_t numConsts() const override  { return 3; }
+    size_t numOutputs() const override { return 6; }
+    size_t dataSize() const override   { return m_sequence.size(); }
+    float zero() const override { return 0.f; }
+    std::vector<float> defaultConsts() const override {
+        std::vector<float> def{1.0f, 0.0f, 1.0f}; // T1, f0 & B1
+        return def;
+    }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        const double T1 = consts[0];
+        const double f0 = consts[1];
+        const double B1 = consts[2];
+        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
+        const double scale = indata.maxCoeff();
+        if (!std::isfinite(T1) || T1 <= 0 || !(scale > 0)) {
+            std::fill(outputs.begin(), outputs.end(), 0.f);
+            residual = 0;
+            resids.Fill(0.);
+            its = 0;
+            return true;
+        }
+        Context &ctx = m_contexts.get();
+        ctx.data = indata.cast<double>() / scale;
+        QMTTerms &t = ctx.terms;
+        t.R1obs = 1. / T1;
+        t.offsets = m_sequence.sat_f0 + f0;
+        t.omega2 = m_omega2 * B1 * B1;
+        t.ratio = (f0 == 0) ? Eigen::ArrayXd(m_ratio * B1 * B1) :
+                              Eigen::ArrayXd(t.omega2 / (2. * M_PI * t.offsets).square());
+
+        // PD is linear, so start it from the best fit of the default shape
+        auto &p = ctx.p;
+        p = m_start.matrix();
+        Eigen::ArrayXd s;
+        if (QMTFunctor::signal(t, m_lineshape, p[1], p[2], p[3], p[4], s)) {
+            p[0] = std::max((s * ctx.data).sum() / s.square().sum(), 0.);
+        }
+        ceres::Solver::Summary summary;
+        ceres::Solve(ctx.options, &ctx.problem, &summary);
+        if (m_debug) std::cout << summary.FullReport() << std::endl;
+        if (!summary.IsSolutionUsable()) {
+            if (m_debug) {
+                std::cerr << "T1: " << T1 << " f0: " << f0 << " B1: " << B1 << std::endl;
+                std::cerr << "Data: " << indata.transpose() << std::endl;
+            }
+            return false;
+        }
+        outputs[0] = p[0] * scale;
+        outputs[1] = 1. / QMTFunctor::R1f(t, p[3], p[4]);
+        outputs[2] = p[1];
+        outputs[3] = p[2];
+        outputs[4] = p[3];
+        outputs[5] = p[4];
+        residual = summary.final_cost * scale;
+        its = summary.iterations.size();
+        if (resids.Size() > 0) {
+            assert(resids.Size() == ctx.data.size());
+            std::vector<double> r_temp(ctx.data.size());
+            ctx.problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
+            for (size_t i = 0; i < r_temp.size(); i++)
+                resids[i] = r_temp[i] * scale;
+        }
+        return true;
+    }
+};
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("Fits a two-pool qMT model to pulsed-MT SPGR data.\nhttp://github.com/spinicist/QUIT");
+
+    args::Positional<std::string> mt_path(parser, "MT_FILE", "Input MT-weighted SPGR file, one volume per saturation");
+
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
+    args::ValueFlag<std::string> T1(parser, "T1", "Observed T1 map (seconds), required", {"T1"});
+    args::ValueFlag<std::string> f0(parser, "f0", "Off-resonance map (Hz)", {'f', "f0"});
+    args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    QI::SubregionArgs subregion(parser);
+    args::ValueFlag<std::string> lineshape(parser, "LINESHAPE", "Lineshape of the restricted pool, Gaussian or SuperLorentzian (default)", {'l', "lineshape"}, "SuperLorentzian");
+    args::ValueFlag<double> T1r(parser, "T1r", "T1 of the restricted pool (default 1s)", {"T1r"}, 1.0);
+    args::Flag debug(parser, "DEBUG", "Output debugging messages", {'d', "debug"});
+    args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    if (!T1) {
+        QI_FAIL("An observed T1 map must be given with --T1");
+    }
+    if (T1r.Get() <= 0) {
+        QI_FAIL("--T1r must be positive");
+    }
+    if (verbose) std::cout << "Opening MT file: " << QI::CheckPos(mt_path) << std::endl;
+    auto mtData = QI::ReadVectorImage<float>(QI::CheckPos(mt_path), subregion.region());
+    auto sequence = QI::ReadSequence<QI::SPGRMTSequence>(std::cin, verbose);
+
+    QI::TLineshape shape;
+    if (lineshape.Get() == "Gaussian") {
+        shape = QI::GaussianLineshape();
+    } else if (lineshape.Get() == "SuperLorentzian") {
+        shape = QI::SuperLorentzianLineshape();
+    } else {
+        QI_FAIL("Unknown lineshape " << lineshape.Get());
+    }
+    // One table for every thread, over the saturation offsets and the range of T2r in the fit
+    const QI::qMT model;
+    const Eigen::ArrayXXd bounds = model.Bounds(QI::FieldStrength::Three);
+    const Eigen::ArrayXd abs_f0 = sequence.sat_f0.abs();
+    if (verbose) std::cout << "Tabulating " << lineshape.Get() << " lineshape" << std::endl;
+    const QI::TabulatedLineshape table(shape, 0.5 * abs_f0.minCoeff(), 2. * abs_f0.maxCoeff(),
+                                       bounds(4, 0), bounds(4, 1));
+
+    auto apply = QI::ApplyF::New();
+    std::shared_ptr<QMTAlgo> algo = std::make_shared<QMTAlgo>(sequence, table, T1r.Get(), debug);
+    apply->SetVerbose(verbose);
+    apply->SetAlgorithm(algo);
+    apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetOutputIterations(true);
+    if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
+    apply->SetPoolsize(threads.Get());
+    apply->SetInput(0, mtData);
+    apply->SetConst(0, QI::ReadImage(T1.Get(), subregion.region()));
+    if (f0) apply->SetConst(1, QI::ReadImage(f0.Get(), subregion.region()));
+    if (B1) apply->SetConst(2, QI::ReadImage(B1.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
+    if (verbose) {
+        std::cout << "Processing" << std::endl;
+        auto monitor = QI::GenericMonitor::New();
+        apply->AddObserver(itk::ProgressEvent(), monitor);
+    }
+    const std::vector<std::string> names{"PD", "T1f", "T2f", "T2r", "kf", "F"};
+    const std::string outPrefix = outarg.Get() + "QMT_";
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), names, outPrefix, verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
+    apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (verbose) {
+        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+        std::cout << "Writing results files." << std::endl;
+    }
+    for (size_t i = 0; i < names.size(); i++) {
+        QI::WriteImage(apply->GetOutput(i), outPrefix + names[i] + QI::OutExt());
+    }
+    QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "its" + QI::OutExt());
+    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+    if (resids) {
+        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
+    return EXIT_SUCCESS;
+}
@@ -10,6 +10,8 @@
  */
 
 #include "DESPOT_2C.h"
+#include "ModelJacobian.h"
+#include "ModelKernels.h"
 
 using namespace std;
 using namespace Eigen;
@@ -67,7 +69,7 @@ bool MCD2::ValidParameters(cvecd &params) const {
 }
 
 VectorXcd MCD2::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-	return scale(Two_SPGR(a, TR, p[0], p[1], p[3], p[5], p[6], p[8]));
+    return scale(MCD2Kernel::SPGR(p, a, TR));
 }
 
 VectorXcd MCD2::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
@@ -78,11 +80,11 @@ VectorXcd MCD2::SPGRFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, cdbl TE) const
 	return scale(Two_SSFP_Finite(a, true, TR, Trf, TE, 0, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]));
 }
 
-VectorXcd MCD2::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(Two_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]));
+VectorXcd MCD2::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(MCD2Kernel::SSFP(p, a, TR, phi));
 }
 
-VectorXcd MCD2::SSFPEcho(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXcd MCD2::SSFPEcho(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale(Two_SSFP_Echo(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]));
 }
 
@@ -93,7 +95,7 @@ VectorXcd MCD2::SSFPFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, carrd &phi) co
          s.segment(start, a.rows()) = Two_SSFP_Finite(a, false, TR, Trf, 0., phi[i], p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]);
          start += a.rows();
     }
-    return scale(s);
+    return scale(std::move(s));
 }
 
 /*****************************************************************************/
@@ -141,13 +143,61 @@ bool MCD2_NoEx::ValidParameters(cvecd &params) const {
 }
 
 VectorXcd MCD2_NoEx::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-    return scale(One_SPGR(a, TR, p[0]*p[5], p[1], p[7]) +
-                 One_SPGR(a, TR, p[0]*(1-p[5]), p[3], p[7]));
+    return scale(MCD2_NoExKernel::SPGR(p, a, TR));
 }
 
-VectorXcd MCD2_NoEx::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(One_SSFP(a, phi, TR, p[0]*p[5], p[1], p[2], p[6], p[7]) +
-                 One_SSFP(a, phi, TR, p[0]*(1-p[5]), p[3], p[4], p[6], p[7]));
+VectorXcd MCD2_NoEx::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(MCD2_NoExKernel::SSFP(p, a, TR, phi));
+}
+
+namespace {
+
+struct MCD2SPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 9, 1> &p) const {
+        return Generic::Two_SPGR(a, TR, p[0], p[1], p[3], p[5], p[6], p[8]);
+    }
+};
+
+struct MCD2SSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 9, 1> &p) const {
+        return Generic::Two_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]);
+    }
+};
+
+struct MCD2_NoExSPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 8, 1> &p) const {
+        return Generic::One_SPGR(a, TR, T(p[0]*p[5]), p[1], p[7]) +
+               Generic::One_SPGR(a, TR, T(p[0]*(1.-p[5])), p[3], p[7]);
+    }
+};
+
+struct MCD2_NoExSSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 8, 1> &p) const {
+        return Generic::One_SSFP(a, phi, TR, T(p[0]*p[5]), p[1], p[2], p[6], p[7]) +
+               Generic::One_SSFP(a, phi, TR, T(p[0]*(1.-p[5])), p[3], p[4], p[6], p[7]);
+    }
+};
+
+} // End anonymous namespace
+
+MatrixXd MCD2::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<9>(p, m_scale_to_mean, MCD2SPGR{a, TR});
+}
+
+MatrixXd MCD2::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<9>(p, m_scale_to_mean, MCD2SSFP{a, TR, phi});
+}
+
+MatrixXd MCD2_NoEx::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<8>(p, m_scale_to_mean, MCD2_NoExSPGR{a, TR});
+}
+
+MatrixXd MCD2_NoEx::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<8>(p, m_scale_to_mean, MCD2_NoExSSFP{a, TR, phi});
 }
 
 } // End namespace QI
\ No newline at end of file
@@ -22,16 +22,20 @@ class MCD2 : public Model {
     Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const override;
     Eigen::VectorXcd SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const override;
     Eigen::VectorXcd SPGRFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, cdbl TE) const override;
-    Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
-    Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
     Eigen::VectorXcd SSFPFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, carrd &phi) const override;
+    Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 class MCD2_NoEx : public Model {
     DECLARE_MODEL_INTERFACE()
 
     Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const override;
-    Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 } // End namespace QI
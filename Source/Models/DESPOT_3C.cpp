@@ -10,6 +10,8 @@
  */
 
 #include "DESPOT_3C.h"
+#include "ModelJacobian.h"
+#include "ModelKernels.h"
 
 using namespace std;
 using namespace Eigen;
@@ -68,7 +70,7 @@ bool MCD3::ValidParameters(cvecd &params) const {
 }
 
 VectorXcd MCD3::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-	return scale(Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[11]));
+    return scale(MCD3Kernel::SPGR(p, a, TR));
 }
 
 VectorXcd MCD3::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
@@ -79,11 +81,11 @@ VectorXcd MCD3::SPGRFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, cdbl TE) const
 	return scale(Three_SSFP_Finite(a, true, TR, Trf, TE, 0, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]));
 }
 
-VectorXcd MCD3::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]));
+VectorXcd MCD3::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(MCD3Kernel::SSFP(p, a, TR, phi));
 }
 
-VectorXcd MCD3::SSFPEcho(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXcd MCD3::SSFPEcho(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale(Three_SSFP_Echo(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]));
 }
 
@@ -94,7 +96,7 @@ VectorXcd MCD3::SSFPFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, carrd &phi) co
          s.segment(start, a.rows()) = Three_SSFP_Finite(a, false, TR, Trf, 0., phi[i], p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]);
          start += a.rows();
      }
-     return scale(s);
+     return scale(std::move(s));
 }
 
 /*****************************************************************************/
@@ -149,7 +151,7 @@ bool MCD3_f0::ValidParameters(cvecd &params) const {
 }
 
 VectorXcd MCD3_f0::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-    return scale(Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[12]));
+    return scale(MCD3_f0Kernel::SPGR(p, a, TR));
 }
 
 VectorXcd MCD3_f0::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
@@ -160,11 +162,11 @@ VectorXcd MCD3_f0::SPGRFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, cdbl TE) co
     return scale(Three_SSFP_Finite(a, true, TR, Trf, TE, 0, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10]+p[11], p[10], p[10], p[12]));
 }
 
-VectorXcd MCD3_f0::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10]+p[11], p[10], p[10], p[12]));
+VectorXcd MCD3_f0::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(MCD3_f0Kernel::SSFP(p, a, TR, phi));
 }
 
-VectorXcd MCD3_f0::SSFPEcho(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXcd MCD3_f0::SSFPEcho(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale(Three_SSFP_Echo(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10]+p[11], p[10], p[10], p[12]));
 }
 
@@ -175,7 +177,7 @@ VectorXcd MCD3_f0::SSFPFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, carrd &phi)
          s.segment(start, a.rows()) = Three_SSFP_Finite(a, false, TR, Trf, 0., phi[i], p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10]+p[11], p[10], p[10], p[12]);
          start += a.rows();
      }
-     return scale(s);
+     return scale(std::move(s));
 }
 
 /*****************************************************************************/
@@ -230,9 +232,7 @@ bool MCD3_NoEx::ValidParameters(cvecd &params) const {
 }
 
 VectorXcd MCD3_NoEx::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-    return scale(One_SPGR(a, TR, p[0]*p[7], p[1], p[10]) +
-                 One_SPGR(a, TR, p[0]*(1-p[7]-p[8]), p[3], p[10]) +
-                 One_SPGR(a, TR, p[0]*p[8], p[5], p[10]));
+    return scale(MCD3_NoExKernel::SPGR(p, a, TR));
 }
 
 VectorXcd MCD3_NoEx::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
@@ -242,16 +242,88 @@ VectorXcd MCD3_NoEx::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
 }
 
 
-VectorXcd MCD3_NoEx::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(One_SSFP(a, phi, TR, p[0]*p[7], p[1], p[2], p[9], p[10]) +
-                 One_SSFP(a, phi, TR, p[0]*(1-p[7]-p[8]), p[3], p[4], p[9], p[10]) +
-                 One_SSFP(a, phi, TR, p[0]*p[8], p[5], p[6], p[9], p[10]));
+VectorXcd MCD3_NoEx::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(MCD3_NoExKernel::SSFP(p, a, TR, phi));
 }
 
-VectorXcd MCD3_NoEx::SSFPEcho(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXcd MCD3_NoEx::SSFPEcho(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale(One_SSFP_Echo(a, phi, TR, p[0]*p[7], p[1], p[2], p[9], p[10]) +
                  One_SSFP_Echo(a, phi, TR, p[0]*(1-p[7]-p[8]), p[3], p[4], p[9], p[10]) +
                  One_SSFP_Echo(a, phi, TR, p[0]*p[8], p[5], p[6], p[9], p[10]));
 }
 
+namespace {
+
+struct MCD3SPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 12, 1> &p) const {
+        return Generic::Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[11]);
+    }
+};
+
+struct MCD3SSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 12, 1> &p) const {
+        return Generic::Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]);
+    }
+};
+
+struct MCD3_f0SPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 13, 1> &p) const {
+        return Generic::Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[12]);
+    }
+};
+
+struct MCD3_f0SSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 13, 1> &p) const {
+        return Generic::Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], T(p[10] + p[11]), p[10], p[10], p[12]);
+    }
+};
+
+struct MCD3_NoExSPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 11, 1> &p) const {
+        return Generic::One_SPGR(a, TR, T(p[0]*p[7]), p[1], p[10]) +
+               Generic::One_SPGR(a, TR, T(p[0]*(1.-p[7]-p[8])), p[3], p[10]) +
+               Generic::One_SPGR(a, TR, T(p[0]*p[8]), p[5], p[10]);
+    }
+};
+
+struct MCD3_NoExSSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 11, 1> &p) const {
+        return Generic::One_SSFP(a, phi, TR, T(p[0]*p[7]), p[1], p[2], p[9], p[10]) +
+               Generic::One_SSFP(a, phi, TR, T(p[0]*(1.-p[7]-p[8])), p[3], p[4], p[9], p[10]) +
+               Generic::One_SSFP(a, phi, TR, T(p[0]*p[8]), p[5], p[6], p[9], p[10]);
+    }
+};
+
+} // End anonymous namespace
+
+MatrixXd MCD3::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<12>(p, m_scale_to_mean, MCD3SPGR{a, TR});
+}
+
+MatrixXd MCD3::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<12>(p, m_scale_to_mean, MCD3SSFP{a, TR, phi});
+}
+
+MatrixXd MCD3_f0::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<13>(p, m_scale_to_mean, MCD3_f0SPGR{a, TR});
+}
+
+MatrixXd MCD3_f0::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<13>(p, m_scale_to_mean, MCD3_f0SSFP{a, TR, phi});
+}
+
+MatrixXd MCD3_NoEx::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<11>(p, m_scale_to_mean, MCD3_NoExSPGR{a, TR});
+}
+
+MatrixXd MCD3_NoEx::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<11>(p, m_scale_to_mean, MCD3_NoExSSFP{a, TR, phi});
+}
+
 } // End namespace QI
@@ -22,9 +22,11 @@ namespace QI {
     virtual Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const override;
     virtual Eigen::VectorXcd SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const override;
     virtual Eigen::VectorXcd SPGRFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, cdbl TE) const override;
-    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
-    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
     virtual Eigen::VectorXcd SSFPFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, carrd &phi) const override;
+    virtual Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    virtual Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 class MCD3_f0 : public Model {
@@ -33,9 +35,11 @@ class MCD3_f0 : public Model {
     virtual Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const override;
     virtual Eigen::VectorXcd SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const override;
     virtual Eigen::VectorXcd SPGRFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, cdbl TE) const override;
-    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
-    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
     virtual Eigen::VectorXcd SSFPFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, carrd &phi) const override;
+    virtual Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    virtual Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 class MCD3_NoEx : public Model {
@@ -43,8 +47,10 @@ class MCD3_NoEx : public Model {
 
     virtual Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) const override;
     virtual Eigen::VectorXcd SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const override;
-    virtual Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const override;
-    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    virtual Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    virtual Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    virtual Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 } // End namespace QI
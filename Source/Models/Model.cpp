@@ -10,6 +10,8 @@
  */
 
 #include "Model.h"
+#include "ModelJacobian.h"
+#include "ModelKernels.h"
 #include "Macro.h"
 
 using namespace std;
@@ -17,6 +19,24 @@ using namespace Eigen;
 
 namespace QI {
 
+MatrixXd NumericJacobian(const function<ArrayXd (const VectorXd &)> &f, cvecd &p) {
+    MatrixXd jac;
+    VectorXd step = p;
+    for (Index i = 0; i < p.rows(); i++) {
+        const double h = 1.e-6 * max(fabs(p[i]), 1.);
+        step[i] = p[i] + h;
+        const ArrayXd up = f(step);
+        step[i] = p[i] - h;
+        const ArrayXd down = f(step);
+        step[i] = p[i];
+        if (i == 0) {
+            jac.resize(up.rows(), p.rows());
+        }
+        jac.col(i) = (up - down) / (2. * h);
+    }
+    return jac;
+}
+
 /*****************************************************************************/
 /* Base Class                                                                */
 /*****************************************************************************/
@@ -29,31 +49,24 @@ ptrdiff_t Model::ParameterIndex(const string &p) const {
     }
 }
 
-ArrayXcd Model::scale(const ArrayXcd &s) const {
-    //std::cout << __PRETTY_FUNCTION__ << std::endl;
+/*
+ * By value and in place, so a signal returned by an equation is only copied if the caller keeps it
+ */
+ArrayXcd Model::scale(ArrayXcd s) const {
 	if (m_scale_to_mean) {
-        //std::cout << "Scaling to mean value" << std::endl;
-		ArrayXcd scaled = s / s.abs().mean();
-		return scaled;
-	} else {
-        //std::cout << "Not scaling" << std::endl;
-		return s;
+		s /= s.abs().mean();
 	}
+	return s;
 }
 
-ArrayXd Model::scale_mag(const ArrayXd &s) const {
-    //std::cout << __PRETTY_FUNCTION__ << std::endl;
+ArrayXd Model::scale_mag(ArrayXd s) const {
     if (m_scale_to_mean) {
-        //std::cout << "Scaling to mean value" << std::endl;
-        ArrayXd scaled = s / s.mean();
-        return scaled;
-    } else {
-        //std::cout << "Not scaling" << std::endl;
-        return s;
+        s /= s.mean();
     }
+    return s;
 }
 
-VectorXd Model::SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, carrd &phi) const { QI_EXCEPTION("Function not implemented."); }
+VectorXd Model::SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const { QI_EXCEPTION("Function not implemented."); }
 
 VectorXcd Model::MultiEcho(cvecd &, carrd &, cdbl) const { QI_EXCEPTION("Function not implemented."); }
 VectorXcd Model::SPGR(cvecd &, carrd &, cdbl) const { QI_EXCEPTION("Function not implemented."); }
@@ -62,11 +75,19 @@ VectorXcd Model::SPGRFinite(cvecd &, carrd &, cdbl, cdbl, cdbl) const { QI_EXCEP
 VectorXcd Model::SPGR_MT(cvecd &p, carrd &satflip, carrd &satf0, cdbl flip, cdbl TR, cdbl Trf) const { QI_EXCEPTION("Function not implemented."); }
 VectorXcd Model::MPRAGE(cvecd &, cdbl, cdbl, const int, const int, cdbl, cdbl, cdbl) const { QI_EXCEPTION("Function not implemented."); }
 VectorXcd Model::AFI(cvecd &, cdbl, cdbl, cdbl) const { QI_EXCEPTION("Function not implemented."); }
-VectorXcd Model::SSFP(cvecd &, carrd &a, cdbl, carrd &) const { QI_EXCEPTION("Function not implemented."); }
-VectorXcd Model::SSFPEcho(cvecd &, carrd &, cdbl, carrd &) const { QI_EXCEPTION("Function not implemented."); }
+VectorXcd Model::SSFP(cvecd &, carrd &a, cdbl, const PhaseTable &) const { QI_EXCEPTION("Function not implemented."); }
+VectorXcd Model::SSFPEcho(cvecd &, carrd &, cdbl, const PhaseTable &) const { QI_EXCEPTION("Function not implemented."); }
 VectorXcd Model::SSFP_GS(cvecd &, carrd &, cdbl) const { QI_EXCEPTION("Function not implemented."); }
 VectorXcd Model::SSFPFinite(cvecd &, carrd &, cdbl, cdbl, carrd &) const { QI_EXCEPTION("Function not implemented."); }
 
+MatrixXd Model::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return NumericJacobian([&](const VectorXd &q) -> ArrayXd { return SPGR(q, a, TR).array().abs(); }, p);
+}
+
+MatrixXd Model::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return NumericJacobian([&](const VectorXd &q) -> ArrayXd { return SSFP(q, a, TR, phi).array().abs(); }, p);
+}
+
 /*****************************************************************************/
 /* Single Component DESPOT                                                   */
 /*****************************************************************************/
@@ -108,7 +129,7 @@ VectorXcd SCD::MultiEcho(cvecd &p, carrd &TE, cdbl TR) const {
 }
 
 VectorXcd SCD::SPGR(cvecd &p, carrd &a, cdbl TR) const {
-	return scale(One_SPGR(a, TR, p[0], p[1], p[4]));
+    return scale(SCDKernel::SPGR(p, a, TR));
 }
 
 VectorXcd SCD::SPGREcho(cvecd &p, carrd &a, cdbl TR, cdbl TE) const {
@@ -126,15 +147,15 @@ VectorXcd SCD::AFI(cvecd &p, cdbl a, cdbl TR1, cdbl TR2) const {
 	return scale(One_AFI(a, TR1, TR2, p[0], p[1], p[4]));
 }
 
-VectorXcd SCD::SSFP(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
-    return scale(One_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4]));
+VectorXcd SCD::SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return scale(SCDKernel::SSFP(p, a, TR, phi));
 }
 
-VectorXd SCD::SSFPEchoMagnitude(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXd SCD::SSFPEchoMagnitude(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale_mag(One_SSFP_Echo_Magnitude(a, phi, TR, p[0], p[1], p[2], p[3], p[4]));
 }
 
-VectorXcd SCD::SSFPEcho(cvecd &p, carrd &a, cdbl TR, carrd &phi) const {
+VectorXcd SCD::SSFPEcho(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
     return scale(One_SSFP_Echo(a, phi, TR, p[0], p[1], p[2], p[3], p[4]));
 }
 
@@ -145,11 +166,37 @@ VectorXcd SCD::SSFPFinite(cvecd &p, carrd &a, cdbl TR, cdbl Trf, carrd &phi) con
         s.segment(start, a.rows()) = One_SSFP_Finite(a, false, TR, Trf, 0., phi[i], p[0], p[1], p[2], p[3], p[4]);
         start += a.rows();
     }
-    return scale(s);
+    return scale(std::move(s));
 }
 
 VectorXcd SCD::SSFP_GS(cvecd &p, carrd &a, cdbl TR) const {
 	return scale(One_SSFP_GS(a, TR, p[0], p[1], p[2], p[3], p[4]));
 }
 
+namespace {
+
+struct SCDSPGR {
+    carrd &a; cdbl TR;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 5, 1> &p) const {
+        return Generic::One_SPGR(a, TR, p[0], p[1], p[4]);
+    }
+};
+
+struct SCDSSFP {
+    carrd &a; cdbl TR; const PhaseTable &phi;
+    template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, 5, 1> &p) const {
+        return Generic::One_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4]);
+    }
+};
+
+} // End anonymous namespace
+
+MatrixXd SCD::SPGRJacobian(cvecd &p, carrd &a, cdbl TR) const {
+    return MagnitudeJacobian<5>(p, m_scale_to_mean, SCDSPGR{a, TR});
+}
+
+MatrixXd SCD::SSFPJacobian(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) const {
+    return MagnitudeJacobian<5>(p, m_scale_to_mean, SCDSSFP{a, TR, phi});
+}
+
 } // End namespace QI
@@ -15,6 +15,7 @@
 
 #include <string>
 #include <vector>
+#include <functional>
 
 #include <Eigen/Core>
 
@@ -25,6 +26,9 @@ namespace QI {
 //cdbl and carrd already typedef'd in SignalEquations
 typedef const Eigen::VectorXd cvecd;
 
+// Central differences of a function of the parameters, for signals without an exact Jacobian
+Eigen::MatrixXd NumericJacobian(const std::function<Eigen::ArrayXd (const Eigen::VectorXd &)> &f, cvecd &p);
+
 enum class FieldStrength { Three, Seven, User };
 
 class Model {
@@ -32,8 +36,8 @@ public:
 
 protected:
     bool m_scale_to_mean = false;
-    Eigen::ArrayXcd scale(const Eigen::ArrayXcd &signal) const;
-    Eigen::ArrayXd  scale_mag(const Eigen::ArrayXd  &signal) const;
+    Eigen::ArrayXcd scale(Eigen::ArrayXcd signal) const;
+    Eigen::ArrayXd  scale_mag(Eigen::ArrayXd  signal) const;
 
 public:
 	virtual std::string Name() const = 0;
@@ -47,7 +51,7 @@ public:
     bool scaleToMean() const { return m_scale_to_mean; }
     void setScaleToMean(bool s) { m_scale_to_mean = s; }
 
-    virtual Eigen::VectorXd SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, carrd &phi) const;
+    virtual Eigen::VectorXd SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const;
 
     virtual Eigen::VectorXcd MultiEcho(cvecd &params, carrd &TE, cdbl TR) const;
 	virtual Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const;
@@ -56,10 +60,15 @@ public:
     virtual Eigen::VectorXcd SPGR_MT(cvecd &p, carrd &satflip, carrd &satf0, cdbl flip, cdbl TR, cdbl Trf) const;
     virtual Eigen::VectorXcd MPRAGE(cvecd &params, cdbl a, cdbl TR, const int Nseg, const int Nk0, cdbl eta, cdbl TI, cdbl TD) const;
 	virtual Eigen::VectorXcd AFI(cvecd &params, cdbl a, cdbl TR1, cdbl TR2) const;
-    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const;
-    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const;
+    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const;
+    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const;
 	virtual Eigen::VectorXcd SSFP_GS(cvecd &params, carrd &a, cdbl TR) const;
     virtual Eigen::VectorXcd SSFPFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, carrd &phi) const;
+
+    // Jacobians of the signal magnitudes, one row per signal and one column per parameter.
+    // These default to central differences, the DESPOT models override them with exact versions.
+    virtual Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const;
+    virtual Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const;
 };
 
 #define DECLARE_MODEL_INTERFACE( )\
@@ -74,7 +83,7 @@ public:\
 class SCD : public Model {
 	DECLARE_MODEL_INTERFACE()
 
-    virtual Eigen::VectorXd SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    virtual Eigen::VectorXd SSFPEchoMagnitude(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 
     virtual Eigen::VectorXcd MultiEcho(cvecd &params, carrd &TE, cdbl TR) const override;
     virtual Eigen::VectorXcd SPGR(cvecd &params, carrd &a, cdbl TR) const override;
@@ -82,10 +91,12 @@ class SCD : public Model {
 	virtual Eigen::VectorXcd SPGRFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, cdbl TE) const override;
     virtual Eigen::VectorXcd MPRAGE(cvecd &params, cdbl a, cdbl TR, const int Nseg, const int Nk0, cdbl eta, cdbl TI, cdbl TD) const override;
 	virtual Eigen::VectorXcd AFI(cvecd &params, cdbl a, cdbl TR1, cdbl TR2) const override;
-    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
-    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, carrd &phi) const override;
+    virtual Eigen::VectorXcd SSFP(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
+    virtual Eigen::VectorXcd SSFPEcho(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
     virtual Eigen::VectorXcd SSFPFinite(cvecd &params, carrd &a, cdbl TR, cdbl T_rf, carrd &phi) const override;
     virtual Eigen::VectorXcd SSFP_GS(cvecd &params, carrd &a, cdbl TR) const override;
+    virtual Eigen::MatrixXd SPGRJacobian(cvecd &params, carrd &a, cdbl TR) const override;
+    virtual Eigen::MatrixXd SSFPJacobian(cvecd &params, carrd &a, cdbl TR, const PhaseTable &phi) const override;
 };
 
 } // End namespace QI
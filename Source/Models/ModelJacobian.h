@@ -0,0 +1,50 @@
+/*
+ *  ModelJacobian.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef MODELS_JACOBIAN_H
+#define MODELS_JACOBIAN_H
+
+#include <Eigen/Core>
+#include "ceres/jet.h"
+
+#include "Model.h"
+#include "Generic.h"
+
+namespace QI {
+
+/*
+ * Jacobian of the magnitude of a generic signal, by evaluating it once with a Jet per parameter.
+ * Functor must have a template<typename T> Generic::Signal<T> operator()(const Eigen::Matrix<T, N, 1> &p).
+ */
+template<int N, typename Functor>
+Eigen::MatrixXd MagnitudeJacobian(cvecd &p, const bool scale_to_mean, const Functor &f) {
+    typedef ceres::Jet<double, N> TJet;
+    eigen_assert(p.rows() == N);
+    Eigen::Matrix<TJet, N, 1> pj;
+    for (int i = 0; i < N; i++) {
+        pj[i] = TJet(p[i], i);
+    }
+    const Generic::Signal<TJet> s = f(pj);
+    Eigen::Array<TJet, Eigen::Dynamic, 1> m = (s.col(0).square() + s.col(1).square()).sqrt();
+    if (scale_to_mean) {
+        const TJet mean = m.sum() / static_cast<double>(m.rows());
+        m /= mean;
+    }
+    Eigen::MatrixXd jac(m.rows(), N);
+    for (Eigen::Index r = 0; r < m.rows(); r++) {
+        jac.row(r) = m[r].v.transpose();
+    }
+    return jac;
+}
+
+} // End namespace QI
+
+#endif // MODELS_JACOBIAN_H
@@ -0,0 +1,86 @@
+/*
+ *  ModelKernels.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef MODELS_KERNELS_H
+#define MODELS_KERNELS_H
+
+#include "Model.h"
+
+namespace QI {
+
+/*
+ * The SPGR and SSFP signals of the DESPOT models as static functions, before any scaling to the
+ * mean. The model classes forward to these, and FixedSignal instantiates them directly so that
+ * fits which know their model up front do not need a virtual call per sequence.
+ */
+struct SCDKernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return One_SPGR(a, TR, p[0], p[1], p[4]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return One_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4]);
+    }
+};
+
+struct MCD2Kernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return Two_SPGR(a, TR, p[0], p[1], p[3], p[5], p[6], p[8]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return Two_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[7], p[8]);
+    }
+};
+
+struct MCD2_NoExKernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return One_SPGR(a, TR, p[0]*p[5], p[1], p[7]) +
+               One_SPGR(a, TR, p[0]*(1-p[5]), p[3], p[7]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return One_SSFP(a, phi, TR, p[0]*p[5], p[1], p[2], p[6], p[7]) +
+               One_SSFP(a, phi, TR, p[0]*(1-p[5]), p[3], p[4], p[6], p[7]);
+    }
+};
+
+struct MCD3Kernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[11]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[10], p[10], p[11]);
+    }
+};
+
+struct MCD3_f0Kernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return Three_SPGR(a, TR, p[0], p[1], p[3], p[5], p[7], p[8], p[9], p[12]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return Three_SSFP(a, phi, TR, p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10]+p[11], p[10], p[10], p[12]);
+    }
+};
+
+struct MCD3_NoExKernel {
+    static Eigen::VectorXcd SPGR(cvecd &p, carrd &a, cdbl TR) {
+        return One_SPGR(a, TR, p[0]*p[7], p[1], p[10]) +
+               One_SPGR(a, TR, p[0]*(1-p[7]-p[8]), p[3], p[10]) +
+               One_SPGR(a, TR, p[0]*p[8], p[5], p[10]);
+    }
+    static Eigen::VectorXcd SSFP(cvecd &p, carrd &a, cdbl TR, const PhaseTable &phi) {
+        return One_SSFP(a, phi, TR, p[0]*p[7], p[1], p[2], p[9], p[10]) +
+               One_SSFP(a, phi, TR, p[0]*(1-p[7]-p[8]), p[3], p[4], p[9], p[10]) +
+               One_SSFP(a, phi, TR, p[0]*p[8], p[5], p[6], p[9], p[10]);
+    }
+};
+
+} // End namespace QI
+
+#endif // MODELS_KERNELS_H
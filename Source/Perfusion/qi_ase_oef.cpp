@@ -21,6 +21,12 @@
 #include "MultiEchoSequence.h"
 #include "SequenceCereal.h"
 
+/*
+ * R2' comes from the long-TE echoes with the integral estimator below, everything else about the
+ * echoes is fixed by the sequence. The averaging over repeats and the Simpson's-rule sums are
+ * stored as matrices so a block of voxels is processed with a few matrix products, and single
+ * voxels go through the same code as a block of one.
+ */
 class ASEAlgo : public QI::ApplyF::Algorithm {
 protected:
     const QI::MultiEchoSequence m_sequence;
@@ -28,6 +34,10 @@ protected:
     int m_linear_count;
     const double m_B0;
     const QI::VolumeF::SpacingType m_voxsize;
+    Eigen::ArrayXd m_tau;         // The long-TE echoes
+    Eigen::MatrixXd m_average;    // Echoes x input, averages the repeats of each echo
+    Eigen::MatrixXd m_simpson;    // Integral of each set of three long-TE echoes
+    Eigen::MatrixXd m_difference; // First minus last of each set of three
 
     // Constants for calculations
     const double kappa = 0.03; // Conversion factor
@@ -47,6 +57,24 @@ public:
         QI_DBVEC( m_sequence.TE );
         QI_DBVEC( (m_sequence.TE > Tc) );
         QI_DB( m_linear_count );
+        if (m_linear_count < 3) {
+            QI_FAIL("Need at least 3 echoes after Tc = " << Tc << " to estimate R2'");
+        }
+        m_tau = m_sequence.TE.tail(m_linear_count);
+        const int nEchoes = m_sequence.size();
+        const int nRepeats = m_inputsize / nEchoes;
+        m_average = Eigen::MatrixXd::Zero(nEchoes, m_inputsize);
+        for (int r = 0; r < nRepeats; r++) {
+            m_average.block(0, r * nEchoes, nEchoes, nEchoes).diagonal().setConstant(1. / nRepeats);
+        }
+        const double dTE_3 = (m_sequence.ESP / 3);
+        m_simpson = Eigen::MatrixXd::Zero(m_linear_count - 2, m_linear_count);
+        m_difference = Eigen::MatrixXd::Zero(m_linear_count - 2, m_linear_count);
+        for (int i = 0; i < m_linear_count - 2; i++) {
+            m_simpson.row(i).segment(i, 3) << dTE_3, 4*dTE_3, dTE_3;
+            m_difference(i, i) = 1;
+            m_difference(i, i + 2) = -1;
+        }
     }
 
     size_t numInputs() const override  { return 1; }
@@ -69,95 +97,67 @@ public:
         return _names;
     }
 
-    double sinc(const double x) const {
-        static double const taylor_0_bound = std::numeric_limits<double>::epsilon();
-        static double const taylor_2_bound = sqrt(taylor_0_bound);
-        static double const taylor_n_bound = sqrt(taylor_2_bound);
-
-        if (std::abs(x) >= taylor_n_bound) {
-            return(sin(x)/x);
-        } else {
-            // approximation by taylor series in x at 0 up to order 0
-            double result = 1;
-
-            if (abs(x) >= taylor_0_bound) {
-                double x2 = x*x;
-                // approximation by taylor series in x at 0 up to order 2
-                result -= x2/6;
-
-                if (abs(x) >= taylor_2_bound) {
-                    // approximation by taylor series in x at 0 up to order 4
-                    result += (x2*x2)/120;
-                }
-            }
-            return result;
-        }
+    static Eigen::ArrayXXd sinc(const Eigen::ArrayXXd &x) {
+        // Below this the first two terms of the Taylor series are exact in double precision
+        return (x.abs() < 1e-4).select(1. - x.square() / 6., x.sin() / x);
     }
-    
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &index, // Unused
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override
     {
-        const Eigen::Map<const Eigen::ArrayXXf> input(inputs[0].GetDataPointer(), m_sequence.size(), inputs[0].Size() / m_sequence.size());
-        Eigen::ArrayXd data = input.cast<double>().rowwise().mean();
-
-        // Eigen::MatrixXd X(m_linear_count, 2);
-        // X.col(0) = m_sequence.TE.tail(m_linear_count);
-        // X.col(1).setOnes();
-        // Eigen::VectorXd Y = data.tail(m_linear_count).log();
-        // Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        // const double R2prime = -b[0];
-        // const double logS0_linear = b[1];
+        const std::vector<TInputBlock> input_block{TInputBlock(inputs[0].GetDataPointer(), m_inputsize, 1)};
+        std::vector<TConstBlock> const_blocks;
+        for (const auto &c : consts) {
+            const_blocks.emplace_back(&c, 1, 1);
+        }
+        std::vector<TOutputBlock> output_blocks;
+        for (auto &o : outputs) {
+            output_blocks.emplace_back(&o, 1, 1);
+        }
+        TOutputBlock residual_block(&residual, 1, 1);
+        TResidsBlock resids_block(nullptr, 0, 0);
+        TIterationsBlock its_block(&its, 1, 1);
+        resids.Fill(0.);
+        return applyBatch(input_block, const_blocks, output_blocks, residual_block, resids_block, its_block);
+    }
 
-        const Eigen::ArrayXd tau = m_sequence.TE.tail(m_linear_count);
-        Eigen::ArrayXd F = Eigen::ArrayXd::Ones(m_linear_count);
-        // QI_DBVEC( F );
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        const Eigen::MatrixXd data = m_average * inputs[0].cast<double>();
+        Eigen::ArrayXXd linear_data = data.bottomRows(m_linear_count).array();
+        // Macroscopic field gradient correction, only needed if a block has any gradients
         for (int d = 0; d < 3; d++) {
-            const double grad = consts[d];
-            const Eigen::ArrayXd x = grad * 2 * M_PI * m_voxsize[d] * tau / 2;
-            for (int i = 0; i < x.rows(); i++) { F[i] *= std::abs(sinc(x[i])); };
-            // QI_DB( grad );
-            // QI_DBVEC( x );
-            // QI_DBVEC( F );
+            const Eigen::ArrayXd grad = consts[d].cast<double>().transpose();
+            if ((grad != 0.).any()) {
+                const Eigen::ArrayXXd x = (M_PI * m_voxsize[d] * m_tau).matrix() * grad.matrix().transpose();
+                linear_data /= sinc(x).abs();
+            }
         }
-        const Eigen::ArrayXd linear_data = data.tail(m_linear_count) / F;
+        const Eigen::ArrayXXd si = m_simpson * linear_data.matrix();
+        const Eigen::ArrayXXd di = m_difference * linear_data.matrix();
         const double dTE_3 = (m_sequence.ESP / 3);
-        double si2sum = 0, sidisum = 0;
-        for (int i = 0; i < m_linear_count - 2; i++) {
-            const double si = dTE_3 * (linear_data(i) + 4*linear_data(i+1) + linear_data(i+2));
-            const double di = linear_data(i) - linear_data(i+2);
-            si2sum += si*si;
-            sidisum += si*di;
+        const Eigen::ArrayXd si2sum = si.square().colwise().sum().transpose();
+        const Eigen::ArrayXd sidisum = (si * di).colwise().sum().transpose();
+        const Eigen::ArrayXd R2prime = (dTE_3*si2sum + sidisum) / (si2sum + dTE_3*sidisum);
+        const Eigen::ArrayXd S0_linear = (linear_data * (m_tau.matrix() * R2prime.matrix().transpose()).array().exp()).colwise().mean().transpose();
+        const Eigen::ArrayXd DBV = S0_linear.log() - data.row(0).transpose().array().log();
+        const Eigen::ArrayXd dHb = 3*R2prime / (DBV * 4 * gamma * M_PI * delta_X0 * kappa * m_B0);
+        const Eigen::ArrayXd OEF = dHb / Hb;
+
+        outputs[0] = R2prime.transpose().cast<float>().matrix();
+        outputs[1] = (DBV*100).transpose().cast<float>().matrix();
+        outputs[2] = (OEF*100).transpose().cast<float>().matrix();
+        outputs[3] = dHb.transpose().cast<float>().matrix();
+        residual.setZero();
+        if (resids.rows() > 0) {
+            resids.setZero();
         }
-        double R2prime = 1 / ((si2sum + dTE_3*sidisum) / (dTE_3*si2sum + sidisum));
-        double S0_linear = (linear_data.array() / exp(-tau * R2prime)).mean();
-
-        const double DBV = log(S0_linear) - log(data[0]);
-
-        const double dHb = 3*R2prime / (DBV * 4 * gamma * M_PI * delta_X0 * kappa * m_B0);
-        const double OEF = dHb / Hb;
-
-        // QI_DB( input );
-        // QI_DBVEC( data );
-        // QI_DBVEC( linear_data );
-        // QI_DB( m_voxsize );
-        // QI_DBVEC( tau );
-        // QI_DBVEC( F );
-        // QI_DB( R2prime );
-        // QI_DB( log(S0_linear) );
-        // QI_DB( log(data[0]) );
-        // QI_DB( DBV );
-        // QI_DB( dHb );
-        // QI_DB( OEF );
-
-        outputs[0] = R2prime;
-        outputs[1] = DBV*100;
-        outputs[2] = OEF*100;
-        outputs[3] = dHb;
-        residual = 0;
-        resids.Fill(0.);
-        its = 0;
+        its.setZero();
         return true;
     }
 };
@@ -177,11 +177,12 @@ int main(int argc, char **argv) {
     args::ValueFlag<double> B0(parser, "B0", "Field-strength (Tesla), default 3", {'B', "B0"}, 3.0);
     args::ValueFlag<std::string> f0_arg(parser, "FIELD MAP", "A field map for macroscopic field gradient correction", {'f', "fmap"});
     args::ValueFlag<double> slice_arg(parser, "SLICE THICKNESS", "Slice-thickness for MFG calculation (useful if there was a slice gap)", {'s', "slice"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
     if (verbose) std::cout << "Reading ASE data from: " << QI::CheckPos(input_path) << std::endl;
     const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
-    auto input = QI::ReadVectorImage(QI::CheckPos(input_path));
+    auto input = QI::ReadVectorImage(QI::CheckPos(input_path), subregion.region());
     auto sequence = QI::ReadSequence<QI::MultiEchoSequence>(std::cin, verbose);
     QI::VolumeF::SpacingType vox_size = input->GetSpacing();
     if (slice_arg) {
@@ -194,7 +195,6 @@ int main(int argc, char **argv) {
     apply->SetOutputAllResiduals(false);
     if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
     apply->SetInput(0, input);
     if (f0_arg) {
         if (verbose) std::cout << "Calculating gradient of field-map" << std::endl;
@@ -214,16 +214,22 @@ int main(int argc, char **argv) {
         QI::WriteImage(grad->GetOutput(), outPrefix + "_fieldgrad_z" + QI::OutExt());
         grad->GetOutput()->DisconnectPipeline();
     }
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
     }
@@ -233,5 +239,8 @@ int main(int argc, char **argv) {
         std::cout << "Writing file: " << fname << std::endl;
         QI::WriteImage(apply->GetOutput(i), fname);
     }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "_failures" + QI::OutExt());
+    }
     return EXIT_SUCCESS;
 }
@@ -10,6 +10,7 @@
  */
 
 #include <iostream>
+#include <cmath>
 #include <Eigen/Dense>
 
 #include "Util.h"
@@ -18,6 +19,8 @@
 #include "ApplyTypes.h"
 #include "CASLSequence.h"
 #include "SequenceCereal.h"
+#include "ImageStreaming.h"
+#include "LevenbergMarquardt.h"
 
 class CASLAlgo : public QI::ApplyVectorF::Algorithm {
 protected:
@@ -25,6 +28,7 @@ protected:
     const double m_T1, m_alpha, m_lambda;
     const int m_inputsize, m_series_size;
     const bool m_average_timeseries;
+    Eigen::ArrayXd m_blood; // The terms of the CBF equation that depend only on each PLD
 public:
     CASLAlgo(const QI::CASLSequence& casl,
              const double T1, const double alpha, const double lambda,
@@ -36,6 +40,8 @@ public:
         if (!slice_time && (casl.post_label_delay.rows() != 1)) {
             QI_FAIL("More than one post-label delay specified, but not in slice-timing correction mode");
         }
+        m_blood = (6000 * m_lambda * (m_CASL.post_label_delay / m_T1).exp()) /
+                  (2. * m_alpha * m_T1 * (1. - exp(-m_CASL.label_time / m_T1)));
     }
 
     size_t numInputs() const override  { return 1; }
@@ -70,30 +76,24 @@ public:
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override
     {
-        const Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>> even(inputs[0].GetDataPointer(), m_series_size, Eigen::InnerStride<>(2));
-        const Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>> odd(inputs[0].GetDataPointer() + 1, m_series_size, Eigen::InnerStride<>(2));
-
-        const Eigen::ArrayXd diff = (odd.cast<double>() - even.cast<double>());
-        Eigen::ArrayXd SI_PD = odd.cast<double>();
-        double T1_tissue = consts[0];
-        Eigen::ArrayXd PD;
-        if (consts[1] == 0) {
-            PD = odd.cast<double>();
-        } else {
-            PD = Eigen::ArrayXd::Constant(m_series_size, consts[1]);
-        }
-        if (T1_tissue > 0) {
-            PD /= (1 - exp(-m_CASL.TR / T1_tissue));
+        // One pass over the control/label pairs, accumulating the mean if needed
+        const float *pairs = inputs[0].GetDataPointer();
+        const double T1_tissue = consts[0];
+        const double saturation = (T1_tissue > 0) ? (1 - exp(-m_CASL.TR / T1_tissue)) : 1.;
+        const double factor = saturation * ((m_blood.rows() > 1) ? m_blood[index[2]] : m_blood[0]);
+        double sum = 0;
+        for (int i = 0; i < m_series_size; i++) {
+            const double control = pairs[2*i], label = pairs[2*i + 1];
+            const double PD = (consts[1] == 0) ? label : consts[1];
+            const double CBF = factor * (label - control) / PD;
+            if (m_average_timeseries) {
+                sum += CBF;
+            } else {
+                outputs[0][i] = CBF;
+            }
         }
-        const double PLD = (m_CASL.post_label_delay.rows() > 1) ? m_CASL.post_label_delay[index[2]] : m_CASL.post_label_delay[0];
-        const Eigen::ArrayXd CBF = (6000 * m_lambda * diff * exp(PLD / m_T1)) / 
-                           (2. * m_alpha * m_T1 * PD * (1. - exp(-m_CASL.label_time / m_T1)));
         if (m_average_timeseries) {
-            outputs[0][0] = CBF.mean();
-        } else {
-            for (int i = 0; i < m_series_size; i++) {
-                outputs[0][i] = CBF[i];
-            }
+            outputs[0][0] = sum / m_series_size;
         }
         residual.Fill(0.);
         resids.Fill(0.);
@@ -102,6 +102,133 @@ public:
     }
 };
 
+/*
+ * Buxton's general kinetic model for (p)CASL, with the tissue and blood T1 taken as equal and no
+ * outflow. For a label of duration tau, delay w and arrival time ATT, the difference signal per unit
+ * CBF is exp(-max(ATT, w) / T1) - exp(-(tau + w) / T1), or zero if the label has not arrived yet.
+ * The data are scaled so CBF comes out directly in mL/(100 g)/min.
+ */
+struct BuxtonModel {
+    typedef Eigen::Vector2d TParams; // CBF, ATT
+    const Eigen::ArrayXd &PLD, &data;
+    const double tau, T1, maxATT;
+
+    size_t size() const { return data.rows(); }
+    bool valid(const TParams &p) const { return (p[1] >= 0) && (p[1] <= maxATT); }
+    double residual(const size_t i, const TParams &p, TParams &gradient) const {
+        const double arrived = exp(-std::max(p[1], PLD[i]) / T1);
+        const double shape = std::max(arrived - exp(-(tau + PLD[i]) / T1), 0.);
+        gradient[0] = shape;
+        gradient[1] = (shape > 0 && p[1] > PLD[i]) ? -p[0] * arrived / T1 : 0.;
+        return p[0] * shape - data[i];
+    }
+};
+
+/*
+ * Fits CBF and ATT to multi-PLD data. The pairs are in one block per PLD, each with the same number
+ * of repeats, and the mean difference of each block is fitted. The model is linear in CBF, so the
+ * start point for ATT is the best of a grid of model curves, built once for the PLD set and shared
+ * by all voxels, with CBF from the least-squares fit to that curve. Both are then refined together.
+ */
+class MultiPLDAlgo : public QI::ApplyVectorF::Algorithm {
+protected:
+    const QI::CASLSequence m_CASL;
+    const double m_T1, m_scale;
+    const int m_inputsize, m_repeats, m_iterations;
+    Eigen::ArrayXd m_grid;     // ATTs of the lookup
+    Eigen::MatrixXd m_curves;  // One column of model curves per ATT
+    Eigen::ArrayXd m_norms;    // The squared norm of each curve
+    static const int GridSize = 256;
+public:
+    MultiPLDAlgo(const QI::CASLSequence& casl,
+                 const double T1, const double alpha, const double lambda,
+                 const int inputsize, const int iterations) :
+        m_CASL(casl), m_T1(T1), m_scale(6000 * lambda / (2. * alpha * T1)),
+        m_inputsize(inputsize), m_repeats(inputsize / (2 * casl.post_label_delay.rows())),
+        m_iterations(iterations)
+    {
+        const auto nPLD = casl.post_label_delay.rows();
+        if (nPLD < 2) {
+            QI_FAIL("Multi-PLD mode needs at least two post-label delays");
+        }
+        if ((inputsize % 2) || (inputsize / 2) % nPLD) {
+            QI_FAIL("Number of control/label pairs " << inputsize / 2 << " is not a multiple of the " << nPLD << " post-label delays");
+        }
+        const double maxATT = casl.post_label_delay.maxCoeff() + casl.label_time;
+        m_grid = Eigen::ArrayXd::LinSpaced(GridSize, 0, maxATT);
+        m_curves.resize(nPLD, GridSize);
+        const Eigen::ArrayXd dummy = Eigen::ArrayXd::Zero(nPLD);
+        const BuxtonModel model{m_CASL.post_label_delay, dummy, m_CASL.label_time, m_T1, maxATT};
+        Eigen::Vector2d g;
+        for (int j = 0; j < GridSize; j++) {
+            for (int i = 0; i < nPLD; i++) {
+                m_curves(i, j) = model.residual(i, Eigen::Vector2d(1., m_grid[j]), g);
+            }
+        }
+        m_norms = m_curves.colwise().squaredNorm().transpose().array();
+    }
+
+    size_t numInputs() const override  { return 1; }
+    size_t numConsts() const override  { return 2; }
+    size_t numOutputs() const override { return 2; }
+    size_t dataSize() const override   { return m_inputsize; }
+    size_t outputSize() const override { return 1; }
+    TOutput zero() const override {
+        TOutput z(1);
+        z.Fill(0.);
+        return z;
+    }
+    std::vector<float> defaultConsts() const override {
+        std::vector<float> def(2, 0);
+        return def;
+    }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TOutput &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        const float *pairs = inputs[0].GetDataPointer();
+        const auto nPLD = m_CASL.post_label_delay.rows();
+        Eigen::ArrayXd data = Eigen::ArrayXd::Zero(nPLD);
+        double labels = 0;
+        for (int p = 0; p < nPLD; p++) {
+            for (int r = 0; r < m_repeats; r++) {
+                const int i = p * m_repeats + r;
+                data[p] += pairs[2*i + 1] - pairs[2*i];
+                labels += pairs[2*i + 1];
+            }
+        }
+        const double T1_tissue = consts[0];
+        const double saturation = (T1_tissue > 0) ? (1 - exp(-m_CASL.TR / T1_tissue)) : 1.;
+        const double PD = ((consts[1] == 0) ? labels / (nPLD * m_repeats) : consts[1]) * saturation;
+        if (PD == 0) {
+            return false;
+        }
+        data *= m_scale / (PD * m_repeats);
+
+        // Lookup - the curve that explains the most of the data, and its least-squares CBF
+        const Eigen::ArrayXd fit = (m_curves.transpose() * data.matrix()).array();
+        Eigen::Index best;
+        (fit.square() / m_norms.max(1e-30)).maxCoeff(&best);
+        Eigen::Vector2d p(fit[best] / std::max(m_norms[best], 1e-30), m_grid[best]);
+        const BuxtonModel model{m_CASL.post_label_delay, data, m_CASL.label_time, m_T1, m_grid[GridSize - 1]};
+        its = QI::LevenbergMarquardt<2>(model, p, m_iterations);
+
+        outputs[0][0] = p[0];
+        outputs[1][0] = p[1];
+        Eigen::Vector2d g;
+        double sum = 0;
+        for (int i = 0; i < nPLD; i++) {
+            const double r = model.residual(i, p, g);
+            sum += r * r;
+        }
+        residual.Fill(sqrt(sum / nPLD));
+        resids.Fill(0.);
+        return true;
+    }
+};
+
 /*
  * Main
  */
@@ -116,26 +243,38 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::Flag average(parser, "AVERAGE", "Average the time-series", {'a', "average"});
     args::Flag slice_time(parser, "SLICE TIME CORRECTION", "Apply slice-time correction (number of post-label delays must match number of slices)", {'s', "slicetime"});
+    args::Flag multi_pld(parser, "MULTI PLD", "Fit CBF and arterial transit time to one block of pairs per post-label delay", {'M', "multipld"});
+    args::ValueFlag<int> its(parser, "ITERATIONS", "Max iterations for the multi-PLD fit (default 20)", {'i', "its"}, 20);
     args::ValueFlag<double> T1_blood(parser, "BLOOD T1", "Value of blood T1 to use (seconds), default 1.65 for 3T", {'b', "blood"}, 1.65);
     args::ValueFlag<std::string> T1_tissue_path(parser, "TISSUE T1", "Path to tissue T1 map (units are seconds)", {'t', "tissue"});
     args::ValueFlag<std::string> PD_path(parser, "PROTON DENSITY", "Path to PD image", {'p', "pd"});
     args::ValueFlag<double> alpha(parser, "ALPHA", "Labelling efficiency, default 0.9", {'a', "alpha"}, 0.9);
     args::ValueFlag<double> lambda(parser, "LAMBDA", "Blood-brain partition co-efficent, default 0.9 mL/g", {'l', "lambda"}, 0.9);
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    args::ValueFlag<int> stream(parser, "SLABS", "Read, process and write the series in this many slabs to limit memory use", {"stream"});
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
     if (verbose) std::cout << "Reading ASL data from: " << QI::CheckPos(input_path) << std::endl;
-    auto input = QI::ReadVectorImage(QI::CheckPos(input_path));
+    std::unique_ptr<QI::VectorImageStream<float>> inputStream;
+    QI::VectorVolumeF::Pointer input;
+    const bool streaming = stream && !subregion.requested(); // Only the subregion is read anyway
+    if (streaming) {
+        inputStream.reset(new QI::VectorImageStream<float>(QI::CheckPos(input_path)));
+        input = inputStream->GetOutput();
+    } else {
+        input = QI::ReadVectorImage<float>(QI::CheckPos(input_path), subregion.region());
+    }
 
     QI::VolumeF::Pointer PD_image = ITK_NULLPTR;
     if (PD_path) {
         if (verbose) std::cout << "Reading proton density map: " << PD_path.Get() << std::endl;
-        PD_image = QI::ReadImage(PD_path.Get());
+        PD_image = QI::ReadImage(PD_path.Get(), subregion.region());
     }
 
     QI::VolumeF::Pointer T1_tissue = ITK_NULLPTR;
     if (T1_tissue_path) {
         if (verbose) std::cout << "Reading tissue T1 map: " << T1_tissue_path.Get() << std::endl;
-        T1_tissue = QI::ReadImage(T1_tissue_path.Get());
+        T1_tissue = QI::ReadImage(T1_tissue_path.Get(), subregion.region());
     }
 
     auto sequence = QI::ReadSequence<QI::CASLSequence>(std::cin, verbose);
@@ -143,33 +282,70 @@ int main(int argc, char **argv) {
     if (slice_time && (n_slices != sequence.post_label_delay.rows())) {
         QI_FAIL("Number of post-label delays " << sequence.post_label_delay.rows() << " does not match number of slices " << n_slices);
     }
-    std::shared_ptr<CASLAlgo> algo = std::make_shared<CASLAlgo>(sequence, T1_blood.Get(), alpha.Get(), lambda.Get(),
-                                                                input->GetNumberOfComponentsPerPixel(), average, slice_time);
+    if (multi_pld && (slice_time || average)) {
+        QI_FAIL("Multi-PLD mode cannot be combined with --slicetime or --average");
+    }
+    std::shared_ptr<QI::ApplyVectorF::Algorithm> algo;
+    if (multi_pld) {
+        algo = std::make_shared<MultiPLDAlgo>(sequence, T1_blood.Get(), alpha.Get(), lambda.Get(),
+                                              input->GetNumberOfComponentsPerPixel(), its.Get());
+    } else {
+        algo = std::make_shared<CASLAlgo>(sequence, T1_blood.Get(), alpha.Get(), lambda.Get(),
+                                          input->GetNumberOfComponentsPerPixel(), average, slice_time);
+    }
     auto apply = QI::ApplyVectorF::New();
     apply->SetVerbose(verbose);
     apply->SetAlgorithm(algo);
     apply->SetConst(0, T1_tissue);
     apply->SetConst(1, PD_image);
     apply->SetOutputAllResiduals(false);
+    apply->SetOutputResidual(multi_pld);
     if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
     apply->SetInput(0, input);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, outarg.Get());
+    const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
+    if (streaming) {
+        apply->UpdateOutputInformation();
+        QI::SlabWriter slabs(stream.Get(), verbose);
+        slabs.Add(apply->GetOutput(0), outPrefix + "_CBF" + QI::OutExt());
+        if (multi_pld) {
+            slabs.Add(apply->GetOutput(1), outPrefix + "_ATT" + QI::OutExt());
+            slabs.Add(apply->GetResidualOutput(), outPrefix + "_residual" + QI::OutExt());
+        }
+        if (checkpoint.failures) {
+            slabs.Add(apply->GetFailuresOutput(), outPrefix + "_failures" + QI::OutExt());
+        }
+        slabs.Write(apply->GetOutput(0)->GetLargestPossibleRegion());
+        if (verbose) std::cout << "Finished." << std::endl;
+        return EXIT_SUCCESS;
+    }
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
     }
-    const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
     QI::WriteVectorImage(apply->GetOutput(0), outPrefix + "_CBF" + QI::OutExt());
+    if (multi_pld) {
+        QI::WriteVectorImage(apply->GetOutput(1), outPrefix + "_ATT" + QI::OutExt());
+        QI::WriteVectorImage(apply->GetResidualOutput(), outPrefix + "_residual" + QI::OutExt());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "_failures" + QI::OutExt());
+    }
     return EXIT_SUCCESS;
 }
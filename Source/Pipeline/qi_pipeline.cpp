@@ -0,0 +1,495 @@
+/*
+ *  qi_pipeline.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cereal/archives/json.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
+
+#include "Util.h"
+#include "Args.h"
+#include "Macro.h"
+#include "MemoryStore.h"
+#include "SequenceCereal.h"
+#include "ThreadPool.h"
+
+#define QI_STAGE( NAME ) int NAME ## _main(int argc, char **argv);
+#include "Stages.h"
+#undef QI_STAGE
+
+namespace {
+
+typedef int (*TMain)(int, char **);
+
+const std::map<std::string, TMain> &Programs() {
+    #define QI_STAGE( NAME ) { #NAME, &NAME ## _main },
+    static const std::map<std::string, TMain> programs = {
+        #include "Stages.h"
+    };
+    #undef QI_STAGE
+    return programs;
+}
+
+/*
+ * One program run. Only program is required. The sequence is handed to the program on stdin as
+ * JSON (as it would be typed), otherwise stdin can be read from a file or mem: text. Likewise
+ * stdout can be kept, e.g. the co-efficients from qipolyfit for qipolyimg.
+ */
+struct Stage {
+    std::string program;
+    std::vector<std::string> args;
+    std::string sequence;            // JSON, empty for none
+    std::string input, output;       // Paths for stdin & stdout, empty to leave them alone
+    std::vector<std::string> forget; // mem: paths to free after this stage
+
+    void load(cereal::JSONInputArchive &ar) {
+        ar(cereal::make_nvp("program", program));
+        Optional(ar, "args", args);
+        Optional(ar, "stdin", input);
+        Optional(ar, "stdout", output);
+        Optional(ar, "forget", forget);
+        try {
+            ar.setNextName("sequence");
+            ar.startNode();
+        } catch (cereal::Exception &) {
+            return;
+        }
+        const std::string name = ar.getNodeName();
+        std::shared_ptr<QI::SequenceBase> s = QI::NewSequence(name);
+        ar(cereal::make_nvp(name, *s));
+        ar.finishNode();
+        std::ostringstream json;
+        {
+            cereal::JSONOutputArchive out(json);
+            out(cereal::make_nvp(name, *s));
+        }
+        sequence = json.str();
+    }
+
+    Stage bind(const std::map<std::string, std::string> &vars) const; //!< Copy with ${NAME} replaced by vars
+
+    template<typename T>
+    static void Optional(cereal::JSONInputArchive &ar, const char *name, T &value) {
+        try {
+            ar(cereal::make_nvp(name, value));
+        } catch (cereal::Exception &) {
+            // Leave the default
+        }
+    }
+};
+
+/*
+ * Replace each ${NAME} in text, the sequence is left alone so it is only parsed once for a batch
+ */
+std::string Substitute(const std::string &text, const std::map<std::string, std::string> &vars) {
+    std::string result;
+    size_t pos = 0;
+    while (true) {
+        const size_t start = text.find("${", pos);
+        if (start == std::string::npos) {
+            result += text.substr(pos);
+            return result;
+        }
+        const size_t end = text.find('}', start);
+        if (end == std::string::npos) {
+            QI_FAIL("Unterminated ${ in pipeline argument: " << text);
+        }
+        const std::string name = text.substr(start + 2, end - start - 2);
+        const auto it = vars.find(name);
+        if (it == vars.end()) {
+            QI_FAIL("Pipeline uses ${" << name << "} but the batch table has no column of that name");
+        }
+        result += text.substr(pos, start - pos) + it->second;
+        pos = end + 1;
+    }
+}
+
+Stage Stage::bind(const std::map<std::string, std::string> &vars) const {
+    Stage s = *this;
+    for (auto &a : s.args) a = Substitute(a, vars);
+    for (auto &f : s.forget) f = Substitute(f, vars);
+    s.input = Substitute(s.input, vars);
+    s.output = Substitute(s.output, vars);
+    return s;
+}
+
+/*
+ * A batch table has the variable names on its first line and then one subject per line, separated
+ * by whitespace. Blank lines and lines starting with # are skipped.
+ */
+std::vector<std::map<std::string, std::string>> ReadBatch(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        QI_FAIL("Could not open batch table: " << path);
+    }
+    std::vector<std::string> names;
+    std::vector<std::map<std::string, std::string>> subjects;
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+        std::istringstream fields(line);
+        std::vector<std::string> values;
+        std::string v;
+        while (fields >> v) values.push_back(v);
+        if (values.empty() || values[0][0] == '#') {
+            continue;
+        }
+        if (names.empty()) {
+            names = values;
+        } else if (values.size() != names.size()) {
+            QI_FAIL("Line " << number << " of " << path << " has " << values.size() << " values but there are " << names.size() << " names");
+        } else {
+            std::map<std::string, std::string> vars;
+            for (size_t i = 0; i < names.size(); i++) vars[names[i]] = values[i];
+            subjects.push_back(vars);
+        }
+    }
+    if (subjects.empty()) {
+        QI_FAIL("Batch table " << path << " does not list any subjects");
+    }
+    return subjects;
+}
+
+/*
+ * Reads the files a subject's stages will open into the page cache on a background thread, so the
+ * next subject's inputs come from memory instead of waiting on the disk (or network). Anything that
+ * is an existing regular file, either an argument or the value of a --flag=, is read. Destruction
+ * waits for the reads to finish.
+ */
+class Prefetch {
+public:
+    Prefetch(const std::vector<Stage> &stages) {
+        std::vector<std::string> paths;
+        for (const auto &s : stages) {
+            std::vector<std::string> candidates = s.args;
+            candidates.push_back(s.input);
+            for (auto &c : candidates) {
+                const size_t eq = c.find('=');
+                if (c.compare(0, 2, "--") == 0 && eq != std::string::npos) c = c.substr(eq + 1);
+                struct stat st;
+                if (!c.empty() && !QI::IsMemoryPath(c) && stat(c.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                    paths.push_back(c);
+                }
+            }
+        }
+        m_thread = std::thread([paths]{
+            std::vector<char> buffer(1 << 20);
+            for (const auto &p : paths) {
+                std::ifstream file(p, std::ios::binary);
+                while (file.read(buffer.data(), buffer.size())) {}
+            }
+        });
+    }
+    ~Prefetch() { m_thread.join(); }
+    Prefetch(const Prefetch &) = delete;
+    Prefetch &operator=(const Prefetch &) = delete;
+
+private:
+    std::thread m_thread;
+};
+
+// Swaps a stream's buffer for the life of the object, so it is restored even if a stage throws
+struct Redirect {
+    std::ios &stream;
+    std::streambuf *original;
+    Redirect(std::ios &s, std::streambuf *buf) : stream(s), original(s.rdbuf(buf)) {}
+    ~Redirect() { stream.rdbuf(original); }
+};
+
+std::string ReadText(const std::string &path) {
+    if (QI::IsMemoryPath(path)) {
+        return QI::GetMemoryText(path);
+    }
+    std::ifstream file(path);
+    if (!file) {
+        QI_FAIL("Could not open " << path);
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+void WriteText(const std::string &path, const std::string &text) {
+    if (QI::IsMemoryPath(path)) {
+        QI::SetMemoryText(path, text);
+        return;
+    }
+    std::ofstream file(path);
+    if (!(file << text)) {
+        QI_FAIL("Could not write " << path);
+    }
+}
+
+void RunStage(const Stage &s, const size_t i, const size_t nStages, const bool verbose) {
+    if (verbose) {
+        std::cout << "Stage " << (i + 1) << " of " << nStages << ": " << s.program;
+        for (const auto &a : s.args) std::cout << " " << a;
+        std::cout << std::endl;
+    }
+    std::vector<std::string> stage_args(1, s.program);
+    stage_args.insert(stage_args.end(), s.args.begin(), s.args.end());
+    std::vector<char *> stage_argv;
+    for (auto &a : stage_args) {
+        stage_argv.push_back(&a[0]);
+    }
+    stage_argv.push_back(nullptr);
+
+    std::istringstream stage_in(!s.sequence.empty() ? s.sequence : (!s.input.empty() ? ReadText(s.input) : ""));
+    std::ostringstream stage_out;
+    const auto start = std::chrono::steady_clock::now();
+    int result = EXIT_FAILURE;
+    try {
+        std::unique_ptr<Redirect> in, out;
+        if (!s.sequence.empty() || !s.input.empty()) in.reset(new Redirect(std::cin, stage_in.rdbuf()));
+        if (!s.output.empty()) out.reset(new Redirect(std::cout, stage_out.rdbuf()));
+        result = Programs().at(s.program)(static_cast<int>(stage_args.size()), stage_argv.data());
+    } catch (std::exception &e) {
+        QI_FAIL("Stage " << (i + 1) << " (" << s.program << ") failed: " << e.what());
+    }
+    if (result != EXIT_SUCCESS) {
+        QI_FAIL("Stage " << (i + 1) << " (" << s.program << ") failed with exit code " << result);
+    }
+    if (!s.output.empty()) {
+        WriteText(s.output, stage_out.str());
+    }
+    for (const auto &f : s.forget) {
+        QI::ForgetMemory(f);
+    }
+    if (verbose) {
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Stage " << (i + 1) << " took " << elapsed << "s" << std::endl;
+    }
+}
+
+/*
+ * The stages of a pipeline (file or job), checking every program exists before any of them run
+ */
+std::vector<Stage> ReadStages(std::istream &in, const std::string &name) {
+    std::vector<Stage> stages;
+    try {
+        cereal::JSONInputArchive archive(in);
+        archive(cereal::make_nvp("stages", stages));
+    } catch (cereal::Exception &e) {
+        QI_FAIL("Error parsing pipeline " << name << ": " << e.what());
+    }
+    for (const auto &s : stages) {
+        if (Programs().count(s.program) == 0) {
+            QI_FAIL("Unknown program in pipeline: " << s.program << ". Use --list to see the programs available");
+        }
+    }
+    return stages;
+}
+
+/*
+ * --serve keeps one process, and so one thread pool, for any number of jobs sent by --submit over a
+ * Unix socket. A job is a pipeline file, and the reply is everything the stages printed followed by
+ * a last line of OK or FAILED. Programs share std::cin and std::cout, so jobs run one at a time in
+ * the order they connect, each with every thread, instead of several processes competing for the
+ * cores. SHUTDOWN instead of a job stops the server.
+ */
+const char *const ShutdownRequest = "SHUTDOWN";
+
+std::string ReadAll(const int fd) {
+    std::string text;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        text.append(buffer, n);
+    }
+    return text;
+}
+
+void WriteAll(const int fd, const std::string &text) {
+    size_t done = 0;
+    while (done < text.size()) {
+        const ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n <= 0) return; // The client has gone, nobody to tell
+        done += n;
+    }
+}
+
+sockaddr_un SocketAddress(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        QI_FAIL("Socket path is too long: " << path);
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+std::string RunJob(const std::string &job, const bool verbose) {
+    std::ostringstream log;
+    std::istringstream none;
+    bool ok = false;
+    {
+        // Stages with no stdin must not wait for the server's
+        Redirect in(std::cin, none.rdbuf()), out(std::cout, log.rdbuf()), err(std::cerr, log.rdbuf());
+        QI::FailedFlag() = false;
+        QI::ThrowOnExit() = true;
+        try {
+            std::istringstream text(job);
+            const std::vector<Stage> stages = ReadStages(text, "job");
+            for (size_t i = 0; i < stages.size(); i++) {
+                RunStage(stages[i], i, stages.size(), verbose);
+            }
+            ok = true;
+        } catch (QI::ExitRequest &e) {
+            ok = (e.code == EXIT_SUCCESS);
+        } catch (std::exception &e) {
+            log << e.what() << std::endl;
+        }
+        QI::ThrowOnExit() = false;
+        QI::ForgetAllMemory(); // Nothing in memory is shared between jobs
+    }
+    log << (ok ? "OK" : "FAILED") << std::endl;
+    return log.str();
+}
+
+int Serve(const std::string &path, const bool verbose) {
+    std::signal(SIGPIPE, SIG_IGN); // A client that disconnects early must not stop the server
+    const sockaddr_un addr = SocketAddress(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str()); // Left behind if a previous server was killed
+    if (fd < 0 || bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        QI_FAIL("Could not listen on " << path << ": " << std::strerror(errno));
+    }
+    QI::ThreadPool::Global(); // Start it now, so the jobs' --threads cannot change it
+    if (verbose) std::cout << "Listening on " << path << " with " << QI::ThreadPool::Global().size() << " threads" << std::endl;
+    for (size_t count = 1; ; count++) {
+        const int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            QI_FAIL("Could not accept a connection on " << path << ": " << std::strerror(errno));
+        }
+        const std::string job = ReadAll(client);
+        if (job.compare(0, std::strlen(ShutdownRequest), ShutdownRequest) == 0) {
+            WriteAll(client, "OK\n");
+            close(client);
+            break;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const std::string reply = RunJob(job, verbose);
+        WriteAll(client, reply);
+        close(client);
+        if (verbose) {
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << "Job " << count << " took " << elapsed << "s, " << reply.substr(reply.rfind('\n', reply.size() - 2) + 1);
+        }
+    }
+    close(fd);
+    unlink(path.c_str());
+    return EXIT_SUCCESS;
+}
+
+int Submit(const std::string &path, const std::string &request) {
+    const sockaddr_un addr = SocketAddress(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        QI_FAIL("Could not connect to a server on " << path << ": " << std::strerror(errno));
+    }
+    WriteAll(fd, request);
+    shutdown(fd, SHUT_WR);
+    const std::string reply = ReadAll(fd);
+    close(fd);
+    // The last line is the status, anything before it is the job's output
+    const size_t last = reply.rfind('\n', reply.size() < 2 ? 0 : reply.size() - 2);
+    const std::string status = (last == std::string::npos) ? reply : reply.substr(last + 1);
+    if (last != std::string::npos) std::cout << reply.substr(0, last + 1);
+    return (status == "OK\n") ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // End anonymous namespace
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Runs several QUIT programs in one process. Any path starting with mem: is kept in\n"
+                                "memory instead of written, so only the final outputs need to touch the disk.\n"
+                                "http://github.com/spinicist/QUIT");
+    args::Positional<std::string> pipeline_path(parser, "PIPELINE", "JSON file listing the stages");
+    args::HelpFlag help(parser, "HELP", "Show this help menu", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::Flag     list(parser, "LIST", "List the programs that can be run and exit", {'l', "list"});
+    args::ValueFlag<std::string> batch_path(parser, "BATCH", "Run the pipeline for each subject (line) of this table", {"batch"});
+    args::ValueFlag<std::string> serve(parser, "SOCKET", "Run pipelines sent to this socket until shut down", {"serve"});
+    args::ValueFlag<std::string> submit(parser, "SOCKET", "Send the pipeline to the server on this socket", {"submit"});
+    args::Flag     shutdown_server(parser, "SHUTDOWN", "With --submit, stop the server instead", {"shutdown"});
+    args::ValueFlag<int> threads(parser, "THREADS", "With --serve, the threads shared by all jobs (default and 0 = hardware limit)", {'T', "threads"});
+    QI::DisableCache(); // The stages run in this process, so cannot exit early or be stored at exit
+    QI::ParseArgs(parser, argc, argv, verbose);
+    if (list) {
+        for (const auto &p : Programs()) {
+            std::cout << p.first << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (serve) {
+        if (threads) QI::ThreadPool::SetGlobalThreads(threads.Get());
+        return Serve(serve.Get(), verbose);
+    }
+    if (submit && shutdown_server) {
+        return Submit(submit.Get(), ShutdownRequest);
+    }
+    if (submit) {
+        return Submit(submit.Get(), ReadText(QI::CheckPos(pipeline_path)));
+    }
+
+    std::ifstream pipeline_file(QI::CheckPos(pipeline_path));
+    if (!pipeline_file) {
+        QI_FAIL("Could not open pipeline file: " << pipeline_path.Get());
+    }
+    const std::vector<Stage> stages = ReadStages(pipeline_file, pipeline_path.Get());
+
+    if (!batch_path) {
+        for (size_t i = 0; i < stages.size(); i++) {
+            RunStage(stages[i], i, stages.size(), verbose);
+        }
+    } else {
+        // Only the stages change between subjects, the programs and this process are set up once
+        const auto subjects = ReadBatch(batch_path.Get());
+        auto bindAll = [&](const size_t j) -> std::vector<Stage> {
+            std::vector<Stage> bound;
+            for (const auto &s : stages) bound.push_back(s.bind(subjects[j]));
+            return bound;
+        };
+        std::vector<Stage> current = bindAll(0);
+        for (size_t j = 0; j < subjects.size(); j++) {
+            if (verbose) std::cout << "Subject " << (j + 1) << " of " << subjects.size() << std::endl;
+            std::vector<Stage> next;
+            std::unique_ptr<Prefetch> prefetch;
+            if (j + 1 < subjects.size()) {
+                next = bindAll(j + 1);
+                prefetch.reset(new Prefetch(next));
+            }
+            for (size_t i = 0; i < current.size(); i++) {
+                RunStage(current[i], i, current.size(), verbose);
+            }
+            QI::ForgetAllMemory(); // Nothing in memory is shared between subjects
+            current.swap(next);
+        }
+    }
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
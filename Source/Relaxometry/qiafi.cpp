@@ -12,35 +12,17 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <Eigen/Core>
 
 #include "ImageTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
-
-#include "itkExtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkBinaryFunctorImageFilter.h"
-
-template<class TPixel> class AFI {
-public:
-    AFI() {}
-    ~AFI() {}
-    bool operator!=(const AFI &) const { return false; }
-    bool operator==(const AFI &other) const { return !(*this != other); }
-
-    inline TPixel operator()(const TPixel &r,
-                             const TPixel &n) const
-    {
-        TPixel temp = (r*n - 1.) / (n - r);
-        if (temp > 1.)
-            temp = 1.;
-        if (temp < -1.)
-            temp = -1.;
-        TPixel alpha = acos(temp) * 180. / M_PI;
-        return alpha;
-    }
-};
+#include "ThreadPool.h"
+#include "FastTrig.h"
+#include "PolynomialFilters.h"
+#include "ElementwiseMap.h"
 
 int main(int argc, char **argv) {
     args::ArgumentParser parser("Calculates B1 maps from AFI data. Input file should have two volumes\n"
@@ -53,41 +35,43 @@ int main(int argc, char **argv) {
     args::ValueFlag<double> nom_flip(parser, "NOMINAL FLIP", "Specify nominal flip-angle, default 55", {'f', "flip"}, 55.0);
     args::ValueFlag<double> tr_ratio(parser, "TR RATIO", "Specify TR2:TR1 ratio, default 5", {'r', "ratio"}, 5.0);
     args::Flag     save_angle(parser, "SAVE ANGLE", "Write out the actual flip-angle as well as B1", {'s', "save"});
+    args::ValueFlag<int> poly(parser, "ORDER", "Write B1 as a polynomial of this order fitted to the raw map (saved as AFI_B1_raw)", {'p', "poly"});
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only fit the polynomial within the mask", {'m', "mask"});
     QI::ParseArgs(parser, argc, argv, verbose);
 
-    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
     if (verbose) std::cout << "Opening input file " << QI::CheckPos(input_path) << std::endl;
     auto inFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path));
+    if (inFile->GetLargestPossibleRegion().GetSize()[3] != 2) {
+        QI_FAIL("Input file " << input_path.Get() << " must have 2 volumes");
+    }
     if (verbose) {
         std::cout << "Nominal flip-angle is " << nom_flip.Get() << " degrees." << std::endl;
         std::cout << "TR2:TR1 ratio is " << tr_ratio.Get() << std::endl;
     }
-    auto volume1 = itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF>::New();
-    auto volume2 = itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF>::New();
-    auto region = inFile->GetLargestPossibleRegion();
-    region.GetModifiableSize()[3] = 0;
-    region.GetModifiableIndex()[3] = 0;
-    volume1->SetExtractionRegion(region);
-    volume1->SetInput(inFile);
-    volume1->SetDirectionCollapseToSubmatrix();
-    region.GetModifiableIndex()[3] = 1;
-    volume2->SetExtractionRegion(region);
-    volume2->SetInput(inFile);
-    volume2->SetDirectionCollapseToSubmatrix();
+    QI::VolumeF::Pointer angle = QI::NewVolumeLike(inFile);
+    QI::VolumeF::Pointer B1 = QI::NewVolumeLike(inFile);
+
+    // The two volumes are contiguous in the input, and the flip-angle comes from the vectorised acos
+    const float n = tr_ratio.Get();
+    const float to_B1 = 1. / nom_flip.Get();
+    QI::ElementwiseMap(QI::VoxelsPerVolume(inFile), [&](const size_t i, const size_t len) {
+        const auto s1 = QI::VolumeBlock(inFile, 0, i, len);
+        const auto s2 = QI::VolumeBlock(inFile, 1, i, len);
+        auto a = QI::VolumeBlock(angle, i, len);
+        const Eigen::ArrayXf r = s2 / s1;
+        a = QI::FastAcos(((r * n - 1.f) / (n - r)).max(-1.f).min(1.f)) * float(180. / M_PI);
+        QI::VolumeBlock(B1, i, len) = a * to_B1;
+    });
 
-    auto imageRatio = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
-    imageRatio->SetInput(0, volume2->GetOutput());
-    imageRatio->SetInput(1, volume1->GetOutput());
-    auto afi = itk::BinaryFunctorImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF, AFI<float>>::New();
-    afi->SetInput1(imageRatio->GetOutput());
-    afi->SetConstant2(tr_ratio.Get());
-    auto B1 = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
-    B1->SetInput1(afi->GetOutput());
-    B1->SetConstant2(nom_flip.Get());
-    B1->Update();
-    QI::WriteImage(B1->GetOutput(),  out_prefix.Get() + "AFI_B1" + QI::OutExt());
-    if (save_angle) QI::WriteImage(afi->GetOutput(), out_prefix.Get() + "AFI_angle" + QI::OutExt());
+    if (poly) {
+        if (verbose) std::cout << "Fitting order " << poly.Get() << " polynomial to B1" << std::endl;
+        QI::VolumeF::Pointer mask_img = mask ? QI::ReadImage(mask.Get()) : QI::VolumeF::Pointer();
+        QI::WriteImage(B1, out_prefix.Get() + "AFI_B1_raw" + QI::OutExt());
+        B1 = QI::PolynomialSmooth(B1, mask_img, poly.Get());
+    }
+    QI::WriteImage(B1, out_prefix.Get() + "AFI_B1" + QI::OutExt());
+    if (save_angle) QI::WriteImage(angle, out_prefix.Get() + "AFI_angle" + QI::OutExt());
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
-
@@ -10,17 +10,23 @@
  */
 
 #include <iostream>
+#include <memory>
 
 #include <Eigen/Dense>
-#include "ceres/ceres.h"
 
 #include "ApplyTypes.h"
 #include "Models.h"
 #include "SPGRSequence.h"
 #include "SequenceCereal.h"
 #include "Util.h"
+#include "Fit.h"
+#include "LevenbergMarquardt.h"
+#include "FlipTable.h"
 #include "Args.h"
+#include "RegionFit.h"
 #include "ImageIO.h"
+#include "ImageStreaming.h"
+#include "MonteCarlo.h"
 
 //******************************************************************************
 // Algorithm Subclasses
@@ -31,6 +37,7 @@ public:
 protected:
     const std::shared_ptr<QI::Model> m_model = std::make_shared<QI::SCD>();
     QI::SPGRSequence m_sequence;
+    std::shared_ptr<QI::FlipTable> m_flips; // For the batched linear fits
     size_t m_iterations = DefaultIterations;
     double m_loPD = -std::numeric_limits<double>::infinity();
     double m_hiPD = std::numeric_limits<double>::infinity();
@@ -40,7 +47,10 @@ protected:
 public:
     void setIterations(size_t n) { m_iterations = n; }
     size_t getIterations() { return m_iterations; }
-    void setSequence(QI::SPGRSequence &s) { m_sequence = s; }
+    virtual void setSequence(QI::SPGRSequence &s) {
+        m_sequence = s;
+        m_flips = std::make_shared<QI::FlipTable>(s.FA);
+    }
     void setClampT1(double lo, double hi) { m_loT1 = lo; m_hiT1 = hi; }
     void setClampPD(double lo, double hi) { m_loPD = lo; m_hiPD = hi; }
     size_t numInputs() const override { return m_sequence.count(); }
@@ -80,6 +90,41 @@ public:
         its = 1;
         return true;
     }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        // Same linearisation as apply(), but the 2x2 normal equations are solved in closed-form
+        // for every voxel (column) of the block at once, with the trigonometry from the table
+        const Eigen::ArrayXXd data = inputs[0].cast<double>().array();
+        Eigen::ArrayXXd sina, cosa;
+        (*m_flips)(consts[0].cast<double>().transpose(), sina, cosa);
+        const Eigen::ArrayXXd Y = data / sina;
+        const Eigen::ArrayXXd X = Y * cosa;
+        const double n = data.rows();
+        const Eigen::ArrayXd Sx = X.colwise().sum().transpose();
+        const Eigen::ArrayXd Sy = Y.colwise().sum().transpose();
+        const Eigen::ArrayXd Sxx = X.square().colwise().sum().transpose();
+        const Eigen::ArrayXd Sxy = (X * Y).colwise().sum().transpose();
+        const Eigen::ArrayXd b0 = (n * Sxy - Sx * Sy) / (n * Sxx - Sx.square());
+        const Eigen::ArrayXd b1 = (Sy - b0 * Sx) / n;
+        const Eigen::ArrayXd PD = (b1 / (1. - b0)).max(m_loPD).min(m_hiPD);
+        const Eigen::ArrayXd T1 = (-m_sequence.TR / b0.log()).max(m_loT1).min(m_hiT1);
+        outputs[0] = PD.transpose().cast<float>();
+        outputs[1] = T1.transpose().cast<float>();
+        const Eigen::ArrayXd E1 = (-m_sequence.TR / T1).exp();
+        const Eigen::ArrayXXd theory = ((sina.rowwise() * (PD * (1. - E1)).transpose()) /
+                                        (1. - cosa.rowwise() * E1.transpose())).abs();
+        const Eigen::ArrayXXf r = (data - theory).cast<float>();
+        residual = (r.square().colwise().sum() / r.rows()).sqrt().matrix();
+        if (resids.rows() > 0) {
+            resids = r.matrix();
+        }
+        its.setOnes();
+        return true;
+    }
 };
 
 class D1WLLS : public D1Algo {
@@ -102,7 +147,7 @@ public:
         out[1] = -m_sequence.TR / log(b[0]);
         out[0] = b[1] / (1. - b[0]);
         for (its = 0; its < m_iterations; its++) {
-            Eigen::VectorXd W = (flip.sin() / (1. - (exp(-m_sequence.TR/outputs[1])*flip.cos()))).square();
+            Eigen::VectorXd W = (flip.sin() / (1. - (exp(-m_sequence.TR/out[1])*flip.cos()))).square();
             b = (X.transpose() * W.asDiagonal() * X).partialPivLu().solve(X.transpose() * W.asDiagonal() * Y);
             Eigen::Array2d newOut;
             newOut[1] = -m_sequence.TR / log(b[0]);
@@ -120,54 +165,107 @@ public:
         resids = itk::VariableLengthVector<float>(r.data(), r.rows());
         return true;
     }
-};
-
-class T1Cost : public ceres::CostFunction {
-protected:
-    const QI::SPGRSequence m_seq;
-    const Eigen::ArrayXd m_data;
-    const double m_B1;
-
-public:
-    T1Cost(const QI::SPGRSequence cs, const Eigen::ArrayXd &data, const double B1) :
-        m_seq(cs), m_data(data), m_B1(B1)
-    {
-        mutable_parameter_block_sizes()->push_back(2);
-        set_num_residuals(data.size());
-    }
 
-    bool Evaluate(double const* const* parameters,
-                  double* resids,
-                  double** jacobians) const override
+    /*
+     * Every voxel of the block is iterated together, and each stops updating once its estimate
+     * converges with the same test as apply()
+     */
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
     {
-        Eigen::Map<const Eigen::Array2d> p(parameters[0]);
-        Eigen::Map<Eigen::ArrayXd> r(resids, m_data.size());
-        Eigen::ArrayXd s = QI::One_SPGR(m_seq.FA, m_seq.TR, p[0], p[1], m_B1).array().abs();
-        r = s - m_data;
-        if (jacobians && jacobians[0]) {
-            Eigen::Map<Eigen::Matrix<double, -1, -1, Eigen::RowMajor>> j(jacobians[0], m_data.size(), p.size());
-            j = QI::One_SPGR_Magnitude_Derivs(m_seq.FA, m_seq.TR, p[0], p[1], m_B1);
+        const Eigen::ArrayXXd data = inputs[0].cast<double>().array();
+        Eigen::ArrayXXd sina, cosa;
+        (*m_flips)(consts[0].cast<double>().transpose(), sina, cosa);
+        const Eigen::ArrayXXd Y = data / sina;
+        const Eigen::ArrayXXd X = Y * cosa;
+        auto fit = [&](const Eigen::ArrayXXd &W, Eigen::ArrayXd &PD, Eigen::ArrayXd &T1) {
+            const Eigen::ArrayXd Sw = W.colwise().sum().transpose();
+            const Eigen::ArrayXd Sx = (W * X).colwise().sum().transpose();
+            const Eigen::ArrayXd Sy = (W * Y).colwise().sum().transpose();
+            const Eigen::ArrayXd Sxx = (W * X.square()).colwise().sum().transpose();
+            const Eigen::ArrayXd Sxy = (W * X * Y).colwise().sum().transpose();
+            const Eigen::ArrayXd b0 = (Sw * Sxy - Sx * Sy) / (Sw * Sxx - Sx.square());
+            const Eigen::ArrayXd b1 = (Sy - b0 * Sx) / Sw;
+            T1 = -m_sequence.TR / b0.log();
+            PD = b1 / (1. - b0);
+        };
+        Eigen::ArrayXd PD, T1, newPD, newT1;
+        fit(Eigen::ArrayXXd::Ones(data.rows(), data.cols()), PD, T1);
+        Eigen::Array<bool, Eigen::Dynamic, 1> done = Eigen::Array<bool, Eigen::Dynamic, 1>::Constant(data.cols(), false);
+        its.setConstant(m_iterations);
+        for (size_t it = 0; it < m_iterations && !done.all(); it++) {
+            const Eigen::ArrayXd E1 = (-m_sequence.TR / T1).exp();
+            fit((sina / (1. - cosa.rowwise() * E1.transpose())).square(), newPD, newT1);
+            const Eigen::ArrayXd diff = (newPD - PD).square() + (newT1 - T1).square();
+            const Eigen::ArrayXd norm = (PD.square() + T1.square()).min(newPD.square() + newT1.square());
+            const double prec = Eigen::NumTraits<double>::dummy_precision();
+            for (Eigen::Index v = 0; v < data.cols(); v++) {
+                if (done[v]) continue;
+                if (diff[v] <= prec * prec * norm[v]) {
+                    done[v] = true;
+                    its[v] = it;
+                } else {
+                    PD[v] = newPD[v];
+                    T1[v] = newT1[v];
+                }
+            }
+        }
+        PD = PD.max(m_loPD).min(m_hiPD);
+        T1 = T1.max(m_loT1).min(m_hiT1);
+        outputs[0] = PD.transpose().cast<float>();
+        outputs[1] = T1.transpose().cast<float>();
+        const Eigen::ArrayXd E1 = (-m_sequence.TR / T1).exp();
+        const Eigen::ArrayXXd theory = ((sina.rowwise() * (PD * (1. - E1)).transpose()) /
+                                        (1. - cosa.rowwise() * E1.transpose())).abs();
+        const Eigen::ArrayXXf r = (data - theory).cast<float>();
+        residual = (r.square().colwise().sum() / r.rows()).sqrt().matrix();
+        if (resids.rows() > 0) {
+            resids = r.matrix();
         }
         return true;
     }
+};
 
+// Residuals of the SPGR signal, for automatic derivatives. PD and T1 are bounded above zero.
+struct T1Functor {
+    const QI::SPGRSequence &seq;
+    const Eigen::ArrayXd &data;
+    const double B1;
 
+    template<typename T>
+    bool operator()(const T *const p, T *r) const {
+        for (Eigen::Index i = 0; i < data.size(); i++) {
+            r[i] = QI::One_SPGR_Signal(B1 * seq.FA[i], seq.TR, p[0], p[1]) - data[i];
+        }
+        return true;
+    }
 };
 
 class D1NLLS : public D1Algo {
 public:
+    static const int MaxFlips = 64;
+    typedef QI::AutoDiffModel<2, T1Functor, MaxFlips> TModel;
+
     D1NLLS() {
         m_loT1 = 1e-6;
         m_loPD = 1e-6;
     }
 
+    void setSequence(QI::SPGRSequence &s) override {
+        if (s.size() > static_cast<size_t>(MaxFlips)) {
+            QI_FAIL("NLLS fits at most " << MaxFlips << " flip-angles");
+        }
+        D1Algo::setSequence(s);
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TConst &residual,
                TInput &resids, TIterations &its) const override
     {
         Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        const double B1 = consts[0];
         const double scale = indata.maxCoeff();
         if (scale < 0) {
             outputs[0] = 0;
@@ -176,37 +274,33 @@ public:
             return false;
         }
         const Eigen::ArrayXd data = indata.cast<double>() / scale;
-        Eigen::Array2d p; p << 10., 1.;
-        ceres::Problem problem;
-        problem.AddResidualBlock(new T1Cost(m_sequence, data, B1), NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, m_loPD / scale);
-        problem.SetParameterUpperBound(p.data(), 0, m_hiPD / scale);
-        problem.SetParameterLowerBound(p.data(), 1, m_loT1);
-        problem.SetParameterUpperBound(p.data(), 1, m_hiT1);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations = 50;
-        options.function_tolerance = 1e-5;
-        options.gradient_tolerance = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        // options.check_gradients = true;
-        options.logging_type = ceres::SILENT;
-        // std::cout << "START P: " << p.transpose() << std::endl;
-        ceres::Solve(options, &problem, &summary);
-        
-        outputs[0] = p[0] * indata.maxCoeff();
-        outputs[1] = p[1];
-        if (!summary.IsSolutionUsable()) {
-            std::cout << summary.FullReport() << std::endl;
+        const T1Functor functor{m_sequence, data, consts[0]};
+        const TModel model(functor, data.size());
+        Eigen::Vector2d p;
+        if (outputs[0] > 0 && outputs[1] > 0) {
+            p << outputs[0] / scale, outputs[1]; // Warm-start
+        } else {
+            p << 10., 1.;
         }
-        its = summary.iterations.size();
-        residual = summary.final_cost * indata.maxCoeff();
+        const Eigen::Vector2d lower(m_loPD / scale, m_loT1), upper(m_hiPD / scale, m_hiT1);
+        p = p.cwiseMax(lower).cwiseMin(upper);
+        if (!model.valid(p)) {
+            outputs[0] = 0;
+            outputs[1] = 0;
+            residual = 0;
+            return false;
+        }
+        its = QI::LevenbergMarquardt<2>(model, p, lower, upper, 50, 1e-5);
+
+        outputs[0] = p[0] * scale;
+        outputs[1] = p[1];
+        Eigen::ArrayXd r(data.size());
+        functor(p.data(), r.data());
+        residual = 0.5 * r.square().sum() * scale; // Half the sum of squares, as Ceres reported it
         if (resids.Size() > 0) {
             assert(resids.Size() == data.size());
-            std::vector<double> r_temp(data.size());
-            problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
-            for (int i = 0; i < r_temp.size(); i++)
-                resids[i] = r_temp[i];
+            for (int i = 0; i < r.size(); i++)
+                resids[i] = r[i];
         }
         return true;
     }
@@ -225,16 +319,25 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a',"algo"}, 'l');
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampPD(parser, "CLAMP PD", "Clamp PD between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> clampT1(parser, "CLAMP T1", "Clamp T1 between 0 and value", {'t',"clampT2"}, std::numeric_limits<float>::infinity());
+    args::Flag timing(parser, "TIMING", "Write out the time spent fitting each voxel (ns)", {"timing"});
+    args::Flag pin(parser, "PIN", "Pin threads to CPUs and allocate outputs from them (for NUMA machines)", {"pin"});
+    args::Flag warm(parser, "WARM", "Start each fit from the neighbouring voxel's result", {"warm"});
+    args::ValueFlag<int> multigrid(parser, "FACTOR", "Fit every FACTOR'th voxel first and start the rest from them", {"multigrid"}, 1);
+    args::Flag sparse(parser, "SPARSE", "Gather the voxels to fit into dense blocks first, for sparse masks", {"sparse"});
+    args::ValueFlag<std::string> initial(parser, "PREFIX", "Start each fit from the maps written with output prefix PREFIX, e.g. for the previous time-point", {"initial"});
+    args::ValueFlag<int> stream(parser, "SLABS", "Read, fit and write the volume in this many slabs to limit memory use", {"stream"});
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
+    QI::MemoryArgs memory(parser);
+    QI::MonteCarloArgs montecarlo(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
-    if (verbose) std::cout << "Opening SPGR file: " << QI::CheckPos(spgr_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(spgr_path));
     std::shared_ptr<D1Algo> algo;
     switch (algorithm.Get()) {
         case 'l': algo = std::make_shared<D1LLS>();  if (verbose) std::cout << "LLS algorithm selected." << std::endl; break;
@@ -246,36 +349,111 @@ int main(int argc, char **argv) {
     if (clampT1) algo->setClampT1(1e-6, clampT1.Get());
     auto spgrSequence = QI::ReadSequence<QI::SPGRSequence>(std::cin, verbose);
     algo->setSequence(spgrSequence);
+    if (montecarlo.enabled()) {
+        QI::ThreadPool::SetGlobalThreads(threads.Get());
+        return montecarlo.Run(*algo, spgrSequence, std::make_shared<QI::SCD>(), {"B1"}, {"PD", "T1"},
+                              outarg.Get() + "D1_MC.txt", verbose);
+    }
+
+    if (verbose) std::cout << "Opening SPGR file: " << QI::CheckPos(spgr_path) << std::endl;
+    // With a memory limit the input is opened as a stream too, in case the fit has to be streamed
+    std::unique_ptr<QI::VectorImageStream<float>> dataStream;
+    QI::VectorVolumeF::Pointer data;
+    if ((stream || memory.bytes()) && !regions.requested() && !subregion.requested()) {
+        dataStream.reset(new QI::VectorImageStream<float>(QI::CheckPos(spgr_path)));
+        data = dataStream->GetOutput();
+    } else {
+        data = QI::ReadVectorImage<float>(QI::CheckPos(spgr_path), subregion.region());
+    }
     auto apply = QI::ApplyF::New();
     apply->SetVerbose(verbose);
     apply->SetAlgorithm(algo);
     apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetOutputIterations(its);
+    apply->SetOutputTiming(timing);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
+    apply->SetPin(pin);
+    apply->SetWarmStart(warm);
+    apply->SetMultigrid(multigrid.Get());
+    apply->SetSparse(sparse);
+    if (initial) {
+        if (verbose) std::cout << "Starting from the maps with prefix: " << initial.Get() << std::endl;
+        apply->SetInitial(0, QI::ReadImage(initial.Get() + "D1_PD" + QI::OutExt(), subregion.region()));
+        apply->SetInitial(1, QI::ReadImage(initial.Get() + "D1_T1" + QI::OutExt(), subregion.region()));
+    }
     apply->SetInput(0, data);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
+    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), {"PD", "T1"}, outarg.Get() + "D1_", verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
+    std::string outPrefix = outarg.Get() + "D1_";
+    // The stream reads the input as a series and then converts it, so each slab holds it twice
+    const size_t nSlabs = subregion.requested() ? 0 : memory.Slabs(apply, stream ? stream.Get() : 0, verbose, algo->dataSize() * sizeof(float));
+    if (nSlabs > 0) {
+        if (!stream) {
+            if (QI::OutExt().find(".gz") != std::string::npos) {
+                QI_FAIL("The fit needs " << nSlabs << " slabs to stay inside the memory limit, which needs uncompressed outputs (e.g. QUIT_EXT=NIFTI)");
+            }
+            if (verbose) std::cout << "Streaming in " << nSlabs << " slabs to stay inside the memory limit" << std::endl;
+        }
+        apply->UpdateOutputInformation();
+        QI::SlabWriter slabs(nSlabs, verbose);
+        slabs.Add(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
+        slabs.Add(apply->GetOutput(1), outPrefix + "T1" + QI::OutExt());
+        slabs.Add(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt(), apply->GetOutput(0));
+        if (resids) {
+            slabs.Add(apply->GetAllResidualsOutput(), outPrefix + "all_residuals" + QI::OutExt(), apply->GetOutput(0));
+        }
+        if (its) {
+            slabs.Add(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+        }
+        if (timing) {
+            slabs.Add(apply->GetTimingOutput(), outPrefix + "timing" + QI::OutExt());
+        }
+        if (checkpoint.failures) {
+            slabs.Add(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+        }
+        slabs.Write(apply->GetOutput(0)->GetLargestPossibleRegion());
+        if (verbose) std::cout << "Finished." << std::endl;
+        return EXIT_SUCCESS;
+    }
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
     }
-    std::string outPrefix = outarg.Get() + "D1_";
     QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
     QI::WriteImage(apply->GetOutput(1), outPrefix + "T1" + QI::OutExt());
     QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
     if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (timing) {
+        QI::WriteImage(apply->GetTimingOutput(), outPrefix + "timing" + QI::OutExt());
     }
     if (its) {
         QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
     }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
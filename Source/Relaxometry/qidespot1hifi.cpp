@@ -13,94 +13,54 @@
  */
 
 #include <iostream>
+#include <vector>
+#include <limits>
 #include <Eigen/Dense>
-#include "ceres/ceres.h"
 
 #include "Util.h"
 #include "SPGRSequence.h"
 #include "MPRAGESequence.h"
 #include "SequenceCereal.h"
 #include "Args.h"
+#include "RegionFit.h"
 #include "ImageIO.h"
 #include "ApplyTypes.h"
+#include "LevenbergMarquardt.h"
 
-class SPGRCost : public ceres::CostFunction {
-protected:
-    const QI::SPGRSequence &m_seq;
-    const Eigen::ArrayXd m_data;
-
-public:
-    SPGRCost(const QI::SPGRSequence &s, const Eigen::ArrayXd &data) :
-        m_seq(s), m_data(data)
-    {
-        mutable_parameter_block_sizes()->push_back(3);
-        set_num_residuals(data.size());
+/*
+ * The SPGR points followed by the single IR-SPGR / MP-RAGE point, with PD, T1 & B1 as parameters
+ * and analytic derivatives. The fitting bounds are kept by rejecting steps that leave them.
+ */
+struct HIFIModel {
+    typedef Eigen::Vector3d TParams;
+    const QI::SPGRSequence &spgr;
+    const QI::MPRAGESequence &mprage;
+    const Eigen::ArrayXd &spgr_data;
+    const double ir_data;
+
+    size_t size() const { return spgr_data.rows() + 1; }
+    bool valid(const TParams &p) const {
+        return p[0] >= 1. && p[1] >= 0.001 && p[1] <= 5.0 && p[2] >= 0.1 && p[2] <= 2.0;
     }
-
-    bool Evaluate(double const* const* p,
-                  double* resids,
-                  double** jacobians) const override
-    {
-        const double &M0 = p[0][0];
-        const double &T1 = p[0][1];
-        const double &B1 = p[0][2];
-
-        const Eigen::ArrayXd sa = sin(B1 * m_seq.FA);
-        const Eigen::ArrayXd ca = cos(B1 * m_seq.FA);
-        const double E1 = exp(-m_seq.TR / T1);
-        const Eigen::ArrayXd denom = (1.-E1*ca);
-        
-        Eigen::Map<Eigen::ArrayXd> r(resids, m_data.size());
-        r = M0*sa*(1-E1)/denom - m_data;
-        
-        // std::cout << "SPGR RESIDS" << std::endl;
-        // std::cout << r.transpose() << std::endl;
-        if (jacobians && jacobians[0]) {
-            Eigen::Map<Eigen::Matrix<double, -1, -1, Eigen::RowMajor>> j(jacobians[0], m_data.size(), 3);
-            j.col(0) = (1-E1)*sa/denom;
-            j.col(1) = E1*M0*m_seq.TR*(ca-1.)*sa/((denom*T1).square());
-            j.col(2) = M0*m_seq.FA*(1.-E1)*(ca-E1)/denom.square();
+    double residual(const size_t i, const TParams &p, TParams &gradient) const {
+        const double &M0 = p[0];
+        const double &T1 = p[1];
+        const double &B1 = p[2];
+        if (i < static_cast<size_t>(spgr_data.rows())) {
+            const double sa = sin(B1 * spgr.FA[i]);
+            const double ca = cos(B1 * spgr.FA[i]);
+            const double E1 = exp(-spgr.TR / T1);
+            const double denom = (1.-E1*ca);
+            gradient[0] = (1-E1)*sa/denom;
+            gradient[1] = E1*M0*spgr.TR*(ca-1.)*sa/((denom*T1)*(denom*T1));
+            gradient[2] = M0*spgr.FA[i]*(1.-E1)*(ca-E1)/(denom*denom);
+            return M0*sa*(1-E1)/denom - spgr_data[i];
+        } else {
+            // One_MPRAGE negates eta itself, so 1 is a perfect inversion
+            const double s = mprage.signal(M0, T1, B1, 1.0, &gradient);
+            gradient = -gradient;
+            return ir_data - s;
         }
-        return true;
-    }
-};
-
-// Use AutoDiff for this
-class IRCostFunction  {
-protected:
-    const QI::MPRAGESequence &m_seq;
-    const Eigen::ArrayXd m_data;
-
-public:
-    IRCostFunction(const QI::MPRAGESequence &s, const Eigen::ArrayXd &data) :
-        m_seq(s), m_data(data)
-    {
-    }
-
-    template<typename T> bool operator() (const T* const p1, T* r) const
-    {
-        const T &M0 = p1[0];
-        const T &T1 = p1[1];
-        const T &B1 = p1[2];
-        const double eta = -1.0; // Inversion efficiency defined as -1 < eta < 0
-
-        const double TIs = m_seq.TI - m_seq.TR*m_seq.k0; // Adjust TI for k0
-        const T T1s = 1. / (1./T1 - log(cos(m_seq.FA * B1))/m_seq.TR);
-        const T M0s = M0 * (1. - exp(-m_seq.TR/T1)) / (1. - exp(-m_seq.TR/T1s));
-        const T A_1 = M0s*(1. - exp(-(m_seq.ETL*m_seq.TR)/T1s));
-
-        const T A_2 = M0*(1. - exp(-m_seq.TD/T1));
-        const T A_3 = M0*(1. - exp(-TIs/T1));
-        const T B_1 = exp(-(m_seq.ETL*m_seq.TR)/T1s);
-        const T B_2 = exp(-m_seq.TD/T1);
-        const T B_3 = eta*exp(-TIs/T1);
-
-        const T A = A_3 + A_2*B_3 + A_1*B_2*B_3;
-        const T B = B_1*B_2*B_3;
-        const T M1 = A / (1. - B);
-
-        r[0] = m_data[0] - (M0s + (M1 - M0s)*exp(-(m_seq.k0*m_seq.TR)/T1s)) * sin(m_seq.FA * B1);
-        return true;
     }
 };
 
@@ -110,6 +70,49 @@ private:
     const QI::MPRAGESequence &m_mprage;
     double m_lo = 0;
     double m_hi = std::numeric_limits<double>::infinity();
+
+    static double cost(const HIFIModel &model, const Eigen::Vector3d &p) {
+        Eigen::Vector3d g;
+        double c = 0;
+        for (size_t i = 0; i < model.size(); i++) {
+            const double r = model.residual(i, p, g);
+            c += r * r;
+        }
+        return c;
+    }
+
+    /*
+     * The joint cost has a long, flat valley along B1 with several minima in it. Profile the cost
+     * over a fine B1 grid, taking PD & T1 at each point from the closed-form DESPOT1 fit to the
+     * SPGR data alone, and start from every minimum of that profile.
+     */
+    std::vector<Eigen::Vector3d> starts(const HIFIModel &model) const {
+        const Eigen::ArrayXd &S = model.spgr_data;
+        const double n = S.rows();
+        std::vector<Eigen::Vector3d> grid;
+        std::vector<double> costs;
+        for (double B1 = 0.3; B1 < 2.0; B1 += 0.01) {
+            const Eigen::ArrayXd Y = S / (m_spgr.FA * B1).sin();
+            const Eigen::ArrayXd X = S / (m_spgr.FA * B1).tan();
+            const double b0 = (n * (X * Y).sum() - X.sum() * Y.sum()) / (n * X.square().sum() - X.sum() * X.sum());
+            const double b1 = (Y.sum() - b0 * X.sum()) / n;
+            if (b0 > 0 && b0 < 1) {
+                grid.push_back(Eigen::Vector3d(QI::Clamp(b1 / (1. - b0), 1., 1e6), QI::Clamp(-m_spgr.TR / log(b0), 0.001, 5.0), B1));
+                costs.push_back(cost(model, grid.back()));
+            }
+        }
+        std::vector<Eigen::Vector3d> minima;
+        for (size_t i = 0; i < grid.size(); i++) {
+            if ((i == 0 || costs[i] <= costs[i - 1]) && (i + 1 == grid.size() || costs[i] <= costs[i + 1])) {
+                minima.push_back(grid[i]);
+            }
+        }
+        if (minima.empty()) {
+            minima.push_back(Eigen::Vector3d(10., 1., 1.)); // PD, T1, B1
+        }
+        return minima;
+    }
+
 public:
     HIFIAlgo(const QI::SPGRSequence &s, const QI::MPRAGESequence &m, const float hi) :
         m_spgr(s), m_mprage(m), m_hi(hi)
@@ -133,45 +136,32 @@ public:
     {
         Eigen::Map<const Eigen::ArrayXf> spgr_in(inputs[0].GetDataPointer(), inputs[0].Size());
         Eigen::Map<const Eigen::ArrayXf> ir_in(inputs[1].GetDataPointer(), inputs[1].Size());
-        double scale = std::max(spgr_in.maxCoeff(), ir_in.maxCoeff());
+        const double scale = std::max(spgr_in.maxCoeff(), ir_in.maxCoeff());
         const Eigen::ArrayXd spgr_data = spgr_in.cast<double>() / scale;
-        const Eigen::ArrayXd ir_data = ir_in.cast<double>() / scale;
-        double spgr_pars[] = {10., 1., 1.}; // PD, T1, B1
-        ceres::Problem problem;
-        problem.AddResidualBlock(new SPGRCost(m_spgr, spgr_data), NULL, spgr_pars);
-        ceres::CostFunction *IRCost = new ceres::AutoDiffCostFunction<IRCostFunction, 1, 3>(new IRCostFunction(m_mprage, ir_data));
-        problem.AddResidualBlock(IRCost, NULL, spgr_pars);
-        problem.SetParameterLowerBound(spgr_pars, 0, 1.);
-        problem.SetParameterLowerBound(spgr_pars, 1, 0.001);
-        problem.SetParameterUpperBound(spgr_pars, 1, 5.0);
-        problem.SetParameterLowerBound(spgr_pars, 2, 0.1);
-        problem.SetParameterUpperBound(spgr_pars, 2, 2.0);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations = 50;
-        options.function_tolerance = 1e-5;
-        options.gradient_tolerance = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        // options.check_gradients = true;
-        options.logging_type = ceres::SILENT;
-        // std::cout << "START P: " << p.transpose() << std::endl;
-        ceres::Solve(options, &problem, &summary);
-        
-        outputs[0] = spgr_pars[0] * scale;
-        outputs[1] = QI::Clamp(spgr_pars[1], m_lo, m_hi);
-        outputs[2] = spgr_pars[2];
-        if (!summary.IsSolutionUsable()) {
-            std::cout << summary.FullReport() << std::endl;
+        const HIFIModel model{m_spgr, m_mprage, spgr_data, ir_in[0] / scale};
+        Eigen::Vector3d p;
+        double best = std::numeric_limits<double>::infinity();
+        its = 0;
+        for (const Eigen::Vector3d &start : starts(model)) {
+            Eigen::Vector3d q = start;
+            its += QI::LevenbergMarquardt<3>(model, q, 50, 1e-6);
+            const double c = cost(model, q);
+            if (c < best) {
+                best = c;
+                p = q;
+            }
         }
-        its = summary.iterations.size();
-        residual = summary.final_cost * scale;
+
+        outputs[0] = p[0] * scale;
+        outputs[1] = QI::Clamp(p[1], m_lo, m_hi);
+        outputs[2] = p[2];
         if (resids.Size() > 0) {
-            std::vector<double> r_temp(spgr_data.size() + 1);
-            problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
-            for (int i = 0; i < r_temp.size(); i++) {
-                resids[i] = r_temp[i];
+            Eigen::Vector3d g;
+            for (size_t i = 0; i < model.size(); i++) {
+                resids[i] = model.residual(i, p, g);
             }
         }
+        residual = 0.5 * best * scale;
         return true;
     }
 };
@@ -193,31 +183,45 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     if (verbose) std::cout << "Reading SPGR file: " << QI::CheckPos(spgr_path) << std::endl;
-    auto spgrImg = QI::ReadVectorImage(QI::CheckPos(spgr_path));
+    auto spgrImg = QI::ReadVectorImage(QI::CheckPos(spgr_path), subregion.region());
     cereal::JSONInputArchive input(std::cin);
     auto spgr_sequence = QI::ReadSequence<QI::SPGRSequence>(input, verbose);
     if (verbose) std::cout << "Reading MPRAGE file: " << QI::CheckPos(ir_path) << std::endl;
-    auto irImg = QI::ReadVectorImage(QI::CheckPos(ir_path));
+    auto irImg = QI::ReadVectorImage(QI::CheckPos(ir_path), subregion.region());
     auto ir_sequence = QI::ReadSequence<QI::MPRAGESequence>(input, verbose);
 
     auto apply = QI::ApplyF::New();
     auto hifi = std::make_shared<HIFIAlgo>(spgr_sequence, ir_sequence, clamp.Get());
     apply->SetAlgorithm(hifi);
     apply->SetOutputAllResiduals(all_resids);
+    apply->SetOutputResidual(true);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
     apply->SetVerbose(verbose);
     apply->SetInput(0, spgrImg);
     apply->SetInput(1, irImg);
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) std::cout << "Processing..." << std::endl;
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), {"PD", "T1", "B1"}, outarg.Get() + "HIFI_", verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
@@ -228,7 +232,10 @@ int main(int argc, char **argv) {
     QI::WriteImage(apply->GetOutput(2), out_prefix + "B1" + QI::OutExt());
     QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), out_prefix + "residual"  + QI::OutExt());
     if (all_resids) {
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_prefix + "all_residuals" + QI::OutExt());
+        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_prefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), out_prefix + "failures" + QI::OutExt());
     }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
@@ -21,8 +21,12 @@
 #include "SequenceCereal.h"
 #include "Util.h"
 #include "Args.h"
+#include "RegionFit.h"
 #include "ImageIO.h"
+#include "WriteQueue.h"
 #include "ApplyTypes.h"
+#include "LevenbergMarquardt.h"
+#include "FlipTable.h"
 
 //******************************************************************************
 // Algorithm Subclasses
@@ -31,8 +35,10 @@ class D2Algo : public QI::ApplyF::Algorithm {
 protected:
     const std::shared_ptr<QI::SCD> m_model = std::make_shared<QI::SCD>();
     std::shared_ptr<QI::SSFPBase> m_sequence;
+    std::shared_ptr<QI::FlipTable> m_flips; // For the batched linear fits
     size_t m_iterations = 15;
     bool m_elliptical = false;
+    bool m_analytic = false; // NLLS can use the closed-form signal and derivatives
     double m_loPD = -std::numeric_limits<double>::infinity();
     double m_hiPD = std::numeric_limits<double>::infinity();
     double m_loT2 = -std::numeric_limits<double>::infinity();
@@ -40,7 +46,13 @@ protected:
 
 public:
     void setIterations(size_t n) { m_iterations = n; }
-    void setSequence(std::shared_ptr<QI::SSFPBase> &s) { m_sequence = s; }
+    void setSequence(std::shared_ptr<QI::SSFPBase> &s) {
+        m_sequence = s;
+        m_flips = std::make_shared<QI::FlipTable>(s->FA);
+        const auto bssfp = std::dynamic_pointer_cast<QI::SSFPSequence>(s);
+        m_analytic = std::dynamic_pointer_cast<QI::SSFPGSSequence>(s) ||
+                     (bssfp && ((bssfp->PhaseInc - M_PI).abs() < 1e-6).all());
+    }
     void setElliptical(bool e) { m_elliptical = e; }
     void setClampT2(double lo, double hi) { m_loT2 = lo; m_hiT2 = hi; }
     void setClampPD(double lo, double hi) { m_loPD = lo; m_hiPD = hi; }
@@ -54,6 +66,68 @@ public:
         std::vector<float> def(2, 1.0f); // T1, B1
         return def;
     }
+
+protected:
+    /*
+     * Helpers for the batched linear fits, which hold one voxel per column. The regression of
+     * Y = S/sin(α) on X = S/tan(α) is solved in closed form, optionally weighted.
+     */
+    void regress(const Eigen::ArrayXXd &X, const Eigen::ArrayXXd &Y, const Eigen::ArrayXXd &W,
+                 const Eigen::ArrayXd &E1, Eigen::ArrayXd &PD, Eigen::ArrayXd &T2) const {
+        const double TR = m_sequence->TR;
+        const Eigen::ArrayXd Sw = W.colwise().sum().transpose();
+        const Eigen::ArrayXd Sx = (W * X).colwise().sum().transpose();
+        const Eigen::ArrayXd Sy = (W * Y).colwise().sum().transpose();
+        const Eigen::ArrayXd Sxx = (W * X.square()).colwise().sum().transpose();
+        const Eigen::ArrayXd Sxy = (W * X * Y).colwise().sum().transpose();
+        const Eigen::ArrayXd b0 = (Sw * Sxy - Sx * Sy) / (Sw * Sxx - Sx.square());
+        const Eigen::ArrayXd b1 = (Sy - b0 * Sx) / Sw;
+        const Eigen::ArrayXd L = ((b0 * E1 - 1.) / (b0 - E1)).log();
+        if (m_elliptical) {
+            T2 = 2. * TR / L;
+            const Eigen::ArrayXd E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1*E2*E2) / (E2.sqrt() * (1. - E1));
+        } else {
+            T2 = TR / L;
+            const Eigen::ArrayXd E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1*E2) / (1. - E1);
+        }
+    }
+
+    /*
+     * The closed-form signal is used for the residuals where the NLLS model allows, otherwise
+     * the sequence is asked for each voxel
+     */
+    void finish(const Eigen::ArrayXXd &data, const Eigen::ArrayXXd &sina, const Eigen::ArrayXXd &cosa,
+                const Eigen::ArrayXd &T1, const Eigen::ArrayXd &B1, const Eigen::ArrayXd &PD, const Eigen::ArrayXd &T2,
+                std::vector<TOutputBlock> &outputs, TOutputBlock &residual, TResidsBlock &resids) const {
+        outputs[0] = PD.max(m_loPD).min(m_hiPD).transpose().cast<float>();
+        outputs[1] = T2.max(m_loT2).min(m_hiT2).transpose().cast<float>();
+        Eigen::ArrayXXd theory(data.rows(), data.cols());
+        if (m_analytic) {
+            const Eigen::ArrayXd E1 = (-m_sequence->TR / T1).exp();
+            const Eigen::ArrayXd E2 = (-m_sequence->TR / T2).exp();
+            const Eigen::ArrayXXd A = sina.rowwise() * (PD * (1. - E1)).transpose();
+            if (m_elliptical) {
+                const Eigen::ArrayXd E22 = E2.square();
+                theory = (A.rowwise() * E2.sqrt().transpose()) /
+                         ((1. - (E1 * E22)).transpose().replicate(data.rows(), 1) - cosa.rowwise() * (E1 - E22).transpose());
+            } else {
+                theory = A / ((1. - (E1 * E2)).transpose().replicate(data.rows(), 1) - cosa.rowwise() * (E1 - E2).transpose());
+            }
+            theory = theory.abs();
+        } else {
+            for (Eigen::Index v = 0; v < data.cols(); v++) {
+                Eigen::VectorXd p(5); p << PD[v], T1[v], T2[v], 0, B1[v];
+                theory.col(v) = m_sequence->signal(m_model, p).abs();
+            }
+        }
+        const Eigen::ArrayXXf r = (data - theory).cast<float>();
+        residual = (r.square().colwise().sum() / r.rows()).sqrt().matrix();
+        if (resids.rows() > 0) {
+            resids = r.matrix();
+        }
+    }
 };
 
 class D2LLS : public D2Algo {
@@ -95,6 +169,26 @@ public:
         its = 1;
         return true;
     }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        const Eigen::ArrayXXd data = inputs[0].cast<double>().array();
+        const Eigen::ArrayXd T1 = consts[0].cast<double>().transpose();
+        const Eigen::ArrayXd B1 = consts[1].cast<double>().transpose();
+        const Eigen::ArrayXd E1 = (-m_sequence->TR / T1).exp();
+        Eigen::ArrayXXd sina, cosa;
+        (*m_flips)(B1, sina, cosa);
+        const Eigen::ArrayXXd Y = data / sina;
+        const Eigen::ArrayXXd X = Y * cosa;
+        Eigen::ArrayXd PD, T2;
+        regress(X, Y, Eigen::ArrayXXd::Ones(data.rows(), data.cols()), E1, PD, T2);
+        finish(data, sina, cosa, T1, B1, PD, T2, outputs, residual, resids);
+        its.setOnes();
+        return true;
+    }
 };
 
 class D2WLLS : public D2Algo {
@@ -154,11 +248,78 @@ public:
         its = m_iterations;
         return true;
     }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        const Eigen::ArrayXXd data = inputs[0].cast<double>().array();
+        const Eigen::ArrayXd T1 = consts[0].cast<double>().transpose();
+        const Eigen::ArrayXd B1 = consts[1].cast<double>().transpose();
+        const Eigen::ArrayXd E1 = (-m_sequence->TR / T1).exp();
+        Eigen::ArrayXXd sina, cosa;
+        (*m_flips)(B1, sina, cosa);
+        const Eigen::ArrayXXd Y = data / sina;
+        const Eigen::ArrayXXd X = Y * cosa;
+        Eigen::ArrayXd PD, T2;
+        regress(X, Y, Eigen::ArrayXXd::Ones(data.rows(), data.cols()), E1, PD, T2);
+        for (size_t n = 0; n < m_iterations; n++) {
+            const Eigen::ArrayXd E2 = (-m_sequence->TR / T2).exp();
+            const Eigen::ArrayXd E2d = m_elliptical ? E2.square().eval() : E2;
+            const Eigen::ArrayXXd W = ((sina.rowwise() * (1. - E1*E2).transpose()) /
+                                       ((1. - E1*E2d).transpose().replicate(data.rows(), 1) - cosa.rowwise() * (E1 - E2d).transpose())).square();
+            regress(X, Y, W, E1, PD, T2);
+        }
+        finish(data, sina, cosa, T1, B1, PD, T2, outputs, residual, resids);
+        its.setConstant(m_iterations);
+        return true;
+    }
 };
 
 //******************************************************************************
-// T2 Only Functor
+// T2 Only Model & Functor
 //******************************************************************************
+/*
+ * Magnitude of on-resonance bSSFP with 180° phase increments, or of the geometric solution (which
+ * does not depend on off-resonance), with PD & T2 as parameters and analytic derivatives
+ */
+struct D2Model {
+    typedef Eigen::Vector2d TParams;
+    const Eigen::ArrayXd &FA, &data;
+    const double TR, E1, B1;
+    const bool elliptical;
+
+    size_t size() const { return data.rows(); }
+    bool valid(const TParams &p) const { return p[1] > 0; }
+    double residual(const size_t i, const TParams &p, TParams &gradient) const {
+        const double E2 = exp(-TR / p[1]);
+        const double dE2_dT2 = E2 * TR / (p[1] * p[1]);
+        const double alpha = FA[i] * B1;
+        const double cosa = cos(alpha);
+        const double A = (1. - E1) * sin(alpha);
+        double s, ds_dE2;
+        if (elliptical) {
+            const double sqrtE2 = sqrt(E2);
+            const double d = 1. - E1*E2*E2 - (E1 - E2*E2)*cosa;
+            s = A * sqrtE2 / d;
+            ds_dE2 = A * (0.5 / (sqrtE2 * d) - 2. * E2 * sqrtE2 * (cosa - E1) / (d * d));
+        } else {
+            const double d = 1. - E1*E2 - (E1 - E2)*cosa;
+            s = A / d;
+            ds_dE2 = -A * (cosa - E1) / (d * d);
+        }
+        const double S = p[0] * s;
+        const double sign = (S < 0) ? -1 : 1;
+        gradient[0] = sign * s;
+        gradient[1] = sign * p[0] * ds_dE2 * dE2_dT2;
+        return std::abs(S) - data[i];
+    }
+};
+
+/*
+ * Fallback for other phase increments, assuming on-resonance
+ */
 class D2Functor : public Eigen::DenseFunctor<double> {
     public:
         const Eigen::ArrayXd m_data;
@@ -167,7 +328,7 @@ class D2Functor : public Eigen::DenseFunctor<double> {
         const std::shared_ptr<QI::SCD> m_model = std::make_shared<QI::SCD>();
 
         D2Functor(const double T1, const std::shared_ptr<QI::SequenceBase> s, const Eigen::ArrayXd &d, const double B1, const bool fitComplex, const bool debug = false) :
-            DenseFunctor<double>(3, s->size()),
+            DenseFunctor<double>(2, s->size()),
             m_data(d), m_sequence(s),
             m_T1(T1), m_B1(B1)
         {
@@ -177,7 +338,7 @@ class D2Functor : public Eigen::DenseFunctor<double> {
         int operator()(const Eigen::Ref<Eigen::VectorXd> &params, Eigen::Ref<Eigen::ArrayXd> diffs) const {
             eigen_assert(diffs.size() == values());
             Eigen::ArrayXd fullparams(5);
-            fullparams << params(0), m_T1, params(1), params(2), m_B1;
+            fullparams << params(0), m_T1, params(1), 0, m_B1;
             Eigen::ArrayXcd s = m_sequence->signal(m_model, fullparams);
             diffs = s.abs() - m_data;
             return 0;
@@ -195,12 +356,20 @@ public:
         const double B1 = consts[1];
         Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
         Eigen::ArrayXd data = indata.cast<double>();
-        D2Functor f(T1, m_sequence, data, B1, false, false);
-        Eigen::NumericalDiff<D2Functor> nDiff(f);
-        Eigen::LevenbergMarquardt<Eigen::NumericalDiff<D2Functor>> lm(nDiff);
-        lm.setMaxfev(m_iterations * (m_sequence->size() + 1));
-        Eigen::VectorXd p(2); p << data.array().maxCoeff() * 5., 0.1;
-        lm.minimize(p);
+        Eigen::Vector2d p(data.maxCoeff() * 5., 0.1);
+        if (m_analytic) {
+            const D2Model model{m_sequence->FA, data, m_sequence->TR, exp(-m_sequence->TR / T1), B1, m_elliptical};
+            its = QI::LevenbergMarquardt<2>(model, p, m_iterations);
+        } else {
+            D2Functor f(T1, m_sequence, data, B1, false, false);
+            Eigen::NumericalDiff<D2Functor> nDiff(f);
+            Eigen::LevenbergMarquardt<Eigen::NumericalDiff<D2Functor>> lm(nDiff);
+            lm.setMaxfev(m_iterations * (m_sequence->size() + 1));
+            Eigen::VectorXd fp = p;
+            lm.minimize(fp);
+            p = fp;
+            its = lm.iterations();
+        }
         outputs[0] = QI::Clamp(p[0], m_loPD, m_hiPD);
         outputs[1] = QI::Clamp(p[1], m_loT2, m_hiT2);
         Eigen::VectorXd fullp(5); fullp << outputs[0], T1, outputs[1], 0, B1; // Assume on-resonance
@@ -208,7 +377,6 @@ public:
         Eigen::ArrayXf r = (data.array() - theory).cast<float>();
         residual = sqrt(r.square().sum() / r.rows());
         resids = itk::VariableLengthVector<float>(r.data(), r.rows());
-        its = lm.iterations();
         return true;
     }
 };
@@ -227,13 +395,17 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/w/n)", {'a',"algo"}, 'l');
     args::Flag ellipse(parser, "ELLIPTICAL", "Data is band-free ellipse / geometric solution", {'e',"ellipse"});
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampPD(parser, "CLAMP PD", "Clamp PD between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> clampT2(parser, "CLAMP T2", "Clamp T2 between 0 and value", {'t',"clampT2"}, std::numeric_limits<float>::infinity());
+    args::Flag timing(parser, "TIMING", "Write out the time spent fitting each voxel (ns)", {"timing"});
+    args::Flag pin(parser, "PIN", "Pin threads to CPUs and allocate outputs from them (for NUMA machines)", {"pin"});
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     std::shared_ptr<D2Algo> algo;
@@ -256,37 +428,61 @@ int main(int argc, char **argv) {
     algo->setElliptical(ellipse);
 
     if (verbose) std::cout << "Reading T1 Map from: " << QI::CheckPos(t1_path) << std::endl;
-    auto T1 = QI::ReadImage(QI::CheckPos(t1_path));
+    auto T1 = QI::ReadImage(QI::CheckPos(t1_path), subregion.region());
 
     if (verbose) std::cout << "Opening SSFP file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path));
+    auto data = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path), subregion.region());
     auto apply = QI::ApplyF::New();
     apply->SetAlgorithm(algo);
     apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetOutputTiming(timing);
     apply->SetPoolsize(threads.Get());
+    apply->SetPin(pin);
     apply->SetInput(0, data);
     apply->SetConst(0, T1);
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
+    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
 
     if (verbose) {
         std::cout << "apply setup complete. Processing." << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), {"PD", "T2"}, outarg.Get() + "D2_", verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
 
     }
     std::string outPrefix = outarg.Get() + "D2_";
-    QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+    QI::WriteQueue writes;
+    writes.WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
+    writes.WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
+    writes.WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
     if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+        writes.WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (timing) {
+        writes.WriteImage(apply->GetTimingOutput(), outPrefix + "timing" + QI::OutExt());
+    }
+    if (checkpoint.failures) {
+        writes.WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
     }
+    writes.wait();
     if (verbose) std::cout << "All done." << std::endl;
     return EXIT_SUCCESS;
 }
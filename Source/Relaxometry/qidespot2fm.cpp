@@ -17,20 +17,24 @@
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
+#include "RegionFit.h"
+#include "Refit.h"
 #include "Models.h"
 #include "ApplyTypes.h"
 #include "SSFPSequence.h"
 #include "SequenceCereal.h"
+#include "Dictionary.h"
+#include "Fit.h"
 
 class FMCost : public ceres::CostFunction {
 private:
     const Eigen::ArrayXd &m_data;
-    double m_T1, m_B1;
+    const double &m_T1, &m_B1;
     QI::SSFPSequence m_sequence;
 
 public:
     FMCost(const Eigen::ArrayXd &d, const QI::SSFPSequence &s,
-           const double T1, const double B1) :
+           const double &T1, const double &B1) :
         m_data(d), m_T1(T1), m_B1(B1), m_sequence(s)
     {
         mutable_parameter_block_sizes()->push_back(3);
@@ -38,7 +42,7 @@ public:
     }
 
     Eigen::ArrayXd residuals(const Eigen::VectorXd &p) const {
-        Eigen::ArrayXd s = QI::One_SSFP_Echo_Magnitude(m_sequence.FA, m_sequence.PhaseInc, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1);
+        Eigen::ArrayXd s = QI::One_SSFP_Echo_Magnitude(m_sequence.FA, m_sequence.PhaseTrig, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1);
         Eigen::ArrayXd diff = s - m_data;
         return diff;
     }
@@ -52,7 +56,7 @@ public:
         r = residuals(p);
         if (jacobians && jacobians[0]) {
             Eigen::Map<Eigen::Matrix<double, -1, -1, Eigen::RowMajor>> j(jacobians[0], m_data.size(), p.size());
-            j = QI::One_SSFP_Echo_Derivs(m_sequence.FA, m_sequence.PhaseInc, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1);
+            j = QI::One_SSFP_Echo_Derivs(m_sequence.FA, m_sequence.PhaseTrig, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1);
         }
         return true;
     }
@@ -63,11 +67,74 @@ class LM_FM : public QI::ApplyF::Algorithm {
 protected:
     QI::SSFPSequence m_sequence;
     bool m_asymmetric = false, m_debug = false;
+    int m_iterations = 75;
+
+    // The problem is built once per thread, each voxel only reloads data, T1 & B1 and the T2 bound
+    struct Context {
+        Eigen::ArrayXd data;
+        double T1 = 1.0, B1 = 1.0;
+        Eigen::Array3d p;
+        ceres::Problem problem;
+        ceres::Solver::Options options;
+
+        Context(const QI::SSFPSequence &sequence, const bool debug, const int iterations) : data(sequence.size()) {
+            problem.AddResidualBlock(new FMCost(data, sequence, T1, B1), NULL, p.data());
+            problem.SetParameterLowerBound(p.data(), 0, 1.);
+            problem.SetParameterLowerBound(p.data(), 1, sequence.TR);
+            problem.SetParameterLowerBound(p.data(), 2, -0.5/sequence.TR);
+            problem.SetParameterUpperBound(p.data(), 2,  0.5/sequence.TR);
+            options.max_num_iterations = iterations;
+            options.function_tolerance = 1e-6;
+            options.gradient_tolerance = 1e-7;
+            options.parameter_tolerance = 1e-5;
+            if (!debug && !QI::SolverTrace()) options.logging_type = ceres::SILENT;
+            options.minimizer_progress_to_stdout = QI::SolverTrace();
+        }
+    };
+    QI::PerThread<Context> m_contexts{[this]{ return new Context(m_sequence, m_debug, m_iterations); }};
+    std::shared_ptr<const QI::Dictionary> m_dictionary;
+
+    /*
+     * PD enters the signal linearly, so for each T2 and f0 on a coarse grid its best value and the
+     * cost follow in closed form from one evaluation of the signal, which is far cheaper than a
+     * solve from every start. The magnitude profile repeats every 1/TR in f0 and without --asym
+     * only positive f0 is fitted, so the grid covers [-0.5, 0.5]/TR or [0, 0.5]/TR. An extra f0,
+     * e.g. from a neighbour, can be tried as well.
+     */
+    Eigen::Array3d gridStart(const Eigen::ArrayXd &data, const double T1, const double B1, const Eigen::ArrayXd &T2s,
+                             const double extra_f0 = std::numeric_limits<double>::quiet_NaN()) const
+    {
+        const double f0_max = 0.5 / m_sequence.TR;
+        Eigen::ArrayXd f0s = m_asymmetric ? Eigen::ArrayXd::LinSpaced(16, -f0_max, f0_max) :
+                                            Eigen::ArrayXd::LinSpaced(9, 0., f0_max);
+        if (std::isfinite(extra_f0)) {
+            f0s.conservativeResize(f0s.size() + 1);
+            f0s[f0s.size() - 1] = QI::Clamp(extra_f0, -f0_max, f0_max);
+        }
+        Eigen::Array3d best(1., T2s[0], f0s[0]);
+        double best_cost = std::numeric_limits<double>::infinity();
+        for (Eigen::Index t = 0; t < T2s.size(); t++) {
+            for (Eigen::Index f = 0; f < f0s.size(); f++) {
+                const Eigen::ArrayXd sig = QI::One_SSFP_Echo_Magnitude(m_sequence.FA, m_sequence.PhaseTrig, m_sequence.TR, 1., T1, T2s[t], f0s[f], B1);
+                const double PD = std::max((sig * data).sum() / sig.square().sum(), 1.); // Lower bound of the fit
+                const double cost = (PD * sig - data).square().sum();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = Eigen::Array3d(PD, T2s[t], f0s[f]);
+                }
+            }
+        }
+        return best;
+    }
+
 public:
     LM_FM(QI::SSFPSequence s, const bool a, const bool d) :
         m_sequence(s), m_asymmetric(a), m_debug(d)
     {}
 
+    void setDictionary(const std::shared_ptr<const QI::Dictionary> &d) { m_dictionary = d; }
+    void setIterations(const int i) { m_iterations = i; } // Before the first fit, which builds the contexts
+
     size_t numInputs() const override  { return m_sequence.count(); }
     size_t numConsts() const override  { return 2; }
     size_t numOutputs() const override { return 3; }
@@ -89,39 +156,48 @@ public:
             // Improve scaling by dividing the PD down to something sensible.
             // This gets scaled back up at the end.
             Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-            Eigen::ArrayXd data = indata.cast<double>() / indata.maxCoeff();
+            Context &ctx = m_contexts.get();
+            ctx.data = indata.cast<double>() / indata.maxCoeff();
+            ctx.T1 = T1;
+            ctx.B1 = B1;
+            const Eigen::ArrayXd &data = ctx.data;
 
-            std::vector<double> f0_starts = {0, 0.4/m_sequence.TR};
-            if (this->m_asymmetric) {
-                f0_starts.push_back(0.2/m_sequence.TR);
-                f0_starts.push_back(-0.2/m_sequence.TR);
-                f0_starts.push_back(-0.4/m_sequence.TR);
+            std::vector<Eigen::Array3d> starts;
+            if (outputs[0] > 0 && outputs[1] > 0) {
+                // Warm-start, the neighbour's T2 is close enough, but check its f0 against the grid
+                // in case this voxel is on the other side of a band
+                const double T2 = QI::Clamp<double>(outputs[1], m_sequence.TR, T1);
+                starts.push_back(gridStart(data, T1, B1, Eigen::ArrayXd::Constant(1, T2), outputs[2]));
+            } else if (m_dictionary) {
+                // The nearest dictionary entry is close enough to pick the right f0 lobe
+                double scale;
+                const size_t entry = m_dictionary->match(data, Eigen::Array2d(T1, B1), scale);
+                const Eigen::ArrayXd match = m_dictionary->parameters(entry);
+                starts.push_back(Eigen::Array3d(std::max(scale, 1.), QI::Clamp<double>(match[2], m_sequence.TR, T1), match[3]));
+            } else {
+                // Yarnykh gives T2 = 0.045 * T1 in brain, but CSF is much longer
+                const Eigen::ArrayXd T2s = Eigen::ArrayXd::LinSpaced(6, std::log(1.5 * m_sequence.TR), std::log(T1)).exp().min(T1);
+                starts.push_back(gridStart(data, T1, B1, T2s));
             }
 
             double best = std::numeric_limits<double>::infinity();
-            Eigen::Array3d p, bestP;
-            ceres::Problem problem;
-            problem.AddResidualBlock(new FMCost(data, m_sequence, T1, B1), NULL, p.data());
-            problem.SetParameterLowerBound(p.data(), 0, 1.);
-            problem.SetParameterLowerBound(p.data(), 1, m_sequence.TR);
+            Eigen::Array3d &p = ctx.p;
+            Eigen::Array3d bestP;
+            ceres::Problem &problem = ctx.problem;
             problem.SetParameterUpperBound(p.data(), 1, T1);
-            problem.SetParameterLowerBound(p.data(), 2, -0.5/m_sequence.TR);
-            problem.SetParameterUpperBound(p.data(), 2,  0.5/m_sequence.TR);
-            ceres::Solver::Options options;
+            const ceres::Solver::Options &options = ctx.options;
             ceres::Solver::Summary summary;
-            options.max_num_iterations = 75;
-            options.function_tolerance = 1e-6;
-            options.gradient_tolerance = 1e-7;
-            options.parameter_tolerance = 1e-5;
-            if (!m_debug) options.logging_type = ceres::SILENT;
-            for (const double &f0 : f0_starts) {
-                p = {5., std::max(0.1 * T1, 1.5*m_sequence.TR), f0}; // Yarnykh gives T2 = 0.045 * T1 in brain, but best to overestimate for CSF
+            for (const Eigen::Array3d &start : starts) {
+                p = start;
                 ceres::Solve(options, &problem, &summary);
                 if (!summary.IsSolutionUsable()) {
-                    std::cerr << summary.FullReport() << std::endl;
-                    std::cerr << "T1: " << T1 << " B1: " << B1 << std::endl;
-                    std::cerr << "Parameters: " << p.transpose() << std::endl;
-                    std::cerr << "Data: " << indata.transpose() << std::endl;
+                    // The filter counts failures, only dump the details when asked
+                    if (m_debug) {
+                        std::cerr << summary.FullReport() << std::endl;
+                        std::cerr << "T1: " << T1 << " B1: " << B1 << std::endl;
+                        std::cerr << "Parameters: " << p.transpose() << std::endl;
+                        std::cerr << "Data: " << indata.transpose() << std::endl;
+                    }
                     return false;
                 }
                 double r = summary.final_cost;
@@ -174,36 +250,89 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::Flag asym(parser, "ASYM", "Fit +/- off-resonance frequency", {'A', "asym"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag debug(parser, "DEBUG", "Output debugging messages", {'d', "debug"});
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
+    args::Flag warm(parser, "WARM", "Start each fit from the neighbouring voxel's result", {"warm"});
+    args::ValueFlag<int> multigrid(parser, "FACTOR", "Fit every FACTOR'th voxel first and start the rest from them", {"multigrid"}, 1);
+    args::ValueFlag<std::string> initial(parser, "PREFIX", "Start each fit from the maps written with output prefix PREFIX, e.g. for the previous time-point", {"initial"});
+    args::Flag dictionary(parser, "DICTIONARY", "Start each fit from the best match in a precomputed dictionary", {"dictionary"});
+    args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 75", {'i', "its"}, 75);
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
+    QI::RefitArgs refit(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     if (verbose) std::cout << "Reading T1 Map from: " << QI::CheckPos(t1_path) << std::endl;
-    auto T1 = QI::ReadImage(QI::CheckPos(t1_path));
+    auto T1 = QI::ReadImage(QI::CheckPos(t1_path), subregion.region());
     if (verbose) std::cout << "Opening SSFP file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto ssfpData = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path));
+    auto ssfpData = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path), subregion.region());
 
     auto ssfp_sequence = QI::ReadSequence<QI::SSFPSequence>(std::cin, verbose);
     auto apply = QI::ApplyF::New();
     std::shared_ptr<LM_FM> algo = std::make_shared<LM_FM>(ssfp_sequence, asym, debug);
+    algo->setIterations(its.Get());
     apply->SetVerbose(verbose);
     apply->SetAlgorithm(algo);
     apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetOutputIterations(true);
     if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Fairly unbalanced algorithm
+    apply->SetWarmStart(warm);
+    apply->SetMultigrid(multigrid.Get());
+    if (initial && refit.requested()) {
+        QI_FAIL("--initial and --refit cannot be used together");
+    }
+    if (refit.requested()) {
+        refit.Apply(apply, "FM_", {"PD", "T2", "f0"}, "residual", "its", {}, subregion.region(), verbose);
+    } else if (initial) {
+        if (verbose) std::cout << "Starting from the maps with prefix: " << initial.Get() << std::endl;
+        apply->SetInitial(0, QI::ReadImage(initial.Get() + "FM_PD" + QI::OutExt(), subregion.region()));
+        apply->SetInitial(1, QI::ReadImage(initial.Get() + "FM_T2" + QI::OutExt(), subregion.region()));
+        apply->SetInitial(2, QI::ReadImage(initial.Get() + "FM_f0" + QI::OutExt(), subregion.region()));
+    }
+    if (dictionary) { // Built on the global pool, so after SetPoolsize
+        QI::SSFPEchoSequence echo;
+        static_cast<QI::SSFPSequence &>(echo) = ssfp_sequence;
+        // Free entries cover T2 (log-spaced) and f0, T1 & B1 are per-voxel constants so are axes
+        Eigen::ArrayXXd bounds(5, 2);
+        bounds << 1., 1.,
+                  1., 1.,
+                  std::log(1.5 * ssfp_sequence.TR), std::log(2.5),
+                  asym ? -0.5 / ssfp_sequence.TR : 0., 0.5 / ssfp_sequence.TR,
+                  1., 1.;
+        Eigen::ArrayXi steps(5);
+        steps << 1, 1, 32, asym ? 48 : 24, 1;
+        Eigen::ArrayXXd entries = QI::Dictionary::Grid(bounds, steps);
+        entries.row(2) = entries.row(2).exp();
+        std::vector<QI::Dictionary::Axis> axes{{1, Eigen::ArrayXd::LinSpaced(32, std::log(0.1), std::log(5.0)).exp()},
+                                               {4, B1 ? Eigen::ArrayXd(Eigen::ArrayXd::LinSpaced(21, 0.5, 1.5)) : Eigen::ArrayXd(Eigen::ArrayXd::Ones(1))}};
+        algo->setDictionary(std::make_shared<const QI::Dictionary>(echo, std::make_shared<QI::SCD>(), entries, axes, 0, verbose));
+    }
     apply->SetInput(0, ssfpData);
     apply->SetConst(0, T1);
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
+    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), {"PD", "T2", "f0"}, outarg.Get() + "FM_", verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
@@ -215,7 +344,10 @@ int main(int argc, char **argv) {
     QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "its" + QI::OutExt());
     QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
     if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
     }
     return EXIT_SUCCESS;
 }
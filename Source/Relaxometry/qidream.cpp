@@ -12,30 +12,17 @@
 
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <Eigen/Core>
 
 #include "ImageTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
-
-#include "itkExtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkBinaryFunctorImageFilter.h"
-
-template<class TPixel> class DREAM {
-public:
-    DREAM() {}
-    ~DREAM() {}
-    bool operator!=(const DREAM &) const { return false; }
-    bool operator==(const DREAM &other) const { return !(*this != other); }
-
-    inline TPixel operator()(const TPixel &fid,
-                             const TPixel &ste) const
-    {
-        TPixel alpha = atan(sqrt(2.*ste/fid)) * 180. / M_PI;
-        return alpha;
-    }
-};
+#include "ThreadPool.h"
+#include "FastTrig.h"
+#include "PolynomialFilters.h"
+#include "ElementwiseMap.h"
 
 int main(int argc, char **argv) {
     args::ArgumentParser parser("Calculates a B1 (flip-angle) map from DREAM data.\nhttp://github.com/spinicist/QUIT");
@@ -47,48 +34,41 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> out_prefix(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<char> order(parser, "ORDER", "Volume order - f/s/v - fid/ste/vst first", {'O', "order"}, 'f');
-    args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only fit the polynomial within the mask", {'m', "mask"});
     args::ValueFlag<double> alpha(parser, "ALPHA", "Nominal flip-angle (default 55)", {'a', "alpha"}, 55);
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    args::ValueFlag<int> poly(parser, "ORDER", "Write B1 as a polynomial of this order fitted to the raw map (saved as DREAM_B1_raw)", {'p', "poly"});
     QI::ParseArgs(parser, argc, argv, verbose);
 
-    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
 
     if (verbose) std::cout << "Opening input file " << QI::CheckPos(input_file) << std::endl;
     auto inFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_file));
-
-    auto fid_volume = itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF>::New();
-    auto ste_volume = itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF>::New();
-    auto region = inFile->GetLargestPossibleRegion();
-    region.GetModifiableSize()[3] = 0;
-    switch (order.Get()) {
-    case 'f': region.GetModifiableIndex()[3] = 0; break;
-    case 's':
-    case 'v': region.GetModifiableIndex()[3] = 1; break;
+    if (inFile->GetLargestPossibleRegion().GetSize()[3] != 2) {
+        QI_FAIL("Input file " << input_file.Get() << " must have 2 volumes");
     }
-    fid_volume->SetExtractionRegion(region);
-    fid_volume->SetInput(inFile);
-    fid_volume->SetDirectionCollapseToSubmatrix();
-    // Swap to other volume
-    region.GetModifiableIndex()[3] = (region.GetIndex()[3] + 1) % 2;
-    ste_volume->SetExtractionRegion(region);
-    ste_volume->SetInput(inFile);
-    ste_volume->SetDirectionCollapseToSubmatrix();
 
-    auto dream = itk::BinaryFunctorImageFilter<QI::VolumeF,
-                                               QI::VolumeF,
-                                               QI::VolumeF,
-                                               DREAM<float>>::New();
-    dream->SetInput1(fid_volume->GetOutput());
-    dream->SetInput2(ste_volume->GetOutput());
+    QI::VolumeF::Pointer angle = QI::NewVolumeLike(inFile);
+    QI::VolumeF::Pointer B1 = QI::NewVolumeLike(inFile);
+
+    // atan(sqrt(2*STE/FID)) is acos(sqrt(FID/(FID + 2*STE))), so this shares the vectorised acos
+    const size_t fid_vol = (order.Get() == 'f') ? 0 : 1;
+    const float to_B1 = 1. / alpha.Get();
+    QI::ElementwiseMap(QI::VoxelsPerVolume(inFile), [&](const size_t i, const size_t len) {
+        const auto fid = QI::VolumeBlock(inFile, fid_vol, i, len);
+        const auto ste = QI::VolumeBlock(inFile, 1 - fid_vol, i, len);
+        auto a = QI::VolumeBlock(angle, i, len);
+        a = QI::FastAcos((fid / (fid + 2.f * ste)).sqrt().min(1.f)) * float(180. / M_PI);
+        QI::VolumeBlock(B1, i, len) = a * to_B1;
+    });
 
-    auto B1 = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
-    B1->SetInput1(dream->GetOutput());
-    B1->SetConstant2(alpha.Get());
-    B1->Update();
-    QI::WriteImage(dream->GetOutput(), out_prefix.Get() + "DREAM_angle" + QI::OutExt());
-    QI::WriteImage(B1->GetOutput(),  out_prefix.Get() + "DREAM_B1" + QI::OutExt());
+    QI::WriteImage(angle, out_prefix.Get() + "DREAM_angle" + QI::OutExt());
+    if (poly) {
+        if (verbose) std::cout << "Fitting order " << poly.Get() << " polynomial to B1" << std::endl;
+        QI::VolumeF::Pointer mask_img = mask ? QI::ReadImage(mask.Get()) : QI::VolumeF::Pointer();
+        QI::WriteImage(B1, out_prefix.Get() + "DREAM_B1_raw" + QI::OutExt());
+        B1 = QI::PolynomialSmooth(B1, mask_img, poly.Get());
+    }
+    QI::WriteImage(B1, out_prefix.Get() + "DREAM_B1" + QI::OutExt());
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
-
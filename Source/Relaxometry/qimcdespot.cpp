@@ -11,33 +11,58 @@
  */
 
 #include <fstream>
+#include <array>
+#include <limits>
+#include <future>
+#include <algorithm>
 #include <Eigen/Dense>
 #include <unsupported/Eigen/LevenbergMarquardt>
 #include <unsupported/Eigen/NumericalDiff>
+#include "ceres/ceres.h"
 
 #include "itkTimeProbe.h"
+#include "itkDivideImageFilter.h"
+#include "itkCastImageFilter.h"
 
 #include "ApplyTypes.h"
 #include "Util.h"
 #include "Args.h"
+#include "RegionFit.h"
+#include "Refit.h"
 #include "ImageIO.h"
+#include "WriteQueue.h"
+#include "ThreadPool.h"
 #include "IO.h"
 #include "Model.h"
 #include "SequenceGroup.h"
 #include "RegionContraction.h"
+#include "Fit.h"
+#include "Dictionary.h"
+#include "Surrogate.h"
+#include "FixedSignal.h"
+#include "itkMinimumMaximumImageCalculator.h"
 
 struct MCDSRCFunctor {
     const QI::SequenceGroup &m_sequence;
     const Eigen::ArrayXd m_data, m_weights;
     const std::shared_ptr<QI::Model> m_model;
+    const QI::FixedSignal *m_fixed; // The same signals without the virtual calls, if available
 
     MCDSRCFunctor(std::shared_ptr<QI::Model> m, QI::SequenceGroup &s,
-                  const Eigen::ArrayXd &d, const Eigen::ArrayXd &w) :
-        m_sequence(s), m_data(d), m_weights(w), m_model(m)
+                  const Eigen::ArrayXd &d, const Eigen::ArrayXd &w, const QI::FixedSignal *f = nullptr) :
+        m_sequence(s), m_data(d), m_weights(w), m_model(m), m_fixed(f)
     {
         assert(static_cast<size_t>(m_data.rows()) == m_sequence.size());
     }
 
+    void signals_into(const Eigen::VectorXd &params, Eigen::Ref<Eigen::ArrayXd> out) const {
+        if (m_fixed) {
+            m_fixed->magnitude_into(params, out);
+        } else {
+            m_sequence.signal_magnitude_into(m_model, params, out);
+        }
+    }
+
     int inputs() const { return m_model->nParameters(); }
     int values() const { return m_sequence.size(); }
 
@@ -46,12 +71,82 @@ struct MCDSRCFunctor {
     }
 
     Eigen::ArrayXd residuals(const Eigen::Ref<Eigen::VectorXd> &params) const {
-        const Eigen::ArrayXd s = (m_sequence.signal(m_model, params)).abs();
-        return m_data - s;
+        Eigen::ArrayXd r(m_data.rows());
+        signals_into(params, r);
+        r = m_data - r;
+        return r;
     }
     double operator()(const Eigen::Ref<Eigen::VectorXd> &params) const {
         return (residuals(params) * m_weights).square().sum();
     }
+
+    // All of a contraction's samples at once, the weighted sum-of-squares is one block operation
+    void batch(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::Ref<Eigen::ArrayXd> resids) const {
+        Eigen::ArrayXXd signals(m_sequence.size(), params.cols());
+        for (Eigen::Index s = 0; s < params.cols(); s++) {
+            signals_into(params.col(s).matrix(), signals.col(s));
+        }
+        resids = ((signals.colwise() - m_data).colwise() * m_weights).square().colwise().sum().transpose();
+    }
+};
+
+/*
+ * The weighted sum-of-squares of MCDSRCFunctor, but from a surrogate's signals instead of the
+ * exact ones. Only used for the early contractions, where the region is still wide.
+ */
+struct MCDSurrogateFunctor {
+    const MCDSRCFunctor &m_exact;
+    const QI::Surrogate &m_surrogate;
+
+    MCDSurrogateFunctor(const MCDSRCFunctor &e, const QI::Surrogate &s) :
+        m_exact(e), m_surrogate(s)
+    {
+        assert(m_surrogate.size() == m_exact.m_sequence.size());
+    }
+
+    int inputs() const { return m_exact.inputs(); }
+    int values() const { return m_exact.values(); }
+    const bool constraint(const Eigen::VectorXd &params) const { return m_exact.constraint(params); }
+
+    double operator()(const Eigen::Ref<Eigen::VectorXd> &params) const {
+        Eigen::ArrayXd r(1);
+        batch(params.array(), r);
+        return r[0];
+    }
+
+    void batch(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::Ref<Eigen::ArrayXd> resids) const {
+        Eigen::ArrayXXd signals(values(), params.cols());
+        m_surrogate.signals(params, signals);
+        resids = ((signals.colwise() - m_exact.m_data).colwise() * m_exact.m_weights).square().colwise().sum().transpose();
+    }
+};
+
+/*
+ * The same weighted residuals as MCDSRCFunctor, with the Jacobian from the sequences
+ */
+class MCDCost : public ceres::CostFunction {
+private:
+    const MCDSRCFunctor &m_func;
+
+public:
+    MCDCost(const MCDSRCFunctor &f) : m_func(f) {
+        mutable_parameter_block_sizes()->push_back(f.inputs());
+        set_num_residuals(f.values());
+    }
+
+    bool Evaluate(double const* const* parameters,
+                  double* resids,
+                  double** jacobians) const override
+    {
+        Eigen::VectorXd p = Eigen::Map<const Eigen::VectorXd>(parameters[0], m_func.inputs()); // residuals() needs a plain vector
+        Eigen::Map<Eigen::ArrayXd> r(resids, m_func.values());
+        r = m_func.residuals(p) * m_func.m_weights;
+        if (jacobians && jacobians[0]) {
+            Eigen::Map<Eigen::Matrix<double, -1, -1, Eigen::RowMajor>> j(jacobians[0], m_func.values(), m_func.inputs());
+            j = -(m_func.m_weights.matrix().asDiagonal() * m_func.m_sequence.signal_magnitude_jacobian(m_func.m_model, p));
+        }
+        return true;
+    }
 };
 
 struct SRCAlgo : public QI::ApplyF::Algorithm {
@@ -61,7 +156,36 @@ struct SRCAlgo : public QI::ApplyF::Algorithm {
     QI::FieldStrength m_tesla = QI::FieldStrength::Three;
     int m_iterations = 0;
     size_t m_samples = 5000, m_retain = 50;
-    bool m_gauss = true;
+    bool m_gauss = true, m_adaptive = false, m_quasi = false, m_refine = false;
+    bool m_twoStage = false; // Coarse search, then always refine
+    size_t m_coarseSamples = 500;
+    std::shared_ptr<const QI::Dictionary> m_dictionary;
+    bool m_dictionaryF0 = false; // Dictionary has an f0 axis as well as B1
+    std::shared_ptr<const QI::Surrogate> m_surrogate;
+    bool m_batch = false; // Fit blocks of voxels in lock-step
+    std::shared_ptr<const QI::FixedSignal> m_fixed;
+    uint64_t m_seed = 0; // Each voxel's samples come from a generator seeded with this and its index
+    bool m_seeded = false; // The outputs hold an earlier fit of each voxel on entry (a re-fit)
+    static constexpr double SurrogatePad = 0.25; // Of the surrogate's final width, on each side
+    static const size_t ParallelGrain = 4096; // Samples per task when one voxel's contraction is split over the pool
+    // Region contraction buffers, so each thread only allocates them for its first voxel (or block)
+    QI::PerThread<QI::RCWorkspace> m_workspaces{[]{ return new QI::RCWorkspace; }};
+    QI::PerThread<std::vector<QI::RCWorkspace>> m_blockWorkspaces{[]{ return new std::vector<QI::RCWorkspace>; }};
+
+    /*
+     * Fitting ranges for the fine pass of a multigrid fit. Each lattice cell (the voxels between
+     * lattice voxels n and n + 1 along every axis) gets the range of the fits at its fitted corners,
+     * padded by LatticePad of the full ranges, so homogeneous regions search a much smaller box.
+     */
+    struct Lattice {
+        TIndex start;
+        std::array<long, 3> points;
+        long spacing;
+        Eigen::ArrayXXd lo, hi; // Parameters x cells
+        std::vector<bool> valid;
+    };
+    static constexpr double LatticePad = 0.1;
+    std::shared_ptr<const Lattice> m_lattice;
 
     SRCAlgo(std::shared_ptr<QI::Model>&m, Eigen::ArrayXXd &b,
             QI::SequenceGroup &s, int mi) :
@@ -69,16 +193,28 @@ struct SRCAlgo : public QI::ApplyF::Algorithm {
     {}
 
     size_t numInputs() const override  { return m_sequence.count(); }
-    size_t numOutputs() const override { return m_model->nParameters(); }
+    // Adaptive adds the sample count, two-stage adds the coarse residual and contractions
+    size_t numOutputs() const override { return m_model->nParameters() + (m_adaptive ? 1 : 0) + (m_twoStage ? 2 : 0); }
     size_t dataSize() const override   { return m_sequence.size(); }
 
     void setModel(std::shared_ptr<QI::Model> &m) { m_model = m; }
     void setSequence(QI::SequenceGroup &s) { m_sequence = s; }
     void setBounds(Eigen::ArrayXXd &b) { m_bounds = b; }
     void setIterations(const int i) { m_iterations = i; }
+    void setSamples(const size_t nS, const size_t nR) { m_samples = nS; m_retain = nR; }
     float zero() const override { return 0.f; }
 
     void setGauss(bool g) { m_gauss = g; }
+    void setAdaptive(bool a) { m_adaptive = a; }
+    void setQuasiRandom(bool q) { m_quasi = q; }
+    void setRefine(bool r) { m_refine = r; }
+    void setTwoStage(bool t, const size_t samples) { m_twoStage = t; m_coarseSamples = samples; }
+    void setDictionary(const std::shared_ptr<const QI::Dictionary> &d, const bool f0Axis) { m_dictionary = d; m_dictionaryF0 = f0Axis; }
+    void setSurrogate(const std::shared_ptr<const QI::Surrogate> &s) { m_surrogate = s; }
+    void setBatch(const bool b) { m_batch = b; }
+    void setSeed(const uint64_t s) { m_seed = s; }
+    void setSeeded(const bool s) { m_seeded = s; }
+    void setFixedSignal(const std::shared_ptr<const QI::FixedSignal> &f) { m_fixed = f; }
     size_t numConsts() const override  { return 2; }
     std::vector<float> defaultConsts() const override {
         std::vector<float> def(2);
@@ -87,7 +223,7 @@ struct SRCAlgo : public QI::ApplyF::Algorithm {
     }
 
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
+               const TIndex &index,
                std::vector<TOutput> &outputs, TConst &residual,
                TInput &resids, TIterations &its) const override
     {
@@ -105,26 +241,393 @@ struct SRCAlgo : public QI::ApplyF::Algorithm {
         Eigen::ArrayXd thresh(m_model->nParameters()); thresh.setConstant(0.05);
         const double f0 = consts[0];
         const double B1 = consts[1];
-        Eigen::ArrayXXd localBounds = m_bounds;
-        Eigen::ArrayXd weights = Eigen::ArrayXd::Ones(m_sequence.size());
-        if (std::isfinite(f0)) { // We have an f0 map, add it to the fitting bounds
-            localBounds.row(m_model->ParameterIndex("f0")) += f0;
-            weights = m_sequence.weights(f0);
+        Eigen::ArrayXXd localBounds;
+        Eigen::ArrayXd weights;
+        voxelBounds(f0, B1, localBounds, weights);
+        if (m_lattice) {
+            narrow(index, localBounds, thresh);
         }
-        localBounds.row(m_model->ParameterIndex("B1")).setConstant(B1);
-        MCDSRCFunctor func(m_model, m_sequence, data, weights);
-        QI::RegionContraction<MCDSRCFunctor> rc(func, localBounds, thresh, m_samples, m_retain, m_iterations, 0.02, m_gauss, false);
+        MCDSRCFunctor func(m_model, m_sequence, data, weights, m_fixed.get());
         Eigen::ArrayXd pars(m_model->nParameters());
-        rc.optimise(pars);
+        size_t samples = 0;
+        // An earlier fit is only a usable start if it is inside this voxel's bounds
+        Eigen::VectorXd previous(m_model->nParameters());
+        for (int i = 0; i < m_model->nParameters(); i++) {
+            previous[i] = outputs[i];
+        }
+        const bool seeded = m_seeded && (previous.array() >= localBounds.col(0)).all() &&
+                            (previous.array() <= localBounds.col(1)).all() && m_model->ValidParameters(previous);
+        if (m_twoStage) {
+            int coarse_its = 0;
+            if (seeded) {
+                pars = previous.array(); // Refine from the earlier fit instead of searching again
+            } else if (m_dictionary) {
+                // The best match is the start, clamped so fixed parameters take their voxel values
+                pars = m_dictionary->parameters(m_dictionary->best(data, dictionaryFixed(f0, B1), 1).front());
+                pars = pars.max(localBounds.col(0)).min(localBounds.col(1));
+            } else {
+                contract(func, index, localBounds, thresh, m_coarseSamples, std::max<size_t>(10, m_coarseSamples / 20),
+                         pars, coarse_its, samples);
+            }
+            const Eigen::ArrayXd r = func.residuals(pars);
+            const size_t o = m_model->nParameters() + (m_adaptive ? 1 : 0);
+            outputs[o] = sqrt(r.square().sum() / r.rows());
+            outputs[o + 1] = coarse_its;
+            its = refine(func, localBounds, pars);
+        } else {
+            if (m_dictionary) {
+                dictionaryBox(data, f0, B1, localBounds);
+            }
+            int contractions = 0;
+            contract(func, index, localBounds, thresh, m_samples, m_retain, pars, contractions, samples);
+            Eigen::VectorXd found = pars.matrix();
+            if (seeded && func(previous) < func(found)) {
+                pars = previous.array(); // The search did no better than the earlier fit
+            }
+            if (m_refine) {
+                refine(func, localBounds, pars);
+            }
+            its = contractions;
+        }
         for (int i = 0; i < m_model->nParameters(); i++) {
             outputs[i] = pars[i];
         }
+        if (m_adaptive) {
+            outputs[m_model->nParameters()] = samples;
+        }
         Eigen::ArrayXf r = func.residuals(pars).cast<float>();
         residual = sqrt(r.square().sum() / r.rows());
         resids = itk::VariableLengthVector<float>(r.data(), r.rows());
-        its = rc.contractions();
         return true;
     }
+
+    /*
+     * Many voxels at once, with their region contractions in lock-step so each contraction's
+     * samples for every voxel in the block are evaluated by one call to evaluateBlock(). Only plain
+     * region contraction (optionally from the dictionary, and refined) is supported.
+     */
+    bool hasBatch() const override { return m_batch; }
+    // Lock-step blocks already share their samples out, otherwise a contraction can split its own
+    bool parallelWithinVoxel() const override { return !m_batch; }
+    bool applyIndexedBatch(const TIndex *indices, const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                           std::vector<TOutputBlock> &outputs, TOutputBlock &residual, TResidsBlock &resids,
+                           TIterationsBlock &its) const override
+    {
+        typedef QI::RegionContraction<MCDSRCFunctor> TRC;
+        const Eigen::Index nVoxels = inputs.front().cols();
+        const Eigen::ArrayXd thresh = Eigen::ArrayXd::Constant(m_model->nParameters(), 0.05);
+        std::vector<std::unique_ptr<MCDSRCFunctor>> funcs;
+        std::vector<std::unique_ptr<TRC>> rcs;
+        std::vector<Eigen::ArrayXXd> voxelBoundsList(nVoxels);
+        std::vector<size_t> active;
+        std::vector<QI::RCWorkspace> &workspaces = m_blockWorkspaces.get();
+        if (workspaces.size() < static_cast<size_t>(nVoxels)) {
+            workspaces.resize(nVoxels);
+        }
+        for (Eigen::Index v = 0; v < nVoxels; v++) {
+            Eigen::ArrayXd data(dataSize());
+            Eigen::Index dataIndex = 0;
+            for (size_t i = 0; i < inputs.size(); i++) {
+                const Eigen::ArrayXf this_data = inputs[i].col(v).array();
+                if (m_model->scaleToMean()) {
+                    data.segment(dataIndex, this_data.rows()) = this_data.cast<double>() / this_data.abs().mean();
+                } else {
+                    data.segment(dataIndex, this_data.rows()) = this_data.cast<double>();
+                }
+                dataIndex += this_data.rows();
+            }
+            const double f0 = consts[0][v];
+            const double B1 = consts[1][v];
+            Eigen::ArrayXd weights;
+            voxelBounds(f0, B1, voxelBoundsList[v], weights);
+            if (m_dictionary) {
+                dictionaryBox(data, f0, B1, voxelBoundsList[v]);
+            }
+            funcs.emplace_back(new MCDSRCFunctor(m_model, m_sequence, data, weights, m_fixed.get()));
+            rcs.emplace_back(new TRC(*funcs.back(), voxelBoundsList[v], thresh, m_samples, m_retain, m_iterations, 0.02, m_gauss, QI::SolverTrace(),
+                                     QI::VoxelSeed(m_seed, indices[v], 1)));
+            rcs.back()->setAdaptive(m_adaptive);
+            rcs.back()->setQuasiRandom(m_quasi);
+            if (rcs.back()->begin(workspaces[v])) {
+                active.push_back(v);
+            }
+        }
+        std::vector<size_t> drawn;
+        std::vector<Eigen::Index> offsets;
+        Eigen::ArrayXXd samples;
+        Eigen::ArrayXd residuals;
+        while (!active.empty()) {
+            drawn.clear();
+            offsets.assign(1, 0);
+            for (const size_t v : active) {
+                if (rcs[v]->nextSamples()) {
+                    drawn.push_back(v);
+                    offsets.push_back(offsets.back() + rcs[v]->samples().cols());
+                }
+            }
+            samples.resize(m_model->nParameters(), offsets.back());
+            for (size_t d = 0; d < drawn.size(); d++) {
+                samples.middleCols(offsets[d], offsets[d + 1] - offsets[d]) = rcs[drawn[d]]->samples();
+            }
+            evaluateBlock(funcs, drawn, offsets, samples, residuals);
+            active.clear();
+            for (size_t d = 0; d < drawn.size(); d++) {
+                if (!rcs[drawn[d]]->update(residuals.segment(offsets[d], offsets[d + 1] - offsets[d]))) {
+                    active.push_back(drawn[d]);
+                }
+            }
+        }
+        Eigen::ArrayXd pars(m_model->nParameters());
+        for (Eigen::Index v = 0; v < nVoxels; v++) {
+            rcs[v]->result(pars);
+            if (m_refine) {
+                refine(*funcs[v], voxelBoundsList[v], pars);
+            }
+            for (size_t i = 0; i < m_model->nParameters(); i++) {
+                outputs[i](0, v) = pars[i];
+            }
+            if (m_adaptive) {
+                outputs[m_model->nParameters()](0, v) = rcs[v]->samplesUsed();
+            }
+            const Eigen::ArrayXd r = funcs[v]->residuals(pars);
+            residual(0, v) = sqrt(r.square().sum() / r.rows());
+            if (resids.rows() > 0) {
+                resids.col(v) = r.cast<float>().matrix();
+            }
+            its[v] = rcs[v]->contractions();
+        }
+        return true;
+    }
+
+    /*
+     * The weighted sum-of-squares for every sample of every voxel in a block, with the columns of
+     * samples from offsets[d] to offsets[d + 1] belonging to voxel voxels[d]. This is the only place
+     * signals are computed in batch mode, so it is the one to replace to move them to other hardware.
+     */
+    void evaluateBlock(const std::vector<std::unique_ptr<MCDSRCFunctor>> &funcs, const std::vector<size_t> &voxels,
+                       const std::vector<Eigen::Index> &offsets, const Eigen::ArrayXXd &samples, Eigen::ArrayXd &residuals) const {
+        Eigen::ArrayXXd signals(m_sequence.size(), samples.cols());
+        for (Eigen::Index s = 0; s < samples.cols(); s++) {
+            if (m_fixed) {
+                m_fixed->magnitude_into(samples.col(s).matrix(), signals.col(s));
+            } else {
+                m_sequence.signal_magnitude_into(m_model, samples.col(s).matrix(), signals.col(s));
+            }
+        }
+        residuals.resize(samples.cols());
+        for (size_t d = 0; d < voxels.size(); d++) {
+            const MCDSRCFunctor &f = *funcs[voxels[d]];
+            const Eigen::Index n = offsets[d + 1] - offsets[d];
+            residuals.segment(offsets[d], n) = ((signals.middleCols(offsets[d], n).colwise() - f.m_data).colwise() * f.m_weights).square().colwise().sum().transpose();
+        }
+    }
+
+    // The global bounds shifted by the voxel's f0 and with its B1 fixed, and the matching weights
+    void voxelBounds(const double f0, const double B1, Eigen::ArrayXXd &bounds, Eigen::ArrayXd &weights) const {
+        bounds = m_bounds;
+        weights = Eigen::ArrayXd::Ones(m_sequence.size());
+        if (std::isfinite(f0)) { // We have an f0 map, add it to the fitting bounds
+            bounds.row(m_model->ParameterIndex("f0")) += f0;
+            weights = m_sequence.weights(f0);
+        }
+        bounds.row(m_model->ParameterIndex("B1")).setConstant(B1);
+    }
+
+    Eigen::ArrayXd dictionaryFixed(const double f0, const double B1) const {
+        Eigen::ArrayXd fixed(m_dictionaryF0 ? 2 : 1);
+        fixed[0] = B1;
+        if (m_dictionaryF0) fixed[1] = std::isfinite(f0) ? f0 : 0.;
+        return fixed;
+    }
+
+    // Start the contraction from the box around the best matches instead of the full bounds
+    void dictionaryBox(const Eigen::ArrayXd &data, const double f0, const double B1, Eigen::ArrayXXd &bounds) const {
+        const std::vector<size_t> matches = m_dictionary->best(data, dictionaryFixed(f0, B1), m_retain);
+        Eigen::ArrayXXd box(m_model->nParameters(), 2);
+        box.col(0).setConstant(std::numeric_limits<double>::infinity());
+        box.col(1).setConstant(-std::numeric_limits<double>::infinity());
+        for (const size_t m : matches) {
+            const Eigen::ArrayXd p = m_dictionary->parameters(m);
+            box.col(0) = box.col(0).min(p);
+            box.col(1) = box.col(1).max(p);
+        }
+        for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+            if (bounds(p, 0) != bounds(p, 1)) {
+                bounds.row(p) = box.row(p);
+            }
+        }
+    }
+
+    void latticeFitted(const std::vector<const QI::VolumeF *> &outputs, const QI::VolumeF *residual,
+                       const TIndex &start, const size_t spacing) override {
+        auto lattice = std::make_shared<Lattice>();
+        lattice->start = start;
+        lattice->spacing = spacing;
+        const auto size = residual->GetLargestPossibleRegion().GetSize();
+        const auto buffered = residual->GetBufferedRegion();
+        for (int d = 0; d < 3; d++) {
+            lattice->points[d] = (size[d] + spacing - 1) / spacing;
+        }
+        const size_t nP = m_model->nParameters();
+        const size_t nPoints = lattice->points[0] * lattice->points[1] * lattice->points[2];
+        // The fits at the lattice voxels, unfitted ones (masked or outside this slab) are marked NaN
+        Eigen::ArrayXXd fits(nP, nPoints);
+        for (long z = 0, n = 0; z < lattice->points[2]; z++) {
+            for (long y = 0; y < lattice->points[1]; y++) {
+                for (long x = 0; x < lattice->points[0]; x++, n++) {
+                    TIndex i = start;
+                    i[0] += x * spacing; i[1] += y * spacing; i[2] += z * spacing;
+                    if (buffered.IsInside(i) && residual->GetPixel(i) > 0) {
+                        for (size_t p = 0; p < nP; p++) {
+                            fits(p, n) = outputs[p]->GetPixel(i);
+                        }
+                    } else {
+                        fits.col(n).setConstant(std::numeric_limits<double>::quiet_NaN());
+                    }
+                }
+            }
+        }
+        lattice->lo.resize(nP, nPoints);
+        lattice->hi.resize(nP, nPoints);
+        lattice->valid.assign(nPoints, false);
+        for (long z = 0, n = 0; z < lattice->points[2]; z++) {
+            for (long y = 0; y < lattice->points[1]; y++) {
+                for (long x = 0; x < lattice->points[0]; x++, n++) {
+                    lattice->lo.col(n).setConstant(std::numeric_limits<double>::infinity());
+                    lattice->hi.col(n).setConstant(-std::numeric_limits<double>::infinity());
+                    for (long c = 0; c < 8; c++) {
+                        const long cx = x + (c & 1), cy = y + ((c >> 1) & 1), cz = z + (c >> 2);
+                        if (cx < lattice->points[0] && cy < lattice->points[1] && cz < lattice->points[2]) {
+                            const long m = (cz * lattice->points[1] + cy) * lattice->points[0] + cx;
+                            if (std::isfinite(fits(0, m))) {
+                                lattice->lo.col(n) = lattice->lo.col(n).min(fits.col(m));
+                                lattice->hi.col(n) = lattice->hi.col(n).max(fits.col(m));
+                                lattice->valid[n] = true;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        m_lattice = lattice;
+    }
+
+    /*
+     * Shrink the free rows of the bounds to the voxel's lattice cell, unless that misses them. The
+     * thresholds are scaled up so contraction stops at the same absolute widths as it would have
+     * from the full ranges, which is where the fewer contractions come from.
+     */
+    void narrow(const TIndex &index, Eigen::ArrayXXd &bounds, Eigen::ArrayXd &thresh) const {
+        long n = 0;
+        bool on_lattice = true; // Lattice voxels are always fitted over the full ranges
+        for (int d = 2; d >= 0; d--) {
+            const long offset = index[d] - m_lattice->start[d];
+            n = n * m_lattice->points[d] + offset / m_lattice->spacing;
+            on_lattice = on_lattice && (offset % m_lattice->spacing == 0);
+        }
+        if (on_lattice || !m_lattice->valid[n]) {
+            return;
+        }
+        for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+            const double width = bounds(p, 1) - bounds(p, 0);
+            if (width > 0) {
+                const double lo = std::max(bounds(p, 0), m_lattice->lo(p, n) - LatticePad * width);
+                const double hi = std::min(bounds(p, 1), m_lattice->hi(p, n) + LatticePad * width);
+                if (lo < hi) {
+                    bounds(p, 0) = lo;
+                    bounds(p, 1) = hi;
+                    thresh[p] = std::min(1., thresh[p] * width / (hi - lo));
+                }
+            }
+        }
+    }
+
+    /*
+     * Region contraction over the bounds. With a surrogate covering them, all but the last
+     * contraction run on its signals, then the exact signals take over inside the surrogate's final
+     * region (padded, in case the surrogate's minimum is slightly off). The thresholds are scaled so
+     * the exact stage stops at the same absolute widths. Contractions and samples cover both stages.
+     */
+    void contract(const MCDSRCFunctor &func, const TIndex &index, const Eigen::ArrayXXd &bounds, const Eigen::ArrayXd &thresh,
+                  const size_t nS, const size_t nR, Eigen::ArrayXd &pars, int &contractions, size_t &samples) const {
+        Eigen::ArrayXXd exactBounds = bounds;
+        Eigen::ArrayXd exactThresh = thresh;
+        int remaining = m_iterations;
+        QI::RCWorkspace &workspace = m_workspaces.get();
+        contractions = 0;
+        samples = 0;
+        if (m_surrogate && m_iterations > 1 && m_surrogate->contains(bounds)) {
+            MCDSurrogateFunctor emulated(func, *m_surrogate);
+            QI::RegionContraction<MCDSurrogateFunctor> rc(emulated, exactBounds, thresh, nS, nR, m_iterations - 1, 0.02, m_gauss, QI::SolverTrace(),
+                                                          QI::VoxelSeed(m_seed, index, 0));
+            rc.setQuasiRandom(m_quasi);
+            rc.setParallel(ParallelGrain);
+            rc.optimise(pars, workspace);
+            contractions = rc.contractions();
+            samples = rc.samplesUsed();
+            remaining -= contractions;
+            const Eigen::ArrayXd width = rc.currentBounds().col(1) - rc.currentBounds().col(0);
+            exactBounds.col(0) = (rc.currentBounds().col(0) - SurrogatePad * width).max(bounds.col(0));
+            exactBounds.col(1) = (rc.currentBounds().col(1) + SurrogatePad * width).min(bounds.col(1));
+            for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+                const double full = bounds(p, 1) - bounds(p, 0);
+                const double narrowed = exactBounds(p, 1) - exactBounds(p, 0);
+                if (full > 0 && narrowed > 0) {
+                    exactThresh[p] = std::min(1., thresh[p] * full / narrowed);
+                } else if (full > 0) { // Collapsed onto one value, so search the full range again
+                    exactBounds.row(p) = bounds.row(p);
+                }
+            }
+        }
+        QI::RegionContraction<MCDSRCFunctor> rc(func, exactBounds, exactThresh, nS, nR, std::max(1, remaining), 0.02, m_gauss, QI::SolverTrace(),
+                                                QI::VoxelSeed(m_seed, index, 1));
+        rc.setAdaptive(m_adaptive);
+        rc.setQuasiRandom(m_quasi);
+        rc.setParallel(ParallelGrain);
+        rc.optimise(pars, workspace);
+        contractions += rc.contractions();
+        samples += rc.samplesUsed();
+    }
+
+    /*
+     * Polish the contraction result with Levenberg-Marquardt inside the same bounds. Region
+     * contraction only gets to within its threshold of the minimum, but is a good enough start
+     * that the local fit is unlikely to wander off. Kept only if it is valid and an improvement.
+     * Returns the number of LM iterations.
+     */
+    int refine(const MCDSRCFunctor &func, const Eigen::ArrayXXd &bounds, Eigen::ArrayXd &pars) const {
+        Eigen::VectorXd start = pars.matrix();
+        Eigen::VectorXd p = start;
+        ceres::Problem problem;
+        problem.AddResidualBlock(new MCDCost(func), NULL, p.data());
+        std::vector<int> fixed;
+        for (int i = 0; i < p.rows(); i++) {
+            if (bounds(i, 0) == bounds(i, 1)) {
+                fixed.push_back(i);
+            } else {
+                problem.SetParameterLowerBound(p.data(), i, bounds(i, 0));
+                problem.SetParameterUpperBound(p.data(), i, bounds(i, 1));
+            }
+        }
+        if (fixed.size() == static_cast<size_t>(p.rows())) {
+            return 0;
+        } else if (!fixed.empty()) {
+            problem.SetParameterization(p.data(), new ceres::SubsetParameterization(p.rows(), fixed));
+        }
+        ceres::Solver::Options options;
+        options.max_num_iterations = 50;
+        options.function_tolerance = 1e-6;
+        options.gradient_tolerance = 1e-7;
+        options.parameter_tolerance = 1e-5;
+        if (!QI::SolverTrace()) options.logging_type = ceres::SILENT;
+        options.minimizer_progress_to_stdout = QI::SolverTrace();
+        ceres::Solver::Summary summary;
+        ceres::Solve(options, &problem, &summary);
+        if (summary.IsSolutionUsable() && m_model->ValidParameters(p) && func(p) < func(start)) {
+            pars = p.array();
+        }
+        return summary.iterations.size();
+    }
 };
 
 //******************************************************************************
@@ -143,23 +646,76 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> f0(parser, "f0", "f0 map (Hertz)", {'f', "f0"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
     args::ValueFlag<std::string> modelarg(parser, "MODEL", "Select model to fit - 1/2/2nex/3/3_f0/3nex, default 3", {'M', "model"}, "3");
     args::Flag scale(parser, "SCALE", "Normalize signals to mean (a good idea)", {'S', "scale"});
-    args::ValueFlag<char> algorithm(parser, "ALGO", "Select (S)tochastic or (G)aussian Region Contraction", {'a', "algo"}, 'G');
+    args::ValueFlag<char> algorithm(parser, "ALGO", "Select (S)tochastic, (G)aussian or (Q)uasi-random Region Contraction, or (T)wo-stage coarse search and LM", {'a', "algo"}, 'G');
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 4", {'i',"its"}, 4);
+    args::ValueFlag<int> samples(parser, "SAMPLES", "Samples per contraction, default 5000", {"samples"}, 5000);
+    args::ValueFlag<int> retain(parser, "RETAIN", "Best samples retained per contraction, default 50", {"retain"}, 50);
+    args::Flag adaptive(parser, "ADAPTIVE", "Adapt the samples per contraction and stop when the residual plateaus", {"adaptive"});
+    args::Flag refine(parser, "REFINE", "Refine the region contraction result with Levenberg-Marquardt", {"refine"});
+    args::ValueFlag<int> coarse(parser, "SAMPLES", "Samples per contraction for the two-stage coarse search, default 500", {"coarse"}, 500);
     args::ValueFlag<char> field(parser, "FIELD STRENGTH", "Specify field-strength for fitting regions - 3/7/u for user input", {'t', "tesla"}, '3');
+    args::Flag timing(parser, "TIMING", "Write out the time spent fitting each voxel (ns)", {"timing"});
+    args::Flag stack(parser, "STACK", "Write all the maps as the volumes of one file, with their names in a .json file alongside", {"stack"});
+    args::Flag interleave(parser, "INTERLEAVE", "Store the maps of each voxel together while fitting and split them when writing", {"interleave"});
+    args::Flag pin(parser, "PIN", "Pin threads to CPUs and allocate outputs from them (for NUMA machines)", {"pin"});
+    args::Flag pack(parser, "PACK", "Hold the inputs losslessly compressed in memory, and unpack a few thousand voxels at a time while fitting", {"pack"});
+    args::Flag keep_int16(parser, "INT16", "Keep inputs stored as 16-bit integers as integers in memory, and convert them while fitting", {"int16"});
+    args::ValueFlag<int> multigrid(parser, "FACTOR", "Fit every FACTOR'th voxel first, then narrow the fitting ranges of the rest to those fitted around them", {"multigrid"}, 1);
+    args::ValueFlag<uint64_t> seed(parser, "SEED", "Seed for the region contraction samples, default 0. The maps do not depend on the number of threads", {"seed"}, 0);
+    args::Flag batch(parser, "BATCH", "Fit blocks of voxels together, evaluating all their samples for each contraction at once", {"batch"});
+    args::ValueFlag<int> surrogate(parser, "ORDER", "Run all but the last contraction on a polynomial surrogate of this order, default 0 (off)", {"surrogate"}, 0);
+    args::ValueFlag<std::string> surrogateCache(parser, "DIR", "Directory to cache surrogates in, default current", {"surrogate-cache"}, ".");
+    args::ValueFlag<int> dictionary(parser, "ENTRIES", "Start region contraction around the best matches from a dictionary of N random entries", {"dictionary"}, 0);
+    args::ValueFlag<int> dictionaryRank(parser, "RANK", "Compress the dictionary onto this many singular vectors, default 0 (off)", {"dictionary-rank"}, 0);
+    args::ValueFlag<int> dictionaryIndex(parser, "CHECKS", "Match the dictionary through an approximate nearest-neighbour index, comparing about CHECKS entries per voxel", {"dictionary-index"}, 0);
+    args::ValueFlag<std::string> dictionaryCache(parser, "DIR", "Directory to cache dictionary indices in, default current", {"dictionary-cache"}, ".");
+    QI::CheckpointArgs checkpoint(parser);
+    QI::RegionArgs regions(parser);
+    QI::RefitArgs refit(parser);
+    QI::MemoryArgs memory(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
-    std::vector<QI::VectorVolumeF::Pointer> images;
-    for (auto &input_path : QI::CheckList(input_paths)) {
+    // The inputs are read (and decompressed) at the same time, while the sequence is parsed. This
+    // has its own pool, as the global one takes its size from --threads when the fit starts.
+    const std::vector<std::string> inputs = QI::CheckList(input_paths);
+    // With --pack each image is packed as soon as it is read and then released, so only the images
+    // being read are ever in memory unpacked. With --int16 integer files are never held as floats.
+    QI::ThreadPool readers(std::min<size_t>(inputs.size(), 4));
+    std::vector<std::future<QI::VectorVolumeF::Pointer>> reads;
+    typedef QI::PackedImage<QI::VectorVolumeF> TPacked;
+    std::vector<std::shared_ptr<const TPacked>> packed(inputs.size());
+    const bool packing = pack, integers = keep_int16;
+    const QI::VolumeF::RegionType region = subregion.region();
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const std::string input_path = inputs[i];
         if (verbose) std::cout << "Reading file: " << input_path << std::endl;
-        auto image = QI::ReadVectorImage<float>(input_path);
-        image->DisconnectPipeline(); // This step is really important.
-        images.push_back(image);
+        reads.push_back(readers.async([input_path, i, packing, integers, region, &packed]() -> QI::VectorVolumeF::Pointer {
+            if (integers) {
+                double slope, inter;
+                auto stored = QI::ReadInt16VectorImage(input_path, region, slope, inter);
+                if (stored) {
+                    packed[i] = std::make_shared<const TPacked>(stored.GetPointer(), slope, inter, packing);
+                    return QI::VectorVolumeF::Pointer();
+                }
+            }
+            auto image = QI::ReadVectorImage<float>(input_path, region);
+            image->DisconnectPipeline(); // This step is really important.
+            if (packing) {
+                packed[i] = std::make_shared<const TPacked>(image.GetPointer());
+                return QI::VectorVolumeF::Pointer();
+            }
+            return image;
+        }));
     }
     auto sequences = QI::ReadSequence<QI::SequenceGroup>(std::cin, verbose);
+    std::vector<QI::VectorVolumeF::Pointer> images;
+    for (auto &read : reads) {
+        images.push_back(read.get());
+    }
     if (sequences.count() != images.size()) {
         QI_FAIL("Sequence group size " << sequences.count() << " does not match images size " << images.size());
     }
@@ -206,39 +762,132 @@ int main(int argc, char **argv) {
     }
 
     auto apply = QI::ApplyF::New();
+    std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
     switch (algorithm.Get()) {
-        case 'S': {
+        case 'S':
             if (verbose) std::cout << "Using SRC algorithm" << std::endl;
-            std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
             algo->setGauss(false);
-            apply->SetAlgorithm(algo);
-        } break;
-        case 'G': {
+            break;
+        case 'G':
             if (verbose) std::cout << "Using GRC algorithm" << std::endl;
-            std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
             algo->setGauss(true);
-            apply->SetAlgorithm(algo);
-        } break;
+            break;
+        case 'Q':
+            if (verbose) std::cout << "Using quasi-random SRC algorithm" << std::endl;
+            algo->setGauss(false);
+            algo->setQuasiRandom(true);
+            break;
+        case 'T':
+            // The coarse stage is the dictionary's best match if there is one, otherwise a small GRC
+            if (verbose) std::cout << "Using two-stage coarse search and Levenberg-Marquardt" << std::endl;
+            algo->setGauss(true);
+            algo->setTwoStage(true, coarse.Get());
+            break;
         default:
             std::cerr << "Unknown algorithm type " << algorithm.Get() << std::endl;
             return EXIT_FAILURE;
     }
+    if (retain.Get() < 2 || samples.Get() < retain.Get()) {
+        QI_FAIL("--retain must be at least 2 and no more than --samples");
+    }
+    algo->setSamples(samples.Get(), retain.Get());
+    algo->setAdaptive(adaptive);
+    algo->setRefine(refine);
+    algo->setSeed(seed.Get());
+    // Pick the compiled signal loop for this model and protocol now, not on every evaluation
+    algo->setFixedSignal(QI::MakeFixedSignal(model, sequences));
+    if (batch) {
+        // Lock-step fitting runs one stage for the whole block, so cannot narrow or switch stages
+        if (algorithm.Get() == 'T' || multigrid.Get() > 1 || surrogate.Get() > 0) {
+            QI_FAIL("--batch cannot be combined with --algo=T, --multigrid or --surrogate");
+        }
+        algo->setBatch(true);
+    }
+    apply->SetAlgorithm(algo);
     apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetOutputIterations(true);
+    apply->SetOutputTiming(timing);
     apply->SetVerbose(verbose);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // mcdespot with a mask & threads is a very unbalanced algorithm
+    apply->SetPin(pin);
+    apply->SetMultigrid(multigrid.Get());
+    apply->SetInterleaved(interleave);
+    QI::VolumeF::Pointer f0Map = f0 ? QI::ReadImage(f0.Get(), region) : QI::VolumeF::Pointer();
+    QI::VolumeF::Pointer B1Map = B1 ? QI::ReadImage(B1.Get(), region) : QI::VolumeF::Pointer();
+    if (dictionary.Get() > 0) { // Built on the global pool, so after SetPoolsize
+        // B1 and f0 are per-voxel constants, so become fixed axes instead of random parameters
+        std::vector<QI::Dictionary::Axis> axes{{static_cast<size_t>(model->ParameterIndex("B1")),
+                                                B1 ? Eigen::ArrayXd(Eigen::ArrayXd::LinSpaced(11, 0.5, 1.5)) : Eigen::ArrayXd(Eigen::ArrayXd::Ones(1))}};
+        if (f0Map) {
+            auto minmax = itk::MinimumMaximumImageCalculator<QI::VolumeF>::New();
+            minmax->SetImage(f0Map);
+            minmax->Compute();
+            axes.push_back({static_cast<size_t>(model->ParameterIndex("f0")), Eigen::ArrayXd::LinSpaced(21, minmax->GetMinimum(), minmax->GetMaximum())});
+        }
+        auto d = std::make_shared<QI::Dictionary>(sequences, model, QI::Dictionary::Random(bounds, dictionary.Get()), axes, dictionaryRank.Get(), verbose);
+        if (dictionaryIndex.Get() > 0) {
+            d->index(dictionaryCache.Get(), dictionaryIndex.Get(), verbose);
+        }
+        algo->setDictionary(d, f0Map.IsNotNull());
+    }
+    if (surrogate.Get() > 0) { // Also built on the global pool
+        // Train over every voxel's bounds, so the f0 offsets and the B1 values in the maps
+        Eigen::ArrayXXd box = bounds;
+        auto minmax = itk::MinimumMaximumImageCalculator<QI::VolumeF>::New();
+        if (f0Map) {
+            minmax->SetImage(f0Map);
+            minmax->Compute();
+            box(model->ParameterIndex("f0"), 0) += minmax->GetMinimum();
+            box(model->ParameterIndex("f0"), 1) += minmax->GetMaximum();
+        }
+        if (B1Map) {
+            minmax->SetImage(B1Map);
+            minmax->Compute();
+            box.row(model->ParameterIndex("B1")) << minmax->GetMinimum(), minmax->GetMaximum();
+        } else {
+            box.row(model->ParameterIndex("B1")).setConstant(1.0);
+        }
+        auto emulator = QI::Surrogate::Cached(surrogateCache.Get(), sequences, model, box, surrogate.Get(), verbose);
+        if (emulator->error() > 0.05) {
+            std::cerr << "Surrogate relative error " << emulator->error() << " is too large, fitting with exact signals only" << std::endl;
+        } else {
+            algo->setSurrogate(emulator);
+        }
+    }
     for (int i = 0; i < images.size(); i++) {
-        apply->SetInput(i, images[i]);
+        if (packed[i]) {
+            if (verbose) std::cout << (packed[i]->integers() ? "Kept the integers of " : "Packed ") << inputs[i]
+                                   << " in 1/" << packed[i]->ratio() << " of the memory of floats" << std::endl;
+            apply->SetPackedInput(i, packed[i]);
+        } else {
+            apply->SetInput(i, images[i]);
+        }
+    }
+    if (f0Map) apply->SetConst(0, f0Map);
+    if (B1Map) apply->SetConst(1, B1Map);
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), region));
+    subregion.Apply(apply);
+    if (refit.requested()) {
+        // The earlier maps are read as separate files, and lock-step blocks cannot start from them
+        if (batch || stack) {
+            QI_FAIL("--refit cannot be combined with --batch or --stack");
+        }
+        std::vector<std::string> names = model->ParameterNames();
+        if (adaptive) names.push_back("samples");
+        if (algorithm.Get() == 'T') {
+            names.push_back("coarse_residual");
+            names.push_back("coarse_its");
+        }
+        refit.Apply(apply, model->Name() + "_", names, "residual", "iterations", {"coarse_residual"}, region, verbose);
+        algo->setSeeded(true);
     }
-    if (f0) apply->SetConst(0, QI::ReadImage(f0.Get()));
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
 
     // Need this here so the bounds.txt file will have the correct prefix
     std::string outPrefix = outarg.Get() + model->Name() + "_";
     if (verbose) {
         std::cout << "Bounds:\n" <<  bounds.transpose() << std::endl;
+        QI::CacheOutput(outPrefix + "bounds.txt");
         std::ofstream boundsFile(outPrefix + "bounds.txt");
         boundsFile << "Names: ";
         for (size_t p = 0; p < model->nParameters(); p++) {
@@ -253,19 +902,100 @@ int main(int argc, char **argv) {
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    if (regions.requested()) {
+        regions.Fit(apply, QI::ReadImage<QI::VolumeI>(regions.labels.Get()), model->ParameterNames(), outPrefix, verbose);
+        return EXIT_SUCCESS;
+    }
+    checkpoint.Apply(apply, outarg.Get());
+    if (memory.Slabs(apply, 0, verbose) > 0) {
+        QI_FAIL("The fit will not fit inside the memory limit, and qimcdespot cannot stream");
+    }
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
     }
-    for (int i = 0; i < model->nParameters(); i++) {
-        QI::WriteImage(apply->GetOutput(i), outPrefix + model->ParameterNames()[i] + QI::OutExt());
+    // An interleaved fit holds every map in one image, split here so the rest is the same
+    std::vector<QI::VolumeF::Pointer> maps;
+    if (interleave) {
+        maps = QI::SplitInterleaved(apply->GetInterleavedOutput());
+    } else {
+        for (size_t i = 0; i < algo->numOutputs(); i++) {
+            maps.push_back(apply->GetOutput(i));
+        }
     }
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+    QI::WriteQueue writes;
     if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+        writes.WriteScaledVectorImage(apply->GetAllResidualsOutput(), maps[0], outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (stack) {
+        // Same volumes as the separate files, so the residual is scaled and iterations are converted
+        std::vector<QI::VolumeF::Pointer> vols;
+        std::vector<std::string> names;
+        for (int i = 0; i < model->nParameters(); i++) {
+            vols.push_back(maps[i]);
+            names.push_back(model->ParameterNames()[i]);
+        }
+        auto scaledResidual = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
+        scaledResidual->SetInput1(apply->GetResidualOutput());
+        scaledResidual->SetInput2(maps[0]);
+        scaledResidual->Update();
+        vols.push_back(scaledResidual->GetOutput());
+        names.push_back("residual");
+        auto iterations = itk::CastImageFilter<QI::ApplyF::TIterationsImage, QI::VolumeF>::New();
+        iterations->SetInput(apply->GetIterationsOutput());
+        iterations->Update();
+        vols.push_back(iterations->GetOutput());
+        names.push_back("iterations");
+        if (timing) {
+            vols.push_back(apply->GetTimingOutput());
+            names.push_back("timing");
+        }
+        if (adaptive) {
+            vols.push_back(maps[model->nParameters()]);
+            names.push_back("samples");
+        }
+        if (algorithm.Get() == 'T') {
+            const int o = model->nParameters() + (adaptive ? 1 : 0);
+            auto scaledCoarse = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
+            scaledCoarse->SetInput1(maps[o]);
+            scaledCoarse->SetInput2(maps[0]);
+            scaledCoarse->Update();
+            vols.push_back(scaledCoarse->GetOutput());
+            names.push_back("coarse_residual");
+            vols.push_back(maps[o + 1]);
+            names.push_back("coarse_its");
+        }
+        QI::WriteStack(vols, names, outPrefix + "all" + QI::OutExt());
+    } else {
+        for (int i = 0; i < model->nParameters(); i++) {
+            writes.WriteImage(maps[i].GetPointer(), outPrefix + model->ParameterNames()[i] + QI::OutExt());
+        }
+        writes.WriteScaledImage(apply->GetResidualOutput(), maps[0], outPrefix + "residual" + QI::OutExt());
+        if (timing) {
+            writes.WriteImage(apply->GetTimingOutput(), outPrefix + "timing" + QI::OutExt());
+        }
+        writes.WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+        if (adaptive) {
+            writes.WriteImage(maps[model->nParameters()].GetPointer(), outPrefix + "samples" + QI::OutExt());
+        }
+        if (algorithm.Get() == 'T') {
+            const int o = model->nParameters() + (adaptive ? 1 : 0);
+            writes.WriteScaledImage(maps[o].GetPointer(), maps[0], outPrefix + "coarse_residual" + QI::OutExt());
+            writes.WriteImage(maps[o + 1].GetPointer(), outPrefix + "coarse_its" + QI::OutExt());
+        }
+    }
+    if (checkpoint.failures) {
+        writes.WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
     }
-    QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+    writes.wait();
     return EXIT_SUCCESS;
 }
 
@@ -13,6 +13,7 @@
 #include <iostream>
 #include <string>
 #include <complex>
+#include <algorithm>
 
 #include "itkBinaryFunctorImageFilter.h"
 #include "itkExtractImageFilter.h"
@@ -65,7 +66,74 @@ class MPRAGELookUpFilter : public ImageToImageFilter<QI::VolumeF, QI::VolumeF>
 public:
 
 protected:
-    std::vector<float> m_T1, m_con;
+    /*
+     * The contrast is monotonic in T1 over most of the range, but can turn over at the ends. The
+     * table for each B1 is split into monotonic segments with the contrast sorted ascending, so a
+     * voxel can be inverted by binary search and linear interpolation in each segment.
+     */
+    struct Segment {
+        std::vector<double> con, T1;
+    };
+    typedef std::vector<Segment> TTable;
+    std::vector<double> m_B1;     // Increasing, one table for each
+    std::vector<TTable> m_tables;
+
+    static TTable BuildTable(const std::vector<double> &T1, const std::vector<double> &con) {
+        TTable table;
+        size_t start = 0;
+        while (start < T1.size()) {
+            size_t end = start + 1;
+            if (end < T1.size()) {
+                const bool rising = con[end] > con[start];
+                while ((end + 1) < T1.size() && ((con[end + 1] > con[end]) == rising)) {
+                    end++;
+                }
+            }
+            Segment seg;
+            seg.con.assign(con.begin() + start, con.begin() + end + 1);
+            seg.T1.assign(T1.begin() + start, T1.begin() + end + 1);
+            if (seg.con.front() > seg.con.back()) {
+                std::reverse(seg.con.begin(), seg.con.end());
+                std::reverse(seg.T1.begin(), seg.T1.end());
+            }
+            table.push_back(seg);
+            start = end + 1;
+        }
+        return table;
+    }
+
+    /*
+     * Where more than one segment spans the contrast the longest (the main monotonic part of the
+     * curve) wins. If none do, return the end of a segment with the closest contrast.
+     */
+    static double Invert(const TTable &table, const double c) {
+        const Segment *best = nullptr;
+        for (const Segment &seg : table) {
+            if (c >= seg.con.front() && c <= seg.con.back() && (!best || seg.con.size() > best->con.size())) {
+                best = &seg;
+            }
+        }
+        if (!best) {
+            double best_distance = std::numeric_limits<double>::max();
+            double best_T1 = 0;
+            for (const Segment &seg : table) {
+                if (fabs(seg.con.front() - c) < best_distance) {
+                    best_distance = fabs(seg.con.front() - c);
+                    best_T1 = seg.T1.front();
+                }
+                if (fabs(seg.con.back() - c) < best_distance) {
+                    best_distance = fabs(seg.con.back() - c);
+                    best_T1 = seg.T1.back();
+                }
+            }
+            return best_T1;
+        }
+        const size_t i = std::upper_bound(best->con.begin(), best->con.end(), c) - best->con.begin();
+        if (i == 0) return best->T1.front();
+        if (i == best->con.size()) return best->T1.back();
+        const double w = (c - best->con[i - 1]) / (best->con[i] - best->con[i - 1]);
+        return best->T1[i - 1] + w * (best->T1[i] - best->T1[i - 1]);
+    }
 
 public:
     /** Standard class typedefs. */
@@ -82,19 +150,37 @@ public:
         this->SetNthInput(0, const_cast<TImage*>(img));
     }
 
-    void SetSequence(QI::MP2RAGESequence &sequence) {
+    void SetB1(const TImage *img) {
+        this->SetNthInput(1, const_cast<TImage*>(img));
+    }
+
+    /*
+     * Without a B1 map only the nominal B1 table is built. With one, tables cover 0.5 to 1.5 and
+     * each voxel is inverted in the two tables either side of its B1 and then interpolated.
+     */
+    void SetSequence(QI::MP2RAGESequence &sequence, const bool withB1 = false) {
         MP2Functor<double> con;
-        m_T1.clear();
-        m_con.clear();
-        for (float T1 = 0.25; T1 < 4.3; T1 += 0.001) {
-            Eigen::Array3d tp; tp << T1, 1.0, 1.0; // Fix B1 and eta
-            Eigen::Array2cd sig = sequence.signal(1., T1, 1.0, 1.0);
-            double c = con(sig[0], sig[1]);
-            m_T1.push_back(T1);
-            m_con.push_back(c);
-            //cout << m_pars.back().transpose() << " : " << m_cons.back().transpose() << std::endl;
+        m_B1.clear();
+        m_tables.clear();
+        if (withB1) {
+            for (int b = 0; b <= 20; b++) {
+                m_B1.push_back(0.5 + b * 0.05);
+            }
+        } else {
+            m_B1.push_back(1.0);
+        }
+        size_t entries = 0;
+        for (const double B1 : m_B1) {
+            std::vector<double> T1s, cons;
+            for (double T1 = 0.25; T1 < 4.3; T1 += 0.001) {
+                Eigen::Array2cd sig = sequence.signal(1., T1, B1, 1.0);
+                T1s.push_back(T1);
+                cons.push_back(con(sig[0], sig[1]));
+            }
+            m_tables.push_back(BuildTable(T1s, cons));
+            entries += T1s.size();
         }
-        std::cout << "Lookup table has " << m_T1.size() << " entries" << std::endl;
+        std::cout << "Lookup table has " << entries << " entries" << std::endl;
     }
 
 protected:
@@ -116,24 +202,32 @@ protected:
         }
     }
 
+    void BeforeThreadedGenerateData() ITK_OVERRIDE {
+        if (this->GetInput(1) && m_B1.size() < 2) {
+            itkExceptionMacro("A B1 map was set but the lookup table was built without B1");
+        }
+    }
+
     void ThreadedGenerateData(const RegionType &region, ThreadIdType threadId) ITK_OVERRIDE {
         //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
         ImageRegionConstIterator<TImage> inputIter(this->GetInput(), region);
+        ImageRegionConstIterator<TImage> B1Iter;
+        if (this->GetInput(1)) {
+            B1Iter = ImageRegionConstIterator<TImage>(this->GetInput(1), region);
+        }
         ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
 
         while(!inputIter.IsAtEnd()) {
             const double ival = inputIter.Get();
-            double best_distance = std::numeric_limits<double>::max();
-            int best_index = 0;
-            for (int i = m_T1.size(); i > 0; i--) {
-                double distance = fabs(m_con[i] - ival);
-                if (distance < best_distance) {
-                    best_distance = distance;
-                    best_index = i;
-                }
+            if (m_B1.size() == 1) {
+                outputIter.Set(Invert(m_tables[0], ival));
+            } else {
+                const double B1 = QI::Clamp<double>(B1Iter.Get(), m_B1.front(), m_B1.back());
+                const size_t i = std::min<size_t>(std::upper_bound(m_B1.begin(), m_B1.end(), B1) - m_B1.begin(), m_B1.size() - 1);
+                const double w = (B1 - m_B1[i - 1]) / (m_B1[i] - m_B1[i - 1]);
+                outputIter.Set((1 - w) * Invert(m_tables[i - 1], ival) + w * Invert(m_tables[i], ival));
+                ++B1Iter;
             }
-            //cout << "Best index " << best_index << " distance " << best_distance << " pars " << outputs.transpose() << " data " << data_inputs.transpose() << " cons" << m_cons[best_index].transpose() << std::endl;
-            outputIter.Set(m_T1[best_index]);
             ++inputIter;
             ++outputIter;
         }
@@ -154,6 +248,7 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::Flag     automask(parser, "AUTOMASK", "Create a mask from the sum of squares image", {'a', "automask"});
     QI::ParseArgs(parser, argc, argv, verbose);
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
@@ -195,8 +290,12 @@ int main(int argc, char **argv) {
     if (verbose) std::cout << "Calculating T1" << std::endl;
     auto mp2rage_sequence = QI::ReadSequence<QI::MP2RAGESequence>(std::cin, verbose);
     auto apply = itk::MPRAGELookUpFilter::New();
-    apply->SetSequence(mp2rage_sequence);
+    apply->SetSequence(mp2rage_sequence, static_cast<bool>(B1));
     apply->SetInput(MP2Filter->GetOutput());
+    if (B1) {
+        if (verbose) std::cout << "Reading B1 map: " << B1.Get() << std::endl;
+        apply->SetB1(QI::ReadImage(B1.Get()));
+    }
     apply->Update();
 
     if (mask_img) {
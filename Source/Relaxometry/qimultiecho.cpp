@@ -12,8 +12,6 @@
 
 #include <iostream>
 #include <Eigen/Core>
-#include <unsupported/Eigen/LevenbergMarquardt>
-#include <unsupported/Eigen/NumericalDiff>
 
 #include "itkTimeProbe.h"
 #include "itkImageFileReader.h"
@@ -26,11 +24,16 @@
 #include "SequenceCereal.h"
 #include "ApplyTypes.h"
 #include "ImageToVectorFilter.h"
+#include "LevenbergMarquardt.h"
+#include "Fit.h"
+#include "NNLS.h"
+#include "EPG.h"
+#include "ThreadPool.h"
 
 typedef itk::ImageToVectorFilter<QI::SeriesF> SeriesToVectorF;
 
 /*
- * Base class for the 3 different algorithms
+ * Base class for the different algorithms
  */
 class RelaxAlgo : public QI::ApplyF::Algorithm {
 private:
@@ -47,6 +50,9 @@ protected:
         if (PD > m_thresh) {
             outputs[0] = PD;
             outputs[1] = QI::Clamp(T2, m_clampLo, m_clampHi);
+            if (!wantsResidual()) {
+                return;
+            }
             Eigen::ArrayXd theory = QI::One_MultiEcho(m_sequence.TE, m_sequence.TR, PD, 0., T2).array().abs(); // T1 isn't modelled, set to 0 for instant recovery
             Eigen::ArrayXf r = (data.array() - theory).cast<float>();
             residual = sqrt(r.square().sum() / r.rows());
@@ -60,12 +66,13 @@ protected:
     }
 public:
     void setIterations(size_t n) { m_iterations = n; }
-    void setSequence(const QI::MultiEchoSequence &s) { m_sequence = s; }
+    virtual void setSequence(const QI::MultiEchoSequence &s) { m_sequence = s; }
     void setClamp(double lo, double hi) { m_clampLo = lo; m_clampHi = hi; }
     void setThresh(double t) { m_thresh = t; }
     size_t numInputs() const override { return m_sequence.count(); }
     size_t numConsts() const override { return 1; }
     size_t numOutputs() const override { return 2; }
+    virtual std::vector<std::string> outputNames() const { return {"PD", "T2"}; }
     size_t dataSize() const override { return m_sequence.size(); }
     float zero() const override { return 0.f; }
 
@@ -76,7 +83,18 @@ public:
 };
 
 class LogLinAlgo: public RelaxAlgo {
+protected:
+    QI::LinearDesign<2> m_design; // log(S) = log(PD) - TE/T2, the same for every voxel
+
 public:
+    void setSequence(const QI::MultiEchoSequence &s) override {
+        RelaxAlgo::setSequence(s);
+        QI::LinearDesign<2>::TDesign X(s.size(), 2);
+        X.col(0) = s.TE;
+        X.col(1).setOnes();
+        m_design = QI::LinearDesign<2>(X);
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TConst &residual,
@@ -84,18 +102,39 @@ public:
     {
         Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
         Eigen::ArrayXd data = indata.cast<double>();
-        // Set up echo times array
-        Eigen::MatrixXd X(m_sequence.size(), 2);
-        X.col(0) = m_sequence.TE;
-        X.col(1).setOnes();
-        Eigen::VectorXd Y = data.array().log();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
+        const Eigen::Vector2d b = m_design.solve(data.log().matrix());
         double PD = exp(b[1]);
         double T2 = -1 / b[0];
         clamp_and_threshold(data, outputs, residual, resids, PD, T2);
         its = 1;
         return true;
     }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        // The design matrix is the same for every voxel, so its factorisation solves the whole block
+        const Eigen::ArrayXXd data = inputs[0].cast<double>().array();
+        const Eigen::MatrixXd b = m_design.solve(data.log().matrix());
+        const Eigen::ArrayXd PD = b.row(1).transpose().array().exp();
+        const Eigen::ArrayXd T2 = -1. / b.row(0).transpose().array();
+        const Eigen::ArrayXd keep = (PD > m_thresh).cast<double>();
+        outputs[0] = (PD * keep).transpose().cast<float>();
+        outputs[1] = (T2.max(m_clampLo).min(m_clampHi) * keep).transpose().cast<float>();
+        its.setOnes();
+        if (!wantsResidual()) {
+            return true; // The model curves are only needed for the residuals
+        }
+        const Eigen::ArrayXXd theory = (m_sequence.TE.matrix() * (-1. / T2).matrix().transpose()).array().exp().rowwise() * PD.transpose();
+        const Eigen::ArrayXXf r = ((data - theory).rowwise() * keep.transpose()).cast<float>();
+        residual = (r.square().colwise().sum() / r.rows()).sqrt().matrix();
+        if (resids.rows() > 0) {
+            resids = r.matrix();
+        }
+        return true;
+    }
 };
 
 class ARLOAlgo : public RelaxAlgo {
@@ -123,28 +162,23 @@ public:
     }
 };
 
-class RelaxFunctor : public Eigen::DenseFunctor<double> {
-    protected:
-        const QI::MultiEchoSequence m_sequence;
-        const Eigen::ArrayXd m_data;
-        const std::shared_ptr<QI::SCD> m_model = std::make_shared<QI::SCD>();
-
-    public:
-        RelaxFunctor(const QI::MultiEchoSequence &cs, const Eigen::ArrayXd &data) :
-            DenseFunctor<double>(2, cs.size()),
-            m_sequence(cs), m_data(data)
-        {
-            assert(static_cast<size_t>(m_data.rows()) == values());
-        }
+/*
+ * Mono-exponential decay with PD & T2 as parameters, with analytic derivatives
+ */
+struct MonoExpModel {
+    typedef Eigen::Vector2d TParams;
+    const Eigen::ArrayXd &TE, &data;
 
-        int operator()(const Eigen::Ref<Eigen::VectorXd> &params, Eigen::Ref<Eigen::ArrayXd> diffs) const {
-            eigen_assert(diffs.size() == values());
-            Eigen::VectorXd fullp(5);
-            fullp << params(0), 0, params(1), 0, 1.0; // Fix B1 to 1.0 for now
-            Eigen::ArrayXcd s = m_sequence.signal(m_model, fullp);
-            diffs = s.abs() - m_data;
-            return 0;
-        }
+    size_t size() const { return data.rows(); }
+    bool valid(const TParams &p) const { return p[1] > 0; }
+    double residual(const size_t i, const TParams &p, TParams &gradient) const {
+        const double e = exp(-TE[i] / p[1]);
+        const double s = p[0] * e;
+        const double sign = (s < 0) ? -1 : 1;
+        gradient[0] = sign * e;
+        gradient[1] = sign * s * TE[i] / (p[1] * p[1]);
+        return std::abs(s) - data[i];
+    }
 };
 
 class NonLinAlgo : public RelaxAlgo {
@@ -156,16 +190,234 @@ public:
     {
         Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
         const Eigen::ArrayXd data = indata.cast<double>();
-        RelaxFunctor f(m_sequence, data);
-        Eigen::NumericalDiff<RelaxFunctor> nDiff(f);
-        Eigen::LevenbergMarquardt<Eigen::NumericalDiff<RelaxFunctor>> lm(nDiff);
-        lm.setMaxfev(m_iterations * (m_sequence.size() + 1));
+        const MonoExpModel model{m_sequence.TE, data};
         // Just PD & T2 for now
         // Basic guess of T2=50ms
-        Eigen::VectorXd p(2); p << data(0), 0.05;
-        lm.minimize(p);
+        Eigen::Vector2d p(data(0), 0.05);
+        its = QI::LevenbergMarquardt<2>(model, p, m_iterations);
         clamp_and_threshold(data, outputs, residual, resids, p[0], p[1]);
-        its = lm.iterations();
+        return true;
+    }
+};
+
+/*
+ * Multi-component T2 from a regularised NNLS T2 spectrum (Whittall & MacKay 1989), with the
+ * stimulated echoes from imperfect refocusing modelled by the EPG (Prasloski et al 2012). The
+ * dictionary covers a grid of T2s and refocusing angles and is built once for the sequence, and
+ * then shared by all the threads. For each voxel the refocusing angle is the best of the grid,
+ * refined by interpolating the residuals, and the spectrum at that angle is regularised until the
+ * residual has grown by the chi-squared factor. Outputs are PD (the sum of the spectrum), the
+ * geometric-mean T2, the fraction of the spectrum below the cutoff T2 and the refocusing angle.
+ */
+class MWFAlgo : public RelaxAlgo {
+protected:
+    Eigen::ArrayXd m_T2s, m_angles;
+    double m_cutoff, m_chi2;
+    Eigen::MatrixXd m_dictionary;    // One block of columns (T2s) per refocusing angle
+    std::vector<Eigen::MatrixXd> m_G; // AᵀA for each angle
+    std::vector<Eigen::MatrixXd> m_C; // AᵀA for each angle and the next, for interpolation
+
+    struct Spectrum {
+        double PD = 0, T2 = 0, MWF = 0, angle = 0;
+        int solves = 0;
+        Eigen::VectorXd theory;
+    };
+
+    /*
+     * The normal equations at an angle between grid points i and i + 1
+     */
+    void interpolate(const Eigen::Index i, const double w, const Eigen::Map<const Eigen::MatrixXd> &Atb,
+                     Eigen::MatrixXd &G, Eigen::VectorXd &g) const {
+        if (w == 0) {
+            G = m_G[i];
+            g = Atb.col(i);
+        } else {
+            G = (1 - w)*(1 - w)*m_G[i] + w*w*m_G[i + 1] + w*(1 - w)*(m_C[i] + m_C[i].transpose());
+            g = (1 - w)*Atb.col(i) + w*Atb.col(i + 1);
+        }
+    }
+
+    /*
+     * Atb holds Aᵀb for every angle, one column each
+     */
+    Spectrum fit(const Eigen::VectorXd &b, const Eigen::Map<const Eigen::MatrixXd> &Atb, QI::ArrayXb &passive) const {
+        Spectrum result;
+        const Eigen::Index nT2 = m_T2s.rows(), nA = m_angles.rows();
+        const double btb = b.squaredNorm();
+        if (btb == 0) {
+            result.theory = Eigen::VectorXd::Zero(b.rows());
+            return result;
+        }
+        Eigen::VectorXd x, costs(nA);
+        for (Eigen::Index a = 0; a < nA; a++) {
+            result.solves += QI::NNLS(m_G[a], Atb.col(a), x, passive);
+            costs[a] = QI::NNLSCost(m_G[a], Atb.col(a), btb, x);
+        }
+        Eigen::Index best;
+        costs.minCoeff(&best);
+        // Vertex of the parabola through the best grid point and its neighbours
+        double offset = 0;
+        if (best > 0 && best < nA - 1) {
+            const double denom = costs[best - 1] - 2*costs[best] + costs[best + 1];
+            if (denom > 0) {
+                offset = QI::Clamp(0.5 * (costs[best - 1] - costs[best + 1]) / denom, -1., 1.);
+            }
+        }
+        const Eigen::Index i = (offset < 0) ? best - 1 : best;
+        const double w = (offset < 0) ? 1 + offset : offset;
+        result.angle = (1 - w)*m_angles[i] + w*m_angles[std::min(i + 1, nA - 1)];
+        Eigen::MatrixXd G;
+        Eigen::VectorXd g;
+        interpolate(i, w, Atb, G, g);
+        result.solves += QI::NNLS(G, g, x, passive);
+        const double chi2 = QI::NNLSCost(G, g, btb, x);
+        if (m_chi2 > 1 && chi2 > 0) {
+            // The misfit grows with mu, so bracket the target and then bisect in log(mu)
+            const double target = m_chi2 * chi2;
+            Eigen::MatrixXd Gmu = G;
+            Eigen::VectorXd xmu;
+            auto misfit = [&](const double mu) -> double {
+                Gmu.diagonal() = G.diagonal().array() + mu;
+                result.solves += QI::NNLS(Gmu, g, xmu, passive);
+                return QI::NNLSCost(G, g, btb, xmu);
+            };
+            double lo = 0, hi = 1e-4 * G.diagonal().mean();
+            double hiMisfit = misfit(hi);
+            Eigen::VectorXd xhi = xmu;
+            while (hiMisfit < target && hi < 1e6 * G.diagonal().mean()) {
+                lo = hi;
+                hi *= 10;
+                hiMisfit = misfit(hi);
+                xhi = xmu;
+            }
+            for (int it = 0; it < 12 && std::abs(hiMisfit / target - 1) > 1e-3; it++) {
+                const double mid = (lo > 0) ? std::sqrt(lo * hi) : hi / 10;
+                const double midMisfit = misfit(mid);
+                if (midMisfit < target) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                    hiMisfit = midMisfit;
+                    xhi = xmu;
+                }
+            }
+            x = xhi;
+        }
+        const double sum = x.sum();
+        if (sum > 0) {
+            result.PD = sum;
+            result.T2 = std::exp((x.array() * m_T2s.log()).sum() / sum);
+            result.MWF = (m_T2s < m_cutoff).select(x.array(), 0.).sum() / sum;
+        }
+        result.angle *= 180. / M_PI;
+        const Eigen::Index j = std::min(i + 1, nA - 1);
+        result.theory = (1 - w)*(m_dictionary.middleCols(i * nT2, nT2) * x) +
+                        w*(m_dictionary.middleCols(j * nT2, nT2) * x);
+        return result;
+    }
+
+    void store(const Spectrum &s, const Eigen::VectorXd &b, double *outputs, float &residual, float *resids) const {
+        const bool keep = s.PD > m_thresh;
+        outputs[0] = keep ? s.PD : 0.;
+        outputs[1] = keep ? QI::Clamp(s.T2, m_clampLo, m_clampHi) : 0.;
+        outputs[2] = keep ? s.MWF : 0.;
+        outputs[3] = keep ? s.angle : 0.;
+        Eigen::ArrayXf r = Eigen::ArrayXf::Zero(b.rows());
+        if (keep) {
+            r = (b - s.theory).cast<float>().array();
+        }
+        residual = std::sqrt(r.square().sum() / r.rows());
+        if (resids) {
+            Eigen::Map<Eigen::ArrayXf>(resids, r.rows()) = r;
+        }
+    }
+
+public:
+    MWFAlgo(const int nT2, const double T2lo, const double T2hi,
+            const int nFA, const double FAlo, const double cutoff, const double chi2) :
+        m_cutoff(cutoff), m_chi2(chi2)
+    {
+        if (nT2 < 2 || nFA < 1 || T2lo <= 0 || T2hi <= T2lo || FAlo <= 0 || FAlo > 180) {
+            QI_FAIL("Invalid T2 or refocusing angle grid for MWF");
+        }
+        m_T2s = Eigen::ArrayXd::LinSpaced(nT2, std::log(T2lo), std::log(T2hi)).exp();
+        m_angles = Eigen::ArrayXd::LinSpaced(nFA, FAlo * M_PI / 180., M_PI); // Just 180° if nFA is 1
+    }
+
+    void setSequence(const QI::MultiEchoSequence &s) override {
+        RelaxAlgo::setSequence(s);
+        const Eigen::Index nT2 = m_T2s.rows(), nA = m_angles.rows();
+        const size_t nCols = nT2 * nA;
+        m_dictionary.resize(s.size(), nCols);
+        QI::ThreadPool &pool = QI::ThreadPool::Global();
+        const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nCols));
+        pool.run(nTasks, [&](const size_t t) {
+            for (size_t c = (nCols * t) / nTasks; c < (nCols * (t + 1)) / nTasks; c++) {
+                // T1 only affects the stimulated echoes and is fixed at 1s
+                m_dictionary.col(c) = QI::EPG_CPMG(s.size(), s.ESP, 1.0, m_T2s[c % nT2], m_angles[c / nT2]).matrix();
+            }
+        });
+        m_G.resize(nA);
+        m_C.resize(nA);
+        for (Eigen::Index a = 0; a < nA; a++) {
+            const auto A = m_dictionary.middleCols(a * nT2, nT2);
+            m_G[a] = A.transpose() * A;
+            if (a < nA - 1) {
+                m_C[a] = A.transpose() * m_dictionary.middleCols((a + 1) * nT2, nT2);
+            }
+        }
+    }
+
+    size_t numOutputs() const override { return 4; }
+    std::vector<std::string> outputNames() const override { return {"PD", "T2", "MWF", "FA"}; }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
+        const Eigen::VectorXd b = indata.cast<double>();
+        const Eigen::MatrixXd Atb = m_dictionary.transpose() * b;
+        QI::ArrayXb passive;
+        const Spectrum s = fit(b, Eigen::Map<const Eigen::MatrixXd>(Atb.data(), m_T2s.rows(), m_angles.rows()), passive);
+        double out[4];
+        resids = itk::VariableLengthVector<float>(b.rows());
+        store(s, b, out, residual, resids.GetDataPointer());
+        for (int o = 0; o < 4; o++) {
+            outputs[o] = out[o];
+        }
+        its = s.solves;
+        return true;
+    }
+
+    /*
+     * The projections onto the dictionary for the whole block are a single product, and each
+     * voxel's fit starts from the non-zero T2s of the voxel before
+     */
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        const Eigen::MatrixXd data = inputs[0].cast<double>();
+        const Eigen::MatrixXd Atb = m_dictionary.transpose() * data;
+        const Eigen::Index nT2 = m_T2s.rows(), nA = m_angles.rows();
+        QI::ArrayXb passive;
+        Eigen::VectorXf r(data.rows());
+        for (Eigen::Index v = 0; v < data.cols(); v++) {
+            const Eigen::VectorXd b = data.col(v);
+            const Spectrum s = fit(b, Eigen::Map<const Eigen::MatrixXd>(Atb.col(v).data(), nT2, nA), passive);
+            double out[4];
+            store(s, b, out, residual(0, v), r.data());
+            for (int o = 0; o < 4; o++) {
+                outputs[o](0, v) = out[o];
+            }
+            if (resids.rows() > 0) {
+                resids.col(v) = r;
+            }
+            its[v] = s.solves;
+        }
         return true;
     }
 };
@@ -183,11 +435,19 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/a/n)", {'a',"algo"}, 'l');
+    args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (l/a/n/m)", {'a',"algo"}, 'l');
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampT2(parser, "CLAMP T2", "Clamp T2 between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> threshPD(parser, "THRESHOLD PD", "Only output maps when PD exceeds threshold value", {'t', "tresh"});
+    args::ValueFlag<int> nT2(parser, "N T2", "MWF: Number of T2s in the spectrum (default 40)", {"nT2"}, 40);
+    args::ValueFlag<double> T2lo(parser, "T2 MIN", "MWF: Shortest T2 in the spectrum (default 0.01 s)", {"T2min"}, 0.01);
+    args::ValueFlag<double> T2hi(parser, "T2 MAX", "MWF: Longest T2 in the spectrum (default 2 s)", {"T2max"}, 2.0);
+    args::ValueFlag<int> nFA(parser, "N FA", "MWF: Number of refocusing angles, from FAmin to 180 (default 14, 1 for 180 only)", {"nFA"}, 14);
+    args::ValueFlag<double> FAlo(parser, "FA MIN", "MWF: Smallest refocusing angle in degrees (default 50)", {"FAmin"}, 50.);
+    args::ValueFlag<double> cutoff(parser, "CUTOFF", "MWF: Myelin water is below this T2 (default 0.04 s)", {"cutoff"}, 0.04);
+    args::ValueFlag<double> chi2(parser, "CHI2", "MWF: Regularise until the misfit grows by this factor (default 1.02, 1 for none)", {"chi2"}, 1.02);
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
 
     if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
     auto inputFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path));
@@ -197,6 +457,8 @@ int main(int argc, char **argv) {
         case 'l': algo = std::make_shared<LogLinAlgo>(); if (verbose) std::cout << "LogLin algorithm selected." << std::endl; break;
         case 'a': algo = std::make_shared<ARLOAlgo>(); if (verbose) std::cout << "ARLO algorithm selected." << std::endl; break;
         case 'n': algo = std::make_shared<NonLinAlgo>(); if (verbose) std::cout << "Non-linear algorithm (Levenberg Marquardt) selected." << std::endl; break;
+        case 'm': algo = std::make_shared<MWFAlgo>(nT2.Get(), T2lo.Get(), T2hi.Get(), nFA.Get(), FAlo.Get(), cutoff.Get(), chi2.Get());
+                  if (verbose) std::cout << "Multi-component (MWF) algorithm selected." << std::endl; break;
         default:
             std::cout << "Unknown algorithm type " << algorithm.Get() << std::endl;
             return EXIT_FAILURE;
@@ -211,41 +473,45 @@ int main(int argc, char **argv) {
     algo->setSequence(multiecho);
     auto apply = QI::ApplyF::New();
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
     if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
 
-    auto PDoutput = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
-    auto T2output = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
+    const std::vector<std::string> names = algo->outputNames();
+    std::vector<itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::Pointer> tiles(names.size());
     itk::FixedArray<unsigned int, 4> layout;
     layout[0] = layout[1] = layout[2] = 1; layout[3] = nVols;
-    PDoutput->SetLayout(layout);
-    T2output->SetLayout(layout);
+    for (auto &tile : tiles) {
+        tile = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
+        tile->SetLayout(layout);
+    }
     if (verbose) std::cout << "Processing" << std::endl;
     auto inputVector = SeriesToVectorF::New();
     inputVector->SetInput(inputFile);
     inputVector->SetBlockSize(multiecho.size());
-    std::vector<QI::VolumeF::Pointer> PDimgs(nVols), T2imgs(nVols);
+    std::vector<std::vector<QI::VolumeF::Pointer>> imgs(names.size(), std::vector<QI::VolumeF::Pointer>(nVols));
+    double elapsed = 0;
     for (size_t i = 0; i < nVols; i++) {
         inputVector->SetBlockStart(i * multiecho.size());
 
         apply->SetAlgorithm(algo);
         apply->SetInput(0, inputVector->GetOutput());
         apply->Update();
+        elapsed += apply->GetTotalTime();
 
-        PDimgs.at(i) = apply->GetOutput(0);
-        T2imgs.at(i) = apply->GetOutput(1);
-        PDimgs.at(i)->DisconnectPipeline();
-        T2imgs.at(i)->DisconnectPipeline();
-
-        PDoutput->SetInput(i, PDimgs.at(i));
-        T2output->SetInput(i, T2imgs.at(i));
+        for (size_t o = 0; o < names.size(); o++) {
+            imgs[o].at(i) = apply->GetOutput(o);
+            imgs[o].at(i)->DisconnectPipeline();
+            tiles[o]->SetInput(i, imgs[o].at(i));
+        }
+    }
+    if (verbose) {
+        std::cout << "Elapsed time was " << elapsed << "s" << std::endl;
+        std::cout << "Writing output" << std::endl;
     }
-    if (verbose) std::cout << "Writing output" << std::endl;
-    PDoutput->UpdateLargestPossibleRegion();
-    T2output->UpdateLargestPossibleRegion();
     std::string outPrefix = outarg.Get() + "ME_";
-    QI::WriteImage(PDoutput->GetOutput(), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(T2output->GetOutput(), outPrefix + "T2" + QI::OutExt());
+    for (size_t o = 0; o < names.size(); o++) {
+        tiles[o]->UpdateLargestPossibleRegion();
+        QI::WriteImage(tiles[o]->GetOutput(), outPrefix + names[o] + QI::OutExt());
+    }
     //QI::writeResiduals(apply->GetResidOutput(), outPrefix, all_residuals);
 
     return EXIT_SUCCESS;
@@ -9,7 +9,10 @@
  *
  */
 
+#include <cmath>
+#include <algorithm>
 #include "Banding.h"
+#include "CPU.h"
 
 namespace QI {
 
@@ -52,6 +55,24 @@ bool BandAlgo::apply(const std::vector<TInput> &inputs, const std::vector<TConst
     return true;
 }
 
+bool BandAlgo::applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                          std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                          TResidsBlock &resids, TIterationsBlock &its) const
+{
+    size_t phase_stride = m_flips;
+    size_t flip_stride = 1;
+    if (m_phaseFirst)
+        std::swap(phase_stride, flip_stride);
+    Eigen::ArrayXXcf slab(m_phases, inputs[0].cols());
+    for (int f = 0; f < m_flips; f++) {
+        for (int p = 0; p < m_phases; p++) {
+            slab.row(p) = inputs[0].row(f*flip_stride + p*phase_stride).array();
+        }
+        outputs[0].row(f) = this->applyFlipBatch(slab).transpose().matrix();
+    }
+    return true;
+}
+
 std::complex<float> GeometricSolution(const Eigen::ArrayXcd &a, const Eigen::ArrayXcd &b, RegEnum regularise) {
     eigen_assert(a.rows() == b.rows());
     std::complex<double> sum(0., 0.);
@@ -91,6 +112,61 @@ std::complex<float> GeometricSolution(const Eigen::ArrayXcd &a, const Eigen::Arr
     return static_cast<std::complex<float>>(sum / N);
 }
 
+namespace {
+
+/*
+ * Sums the solution of every pair of lines for n voxels. One voxel at a time in plain loops
+ * instead of Eigen expressions, so each instruction set's build of it (see QI_MULTIVERSION) can
+ * vectorise down the voxels.
+ */
+QI_MULTIVERSION void SumPairs(const double *are, const double *aim, const double *bre, const double *bim,
+                              const Eigen::Index n, const Eigen::Index lines, const RegEnum regularise,
+                              double *sumre, double *sumim) {
+    for (Eigen::Index i = 0; i < lines; i++) {
+        const double *ari = are + i*n, *aii = aim + i*n, *bri = bre + i*n, *bii = bim + i*n;
+        for (Eigen::Index j = i + 1; j < lines; j++) {
+            const double *arj = are + j*n, *aij = aim + j*n, *brj = bre + j*n, *bij = bim + j*n;
+            for (Eigen::Index v = 0; v < n; v++) {
+                // The lines, their normals are (-dim, dre)
+                const double drei = bri[v] - ari[v], dimi = bii[v] - aii[v];
+                const double drej = brj[v] - arj[v], dimj = bij[v] - aij[v];
+                const double mu = ((arj[v] - ari[v])*(-dimj) + (aij[v] - aii[v])*drej) / (drei*(-dimj) + dimi*drej);
+                const double gsre = ari[v] + mu * drei;
+                const double gsim = aii[v] + mu * dimi;
+                bool use_gs = true;
+                if (regularise == RegEnum::Magnitude) {
+                    const double maxnorm = std::max(std::max(ari[v]*ari[v] + aii[v]*aii[v], arj[v]*arj[v] + aij[v]*aij[v]),
+                                                    std::max(bri[v]*bri[v] + bii[v]*bii[v], brj[v]*brj[v] + bij[v]*bij[v]));
+                    use_gs = (gsre*gsre + gsim*gsim) < maxnorm;
+                } else if (regularise == RegEnum::Line) {
+                    const double nu = ((ari[v] - arj[v])*(-dimi) + (aii[v] - aij[v])*drei) / (drej*(-dimi) + dimj*drei);
+                    const double cross = (drei*drej + dimi*dimj) / (std::sqrt(drei*drei + dimi*dimi) * std::sqrt(drej*drej + dimj*dimj));
+                    const double xi = 1.0 - cross*cross;
+                    use_gs = (mu > -xi) && (mu < 1 + xi) && (nu > -xi) && (nu < 1 + xi);
+                }
+                // The complex sum, (a[i] + a[j] + b[i] + b[j]) / 4, otherwise
+                sumre[v] += use_gs ? gsre : (ari[v] + arj[v] + bri[v] + brj[v]) / 4.0;
+                sumim[v] += use_gs ? gsim : (aii[v] + aij[v] + bii[v] + bij[v]) / 4.0;
+            }
+        }
+    }
+}
+
+} // End anonymous namespace
+
+Eigen::ArrayXcf GeometricSolution(const Eigen::ArrayXXd &are, const Eigen::ArrayXXd &aim,
+                                  const Eigen::ArrayXXd &bre, const Eigen::ArrayXXd &bim, RegEnum regularise) {
+    eigen_assert(are.cols() == bre.cols());
+    const Eigen::Index n = are.rows(), lines = are.cols();
+    Eigen::ArrayXd sumre = Eigen::ArrayXd::Zero(n), sumim = Eigen::ArrayXd::Zero(n);
+    SumPairs(are.data(), aim.data(), bre.data(), bim.data(), n, lines, regularise, sumre.data(), sumim.data());
+    const double N = lines * (lines - 1) / 2;
+    Eigen::ArrayXcf result(n);
+    result.real() = (sumre / N).cast<float>();
+    result.imag() = (sumim / N).cast<float>();
+    return result;
+}
+
 std::complex<float> GSAlgo::applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0, Eigen::InnerStride<>> &vf) const {
     Eigen::ArrayXcd a(m_lines);
     Eigen::ArrayXcd b(m_lines);
@@ -99,4 +175,21 @@ std::complex<float> GSAlgo::applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0,
     return GeometricSolution(a, b, m_Regularise);
 }
 
+Eigen::ArrayXcf GSAlgo::applyFlipBatch(const Eigen::ArrayXXcf &slab) const {
+    // Transpose so each line is a contiguous column of voxels
+    const Eigen::ArrayXXd re = slab.real().cast<double>().transpose(), im = slab.imag().cast<double>().transpose();
+    const Eigen::Index n = slab.cols();
+    Eigen::ArrayXXd are(n, m_lines), aim(n, m_lines), bre(n, m_lines), bim(n, m_lines);
+    if (m_reorderBlock) {
+        for (size_t i = 0; i < m_lines; i++) {
+            are.col(i) = re.col(i*2);   aim.col(i) = im.col(i*2);
+            bre.col(i) = re.col(i*2+1); bim.col(i) = im.col(i*2+1);
+        }
+    } else {
+        are = re.leftCols(m_lines);  aim = im.leftCols(m_lines);
+        bre = re.rightCols(m_lines); bim = im.rightCols(m_lines);
+    }
+    return GeometricSolution(are, aim, bre, bim, m_Regularise);
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -43,6 +43,12 @@ void SplitBlocks(const Eigen::ArrayBase<Derived> &full, Eigen::ArrayBase<Derived
 
 enum class RegEnum { None = 0, Line, Magnitude };
 std::complex<float> GeometricSolution(const Eigen::ArrayXcd &a, const Eigen::ArrayXcd &b, RegEnum r);
+/*
+ * The same for a block of voxels, a and b are (voxels x lines). The real and imaginary parts are
+ * kept in separate planes so every step is a plain array operation down the voxels.
+ */
+Eigen::ArrayXcf GeometricSolution(const Eigen::ArrayXXd &are, const Eigen::ArrayXXd &aim,
+                                  const Eigen::ArrayXXd &bre, const Eigen::ArrayXXd &bim, RegEnum r);
 
 class BandAlgo : public ApplyVectorXF::Algorithm {
 protected:
@@ -65,7 +71,12 @@ public:
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override;
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override;
     virtual std::complex<float> applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0, Eigen::InnerStride<>> &vf) const = 0;
+    virtual Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const = 0; // One flip for a block, slab is (phases x voxels)
 };
 
 class CSAlgo : public BandAlgo {
@@ -73,6 +84,9 @@ public:
     std::complex<float> applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0, Eigen::InnerStride<>> &vf) const override {
         return vf.mean();
     }
+    Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const override {
+        return slab.colwise().mean().transpose();
+    }
 };
 
 class MagMeanAlgo : public BandAlgo {
@@ -80,6 +94,9 @@ public:
     std::complex<float> applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0, Eigen::InnerStride<>> &vf) const override {
         return vf.abs().mean();
     }
+    Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const override {
+        return slab.abs().colwise().mean().transpose().cast<std::complex<float>>();
+    }
 };
 
 class RMSAlgo : public BandAlgo {
@@ -88,6 +105,9 @@ public:
         float sum = vf.abs().square().sum();
         return std::complex<float>(sqrt(sum / vf.rows()), 0.);
     }
+    Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const override {
+        return (slab.abs2().colwise().sum() / slab.rows()).sqrt().transpose().cast<std::complex<float>>();
+    }
 };
 
 class MaxAlgo : public BandAlgo {
@@ -99,6 +119,16 @@ public:
         }
         return max;
     }
+    Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const override {
+        Eigen::ArrayXcf max = Eigen::ArrayXcf::Zero(slab.cols());
+        Eigen::ArrayXf maxNorm = Eigen::ArrayXf::Zero(slab.cols());
+        for (Eigen::Index i = 0; i < slab.rows(); i++) {
+            const Eigen::ArrayXf n = slab.row(i).abs2().transpose();
+            max = (n > maxNorm).select(slab.row(i).transpose(), max);
+            maxNorm = maxNorm.max(n);
+        }
+        return max;
+    }
 };
 
 class GSAlgo : public BandAlgo {
@@ -108,6 +138,7 @@ public:
     const RegEnum &regularise()       { return m_Regularise; }
     void setRegularise(const RegEnum &r) { m_Regularise = r;}
     std::complex<float> applyFlip(const Eigen::Map<const Eigen::ArrayXcf, 0, Eigen::InnerStride<>> &vf) const override;
+    Eigen::ArrayXcf applyFlipBatch(const Eigen::ArrayXXcf &slab) const override;
 };
 
 } // End namespace QI
@@ -12,7 +12,8 @@
 #include "Direct2Algo.h"
 #include "EllipseHelpers.h"
 #include "Fit.h"
-#include "ceres/ceres.h"
+#include "FixedCost.h"
+#include "Trace.h"
 
 namespace QI {
 
@@ -24,20 +25,20 @@ public:
     const bool debug;
 
     template<typename T>
-    bool operator() (T const* const* p, T* resids) const {
+    bool operator() (const T *p, T *resids) const {
         typedef Eigen::Array<T, Eigen::Dynamic, 1> ArrayXT;
 
-        const T &G = p[0][0];
-        const T &a_1 = p[0][1];
-        const T &b_1 = p[0][2];
-        const T &f0_1 = p[0][3];
+        const T &G = p[0];
+        const T &a_1 = p[1];
+        const T &b_1 = p[2];
+        const T &f0_1 = p[3];
 
-        const T &f_2 = p[0][4];
-        const T &a_2 = p[0][5];
-        const T &b_2 = p[0][6];
-        const T &f0_2 = p[0][7] + f0_1; // Fit this as an offset
+        const T &f_2 = p[4];
+        const T &a_2 = p[5];
+        const T &b_2 = p[6];
+        const T &f0_2 = p[7] + f0_1; // Fit this as an offset
         const T &f_1 = 1.0 - f_2;
-        const T &psi0 = p[0][8];
+        const T &psi0 = p[8];
         
         // Convert the SSFP Ellipse parameters into a magnetization
         const ArrayXT m1 = EllipseToSignal(G * f_1, a_1, b_1, f0_1, psi0, TR, phi);
@@ -56,8 +57,40 @@ public:
     }
 };
 
+// Built once per thread, each voxel reloads the data and resets the start and bounds
+struct Direct2Algo::Context {
+    Eigen::ArrayXcd data;
+    Eigen::Array<double, 9, 1> p;
+    QI::LinearDesign<2> phase; // Regression of the phase differences against the increments
+    ceres::Problem problem;
+    ceres::Solver::Options options;
+
+    Context(const QI::SSFPEllipseSequence &seq, const bool debug) : data(seq.PhaseInc.rows()) {
+        QI::LinearDesign<2>::TDesign X(seq.PhaseInc.rows(), 2);
+        X.col(0) = seq.PhaseInc - M_PI;
+        X.col(1).setOnes();
+        phase = QI::LinearDesign<2>(X);
+        problem.AddResidualBlock(FixedAutoDiffCost<Direct2Cost, 9>(new Direct2Cost{data, seq.TR, seq.PhaseInc, debug}, data.size()*2),
+                                 NULL, p.data());
+        options.max_num_iterations = 50;
+        options.function_tolerance = 1e-5;
+        options.gradient_tolerance = 1e-6;
+        options.parameter_tolerance = 1e-4;
+        if (!debug && !QI::SolverTrace()) options.logging_type = ceres::SILENT;
+        options.minimizer_progress_to_stdout = QI::SolverTrace();
+    }
+};
+
+Direct2Algo::Direct2Algo(const QI::SSFPEllipseSequence &seq, bool debug) :
+    EllipseAlgo(seq, debug),
+    m_contexts(std::make_shared<PerThread<Context>>([this]{ return new Context(m_seq, m_debug); }))
+{}
+
+// TR and phi are always the sequence's, which the context was built with
 Eigen::ArrayXd Direct2Algo::apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const {
-    Eigen::ArrayXcd data = input.cast<std::complex<double>>();
+    Context &ctx = m_contexts->get();
+    Eigen::ArrayXcd &data = ctx.data;
+    data = input.cast<std::complex<double>>();
     const double scale = data.abs().maxCoeff();
     data /= scale;
 
@@ -65,14 +98,11 @@ Eigen::ArrayXd Direct2Algo::apply_internal(const Eigen::ArrayXcf &input, const d
     // Get as estimate of f0 and psi0
     // Do a linear regression of phi against unwrapped phase diff, intercept is theta0
     Eigen::VectorXd Y = QI::Unwrap((data / c_mean - std::complex<double>(1.0, 0.0)).arg());
-    Eigen::MatrixXd X(Y.rows(), 2);
-    X.col(0) = phi - M_PI;
-    X.col(1).setOnes();
-    const Eigen::VectorXd b = QI::LeastSquares(X, Y);
+    const Eigen::Vector2d b = ctx.phase.solve(Y);
     const double theta0_est = arg((data[0] / c_mean) - std::complex<double>(1.0, 0.0));//b[1];
     const double psi0_est   = arg(c_mean / std::polar(1.0, theta0_est/2));
     if (debug) {
-        std::cerr << "X\n" << X.transpose() << "\nY\n" << Y.transpose() << std::endl;
+        std::cerr << "X\n" << ctx.phase.design().transpose() << "\nY\n" << Y.transpose() << std::endl;
         std::cerr << "b " << b.transpose() << " theta0_est " << theta0_est << " psi0_est " << psi0_est << std::endl;
         std::cerr << "arg(c_mean) " << std::arg(c_mean) << std::endl;
         std::cerr << "old theta0_est " << arg((data[0] / c_mean) - std::complex<double>(1.0, 0.0)) << std::endl;
@@ -86,15 +116,12 @@ Eigen::ArrayXd Direct2Algo::apply_internal(const Eigen::ArrayXcf &input, const d
     const double not_zero = 1.0e-6;
     const double not_one  = 1.0 - not_zero;
     const double max_a = exp(-TR / 4.3); // Set a sensible maximum on T2
-    Eigen::Array<double, 9, 1> p, lo, hi;
+    Eigen::Array<double, 9, 1> &p = ctx.p;
+    Eigen::Array<double, 9, 1> lo, hi;
     p  << abs(c_mean), Gab_ie[1], Gab_ie[2], f0_1_est, 0.1, Gab_m[1], Gab_m[2], 10., psi0_est;
     lo << not_zero, std::max(Gab_ie[1] - 0.3, 0.01), std::max(Gab_ie[2] - 0.3, 0.01), -0.5/TR + 1.0e-6, 0.001, std::max(Gab_m[1] - 0.3, 0.01), std::max(Gab_m[2] - 0.3, 0.01), -35., -M_PI;
     hi << not_one,  std::min(Gab_ie[1] + 0.3, max_a), not_one, 0.5/TR - 1.0e-6, 0.5,  std::min(Gab_m[1] + 0.2, max_a), std::min(Gab_m[2] + 0.3, not_one), 35., M_PI;
-    ceres::Problem problem;
-    auto *cost = new ceres::DynamicAutoDiffCostFunction<Direct2Cost>(new Direct2Cost{data, TR, phi, debug});
-    cost->AddParameterBlock(9);
-    cost->SetNumResiduals(data.size()*2);
-    problem.AddResidualBlock(cost, NULL, p.data());
+    ceres::Problem &problem = ctx.problem;
     problem.SetParameterLowerBound(p.data(), 0, lo[0]); problem.SetParameterUpperBound(p.data(), 0, hi[0]);
     problem.SetParameterLowerBound(p.data(), 1, lo[1]); problem.SetParameterUpperBound(p.data(), 1, hi[1]);
     problem.SetParameterLowerBound(p.data(), 2, lo[2]); problem.SetParameterUpperBound(p.data(), 2, hi[2]);
@@ -104,13 +131,8 @@ Eigen::ArrayXd Direct2Algo::apply_internal(const Eigen::ArrayXcf &input, const d
     problem.SetParameterLowerBound(p.data(), 6, lo[6]); problem.SetParameterUpperBound(p.data(), 6, hi[6]);
     problem.SetParameterLowerBound(p.data(), 7, lo[7]); problem.SetParameterUpperBound(p.data(), 7, hi[7]);
     problem.SetParameterLowerBound(p.data(), 8, lo[8]); problem.SetParameterUpperBound(p.data(), 8, hi[8]);
-    ceres::Solver::Options options;
+    const ceres::Solver::Options &options = ctx.options;
     ceres::Solver::Summary summary;
-    options.max_num_iterations = 50;
-    options.function_tolerance = 1e-5;
-    options.gradient_tolerance = 1e-6;
-    options.parameter_tolerance = 1e-4;
-    if (!debug) options.logging_type = ceres::SILENT;
     if (debug) {
         std::cout << "***START***\n"
                   << "P:  " << p.transpose() << "\n"
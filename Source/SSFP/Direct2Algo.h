@@ -12,16 +12,20 @@
 #ifndef QI_ELLIPSE_DIRECT2_H
 #define QI_ELLIPSE_DIRECT2_H
 
+#include <memory>
 #include <Eigen/Dense>
 #include "EllipseAlgo.h"
+#include "Fit.h"
 
 namespace QI {
 
 class Direct2Algo : public EllipseAlgo {
 protected:
+    struct Context; // Per-thread problem, so the header does not need Ceres
+    std::shared_ptr<PerThread<Context>> m_contexts;
     Eigen::ArrayXd apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const override;
 public:
-    Direct2Algo(const QI::SSFPEllipseSequence &seq, bool debug) : EllipseAlgo(seq, debug) {};
+    Direct2Algo(const QI::SSFPEllipseSequence &seq, bool debug);
     size_t numOutputs() const override { return 9; }
     const std::vector<std::string> & names() const override {
         static std::vector<std::string> _names = {"G_ie", "a_ie", "b_ie", "f0_ie", 
@@ -12,7 +12,8 @@
 #include "DirectAlgo.h"
 #include "EllipseHelpers.h"
 #include "Fit.h"
-#include "ceres/ceres.h"
+#include "FixedCost.h"
+#include "Trace.h"
 
 namespace QI {
 
@@ -24,14 +25,14 @@ public:
     const bool debug;
 
     template<typename T>
-    bool operator() (T const* const* p, T* resids) const {
+    bool operator() (const T *p, T *resids) const {
         typedef Eigen::Array<T, Eigen::Dynamic, 1> ArrayXT;
 
-        const T &G = p[0][0];
-        const T &a = p[0][1];
-        const T &b = p[0][2];
-        const T &th0 = p[0][3];
-        const T &psi0 = p[0][4];
+        const T &G = p[0];
+        const T &a = p[1];
+        const T &b = p[2];
+        const T &th0 = p[3];
+        const T &psi0 = p[4];
 
         if (b < 2.*a/(1. + a*a)) {
             ArrayXT m = EllipseToSignal(G, a, b, th0, psi0, TR, phi);
@@ -53,35 +54,52 @@ public:
     }
 };
 
-Eigen::ArrayXd DirectAlgo::apply_internal(const Eigen::ArrayXcf &indata, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const {
-    Eigen::ArrayXcd data = indata.cast<std::complex<double>>();
+// The problem and its bounds only depend on the sequence, so each thread builds one and reloads the data
+struct DirectAlgo::Context {
+    Eigen::ArrayXcd data;
+    Eigen::Array<double, 5, 1> p;
+    ceres::Problem problem;
+    ceres::Solver::Options options;
+
+    Context(const QI::SSFPEllipseSequence &seq, const bool debug) : data(seq.PhaseInc.rows()) {
+        problem.AddResidualBlock(FixedAutoDiffCost<DirectCost, 5>(new DirectCost{data, seq.TR, seq.PhaseInc, debug}, data.size()*2),
+                                 new ceres::HuberLoss(1.0), p.data());
+        const double not_zero = 1.0e-6;
+        const double not_one  = 1.0 - not_zero;
+        const double max_a = exp(-seq.TR / 4.3); // Set a sensible maximum on T2
+        problem.SetParameterLowerBound(p.data(), 0, not_zero); problem.SetParameterUpperBound(p.data(), 0, not_one);
+        problem.SetParameterLowerBound(p.data(), 1, not_zero); problem.SetParameterUpperBound(p.data(), 1, max_a);
+        problem.SetParameterLowerBound(p.data(), 2, not_zero); problem.SetParameterUpperBound(p.data(), 2, not_one);
+        problem.SetParameterLowerBound(p.data(), 3, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 3, 2.*M_PI);
+        problem.SetParameterLowerBound(p.data(), 4, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 4, 2.*M_PI);
+        options.max_num_iterations = 50;
+        options.function_tolerance = 1e-5;
+        options.gradient_tolerance = 1e-6;
+        options.parameter_tolerance = 1e-4;
+        if (!debug && !QI::SolverTrace()) options.logging_type = ceres::SILENT;
+        options.minimizer_progress_to_stdout = QI::SolverTrace();
+    }
+};
+
+DirectAlgo::DirectAlgo(const QI::SSFPEllipseSequence &seq, bool debug) :
+    EllipseAlgo(seq, debug),
+    m_contexts(std::make_shared<PerThread<Context>>([this]{ return new Context(m_seq, m_debug); }))
+{}
+
+// TR and phi are always the sequence's, which the context was built with
+Eigen::ArrayXd DirectAlgo::apply_internal(const Eigen::ArrayXcf &indata, const double flip, const double TR, const Eigen::ArrayXd &, const bool debug, float &residual) const {
+    Context &ctx = m_contexts->get();
+    Eigen::ArrayXcd &data = ctx.data;
+    data = indata.cast<std::complex<double>>();
     const double scale = data.abs().maxCoeff();
     data /= scale;
 
     std::complex<double> c_mean = data.mean();
-
-    auto *cost = new ceres::DynamicAutoDiffCostFunction<DirectCost>(new DirectCost{data, TR, phi, debug});
-    cost->AddParameterBlock(5);
-    cost->SetNumResiduals(data.size()*2);
-    ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-    Eigen::Array<double, 5, 1> p, best_p;
-    ceres::Problem problem;
-    problem.AddResidualBlock(cost, loss, p.data());
-    const double not_zero = 1.0e-6;
-    const double not_one  = 1.0 - not_zero;
-    const double max_a = exp(-TR / 4.3); // Set a sensible maximum on T2
-    problem.SetParameterLowerBound(p.data(), 0, not_zero); problem.SetParameterUpperBound(p.data(), 0, not_one);
-    problem.SetParameterLowerBound(p.data(), 1, not_zero); problem.SetParameterUpperBound(p.data(), 1, max_a);
-    problem.SetParameterLowerBound(p.data(), 2, not_zero); problem.SetParameterUpperBound(p.data(), 2, not_one);
-    problem.SetParameterLowerBound(p.data(), 3, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 3, 2.*M_PI);
-    problem.SetParameterLowerBound(p.data(), 4, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 4, 2.*M_PI);
-    ceres::Solver::Options options;
+    Eigen::Array<double, 5, 1> &p = ctx.p;
+    Eigen::Array<double, 5, 1> best_p;
+    ceres::Problem &problem = ctx.problem;
+    const ceres::Solver::Options &options = ctx.options;
     ceres::Solver::Summary summary;
-    options.max_num_iterations = 50;
-    options.function_tolerance = 1e-5;
-    options.gradient_tolerance = 1e-6;
-    options.parameter_tolerance = 1e-4;
-    if (!debug) options.logging_type = ceres::SILENT;
 
     // Calculate a sensible guess for a/b using T1/T2 of grey matter
     Eigen::Array3d Gab = EllipseGab(1000., 50., TR, flip);
@@ -12,16 +12,20 @@
 #ifndef QI_ELLIPSE_DIRECT_H
 #define QI_ELLIPSE_DIRECT_H
 
+#include <memory>
 #include <Eigen/Dense>
 #include "EllipseAlgo.h"
+#include "Fit.h"
 
 namespace QI {
 
 class DirectAlgo : public EllipseAlgo {
 protected:
+    struct Context; // Per-thread problem, so the header does not need Ceres
+    std::shared_ptr<PerThread<Context>> m_contexts;
     Eigen::ArrayXd apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const override;
 public:
-    DirectAlgo(const QI::SSFPEllipseSequence &seq, bool debug) : EllipseAlgo(seq, debug) {};
+    DirectAlgo(const QI::SSFPEllipseSequence &seq, bool debug);
 };
 
 } // End namespace QI
@@ -23,31 +23,91 @@ EllipseAlgo::EllipseAlgo(const QI::SSFPEllipseSequence &seq, bool debug) :
     m_zero.Fill(0.);
 }
 
+void EllipseAlgo::fit(const Eigen::ArrayXcf &data, const double B1, Eigen::ArrayXXd &params, Eigen::ArrayXd &residual) const {
+    const int np = m_seq.PhaseInc.rows();
+    params.resize(this->numOutputs(), m_seq.FA.rows());
+    residual.resize(m_seq.FA.rows());
+    for (int f = 0; f < m_seq.FA.rows(); f++) {
+        const Eigen::ArrayXcf flipData = data.segment(f*np, np);
+        if (m_debug) {
+            std::cout << "Flip: " << m_seq.FA[f] << " Data: " << flipData.transpose() << std::endl;
+        }
+        float r = 0;
+        params.col(f) = this->apply_internal(flipData, B1 * m_seq.FA[f], m_seq.TR, m_seq.PhaseInc, m_debug, r);
+        residual[f] = r;
+        if (m_debug) {
+            std::cout << "Outputs: " << params.col(f).transpose() << std::endl;
+        }
+    }
+}
+
+bool EllipseAlgo::fitBlock(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &B1,
+                           std::vector<Eigen::ArrayXXd> &params, Eigen::ArrayXXd &residual) const
+{
+    const int np = m_seq.PhaseInc.rows();
+    params.assign(this->numOutputs(), Eigen::ArrayXXd(m_seq.FA.rows(), data.cols()));
+    residual.resize(m_seq.FA.rows(), data.cols());
+    if (this->hasBatch()) {
+        Eigen::ArrayXXd blockOutputs;
+        Eigen::ArrayXd blockResidual;
+        for (int f = 0; f < m_seq.FA.rows(); f++) {
+            if (!this->apply_batch_internal(data.middleRows(f*np, np), B1 * m_seq.FA[f], m_seq.TR, m_seq.PhaseInc, blockOutputs, blockResidual)) {
+                return false;
+            }
+            for (size_t o = 0; o < this->numOutputs(); o++) {
+                params[o].row(f) = blockOutputs.row(o);
+            }
+            residual.row(f) = blockResidual.transpose();
+        }
+    } else {
+        Eigen::ArrayXXd voxelParams;
+        Eigen::ArrayXd voxelResidual;
+        for (Eigen::Index v = 0; v < data.cols(); v++) {
+            fit(data.col(v).cast<std::complex<float>>(), B1[v], voxelParams, voxelResidual);
+            for (size_t o = 0; o < this->numOutputs(); o++) {
+                params[o].col(v) = voxelParams.row(o).transpose();
+            }
+            residual.col(v) = voxelResidual;
+        }
+    }
+    return true;
+}
+
 bool EllipseAlgo::apply(const std::vector<TInput> &inputs,
                         const std::vector<TConst> &consts,
                         const TIndex &, // Unused
                         std::vector<TOutput> &outputs, TOutput &residual,
                         TInput &resids, TIterations &its) const
 {
-    const int np = m_seq.PhaseInc.rows();
-    const double B1 = consts[0];
+    const Eigen::Map<const Eigen::ArrayXcf> data(inputs[0].GetDataPointer(), inputs[0].Size());
+    Eigen::ArrayXXd params;
+    Eigen::ArrayXd voxelResidual;
+    fit(data, consts[0], params, voxelResidual);
     for (int f = 0; f < m_seq.FA.rows(); f++) {
-        Eigen::ArrayXcf data(np);
-        for (int i = 0; i < np; i++) {
-            data[i] = inputs[0][f*np + i];
-        }
-        if (m_debug) {
-            std::cout << "Flip: " << m_seq.FA[f] << " Data: " << data.transpose() << std::endl;
-        }
-        Eigen::ArrayXd tempOutputs = this->apply_internal(data, B1 * m_seq.FA[f], m_seq.TR, m_seq.PhaseInc, m_debug, residual[f]);
-        if (m_debug) {
-            std::cout << "Outputs: " << tempOutputs.transpose() << std::endl;
-        }
         for (int o = 0; o < this->numOutputs(); o++) {
-            outputs[o][f] = tempOutputs[o];
+            outputs[o][f] = params(o, f);
         }
+        residual[f] = voxelResidual[f];
+    }
+    return true;
+}
+
+bool EllipseAlgo::applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                             std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                             TResidsBlock &resids, TIterationsBlock &its) const
+{
+    const Eigen::ArrayXXcd data = inputs[0].cast<std::complex<double>>().array();
+    const Eigen::ArrayXd B1 = consts[0].cast<double>().transpose();
+    std::vector<Eigen::ArrayXXd> blockOutputs;
+    Eigen::ArrayXXd blockResidual;
+    if (!fitBlock(data, B1, blockOutputs, blockResidual)) {
+        return false;
+    }
+    for (int o = 0; o < this->numOutputs(); o++) {
+        outputs[o] = blockOutputs[o].cast<float>().matrix();
     }
+    residual = blockResidual.cast<float>().matrix();
     return true;
 }
 
-} // End namespace QI
\ No newline at end of file
+} // End namespace QI
@@ -34,6 +34,10 @@ protected:
     const QI::SSFPEllipseSequence &m_seq;
     TOutput m_zero;
     virtual Eigen::ArrayXd apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const = 0;
+    /* Algorithms that can fit a block of voxels at once override this and hasBatch(). Data is
+     * (phase increments x voxels) for one flip-angle, outputs are (5 x voxels). */
+    virtual bool apply_batch_internal(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &flip, const double TR, const Eigen::ArrayXd &phi,
+                                      Eigen::ArrayXXd &outputs, Eigen::ArrayXd &residual) const { return false; }
 public:
     EllipseAlgo(const QI::SSFPEllipseSequence &seq, bool debug);
 
@@ -51,10 +55,18 @@ public:
         return def;
     }
     TOutput zero() const override { return m_zero; }
+    // Fit every flip-angle of one voxel, params is (outputs x flip-angles)
+    void fit(const Eigen::ArrayXcf &data, const double B1, Eigen::ArrayXXd &params, Eigen::ArrayXd &residual) const;
+    // Fit a block of voxels, data is (size x voxels). One (flip-angles x voxels) array per output.
+    bool fitBlock(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &B1,
+                  std::vector<Eigen::ArrayXXd> &params, Eigen::ArrayXXd &residual) const;
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TOutput &residual,
                TInput &resids, TIterations &its) const override;
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override;
 };
 
 } // End namespace QI
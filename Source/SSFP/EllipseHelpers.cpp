@@ -65,4 +65,93 @@ void EllipseToMRI(const double a, const double b, const double c, const double t
     }
 }
 
+Eigen::ArrayXXd HyperEllipseFit(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &phi) {
+    typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+    const Eigen::Index np = data.rows();
+    const Eigen::Index nv = data.cols();
+    const Eigen::ArrayXd scale = data.abs().colwise().maxCoeff().transpose();
+    const Eigen::ArrayXXd x = data.real().rowwise() / scale.transpose();
+    const Eigen::ArrayXXd y = data.imag().rowwise() / scale.transpose();
+
+    // Columns of the design matrix, the scatter matrix S = D'D is then a sum over each pair
+    const Eigen::ArrayXXd D[6] = {x*x, 2*x*y, y*y, 2*x, 2*y, Eigen::ArrayXXd::Ones(np, nv)};
+    Eigen::ArrayXXd S(21, nv);
+    for (int i = 0, k = 0; i < 6; i++) {
+        for (int j = i; j < 6; j++, k++) {
+            S.row(k) = (D[i] * D[j]).colwise().sum();
+        }
+    }
+    // The per-voxel fit used sums rather than means for the constraint, and that is kept here
+    const Eigen::ArrayXd xc = x.colwise().sum().transpose();
+    const Eigen::ArrayXd yc = y.colwise().sum().transpose();
+    const Eigen::ArrayXd sx = x.square().colwise().sum().transpose();
+    const Eigen::ArrayXd sy = y.square().colwise().sum().transpose();
+    const Eigen::ArrayXd sxy = (x * y).colwise().sum().transpose();
+
+    Eigen::ArrayXXd Z(6, nv);
+    for (Eigen::Index v = 0; v < nv; v++) {
+        Matrix6d Sv;
+        for (int i = 0, k = 0; i < 6; i++) {
+            for (int j = i; j < 6; j++, k++) {
+                Sv(i, j) = Sv(j, i) = S(k, v);
+            }
+        }
+        // Hyper ellipse constraint
+        Matrix6d C;
+        C << 6*sx[v], 6*sxy[v], sx[v]+sy[v], 6*xc[v], 2*yc[v], 1,
+             6*sxy[v], 4*(sx[v]+sy[v]), 6*sxy[v], 4*yc[v], 4*xc[v], 0,
+             sx[v]+sy[v], 6*sxy[v], 6*sy[v], 2*xc[v], 6*yc[v], 1,
+             6*xc[v], 4*yc[v], 2*xc[v], 4, 0, 0,
+             2*yc[v], 4*xc[v], 6*yc[v], 0, 4, 0,
+             1, 0, 1, 0, 0, 0;
+        // Note S and C are swapped so we can use GES
+        Eigen::GeneralizedSelfAdjointEigenSolver<Matrix6d> solver(C, Sv);
+        if (fabs(solver.eigenvalues()[5]) > fabs(solver.eigenvalues()[0]))
+            Z.col(v) = solver.eigenvectors().col(5);
+        else
+            Z.col(v) = solver.eigenvectors().col(0);
+    }
+
+    // Everything from here is element-wise across the voxels
+    const Eigen::ArrayXd Z0 = Z.row(0).transpose(), Z1 = Z.row(1).transpose(), Z2 = Z.row(2).transpose(),
+                         Z3 = Z.row(3).transpose(), Z4 = Z.row(4).transpose(), Z5 = Z.row(5).transpose();
+    const Eigen::ArrayXd dsc = Z1*Z1 - Z0*Z2;
+    const Eigen::ArrayXd ex = (Z2*Z3 - Z1*Z4) / dsc;
+    const Eigen::ArrayXd ey = (Z0*Z4 - Z1*Z3) / dsc;
+    const Eigen::ArrayXd theta_te = ey.binaryExpr(ex, [](double a, double b) { return atan2(a, b); });
+    const Eigen::ArrayXd num = 2*(Z0*Z4*Z4 + Z2*Z3*Z3 + Z5*Z1*Z1 - 2*Z1*Z3*Z4 - Z0*Z2*Z5);
+    const Eigen::ArrayXd root = ((Z0 - Z2).square() + 4*Z1*Z1).sqrt();
+    const Eigen::ArrayXd semi1 = (num / (dsc * (root - (Z0 + Z2)))).sqrt();
+    const Eigen::ArrayXd semi2 = (num / (dsc * (-root - (Z0 + Z2)))).sqrt();
+    const Eigen::ArrayXd A = (semi1 > semi2).select(semi2, semi1);
+    const Eigen::ArrayXd B = (semi1 > semi2).select(semi1, semi2);
+    const Eigen::ArrayXd c = (ex*ex + ey*ey).sqrt();
+    // SemiaxesToHoff
+    const Eigen::ArrayXd b = (-c*A + (c*c*A*A - (c*c + B*B)*(A*A - B*B)).sqrt()) / (c*c + B*B);
+    const Eigen::ArrayXd a = B / (b*B + c*(1 - b*b).sqrt());
+    const Eigen::ArrayXd G = c*(1 - b*b) / (1 - a*b);
+
+    /* Calculate theta_tr, i.e. drop RF phase, eddy currents etc. */
+    /* First, center, rotate back to vertical and get 't' parameter */
+    const Eigen::ArrayXXd vert = x.rowwise() * theta_te.cos().transpose() + y.rowwise() * theta_te.sin().transpose();
+    const Eigen::ArrayXXd ct = (vert.rowwise() - c.transpose()).rowwise() / A.transpose();
+    const Eigen::MatrixXd rhs = ((ct.rowwise() - b.transpose()) / ((ct.rowwise() * b.transpose()) - 1)).matrix();
+    // The phase increments are the same for every voxel, so one decomposition solves them all
+    Eigen::MatrixXd lhs(np, 2);
+    lhs.col(0) = cos(phi);
+    lhs.col(1) = sin(phi);
+    const Eigen::ArrayXXd K = Eigen::ColPivHouseholderQR<Eigen::MatrixXd>(lhs).solve(rhs).array();
+    const Eigen::ArrayXd theta_0 = K.row(1).transpose().binaryExpr(K.row(0).transpose(), [](double a, double b) { return atan2(a, b); });
+    const Eigen::ArrayXd dpsi = theta_te - theta_0 / 2;
+    const Eigen::ArrayXd psi_0 = dpsi.sin().binaryExpr(dpsi.cos(), [](double a, double b) { return atan2(a, b); });
+
+    Eigen::ArrayXXd outputs(5, nv);
+    outputs.row(0) = (G * scale).transpose();
+    outputs.row(1) = a.transpose();
+    outputs.row(2) = b.transpose();
+    outputs.row(3) = theta_0.transpose();
+    outputs.row(4) = psi_0.transpose();
+    return outputs;
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -29,6 +29,14 @@ void SemiaxesToHoff(const double A, const double B, const double c,
 void EllipseToMRI(const double a, const double b, const double c, const double th, const double TR, const double flip,
                   float &M0, float &T1, float &T2, float &df0, const bool debug = false);
 
+/*
+ * Closed-form hyper-ellipse fit to many voxels at once. Data is (phase increments x voxels), the
+ * result is (5 x voxels) with rows G, a, b, theta_0 and psi_0. Everything except the 6x6
+ * eigenproblem is done with whole-block array operations, and that only needs fixed-size
+ * matrices, so a block of voxels costs much less than fitting them one at a time.
+ */
+Eigen::ArrayXXd HyperEllipseFit(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &phi);
+
 /*
  * Convert the SSFP Ellipse parameters into a magnetization. Needs to be a template function for
  * automatic differentation in Ceres. For the same reason, return real and imaginary parts in
@@ -0,0 +1,69 @@
+/*
+ *  EllipseMTAlgo.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "EllipseMTAlgo.h"
+
+namespace QI {
+
+EllipseMTAlgo::EllipseMTAlgo(const std::shared_ptr<const EllipseAlgo> &e, const std::shared_ptr<const MTFromEllipse> &mt) :
+    m_ellipse(e), m_mt(mt)
+{}
+
+bool EllipseMTAlgo::apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+                          const TIndex &, // Unused
+                          std::vector<TOutput> &outputs, TOutput &residual,
+                          TInput &, TIterations &) const
+{
+    const Eigen::Map<const Eigen::ArrayXcf> data(inputs[0].GetDataPointer(), inputs[0].Size());
+    Eigen::ArrayXXd ellipse;
+    Eigen::ArrayXd ellipseResidual;
+    m_ellipse->fit(data, consts[0], ellipse, ellipseResidual);
+    Eigen::ArrayXd p(numOutputs());
+    double cost = 0;
+    // Rows of the ellipse parameters are G, a, b, theta_0 and phi_rf
+    if (!m_mt->fit(ellipse.row(0).transpose(), ellipse.row(1).transpose(), ellipse.row(2).transpose(), consts[0], consts[1], p, cost)) {
+        return false;
+    }
+    for (size_t i = 0; i < numOutputs(); i++) {
+        outputs[i] = p[i];
+    }
+    residual = cost;
+    return true;
+}
+
+bool EllipseMTAlgo::applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                               std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                               TResidsBlock &, TIterationsBlock &) const
+{
+    const Eigen::ArrayXXcd data = inputs[0].cast<std::complex<double>>().array();
+    const Eigen::ArrayXd B1 = consts[0].cast<double>().transpose();
+    std::vector<Eigen::ArrayXXd> ellipse;
+    Eigen::ArrayXXd ellipseResidual;
+    if (!m_ellipse->fitBlock(data, B1, ellipse, ellipseResidual)) {
+        return false;
+    }
+    Eigen::ArrayXd p(numOutputs());
+    double cost = 0;
+    bool success = true;
+    for (Eigen::Index v = 0; v < data.cols(); v++) {
+        if (m_mt->fit(ellipse[0].col(v), ellipse[1].col(v), ellipse[2].col(v), B1[v], consts[1][v], p, cost)) {
+            for (size_t i = 0; i < numOutputs(); i++) {
+                outputs[i](0, v) = p[i];
+            }
+            residual(0, v) = cost;
+        } else {
+            success = false;
+        }
+    }
+    return success;
+}
+
+} // End namespace QI
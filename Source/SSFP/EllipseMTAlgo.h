@@ -0,0 +1,53 @@
+/*
+ *  EllipseMTAlgo.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ELLIPSE_MT_ALGO_H
+#define QI_ELLIPSE_MT_ALGO_H
+
+#include <memory>
+#include "ApplyTypes.h"
+#include "EllipseAlgo.h"
+#include "MTFromEllipse.h"
+
+namespace QI {
+
+/*
+ * The ellipse fit and the MT fit in one pass over complex SSFP data. The ellipse parameters of
+ * each block of voxels are handed straight to the MT fit, instead of going through G, a and b
+ * images on disk. Outputs are those of MTFromEllipse, the residual is the MT fit's.
+ */
+class EllipseMTAlgo : public QI::ApplyXF::Algorithm {
+protected:
+    const std::shared_ptr<const EllipseAlgo> m_ellipse;
+    const std::shared_ptr<const MTFromEllipse> m_mt;
+
+public:
+    EllipseMTAlgo(const std::shared_ptr<const EllipseAlgo> &e, const std::shared_ptr<const MTFromEllipse> &mt);
+    size_t numInputs() const override { return 1; }
+    size_t numConsts() const override { return 2; }
+    size_t numOutputs() const override { return MTFromEllipse::NumOutputs; }
+    size_t dataSize() const override { return m_ellipse->dataSize(); }
+    const std::vector<std::string> &names() const { return m_mt->names(); }
+    std::vector<float> defaultConsts() const override { return m_mt->defaultConsts(); } // B1, f0
+    TOutput zero() const override { return 0.f; }
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TOutput &residual,
+               TInput &resids, TIterations &its) const override;
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override;
+};
+
+} // End namespace QI
+
+#endif // QI_ELLIPSE_MT_ALGO_H
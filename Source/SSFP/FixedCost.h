@@ -0,0 +1,41 @@
+/*
+ *  FixedCost.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_SSFP_FIXEDCOST_H
+#define QI_SSFP_FIXEDCOST_H
+
+#include "ceres/ceres.h"
+
+namespace QI {
+
+/*
+ * An autodiff cost function for a functor with one block of NP parameters, which takes
+ * operator()(const T *p, T *residuals). The parameter count sets the size of the Jets, so fixing
+ * it avoids the dynamically sized ones. The residual count comes from the sequence, the common
+ * ones are dispatched to fixed sizes as well and anything else is left dynamic.
+ */
+template<typename TFunctor, int NP>
+ceres::CostFunction *FixedAutoDiffCost(TFunctor *f, const int nResiduals) {
+    switch (nResiduals) {
+    case 4:  return new ceres::AutoDiffCostFunction<TFunctor, 4, NP>(f);
+    case 6:  return new ceres::AutoDiffCostFunction<TFunctor, 6, NP>(f);
+    case 8:  return new ceres::AutoDiffCostFunction<TFunctor, 8, NP>(f);
+    case 10: return new ceres::AutoDiffCostFunction<TFunctor, 10, NP>(f);
+    case 12: return new ceres::AutoDiffCostFunction<TFunctor, 12, NP>(f);
+    case 16: return new ceres::AutoDiffCostFunction<TFunctor, 16, NP>(f);
+    case 24: return new ceres::AutoDiffCostFunction<TFunctor, 24, NP>(f);
+    default: return new ceres::AutoDiffCostFunction<TFunctor, ceres::DYNAMIC, NP>(f, nResiduals);
+    }
+}
+
+} // End namespace QI
+
+#endif // QI_SSFP_FIXEDCOST_H
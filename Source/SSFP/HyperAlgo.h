@@ -20,8 +20,11 @@ namespace QI {
 class HyperAlgo : public EllipseAlgo {
 protected:
     Eigen::ArrayXd apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const override;
+    bool apply_batch_internal(const Eigen::ArrayXXcd &data, const Eigen::ArrayXd &flip, const double TR, const Eigen::ArrayXd &phi,
+                              Eigen::ArrayXXd &outputs, Eigen::ArrayXd &residual) const override;
 public:
     HyperAlgo(const QI::SSFPEllipseSequence &seq, bool debug) : EllipseAlgo(seq, debug) {};
+    bool hasBatch() const override { return !m_debug; } // Debug output is per voxel
 };
 
 } // End namespace QI
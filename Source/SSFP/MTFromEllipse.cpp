@@ -12,8 +12,9 @@
 #include <iostream>
 #include <vector>
 #include <Eigen/Dense>
-#include "ceres/ceres.h"
 #include "MTFromEllipse.h"
+#include "FixedCost.h"
+#include "Trace.h"
 
 namespace QI {
 
@@ -21,24 +22,24 @@ struct EMTCost {
 public:
     const Eigen::ArrayXd &G;
     const Eigen::ArrayXd &b;
-    const Eigen::ArrayXd flip;
-    const Eigen::ArrayXd int_omega2;
+    const Eigen::ArrayXd &flip;
+    const Eigen::ArrayXd &int_omega2;
     const Eigen::ArrayXd &TR;
     const Eigen::ArrayXd &Trf;
     const double T2r;
-    const double T2f;
-    const double f0_Hz;
+    const double &T2f;
+    const double &f0_Hz;
     const bool debug;
 
     template<typename T>
-    bool operator() (T const* const* p, T* resids) const {
+    bool operator() (const T *p, T *resids) const {
         typedef Eigen::Array<T, Eigen::Dynamic, 1> ArrayXT;
-        const T &M0  = p[0][0];
-        const T &F   = p[0][1];
-        const T &kf  = p[0][2];
-        const T &T1f = p[0][3];
-        const T &T1r = T1f; //p[0][3];
-        //const double &T2r = 12.0e-6; //p[0][4];
+        const T &M0  = p[0];
+        const T &F   = p[1];
+        const T &kf  = p[2];
+        const T &T1f = p[3];
+        const T &T1r = T1f; //p[3];
+        //const double &T2r = 12.0e-6; //p[4];
 
         const ArrayXT E1f = (-TR/T1f).exp();
         const Eigen::ArrayXd E2f = (-TR/T2f).exp();
@@ -72,8 +73,42 @@ public:
     }
 };
 
+/*
+ * Each thread builds the problem once, with the cost reading the voxel's ellipse parameters,
+ * B1-scaled pulses and f0 from here. Only those and the start are reloaded for each voxel.
+ */
+struct MTFromEllipse::Context {
+    Eigen::ArrayXd G, b, flip, int_omega2;
+    double T2f = 0, f0_Hz = 0;
+    Eigen::Array<double, 4, 1> p;
+    ceres::Problem problem;
+    ceres::Solver::Options options;
+
+    Context(const QI::SSFPMTSequence &seq, const double T2r, const bool debug) :
+        G(seq.FA.rows()), b(seq.FA.rows()), flip(seq.FA.rows()), int_omega2(seq.FA.rows())
+    {
+        problem.AddResidualBlock(FixedAutoDiffCost<EMTCost, 4>(new EMTCost{G, b, flip, int_omega2, seq.TR, seq.Trf, T2r, T2f, f0_Hz, debug}, G.size() + b.size()),
+                                 new ceres::HuberLoss(1.0), p.data());
+        problem.SetParameterLowerBound(p.data(), 0, 0.1);
+        problem.SetParameterUpperBound(p.data(), 0, 20.0);
+        problem.SetParameterLowerBound(p.data(), 1, 1e-6);
+        problem.SetParameterUpperBound(p.data(), 1, 0.2 - 1e-6);
+        problem.SetParameterLowerBound(p.data(), 2, 0.1);
+        problem.SetParameterUpperBound(p.data(), 2, 10.0);
+        problem.SetParameterLowerBound(p.data(), 3, 0.5);
+        problem.SetParameterUpperBound(p.data(), 3, 5.0);
+        options.max_num_iterations = 100;
+        options.function_tolerance = 1e-7;
+        options.gradient_tolerance = 1e-8;
+        options.parameter_tolerance = 1e-6;
+        if (!debug && !QI::SolverTrace()) options.logging_type = ceres::SILENT;
+        options.minimizer_progress_to_stdout = QI::SolverTrace();
+    }
+};
+
 MTFromEllipse::MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d) :
-    m_seq(s), T2r(T2), debug(d)
+    m_seq(s), T2r(T2), debug(d),
+    m_contexts(std::make_shared<PerThread<Context>>([this]{ return new Context(m_seq, T2r, debug); }))
 {
 }
 
@@ -83,54 +118,34 @@ std::vector<float> MTFromEllipse::defaultConsts() const {
     return def;
 }
 
-bool MTFromEllipse::apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-                          const TIndex &, // Unused
-                          std::vector<TOutput> &outputs, TConst &residual,
-                          TInput &resids, TIterations &its) const
+bool MTFromEllipse::fit(const Eigen::ArrayXd &in_G, const Eigen::ArrayXd &a, const Eigen::ArrayXd &in_b,
+                        const double B1, const double f0_Hz,
+                        Eigen::Ref<Eigen::ArrayXd> outputs, double &residual, Eigen::ArrayXd *resids) const
 {
-    const double B1 = consts[0];
-    const double f0_Hz = consts[1];
-
-    Eigen::Map<const Eigen::ArrayXf> in_G(inputs[0].GetDataPointer(), inputs[0].Size());
-    Eigen::Map<const Eigen::ArrayXf> in_a(inputs[1].GetDataPointer(), inputs[1].Size());
-    Eigen::Map<const Eigen::ArrayXf> in_b(inputs[2].GetDataPointer(), inputs[2].Size());
-
+    Context &ctx = m_contexts->get();
     const double scale = in_G.mean();
-    Eigen::ArrayXd G = in_G.cast<double>() / scale;
-    Eigen::ArrayXd a = in_a.cast<double>();
-    Eigen::ArrayXd b = in_b.cast<double>();
+    const Eigen::ArrayXd &G = ctx.G = in_G / scale;
+    const Eigen::ArrayXd &b = ctx.b = in_b;
     Eigen::ArrayXd T2fs = (-m_seq.TR / a.log());
-    const double T2f = T2fs.mean(); // Different TRs so have to average afterwards
+    const double T2f = ctx.T2f = T2fs.mean(); // Different TRs so have to average afterwards
+    ctx.f0_Hz = f0_Hz;
+    ctx.flip = m_seq.FA * B1;
+    ctx.int_omega2 = m_seq.intB1 * B1 * B1;
 
-    auto *cost = new ceres::DynamicAutoDiffCostFunction<EMTCost>(new EMTCost{G, b, m_seq.FA*B1, m_seq.intB1*B1*B1, m_seq.TR, m_seq.Trf, T2r, T2f, f0_Hz, debug});
-    cost->AddParameterBlock(4);
-    cost->SetNumResiduals(G.size() + b.size());
-    ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-    Eigen::Array<double, 4, 1> p; p << 15.0, 0.01, 5.0, 1.0;
-    ceres::Problem problem;
-    problem.AddResidualBlock(cost, loss, p.data());
-    problem.SetParameterLowerBound(p.data(), 0, 0.1);
-    problem.SetParameterUpperBound(p.data(), 0, 20.0);
-    problem.SetParameterLowerBound(p.data(), 1, 1e-6);
-    problem.SetParameterUpperBound(p.data(), 1, 0.2 - 1e-6);
-    problem.SetParameterLowerBound(p.data(), 2, 0.1);
-    problem.SetParameterUpperBound(p.data(), 2, 10.0);
-    problem.SetParameterLowerBound(p.data(), 3, 0.5);
-    problem.SetParameterUpperBound(p.data(), 3, 5.0);
-    ceres::Solver::Options options;
+    Eigen::Array<double, 4, 1> &p = ctx.p;
+    p << 15.0, 0.01, 5.0, 1.0;
+    ceres::Problem &problem = ctx.problem;
     ceres::Solver::Summary summary;
-    options.max_num_iterations = 100;
-    options.function_tolerance = 1e-7;
-    options.gradient_tolerance = 1e-8;
-    options.parameter_tolerance = 1e-6;
-    if (!debug) options.logging_type = ceres::SILENT;
-    ceres::Solve(options, &problem, &summary);
+    ceres::Solve(ctx.options, &problem, &summary);
     if (!summary.IsSolutionUsable()) {
-        std::cerr << summary.FullReport() << std::endl;
-        std::cerr << "Parameters: " << p.transpose() << " T2f: " << T2f << " B1: " << B1 << std::endl;
-        std::cerr << "G: " << G.transpose() << std::endl;
-        std::cerr << "a: " << a.transpose() << std::endl;
-        std::cerr << "b: " << b.transpose() << std::endl;
+        // The filter counts failures, only dump the details when asked
+        if (debug) {
+            std::cerr << summary.FullReport() << std::endl;
+            std::cerr << "Parameters: " << p.transpose() << " T2f: " << T2f << " B1: " << B1 << std::endl;
+            std::cerr << "G: " << G.transpose() << std::endl;
+            std::cerr << "a: " << a.transpose() << std::endl;
+            std::cerr << "b: " << b.transpose() << std::endl;
+        }
         return false;
     } else if (debug) {
         std::cout << summary.FullReport() << std::endl;
@@ -141,21 +156,48 @@ bool MTFromEllipse::apply(const std::vector<TInput> &inputs, const std::vector<T
     outputs[3] = p[3];
     outputs[4] = T2f;
     residual = summary.final_cost;
-    if (resids.Size() > 0) {
-        assert(resids.Size() == data.size());
-        std::vector<double> r_temp(G.size() + a.size() + b.size());
+    if (resids) {
+        std::vector<double> r_temp;
         problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
+        resids->resize(G.size() + a.size() + b.size());
         for (int i = 0; i < G.size(); i++)
-            resids[i] = r_temp[i];
+            (*resids)[i] = r_temp[i];
         Eigen::ArrayXd as = (-m_seq.TR / T2f).exp();
         for (int i = 0; i < a.size(); i++) {
-            resids[i + G.size()] = as[i] - a[i];
+            (*resids)[i + G.size()] = as[i] - a[i];
         }
         for (int i = 0; i < b.size(); i++) {
-            resids[i + G.size() + a.size()] = r_temp[i + G.size()];
+            (*resids)[i + G.size() + a.size()] = r_temp[i + G.size()];
+        }
+    }
+    return true;
+}
+
+bool MTFromEllipse::apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+                          const TIndex &, // Unused
+                          std::vector<TOutput> &outputs, TConst &residual,
+                          TInput &resids, TIterations &its) const
+{
+    Eigen::Map<const Eigen::ArrayXf> in_G(inputs[0].GetDataPointer(), inputs[0].Size());
+    Eigen::Map<const Eigen::ArrayXf> in_a(inputs[1].GetDataPointer(), inputs[1].Size());
+    Eigen::Map<const Eigen::ArrayXf> in_b(inputs[2].GetDataPointer(), inputs[2].Size());
+    Eigen::ArrayXd p(NumOutputs), r;
+    double cost = 0;
+    if (!fit(in_G.cast<double>(), in_a.cast<double>(), in_b.cast<double>(), consts[0], consts[1],
+             p, cost, (resids.Size() > 0) ? &r : nullptr)) {
+        return false;
+    }
+    for (size_t i = 0; i < NumOutputs; i++) {
+        outputs[i] = p[i];
+    }
+    residual = cost;
+    if (resids.Size() > 0) {
+        assert(resids.Size() == r.size());
+        for (int i = 0; i < r.size(); i++) {
+            resids[i] = r[i];
         }
     }
     return true;
 }
 
-} // End namespace QI
\ No newline at end of file
+} // End namespace QI
@@ -12,8 +12,10 @@
 #ifndef QI_ELLIPSE_MTFROMELLIPSE_H
 #define QI_ELLIPSE_MTFROMELLIPSE_H
 
+#include <memory>
 #include "ApplyTypes.h"
 #include "SSFPSequence.h"
+#include "Fit.h"
 
 namespace QI {
 
@@ -24,6 +26,8 @@ protected:
     const QI::SSFPMTSequence &m_seq;
     const double T2r;
     const bool debug;
+    struct Context; // Per-thread problem, so the header does not need Ceres
+    std::shared_ptr<PerThread<Context>> m_contexts;
 public:
     MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d);
     size_t numInputs() const override { return 3; }
@@ -36,6 +40,9 @@ public:
     }
     std::vector<float> defaultConsts() const override;
     TOutput zero() const override { return 0.f; }
+    // The fit for one voxel's ellipse parameters, one per flip-angle. resids are G, a then b if not null.
+    bool fit(const Eigen::ArrayXd &G, const Eigen::ArrayXd &a, const Eigen::ArrayXd &b, const double B1, const double f0_Hz,
+             Eigen::Ref<Eigen::ArrayXd> outputs, double &residual, Eigen::ArrayXd *resids = nullptr) const;
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &, // Unused
                std::vector<TOutput> &outputs, TConst &residual,
@@ -222,7 +222,6 @@ int main(int argc, char **argv) {
     if (mask) pass1->SetMask(QI::ReadImage(mask.Get()));
     pass1->SetInput(0, inFile);
     pass1->SetPoolsize(num_threads.Get());
-    pass1->SetSplitsPerThread(num_threads.Get()); // Unbalanced algorithm
     pass1->SetVerbose(verbose);
     if (verbose) {
         std::cout << "1st pass" << std::endl;
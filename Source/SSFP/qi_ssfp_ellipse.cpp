@@ -16,6 +16,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "WriteQueue.h"
 #include "Args.h"
 #include "DirectAlgo.h"
 #include "HyperAlgo.h"
@@ -34,11 +35,12 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
-    args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (h)yper/(d)irect, default d", {'a', "algo"}, 'd');
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
     if (verbose) std::cout << "Opening file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto data = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(ssfp_path));
+    auto data = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(ssfp_path), subregion.region());
     auto seq = QI::ReadSequence<QI::SSFPEllipseSequence>(std::cin, verbose);
     std::shared_ptr<QI::EllipseAlgo> algo;
     switch (algorithm.Get()) {
@@ -48,36 +50,47 @@ int main(int argc, char **argv) {
     QI::ApplyVectorXFVectorF::Pointer apply = QI::ApplyVectorXFVectorF::New();
     apply->SetAlgorithm(algo);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()*2);
     apply->SetInput(0, data);
     if (mask) {
         if (verbose) std::cout << "Reading mask: " << mask.Get() << std::endl;
-        apply->SetMask(QI::ReadImage(mask.Get()));
+        apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
     }
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
+    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get(), subregion.region()));
     apply->SetVerbose(verbose);
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
+    apply->SetOutputResidual(true);
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
         std::cout << "Writing results files." << std::endl;
     }
     std::string outPrefix;
     outPrefix = outarg.Get() + "ES_";
+    QI::WriteQueue writes;
     for (int i = 0; i < algo->numOutputs(); i++) {
         std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
         if (verbose) std::cout << "Writing: " << outName << std::endl;
-        QI::WriteVectorImage(apply->GetOutput(i), outName);
+        writes.WriteVectorImage(apply->GetOutput(i), outName);
     }
     if (verbose) std::cout << "Writing total residuals." << std::endl;
-    QI::WriteVectorImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    writes.WriteVectorImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    if (checkpoint.failures) {
+        writes.WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
+    writes.wait();
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
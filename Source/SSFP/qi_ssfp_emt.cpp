@@ -17,11 +17,62 @@
 #include "IO.h"
 #include "Args.h"
 #include "MTFromEllipse.h"
+#include "DirectAlgo.h"
+#include "HyperAlgo.h"
+#include "EllipseMTAlgo.h"
 #include "SequenceCereal.h"
 
+/*
+ * Everything after the inputs is the same for the MT fit alone and the pipelined fit, which only
+ * differ in the input type of the filter.
+ */
+template<typename TApply>
+int Process(TApply &apply, const std::vector<std::string> &names, const std::string &prefix,
+            QI::CheckpointArgs &checkpoint, QI::SubregionArgs &subregion, const bool all_residuals, const bool verbose)
+{
+    apply->SetVerbose(verbose);
+    apply->SetOutputResidual(true);
+    subregion.Apply(apply);
+    if (verbose) {
+        std::cout << "Processing" << std::endl;
+        auto monitor = QI::GenericMonitor::New();
+        apply->AddObserver(itk::ProgressEvent(), monitor);
+    }
+    checkpoint.Apply(apply, prefix);
+    apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (verbose) {
+        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+        std::cout << "Writing results files." << std::endl;
+    }
+    std::string outPrefix = prefix + "EMT_";
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string outName = outPrefix + names.at(i) + QI::OutExt();
+        if (verbose) std::cout << "Writing: " << outName << std::endl;
+        QI::WriteImage(apply->GetOutput(i), outName);
+    }
+    if (verbose) std::cout << "Writing total residual." << std::endl;
+    QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    if (all_residuals) {
+        if (verbose) std::cout << "Writing individual residuals." << std::endl;
+        QI::WriteVectorImage(apply->GetAllResidualsOutput(), outPrefix + "all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
     Eigen::initParallel();
-    args::ArgumentParser parser("Calculates qMT parameters from ellipse parameters.\nInputs are G, a, b.\nhttp://github.com/spinicist/QUIT");
+    args::ArgumentParser parser("Calculates qMT parameters from ellipse parameters.\nInputs are G, a, b, or the complex SSFP data with --ssfp.\nhttp://github.com/spinicist/QUIT");
     
     args::Positional<std::string> G_path(parser, "G_FILE", "Input G file");
     args::Positional<std::string> a_path(parser, "a_FILE", "Input a file");
@@ -35,16 +86,12 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<std::string> f0(parser, "f0", "f0 map (in Hertz)", {'f', "f0"});
     args::ValueFlag<double> T2r_us(parser, "T2r", "T2r (in microseconds, default 12)", {"T2r"}, 12);
-    args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
     args::Flag     all_residuals(parser, "RESIDUALS", "Write out all residuals", {'r',"all_resids"});
+    args::ValueFlag<std::string> ssfp_path(parser, "SSFP", "Fit the ellipses of this complex SSFP file on the way, instead of reading G, a, b", {"ssfp"});
+    args::ValueFlag<char> ellipse_algo(parser, "ALGO", "Ellipse algorithm for --ssfp, (h)yper/(d)irect, default d", {"ellipse-algo"}, 'd');
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(G_path) << std::endl;
-    auto G = QI::ReadVectorImage<float>(QI::CheckPos(G_path));
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(a_path) << std::endl;
-    auto a = QI::ReadVectorImage<float>(QI::CheckPos(a_path));
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(b_path) << std::endl;
-    auto b = QI::ReadVectorImage<float>(QI::CheckPos(b_path));
-
     cereal::JSONInputArchive input(std::cin);
     auto seq = QI::ReadSequence<QI::SSFPMTSequence>(input, verbose);
     if (verbose) {
@@ -52,45 +99,50 @@ int main(int argc, char **argv) {
     }
     auto algo = std::make_shared<QI::MTFromEllipse>(seq, T2r_us.Get() * 1e-6, debug);
 
+    if (ssfp_path) {
+        if (all_residuals) {
+            QI_FAIL("Writing all residuals is not supported with --ssfp");
+        }
+        if ((seq.TR != seq.TR[0]).any()) {
+            QI_FAIL("--ssfp needs the same TR for every flip-angle, use qi_ssfp_ellipse first instead");
+        }
+        QI::SSFPEllipseSequence ellipse_seq;
+        ellipse_seq.TR = seq.TR[0];
+        ellipse_seq.FA = seq.FA;
+        ellipse_seq.PhaseInc = seq.PhaseInc;
+        std::shared_ptr<QI::EllipseAlgo> ellipse;
+        switch (ellipse_algo.Get()) {
+        case 'h': ellipse = std::make_shared<QI::HyperAlgo>(ellipse_seq, debug); break;
+        case 'd': ellipse = std::make_shared<QI::DirectAlgo>(ellipse_seq, debug); break;
+        default: QI_FAIL("Unknown ellipse algorithm: " << ellipse_algo.Get());
+        }
+        if (verbose) std::cout << "Opening file: " << ssfp_path.Get() << std::endl;
+        auto data = QI::ReadVectorImage<std::complex<float>>(ssfp_path.Get(), subregion.region());
+        auto apply = QI::ApplyXF::New();
+        apply->SetAlgorithm(std::make_shared<QI::EllipseMTAlgo>(ellipse, algo));
+        apply->SetPoolsize(threads.Get());
+        apply->SetInput(0, data);
+        if (B1) apply->SetConst(0, QI::ReadImage(B1.Get(), subregion.region()));
+        if (f0) apply->SetConst(1, QI::ReadImage(f0.Get(), subregion.region()));
+        if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+        return Process(apply, algo->names(), outarg.Get(), checkpoint, subregion, false, verbose);
+    }
+
+    if (verbose) std::cout << "Opening file: " << QI::CheckPos(G_path) << std::endl;
+    auto G = QI::ReadVectorImage<float>(QI::CheckPos(G_path), subregion.region());
+    if (verbose) std::cout << "Opening file: " << QI::CheckPos(a_path) << std::endl;
+    auto a = QI::ReadVectorImage<float>(QI::CheckPos(a_path), subregion.region());
+    if (verbose) std::cout << "Opening file: " << QI::CheckPos(b_path) << std::endl;
+    auto b = QI::ReadVectorImage<float>(QI::CheckPos(b_path), subregion.region());
     auto apply = QI::ApplyF::New();
     apply->SetAlgorithm(algo);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()*2);
     apply->SetOutputAllResiduals(all_residuals);
     apply->SetInput(0, G);
     apply->SetInput(1, a);
     apply->SetInput(2, b);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (f0) apply->SetConst(1, QI::ReadImage(f0.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-
-    apply->SetVerbose(verbose);
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string outPrefix = outarg.Get() + "EMT_";
-    for (int i = 0; i < algo->numOutputs(); i++) {
-        std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
-        if (verbose) std::cout << "Writing: " << outName << std::endl;
-        QI::WriteImage(apply->GetOutput(i), outName);
-    }
-    if (verbose) std::cout << "Writing total residual." << std::endl;
-    QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
-    if (all_residuals) {
-        if (verbose) std::cout << "Writing individual residuals." << std::endl;
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), outPrefix + "all_residuals" + QI::OutExt());
-    }
-
-    if (verbose) std::cout << "Finished." << std::endl;
-    return EXIT_SUCCESS;
+    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get(), subregion.region()));
+    if (f0) apply->SetConst(1, QI::ReadImage(f0.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    return Process(apply, algo->names(), outarg.Get(), checkpoint, subregion, all_residuals, verbose);
 }
@@ -44,6 +44,23 @@ struct PLANET : public QI::ApplyVectorF::Algorithm {
     }
     PLANET(const QI::SSFPGSSequence &s) : m_seq(s) {}
 
+    /*
+     * The conversion is closed-form, so work on (flip-angles x voxels) arrays. A single voxel is
+     * then just a block with one column.
+     */
+    void convert(const Eigen::ArrayXXf &G, const Eigen::ArrayXXf &a, const Eigen::ArrayXXf &b, const Eigen::ArrayXf &b1,
+                 Eigen::ArrayXXf &T1, Eigen::ArrayXXf &T2, Eigen::ArrayXXf &PD) const
+    {
+        const Eigen::ArrayXXf flip = m_seq.FA.cast<float>().matrix() * b1.matrix().transpose();
+        const Eigen::ArrayXXf cosa = flip.cos();
+        const Eigen::ArrayXXf sina = flip.sin();
+        T1 = -m_seq.TR / ((a*(1. + cosa - a*b*cosa) - b)/(a*(1. + cosa - a*b) - b*cosa)).log();
+        T2 = -m_seq.TR / a.log();
+        const Eigen::ArrayXXf E1 = (-m_seq.TR / T1).exp();
+        const Eigen::ArrayXXf &E2 = a; // For simplicity copying formulas
+        PD = G * (1. - E1*cosa - E2*E2*(E1 - cosa)) / (E2.sqrt()*(1. - E1)*sina);
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
                const TIndex &/*Unused*/,
                std::vector<TOutput> &outputs, TOutput &/*Unused*/,
@@ -52,21 +69,28 @@ struct PLANET : public QI::ApplyVectorF::Algorithm {
         Eigen::Map<const Eigen::ArrayXf> G(inputs[0].GetDataPointer(), inputs[0].Size());
         Eigen::Map<const Eigen::ArrayXf> a(inputs[1].GetDataPointer(), inputs[0].Size());
         Eigen::Map<const Eigen::ArrayXf> b(inputs[2].GetDataPointer(), inputs[0].Size());
-        const float b1 = consts[0];
-        const Eigen::ArrayXf cosa = cos(b1 * m_seq.FA.cast<float>());
-        const Eigen::ArrayXf sina = sin(b1 * m_seq.FA.cast<float>());
-        const Eigen::ArrayXf T1 = -m_seq.TR / log((a*(1. + cosa - a*b*cosa) - b)/(a*(1. + cosa - a*b) - b*cosa));
-        const Eigen::ArrayXf T2 = -m_seq.TR / log(a);
-        const Eigen::ArrayXf E1 = exp(-m_seq.TR / T1);
-        const Eigen::ArrayXf E2 = a; // For simplicity copying formulas
-        const Eigen::ArrayXf PD = G * (1. - E1*cosa - E2*E2*(E1 - cosa)) / (sqrt(E2)*(1. - E1)*sina);
+        Eigen::ArrayXXf T1, T2, PD;
+        convert(G, a, b, Eigen::ArrayXf::Constant(1, consts[0]), T1, T2, PD);
         for (int i = 0; i < m_seq.FA.rows(); i++) {
-            outputs[0][i] = T1[i];
-            outputs[1][i] = T2[i];
-            outputs[2][i] = PD[i];
+            outputs[0][i] = T1(i, 0);
+            outputs[1][i] = T2(i, 0);
+            outputs[2][i] = PD(i, 0);
         }
         return true;
     }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &/*Unused*/,
+                    TResidsBlock &/*Unused*/, TIterationsBlock &/*Unused*/) const override
+    {
+        Eigen::ArrayXXf T1, T2, PD;
+        convert(inputs[0].array(), inputs[1].array(), inputs[2].array(), consts[0].transpose(), T1, T2, PD);
+        outputs[0] = T1.matrix();
+        outputs[1] = T2.matrix();
+        outputs[2] = PD.matrix();
+        return true;
+    }
 };
 
 int main(int argc, char **argv) {
@@ -81,15 +105,16 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> out_prefix(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
     if (verbose) std::cout << "Opening G: " << QI::CheckPos(G_filename) << std::endl;
-    auto G = QI::ReadVectorImage(QI::CheckPos(G_filename));
+    auto G = QI::ReadVectorImage(QI::CheckPos(G_filename), subregion.region());
     if (verbose) std::cout << "Opening a: " << QI::CheckPos(a_filename) << std::endl;
-    auto a = QI::ReadVectorImage(QI::CheckPos(a_filename));
+    auto a = QI::ReadVectorImage(QI::CheckPos(a_filename), subregion.region());
     if (verbose) std::cout << "Opening b: " << QI::CheckPos(b_filename) << std::endl;
-    auto b = QI::ReadVectorImage(QI::CheckPos(b_filename));
+    auto b = QI::ReadVectorImage(QI::CheckPos(b_filename), subregion.region());
     auto seq = QI::ReadSequence<QI::SSFPGSSequence>(std::cin, verbose);
     auto algo = std::make_shared<PLANET>(seq);
     auto apply = QI::ApplyVectorF::New();
@@ -98,17 +123,23 @@ int main(int argc, char **argv) {
     apply->SetInput(0, G);
     apply->SetInput(1, a);
     apply->SetInput(2, b);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
+    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get(), subregion.region()));
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
     if (verbose) {
         std::cout << "Processing" << std::endl;
         auto monitor = QI::GenericMonitor::New();
         apply->AddObserver(itk::ProgressEvent(), monitor);
     }
+    checkpoint.Apply(apply, out_prefix.Get());
     apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
     if (verbose) {
         std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
     }
@@ -117,6 +148,9 @@ int main(int argc, char **argv) {
         if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
         QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
     }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "failures" + QI::OutExt());
+    }
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
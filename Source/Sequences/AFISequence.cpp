@@ -10,10 +10,12 @@
  */
 
 #include "AFISequence.h"
+#include "Counters.h"
 
 namespace QI {
 
 Eigen::ArrayXcd AFISequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->AFI(p, FA, TR1, TR2);
 }
 
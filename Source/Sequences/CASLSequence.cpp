@@ -27,6 +27,8 @@ void CASLSequence::save(cereal::JSONOutputArchive &ar) const {
        CEREAL_NVP(post_label_delay));
 }
 
+QI_SEQUENCE_BINARY( CASLSequence, TR, label_time, post_label_delay )
+
 Eigen::ArrayXcd CASLSequence::signal(const std::shared_ptr<QI::Model> m, const Eigen::VectorXd &p) const {
     QI_FAIL("Not Implemented");
 }
@@ -0,0 +1,266 @@
+/*
+ *  Dictionary.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <Eigen/Eigenvalues>
+
+#include "Dictionary.h"
+#include "DictionaryIndex.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+Dictionary::Dictionary(const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+                       const Eigen::ArrayXXd &entries, const std::vector<Axis> &axes,
+                       const size_t rank, const bool verbose) :
+    m_free(entries), m_axes(axes), m_cells(1)
+{
+    if (static_cast<size_t>(m_free.rows()) != model->nParameters()) {
+        QI_EXCEPTION("Dictionary entries have " << m_free.rows() << " parameters but model " << model->Name() << " has " << model->nParameters());
+    }
+    for (const Axis &a : m_axes) {
+        if (a.parameter >= model->nParameters() || a.values.size() == 0) {
+            QI_EXCEPTION("Invalid dictionary axis for parameter " << a.parameter);
+        }
+        m_cells *= a.values.size();
+    }
+    const size_t dataSize = sequence.size();
+    m_atoms.resize(dataSize, size());
+    m_norms.resize(size());
+    if (verbose) std::cout << "Building dictionary with " << size() << " entries in " << m_cells << " cells" << std::endl;
+
+    // The signals are independent, so share them out over the global pool
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = pool.size();
+    struct {
+        size_t running;
+        std::mutex mutex;
+        std::condition_variable condition;
+    } sync;
+    sync.running = nTasks;
+    for (size_t t = 0; t < nTasks; t++) {
+        pool.enqueue([=, &sequence, &model, &sync] {
+            Eigen::ArrayXd s(sequence.size());
+            for (size_t e = (size() * t) / nTasks; e < (size() * (t + 1)) / nTasks; e++) {
+                sequence.signal_magnitude_into(model, parameters(e).matrix(), s);
+                const double norm = s.matrix().norm();
+                if (std::isfinite(norm) && norm > 0) {
+                    m_atoms.col(e) = (s / norm).cast<float>().matrix();
+                    m_norms[e] = norm;
+                } else {
+                    // Can never be the best match
+                    m_atoms.col(e).setZero();
+                    m_norms[e] = 1;
+                }
+            }
+            std::unique_lock<std::mutex> lock(sync.mutex);
+            if (--sync.running == 0) {
+                sync.condition.notify_all();
+            }
+        });
+    }
+    {
+        std::unique_lock<std::mutex> lock(sync.mutex);
+        sync.condition.wait(lock, [&sync]{ return sync.running == 0; });
+    }
+
+    if (rank > 0 && rank < dataSize) {
+        // The leading left singular vectors are the eigenvectors of the (small) Gram matrix
+        const Eigen::MatrixXd gram = (m_atoms * m_atoms.transpose()).cast<double>();
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen(gram);
+        m_basis = eigen.eigenvectors().rightCols(rank).cast<float>();
+        m_atoms = m_basis.transpose() * m_atoms;
+        if (verbose) {
+            const double kept = eigen.eigenvalues().tail(rank).sum() / eigen.eigenvalues().sum();
+            std::cout << "Compressed dictionary to rank " << rank << ", keeping " << (100. * kept) << "% of the energy" << std::endl;
+        }
+    }
+}
+
+Eigen::ArrayXXd Dictionary::Grid(const Eigen::ArrayXXd &bounds, const Eigen::ArrayXi &steps) {
+    if (bounds.cols() != 2 || steps.rows() != bounds.rows() || (steps < 1).any()) {
+        QI_EXCEPTION("Grid needs one lower & upper bound and at least one step for each parameter");
+    }
+    size_t total = 1;
+    for (Eigen::Index p = 0; p < steps.rows(); p++) {
+        total *= steps[p];
+    }
+    Eigen::ArrayXXd grid(bounds.rows(), total);
+    for (size_t e = 0; e < total; e++) {
+        size_t rem = e;
+        for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+            const size_t i = rem % steps[p];
+            rem /= steps[p];
+            grid(p, e) = (steps[p] == 1) ? bounds(p, 0) :
+                         bounds(p, 0) + i * (bounds(p, 1) - bounds(p, 0)) / (steps[p] - 1);
+        }
+    }
+    return grid;
+}
+
+Eigen::ArrayXXd Dictionary::Random(const Eigen::ArrayXXd &bounds, const size_t n, const unsigned int seed) {
+    if (bounds.cols() != 2) {
+        QI_EXCEPTION("Random dictionary needs one lower & upper bound for each parameter");
+    }
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    Eigen::ArrayXXd samples(bounds.rows(), n);
+    for (size_t e = 0; e < n; e++) {
+        for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+            samples(p, e) = bounds(p, 0) + uniform(rng) * (bounds(p, 1) - bounds(p, 0));
+        }
+    }
+    return samples;
+}
+
+size_t Dictionary::size() const { return m_cells * cellSize(); }
+size_t Dictionary::cellSize() const { return m_free.cols(); }
+size_t Dictionary::rank() const { return m_atoms.rows(); }
+
+Eigen::ArrayXd Dictionary::parameters(const size_t entry) const {
+    Eigen::ArrayXd p = m_free.col(entry % cellSize());
+    size_t c = entry / cellSize();
+    for (const Axis &a : m_axes) {
+        p[a.parameter] = a.values[c % a.values.size()];
+        c /= a.values.size();
+    }
+    return p;
+}
+
+void Dictionary::index(const std::string &cacheDir, const size_t checks, const bool verbose) {
+    if (checks == 0) {
+        QI_EXCEPTION("A dictionary index must check at least one atom");
+    }
+    m_index = DictionaryIndex::Cached(cacheDir, m_atoms, m_cells, IndexBranching, IndexLeafSize, verbose);
+    m_checks = checks;
+}
+
+size_t Dictionary::cell(const Eigen::Ref<const Eigen::ArrayXd> &fixed) const {
+    if (static_cast<size_t>(fixed.size()) != m_axes.size()) {
+        QI_EXCEPTION("Dictionary has " << m_axes.size() << " fixed axes but " << fixed.size() << " values were given");
+    }
+    size_t c = 0, stride = 1;
+    for (size_t i = 0; i < m_axes.size(); i++) {
+        const Eigen::ArrayXd &v = m_axes[i].values;
+        const double *upper = std::lower_bound(v.data(), v.data() + v.size(), fixed[i]);
+        size_t nearest = upper - v.data();
+        if (nearest == static_cast<size_t>(v.size()) || (nearest > 0 && (fixed[i] - v[nearest - 1]) < (v[nearest] - fixed[i]))) {
+            nearest--;
+        }
+        c += nearest * stride;
+        stride *= v.size();
+    }
+    return c;
+}
+
+Eigen::VectorXf Dictionary::project(const Eigen::Ref<const Eigen::ArrayXd> &data) const {
+    if (m_basis.size() > 0) {
+        return m_basis.transpose() * data.cast<float>().matrix();
+    } else {
+        return data.cast<float>().matrix();
+    }
+}
+
+Eigen::VectorXf Dictionary::similarity(const Eigen::Ref<const Eigen::ArrayXd> &data, const size_t c) const {
+    return m_atoms.middleCols(c * cellSize(), cellSize()).transpose() * project(data);
+}
+
+std::vector<size_t> Dictionary::search(const Eigen::Ref<const Eigen::ArrayXd> &data, const size_t c, const size_t n) const {
+    std::vector<size_t> entries = m_index->search(m_atoms, project(data), c, m_checks, n);
+    for (size_t &e : entries) {
+        e += c * cellSize();
+    }
+    return entries;
+}
+
+size_t Dictionary::match(const Eigen::Ref<const Eigen::ArrayXd> &data, const Eigen::Ref<const Eigen::ArrayXd> &fixed, double &scale) const {
+    const size_t c = cell(fixed);
+    if (m_index) {
+        const size_t entry = search(data, c, 1).front();
+        scale = m_atoms.col(entry).dot(project(data)) / m_norms[entry];
+        return entry;
+    }
+    const Eigen::VectorXf s = similarity(data, c);
+    Eigen::Index i;
+    const float best = s.maxCoeff(&i);
+    const size_t entry = c * cellSize() + i;
+    scale = best / m_norms[entry];
+    return entry;
+}
+
+std::vector<size_t> Dictionary::best(const Eigen::Ref<const Eigen::ArrayXd> &data, const Eigen::Ref<const Eigen::ArrayXd> &fixed, const size_t n) const {
+    const size_t c = cell(fixed);
+    if (m_index) {
+        return search(data, c, n);
+    }
+    const Eigen::VectorXf s = similarity(data, c);
+    std::vector<size_t> indices(cellSize());
+    std::iota(indices.begin(), indices.end(), 0);
+    const size_t keep = std::min(n, indices.size());
+    std::partial_sort(indices.begin(), indices.begin() + keep, indices.end(),
+                      [&s](const size_t a, const size_t b) { return s[a] > s[b]; });
+    indices.resize(keep);
+    for (size_t &i : indices) {
+        i += c * cellSize();
+    }
+    return indices;
+}
+
+void Dictionary::match(const Eigen::Ref<const Eigen::ArrayXXd> &data, const Eigen::Ref<const Eigen::ArrayXXd> &fixed,
+                       std::vector<size_t> &entries, Eigen::ArrayXd &scales) const {
+    const size_t nVoxels = data.cols();
+    entries.resize(nVoxels);
+    scales.resize(nVoxels);
+    std::vector<size_t> cells(nVoxels), order(nVoxels);
+    for (size_t v = 0; v < nVoxels; v++) {
+        cells[v] = m_axes.empty() ? 0 : cell(fixed.col(v));
+    }
+    if (m_index) {
+        // Each voxel finds its own atoms, so there is nothing to share between them
+        for (size_t v = 0; v < nVoxels; v++) {
+            entries[v] = search(data.col(v), cells[v], 1).front();
+            scales[v] = m_atoms.col(entries[v]).dot(project(data.col(v))) / m_norms[entries[v]];
+        }
+        return;
+    }
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&cells](const size_t a, const size_t b) { return cells[a] < cells[b]; });
+    Eigen::MatrixXf block(data.rows(), BatchSize);
+    size_t start = 0;
+    while (start < nVoxels) {
+        const size_t c = cells[order[start]];
+        size_t n = 0;
+        while ((start + n) < nVoxels && n < BatchSize && cells[order[start + n]] == c) {
+            block.col(n) = data.col(order[start + n]).cast<float>().matrix();
+            n++;
+        }
+        Eigen::MatrixXf projected;
+        if (m_basis.size() > 0) {
+            projected = m_basis.transpose() * block.leftCols(n);
+        } else {
+            projected = block.leftCols(n);
+        }
+        const Eigen::MatrixXf s = m_atoms.middleCols(c * cellSize(), cellSize()).transpose() * projected;
+        for (size_t i = 0; i < n; i++) {
+            Eigen::Index best;
+            const float value = s.col(i).maxCoeff(&best);
+            const size_t v = order[start + i];
+            entries[v] = c * cellSize() + best;
+            scales[v] = value / m_norms[entries[v]];
+        }
+        start += n;
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,90 @@
+/*
+ *  Dictionary.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SEQUENCES_DICTIONARY_H
+#define SEQUENCES_DICTIONARY_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <Eigen/Core>
+#include "SequenceBase.h"
+#include "Model.h"
+
+namespace QI {
+
+class DictionaryIndex;
+
+/*
+ * Precomputed signal magnitudes for a grid of model parameters, matched against voxels by inner
+ * products as in MR fingerprinting. Entries are split into cells, one for each combination of the
+ * values along the fixed axes (usually per-voxel constants such as B1). All cells contain the same
+ * free entries, and a voxel is only matched against the cell nearest its fixed values.
+ *
+ * Atoms are stored as floats with unit norm, so matching ignores overall scale (e.g. PD). With a
+ * rank below the data size they are compressed onto the leading singular vectors of the dictionary.
+ * Very large dictionaries can be matched through an approximate nearest-neighbour index instead of
+ * against every atom of the cell, see index().
+ */
+class Dictionary {
+public:
+    struct Axis {
+        size_t parameter;      // Index of the model parameter
+        Eigen::ArrayXd values; // Increasing
+    };
+
+    Dictionary(const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+               const Eigen::ArrayXXd &entries, // nParameters x free entries, rows on an axis are ignored
+               const std::vector<Axis> &axes = std::vector<Axis>(),
+               const size_t rank = 0,          // 0 for no compression
+               const bool verbose = false);
+
+    static Eigen::ArrayXXd Grid(const Eigen::ArrayXXd &bounds, const Eigen::ArrayXi &steps); // Every combination, first parameter fastest
+    static Eigen::ArrayXXd Random(const Eigen::ArrayXXd &bounds, const size_t n, const unsigned int seed = 0); // Uniform between the bounds
+
+    size_t size() const;     // Entries in all cells
+    size_t cellSize() const; // Entries in each cell
+    size_t rank() const;     // Length of each stored atom
+    Eigen::ArrayXd parameters(const size_t entry) const;
+    /* From now on match by comparing about checks atoms found by a QI::DictionaryIndex, which is
+     * read from cacheDir if it was built for these atoms before, otherwise built and saved there. */
+    void index(const std::string &cacheDir, const size_t checks, const bool verbose = false);
+
+    // Best entry for one voxel, scale is the factor from the unnormalised atom to the data
+    size_t match(const Eigen::Ref<const Eigen::ArrayXd> &data, const Eigen::Ref<const Eigen::ArrayXd> &fixed, double &scale) const;
+    // The n best entries, best first
+    std::vector<size_t> best(const Eigen::Ref<const Eigen::ArrayXd> &data, const Eigen::Ref<const Eigen::ArrayXd> &fixed, const size_t n) const;
+    // Many voxels at once, one column each. Voxels in the same cell are matched with one matrix product.
+    void match(const Eigen::Ref<const Eigen::ArrayXXd> &data, const Eigen::Ref<const Eigen::ArrayXXd> &fixed,
+               std::vector<size_t> &entries, Eigen::ArrayXd &scales) const;
+
+protected:
+    Eigen::ArrayXXd m_free;
+    std::vector<Axis> m_axes;
+    size_t m_cells;
+    Eigen::MatrixXf m_basis; // data size x rank, empty if not compressed
+    Eigen::MatrixXf m_atoms; // rank x entries
+    Eigen::ArrayXf m_norms;  // Norm of each atom before it was normalised
+    std::shared_ptr<const DictionaryIndex> m_index; // Null to compare every atom
+    size_t m_checks = 0;
+
+    static const size_t BatchSize = 256; // Voxels multiplied against a cell at once
+    static const size_t IndexBranching = 16, IndexLeafSize = 32;
+
+    size_t cell(const Eigen::Ref<const Eigen::ArrayXd> &fixed) const;
+    Eigen::VectorXf project(const Eigen::Ref<const Eigen::ArrayXd> &data) const;
+    Eigen::VectorXf similarity(const Eigen::Ref<const Eigen::ArrayXd> &data, const size_t c) const;
+    std::vector<size_t> search(const Eigen::Ref<const Eigen::ArrayXd> &data, const size_t c, const size_t n) const; // With the index
+};
+
+} // End namespace QI
+
+#endif // SEQUENCES_DICTIONARY_H
@@ -0,0 +1,307 @@
+/*
+ *  DictionaryIndex.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstring>
+#include <limits>
+#include <queue>
+#include <random>
+#include <numeric>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+
+#include "DictionaryIndex.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+DictionaryIndex::DictionaryIndex(const Eigen::MatrixXf &atoms, const size_t cells, const size_t branching,
+                                 const size_t leafSize, const bool verbose) {
+    if (cells == 0 || atoms.cols() == 0 || atoms.cols() % cells) {
+        QI_EXCEPTION("Dictionary index needs the same number of atoms in each of at least one cell");
+    }
+    if (branching < 2 || leafSize < 1) {
+        QI_EXCEPTION("Dictionary index needs a branching factor of at least 2 and leaves of at least 1 atom");
+    }
+    if (static_cast<uint64_t>(atoms.cols()) > std::numeric_limits<uint32_t>::max()) {
+        QI_EXCEPTION("Dictionary of " << atoms.cols() << " atoms is too large to index");
+    }
+    m_cellSize = atoms.cols() / cells;
+    if (verbose) std::cout << "Building dictionary index over " << cells << " cells of " << m_cellSize << " atoms" << std::endl;
+    m_order.resize(atoms.cols());
+    std::vector<float> centroids;
+    for (size_t c = 0; c < cells; c++) {
+        std::iota(m_order.begin() + c * m_cellSize, m_order.begin() + (c + 1) * m_cellSize, 0);
+        m_roots.push_back(m_nodes.size());
+        m_nodes.push_back(Node{static_cast<uint32_t>(c * m_cellSize), static_cast<uint32_t>(m_cellSize), true});
+        const Eigen::VectorXf mean = atoms.middleCols(c * m_cellSize, m_cellSize).rowwise().mean();
+        centroids.insert(centroids.end(), mean.data(), mean.data() + mean.size());
+        split(atoms, c * m_cellSize, m_roots.back(), branching, leafSize, centroids);
+    }
+    m_centroids = Eigen::Map<const Eigen::MatrixXf>(centroids.data(), atoms.rows(), m_nodes.size());
+    if (verbose) std::cout << "Dictionary index has " << m_nodes.size() << " nodes" << std::endl;
+}
+
+/*
+ * Cluster a leaf's atoms with k-means and make each cluster a child, until the leaves are small
+ * enough. The centres come from k-means++ and a few iterations on an even sample of the atoms,
+ * then every atom goes to its nearest centre and each child's centroid is its atoms' mean. A
+ * leaf whose atoms cannot be separated (e.g. copies of one atom) stays a leaf.
+ */
+void DictionaryIndex::split(const Eigen::MatrixXf &atoms, const size_t offset, const size_t node,
+                            const size_t branching, const size_t leafSize, std::vector<float> &centroids) {
+    const size_t begin = m_nodes[node].first, count = m_nodes[node].count;
+    if (count <= leafSize) {
+        return;
+    }
+    const Eigen::Index rank = atoms.rows();
+    uint32_t *members = m_order.data() + begin;
+    const size_t nSample = std::min(count, SampleSize * branching);
+    Eigen::MatrixXf sample(rank, nSample);
+    for (size_t s = 0; s < nSample; s++) {
+        sample.col(s) = atoms.col(offset + members[(s * count) / nSample]);
+    }
+
+    std::mt19937_64 rng(node);
+    Eigen::MatrixXf centres(rank, branching);
+    centres.col(0) = sample.col(rng() % nSample);
+    size_t K = 1;
+    Eigen::VectorXd nearest = (sample.colwise() - centres.col(0)).colwise().squaredNorm().transpose().cast<double>();
+    while (K < branching) {
+        if (nearest.sum() <= 0) break; // Every sample is on a centre already
+        std::discrete_distribution<size_t> pick(nearest.data(), nearest.data() + nearest.size());
+        centres.col(K) = sample.col(pick(rng));
+        nearest = nearest.cwiseMin((sample.colwise() - centres.col(K)).colwise().squaredNorm().transpose().cast<double>());
+        K++;
+    }
+    // Nearest centre by |c|² - 2 c·a, the |a|² term is the same for every centre
+    auto assign = [&](const Eigen::Ref<const Eigen::VectorXf> &a, const Eigen::VectorXf &norms) -> size_t {
+        Eigen::Index k;
+        (norms - 2 * centres.leftCols(K).transpose() * a).minCoeff(&k);
+        return k;
+    };
+    std::vector<size_t> labels(nSample);
+    for (size_t it = 0; it < KMeansIterations; it++) {
+        const Eigen::VectorXf norms = centres.leftCols(K).colwise().squaredNorm().transpose();
+        Eigen::MatrixXf sums = Eigen::MatrixXf::Zero(rank, K);
+        Eigen::VectorXf counts = Eigen::VectorXf::Zero(K);
+        for (size_t s = 0; s < nSample; s++) {
+            labels[s] = assign(sample.col(s), norms);
+            sums.col(labels[s]) += sample.col(s);
+            counts[labels[s]] += 1;
+        }
+        for (size_t k = 0; k < K; k++) {
+            if (counts[k] > 0) centres.col(k) = sums.col(k) / counts[k]; // Empty centres stay put
+        }
+    }
+
+    std::vector<uint32_t> all(count);
+    const Eigen::VectorXf norms = centres.leftCols(K).colwise().squaredNorm().transpose();
+    auto assignAll = [&](const size_t first, const size_t last) {
+        for (size_t i = first; i < last; i++) {
+            all[i] = assign(atoms.col(offset + members[i]), norms);
+        }
+    };
+    if (count > AssignGrain && !QI::ThreadPool::InWorker()) {
+        QI::ThreadPool::Global().parallelFor(0, count, AssignGrain, assignAll);
+    } else {
+        assignAll(0, count);
+    }
+    std::vector<size_t> sizes(K, 0);
+    for (const uint32_t k : all) sizes[k]++;
+    if (*std::max_element(sizes.begin(), sizes.end()) == count) {
+        return;
+    }
+    // Counting sort of the members by cluster, then one child per non-empty cluster
+    std::vector<size_t> starts(K, 0);
+    for (size_t k = 1; k < K; k++) starts[k] = starts[k - 1] + sizes[k - 1];
+    std::vector<uint32_t> sorted(count);
+    {
+        std::vector<size_t> next = starts;
+        for (size_t i = 0; i < count; i++) sorted[next[all[i]]++] = members[i];
+    }
+    std::copy(sorted.begin(), sorted.end(), members);
+    const size_t first = m_nodes.size();
+    for (size_t k = 0; k < K; k++) {
+        if (sizes[k] == 0) continue;
+        m_nodes.push_back(Node{static_cast<uint32_t>(begin + starts[k]), static_cast<uint32_t>(sizes[k]), true});
+        Eigen::VectorXf mean = Eigen::VectorXf::Zero(rank);
+        for (size_t i = starts[k]; i < starts[k] + sizes[k]; i++) {
+            mean += atoms.col(offset + members[i]);
+        }
+        mean /= sizes[k];
+        centroids.insert(centroids.end(), mean.data(), mean.data() + rank);
+    }
+    const size_t children = m_nodes.size() - first;
+    m_nodes[node] = Node{static_cast<uint32_t>(first), static_cast<uint32_t>(children), false};
+    for (size_t child = first; child < first + children; child++) {
+        split(atoms, offset, child, branching, leafSize, centroids);
+    }
+}
+
+size_t DictionaryIndex::nodes() const { return m_nodes.size(); }
+
+std::vector<size_t> DictionaryIndex::search(const Eigen::MatrixXf &atoms, const Eigen::Ref<const Eigen::VectorXf> &query,
+                                            const size_t c, const size_t checks, const size_t n) const {
+    if (c >= m_roots.size() || query.size() != atoms.rows() || query.size() != m_centroids.rows()) {
+        QI_EXCEPTION("Dictionary index search does not match the index");
+    }
+    std::vector<size_t> result;
+    if (n == 0) return result;
+    const float norm = query.norm();
+    const Eigen::VectorXf unit = (norm > 0) ? Eigen::VectorXf(query / norm) : Eigen::VectorXf(query);
+    const size_t offset = c * m_cellSize;
+
+    typedef std::pair<float, uint32_t> TBranch; // Distance to the centroid, node
+    std::priority_queue<TBranch, std::vector<TBranch>, std::greater<TBranch>> branches;
+    typedef std::pair<float, uint32_t> TMatch;  // Inner product, entry
+    std::priority_queue<TMatch, std::vector<TMatch>, std::greater<TMatch>> matches; // Worst kept on top
+    branches.push(TBranch(0.f, m_roots[c]));
+    size_t checked = 0;
+    while (!branches.empty() && (checked < checks || matches.size() < n)) {
+        uint32_t node = branches.top().second;
+        branches.pop();
+        while (!m_nodes[node].leaf) {
+            const Node &parent = m_nodes[node];
+            uint32_t nearest = parent.first;
+            float nearestDistance = std::numeric_limits<float>::infinity();
+            for (uint32_t child = parent.first; child < parent.first + parent.count; child++) {
+                const float d = (m_centroids.col(child) - unit).squaredNorm();
+                if (d < nearestDistance) {
+                    if (nearestDistance < std::numeric_limits<float>::infinity()) {
+                        branches.push(TBranch(nearestDistance, nearest));
+                    }
+                    nearest = child;
+                    nearestDistance = d;
+                } else {
+                    branches.push(TBranch(d, child));
+                }
+            }
+            node = nearest;
+        }
+        const Node &leaf = m_nodes[node];
+        for (uint32_t i = leaf.first; i < leaf.first + leaf.count; i++) {
+            const uint32_t entry = m_order[i];
+            const float s = atoms.col(offset + entry).dot(query);
+            if (matches.size() < n) {
+                matches.push(TMatch(s, entry));
+            } else if (s > matches.top().first) {
+                matches.pop();
+                matches.push(TMatch(s, entry));
+            }
+        }
+        checked += leaf.count;
+    }
+    result.resize(matches.size());
+    for (size_t i = result.size(); i-- > 0;) {
+        result[i] = matches.top().second;
+        matches.pop();
+    }
+    return result;
+}
+
+std::string DictionaryIndex::Key(const Eigen::MatrixXf &atoms, const size_t cells, const size_t branching, const size_t leafSize) {
+    // The atoms are far too many to keep in the key, so it holds an FNV-1a hash of their words
+    uint64_t hash = 14695981039346656037ULL;
+    const float *data = atoms.data();
+    for (Eigen::Index i = 0; i < atoms.size(); i++) {
+        uint32_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    std::stringstream key;
+    key << "DictionaryIndex branching " << branching << " leaf " << leafSize << " cells " << cells
+        << " rank " << atoms.rows() << " atoms " << atoms.cols() << " " << std::hex << hash;
+    return key.str();
+}
+
+/*
+ * As for QI::Surrogate, cache files are named by an FNV-1a hash of the key, hold the whole key, and
+ * are native binary.
+ */
+std::shared_ptr<const DictionaryIndex> DictionaryIndex::Cached(const std::string &dir, const Eigen::MatrixXf &atoms,
+                                                               const size_t cells, const size_t branching,
+                                                               const size_t leafSize, const bool verbose) {
+    const std::string key = Key(atoms, cells, branching, leafSize);
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : key) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    std::stringstream path;
+    path << dir << "/dictionary_index_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+    std::ifstream in(path.str(), std::ios::binary);
+    if (in) {
+        std::shared_ptr<DictionaryIndex> cached(new DictionaryIndex());
+        if (cached->read(in, key)) {
+            if (verbose) std::cout << "Read dictionary index from " << path.str() << std::endl;
+            return cached;
+        }
+    }
+    auto index = std::make_shared<DictionaryIndex>(atoms, cells, branching, leafSize, verbose);
+    std::ofstream out(path.str(), std::ios::binary | std::ios::trunc);
+    if (out) {
+        index->write(out, key);
+        if (verbose) std::cout << "Cached dictionary index in " << path.str() << std::endl;
+    } else {
+        std::cerr << "Could not open " << path.str() << " to cache the dictionary index" << std::endl;
+    }
+    return index;
+}
+
+void DictionaryIndex::write(std::ostream &os, const std::string &key) const {
+    auto put = [&](const void *data, const size_t bytes) { os.write(static_cast<const char *>(data), bytes); };
+    const uint64_t keySize = key.size(), cellSize = m_cellSize, nNodes = m_nodes.size(), nRoots = m_roots.size(),
+                   nOrder = m_order.size(), rank = m_centroids.rows();
+    put(&keySize, sizeof(keySize));
+    put(key.data(), key.size());
+    put(&cellSize, sizeof(cellSize));
+    put(&nNodes, sizeof(nNodes));
+    put(m_nodes.data(), m_nodes.size() * sizeof(Node));
+    put(&nRoots, sizeof(nRoots));
+    put(m_roots.data(), m_roots.size() * sizeof(uint32_t));
+    put(&nOrder, sizeof(nOrder));
+    put(m_order.data(), m_order.size() * sizeof(uint32_t));
+    put(&rank, sizeof(rank));
+    put(m_centroids.data(), m_centroids.size() * sizeof(float));
+}
+
+bool DictionaryIndex::read(std::istream &is, const std::string &key) {
+    auto get = [&](void *data, const size_t bytes) { return static_cast<bool>(is.read(static_cast<char *>(data), bytes)); };
+    uint64_t keySize = 0, cellSize = 0, nNodes = 0, nRoots = 0, nOrder = 0, rank = 0;
+    if (!get(&keySize, sizeof(keySize)) || keySize != key.size()) {
+        return false;
+    }
+    std::string stored(keySize, '\0');
+    if (!get(&stored[0], keySize) || stored != key || !get(&cellSize, sizeof(cellSize)) || !get(&nNodes, sizeof(nNodes))) {
+        return false;
+    }
+    m_cellSize = cellSize;
+    m_nodes.resize(nNodes);
+    if (!get(m_nodes.data(), nNodes * sizeof(Node)) || !get(&nRoots, sizeof(nRoots))) {
+        return false;
+    }
+    m_roots.resize(nRoots);
+    if (!get(m_roots.data(), nRoots * sizeof(uint32_t)) || !get(&nOrder, sizeof(nOrder))) {
+        return false;
+    }
+    m_order.resize(nOrder);
+    if (!get(m_order.data(), nOrder * sizeof(uint32_t)) || !get(&rank, sizeof(rank))) {
+        return false;
+    }
+    m_centroids.resize(rank, nNodes);
+    return get(m_centroids.data(), m_centroids.size() * sizeof(float));
+}
+
+} // End namespace QI
@@ -0,0 +1,74 @@
+/*
+ *  DictionaryIndex.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SEQUENCES_DICTIONARYINDEX_H
+#define SEQUENCES_DICTIONARYINDEX_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <iosfwd>
+#include <Eigen/Core>
+
+namespace QI {
+
+/*
+ * Approximate nearest-neighbour search over the atoms of a dictionary, for dictionaries too large
+ * to compare every atom with every voxel. Each cell's atoms are clustered into a hierarchical
+ * k-means tree, with at most branching children per node and leafSize atoms per leaf. A search
+ * descends to the leaf nearest the query, keeping the other children on a queue, and carries on
+ * from the nearest of those until it has compared about checks atoms (Muja & Lowe 2009). Atoms
+ * are near unit norm, so the nearest atom to the normalised query has about the largest inner
+ * product with it, and the atoms that are compared are ranked by their inner products.
+ */
+class DictionaryIndex {
+public:
+    DictionaryIndex(const Eigen::MatrixXf &atoms, // rank x entries, cells of equal size one after another
+                    const size_t cells, const size_t branching = 16, const size_t leafSize = 32,
+                    const bool verbose = false);
+
+    // Re-use a cached index for these atoms from the directory, or build and cache it there
+    static std::shared_ptr<const DictionaryIndex> Cached(const std::string &dir, const Eigen::MatrixXf &atoms,
+                                                         const size_t cells, const size_t branching = 16,
+                                                         const size_t leafSize = 32, const bool verbose = false);
+
+    size_t nodes() const;
+    // The n entries of cell c (from 0 within the cell) with the largest inner products found, best first
+    std::vector<size_t> search(const Eigen::MatrixXf &atoms, const Eigen::Ref<const Eigen::VectorXf> &query,
+                               const size_t c, const size_t checks, const size_t n) const;
+
+protected:
+    DictionaryIndex() {}
+    static std::string Key(const Eigen::MatrixXf &atoms, const size_t cells, const size_t branching, const size_t leafSize);
+    void write(std::ostream &os, const std::string &key) const;
+    bool read(std::istream &is, const std::string &key); // False if the file is for a different key
+    void split(const Eigen::MatrixXf &atoms, const size_t offset, const size_t node,
+               const size_t branching, const size_t leafSize, std::vector<float> &centroids);
+
+    struct Node {
+        uint32_t first, count; // Children, or the leaf's range of m_order
+        bool leaf;
+    };
+    size_t m_cellSize = 0;
+    std::vector<Node> m_nodes;
+    std::vector<uint32_t> m_roots;  // One per cell
+    std::vector<uint32_t> m_order;  // Entries within their cell, each leaf's are contiguous
+    Eigen::MatrixXf m_centroids;    // rank x nodes
+
+    static const size_t SampleSize = 64;     // Per centre, for the k-means iterations
+    static const size_t KMeansIterations = 8;
+    static const size_t AssignGrain = 16384; // Atoms per task when assigning a large node
+};
+
+} // End namespace QI
+
+#endif // SEQUENCES_DICTIONARYINDEX_H
@@ -0,0 +1,91 @@
+/*
+ *  FixedSignal.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <typeinfo>
+#include <vector>
+
+#include "FixedSignal.h"
+#include "Models.h"
+#include "ModelKernels.h"
+#include "SPGRSequence.h"
+#include "SSFPSequence.h"
+#include "Counters.h"
+
+namespace QI {
+
+namespace {
+
+struct Part {
+    bool ssfp;
+    double TR;
+    Eigen::ArrayXd FA;
+    PhaseTable phi;
+    Eigen::Index start;
+};
+
+template<typename Kernel>
+class TFixedSignal : public FixedSignal {
+    std::vector<Part> m_parts;
+    bool m_scale;
+
+public:
+    TFixedSignal(const std::vector<Part> &parts, const bool scale) : m_parts(parts), m_scale(scale) {}
+
+    void magnitude_into(const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const override {
+        for (const Part &part : m_parts) {
+            CountEvaluation();
+            auto segment = out.segment(part.start, part.FA.rows());
+            if (part.ssfp) {
+                segment = Kernel::SSFP(p, part.FA, part.TR, part.phi).array().abs();
+            } else {
+                segment = Kernel::SPGR(p, part.FA, part.TR).array().abs();
+            }
+            if (m_scale) { // As Model::scale, each sequence on its own
+                segment /= segment.mean();
+            }
+        }
+    }
+};
+
+} // End anonymous namespace
+
+std::shared_ptr<const FixedSignal> MakeFixedSignal(const std::shared_ptr<Model> &m, const SequenceGroup &group) {
+    std::vector<Part> parts;
+    Eigen::Index start = 0;
+    for (const auto &s : group.sequences) {
+        const SequenceBase &sequence = *s;
+        // Exact types only, derived sequences (e.g. SSFPEcho) have different signals
+        if (typeid(sequence) == typeid(SPGRSequence)) {
+            const SPGRSequence &spgr = static_cast<const SPGRSequence &>(sequence);
+            parts.push_back(Part{false, spgr.TR, spgr.FA, PhaseTable(), start});
+        } else if (typeid(sequence) == typeid(SSFPSequence)) {
+            const SSFPSequence &ssfp = static_cast<const SSFPSequence &>(sequence);
+            if (ssfp.PhaseTrig.size() != ssfp.FA.rows()) {
+                return nullptr;
+            }
+            parts.push_back(Part{true, ssfp.TR, ssfp.FA, ssfp.PhaseTrig, start});
+        } else {
+            return nullptr;
+        }
+        start += sequence.size();
+    }
+    const Model &model = *m;
+    const bool scale = model.scaleToMean();
+    if      (typeid(model) == typeid(SCD))       { return std::make_shared<TFixedSignal<SCDKernel>>(parts, scale); }
+    else if (typeid(model) == typeid(MCD2))      { return std::make_shared<TFixedSignal<MCD2Kernel>>(parts, scale); }
+    else if (typeid(model) == typeid(MCD2_NoEx)) { return std::make_shared<TFixedSignal<MCD2_NoExKernel>>(parts, scale); }
+    else if (typeid(model) == typeid(MCD3))      { return std::make_shared<TFixedSignal<MCD3Kernel>>(parts, scale); }
+    else if (typeid(model) == typeid(MCD3_f0))   { return std::make_shared<TFixedSignal<MCD3_f0Kernel>>(parts, scale); }
+    else if (typeid(model) == typeid(MCD3_NoEx)) { return std::make_shared<TFixedSignal<MCD3_NoExKernel>>(parts, scale); }
+    return nullptr;
+}
+
+} // End namespace QI
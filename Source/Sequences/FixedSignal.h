@@ -0,0 +1,43 @@
+/*
+ *  FixedSignal.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SEQUENCES_FIXED_SIGNAL_H
+#define SEQUENCES_FIXED_SIGNAL_H
+
+#include <memory>
+#include <Eigen/Core>
+#include "Model.h"
+#include "SequenceGroup.h"
+
+namespace QI {
+
+/*
+ * The magnitude signals of a SequenceGroup for one model, the same as signal_magnitude_into, but
+ * with the model and the type of each sequence looked up once. Each evaluation is then a single
+ * virtual call into a version of the loop compiled for that model, instead of one call per
+ * sequence to the sequence and another to the model. The model's settings (e.g. scaling to the
+ * mean) and the sequence parameters are copied, so make it once they are set up.
+ */
+class FixedSignal {
+public:
+    virtual ~FixedSignal() {}
+    virtual void magnitude_into(const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const = 0;
+};
+
+/*
+ * Covers the DESPOT models with groups of plain SPGR and SSFP sequences. Anything else returns
+ * nullptr, and the virtual path should be used.
+ */
+std::shared_ptr<const FixedSignal> MakeFixedSignal(const std::shared_ptr<Model> &m, const SequenceGroup &group);
+
+} // End namespace QI
+
+#endif // SEQUENCES_FIXED_SIGNAL_H
@@ -9,13 +9,16 @@
  *
  */
 
+#include <cmath>
 #include "MPRAGESequence.h"
+#include "Counters.h"
 
 namespace QI {
 
 size_t MPRAGESequence::size() const { return 1; }
 
 Eigen::ArrayXcd MPRAGESequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const {
+    CountEvaluation();
     return m->MPRAGE(par, FA, TR, ETL, k0, eta, TI, TD);
 }
 
@@ -42,6 +45,50 @@ void MPRAGESequence::save(cereal::JSONOutputArchive &ar) const {
     ar(cereal::make_nvp("k0", k0));
 }
 
+QI_SEQUENCE_BINARY( MPRAGESequence, TR, TI, TD, eta, FA, ETL, k0 )
+
+/*
+ * The same equation as One_MPRAGE, but the relaxation during the readout uses exp(-TR/T1*) =
+ * E1 cos(alpha), so its exponentials are integer powers and only three exponentials of T1
+ * remain. The derivatives by T1 and B1 are carried alongside each intermediate value, and the
+ * signal is linear in M0.
+ */
+double MPRAGESequence::signal(const double M0, const double T1, const double B1, const double eta,
+                              Eigen::Vector3d *gradient) const {
+    CountEvaluation();
+    typedef Eigen::Array2d D; // d/dT1, d/dB1
+    const double TIs = TI - TR*k0; // Adjust TI for k0
+    const double a = FA * B1, sa = sin(a), ca = cos(a);
+    const D dsa(0., FA * ca), dca(0., -FA * sa);
+    const double E1 = exp(-TR / T1), ETD = exp(-TD / T1), ETI = exp(-TIs / T1);
+    const D dE1(E1 * TR / (T1 * T1), 0.), dETD(ETD * TD / (T1 * T1), 0.), dETI(ETI * TIs / (T1 * T1), 0.);
+    const double Es = E1 * ca;
+    const D dEs = dE1 * ca + E1 * dca;
+    const double EN = std::pow(Es, ETL), Ek = std::pow(Es, k0);
+    const D dEN = (ETL > 0) ? D(ETL * std::pow(Es, ETL - 1) * dEs) : D(D::Zero());
+    const D dEk = (k0 > 0) ? D(k0 * std::pow(Es, k0 - 1) * dEs) : D(D::Zero());
+    const double M0s = (1. - E1) / (1. - Es);
+    const D dM0s = (-dE1 * (1. - Es) + (1. - E1) * dEs) / ((1. - Es) * (1. - Es));
+    const double A1 = M0s * (1. - EN);
+    const D dA1 = dM0s * (1. - EN) - M0s * dEN;
+    const double A2 = 1. - ETD, A3 = 1. - ETI;
+    const double B3 = -eta * ETI; // eta is inversion efficency
+    const D dB3 = -eta * dETI;
+    const double A = A3 + A2*B3 + A1*ETD*B3;
+    const D dA = -dETI - dETD*B3 + A2*dB3 + dA1*ETD*B3 + A1*dETD*B3 + A1*ETD*dB3;
+    const double B = EN*ETD*B3;
+    const D dB = dEN*ETD*B3 + EN*dETD*B3 + EN*ETD*dB3;
+    const double M1 = A / (1. - B);
+    const D dM1 = (dA * (1. - B) + A * dB) / ((1. - B) * (1. - B));
+    const double m = M0s + (M1 - M0s) * Ek;
+    const D dm = dM0s + (dM1 - dM0s) * Ek + (M1 - M0s) * dEk;
+    if (gradient) {
+        const D df = dm * sa + m * dsa;
+        (*gradient) << m * sa, M0 * df[0], M0 * df[1];
+    }
+    return M0 * m * sa;
+}
+
 /*
  * MP2RAGE
  */
@@ -53,6 +100,7 @@ Eigen::ArrayXcd MP2RAGESequence::signal(const std::shared_ptr<Model> m, const Ei
 }
 
 Eigen::ArrayXcd MP2RAGESequence::signal(const double M0, const double T1, const double B1, const double eta) const {
+    CountEvaluation();
     return One_MP2RAGE(FA, TR, ETL, TD, M0, T1, B1, eta);
 }
 
@@ -79,6 +127,8 @@ void MP2RAGESequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( MP2RAGESequence, TR, ETL, FA, TD )
+
 /*
  * MP3RAGE
  */
@@ -90,6 +140,7 @@ Eigen::ArrayXcd MP3RAGESequence::signal(const std::shared_ptr<Model> m, const Ei
 }
 
 Eigen::ArrayXcd MP3RAGESequence::signal(const double M0, const double T1, const double B1, const double eta) const {
+    CountEvaluation();
     return One_MP3RAGE(FA, TR, ETL, TD, M0, T1, B1, eta);
 }
 
@@ -107,4 +158,6 @@ void MP3RAGESequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( MP3RAGESequence, TR, ETL, FA, TD )
+
 } // End namespace QI
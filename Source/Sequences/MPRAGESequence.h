@@ -23,6 +23,9 @@ struct MPRAGESequence : SequenceBase {
     int ETL, k0;
     QI_SEQUENCE_DECLARE(MPRAGE);
     size_t size() const override;
+    // Single-exponential signal, and its derivatives by M0, T1 & B1 if requested
+    double signal(const double M0, const double T1, const double B1, const double eta,
+                  Eigen::Vector3d *gradient = nullptr) const;
 };
 
 struct MP2RAGESequence : SequenceBase {
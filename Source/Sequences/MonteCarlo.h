@@ -0,0 +1,230 @@
+/*
+ *  MonteCarlo.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SEQUENCES_MONTECARLO_H
+#define SEQUENCES_MONTECARLO_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <algorithm>
+#include <Eigen/Core>
+#include <cereal/archives/json.hpp>
+
+#include "SequenceBase.h"
+#include "Model.h"
+#include "Dictionary.h"
+#include "CounterNoise.h"
+#include "ThreadPool.h"
+#include "EigenCereal.h"
+#include "Args.h"
+#include "Macro.h"
+
+namespace QI {
+
+/*
+ * Precision and accuracy of a fitting algorithm without any images. For each set of true model
+ * parameters the noise-free signal is simulated once, and then n noisy magnitude realisations of
+ * it are passed straight to the algorithm. The realisations are shared over the global thread
+ * pool, and the noise for realisation r of point p is that of voxel r * points + p from the
+ * CounterNoise, so the noise does not depend on the number of threads.
+ *
+ * Algorithm constants and outputs are matched to model parameters by name. Constants without a
+ * matching parameter take the algorithm's default, and outputs without one have no truth.
+ */
+struct MonteCarloResult {
+    Eigen::ArrayXXd mean, sd; // Outputs x points, over the realisations that did not fail
+    Eigen::ArrayXi failures;  // Per point
+};
+
+template<typename TAlgorithm>
+MonteCarloResult MonteCarlo(const TAlgorithm &algo, const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+                            const Eigen::ArrayXXd &truth, // Model parameters x points
+                            const std::vector<std::string> &constNames,
+                            const size_t n, const CounterNoise &noise)
+{
+    typedef typename TAlgorithm::TInput TInput;
+    typedef typename TAlgorithm::TConst TConst;
+    typedef typename TAlgorithm::TOutput TOutput;
+    if (algo.numInputs() != 1 || algo.dataSize() != sequence.size()) {
+        QI_EXCEPTION("Monte-Carlo needs an algorithm with one input the same size as the sequence");
+    }
+    if (constNames.size() != algo.numConsts()) {
+        QI_EXCEPTION("Monte-Carlo needs a name for each of the " << algo.numConsts() << " algorithm constants");
+    }
+    const auto &names = model->ParameterNames();
+    std::vector<int> constIndex;
+    for (const auto &name : constNames) {
+        const auto it = std::find(names.begin(), names.end(), name);
+        constIndex.push_back(it == names.end() ? -1 : it - names.begin());
+    }
+    const size_t nPoints = truth.cols();
+    const size_t nOutputs = algo.numOutputs();
+    const Eigen::ArrayXXcd signals = sequence.signals(model, truth);
+
+    ThreadPool &pool = ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), n));
+    std::vector<Eigen::ArrayXXd> sums(nTasks, Eigen::ArrayXXd::Zero(nOutputs, nPoints));
+    std::vector<Eigen::ArrayXXd> squares(nTasks, Eigen::ArrayXXd::Zero(nOutputs, nPoints));
+    std::vector<Eigen::ArrayXi> fails(nTasks, Eigen::ArrayXi::Zero(nPoints));
+    std::vector<std::string> errors(nTasks);
+    pool.run(nTasks, [&](const size_t t) {
+        try {
+            std::vector<TInput> inputs(1, TInput(sequence.size()));
+            std::vector<TConst> consts(algo.numConsts());
+            std::vector<TOutput> outputs(nOutputs);
+            TOutput residual;
+            TInput resids(sequence.size());
+            typename TAlgorithm::TIterations its;
+            typename TAlgorithm::TIndex index;
+            index.Fill(0);
+            for (size_t r = (n * t) / nTasks; r < (n * (t + 1)) / nTasks; r++) {
+                Eigen::ArrayXXcd noisy = signals;
+                if (noise.sigma() != 0.) {
+                    noise.add(noisy, r * nPoints, 0);
+                }
+                for (size_t p = 0; p < nPoints; p++) {
+                    for (size_t j = 0; j < sequence.size(); j++) {
+                        inputs[0][j] = std::abs(noisy(j, p));
+                    }
+                    const std::vector<TConst> defaults = algo.defaultConsts();
+                    for (size_t c = 0; c < consts.size(); c++) {
+                        consts[c] = (constIndex[c] < 0) ? defaults[c] : truth(constIndex[c], p);
+                    }
+                    std::fill(outputs.begin(), outputs.end(), algo.zero());
+                    if (algo.apply(inputs, consts, index, outputs, residual, resids, its)) {
+                        for (size_t o = 0; o < nOutputs; o++) {
+                            sums[t](o, p) += outputs[o];
+                            squares[t](o, p) += outputs[o] * outputs[o];
+                        }
+                    } else {
+                        fails[t][p]++;
+                    }
+                }
+            }
+        } catch (const std::exception &e) {
+            errors[t] = e.what();
+        }
+    });
+    for (const auto &e : errors) {
+        if (!e.empty()) {
+            QI_EXCEPTION("Monte-Carlo failed: " << e);
+        }
+    }
+    MonteCarloResult result;
+    result.mean = Eigen::ArrayXXd::Zero(nOutputs, nPoints);
+    result.sd = Eigen::ArrayXXd::Zero(nOutputs, nPoints);
+    result.failures = Eigen::ArrayXi::Zero(nPoints);
+    for (size_t t = 0; t < nTasks; t++) {
+        result.mean += sums[t];
+        result.sd += squares[t];
+        result.failures += fails[t];
+    }
+    const Eigen::ArrayXd good = (n - result.failures.cast<double>()).max(1.);
+    result.mean.rowwise() /= good.transpose();
+    result.sd.rowwise() /= good.transpose();
+    result.sd = (result.sd - result.mean.square()).max(0.).sqrt();
+    return result;
+}
+
+/*
+ * Options for fitting programs to run MonteCarlo instead of fitting images. The grid file has a
+ * [low, high, steps] entry for each model parameter (an empty entry uses the default), and every
+ * combination is simulated as with Dictionary::Grid. The table written has one row per point, the
+ * true parameters followed by the mean, bias (%) and CoV (%) of each output and the failures.
+ */
+class MonteCarloArgs {
+public:
+    args::ValueFlag<std::string> grid;
+    args::ValueFlag<int> realisations;
+    args::ValueFlag<float> noise;
+    args::ValueFlag<int> seed;
+
+    MonteCarloArgs(args::Group &group) :
+        grid(group, "GRID", "Run a Monte-Carlo simulation over the parameter grid in this file instead of fitting images", {"mc"}),
+        realisations(group, "N", "Number of noisy realisations per Monte-Carlo point, default 100", {"mc-n"}, 100),
+        noise(group, "NOISE", "Complex noise standard deviation for the Monte-Carlo, default 0.01", {"mc-noise"}, 0.01),
+        seed(group, "SEED", "Seed for the Monte-Carlo noise", {"mc-seed"})
+    {}
+
+    bool enabled() { return grid; }
+
+    template<typename TAlgorithm>
+    int Run(const TAlgorithm &algo, const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+            const std::vector<std::string> &constNames, const std::vector<std::string> &outputNames,
+            const std::string &path, const bool verbose)
+    {
+        if (outputNames.size() != algo.numOutputs()) {
+            QI_FAIL("Monte-Carlo needs a name for each of the " << algo.numOutputs() << " algorithm outputs");
+        }
+        const size_t nPars = model->ParameterNames().size();
+        Eigen::ArrayXXd bounds(nPars, 2);
+        Eigen::ArrayXi steps(nPars);
+        std::ifstream file(grid.Get());
+        if (!file) {
+            QI_FAIL("Could not open Monte-Carlo grid file " << grid.Get());
+        }
+        cereal::JSONInputArchive archive(file);
+        for (size_t i = 0; i < nPars; i++) {
+            Eigen::ArrayXd range;
+            ReadCereal(archive, model->ParameterNames()[i], range);
+            if (range.rows() == 0) {
+                bounds.row(i).setConstant(model->Default()[i]);
+                steps[i] = 1;
+            } else if (range.rows() == 3) {
+                bounds.row(i) << range[0], range[1];
+                steps[i] = range[2];
+            } else {
+                QI_FAIL("Monte-Carlo range for " << model->ParameterNames()[i] << " must be [low, high, steps] or empty");
+            }
+        }
+        const Eigen::ArrayXXd truth = Dictionary::Grid(bounds, steps);
+        if (verbose) std::cout << "Monte-Carlo with " << truth.cols() << " points and " << realisations.Get() << " realisations each" << std::endl;
+        const MonteCarloResult result = MonteCarlo(algo, sequence, model, truth, constNames, realisations.Get(),
+                                                   CounterNoise(noise.Get(), seed ? seed.Get() : RandomSeed()));
+        std::vector<int> outputIndex;
+        for (const auto &name : outputNames) {
+            const auto &names = model->ParameterNames();
+            const auto it = std::find(names.begin(), names.end(), name);
+            outputIndex.push_back(it == names.end() ? -1 : it - names.begin());
+        }
+        if (verbose) std::cout << "Writing Monte-Carlo results to: " << path << std::endl;
+        std::ofstream out(path);
+        if (!out) {
+            QI_FAIL("Could not open " << path << " for writing");
+        }
+        out << "#";
+        for (const auto &name : model->ParameterNames()) {
+            out << " " << name;
+        }
+        for (const auto &name : outputNames) {
+            out << " " << name << "_mean " << name << "_bias " << name << "_cov";
+        }
+        out << " failures\n";
+        for (Eigen::Index p = 0; p < truth.cols(); p++) {
+            for (size_t i = 0; i < nPars; i++) {
+                out << (i ? " " : "") << truth(i, p);
+            }
+            for (size_t o = 0; o < outputNames.size(); o++) {
+                const double mean = result.mean(o, p);
+                const double bias = (outputIndex[o] < 0) ? 0. : 100. * (mean - truth(outputIndex[o], p)) / truth(outputIndex[o], p);
+                out << " " << mean << " " << bias << " " << (100. * result.sd(o, p) / mean);
+            }
+            out << " " << result.failures[p] << "\n";
+        }
+        return EXIT_SUCCESS;
+    }
+};
+
+} // End namespace QI
+
+#endif // SEQUENCES_MONTECARLO_H
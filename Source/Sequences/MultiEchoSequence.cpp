@@ -10,6 +10,8 @@
  */
 
 #include "MultiEchoSequence.h"
+#include "Counters.h"
+#include "EigenCereal.h"
 
 namespace QI {
 
@@ -18,6 +20,7 @@ size_t MultiEchoSequence::size() const {
 }
 
 Eigen::ArrayXcd MultiEchoSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->MultiEcho(p, TE, TR);
 }
 
@@ -25,6 +28,8 @@ void MultiEchoSequence::save(cereal::JSONOutputArchive &ar) const {
     ar(CEREAL_NVP(TR), CEREAL_NVP(TE1), CEREAL_NVP(ESP), CEREAL_NVP(ETL));
 }
 
+QI_SEQUENCE_BINARY( MultiEchoSequence, TR, TE1, ESP, ETL, TE )
+
 void MultiEchoSequence::load(cereal::JSONInputArchive &ar) {
     QI_SEQUENCE_LOAD( TR );
     QI_SEQUENCE_LOAD( TE1 );
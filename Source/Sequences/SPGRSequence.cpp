@@ -12,6 +12,7 @@
  */
 
 #include "SPGRSequence.h"
+#include "Counters.h"
 
 namespace QI {
 
@@ -20,9 +21,14 @@ size_t SPGRBase::size() const {
 }
 
 Eigen::ArrayXcd SPGRSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->SPGR(p, FA, TR);
 }
 
+Eigen::MatrixXd SPGRSequence::signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    return m->SPGRJacobian(p, FA, TR);
+}
+
 void SPGRSequence::load(cereal::JSONInputArchive &ar) {
     ar(cereal::make_nvp("TR", TR));
     QI_SEQUENCE_LOAD_DEGREES( FA );
@@ -33,12 +39,15 @@ void SPGRSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( SPGRSequence, TR, FA )
+
 
 /*
  * With echo-time correction
  */
 
 Eigen::ArrayXcd SPGREchoSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->SPGREcho(p, FA, TR, TE);
 }
 
@@ -54,11 +63,14 @@ void SPGREchoSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( SPGREchoSequence, TR, TE, FA )
+
 /*
  * With echo-time and finite-pulse corrections
  */
 
 Eigen::ArrayXcd SPGRFiniteSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->SPGRFinite(p, FA, TR, Trf, TE);
 }
 
@@ -76,4 +88,46 @@ void SPGRFiniteSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( SPGRFiniteSequence, TR, TE, Trf, FA )
+
+/*
+ * With off-resonance MT saturation
+ */
+
+size_t SPGRMTSequence::size() const {
+    return sat_f0.rows();
+}
+
+Eigen::ArrayXd SPGRMTSequence::omega_cwpe() const {
+    return (intB1 / TR).sqrt();
+}
+
+Eigen::ArrayXcd SPGRMTSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
+    return m->SPGR_MT(p, omega_cwpe(), sat_f0, FA, TR, Trf);
+}
+
+void SPGRMTSequence::load(cereal::JSONInputArchive &ar) {
+    QI_SEQUENCE_LOAD( TR );
+    QI_SEQUENCE_LOAD( Trf );
+    QI_SEQUENCE_LOAD( FA );
+    FA *= M_PI / 180.;
+    QI_SEQUENCE_LOAD( sat_f0 );
+    QI_SEQUENCE_LOAD( intB1 );
+    if (sat_f0.rows() != intB1.rows()) {
+        QI_FAIL("One on more parameters had differing lengths, sat_f0 had " << sat_f0.rows() << ", intB1 had " << intB1.rows());
+    }
+}
+
+void SPGRMTSequence::save(cereal::JSONOutputArchive &ar) const {
+    QI_SEQUENCE_SAVE( TR );
+    QI_SEQUENCE_SAVE( Trf );
+    const double FA_degrees = FA * 180. / M_PI;
+    ar(cereal::make_nvp("FA", FA_degrees));
+    QI_SEQUENCE_SAVE( sat_f0 );
+    QI_SEQUENCE_SAVE( intB1 );
+}
+
+QI_SEQUENCE_BINARY( SPGRMTSequence, TR, Trf, FA, sat_f0, intB1 )
+
 } // End namespace QI
\ No newline at end of file
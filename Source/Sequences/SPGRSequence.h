@@ -29,6 +29,7 @@ struct SPGRSequence : SPGRBase {
     double TR;
     
     QI_SEQUENCE_DECLARE(SPGR);
+    Eigen::MatrixXd signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
 };
 
 struct SPGREchoSequence : SPGRBase {
@@ -43,6 +44,19 @@ struct SPGRFiniteSequence : SPGRBase {
     QI_SEQUENCE_DECLARE(SPGRFinite);
 };
 
+/*
+ * SPGR with an off-resonance saturation pulse of length Trf before each excitation, one volume per
+ * saturation. sat_f0 is the offset (Hz) and intB1 the integral of (gamma B1)^2 over the pulse
+ * (rad^2/s), so the continuous-wave power equivalent over TR is omega_cwpe^2 = intB1 / TR.
+ */
+struct SPGRMTSequence : SequenceBase {
+    double TR, Trf, FA;
+    Eigen::ArrayXd sat_f0, intB1;
+    QI_SEQUENCE_DECLARE(SPGRMT);
+    size_t size() const override;
+    Eigen::ArrayXd omega_cwpe() const;
+};
+
 } // End namespace QI
 
 #endif // SEQUENCES_SPGR_H
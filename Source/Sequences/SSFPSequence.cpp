@@ -10,6 +10,7 @@
  */
 
 #include "SSFPSequence.h"
+#include "Counters.h"
 
 #define FA_PHASE_CHECK()\
     if (FA.rows() != PhaseInc.rows()) {\
@@ -23,14 +24,34 @@ size_t SSFPBase::size() const {
     return FA.rows();
 }
 
-Eigen::ArrayXd SSFPSequence::weights(const double f0) const {
-    Eigen::ArrayXd offset = PhaseInc + 2.*M_PI*f0*TR;
-    Eigen::ArrayXd weights = 0.75 * (offset / 2).sin().square();
-    return weights;
+namespace {
+/*
+ * 0.75 sin^2((phi + theta) / 2) with theta = 2 pi f0 TR. This is 0.375 (1 - cos(phi + theta)), so
+ * with the cosine and sine of the phase increments from the table it needs only the cosine and
+ * sine of theta. Sequences made in code may not have the table, they use the phases directly.
+ */
+void OffResonanceWeights(const Eigen::ArrayXd &phi, const PhaseTable &trig, const double f0, const double TR,
+                         Eigen::Ref<Eigen::ArrayXd> out) {
+    const double theta = 2. * M_PI * f0 * TR;
+    if (trig.size() == phi.rows()) {
+        out = 0.375 * (1. - (trig.cosine * std::cos(theta) - trig.sine * std::sin(theta)));
+    } else {
+        out = 0.75 * ((phi + theta) / 2).sin().square();
+    }
+}
+}
+
+void SSFPSequence::weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const {
+    OffResonanceWeights(PhaseInc, PhaseTrig, f0, TR, out);
 }
 
 Eigen::ArrayXcd SSFPSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
-    return m->SSFP(p, FA, TR, PhaseInc);
+    CountEvaluation();
+    return m->SSFP(p, FA, TR, PhaseTrig);
+}
+
+Eigen::MatrixXd SSFPSequence::signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    return m->SSFPJacobian(p, FA, TR, PhaseTrig);
 }
 
 void SSFPSequence::load(cereal::JSONInputArchive &ar) {
@@ -38,6 +59,7 @@ void SSFPSequence::load(cereal::JSONInputArchive &ar) {
     QI_SEQUENCE_LOAD_DEGREES( FA );
     QI_SEQUENCE_LOAD_DEGREES( PhaseInc );
     FA_PHASE_CHECK()
+    PhaseTrig = PhaseTable(PhaseInc);
 }
 
 void SSFPSequence::save(cereal::JSONOutputArchive &ar) const {
@@ -46,12 +68,25 @@ void SSFPSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( PhaseInc );
 }
 
+QI_SEQUENCE_BINARY( SSFPSequence, TR, FA, PhaseInc, PhaseTrig.cosine, PhaseTrig.sine )
+
 Eigen::ArrayXcd SSFPEchoSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
-    return m->SSFPEcho(p, FA, TR, PhaseInc);
+    CountEvaluation();
+    return m->SSFPEcho(p, FA, TR, PhaseTrig);
 }
 
 Eigen::ArrayXd SSFPEchoSequence::signal_magnitude(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
-    return m->SSFPEchoMagnitude(p, FA, TR, PhaseInc);
+    CountEvaluation();
+    return m->SSFPEchoMagnitude(p, FA, TR, PhaseTrig);
+}
+
+void SSFPEchoSequence::signal_magnitude_into(std::shared_ptr<Model> m, const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const {
+    CountEvaluation();
+    out = m->SSFPEchoMagnitude(p, FA, TR, PhaseTrig).array();
+}
+
+Eigen::MatrixXd SSFPEchoSequence::signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    return SequenceBase::signal_magnitude_jacobian(m, p); // The echo signals have no exact Jacobian yet
 }
 
 void SSFPEchoSequence::load(cereal::JSONInputArchive &ar) {
@@ -59,6 +94,7 @@ void SSFPEchoSequence::load(cereal::JSONInputArchive &ar) {
     QI_SEQUENCE_LOAD_DEGREES( FA );
     QI_SEQUENCE_LOAD_DEGREES( PhaseInc );
     FA_PHASE_CHECK()
+    PhaseTrig = PhaseTable(PhaseInc);
 }
 
 void SSFPEchoSequence::save(cereal::JSONOutputArchive &ar) const {
@@ -67,13 +103,14 @@ void SSFPEchoSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( PhaseInc );
 }
 
-Eigen::ArrayXd SSFPFiniteSequence::weights(const double f0) const {
-    Eigen::ArrayXd offset = PhaseInc + 2.*M_PI*f0*TR;
-    Eigen::ArrayXd weights = 0.75 * (offset / 2).sin().square();
-    return weights;
+QI_SEQUENCE_BINARY( SSFPEchoSequence, TR, FA, PhaseInc, PhaseTrig.cosine, PhaseTrig.sine )
+
+void SSFPFiniteSequence::weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const {
+    OffResonanceWeights(PhaseInc, PhaseTrig, f0, TR, out);
 }
 
 Eigen::ArrayXcd SSFPFiniteSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->SSFPFinite(p, FA, TR, Trf, PhaseInc);
 }
 
@@ -83,6 +120,7 @@ void SSFPFiniteSequence::load(cereal::JSONInputArchive &ar) {
     QI_SEQUENCE_LOAD_DEGREES( FA );
     QI_SEQUENCE_LOAD_DEGREES( PhaseInc );
     FA_PHASE_CHECK()
+    PhaseTrig = PhaseTable(PhaseInc);
 }
 
 void SSFPFiniteSequence::save(cereal::JSONOutputArchive &ar) const {
@@ -92,7 +130,18 @@ void SSFPFiniteSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( PhaseInc );
 }
 
+// The table is not stored, so binary files are the same as before it was added
+void SSFPFiniteSequence::load(cereal::PortableBinaryInputArchive &ar) {
+    ar(TR, Trf, FA, PhaseInc);
+    PhaseTrig = PhaseTable(PhaseInc);
+}
+
+void SSFPFiniteSequence::save(cereal::PortableBinaryOutputArchive &ar) const {
+    ar(TR, Trf, FA, PhaseInc);
+}
+
 Eigen::ArrayXcd SSFPGSSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    CountEvaluation();
     return m->SSFP_GS(p, FA, TR);
 }
 
@@ -106,6 +155,8 @@ void SSFPGSSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( FA );
 }
 
+QI_SEQUENCE_BINARY( SSFPGSSequence, TR, FA )
+
 Eigen::ArrayXcd SSFPEllipseSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
     QI_FAIL("Not implemented");
 }
@@ -126,6 +177,8 @@ void SSFPEllipseSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( PhaseInc );
 }
 
+QI_SEQUENCE_BINARY( SSFPEllipseSequence, TR, FA, PhaseInc )
+
 Eigen::ArrayXcd SSFPMTSequence::signal(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
     QI_FAIL("Not implemented");
 }
@@ -153,4 +206,6 @@ void SSFPMTSequence::save(cereal::JSONOutputArchive &ar) const {
     QI_SEQUENCE_SAVE_DEGREES( PhaseInc );
 }
 
+QI_SEQUENCE_BINARY( SSFPMTSequence, TR, Trf, intB1, FA, PhaseInc )
+
 } // End namespace QI
@@ -26,22 +26,27 @@ struct SSFPBase : SequenceBase {
 
 struct SSFPSequence : SSFPBase {
     Eigen::ArrayXd PhaseInc;
+    PhaseTable PhaseTrig; // Built from PhaseInc when the sequence is read
 
     QI_SEQUENCE_DECLARE(SSFP);
-    Eigen::ArrayXd weights(const double f0) const override;
+    void weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const override;
+    Eigen::MatrixXd signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
 };
 
 struct SSFPEchoSequence : SSFPSequence {
     QI_SEQUENCE_DECLARE(SSFPEcho);
     Eigen::ArrayXd signal_magnitude(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
+    void signal_magnitude_into(std::shared_ptr<Model> m, const Eigen::VectorXd &par, Eigen::Ref<Eigen::ArrayXd> out) const override;
+    Eigen::MatrixXd signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
 };
 
 struct SSFPFiniteSequence : SSFPBase {
     double Trf;
     Eigen::ArrayXd PhaseInc;
+    PhaseTable PhaseTrig; // Built from PhaseInc when the sequence is read, only for the weights
 
     QI_SEQUENCE_DECLARE(SSFPFinite);
-    Eigen::ArrayXd weights(const double f0) const override;
+    void weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const override;
 };
 
 struct SSFPGSSequence : SSFPBase {
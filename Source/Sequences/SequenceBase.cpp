@@ -10,6 +10,7 @@
  */
 
 #include "SequenceBase.h"
+#include "Macro.h"
 
 namespace QI {
 
@@ -18,7 +19,13 @@ size_t SequenceBase::count() const{
 }
 
 Eigen::ArrayXd SequenceBase::weights(const double f0) const {
-    return Eigen::ArrayXd::Ones(size()); // Default weights are constant
+    Eigen::ArrayXd w(size());
+    weights_into(f0, w);
+    return w;
+}
+
+void SequenceBase::weights_into(const double, Eigen::Ref<Eigen::ArrayXd> out) const {
+    out.setOnes(); // Default weights are constant
 }
 
 Eigen::ArrayXd SequenceBase::signal_magnitude(const std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
@@ -26,4 +33,28 @@ Eigen::ArrayXd SequenceBase::signal_magnitude(const std::shared_ptr<Model> m, co
     return c_signal.abs();
 }
 
+void SequenceBase::signal_magnitude_into(const std::shared_ptr<Model> m, const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const {
+    out = this->signal(m, p).abs();
+}
+
+Eigen::MatrixXd SequenceBase::signal_magnitude_jacobian(const std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    return NumericJacobian([&](const Eigen::VectorXd &q) -> Eigen::ArrayXd { return this->signal_magnitude(m, q); }, p);
+}
+
+Eigen::ArrayXXcd SequenceBase::signals(const std::shared_ptr<Model> m, const Eigen::ArrayXXd &p) const {
+    Eigen::ArrayXXcd result(size(), p.cols());
+    for (Eigen::Index i = 0; i < p.cols(); i++) {
+        result.col(i) = this->signal(m, p.col(i).matrix());
+    }
+    return result;
+}
+
+void SequenceBase::load(cereal::PortableBinaryInputArchive &) {
+    QI_FAIL("Binary sequence files are not supported for sequence type: " << name());
+}
+
+void SequenceBase::save(cereal::PortableBinaryOutputArchive &) const {
+    QI_FAIL("Binary sequence files are not supported for sequence type: " << name());
+}
+
 } // End namespace QI
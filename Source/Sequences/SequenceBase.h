@@ -17,6 +17,8 @@
 #include <memory>
 #include <Eigen/Core>
 #include <cereal/archives/json.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include "Macro.h"
 #include "Models.h"
 
 namespace QI {
@@ -27,24 +29,40 @@ struct SequenceBase {
     virtual Eigen::ArrayXcd signal(const std::shared_ptr<Model> m, const Eigen::VectorXd &p) const = 0;
     virtual void load(cereal::JSONInputArchive &ar) = 0;
     virtual void save(cereal::JSONOutputArchive &ar) const = 0;
+    // Binary versions store every member as is (angles in radians) so loading needs no conversion
+    virtual void load(cereal::PortableBinaryInputArchive &ar);
+    virtual void save(cereal::PortableBinaryOutputArchive &ar) const;
 
     virtual size_t count() const;
-    virtual Eigen::ArrayXd weights(double f0 = 0.0) const;
+    Eigen::ArrayXd weights(double f0 = 0.0) const;
+    // Writes the weights for off-resonance f0 straight into out, which must already be size() long
+    virtual void weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const;
     virtual Eigen::ArrayXd  signal_magnitude(const std::shared_ptr<Model> m, const Eigen::VectorXd &p) const;
+    // Writes the magnitude straight into out, which must already be size() long, for use in cost functions
+    virtual void signal_magnitude_into(const std::shared_ptr<Model> m, const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const;
+    // One row per signal and one column per parameter, by central differences unless a sequence knows better
+    virtual Eigen::MatrixXd signal_magnitude_jacobian(const std::shared_ptr<Model> m, const Eigen::VectorXd &p) const;
+    // One column of parameters per voxel in and one column of signals out, to simulate many voxels per call
+    virtual Eigen::ArrayXXcd signals(const std::shared_ptr<Model> m, const Eigen::ArrayXXd &p) const;
 };
 
 #define QI_SEQUENCE_DECLARE( N ) \
     std::string &name() const override { static std::string name = #N; return name; }\
     Eigen::ArrayXcd signal(std::shared_ptr<QI::Model> m, const Eigen::VectorXd &par) const override;\
     void load(cereal::JSONInputArchive &ar) override;\
-    void save(cereal::JSONOutputArchive &ar) const override;
+    void save(cereal::JSONOutputArchive &ar) const override;\
+    void load(cereal::PortableBinaryInputArchive &ar) override;\
+    void save(cereal::PortableBinaryOutputArchive &ar) const override;
+
+#define QI_SEQUENCE_BINARY( S, ... ) \
+    void S::load(cereal::PortableBinaryInputArchive &ar) { ar(__VA_ARGS__); }\
+    void S::save(cereal::PortableBinaryOutputArchive &ar) const { ar(__VA_ARGS__); }
 
 #define QI_SEQUENCE_LOAD( X ) \
     try {\
         ar(cereal::make_nvp(#X, X));\
     } catch (cereal::RapidJSONException &e) {\
-        std::cerr << "Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what();\
-        exit(EXIT_FAILURE);\
+        QI_FAIL("Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what());\
     };
 
 #define QI_SEQUENCE_LOAD_DEGREES( X ) \
@@ -53,8 +71,7 @@ struct SequenceBase {
         ar(cereal::make_nvp(#X, X ## _degrees));\
         X = X ## _degrees * M_PI / 180.;\
     } catch (cereal::RapidJSONException &e) {\
-        std::cerr << "Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what() << std::endl;\
-        exit(EXIT_FAILURE);\
+        QI_FAIL("Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what());\
     }
 
 #define QI_SEQUENCE_SAVE( X )\
@@ -1,4 +1,6 @@
 
+#include <cstring>
+#include <cereal/types/string.hpp>
 #include "SequenceCereal.h"
 #include "SequenceCereal.hpp"
 #include "SPGRSequence.h"
@@ -16,6 +18,7 @@ void save(cereal::JSONOutputArchive &ar, std::shared_ptr<QI::SequenceBase> const
     if QI_SAVE( SPGR )
     else if QI_SAVE( SPGREcho )
     else if QI_SAVE( SPGRFinite )
+    else if QI_SAVE( SPGRMT )
     else if QI_SAVE( MPRAGE )
     else if QI_SAVE( SSFP )
     else if QI_SAVE( SSFPEcho )
@@ -35,6 +38,7 @@ void load(cereal::JSONInputArchive &ar, std::shared_ptr<QI::SequenceBase> &sb) {
     if QI_LOAD( SPGR )
     else if QI_LOAD( SPGREcho )
     else if QI_LOAD( SPGRFinite )
+    else if QI_LOAD( SPGRMT )
     else if QI_LOAD( MPRAGE )
     else if QI_LOAD( SSFP )
     else if QI_LOAD( SSFPEcho )
@@ -50,6 +54,72 @@ void load(cereal::JSONInputArchive &ar, std::shared_ptr<QI::SequenceBase> &sb) {
 } // End namespace cereal
 
 namespace QI {
+
+namespace {
+    const char BinaryMagic[8] = {'Q', 'I', 'S', 'E', 'Q', 'B', 'I', 'N'}; // JSON can never start with Q
+    const uint32_t BinaryVersion = 1;
+}
+
+std::shared_ptr<SequenceBase> NewSequence(const std::string &name) {
+    #define QI_NEW( NAME ) \
+        (name == #NAME ) { return std::make_shared< QI::NAME ## Sequence >(); }
+    if QI_NEW( SPGR )
+    else if QI_NEW( SPGREcho )
+    else if QI_NEW( SPGRFinite )
+    else if QI_NEW( SPGRMT )
+    else if QI_NEW( MPRAGE )
+    else if QI_NEW( MP2RAGE )
+    else if QI_NEW( SSFP )
+    else if QI_NEW( SSFPEcho )
+    else if QI_NEW( SSFPFinite )
+    else if QI_NEW( SSFPGS )
+    else if QI_NEW( SSFPEllipse )
+    else if QI_NEW( SSFPMT )
+    else if QI_NEW( MultiEcho )
+    else if QI_NEW( CASL )
+    else if (name == "SequenceGroup") { return std::make_shared<QI::SequenceGroup>(); }
+    else { QI_FAIL("Unknown sequence type: " << name); }
+    #undef QI_NEW
+}
+
+bool IsBinarySequence(std::istream &is) {
+    return is.peek() == BinaryMagic[0];
+}
+
+void WriteSequenceBinary(const SequenceBase &s, std::ostream &os) {
+    os.write(BinaryMagic, sizeof(BinaryMagic));
+    {
+        cereal::PortableBinaryOutputArchive archive(os);
+        archive(BinaryVersion, s.name());
+        s.save(archive);
+    }
+    if (!os) {
+        QI_FAIL("Failed to write binary sequence " << s.name());
+    }
+}
+
+void ReadSequenceBinary(std::istream &is, SequenceBase &s) {
+    char magic[sizeof(BinaryMagic)];
+    if (!is.read(magic, sizeof(magic)) || std::memcmp(magic, BinaryMagic, sizeof(magic)) != 0) {
+        QI_FAIL("Input is not a binary sequence file");
+    }
+    cereal::PortableBinaryInputArchive archive(is);
+    uint32_t version;
+    std::string name;
+    try {
+        archive(version, name);
+        if (version != BinaryVersion) {
+            QI_FAIL("Binary sequence file is version " << version << ", expected " << BinaryVersion << ". Regenerate it from the JSON");
+        }
+        if (name != s.name()) {
+            QI_FAIL("Expected sequence " << s.name() << " but binary file contains " << name);
+        }
+        s.load(archive);
+    } catch (cereal::Exception &e) {
+        QI_FAIL("Error reading binary sequence " << s.name() << "\n" << e.what());
+    }
+}
+
     #define QI_READSEQ( Seq ) \
         template auto ReadSequence< Seq >(cereal::JSONInputArchive &in_archive, bool verbose, std::ostream &os = std::cout) -> Seq;\
         template auto ReadSequence< Seq >(std::istream &is, bool verbose, std::ostream &os = std::cout) -> Seq;
@@ -57,6 +127,7 @@ namespace QI {
     QI_READSEQ( SPGRSequence )
     QI_READSEQ( SPGREchoSequence )
     QI_READSEQ( SPGRFiniteSequence )
+    QI_READSEQ( SPGRMTSequence )
     QI_READSEQ( MPRAGESequence )
     QI_READSEQ( SSFPSequence )
     QI_READSEQ( SSFPEchoSequence )
@@ -23,7 +23,18 @@ extern TSeq ReadSequence(cereal::JSONInputArchive &in_archive,
                          std::ostream &os = std::cout);
 
 template<typename TSeq>
-extern TSeq ReadSequence(std::istream &is, bool verbose, std::ostream &os = std::cout);
+extern TSeq ReadSequence(std::istream &is, bool verbose, std::ostream &os = std::cout); //!< Also reads binary files
+
+std::shared_ptr<SequenceBase> NewSequence(const std::string &name); //!< Default-constructed sequence of the named type
+
+/*
+ * Pre-parsed sequence files, written once (e.g. with qi_sequence --save-binary) and then read by
+ * any program instead of the JSON, so jobs skip the parsing and unit conversion at start-up.
+ * The file starts with a magic string, so ReadSequence tells the two apart by itself.
+ */
+bool IsBinarySequence(std::istream &is);
+void WriteSequenceBinary(const SequenceBase &s, std::ostream &os);
+void ReadSequenceBinary(std::istream &is, SequenceBase &s); //!< s must be the type stored in the file
 
 } // End namespace QI
 
@@ -39,6 +39,18 @@ TSeq ReadSequence(cereal::JSONInputArchive &in_archive, bool verbose, std::ostre
 
 template<typename TSeq>
 TSeq ReadSequence(std::istream &is, bool verbose, std::ostream &os) {
+    if (IsBinarySequence(is)) {
+        TSeq sequence;
+        ReadSequenceBinary(is, sequence);
+        if (verbose) {
+            {
+                cereal::JSONOutputArchive archive(std::cout);
+                archive(cereal::make_nvp(sequence.name(), sequence));
+            }
+            std::cout << std::endl;
+        }
+        return sequence;
+    }
     cereal::JSONInputArchive in_archive(is);
     return ReadSequence<TSeq>(in_archive, verbose, os);
 }
@@ -10,6 +10,7 @@
  */
 
 #include "SequenceGroup.h"
+#include "SequenceCereal.h"
 
 namespace QI {
 
@@ -30,28 +31,72 @@ size_t SequenceGroup::size() const {
 
 Eigen::ArrayXcd SequenceGroup::signal(std::shared_ptr<Model> m,
                                       const Eigen::VectorXd &p) const {
+    if (sequences.size() == 1) {
+        return sequences.front()->signal(m, p); // Nothing to concatenate, skip the copy
+    }
     Eigen::ArrayXcd result(size());
     size_t start = 0;
     for (auto &sig : sequences) {
-        Eigen::ArrayXcd thisResult = sig->signal(m, p);
-        result.segment(start, sig->size()) = thisResult;
+        result.segment(start, sig->size()) = sig->signal(m, p);
         start += sig->size();
     }
     return result;
 }
 
-Eigen::ArrayXd SequenceGroup::weights(const double f0) const {
-    Eigen::ArrayXd weights(size());
-    size_t start = 0;
+/*
+ * Each sequence writes into its own segment, so there is no concatenated complex signal to allocate
+ */
+void SequenceGroup::signal_magnitude_into(std::shared_ptr<Model> m, const Eigen::VectorXd &p, Eigen::Ref<Eigen::ArrayXd> out) const {
+    eigen_assert(static_cast<size_t>(out.rows()) == size());
+    Eigen::Index start = 0;
+    for (auto &sig : sequences) {
+        sig->signal_magnitude_into(m, p, out.segment(start, sig->size()));
+        start += sig->size();
+    }
+}
+
+Eigen::MatrixXd SequenceGroup::signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &p) const {
+    Eigen::MatrixXd jac(size(), p.rows());
+    Eigen::Index start = 0;
+    for (auto &sig : sequences) {
+        jac.middleRows(start, sig->size()) = sig->signal_magnitude_jacobian(m, p);
+        start += sig->size();
+    }
+    return jac;
+}
+
+void SequenceGroup::weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const {
+    eigen_assert(static_cast<size_t>(out.rows()) == size());
+    Eigen::Index start = 0;
     for (auto &sig : sequences) {
-        weights.segment(start, sig->size()) = sig->weights(f0);
+        sig->weights_into(f0, out.segment(start, sig->size()));
         start += sig->size();
     }
-    return weights;
 }
 
 void SequenceGroup::addSequence(const std::shared_ptr<SequenceBase> &w) {
     sequences.push_back(w);
 }
 
+void SequenceGroup::save(cereal::PortableBinaryOutputArchive &archive) const {
+    archive(cereal::make_size_tag(static_cast<cereal::size_type>(sequences.size())));
+    for (const auto &s : sequences) {
+        archive(s->name());
+        s->save(archive);
+    }
+}
+
+void SequenceGroup::load(cereal::PortableBinaryInputArchive &archive) {
+    cereal::size_type n;
+    archive(cereal::make_size_tag(n));
+    sequences.clear();
+    for (cereal::size_type i = 0; i < n; i++) {
+        std::string name;
+        archive(name);
+        std::shared_ptr<SequenceBase> s = NewSequence(name);
+        s->load(archive);
+        sequences.push_back(s);
+    }
+}
+
 } // End namespace QI
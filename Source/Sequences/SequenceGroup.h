@@ -28,7 +28,9 @@ struct SequenceGroup : SequenceBase {
     size_t count() const override;
     size_t size() const override;
     Eigen::ArrayXcd signal(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
-    Eigen::ArrayXd weights(const double f0 = 0.0) const override;
+    void signal_magnitude_into(std::shared_ptr<Model> m, const Eigen::VectorXd &par, Eigen::Ref<Eigen::ArrayXd> out) const override;
+    Eigen::MatrixXd signal_magnitude_jacobian(std::shared_ptr<Model> m, const Eigen::VectorXd &par) const override;
+    void weights_into(const double f0, Eigen::Ref<Eigen::ArrayXd> out) const override;
 
     void addSequence(const std::shared_ptr<SequenceBase> &s);
 
@@ -40,6 +42,9 @@ struct SequenceGroup : SequenceBase {
         archive(CEREAL_NVP(sequences));
     }
 
+    void save(cereal::PortableBinaryOutputArchive &archive) const override;
+    void load(cereal::PortableBinaryInputArchive &archive) override;
+
 };
 
 } // End namespace QI
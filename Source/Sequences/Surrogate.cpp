@@ -0,0 +1,249 @@
+/*
+ *  Surrogate.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdint>
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <functional>
+#include <Eigen/QR>
+
+#include "Surrogate.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+Surrogate::Surrogate(const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+                     const Eigen::ArrayXXd &bounds, const int order, const bool verbose) :
+    m_bounds(bounds), m_order(order)
+{
+    if (static_cast<size_t>(bounds.rows()) != model->nParameters() || bounds.cols() != 2) {
+        QI_EXCEPTION("Surrogate bounds must be " << model->nParameters() << " x 2 for model " << model->Name());
+    }
+    if (order < 1) {
+        QI_EXCEPTION("Surrogate order must be at least 1");
+    }
+    for (Eigen::Index p = 0; p < bounds.rows(); p++) {
+        if (bounds(p, 1) > bounds(p, 0)) {
+            m_free.push_back(p);
+        }
+    }
+    buildTerms();
+    // A few samples per term keeps the fit well-determined, the rest are held out to check it
+    const size_t nTrain = 4 * nTerms();
+    const size_t nTest = std::max<size_t>(1000, nTerms());
+    if (verbose) std::cout << "Building order " << order << " surrogate of " << model->Name() << " with " << nTerms()
+                           << " terms from " << nTrain << " samples" << std::endl;
+
+    // Fixed seed, so the same key always gives the same surrogate
+    std::mt19937_64 rng(0);
+    std::uniform_real_distribution<double> uniform(0., 1.);
+    Eigen::ArrayXXd samples(bounds.rows(), nTrain + nTest);
+    for (Eigen::Index s = 0; s < samples.cols(); s++) {
+        for (int tries = 0; ; tries++) {
+            samples.col(s) = bounds.col(0) + (bounds.col(1) - bounds.col(0)) * Eigen::ArrayXd::NullaryExpr(bounds.rows(), [&]() { return uniform(rng); });
+            if (model->ValidParameters(samples.col(s).matrix())) {
+                break;
+            } else if (tries == 100) {
+                QI_EXCEPTION("Could not draw valid surrogate samples for model " << model->Name());
+            }
+        }
+    }
+    Eigen::ArrayXXd exact(sequence.size(), samples.cols());
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min<size_t>(pool.size(), samples.cols()));
+    pool.run(nTasks, [&](const size_t t) {
+        Eigen::ArrayXd s(sequence.size());
+        const Eigen::Index n = samples.cols();
+        for (Eigen::Index c = (n * t) / nTasks; c < static_cast<Eigen::Index>((n * (t + 1)) / nTasks); c++) {
+            sequence.signal_magnitude_into(model, samples.col(c).matrix(), s);
+            exact.col(c) = s;
+        }
+    });
+    // Samples the exact model cannot evaluate would spoil the whole fit
+    std::vector<Eigen::Index> train, test;
+    for (Eigen::Index c = 0; c < samples.cols(); c++) {
+        if (exact.col(c).isFinite().all()) {
+            (static_cast<size_t>(c) < nTrain ? train : test).push_back(c);
+        }
+    }
+    if (train.size() < nTerms() || test.empty()) {
+        QI_EXCEPTION("Too few finite signals to build a surrogate of " << model->Name());
+    }
+    auto gather = [&](const std::vector<Eigen::Index> &cols, Eigen::ArrayXXd &p, Eigen::ArrayXXd &y) {
+        p.resize(samples.rows(), cols.size());
+        y.resize(exact.rows(), cols.size());
+        for (size_t i = 0; i < cols.size(); i++) {
+            p.col(i) = samples.col(cols[i]);
+            y.col(i) = exact.col(cols[i]);
+        }
+    };
+    Eigen::ArrayXXd p, y;
+    Eigen::MatrixXd terms;
+    gather(train, p, y);
+    evaluateTerms(p, terms);
+    m_coeffs = terms.transpose().colPivHouseholderQr().solve(y.matrix().transpose()).transpose();
+    gather(test, p, y);
+    Eigen::ArrayXXd predicted(y.rows(), y.cols());
+    signals(p, predicted);
+    m_error = std::sqrt((predicted - y).square().sum() / y.square().sum());
+    if (verbose) std::cout << "Surrogate relative RMS error on " << test.size() << " held-out samples: " << m_error << std::endl;
+}
+
+size_t Surrogate::size() const { return m_coeffs.rows(); }
+size_t Surrogate::nTerms() const { return m_terms.size(); }
+double Surrogate::error() const { return m_error; }
+
+bool Surrogate::contains(const Eigen::ArrayXXd &bounds) const {
+    return bounds.rows() == m_bounds.rows() &&
+           (bounds.col(0) >= m_bounds.col(0)).all() && (bounds.col(1) <= m_bounds.col(1)).all();
+}
+
+/*
+ * Every combination of degrees for the free parameters with a total of at most m_order, so
+ * C(free + order, order) terms. Only the non-zero degrees are kept for each.
+ */
+void Surrogate::buildTerms() {
+    m_terms.clear();
+    std::vector<std::pair<int, int>> current;
+    std::function<void (int, int)> add = [&](const int v, const int left) -> void {
+        if (v == static_cast<int>(m_free.size())) {
+            m_terms.push_back(current);
+            return;
+        }
+        for (int d = 0; d <= left; d++) {
+            if (d > 0) current.push_back(std::make_pair(v, d));
+            add(v + 1, left - d);
+            if (d > 0) current.pop_back();
+        }
+    };
+    add(0, m_order);
+}
+
+void Surrogate::evaluateTerms(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::MatrixXd &terms) const {
+    terms.resize(nTerms(), params.cols());
+    Eigen::ArrayXXd cheb(m_order + 1, m_free.size());
+    for (Eigen::Index s = 0; s < params.cols(); s++) {
+        for (size_t v = 0; v < m_free.size(); v++) {
+            const int p = m_free[v];
+            const double x = 2. * (params(p, s) - m_bounds(p, 0)) / (m_bounds(p, 1) - m_bounds(p, 0)) - 1.;
+            cheb(0, v) = 1.;
+            cheb(1, v) = x;
+            for (int k = 2; k <= m_order; k++) {
+                cheb(k, v) = 2. * x * cheb(k - 1, v) - cheb(k - 2, v);
+            }
+        }
+        for (size_t t = 0; t < nTerms(); t++) {
+            double value = 1.;
+            for (const auto &f : m_terms[t]) {
+                value *= cheb(f.second, f.first);
+            }
+            terms(t, s) = value;
+        }
+    }
+}
+
+void Surrogate::signals(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::Ref<Eigen::ArrayXXd> out) const {
+    Eigen::MatrixXd terms;
+    evaluateTerms(params, terms);
+    out.matrix().noalias() = m_coeffs * terms;
+}
+
+std::string Surrogate::Key(const SequenceBase &sequence, const Model &model, const Eigen::ArrayXXd &bounds, const int order) {
+    std::stringstream key;
+    key << model.Name() << " scale " << model.scaleToMean() << " order " << order << "\n"
+        << std::setprecision(17) << bounds << "\n";
+    {
+        cereal::JSONOutputArchive archive(key);
+        archive(cereal::make_nvp(sequence.name(), sequence));
+    }
+    return key.str();
+}
+
+/*
+ * Cache files are named by an FNV-1a hash of the key, and hold the whole key to rule out
+ * collisions. They are native binary, only meant to be re-read on the same machine.
+ */
+std::shared_ptr<const Surrogate> Surrogate::Cached(const std::string &dir,
+                                                   const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+                                                   const Eigen::ArrayXXd &bounds, const int order, const bool verbose) {
+    const std::string key = Key(sequence, *model, bounds, order);
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : key) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    std::stringstream path;
+    path << dir << "/" << model->Name() << "_surrogate_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+    std::ifstream in(path.str(), std::ios::binary);
+    if (in) {
+        std::shared_ptr<Surrogate> cached(new Surrogate());
+        if (cached->read(in, key)) {
+            if (verbose) std::cout << "Read surrogate from " << path.str() << ", relative RMS error " << cached->error() << std::endl;
+            return cached;
+        }
+    }
+    auto surrogate = std::make_shared<Surrogate>(sequence, model, bounds, order, verbose);
+    std::ofstream out(path.str(), std::ios::binary | std::ios::trunc);
+    if (out) {
+        surrogate->write(out, key);
+        if (verbose) std::cout << "Cached surrogate in " << path.str() << std::endl;
+    } else {
+        std::cerr << "Could not open " << path.str() << " to cache the surrogate" << std::endl;
+    }
+    return surrogate;
+}
+
+void Surrogate::write(std::ostream &os, const std::string &key) const {
+    auto put = [&](const void *data, const size_t bytes) { os.write(static_cast<const char *>(data), bytes); };
+    const uint64_t keySize = key.size(), rows = m_coeffs.rows(), cols = m_coeffs.cols(), nP = m_bounds.rows(), nFree = m_free.size();
+    put(&keySize, sizeof(keySize));
+    put(key.data(), key.size());
+    put(&nP, sizeof(nP));
+    put(m_bounds.data(), m_bounds.size() * sizeof(double));
+    put(&nFree, sizeof(nFree));
+    put(m_free.data(), m_free.size() * sizeof(int));
+    put(&m_order, sizeof(m_order));
+    put(&m_error, sizeof(m_error));
+    put(&rows, sizeof(rows));
+    put(&cols, sizeof(cols));
+    put(m_coeffs.data(), m_coeffs.size() * sizeof(double));
+}
+
+bool Surrogate::read(std::istream &is, const std::string &key) {
+    auto get = [&](void *data, const size_t bytes) { return static_cast<bool>(is.read(static_cast<char *>(data), bytes)); };
+    uint64_t keySize = 0, rows = 0, cols = 0, nP = 0, nFree = 0;
+    if (!get(&keySize, sizeof(keySize)) || keySize != key.size()) {
+        return false;
+    }
+    std::string stored(keySize, '\0');
+    if (!get(&stored[0], keySize) || stored != key || !get(&nP, sizeof(nP))) {
+        return false;
+    }
+    m_bounds.resize(nP, 2);
+    if (!get(m_bounds.data(), m_bounds.size() * sizeof(double)) || !get(&nFree, sizeof(nFree))) {
+        return false;
+    }
+    m_free.resize(nFree);
+    if (!get(m_free.data(), nFree * sizeof(int)) || !get(&m_order, sizeof(m_order)) || !get(&m_error, sizeof(m_error)) ||
+        !get(&rows, sizeof(rows)) || !get(&cols, sizeof(cols))) {
+        return false;
+    }
+    buildTerms();
+    if (cols != nTerms()) {
+        return false;
+    }
+    m_coeffs.resize(rows, cols);
+    return get(m_coeffs.data(), m_coeffs.size() * sizeof(double));
+}
+
+} // End namespace QI
@@ -0,0 +1,71 @@
+/*
+ *  Surrogate.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SEQUENCES_SURROGATE_H
+#define SEQUENCES_SURROGATE_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <utility>
+#include <Eigen/Core>
+#include "SequenceBase.h"
+#include "Model.h"
+
+namespace QI {
+
+/*
+ * A polynomial emulator of a sequence's signal magnitudes over a box of model parameters, for
+ * models where every exact signal is expensive (e.g. the steady-state solves of MCD3). Each free
+ * parameter is mapped to [-1, 1] over the box, and every signal is a least-squares fit of all
+ * products of Chebyshev polynomials up to a total order, so a batch of samples is one matrix
+ * product. The fit is checked against the exact signals on held-out samples, and error() is the
+ * RMS difference relative to the RMS signal.
+ */
+class Surrogate {
+public:
+    Surrogate(const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+              const Eigen::ArrayXXd &bounds, // nParameters x 2, rows with equal bounds are fixed
+              const int order, const bool verbose = false);
+
+    // Stable across runs, for naming cached surrogates. Covers everything the constructor uses.
+    static std::string Key(const SequenceBase &sequence, const Model &model, const Eigen::ArrayXXd &bounds, const int order);
+    // Re-use a cached surrogate with this key from the directory, or build and cache it there
+    static std::shared_ptr<const Surrogate> Cached(const std::string &dir,
+                                                   const SequenceBase &sequence, const std::shared_ptr<Model> &model,
+                                                   const Eigen::ArrayXXd &bounds, const int order, const bool verbose = false);
+
+    size_t size() const;   // Signals per sample
+    size_t nTerms() const;
+    double error() const;
+    bool contains(const Eigen::ArrayXXd &bounds) const; // Is every sample within these bounds inside the box?
+    // Signals for one sample per column of params (nParameters x n) into out (size x n)
+    void signals(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::Ref<Eigen::ArrayXXd> out) const;
+
+protected:
+    Surrogate() {}
+    void write(std::ostream &os, const std::string &key) const;
+    bool read(std::istream &is, const std::string &key); // False if the file is for a different key
+
+    Eigen::ArrayXXd m_bounds;
+    std::vector<int> m_free;                            // Indices of the parameters that vary in the box
+    int m_order = 0;
+    std::vector<std::vector<std::pair<int, int>>> m_terms; // (free parameter, degree) for each non-constant factor
+    Eigen::MatrixXd m_coeffs;                           // size x terms
+    double m_error = 0;
+
+    void buildTerms();
+    void evaluateTerms(const Eigen::Ref<const Eigen::ArrayXXd> &params, Eigen::MatrixXd &terms) const; // terms x samples
+};
+
+} // End namespace QI
+
+#endif // SEQUENCES_SURROGATE_H
@@ -9,6 +9,7 @@
  *
  */
 
+#include <complex>
 #include "Common.h"
 
 using namespace std;
@@ -25,6 +26,10 @@ typedef Matrix<double, 9, 9> Matrix9d;
 typedef Matrix<double, 9, 1> Vector9d;
 typedef Matrix<double, 3, Dynamic> MagVector;
 
+PhaseTable::PhaseTable(const ArrayXd &phi) :
+    cosine(phi.cos()), sine(phi.sin())
+{}
+
 // Sum a multi-component magnetisation vector
 MagVector SumMC(const MatrixXd &M_in) {
     MagVector M_out = M_in.topRows(3);
@@ -101,4 +106,68 @@ const void CalcExchange(const double tau_a, const double f_a, double &f_b, doubl
     }
 }
 
+namespace {
+
+/*
+ * exp(M) for a 2x2 matrix, from M = m*I + N where N*N = q^2*I, so exp(M) = e^m*(cosh(q)*I + sinh(q)/q*N).
+ * q can be imaginary, so always works in complex.
+ */
+Matrix2cd Exp2(const Matrix2cd &M) {
+    const complex<double> m = 0.5 * (M(0,0) + M(1,1));
+    const complex<double> h = 0.5 * (M(0,0) - M(1,1));
+    const complex<double> q = sqrt(h*h + M(0,1)*M(1,0));
+    const complex<double> q2 = q*q;
+    // Series for sinh(q)/q when q is small, the next term is q^6/5040
+    const complex<double> sinhc = (abs(q) < 1.e-3) ? (1. + q2/6. + q2*q2/120.) : sinh(q) / q;
+    const complex<double> em = exp(m);
+    const complex<double> diag = em * cosh(q);
+    const complex<double> offd = em * sinhc;
+    Matrix2cd E;
+    E << diag + offd*h,     offd*M(0,1),
+              offd*M(1,0), diag - offd*h;
+    return E;
+}
+
+} // End anonymous namespace
+
+const Matrix3d FreePrecession(cdbl T1, cdbl T2, cdbl f0, cdbl t) {
+    // Matches the sign convention in OffResonance
+    const double theta = 2. * M_PI * f0 * t;
+    const double E2 = exp(-t / T2);
+    const double c = E2 * cos(theta), s = E2 * sin(theta);
+    Matrix3d E;
+    E << c, -s, 0,
+         s,  c, 0,
+         0,  0, exp(-t / T1);
+    return E;
+}
+
+const Matrix6d FreePrecession(cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
+                              cdbl k_ab, cdbl k_ba, cdbl f0_a, cdbl f0_b, cdbl t) {
+    // Transverse magnetisation x + iy of both pools
+    Matrix2cd T;
+    T << complex<double>(-1./T2_a - k_ab, 2.*M_PI*f0_a), k_ba,
+         k_ab, complex<double>(-1./T2_b - k_ba, 2.*M_PI*f0_b);
+    const Matrix2cd ET = Exp2(t * T);
+    const Matrix2d EL = LongitudinalExchange(T1_a, T1_b, k_ab, k_ba, t);
+    Matrix6d E = Matrix6d::Zero();
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            E(3*i, 3*j)     =  ET(i, j).real();
+            E(3*i, 3*j + 1) = -ET(i, j).imag();
+            E(3*i + 1, 3*j) =  ET(i, j).imag();
+            E(3*i + 1, 3*j + 1) = ET(i, j).real();
+            E(3*i + 2, 3*j + 2) = EL(i, j);
+        }
+    }
+    return E;
+}
+
+const Matrix2d LongitudinalExchange(cdbl T1_a, cdbl T1_b, cdbl k_ab, cdbl k_ba, cdbl t) {
+    Matrix2d L;
+    L << -1./T1_a - k_ab,             k_ba,
+                    k_ab, -1./T1_b - k_ba;
+    return Exp2((t * L).cast<complex<double>>()).real();
+}
+
 } // End namespace QI
@@ -12,11 +12,15 @@
 #ifndef SIGNALS_COMMON_H
 #define SIGNALS_COMMON_H
 
+#include <cmath>
 #include <iostream>
 #include <exception>
+#include <utility>
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 
+#include "Arena.h"
+
 namespace QI {
 
 //******************************************************************************
@@ -42,6 +46,106 @@ const Eigen::Matrix3d Spoiling();
 const Matrix6d Exchange(cdbl &k_ab, cdbl &k_ba);
 const void CalcExchange(cdbl tau_a, cdbl f_a, double &f_b, double &k_ab, double &k_ba);
 
+/*
+ * Propagators for the Bloch matrices above. Between pulses the transverse and longitudinal parts
+ * decouple, the transverse part of each pool is a rotation by the off-resonance times the T2 decay,
+ * so these are closed-form instead of a general matrix exponential. With exchange each part is a
+ * 2x2 system (complex for the transverse), which also has a closed-form exponential.
+ */
+const Eigen::Matrix3d FreePrecession(cdbl T1, cdbl T2, cdbl f0, cdbl t);    //!< exp(-t*(Relax + OffResonance))
+const Matrix6d FreePrecession(cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
+                              cdbl k_ab, cdbl k_ba, cdbl f0_a, cdbl f0_b, cdbl t); //!< As above plus Exchange
+const Eigen::Matrix2d LongitudinalExchange(cdbl T1_a, cdbl T1_b, cdbl k_ab, cdbl k_ba, cdbl t);
+
+/*
+ * exp(X) for the fixed-size matrices during an RF pulse, where the rotation and relaxation do not
+ * commute. Degree 12 Taylor evaluated in blocks of Y^4 (Paterson-Stockmeyer, 6 products) on X scaled
+ * to norm 0.5 or less, then squared back. The truncation error is below 1e-13, without the norm
+ * estimates and LU solve of the general Pade version in unsupported/MatrixFunctions.
+ */
+template<int N>
+Eigen::Matrix<double, N, N> PulsePropagator(const Eigen::Matrix<double, N, N> &X) {
+    typedef Eigen::Matrix<double, N, N> TMatrix;
+    static const double c[13] = {1., 1., 1./2, 1./6, 1./24, 1./120, 1./720, 1./5040, 1./40320,
+                                 1./362880, 1./3628800, 1./39916800, 1./479001600};
+    const double norm = X.cwiseAbs().rowwise().sum().maxCoeff();
+    int s = 0;
+    if (norm > 0.5) std::frexp(norm / 0.5, &s);
+    const TMatrix I = TMatrix::Identity();
+    const TMatrix Y = X * std::ldexp(1.0, -s);
+    const TMatrix Y2 = Y * Y;
+    const TMatrix Y3 = Y2 * Y;
+    const TMatrix Y4 = Y2 * Y2;
+    TMatrix E = c[8]*I + c[9]*Y + c[10]*Y2 + c[11]*Y3 + c[12]*Y4;
+    E = c[4]*I + c[5]*Y + c[6]*Y2 + c[7]*Y3 + Y4 * E;
+    E = c[0]*I + c[1]*Y + c[2]*Y2 + c[3]*Y3 + Y4 * E;
+    for (int i = 0; i < s; i++) {
+        E = E * E;
+    }
+    return E;
+}
+
+/*
+ * The SSFP equations need the cosine and sine of each phase increment plus the off-resonance
+ * angle. The increments are fixed by the sequence, so it builds this table once when it is read,
+ * and the equations rotate it by the off-resonance with one cos & sin instead of one per increment.
+ * Implicit so plain arrays of increments (in radians) also work, but then the table is rebuilt each call.
+ */
+struct PhaseTable {
+    Eigen::ArrayXd cosine, sine;
+    PhaseTable() = default;
+    PhaseTable(const Eigen::ArrayXd &phi);
+    Eigen::Index size() const { return cosine.size(); }
+};
+
+/*
+ * Temporaries for a kernel of size N. The fixed sizes are plain arrays on the stack, Eigen::Dynamic
+ * gets a map onto the thread's QI::Arena, so the kernels of other sizes do not call the allocator
+ * for each one. Open a Scope before making any, the maps are only valid until it ends.
+ */
+template<typename T, int N>
+struct Scratch {
+    typedef Eigen::Array<T, N, 1> Type;
+    struct Scope { Scope() {} };
+    static Type make(const Eigen::Index n) { return Type(n); }
+    template<typename Derived>
+    static Type make(const Eigen::ArrayBase<Derived> &e) { return Type(e); }
+};
+
+template<typename T>
+struct Scratch<T, Eigen::Dynamic> {
+    typedef Eigen::Map<Eigen::Array<T, Eigen::Dynamic, 1>, Eigen::AlignedMax> Type;
+    typedef QI::ArenaScope Scope;
+    static Type make(const Eigen::Index n) { return Arena::Local().array<T>(n); }
+    template<typename Derived>
+    static Type make(const Eigen::ArrayBase<Derived> &e) {
+        Type t = make(e.size());
+        t = e;
+        return t;
+    }
+};
+
+/*
+ * Protocols only use a handful of sizes, so signal kernels are instantiated for those and picked at
+ * run-time. Eigen then keeps the temporaries on the stack and can unroll the loops. Kernel must have
+ * a static template<int N> run(...), any other size uses the Eigen::Dynamic version.
+ *
+ * The kernels stay in double precision. The multi-component solves are small fixed-size systems
+ * whose cost is latency rather than SIMD width, and a float version measured no faster.
+ */
+template<typename Kernel, typename... Args>
+auto DispatchFixedSize(const Eigen::Index n, Args&&... args) -> decltype(Kernel::template run<Eigen::Dynamic>(std::forward<Args>(args)...)) {
+    switch (n) {
+        case 2:  return Kernel::template run<2>(std::forward<Args>(args)...);
+        case 4:  return Kernel::template run<4>(std::forward<Args>(args)...);
+        case 6:  return Kernel::template run<6>(std::forward<Args>(args)...);
+        case 8:  return Kernel::template run<8>(std::forward<Args>(args)...);
+        case 12: return Kernel::template run<12>(std::forward<Args>(args)...);
+        case 16: return Kernel::template run<16>(std::forward<Args>(args)...);
+        default: return Kernel::template run<Eigen::Dynamic>(std::forward<Args>(args)...);
+    }
+}
+
 } // End namespace QI
 
 #endif // SIGNALS_COMMON_H
\ No newline at end of file
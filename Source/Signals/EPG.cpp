@@ -0,0 +1,59 @@
+/*
+ *  EPG.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include "EPG.h"
+
+using namespace Eigen;
+
+namespace QI {
+
+/*
+ * With the refocusing pulses 90° out of phase with the excitation all the states stay real. Each
+ * echo spacing is relaxation and dephasing over ESP/2, the refocusing pulse, then the same again.
+ * F+ and F- are stored separately, and F-(0) is the conjugate of F+(0).
+ */
+ArrayXd EPG_CPMG(const int ETL, cdbl ESP, cdbl T1, cdbl T2, cdbl refocus) {
+    const int nStates = 2 * ETL + 2;
+    ArrayXd Fp = ArrayXd::Zero(nStates), Fm = ArrayXd::Zero(nStates), Z = ArrayXd::Zero(nStates);
+    const double E1 = exp(-0.5 * ESP / T1), E2 = exp(-0.5 * ESP / T2);
+    const double c2 = pow(cos(refocus / 2), 2), s2 = pow(sin(refocus / 2), 2);
+    const double sa = sin(refocus), ca = cos(refocus);
+    auto relax_shift = [&](const int k) {
+        Fp.head(k + 1) *= E2;
+        Fm.head(k + 1) *= E2;
+        Z.head(k + 1) *= E1;
+        Z[0] += 1. - E1;
+        for (int i = k + 1; i > 0; i--) {
+            Fp[i] = Fp[i - 1];
+        }
+        for (int i = 0; i <= k; i++) {
+            Fm[i] = Fm[i + 1];
+        }
+        Fp[0] = Fm[0];
+    };
+    Fp[0] = 1.;
+    ArrayXd echoes(ETL);
+    for (int e = 0; e < ETL; e++) {
+        const int k = 2 * e; // Highest occupied state before this echo spacing
+        relax_shift(k);
+        for (int i = 0; i <= k + 1; i++) {
+            const double fp = Fp[i], fm = Fm[i], z = Z[i];
+            Fp[i] = c2 * fp + s2 * fm + sa * z;
+            Fm[i] = s2 * fp + c2 * fm - sa * z;
+            Z[i]  = -0.5 * sa * fp + 0.5 * sa * fm + ca * z;
+        }
+        relax_shift(k + 1);
+        echoes[e] = std::abs(Fp[0]);
+    }
+    return echoes;
+}
+
+} // End namespace QI
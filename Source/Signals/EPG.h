@@ -0,0 +1,28 @@
+/*
+ *  EPG.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SIGNALS_EPG_H
+#define SIGNALS_EPG_H
+
+#include "Common.h"
+
+namespace QI {
+
+/*
+ * Echo amplitudes of a CPMG train with a perfect 90° excitation and refocusing pulses of the
+ * given angle, from the Extended Phase Graph. Stimulated echoes make the decay depart from a
+ * single exponential when the refocusing angle is below 180°.
+ */
+Eigen::ArrayXd EPG_CPMG(const int ETL, cdbl ESP, cdbl T1, cdbl T2, cdbl refocus);
+
+} // End namespace QI
+
+#endif // SIGNALS_EPG_H
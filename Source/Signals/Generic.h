@@ -0,0 +1,258 @@
+/*
+ *  Generic.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef SIGNALS_GENERIC_H
+#define SIGNALS_GENERIC_H
+
+#include <cmath>
+#include <limits>
+#include <Eigen/Core>
+#include <Eigen/LU>
+
+#include "Common.h"
+
+namespace QI {
+namespace Generic {
+
+/*
+ * Versions of the signal equations templated on the parameter type, so they can be evaluated
+ * with ceres::Jet to get exact derivatives. The sequence parameters stay as doubles. std::complex
+ * does not work with Jets, so the signals are returned as real & imaginary columns. The double
+ * versions elsewhere are specialised for speed and remain what the forward fits use.
+ */
+template<typename T> using Signal = Eigen::Array<T, Eigen::Dynamic, 2>;
+
+template<typename T>
+void CalcExchange(const T &tau_a, const T &f_a, T &f_b, T &k_ab, T &k_ba) {
+    const double feps = std::numeric_limits<float>::epsilon(); // Because we read from float files
+    f_b = 1. - f_a;
+    if ((f_a >= 1. - feps) || (f_a <= feps)) {
+        // Only have 1 component, so no exchange
+        k_ab = T(0.);
+        k_ba = T(0.);
+    } else {
+        k_ab = 1. / tau_a;
+        k_ba = k_ab * f_a / f_b;
+    }
+}
+
+template<typename T>
+Signal<T> One_SPGR(carrd &flip, cdbl TR, const T &PD, const T &T1, const T &B1) {
+    using std::exp; using std::sin; using std::cos;
+    const T E1 = exp(-TR / T1);
+    Signal<T> s(flip.rows(), 2);
+    for (Eigen::Index i = 0; i < flip.rows(); i++) {
+        const T a = B1 * flip[i];
+        s(i, 0) = PD * (1. - E1) * sin(a) / (1. - E1*cos(a));
+        s(i, 1) = T(0.);
+    }
+    return s;
+}
+
+template<typename T>
+Signal<T> One_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR,
+                   const T &PD, const T &T1, const T &T2, const T &f0, const T &B1) {
+    using std::exp; using std::sin; using std::cos;
+    eigen_assert(flip.size() == phi.size());
+    const T E1 = exp(-TR / T1);
+    const T E2 = exp(-TR / T2);
+    const T psi = 2. * M_PI * TR * f0;
+    const T cpsi = cos(psi), spsi = sin(psi);
+    Signal<T> s(flip.rows(), 2);
+    for (Eigen::Index i = 0; i < flip.rows(); i++) {
+        const T a = B1 * flip[i];
+        const T ca = cos(a);
+        const T cth = phi.cosine[i]*cpsi - phi.sine[i]*spsi;
+        const T sth = phi.sine[i]*cpsi + phi.cosine[i]*spsi;
+        const T d = 1. - E1*E2*E2 - (E1 - E2*E2)*ca;
+        const T G = -PD*(1. - E1)*sin(a)/d;
+        const T b = E2*(1. - E1)*(1. + ca)/d;
+        const T denom = 1. - b*cth;
+        s(i, 0) = G*(1. - E2*cth) / denom;
+        s(i, 1) = G*E2*sth / denom;
+    }
+    return s;
+}
+
+/*
+ * exp(M) for a real 2x2 matrix with real eigenvalues, which relaxation with exchange always has
+ */
+template<typename T>
+Eigen::Matrix<T, 2, 2> Exp2(const Eigen::Matrix<T, 2, 2> &M) {
+    using std::exp; using std::sqrt;
+    const T s = (M(0,0) + M(1,1)) / 2.;
+    const T h = (M(0,0) - M(1,1)) / 2.;
+    const T q2 = h*h + M(0,1)*M(1,0);
+    T ch, shq; // cosh(q) and sinh(q)/q
+    if (q2 < 1.e-12) {
+        ch = 1. + q2 / 2.;
+        shq = 1. + q2 / 6.;
+    } else {
+        const T q = sqrt(q2);
+        const T eq = exp(q);
+        ch = (eq + 1. / eq) / 2.;
+        shq = (eq - 1. / eq) / (2. * q);
+    }
+    Eigen::Matrix<T, 2, 2> E;
+    E << ch + shq*h, shq*M(0,1),
+         shq*M(1,0), ch - shq*h;
+    return exp(s) * E;
+}
+
+template<typename T>
+Signal<T> Two_SPGR(carrd &flip, cdbl TR, const T &PD, const T &T1_a, const T &T1_b,
+                   const T &tau_a, const T &f_a, const T &B1) {
+    using std::sin; using std::cos;
+    T f_b, k_ab, k_ba;
+    CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+    Eigen::Matrix<T, 2, 2> A;
+    A << -TR*(1./T1_a + k_ab),  TR*k_ba,
+          TR*k_ab,             -TR*(1./T1_b + k_ba);
+    const Eigen::Matrix<T, 2, 2> eATR = Exp2(A);
+    Eigen::Matrix<T, 2, 1> M0; M0 << f_a, f_b;
+    const Eigen::Matrix<T, 2, 1> RHS = M0 - eATR * M0;
+    Signal<T> s(flip.rows(), 2);
+    for (Eigen::Index i = 0; i < flip.rows(); i++) {
+        const T a = B1 * flip[i];
+        const T ca = cos(a);
+        // Closed form solve of (I - eATR*cos(a)) * M = RHS * sin(a)
+        const T l00 = 1. - eATR(0,0)*ca, l01 = -eATR(0,1)*ca;
+        const T l10 = -eATR(1,0)*ca, l11 = 1. - eATR(1,1)*ca;
+        const T det = l00*l11 - l01*l10;
+        const T m_a = (l11*RHS[0] - l01*RHS[1]) / det;
+        const T m_b = (l00*RHS[1] - l10*RHS[0]) / det;
+        s(i, 0) = PD * sin(a) * (m_a + m_b);
+        s(i, 1) = T(0.);
+    }
+    return s;
+}
+
+template<typename T>
+Signal<T> Two_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR,
+                   const T &PD, const T &T1_a, const T &T2_a, const T &T1_b, const T &T2_b,
+                   const T &tau_a, const T &f_a, const T &f0_a, const T &f0_b, const T &B1) {
+    using std::exp; using std::sin; using std::cos;
+    typedef Eigen::Matrix<T, 6, 6> TMatrix6;
+    typedef Eigen::Matrix<T, 6, 1> TVector6;
+    eigen_assert(flip.size() == phi.size());
+    const T E1_a = exp(-TR/T1_a);
+    const T E1_b = exp(-TR/T1_b);
+    const T E2_a = exp(-TR/T2_a);
+    const T E2_b = exp(-TR/T2_b);
+    T f_b, k_ab, k_ba;
+    CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+    const T E_ab = exp(-TR*k_ab/f_b);
+    const T K1 = E_ab*f_b+f_a;
+    const T K2 = E_ab*f_a+f_b;
+    const T K3 = f_a*(1.-E_ab);
+    const T K4 = f_b*(1.-E_ab);
+    const T psi_a = 2.*M_PI*TR*f0_a, psi_b = 2.*M_PI*TR*f0_b;
+    const T cpsi_a = cos(psi_a), spsi_a = sin(psi_a);
+    const T cpsi_b = cos(psi_b), spsi_b = sin(psi_b);
+    const T zero(0.), one(1.);
+    TVector6 RHS;
+    RHS << zero, zero, zero, zero, -E1_b*K3*f_b + f_a*(-E1_a*K1 + 1.), -E1_a*K4*f_a + f_b*(-E1_b*K2 + 1.);
+    TMatrix6 LHS;
+    Signal<T> s(flip.rows(), 2);
+    for (Eigen::Index i = 0; i < flip.rows(); i++) {
+        const T a = B1 * flip[i];
+        const T ca = cos(a);
+        const T sa = sin(a);
+        const T cta = phi.cosine[i]*cpsi_a - phi.sine[i]*spsi_a;
+        const T ctb = phi.cosine[i]*cpsi_b - phi.sine[i]*spsi_b;
+        const T sta = phi.sine[i]*cpsi_a + phi.cosine[i]*spsi_a;
+        const T stb = phi.sine[i]*cpsi_b + phi.cosine[i]*spsi_b;
+        LHS << -E2_a*K1*cta + ca, -E2_b*K3*cta, E2_a*K1*sta, E2_b*K3*sta, sa, zero,
+               -E2_a*K4*ctb, -E2_b*K2*ctb + ca, E2_a*K4*stb, E2_b*K2*stb, zero, sa,
+               -E2_a*K1*sta, -E2_b*K3*sta, -E2_a*K1*cta + one, -E2_b*K3*cta, zero, zero,
+               -E2_a*K4*stb, -E2_b*K2*stb, -E2_a*K4*ctb, -E2_b*K2*ctb + one, zero, zero,
+               -sa, zero, zero, zero, -E1_a*K1 + ca, -E1_b*K3,
+               zero, -sa, zero, zero, -E1_a*K4, -E1_b*K2 + ca;
+        const TVector6 M = LHS.partialPivLu().solve(RHS);
+        s(i, 0) = PD * (M[0] + M[1]);
+        s(i, 1) = PD * (M[2] + M[3]);
+    }
+    return s;
+}
+
+template<typename T>
+Signal<T> Three_SPGR(carrd &flip, cdbl TR, const T &PD, const T &T1_a, const T &T1_b, const T &T1_c,
+                     const T &tau_a, const T &f_a, const T &f_c, const T &B1) {
+    const T f_ab = 1. - f_c;
+    return Two_SPGR(flip, TR, PD * f_ab, T1_a, T1_b, tau_a, f_a / f_ab, B1) + One_SPGR(flip, TR, PD * f_c, T1_c, B1);
+}
+
+template<typename T>
+Signal<T> Three_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR, const T &PD,
+                     const T &T1_a, const T &T2_a, const T &T1_b, const T &T2_b, const T &T1_c, const T &T2_c,
+                     const T &tau_a, const T &f_a, const T &f_c, const T &f0_a, const T &f0_b, const T &f0_c, const T &B1) {
+    const T f_ab = 1. - f_c;
+    return Two_SSFP(flip, phi, TR, PD * f_ab, T1_a, T2_a, T1_b, T2_b, tau_a, f_a / f_ab, f0_a, f0_b, B1) +
+           One_SSFP(flip, phi, TR, PD * f_c, T1_c, T2_c, f0_c, B1);
+}
+
+/*
+ * Same as QI::One_MPRAGE, returned as a single row
+ */
+template<typename T>
+Signal<T> One_MPRAGE(cdbl flip, cdbl TR, const int Nseg, const int Nk0, cdbl TI, cdbl TD,
+                     const T &PD, const T &T1, const T &B1, cdbl eta) {
+    using std::exp; using std::log; using std::sin; using std::cos;
+    const double TIs = TI - TR*Nk0; // Adjust TI for k0
+    const T T1s = 1. / (1./T1 - log(cos(flip * B1))/TR);
+    const T M0s = PD * (1. - exp(-TR/T1)) / (1. - exp(-TR/T1s));
+    const T A_1 = M0s*(1. - exp(-(Nseg*TR)/T1s));
+    const T A_2 = PD*(1. - exp(-TD/T1));
+    const T A_3 = PD*(1. - exp(-TIs/T1));
+    const T B_1 = exp(-(Nseg*TR)/T1s);
+    const T B_2 = exp(-TD/T1);
+    const T B_3 = -eta*exp(-TIs/T1); // eta is inversion efficency
+    const T A = A_3 + A_2*B_3 + A_1*B_2*B_3;
+    const T B = B_1*B_2*B_3;
+    const T M1 = A / (1. - B);
+    Signal<T> s(1, 2);
+    s(0, 0) = (M0s + (M1 - M0s)*exp(-(Nk0*TR)/T1s)) * sin(flip * B1);
+    s(0, 1) = T(0.);
+    return s;
+}
+
+/*
+ * TLineshape only takes doubles, so the bound pool lineshape is fixed as Gaussian
+ */
+template<typename T>
+T GaussianLineshape(cdbl df0, const T &T2b) {
+    using std::exp;
+    const T x = 2.0*M_PI*df0*T2b;
+    return std::sqrt(M_PI_2) * T2b * exp(-x*x/2.0);
+}
+
+template<typename T>
+Signal<T> MT_SPGR(carrd &omega_cwpe, carrd &satf0, const T &PD, const T &T1f, const T &T2f,
+                  const T &T1r, const T &T2r, const T &kf, const T &F) {
+    eigen_assert(omega_cwpe.size() == satf0.size());
+    const T R1f = 1. / T1f;
+    const T R1r = 1. / T1r;
+    const T kr = kf/F; // F is M0r/M0b
+    Signal<T> s(omega_cwpe.rows(), 2);
+    for (Eigen::Index i = 0; i < omega_cwpe.rows(); i++) {
+        const T W = omega_cwpe[i]*omega_cwpe[i]*GaussianLineshape(satf0[i], T2r);
+        const double w = omega_cwpe[i]/(2.*M_PI*satf0[i]);
+        s(i, 0) = PD * F * (R1r*kr/R1f + W + R1r + kr) /
+                  (kf*(R1r + W) + (1.0 + w*w*(T1f/T2f))*(W + R1r + kr));
+        s(i, 1) = T(0.);
+    }
+    return s;
+}
+
+} // End namespace Generic
+} // End namespace QI
+
+#endif // SIGNALS_GENERIC_H
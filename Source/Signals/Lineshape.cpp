@@ -10,6 +10,8 @@
  */
 
 #include "Lineshape.h"
+#include "Spline.h"
+#include "Macro.h"
 
 namespace QI {
 
@@ -17,4 +19,50 @@ Eigen::ArrayXd GaussianLineshape::operator () (const Eigen::ArrayXd &df0, const
     return sqrt(M_PI_2) * T2b * exp(-pow(2.0*M_PI*df0*T2b,2.0)/2.0);
 }
 
+/*
+ * Integrate over the angle to the field, u = cos(theta), with the midpoint rule. The integrand is
+ * singular at the magic angle, but the midpoints never land on it and for any non-zero offset the
+ * exponential goes to zero there first.
+ */
+Eigen::ArrayXd SuperLorentzianLineshape::operator () (const Eigen::ArrayXd &df0, const double T2b) const {
+    const int nU = 1024;
+    const Eigen::ArrayXd u = (Eigen::ArrayXd::LinSpaced(nU, 0, nU - 1) + 0.5) / nU;
+    const Eigen::ArrayXd d = (3.*u.square() - 1.).abs();
+    Eigen::ArrayXd g(df0.rows());
+    for (Eigen::Index i = 0; i < df0.rows(); i++) {
+        const double x = 2.*M_PI*df0[i]*T2b;
+        g[i] = sqrt(2./M_PI) * T2b * ((-2.*(x / d).square()).exp() / d).sum() / nU;
+    }
+    return g;
+}
+
+TabulatedLineshape::TabulatedLineshape(const TLineshape &g, const double minOffset, const double maxOffset,
+                                       const double minT2b, const double maxT2b, const int nPoints) :
+    m_lineshape(g)
+{
+    if (minOffset <= 0 || minT2b <= 0 || maxOffset <= minOffset || maxT2b < minT2b || nPoints < 4) {
+        QI_FAIL("Invalid range for lineshape table, offsets " << minOffset << "-" << maxOffset <<
+                " T2b " << minT2b << "-" << maxT2b << " points " << nPoints);
+    }
+    m_min = log(minOffset * minT2b);
+    m_max = log(maxOffset * maxT2b);
+    // Tabulate in log-space, the lineshapes change fastest near zero offset
+    const Eigen::ArrayXd logx = Eigen::ArrayXd::LinSpaced(nPoints, m_min, m_max);
+    const Eigen::ArrayXd h = g(logx.exp(), 1.0);
+    m_spline = std::make_shared<const SplineInterpolator>(logx, h);
+}
+
+Eigen::ArrayXd TabulatedLineshape::operator () (const Eigen::ArrayXd &df0, const double T2b) const {
+    Eigen::ArrayXd g(df0.rows());
+    for (Eigen::Index i = 0; i < df0.rows(); i++) {
+        const double logx = log(std::abs(df0[i]) * T2b);
+        if (logx >= m_min && logx <= m_max) {
+            g[i] = T2b * std::max(0., (*m_spline)(logx)); // The far tails can ring slightly negative
+        } else {
+            g[i] = T2b * m_lineshape(Eigen::ArrayXd::Constant(1, std::abs(df0[i]) * T2b), 1.0)[0];
+        }
+    }
+    return g;
+}
+
 } // End namespace QI
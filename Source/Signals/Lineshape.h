@@ -13,10 +13,13 @@
 #define LINESHAPE_H
 
 #include <functional>
+#include <memory>
 #include <Eigen/Dense>
 
 namespace QI {
 
+class SplineInterpolator;
+
 typedef std::function<Eigen::ArrayXd(const Eigen::ArrayXd &, const double)> TLineshape;
 
 class GaussianLineshape {
@@ -24,6 +27,31 @@ public:
     Eigen::ArrayXd operator()(const Eigen::ArrayXd &df0, const double T2b) const;
 };
 
+/*
+ * Needs a numerical integral for every offset, so wrap it in a TabulatedLineshape for fitting
+ */
+class SuperLorentzianLineshape {
+public:
+    Eigen::ArrayXd operator()(const Eigen::ArrayXd &df0, const double T2b) const;
+};
+
+/*
+ * All of the lineshapes above are T2b * h(df0 * T2b) for some h, so a single spline of h over the
+ * range of df0 * T2b covers every T2b. Outside that range the original lineshape is called. The
+ * spline is shared between copies and only read, so one table can be used by all threads.
+ */
+class TabulatedLineshape {
+public:
+    TabulatedLineshape(const TLineshape &g, const double minOffset, const double maxOffset,
+                       const double minT2b, const double maxT2b, const int nPoints = 256);
+    Eigen::ArrayXd operator()(const Eigen::ArrayXd &df0, const double T2b) const;
+
+protected:
+    TLineshape m_lineshape;
+    double m_min, m_max; // log(df0 * T2b)
+    std::shared_ptr<const SplineInterpolator> m_spline;
+};
+
 } // End namespace QI
 
 #endif // LINESHAPE_H
@@ -10,9 +10,6 @@
  */
 
 #include "SPGR.h"
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
 
 using namespace std;
 using namespace Eigen;
@@ -21,18 +18,18 @@ namespace QI {
 
 VectorXcd One_SPGR(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1) {
     VectorXcd M = VectorXcd::Zero(flip.size());
-    ArrayXd sa = (B1 * flip).sin();
-    ArrayXd ca = (B1 * flip).cos();
-    double expT1 = exp(-TR / T1);
-    M.real() = PD * ((1. - expT1) * sa) / (1. - expT1*ca);
+    for (Eigen::Index i = 0; i < flip.size(); i++) {
+        M[i] = One_SPGR_Signal(B1 * flip[i], TR, PD, T1);
+    }
     return M;
 }
 
 VectorXd One_SPGR_Magnitude(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1) {
-    const ArrayXd sa = sin(B1 * flip);
-    const ArrayXd ca = cos(B1 * flip);
-    const double E1 = exp(-TR / T1);
-    return PD * ((1. - E1) * sa) / (1. - E1*ca);
+    VectorXd M(flip.size());
+    for (Eigen::Index i = 0; i < flip.size(); i++) {
+        M[i] = One_SPGR_Signal(B1 * flip[i], TR, PD, T1);
+    }
+    return M;
 }
 
 ArrayXXd One_SPGR_Magnitude_Derivs(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1) {
@@ -59,20 +56,18 @@ VectorXcd One_SPGR_Echo(carrd &flip, cdbl TR, cdbl TE, cdbl PD, cdbl T1, cdbl T2
 
 VectorXcd Two_SPGR(carrd &flip, cdbl TR,
                    cdbl PD, cdbl T1_a, cdbl T1_b, cdbl tau_a, cdbl f_a, cdbl B1) {
-    Matrix2d A, eATR;
+    Matrix2d eATR;
     Vector2d M0, Mobs;
     MagVector signal(3, flip.size()); signal.setZero();
     double k_ab, k_ba, f_b;
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
     M0 << f_a, f_b;
-    A << ((1./T1_a) + k_ab),            -k_ba,
-                     -k_ab, ((1./T1_b) + k_ba);
-    eATR = (-TR*A).exp();
+    eATR = LongitudinalExchange(T1_a, T1_b, k_ab, k_ba, TR);
     const Vector2d RHS = (Matrix2d::Identity() - eATR) * M0;
     for (int i = 0; i < flip.size(); i++) {
         const double a = flip[i] * B1;
         Mobs = (Matrix2d::Identity() - eATR*cos(a)).partialPivLu().solve(RHS * sin(a));
-        signal(1, i) = PD * Mobs.sum();
+        signal(0, i) = PD * Mobs.sum();
     }
     return SigComplex(signal);
 }
@@ -81,15 +76,13 @@ VectorXcd Two_SPGR_Echo(carrd &flip, cdbl TR, cdbl TE, cdbl PD,
                         cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b, 
                         cdbl tau_a, cdbl f_a, 
                         cdbl f0_a, cdbl f0_b, cdbl B1) {
-    Matrix2d A, eATR;
+    Matrix2d eATR;
     Vector2d M0, Mz;
     Vector2cd Mxy;
     double k_ab, k_ba, f_b;
     CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
     M0 << f_a, f_b;
-    A << -(1./T1_a) - k_ab,              k_ba,
-                      k_ab, -(1./T1_b) - k_ba;
-    eATR = (TR*A).exp();
+    eATR = LongitudinalExchange(T1_a, T1_b, k_ab, k_ba, TR);
     Matrix2cd echo = Matrix2cd::Zero();
     echo(0,0) = polar(exp(-TE/T2_a),2.*M_PI*f0_a); // T2' absorbed into PD as it effects both components equally
     echo(1,1) = polar(exp(-TE/T2_b),2.*M_PI*f0_b);
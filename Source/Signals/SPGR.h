@@ -17,6 +17,17 @@
 
 namespace QI {
 
+/*
+ * The single-component SPGR signal at one flip-angle (already scaled by B1), templated so fits
+ * can take automatic derivatives of it. One_SPGR and One_SPGR_Magnitude apply it to every angle.
+ */
+template<typename T>
+T One_SPGR_Signal(const double alpha, const double TR, const T &PD, const T &T1) {
+    using std::exp;
+    const T E1 = exp(-TR / T1);
+    return PD * ((1. - E1) * std::sin(alpha)) / (1. - E1 * std::cos(alpha));
+}
+
 Eigen::VectorXcd One_SPGR(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1);
 Eigen::VectorXd One_SPGR_Magnitude(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1);
 Eigen::ArrayXXd One_SPGR_Magnitude_Derivs(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl B1);
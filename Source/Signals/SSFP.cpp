@@ -10,9 +10,6 @@
  */
 
 #include "SSFP.h"
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
 
 using namespace std;
 using namespace Eigen;
@@ -31,66 +28,115 @@ VectorXcd One_SSFP_GS(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0,
     return G;
 }
 
-VectorXcd One_SSFP(carrd &flip, carrd &phi, cdbl TR,
+namespace {
+
+/*
+ * cos & sin of (phase increment + psi) by the angle-sum identities
+ */
+template<typename TArray>
+void RotatePhase(const PhaseTable &phi, cdbl psi, TArray &cth, TArray &sth) {
+    typedef Array<double, TArray::SizeAtCompileTime, 1> TFixed;
+    const Map<const TFixed> cph(phi.cosine.data(), phi.size()), sph(phi.sine.data(), phi.size());
+    const double cpsi = cos(psi);
+    const double spsi = sin(psi);
+    cth = cph*cpsi - sph*spsi;
+    sth = sph*cpsi + cph*spsi;
+}
+
+struct OneSSFPKernel {
+    template<int N>
+    static VectorXcd run(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
+        typedef Scratch<double, N> S;
+        typedef Scratch<complex<double>, N> SC;
+        typedef typename S::Type TArray;
+        const typename S::Scope scratch;
+        const Map<const Array<double, N, 1>> fa(flip.data(), flip.size());
+        const double E1 = exp(-TR / T1);
+        const double E2 = exp(-TR / T2);
+
+        const double psi = 2. * M_PI * f0 * TR;
+        const TArray alpha = S::make(fa * B1);
+        TArray cth = S::make(flip.size()), sth = S::make(flip.size());
+        RotatePhase(phi, psi, cth, sth);
+        const TArray d = S::make(1. - E1*E2*E2-(E1-E2*E2)*cos(alpha));
+        const TArray G = S::make(-PD*(1. - E1)*sin(alpha)/d);
+        const TArray b = S::make(E2*(1. - E1)*(1.+cos(alpha))/d);
+        typename SC::Type et = SC::make(flip.size());
+        et.real() = cth;
+        et.imag() = -sth;
+        return G*(1. - E2*et) / (1 - b*cth);
+    }
+};
+
+struct OneSSFPEchoKernel {
+    template<int N>
+    static VectorXcd run(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
+        typedef Scratch<double, N> S;
+        typedef Scratch<complex<double>, N> SC;
+        typedef typename S::Type TArray;
+        const typename S::Scope scratch;
+        const Map<const Array<double, N, 1>> fa(flip.data(), flip.size());
+        const double E1 = exp(-TR / T1);
+        const double E2 = exp(-TR / T2);
+
+        const double  psi = 2. * M_PI * f0 * TR;
+        const TArray  alpha = S::make(fa * B1);
+        TArray cth = S::make(flip.size()), sth = S::make(flip.size());
+        RotatePhase(phi, psi, cth, sth);
+        const TArray  d = S::make(1. - E1*E2*E2-(E1-E2*E2)*cos(alpha));
+        const typename SC::Type G = SC::make(polar(PD*sqrt(E2), psi/2.)*(1 - E1)*sin(alpha)/d);
+        const TArray  b = S::make(E2*(1. - E1)*(1.+cos(alpha))/d);
+        typename SC::Type et = SC::make(flip.size());
+        et.real() = cth;
+        et.imag() = -sth;
+        return G*(1. - E2*et) / (1 - b*cth);
+    }
+};
+
+struct OneSSFPEchoMagnitudeKernel {
+    template<int N>
+    static VectorXd run(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
+        typedef Scratch<double, N> S;
+        typedef typename S::Type TArray;
+        const typename S::Scope scratch;
+        const Map<const Array<double, N, 1>> fa(flip.data(), flip.size());
+        const double E1 = exp(-TR / T1);
+        const double E2 = exp(-TR / T2);
+
+        const double psi = 2. * M_PI * f0 * TR;
+        const TArray al = S::make(fa * B1);
+        const TArray ca = S::make(cos(al));
+        TArray cth = S::make(flip.size()), sth = S::make(flip.size());
+        RotatePhase(phi, psi, cth, sth);
+        const TArray d = S::make((1. - E1*ca)*(1. - E2*cth) - E2*(E1-ca)*(E2-cth));
+        const TArray rtn = S::make((E2*(1. + E2*(E2-2.*cth))).sqrt());
+        return M0*(1.-E1)*rtn*sin(al)/d;
+    }
+};
+
+} // End anonymous namespace
+
+VectorXcd One_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR,
                    cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
-    const double E1 = exp(-TR / T1);
-    const double E2 = exp(-TR / T2);
-
-    const double  psi = 2. * M_PI * f0 * TR;
-    const ArrayXd alpha = flip * B1;
-    const ArrayXd theta = phi + psi;
-    const ArrayXd d = (1. - E1*E2*E2-(E1-E2*E2)*cos(alpha));
-    const ArrayXd G = -PD*(1. - E1)*sin(alpha)/d;
-    const ArrayXd b = E2*(1. - E1)*(1.+cos(alpha))/d;
-    ArrayXcd et(theta.size());
-    et.real() = cos(-theta);
-    et.imag() = sin(-theta);
-    const ArrayXcd M = G*(1. - E2*et) / (1 - b*cos(theta));
-    return M;
+    return DispatchFixedSize<OneSSFPKernel>(flip.size(), flip, phi, TR, PD, T1, T2, f0, B1);
 }
 
-VectorXcd One_SSFP_Echo(carrd &flip, carrd &phi, cdbl TR,
+VectorXcd One_SSFP_Echo(carrd &flip, const PhaseTable &phi, cdbl TR,
                         cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
-    const double E1 = exp(-TR / T1);
-    const double E2 = exp(-TR / T2);
-
-    const double   psi = 2. * M_PI * f0 * TR;
-    const ArrayXd  alpha = flip * B1;
-    const ArrayXd  theta = psi + phi;
-    const ArrayXd  d = (1. - E1*E2*E2-(E1-E2*E2)*cos(alpha));
-    const ArrayXcd G = polar(PD*sqrt(E2), psi/2.)*(1 - E1)*sin(alpha)/d;
-    const ArrayXd  b = E2*(1. - E1)*(1.+cos(alpha))/d;
-    ArrayXcd et(theta.size());
-    et.real() = cos(-theta);
-    et.imag() = sin(-theta);
-    const ArrayXcd M = G*(1. - E2*et) / (1 - b*cos(theta));
-    /*std::cout << "f0: " << f0 << " TR: " << TR << " psi: " << psi << std::endl;
-    std::cout << "phi:   " << phi.transpose() << std::endl;
-    std::cout << "theta: " << theta.transpose() << std::endl;
-    std::cout << "phase: " << arg(M).transpose() << std::endl;*/
-    return M;
+    return DispatchFixedSize<OneSSFPEchoKernel>(flip.size(), flip, phi, TR, PD, T1, T2, f0, B1);
 }
 
-VectorXd One_SSFP_Echo_Magnitude(carrd &flip, carrd &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
+VectorXd One_SSFP_Echo_Magnitude(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
-    const double E1 = exp(-TR / T1);
-    const double E2 = exp(-TR / T2);
-
-    const double  psi = 2. * M_PI * f0 * TR;
-    const ArrayXd al = flip * B1;
-    const ArrayXd th = phi + psi;
-    const ArrayXd d = (1. - E1*cos(al))*(1. - E2*cos(th)) - E2*(E1-cos(al))*(E2-cos(th));
-    const ArrayXd rtn = (E2*(1. + E2*(E2-2.*cos(th)))).sqrt();
-    const ArrayXd Mxy = M0*(1.-E1)*rtn*sin(al)/d;
-    return Mxy;
+    return DispatchFixedSize<OneSSFPEchoMagnitudeKernel>(flip.size(), flip, phi, TR, M0, T1, T2, f0, B1);
 }
 
 /*
  * For DESPOT2-FM, only includes M0, T2, f0 derivs for now
  */
-MatrixXd One_SSFP_Echo_Derivs(carrd &flip, carrd &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
+MatrixXd One_SSFP_Echo_Derivs(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
     const double E1 = exp(-TR / T1);
     const double E2 = exp(-TR / T2);
@@ -99,9 +145,8 @@ MatrixXd One_SSFP_Echo_Derivs(carrd &flip, carrd &phi, cdbl TR, cdbl M0, cdbl T1
     const ArrayXd al = flip * B1;
     const ArrayXd sa = sin(al);
     const ArrayXd ca = cos(al);
-    const ArrayXd th = phi + psi;
-    const ArrayXd sth = sin(th);
-    const ArrayXd cth = cos(th);
+    ArrayXd cth(flip.size()), sth(flip.size());
+    RotatePhase(phi, psi, cth, sth);
     const ArrayXd d = (1. - E1*ca)*(1. - E2*cth) - E2*(E1-ca)*(E2-cth);
     const ArrayXd dd = (d*d*(E2sqr - 2*E2*cth + 1)); // Denom for dT2, dth
     const ArrayXd n = E2*(1. + E2*(E2 - 2.*cth));
@@ -129,15 +174,15 @@ VectorXcd One_SSFP_Finite(carrd &flip, const bool spoil, cdbl TR, cdbl Trf, cdbl
     }
     
     const Matrix3d RpO = R + O;
-    const Matrix3d E_e = (-TE * RpO).exp();
-    const Matrix3d E = (-(TR - Trf) * RpO).exp();
+    const Matrix3d E_e = FreePrecession(T1, T2, f0, TE);
+    const Matrix3d E = FreePrecession(T1, T2, f0, TR - Trf);
     Vector3d m_inf; m_inf << 0, 0, PD;
         
     Matrix3d E_r;
     MagVector result(3, flip.size());
     for (int i = 0; i < flip.size(); i++) {
         const Matrix3d A = InfinitesimalRF(B1 * flip(i) / Trf);
-        E_r.noalias() = (-Trf * (RpO + A)).exp();
+        E_r.noalias() = PulsePropagator<3>(-Trf * (RpO + A));
         Vector3d m_rinf = (RpO + A).partialPivLu().solve(R * m_inf);
         Vector3d m_r = (I - E_r*P*E).partialPivLu().solve(E_r*P*(I-E)*m_inf + (I-E_r)*m_rinf);
         Vector3d m_e = E_e*(m_r - m_inf) + m_inf;
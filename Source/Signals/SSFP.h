@@ -16,14 +16,14 @@
 
 namespace QI {
 
-Eigen::VectorXcd One_SSFP(carrd &flip, carrd &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
-Eigen::VectorXcd One_SSFP_Echo(carrd &flip, carrd &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
-Eigen::VectorXd  One_SSFP_Echo_Magnitude(carrd &flip, carrd &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
+Eigen::VectorXcd One_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
+Eigen::VectorXcd One_SSFP_Echo(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
+Eigen::VectorXd  One_SSFP_Echo_Magnitude(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
 Eigen::VectorXcd One_SSFP_Finite(carrd &flip, const bool spoil, cdbl TR, cdbl Trf, cdbl TE, cdbl ph,
                                  cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
 Eigen::VectorXcd One_SSFP_GS(carrd &flip, cdbl TR, cdbl PD, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
 
-Eigen::MatrixXd One_SSFP_Echo_Derivs(carrd &flip, carrd &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
+Eigen::MatrixXd One_SSFP_Echo_Derivs(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl M0, cdbl T1, cdbl T2, cdbl f0, cdbl B1);
 
 } // End namespace QI
 
@@ -11,18 +11,29 @@
 
 #include "SSFP.h"
 #include "SSFP_MC.h"
-// There's a bug in matrix log that leads to duplicate symbol definitions if
-// this is included in the header file
-#include <unsupported/Eigen/MatrixFunctions>
 
 using namespace std;
 using namespace Eigen;
 
 namespace QI {
 
-MatrixXd Two_SSFP_Matrix(carrd &flip, carrd &phi, const double TR,
-                         cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
-                         cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
+namespace {
+
+/*
+ * Steady-state transverse magnetisation of both pools for each flip-angle, rows are x_a, x_b, y_a, y_b
+ *
+ * The full system is 6x6 in (x, y, z), but the relaxation & exchange propagators P (transverse) and
+ * Q (longitudinal) only depend on the tissue, so are built once. For each flip-angle/phase pair the
+ * y equations give y = (I - C*P)^-1 * S*P * x, where C & S are the cos & sin of each pool's phase,
+ * which leaves a 4x4 system in (x, z).
+ */
+template<int N>
+Matrix<double, 4, N> Two_SSFP_Matrix(carrd &flip, const PhaseTable &phi, const double TR,
+                                     cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
+                                     cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
+    typedef Array<double, N, 1> TArray;
+    const Map<const TArray> fa(flip.data(), flip.size());
+    const Map<const TArray> cph(phi.cosine.data(), phi.size()), sph(phi.sine.data(), phi.size());
     const double E1_a = exp(-TR/T1_a);
     const double E1_b = exp(-TR/T1_b);
     const double E2_a = exp(-TR/T2_a);
@@ -34,78 +45,104 @@ MatrixXd Two_SSFP_Matrix(carrd &flip, carrd &phi, const double TR,
     const double K2 = E_ab*f_a+f_b;
     const double K3 = f_a*(1-E_ab);
     const double K4 = f_b*(1-E_ab);
-    carrd alpha = B1 * flip;
-    carrd theta_a = phi + 2.*M_PI*f0_a*TR;
-    carrd theta_b = phi + 2.*M_PI*f0_b*TR;
-
-    MatrixXd M(4, flip.size());
-    Matrix6d LHS;
-    Vector6d RHS;
-    RHS << 0, 0, 0, 0, -E1_b*K3*f_b + f_a*(-E1_a*K1 + 1), -E1_a*K4*f_a + f_b*(-E1_b*K2 + 1);
-
+    const TArray alpha = B1 * fa;
+    const double cpsi_a = cos(2.*M_PI*f0_a*TR), spsi_a = sin(2.*M_PI*f0_a*TR);
+    const double cpsi_b = cos(2.*M_PI*f0_b*TR), spsi_b = sin(2.*M_PI*f0_b*TR);
+
+    Matrix2d P, Q;
+    P << E2_a*K1, E2_b*K3,
+         E2_a*K4, E2_b*K2;
+    Q << E1_a*K1, E1_b*K3,
+         E1_a*K4, E1_b*K2;
+    Vector4d RHS;
+    RHS << 0, 0, -E1_b*K3*f_b + f_a*(-E1_a*K1 + 1), -E1_a*K4*f_a + f_b*(-E1_b*K2 + 1);
+    const Matrix2d I = Matrix2d::Identity();
+
+    Matrix<double, 4, N> M(4, flip.size());
+    Matrix4d LHS;
     for (int i = 0; i < flip.size(); i++) {
         const double ca = cos(alpha[i]);
         const double sa = sin(alpha[i]);
-        const double cta = cos(theta_a[i]);
-        const double ctb = cos(theta_b[i]);
-        const double sta = sin(theta_a[i]);
-        const double stb = sin(theta_b[i]);
-
-        LHS << -E2_a*K1*cta + ca, -E2_b*K3*cta, E2_a*K1*sta, E2_b*K3*sta, sa, 0,
-               -E2_a*K4*ctb, -E2_b*K2*ctb + ca, E2_a*K4*stb, E2_b*K2*stb, 0, sa,
-               -E2_a*K1*sta, -E2_b*K3*sta, -E2_a*K1*cta + 1, -E2_b*K3*cta, 0, 0,
-               -E2_a*K4*stb, -E2_b*K2*stb, -E2_a*K4*ctb, -E2_b*K2*ctb + 1, 0, 0,
-               -sa, 0, 0, 0, -E1_a*K1 + ca, -E1_b*K3,
-                0, -sa, 0, 0, -E1_a*K4, -E1_b*K2 + ca;
-        M.col(i).noalias() = (LHS.partialPivLu().solve(RHS)).head(4);
+        // Angle-sum identities for the phase increment plus each pool's off-resonance
+        const Vector2d ct(cph[i]*cpsi_a - sph[i]*spsi_a, cph[i]*cpsi_b - sph[i]*spsi_b);
+        const Vector2d st(sph[i]*cpsi_a + cph[i]*spsi_a, sph[i]*cpsi_b + cph[i]*spsi_b);
+        const Matrix2d CP = ct.asDiagonal() * P;
+        const Matrix2d SP = st.asDiagonal() * P;
+        const Matrix2d W = (I - CP).inverse() * SP; // Always invertible as P is a contraction
+
+        LHS.topLeftCorner<2, 2>() = ca*I - CP + SP*W;
+        LHS.topRightCorner<2, 2>() = sa*I;
+        LHS.bottomLeftCorner<2, 2>() = -sa*I;
+        LHS.bottomRightCorner<2, 2>() = ca*I - Q;
+        const Vector4d xz = LHS.partialPivLu().solve(RHS);
+        M.col(i).template head<2>() = xz.head<2>();
+        M.col(i).template tail<2>() = W * xz.head<2>();
     }
     return M;
 }
 
-VectorXcd Two_SSFP(carrd &flip, carrd &phi, const double TR,
+struct TwoSSFPKernel {
+    template<int N>
+    static VectorXcd run(carrd &flip, const PhaseTable &phi, const double TR,
+                         cdbl PD, cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
+                         cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
+        const Matrix<double, 4, N> M = Two_SSFP_Matrix<N>(flip, phi, TR, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
+        VectorXcd mc(flip.size());
+        mc.real() = PD * (M.row(0) + M.row(1));
+        mc.imag() = PD * (M.row(2) + M.row(3));
+        return mc;
+    }
+};
+
+struct TwoSSFPEchoKernel {
+    template<int N>
+    static VectorXcd run(carrd &flip, const PhaseTable &phi, const double TR,
+                         cdbl PD, cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
+                         cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
+        const Matrix<double, 4, N> M = Two_SSFP_Matrix<N>(flip, phi, TR, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
+
+        const double sE2_a = exp(-TR/(2.*T2_a));
+        const double sE2_b = exp(-TR/(2.*T2_b));
+        double f_b, k_ab, k_ba;
+        CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
+        const double sqrtE_ab = exp(-TR*k_ab/(2*f_b));
+        const double K1 = sqrtE_ab*f_b+f_a;
+        const double K2 = sqrtE_ab*f_a+f_b;
+        const double K3 = f_a*(1-sqrtE_ab);
+        const double K4 = f_b*(1-sqrtE_ab);
+        const double cpa = cos(M_PI*f0_a*TR);
+        const double spa = sin(M_PI*f0_a*TR);
+        const double cpb = cos(M_PI*f0_b*TR);
+        const double spb = sin(M_PI*f0_b*TR);
+
+        Matrix<double, 4, 4> echo;
+        echo << sE2_a*K1*cpa, sE2_b*K3*cpa, -sE2_a*K1*spa, -sE2_b*K3*spa,
+                sE2_a*K4*cpb, sE2_b*K2*cpb, -sE2_a*K4*spb, -sE2_b*K2*spb,
+                sE2_a*K1*spa, sE2_b*K3*spa,  sE2_a*K1*cpa,  sE2_b*K3*cpa,
+                sE2_a*K4*spb, sE2_b*K2*spb,  sE2_a*K4*cpb,  sE2_b*K2*cpb;
+
+        const Matrix<double, 4, N> Me = echo*M;
+        VectorXcd mce(flip.size());
+        mce.real() = PD * (Me.row(0) + Me.row(1));
+        mce.imag() = PD * (Me.row(2) + Me.row(3));
+        return mce;
+    }
+};
+
+} // End anonymous namespace
+
+VectorXcd Two_SSFP(carrd &flip, const PhaseTable &phi, const double TR,
                    cdbl PD, cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
                    cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
-
-    MatrixXd M = Two_SSFP_Matrix(flip, phi, TR, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
-    VectorXcd mc(flip.size());
-    mc.real() = PD * (M.row(0) + M.row(1));
-    mc.imag() = PD * (M.row(2) + M.row(3));
-    return mc;
+    return DispatchFixedSize<TwoSSFPKernel>(flip.size(), flip, phi, TR, PD, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
 }
 
-VectorXcd Two_SSFP_Echo(carrd &flip, carrd &phi, const double TR,
+VectorXcd Two_SSFP_Echo(carrd &flip, const PhaseTable &phi, const double TR,
                         cdbl PD, cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b,
                         cdbl tau_a, cdbl f_a, cdbl f0_a, cdbl f0_b, cdbl B1) {
     eigen_assert(flip.size() == phi.size());
-
-    MatrixXd M = Two_SSFP_Matrix(flip, phi, TR, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
-
-    const double sE2_a = exp(-TR/(2.*T2_a));
-    const double sE2_b = exp(-TR/(2.*T2_b));
-    double f_b, k_ab, k_ba;
-    CalcExchange(tau_a, f_a, f_b, k_ab, k_ba);
-    const double sqrtE_ab = exp(-TR*k_ab/(2*f_b));
-    const double K1 = sqrtE_ab*f_b+f_a;
-    const double K2 = sqrtE_ab*f_a+f_b;
-    const double K3 = f_a*(1-sqrtE_ab);
-    const double K4 = f_b*(1-sqrtE_ab);
-    const double cpa = cos(M_PI*f0_a*TR);
-    const double spa = sin(M_PI*f0_a*TR);
-    const double cpb = cos(M_PI*f0_b*TR);
-    const double spb = sin(M_PI*f0_b*TR);
-
-    Matrix<double, 4, 4> echo;
-    echo << sE2_a*K1*cpa, sE2_b*K3*cpa, -sE2_a*K1*spa, -sE2_b*K3*spa,
-            sE2_a*K4*cpb, sE2_b*K2*cpb, -sE2_a*K4*spb, -sE2_b*K2*spb,
-            sE2_a*K1*spa, sE2_b*K3*spa,  sE2_a*K1*cpa,  sE2_b*K3*cpa,
-            sE2_a*K4*spb, sE2_b*K2*spb,  sE2_a*K4*cpb,  sE2_b*K2*cpb;
-
-    const MatrixXd Me = echo*M;
-    VectorXcd mce(flip.size());
-    mce.real() = PD * (Me.row(0) + Me.row(1));
-    mce.imag() = PD * (Me.row(2) + Me.row(3));
-    return mce;
+    return DispatchFixedSize<TwoSSFPEchoKernel>(flip.size(), flip, phi, TR, PD, T1_a, T2_a, T1_b, T2_b, tau_a, f_a, f0_a, f0_b, B1);
 }
 
 VectorXcd Two_SSFP_Finite(carrd &flip, const bool spoil,
@@ -138,8 +175,8 @@ VectorXcd Two_SSFP_Finite(carrd &flip, const bool spoil,
     Matrix6d K = Exchange(k_ab, k_ba);
     Matrix6d RpOpK = RpO + K;
     Matrix6d l1;
-    const Matrix6d le = (-(RpOpK)*TE).exp();
-    const Matrix6d l2 = (-(RpOpK)*(TR-Trf)).exp();
+    const Matrix6d le = FreePrecession(T1_a, T2_a, T1_b, T2_b, k_ab, k_ba, f0_a, f0_b, TE);
+    const Matrix6d l2 = FreePrecession(T1_a, T2_a, T1_b, T2_b, k_ab, k_ba, f0_a, f0_b, TR - Trf);
     
     Vector6d m0, mp, me;
     m0 << 0, 0, f_a * PD, 0, 0, PD * f_b;
@@ -152,7 +189,7 @@ VectorXcd Two_SSFP_Finite(carrd &flip, const bool spoil,
     
     for (int i = 0; i < flip.size(); i++) {
         A.block(0,0,3,3) = A.block(3,3,3,3) = InfinitesimalRF(B1 * flip(i) / Trf);
-        l1.noalias() = (-(RpOpK+A)*Trf).exp();
+        l1.noalias() = PulsePropagator<6>(-(RpOpK+A)*Trf);
         Vector6d m1 = (RpO + A).partialPivLu().solve(Rm0);
         mp.noalias() = Cm2 + (I - l1*C*l2).partialPivLu().solve((I - l1)*(m1 - Cm2));
         me.noalias() = le*(mp - m2) + m2;				
@@ -162,7 +199,7 @@ VectorXcd Two_SSFP_Finite(carrd &flip, const bool spoil,
 }
 
 
-VectorXcd Three_SSFP(carrd &flip, carrd &phi, cdbl TR, cdbl PD,
+VectorXcd Three_SSFP(carrd &flip, const PhaseTable &phi, cdbl TR, cdbl PD,
                      cdbl T1_a, cdbl T2_a,
                      cdbl T1_b, cdbl T2_b,
                      cdbl T1_c, cdbl T2_c,
@@ -175,7 +212,7 @@ VectorXcd Three_SSFP(carrd &flip, carrd &phi, cdbl TR, cdbl PD,
     return r;
 }
 
-VectorXcd Three_SSFP_Echo(carrd &flip, carrd &phi, cdbl TR, 
+VectorXcd Three_SSFP_Echo(carrd &flip, const PhaseTable &phi, cdbl TR, 
                           cdbl PD, cdbl T1_a, cdbl T2_a, cdbl T1_b, cdbl T2_b, cdbl T1_c, cdbl T2_c,
                           cdbl tau_a, cdbl f_a, cdbl f_c, cdbl f0_a, cdbl f0_b, cdbl f0_c, cdbl B1) {
     double f_ab = 1. - f_c;
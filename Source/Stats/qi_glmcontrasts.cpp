@@ -16,54 +16,12 @@
 
 #include <Eigen/Dense>
 
-#include "itkTileImageFilter.h"
-#include "itkSubtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "MeanImageFilter.h"
-
-#include "ApplyTypes.h"
+#include "ImageTypes.h"
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
-
-class ContrastsAlgorithm : public QI::ApplyF::Algorithm {
-protected:
-    Eigen::MatrixXd m_mat;
-    bool m_scale;
-public:
-    ContrastsAlgorithm(const Eigen::MatrixXd &d, const Eigen::MatrixXd &c, const bool s = false) :
-        m_scale(s)
-    {
-        m_mat = c * ((d.transpose() * d).inverse()) * d.transpose();
-    }
-
-    size_t numInputs() const override { return 1; }
-    size_t numConsts() const override { return 0; }
-    size_t numOutputs() const override { return m_mat.rows(); }
-    size_t dataSize() const override { return m_mat.cols(); }
-    float zero() const override { return 0.f; }
-    std::vector<float> defaultConsts() const override {
-        std::vector<float> def;
-        return def;
-    }
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
-               TInput &resids, TIterations &its) const override
-    {
-        Eigen::Map<const Eigen::VectorXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::VectorXd c = m_mat * indata.cast<double>();
-        if (m_scale) {
-            c /= indata.mean();
-        }
-        for (int i = 0; i < m_mat.rows(); i++) {
-            outputs[i] = c[i];
-        }
-        residual = 0;
-        its = 0;
-        return true;
-    }
-};
+#include "GLM.h"
+#include "ThreadPool.h"
 
 /*
  * Main
@@ -81,6 +39,7 @@ int main(int argc, char **argv) {
     args::Flag fraction(parser, "FRACTION", "Output contrasts as fraction of grand mean", {'F',"frac"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filename", {'o', "out"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     if (verbose) std::cout << "Reading input file " << QI::CheckPos(input_path) << std::endl;
@@ -100,16 +59,30 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    auto con_algo = std::make_shared<ContrastsAlgorithm>(design_matrix, contrasts, fraction);
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(con_algo);
-    apply->SetInput(0, merged);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
+    const QI::GLMContrasts glm(design_matrix.matrix(), contrasts.matrix());
+    QI::VolumeF::Pointer mask_image;
+    if (mask) {
+        mask_image = QI::ReadImage(mask.Get());
+        if (mask_image->GetLargestPossibleRegion().GetSize() != merged->GetLargestPossibleRegion().GetSize()) {
+            QI_FAIL("Mask " << mask.Get() << " is not the same size as the input");
+        }
+    }
+    std::vector<QI::VolumeF::Pointer> con_images(contrasts.rows());
+    std::vector<float *> con_buffers(contrasts.rows());
+    for (int c = 0; c < contrasts.rows(); c++) {
+        con_images[c] = QI::VolumeF::New();
+        con_images[c]->CopyInformation(merged);
+        con_images[c]->SetRegions(merged->GetLargestPossibleRegion());
+        con_images[c]->Allocate();
+        con_buffers[c] = con_images[c]->GetBufferPointer();
+    }
     if (verbose) std::cout << "Calculating contrasts" << std::endl;
-    apply->Update();
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    glm.apply(merged->GetBufferPointer(), merged->GetLargestPossibleRegion().GetNumberOfPixels(), con_buffers,
+              fraction, mask_image ? mask_image->GetBufferPointer() : nullptr, QI::ThreadPool::Global().size());
     for (int c = 0; c < contrasts.rows(); c++) {
         if (verbose) std::cout << "Writing contrast " << (c + 1) << std::endl;
-        QI::WriteImage(apply->GetOutput(c), outarg.Get() + "con" + std::to_string(c + 1) + QI::OutExt());
+        QI::WriteImage(con_images[c], outarg.Get() + "con" + std::to_string(c + 1) + QI::OutExt());
     }
 }
 
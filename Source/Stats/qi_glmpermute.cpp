@@ -0,0 +1,367 @@
+/*
+ *  qi_glmpermute.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <random>
+#include <limits>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "ImageTypes.h"
+#include "Util.h"
+#include "Args.h"
+#include "ImageIO.h"
+#include "GLM.h"
+#include "ThreadPool.h"
+
+namespace {
+    const size_t Unset = std::numeric_limits<size_t>::max(); // Voxels not yet added to a cluster
+}
+
+/*
+ * Threshold-Free Cluster Enhancement, Smith & Nichols 10.1016/j.neuroimage.2008.03.061, with
+ * 6-connected clusters of positive voxels. Instead of labelling the clusters again at every
+ * threshold, voxels are added from the highest value down and joined with a union-find. The
+ * score for each threshold is only added to the cluster roots, and stored relative to the
+ * parent so that joining two clusters does not touch their voxels. Each voxel's score is then
+ * the sum along its path to the root. One object can be re-used for any number of maps.
+ */
+class TFCE {
+public:
+    TFCE(const std::array<size_t, 3> &size, const double E, const double H) :
+        m_size(size), m_E(E), m_H(H)
+    {
+        const size_t nVox = size[0] * size[1] * size[2];
+        m_parent.resize(nVox);
+        m_acc.resize(nVox);
+        m_count.resize(nVox);
+    }
+
+    void operator()(const float *t, const double dh, float *out) {
+        const size_t nx = m_size[0], ny = m_size[1], nz = m_size[2];
+        const size_t nVox = m_parent.size();
+        m_order.clear();
+        for (size_t v = 0; v < nVox; v++) {
+            if (t[v] > 0) {
+                m_order.push_back(v);
+            }
+        }
+        std::sort(m_order.begin(), m_order.end(), [t](const size_t a, const size_t b) { return t[a] > t[b]; });
+        std::fill(m_parent.begin(), m_parent.end(), Unset);
+        m_roots.clear();
+        const long top = m_order.empty() ? 0 : long(t[m_order.front()] / dh);
+        size_t next = 0;
+        for (long k = top; k > 0; k--) {
+            const double h = k * dh;
+            for (; next < m_order.size() && t[m_order[next]] >= h; next++) {
+                const size_t v = m_order[next];
+                m_parent[v] = v;
+                m_acc[v] = 0;
+                m_count[v] = 1;
+                m_roots.push_back(v);
+                const size_t x = v % nx, y = (v / nx) % ny, z = v / (nx * ny);
+                if (x > 0)      join(v, v - 1);
+                if (x < nx - 1) join(v, v + 1);
+                if (y > 0)      join(v, v - nx);
+                if (y < ny - 1) join(v, v + nx);
+                if (z > 0)      join(v, v - nx * ny);
+                if (z < nz - 1) join(v, v + nx * ny);
+            }
+            const double weight = pow(h, m_H) * dh;
+            size_t kept = 0;
+            for (const size_t r : m_roots) {
+                if (m_parent[r] == r) {
+                    m_acc[r] += pow(double(m_count[r]), m_E) * weight;
+                    m_roots[kept++] = r;
+                }
+            }
+            m_roots.resize(kept);
+        }
+        for (size_t v = 0; v < nVox; v++) {
+            if (m_parent[v] == Unset) {
+                out[v] = 0;
+            } else {
+                const size_t r = find(v);
+                out[v] = (r == v) ? m_acc[v] : m_acc[v] + m_acc[r];
+            }
+        }
+    }
+
+protected:
+    std::array<size_t, 3> m_size;
+    double m_E, m_H;
+    std::vector<size_t> m_order, m_parent, m_count, m_roots, m_path;
+    std::vector<double> m_acc; // For roots the cluster score, otherwise relative to the parent
+
+    size_t find(const size_t v) {
+        size_t root = v;
+        while (m_parent[root] != root) {
+            root = m_parent[root];
+        }
+        m_path.clear();
+        for (size_t u = v; u != root && m_parent[u] != root; u = m_parent[u]) {
+            m_path.push_back(u);
+        }
+        for (auto it = m_path.rbegin(); it != m_path.rend(); ++it) {
+            m_acc[*it] += m_acc[m_parent[*it]];
+            m_parent[*it] = root;
+        }
+        return root;
+    }
+
+    void join(const size_t v, const size_t n) {
+        if (m_parent[n] == Unset) {
+            return;
+        }
+        size_t a = find(v), b = find(n);
+        if (a == b) {
+            return;
+        }
+        if (m_count[a] > m_count[b]) {
+            std::swap(a, b);
+        }
+        m_acc[a] -= m_acc[b];
+        m_parent[a] = b;
+        m_count[b] += m_count[a];
+    }
+};
+
+/*
+ * A permutation or sign-flip of the subjects, i.e. row i of the permuted data is
+ * sign[i] * row index[i] of the data.
+ */
+struct Permutation {
+    std::vector<Eigen::Index> index;
+    std::vector<double> sign;
+};
+
+/*
+ * The contrasts and the fitted sum-of-squares for permuted data are both linear in the data, so
+ * rather than permuting the data the columns of [c pinv(D); Q'] are permuted instead, and this
+ * one matrix is applied to blocks of the read-only data with a GEMM. Q is an orthonormal basis for
+ * the design, so |Q'y|^2 is the fitted sum-of-squares, which with |y|^2 gives the residual.
+ */
+void PermutedMatrix(const Eigen::MatrixXd &A0, const Permutation &p, Eigen::MatrixXd &A) {
+    for (Eigen::Index i = 0; i < A0.cols(); i++) {
+        A.col(p.index[i]) = p.sign[i] * A0.col(i);
+    }
+}
+
+/*
+ * Main
+ */
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("Non-parametric permutation tests of GLM contrasts, with the maximum statistic\n"
+                                "to correct for multiple comparisons, as in FSL randomise.\n"
+                                "One-sided t-statistics are generated for each contrast.\n"
+                                "\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> input_path(parser, "IMAGE", "The combined image file from qi_glmsetup");
+    args::Positional<std::string> design_path(parser, "DESIGN", "GLM Design matrix from qi_glmsetup");
+    args::Positional<std::string> contrasts_path(parser, "CONTRASTS", "Contrasts matrix from qi_glmsetup");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<int> nperms(parser, "PERMS", "Number of permutations, including the original data (default 5000)", {'n', "perms"}, 5000);
+    args::Flag     signflip(parser, "SIGNFLIP", "Flip the signs of subjects instead of permuting them (one-sample tests)", {'1', "signflip"});
+    args::ValueFlag<int> seed(parser, "SEED", "Seed for the random permutations", {"seed"});
+    args::Flag     tfce(parser, "TFCE", "Also generate Threshold-Free Cluster Enhancement statistics", {'t', "tfce"});
+    args::ValueFlag<double> tfce_E(parser, "E", "TFCE extent exponent (default 0.5)", {"tfce_E"}, 0.5);
+    args::ValueFlag<double> tfce_H(parser, "H", "TFCE height exponent (default 2)", {"tfce_H"}, 2.0);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    if (verbose) std::cout << "Reading input file " << QI::CheckPos(input_path) << std::endl;
+    QI::VectorVolumeF::Pointer merged = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    if (verbose) std::cout << "Reading design matrix" << QI::CheckPos(design_path) << std::endl;
+    Eigen::ArrayXXd design_matrix = QI::ReadArrayFile(QI::CheckPos(design_path));
+    if (verbose) std::cout << "Reading contrasts file" << QI::CheckPos(contrasts_path) << std::endl;
+    Eigen::ArrayXXd contrasts     = QI::ReadArrayFile(QI::CheckPos(contrasts_path));
+    if (design_matrix.rows() != merged->GetNumberOfComponentsPerPixel()) {
+        QI_FAIL("Number of rows in design matrix (" << design_matrix.rows()
+                << ") does not match number of volumes in image (" << merged->GetNumberOfComponentsPerPixel() << ")");
+    }
+    if (nperms.Get() < 1) {
+        QI_FAIL("Need at least one permutation");
+    }
+    const QI::GLMContrasts glm(design_matrix.matrix(), contrasts.matrix());
+    if (glm.dof() < 1) {
+        QI_FAIL("Design matrix has no residual degrees of freedom");
+    }
+
+    const auto size = merged->GetLargestPossibleRegion().GetSize();
+    const size_t nVox = merged->GetLargestPossibleRegion().GetNumberOfPixels();
+    const Eigen::Index nSub = glm.subjects(), nCon = glm.contrasts(), nCov = design_matrix.cols();
+    std::vector<size_t> voxels;
+    if (mask) {
+        QI::VolumeF::Pointer mask_image = QI::ReadImage(mask.Get());
+        if (mask_image->GetLargestPossibleRegion().GetSize() != size) {
+            QI_FAIL("Mask " << mask.Get() << " is not the same size as the input");
+        }
+        for (size_t v = 0; v < nVox; v++) {
+            if (mask_image->GetBufferPointer()[v] != 0) {
+                voxels.push_back(v);
+            }
+        }
+    } else {
+        for (size_t v = 0; v < nVox; v++) {
+            voxels.push_back(v);
+        }
+    }
+    if (verbose) std::cout << "Voxels: " << voxels.size() << " Subjects: " << nSub << " Contrasts: " << nCon << std::endl;
+
+    const size_t nPerms = nperms.Get();
+    std::mt19937_64 rng(seed ? seed.Get() : QI::RandomSeed());
+    std::vector<Permutation> perms(nPerms);
+    for (size_t p = 0; p < nPerms; p++) {
+        perms[p].index.resize(nSub);
+        perms[p].sign.assign(nSub, 1.);
+        for (Eigen::Index i = 0; i < nSub; i++) {
+            perms[p].index[i] = i;
+        }
+        if (p > 0) { // The first is always the original data
+            if (signflip) {
+                std::bernoulli_distribution flip(0.5);
+                for (auto &s : perms[p].sign) {
+                    s = flip(rng) ? -1. : 1.;
+                }
+            } else {
+                std::shuffle(perms[p].index.begin(), perms[p].index.end(), rng);
+            }
+        }
+    }
+
+    Eigen::MatrixXd A0(nCon + nCov, nSub);
+    A0 << glm.matrix(), glm.basis().transpose();
+    const Eigen::ArrayXd tscale = (glm.variances().array() / glm.dof()).sqrt();
+    const float *data = merged->GetBufferPointer();
+    const size_t block = std::max<size_t>(16, (256 * 1024) / (sizeof(double) * nSub));
+    const size_t nBlocks = (voxels.size() + block - 1) / block;
+
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nBlocks));
+    const float lowest = std::numeric_limits<float>::lowest();
+    std::vector<std::vector<float>> tstat(nCon, std::vector<float>(nVox, 0.f)), tfce_stat;
+    Eigen::ArrayXXf vox_max(nPerms, nCon), tfce_max(nPerms, nCon);
+    std::vector<double> dh(nCon, 1.);
+    /*
+     * Without TFCE only the maximum of each permutation is needed, so every permutation is done at
+     * once with the data blocks on the outside, keeping each block in cache for all of them. TFCE
+     * needs whole maps, so then the permutations are done in batches of one per thread.
+     */
+    const size_t batch = tfce ? pool.size() : nPerms;
+    std::vector<float> maps(tfce ? batch * nCon * nVox : 0);
+    for (size_t p0 = 0; p0 < nPerms; p0 += batch) {
+        const size_t n = std::min(batch, nPerms - p0);
+        if (verbose) std::cout << "Permutations " << (p0 + 1) << " to " << (p0 + n) << " of " << nPerms << std::endl;
+        std::vector<Eigen::ArrayXXf> task_max(nTasks, Eigen::ArrayXXf::Constant(n, nCon, lowest));
+        pool.run(nTasks, [&](const size_t t) {
+            Eigen::MatrixXd Y(nSub, block), A(nCon + nCov, nSub), R(nCon + nCov, block);
+            Eigen::ArrayXd ss(block);
+            for (size_t b = (nBlocks * t) / nTasks; b < (nBlocks * (t + 1)) / nTasks; b++) {
+                const size_t j0 = b * block;
+                const size_t m = std::min(block, voxels.size() - j0);
+                for (size_t j = 0; j < m; j++) {
+                    Y.col(j) = Eigen::Map<const Eigen::VectorXf>(data + voxels[j0 + j] * nSub, nSub).cast<double>();
+                }
+                ss.head(m) = Y.leftCols(m).colwise().squaredNorm().transpose();
+                for (size_t k = 0; k < n; k++) {
+                    PermutedMatrix(A0, perms[p0 + k], A);
+                    R.leftCols(m).noalias() = A * Y.leftCols(m);
+                    for (size_t j = 0; j < m; j++) {
+                        const size_t v = voxels[j0 + j];
+                        const double rss = ss[j] - R.col(j).tail(nCov).squaredNorm();
+                        for (Eigen::Index c = 0; c < nCon; c++) {
+                            const float tv = rss > 0 ? R(c, j) / (tscale[c] * sqrt(rss)) : 0.;
+                            task_max[t](k, c) = std::max(task_max[t](k, c), tv);
+                            if (p0 + k == 0) {
+                                tstat[c][v] = tv;
+                            }
+                            if (tfce) {
+                                maps[(k * nCon + c) * nVox + v] = tv;
+                            }
+                        }
+                    }
+                }
+            }
+        });
+        vox_max.middleRows(p0, n) = task_max[0];
+        for (size_t t = 1; t < nTasks; t++) {
+            vox_max.middleRows(p0, n) = vox_max.middleRows(p0, n).max(task_max[t]);
+        }
+        if (tfce) {
+            if (p0 == 0) {
+                // The step is fixed from the original data, so every permutation is scored the same way
+                for (Eigen::Index c = 0; c < nCon; c++) {
+                    if (vox_max(0, c) > 0) {
+                        dh[c] = vox_max(0, c) / 100.;
+                    }
+                }
+                tfce_stat.assign(nCon, std::vector<float>(nVox, 0.f));
+            }
+            const size_t nMaps = n * nCon;
+            const size_t mTasks = std::min(pool.size(), nMaps);
+            pool.run(mTasks, [&](const size_t t) {
+                TFCE enhance({{size[0], size[1], size[2]}}, tfce_E.Get(), tfce_H.Get());
+                std::vector<float> out(nVox);
+                for (size_t i = (nMaps * t) / mTasks; i < (nMaps * (t + 1)) / mTasks; i++) {
+                    const size_t k = i / nCon, c = i % nCon;
+                    enhance(maps.data() + i * nVox, dh[c], out.data());
+                    tfce_max(p0 + k, c) = *std::max_element(out.begin(), out.end());
+                    if (p0 + k == 0) {
+                        tfce_stat[c] = out;
+                    }
+                }
+            });
+        }
+    }
+
+    /*
+     * Corrected p-values are stored as 1 - p, as with randomise, so that higher is more significant
+     */
+    auto corrected = [&](const std::vector<float> &stat, const Eigen::ArrayXf &null) -> std::vector<float> {
+        std::vector<float> sorted(null.data(), null.data() + null.size());
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<float> corrp(nVox, 0.f);
+        for (const size_t v : voxels) {
+            const size_t below = std::lower_bound(sorted.begin(), sorted.end(), stat[v]) - sorted.begin();
+            corrp[v] = float(below) / nPerms;
+        }
+        return corrp;
+    };
+    auto write = [&](const std::vector<float> &img, const std::string &name) {
+        auto vol = QI::VolumeF::New();
+        vol->CopyInformation(merged);
+        vol->SetRegions(merged->GetLargestPossibleRegion());
+        vol->Allocate();
+        std::copy(img.begin(), img.end(), vol->GetBufferPointer());
+        const std::string path = outarg.Get() + name + QI::OutExt();
+        if (verbose) std::cout << "Writing " << path << std::endl;
+        QI::WriteImage(vol, path);
+    };
+    for (Eigen::Index c = 0; c < nCon; c++) {
+        const std::string con = std::to_string(c + 1);
+        write(tstat[c], "tstat" + con);
+        write(corrected(tstat[c], vox_max.col(c)), "vox_corrp_tstat" + con);
+        if (tfce) {
+            write(tfce_stat[c], "tfce_tstat" + con);
+            write(corrected(tfce_stat[c], tfce_max.col(c)), "tfce_corrp_tstat" + con);
+        }
+    }
+    return EXIT_SUCCESS;
+}
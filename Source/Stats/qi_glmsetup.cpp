@@ -13,16 +13,23 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <sstream>
 
-#include "itkTileImageFilter.h"
+#include "itkImageFileWriter.h"
+#include "itkImageIORegion.h"
 #include "itkSubtractImageFilter.h"
 #include "itkDivideImageFilter.h"
 #include "MeanImageFilter.h"
+#include "VolumeStatistics.h"
 
 #include "ImageTypes.h"
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "ThreadPool.h"
 
 const std::string usage{
 "Usage is: qi_glmsetup [options] files\n\
@@ -35,6 +42,110 @@ An output file must be specified with --out.\n\
 \n\
 Additionally, simple GLM including co-variates can be generated.\n"};
 
+/*
+ * Writes the volumes into the 4D file one at a time, pasting each into its place in the file, so
+ * only a few are ever in memory instead of the whole cohort. ITK can only paste into uncompressed
+ * files, so .nii.gz outputs are written uncompressed first and compressed at the end. The inputs
+ * are read in batches, one per thread, while the volumes are pasted in order. The merged file
+ * takes its space from the first volume. Each volume is also added to stats if given, and with an
+ * empty out_path only the statistics are calculated.
+ */
+void MergeVolumes(const std::vector<std::string> &paths, const std::string &out_path, QI::VolumeStatistics *stats,
+                  const bool verbose) {
+    if (paths.empty()) {
+        QI_FAIL("No images to merge");
+    }
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t batch = pool.size();
+    std::unique_ptr<QI::GzipOutput> output;
+    if (!out_path.empty()) {
+        output.reset(new QI::GzipOutput(out_path, true));
+        std::remove(output->path().c_str()); // Otherwise ITK would try to paste into an old file
+    }
+    QI::SeriesF::Pointer merged;
+    QI::SeriesF::RegionType largest;
+    QI::VolumeF::RegionType::SizeType size;
+    size_t nVox = 0;
+    for (size_t start = 0; start < paths.size(); start += batch) {
+        const size_t n = std::min(batch, paths.size() - start);
+        std::vector<QI::VolumeF::Pointer> vols(n);
+        std::vector<std::string> errors(n);
+        pool.run(n, [&](const size_t t) {
+            try {
+                vols[t] = QI::ReadImage(paths[start + t]);
+            } catch (std::exception &e) {
+                errors[t] = e.what();
+            }
+        });
+        for (size_t t = 0; t < n; t++) {
+            const size_t v = start + t;
+            if (!errors[t].empty()) {
+                QI_FAIL("Failed to read " << paths[v] << ": " << errors[t]);
+            }
+            const QI::VolumeF *vol = vols[t];
+            if (!merged) {
+                size = vol->GetLargestPossibleRegion().GetSize();
+                nVox = vol->GetLargestPossibleRegion().GetNumberOfPixels();
+                QI::SeriesF::SpacingType spacing;
+                QI::SeriesF::PointType origin;
+                QI::SeriesF::DirectionType direction;
+                spacing.Fill(1);
+                origin.Fill(0);
+                direction.SetIdentity();
+                for (int i = 0; i < 3; i++) {
+                    largest.SetIndex(i, 0);
+                    largest.SetSize(i, size[i]);
+                    spacing[i] = vol->GetSpacing()[i];
+                    origin[i] = vol->GetOrigin()[i];
+                    for (int j = 0; j < 3; j++) {
+                        direction[i][j] = vol->GetDirection()[i][j];
+                    }
+                }
+                largest.SetIndex(3, 0);
+                largest.SetSize(3, paths.size());
+                QI::SeriesF::RegionType one = largest;
+                one.SetSize(3, 1);
+                merged = QI::SeriesF::New();
+                merged->SetLargestPossibleRegion(largest);
+                merged->SetBufferedRegion(one);
+                merged->SetSpacing(spacing);
+                merged->SetOrigin(origin);
+                merged->SetDirection(direction);
+                merged->Allocate();
+            } else if (vol->GetLargestPossibleRegion().GetSize() != size) {
+                QI_FAIL("Image " << paths[v] << " is not the same size as " << paths.front());
+            }
+            if (stats) {
+                if (verbose) std::cout << "Adding volume " << (v + 1) << " of " << paths.size() << " to statistics" << std::endl;
+                stats->add(vol);
+            }
+            if (!output) {
+                continue;
+            }
+            if (verbose) std::cout << "Writing volume " << (v + 1) << " of " << paths.size() << std::endl;
+            QI::SeriesF::RegionType region = largest;
+            region.SetIndex(3, v);
+            region.SetSize(3, 1);
+            merged->SetBufferedRegion(region);
+            merged->SetRequestedRegion(region);
+            std::copy(vol->GetBufferPointer(), vol->GetBufferPointer() + nVox, merged->GetBufferPointer());
+            itk::ImageIORegion ioRegion(4);
+            for (int i = 0; i < 4; i++) {
+                ioRegion.SetIndex(i, region.GetIndex()[i]);
+                ioRegion.SetSize(i, region.GetSize()[i]);
+            }
+            auto file = itk::ImageFileWriter<QI::SeriesF>::New();
+            file->SetFileName(output->path());
+            file->SetInput(merged);
+            file->SetIORegion(ioRegion);
+            file->Update();
+        }
+    }
+    if (output) {
+        output->finish();
+    }
+}
+
 int main(int argc, char **argv) {
     Eigen::initParallel();
     args::ArgumentParser parser("A utility for setting up merged 4D files for use with FSL randomise etc.\n"
@@ -51,6 +162,10 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> design_path(parser, "DESIGN", "Path to save design matrix", {'d',"design"});
     args::ValueFlag<std::string> contrasts_path(parser, "CONTRASTS", "Generate and save contrasts", {'c',"contrasts"});
     args::ValueFlag<std::string> ftests_path(parser, "FTESTS", "Generate and save F-tests", {'f',"ftests"});
+    args::ValueFlag<std::string> stats_prefix(parser, "STATS", "Write voxelwise mean and standard deviation maps of the images with this prefix", {"stats"});
+    args::Flag minmax(parser, "MINMAX", "Also write minimum and maximum maps with --stats", {"minmax"});
+    args::ValueFlagList<double> percentiles(parser, "PERCENTILE", "Also write a map of this percentile with --stats (can be specified multiple times)", {"percentile"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Read N files at once (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     QI::ParseArgs(parser, argc, argv, verbose);
 
     std::ifstream group_file(QI::CheckValue(group_path));
@@ -68,18 +183,15 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    std::vector<std::vector<QI::VolumeF::Pointer>> groups(n_groups);
+    std::vector<std::vector<std::string>> groups(n_groups);
+    std::vector<std::string> merge_paths;
     if (verbose) std::cout << "Number of groups: " << n_groups << std::endl;
     if (verbose) std::cout << "Number of images: " << n_images << std::endl;
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = n_images;
-    auto tiler = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
-    tiler->SetLayout(layout);
 
     std::ofstream design_file;
     if (design_path) {
         if (verbose) std::cout << "Design matrix will be saved to: " << design_path.Get() << std::endl;
+        QI::CacheOutput(design_path.Get());
         design_file = std::ofstream(design_path.Get());
     }
     std::vector<std::vector<std::vector<std::string>>> covars(n_groups);
@@ -99,13 +211,11 @@ int main(int argc, char **argv) {
             covars_files.push_back(std::move(covars_file));
         }
     }
-    int out_index = 0;
     for (int i = 0; i < group_list.size(); i++) {
         const int group = group_list.at(i);
         if (group > 0) { // Ignore entries with a 0
             if (verbose) std::cout << "File: " << file_paths.Get().at(i) << " Group: " << group << std::flush;
-            QI::VolumeF::Pointer ptr = QI::ReadImage(file_paths.Get().at(i));
-            groups.at(group - 1).push_back(ptr);
+            groups.at(group - 1).push_back(file_paths.Get().at(i));
             std::vector<std::string> covar;
             if (covars_path) {
                 if (verbose) std::cout << " Covariates: ";
@@ -119,8 +229,7 @@ int main(int argc, char **argv) {
             }
             if (verbose) std::cout << std::endl;
             if (!sort) {
-                tiler->SetInput(out_index, ptr);
-                out_index++;
+                merge_paths.push_back(file_paths.Get().at(i));
                 if (design_path) {
                     for (int g = 1; g <= n_groups; g++) {
                         if (g == group) {
@@ -150,8 +259,7 @@ int main(int argc, char **argv) {
         if (verbose) std::cout << "Sorting." << std::endl;
         for (int g = 0; g < n_groups; g++) {
             for (int i = 0; i < groups.at(g).size(); i++) {
-                tiler->SetInput(out_index, groups.at(g).at(i));
-                out_index++;
+                merge_paths.push_back(groups.at(g).at(i));
                 if (design_path) {
                     for (int g2 = 0; g2 < n_groups; g2++) {
                         if (g2 == g) {
@@ -173,6 +281,7 @@ int main(int argc, char **argv) {
     int n_covars = covars_path ? covars.front().front().size() : 0;
     if (contrasts_path) {
         if (verbose) std::cout << "Generating contrasts" << std::endl;
+        QI::CacheOutput(contrasts_path.Get());
         std::ofstream con_file(contrasts_path.Get());
         for (int g = 0; g < n_groups; g++) {
             for (int g2 = 0; g2 < n_groups; g2++) {
@@ -205,6 +314,7 @@ int main(int argc, char **argv) {
     }
     if (ftests_path) {
         if (verbose) std::cout << "Generating F-tests" << std::endl;
+        QI::CacheOutput(ftests_path.Get());
         std::ofstream fts_file(ftests_path.Get());
         for (int g = 0; g < n_groups; g++) { // Individual group comparisons
             for (int g2 = 0; g2 < n_groups; g2++) {
@@ -226,28 +336,32 @@ int main(int argc, char **argv) {
             fts_file << std::endl;
         }
     }
-    tiler->UpdateLargestPossibleRegion();
-    // Reset space information because tiler messes it up
-    QI::SeriesF::Pointer output = tiler->GetOutput();
-    output->DisconnectPipeline();
-    auto spacing    = output->GetSpacing();
-    auto origin     = output->GetOrigin();
-    auto direction  = output->GetDirection();
-    spacing.Fill(1);
-    origin.Fill(0);
-    direction.SetIdentity();
-    for (int i = 0; i < 3; i++) {
-        spacing[i] = groups.at(0).at(0)->GetSpacing()[i];
-        origin[i] =  groups.at(0).at(0)->GetOrigin()[i];
-        for (int j = 0; j < 3; j++) {
-            direction[i][j] = groups.at(0).at(0)->GetDirection()[i][j];
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    std::unique_ptr<QI::VolumeStatistics> stats;
+    if (stats_prefix) {
+        stats.reset(new QI::VolumeStatistics(minmax, percentiles.Get()));
+    } else if (minmax || percentiles) {
+        QI_FAIL("--minmax and --percentile need --stats");
+    }
+    if (!stats || output_path) {
+        if (verbose) std::cout << "Writing merged file: " << QI::CheckValue(output_path) << std::endl;
+    }
+    MergeVolumes(merge_paths, output_path.Get(), stats.get(), verbose);
+    if (stats) {
+        const std::string prefix = stats_prefix.Get();
+        if (verbose) std::cout << "Writing statistics of " << stats->volumes() << " images with prefix: " << prefix << std::endl;
+        QI::WriteImage(stats->mean(), prefix + "mean" + QI::OutExt());
+        QI::WriteImage(stats->sd(), prefix + "sd" + QI::OutExt());
+        if (minmax) {
+            QI::WriteImage(stats->min(), prefix + "min" + QI::OutExt());
+            QI::WriteImage(stats->max(), prefix + "max" + QI::OutExt());
+        }
+        for (size_t p = 0; p < percentiles.Get().size(); p++) {
+            std::ostringstream name;
+            name << prefix << "p" << percentiles.Get()[p] << QI::OutExt();
+            QI::WriteImage(stats->percentile(p), name.str());
         }
     }
-    output->SetSpacing(spacing);
-    output->SetOrigin(origin);
-    output->SetDirection(direction);
-    if (verbose) std::cout << "Writing merged file: " << QI::CheckValue(output_path) << std::endl;
-    QI::WriteImage<QI::SeriesF>(output, QI::CheckValue(output_path));
     return EXIT_SUCCESS;
 }
 
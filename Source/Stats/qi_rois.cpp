@@ -13,72 +13,350 @@
 #include <iomanip>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include <limits>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/types/vector.hpp>
+#include <cereal/types/array.hpp>
 
 #include "ImageTypes.h"
 #include "ImageIO.h"
 #include "Args.h"
 #include "Util.h"
+#include "ThreadPool.h"
 
-#include "itkLabelStatisticsImageFilter.h"
-typedef itk::LabelStatisticsImageFilter<QI::VolumeF, QI::VolumeI> TStatsFilter;
-typedef TStatsFilter::ValidLabelValuesContainerType TLabels;
+typedef std::vector<int> TLabels;
+namespace {
+    const std::string IndexExt = ".qiroi";
+    const char IndexMagic[8] = {'Q', 'I', 'R', 'O', 'I', 'I', 'D', 'X'};
+    const uint32_t IndexVersion = 1;
+}
 // Declare arguments here so they are available in helper functions
 args::ArgumentParser parser("Calculates average values or volumes of ROI labels.\n"
                             "If the --volumes flag is specified, only give the label images.\n"
-                            "If --volumes is not specified, give label and value image pairs (all labels first, then all values).\n"
+                            "If --volumes is not specified, give the label images followed by the value images (all labels first, then all values).\n"
+                            "With --maps=N there are N value images per label image, all the subjects for the first map, then all for the second and so on.\n"
                             "Output goes to stdout\n"
                             "http://github.com/spinicist/QUIT");
 args::PositionalList<std::string> in_paths(parser, "INPUT", "Input file paths.");
 args::HelpFlag help(parser, "HELP", "Show this help menu", {'h', "help"});
 args::Flag     verbose(parser, "VERBOSE", "Print more information (will mess up output, for test runs only)", {'v', "verbose"});
 args::Flag     volumes(parser, "VOLUMES", "Output ROI volumes, not average values (does not require value images)", {'V', "volumes"});
+args::ValueFlag<int> maps(parser, "MAPS", "Number of value images per label image (default 1)", {'m', "maps"}, 1);
 args::ValueFlag<std::string> label_list_path(parser, "LABELS", "Specify labels and names to use in text file 'label number, label name' one per line", {'l', "labels"});
 args::Flag     print_names(parser, "PRINT_NAMES", "Print label names in first column/row (LABEL_NUMBERS must be specified)", {'n', "print_names"});
 args::Flag     transpose(parser, "TRANSPOSE", "Transpose output table (values go in rows instead of columns", {'t', "transpose"});
+args::Flag     long_format(parser, "LONG", "Output one row per image and label, with a column for each statistic", {"long"});
 args::Flag     ignore_zero(parser, "IGNORE_ZERO", "Ignore 0 label (background)", {'z', "ignore_zero"});
 args::Flag     sigma(parser, "SIGMA", "Print ±std along with mean", {'s', "sigma"});
+args::Flag     median(parser, "MEDIAN", "Print the median instead of the mean", {"median"});
 args::ValueFlag<int> precision(parser, "PRECISION", "Number of decimal places (default 6)", {'p', "precision"}, 6);
 args::ValueFlag<std::string> delim(parser, "DELIMITER", "Specify delimiter to use between entries (default ,)", {'d',"delim"}, ",");
 args::ValueFlagList<std::string> header_paths(parser, "HEADER", "Add a header (can be specified multiple times)", {'H', "header"});
 args::ValueFlagList<std::string> header_names(parser, "HEADER NAME", "Header name (must be specified in same order as paths)", {"header_name"});
 args::ValueFlagList<double> scales(parser, "SCALE", "Divide ROI values by scale (must be same order as paths)", {"scale"});
+args::Flag     save_index(parser, "SAVE_INDEX", "Save a label index (.qiroi) next to each label image, which can be given instead of the image in later runs", {"save_index"});
+args::ValueFlag<int> threads(parser, "THREADS", "Process N subjects at once (default=4, 0=hardware limit)", {'T', "threads"}, 4);
 
 /*
- * Helper function to work out the label list
+ * Sums for one label of one image, the median is only filled in if requested
  */
-void GetLabelList(TLabels &label_numbers, std::vector<std::string> &label_names) {
-    if (label_list_path) {
-        if (verbose) std::cout << "Opening label list file: " << label_list_path.Get() << std::endl;
-        std::ifstream file(label_list_path.Get());
-        if (!file) {
-            QI_EXCEPTION("Could not open label list file: " << label_list_path.Get());
+struct ROIStats {
+    size_t count = 0;
+    double sum = 0, sum_sq = 0, median = 0;
+
+    double mean() const { return count ? sum / count : 0; }
+    double sigma() const { return count > 1 ? sqrt(std::max(0., (sum_sq - sum * sum / count) / (count - 1))) : 0; }
+};
+typedef std::map<int, ROIStats> TROIs;
+
+/*
+ * Where each label is in one label image, as runs of consecutive voxels grouped by label. This
+ * is worked out once per subject and then re-used for every value image, and can be saved so
+ * later runs on new maps of the same subject need not read the label image at all. Each label
+ * is gathered straight from its runs, so labels that are not wanted (e.g. a large background)
+ * cost nothing.
+ */
+struct LabelIndex {
+    std::array<uint64_t, 3> size{{0, 0, 0}};
+    double vox_volume = 0;
+    std::vector<int> labels;
+    std::vector<uint64_t> count;
+    std::vector<uint64_t> first; // Runs for label l are [first[l], first[l + 1])
+    std::vector<uint64_t> run_start;
+    std::vector<uint32_t> run_length;
+
+    LabelIndex() {}
+
+    /*
+     * Labels are looked up through a table when they span no more values than there are voxels,
+     * and by binary search otherwise.
+     */
+    LabelIndex(const QI::VolumeI::Pointer &img) {
+        for (int d = 0; d < 3; d++) {
+            size[d] = img->GetBufferedRegion().GetSize()[d];
         }
-        std::string temp;
-        while (std::getline(file, temp, ',')) {
-            label_numbers.push_back(stoi(temp));
-            std::getline(file, temp);
-            temp.erase(std::remove(temp.begin(), temp.end(), '\r'), temp.end()); // Deal with rogue ^M characters
-            label_names.push_back(temp);
-            if (verbose) std::cout << "Read label: " << label_numbers.back() << ", name: " << label_names.back() << std::endl;
+        vox_volume = QI::VoxelVolume(img);
+        const size_t n = img->GetBufferedRegion().GetNumberOfPixels();
+        const int *l = img->GetBufferPointer();
+        std::vector<uint32_t> slot(n);
+        if (n > 0) {
+            const auto mm = std::minmax_element(l, l + n);
+            const int64_t lo = *mm.first, range = int64_t(*mm.second) - lo + 1;
+            if (range <= int64_t(n)) {
+                std::vector<uint32_t> table(range, 0);
+                for (size_t i = 0; i < n; i++) {
+                    table[l[i] - lo] = 1;
+                }
+                for (int64_t r = 0; r < range; r++) {
+                    if (table[r]) {
+                        table[r] = labels.size();
+                        labels.push_back(lo + r);
+                    }
+                }
+                for (size_t i = 0; i < n; i++) {
+                    slot[i] = table[l[i] - lo];
+                }
+            } else {
+                labels.assign(l, l + n);
+                std::sort(labels.begin(), labels.end());
+                labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+                for (size_t i = 0; i < n; i++) {
+                    slot[i] = std::lower_bound(labels.begin(), labels.end(), l[i]) - labels.begin();
+                }
+            }
         }
-    } else {
-        TStatsFilter::Pointer label_filter = TStatsFilter::New();
-        if (verbose) std::cout << "Reading first label file to determine labels: " << QI::CheckList(in_paths).at(0) << std::endl;
-        label_filter->SetLabelInput(QI::ReadImage<QI::VolumeI>(QI::CheckList(in_paths).at(0)));
-        label_filter->SetInput(QI::ReadImage<QI::VolumeF>(QI::CheckList(in_paths).at(0))); // Dummy value because ITK complains input primary is not set
-        label_filter->Update();
-        label_numbers = label_filter->GetValidLabelValues();
-        std::sort(label_numbers.begin(), label_numbers.end());
-        if (verbose) {
-            std::cout << "Found the following labels:" << std::endl;
-            for (auto &l : label_numbers) std::cout << l << " ";
-            std::cout << std::endl;
+        // Count the runs of each label, then fill them in by label
+        const uint32_t max_run = std::numeric_limits<uint32_t>::max();
+        count.assign(labels.size(), 0);
+        std::vector<uint64_t> n_runs(labels.size(), 0);
+        uint32_t length = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (i == 0 || slot[i] != slot[i - 1] || length == max_run) {
+                n_runs[slot[i]]++;
+                length = 0;
+            }
+            length++;
+            count[slot[i]]++;
+        }
+        first.assign(labels.size() + 1, 0);
+        for (size_t s = 0; s < labels.size(); s++) {
+            first[s + 1] = first[s] + n_runs[s];
+        }
+        run_start.resize(first.back());
+        run_length.resize(first.back());
+        std::vector<uint64_t> next(first.begin(), first.end() - 1);
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t s = slot[i];
+            if (i == 0 || s != slot[i - 1] || run_length[next[s] - 1] == max_run) {
+                run_start[next[s]] = i;
+                run_length[next[s]] = 0;
+                next[s]++;
+            }
+            run_length[next[s] - 1]++;
         }
     }
-    if (ignore_zero) {
-        if (verbose) std::cout << "Removing zero from label list." << std::endl;
-        label_numbers.erase(std::remove(label_numbers.begin(), label_numbers.end(), 0), label_numbers.end());
+
+    uint64_t voxels() const { return size[0] * size[1] * size[2]; }
+
+    /*
+     * Statistics for the wanted labels (sorted, empty for all). The values of one label are only
+     * copied out if the median is needed.
+     */
+    TROIs accumulate(const float *values, const TLabels &wanted, const bool with_median) const {
+        TROIs rois;
+        std::vector<float> gathered;
+        for (size_t s = 0; s < labels.size(); s++) {
+            if (!Wanted(labels[s], wanted)) {
+                continue;
+            }
+            ROIStats &roi = rois[labels[s]];
+            roi.count = count[s];
+            if (with_median) {
+                gathered.clear();
+            }
+            for (uint64_t r = first[s]; r < first[s + 1]; r++) {
+                const float *v = values + run_start[r];
+                for (uint32_t i = 0; i < run_length[r]; i++) {
+                    roi.sum += v[i];
+                    roi.sum_sq += double(v[i]) * v[i];
+                }
+                if (with_median) {
+                    gathered.insert(gathered.end(), v, v + run_length[r]);
+                }
+            }
+            if (with_median && !gathered.empty()) {
+                auto mid = gathered.begin() + gathered.size() / 2;
+                std::nth_element(gathered.begin(), mid, gathered.end());
+                roi.median = *mid;
+                if (gathered.size() % 2 == 0) {
+                    roi.median = 0.5 * (roi.median + *std::max_element(gathered.begin(), mid));
+                }
+            }
+        }
+        return rois;
+    }
+
+    TROIs volumes(const TLabels &wanted) const {
+        TROIs rois;
+        for (size_t s = 0; s < labels.size(); s++) {
+            if (Wanted(labels[s], wanted)) {
+                rois[labels[s]].count = count[s];
+            }
+        }
+        return rois;
+    }
+
+    static bool Wanted(const int label, const TLabels &wanted) {
+        if (ignore_zero && label == 0) {
+            return false;
+        }
+        return wanted.empty() || std::binary_search(wanted.begin(), wanted.end(), label);
+    }
+
+    void save(const std::string &path) const {
+        QI::CacheOutput(path);
+        std::ofstream os(path, std::ios::binary);
+        os.write(IndexMagic, sizeof(IndexMagic));
+        {
+            cereal::PortableBinaryOutputArchive archive(os);
+            archive(IndexVersion, size, vox_volume, labels, count, first, run_start, run_length);
+        }
+        if (!os) {
+            QI_EXCEPTION("Failed to write label index " << path);
+        }
     }
+
+    void load(const std::string &path) {
+        std::ifstream is(path, std::ios::binary);
+        char magic[sizeof(IndexMagic)];
+        if (!is.read(magic, sizeof(magic)) || std::memcmp(magic, IndexMagic, sizeof(magic)) != 0) {
+            QI_EXCEPTION(path << " is not a label index file");
+        }
+        uint32_t version;
+        try {
+            cereal::PortableBinaryInputArchive archive(is);
+            archive(version);
+            if (version != IndexVersion) {
+                QI_EXCEPTION("Label index " << path << " is version " << version << ", expected " << IndexVersion << ". Regenerate it from the label image");
+            }
+            archive(size, vox_volume, labels, count, first, run_start, run_length);
+        } catch (cereal::Exception &e) {
+            QI_EXCEPTION("Failed to read label index " << path << ": " << e.what());
+        }
+        if (first.size() != labels.size() + 1 || count.size() != labels.size() ||
+            run_length.size() != run_start.size() || first.back() != run_start.size()) {
+            QI_EXCEPTION("Label index " << path << " is corrupt");
+        }
+        for (size_t r = 0; r < run_start.size(); r++) {
+            if (run_start[r] + run_length[r] > voxels()) {
+                QI_EXCEPTION("Label index " << path << " is corrupt");
+            }
+        }
+    }
+};
+
+/*
+ * Each subject's labels are read (from an image, or a saved index) once, and all of its value
+ * images accumulated against them, with the subjects shared out over the thread pool. Row r of
+ * the output comes from value image r, which belongs to label image r % n_subjects.
+ */
+void GetValues(const int n_subjects, const TLabels &labels, const bool with_median, std::vector<TROIs> &rows, std::vector<double> &vox_volumes) {
+    const int n_maps = volumes ? 1 : maps.Get();
+    TLabels wanted(labels);
+    std::sort(wanted.begin(), wanted.end());
+    rows = std::vector<TROIs>(n_subjects * n_maps);
+    vox_volumes = std::vector<double>(n_subjects);
+    std::vector<std::string> errors(n_subjects);
+    std::mutex log_mutex;
+    QI::ThreadPool::Global().run(n_subjects, [&](const size_t s) {
+        try {
+            const std::string &label_path = in_paths.Get().at(s);
+            LabelIndex index;
+            if (QI::GetExt(label_path) == IndexExt) {
+                if (verbose) { std::lock_guard<std::mutex> lock(log_mutex); std::cout << "Reading label index: " << label_path << std::endl; }
+                index.load(label_path);
+            } else {
+                if (verbose) { std::lock_guard<std::mutex> lock(log_mutex); std::cout << "Reading label file: " << label_path << std::endl; }
+                index = LabelIndex(QI::ReadImage<QI::VolumeI>(label_path));
+                if (save_index) {
+                    const std::string index_path = QI::StripExt(label_path) + IndexExt;
+                    if (verbose) { std::lock_guard<std::mutex> lock(log_mutex); std::cout << "Saving label index: " << index_path << std::endl; }
+                    index.save(index_path);
+                }
+            }
+            vox_volumes[s] = index.vox_volume;
+            if (volumes) {
+                rows[s] = index.volumes(wanted);
+                return;
+            }
+            for (int m = 0; m < n_maps; m++) {
+                const size_t r = m * n_subjects + s;
+                const std::string &value_path = in_paths.Get().at(n_subjects + r);
+                if (verbose) { std::lock_guard<std::mutex> lock(log_mutex); std::cout << "Reading value file: " << value_path << std::endl; }
+                QI::VolumeF::Pointer value_img = QI::ReadImage(value_path);
+                for (int d = 0; d < 3; d++) {
+                    if (value_img->GetBufferedRegion().GetSize()[d] != index.size[d]) {
+                        QI_EXCEPTION("Value image " << value_path << " is not the same size as labels " << label_path);
+                    }
+                }
+                rows[r] = index.accumulate(value_img->GetBufferPointer(), wanted, with_median);
+            }
+        } catch (std::exception &e) {
+            errors[s] = e.what();
+        }
+    });
+    for (int s = 0; s < n_subjects; s++) {
+        if (!errors[s].empty()) {
+            QI_EXCEPTION("Failed to process subject " << s << ": " << errors[s]);
+        }
+    }
+}
+
+/*
+ * Helper function to read the label list
+ */
+void ReadLabelList(TLabels &label_numbers, std::vector<std::string> &label_names) {
+    if (verbose) std::cout << "Opening label list file: " << label_list_path.Get() << std::endl;
+    std::ifstream file(label_list_path.Get());
+    if (!file) {
+        QI_EXCEPTION("Could not open label list file: " << label_list_path.Get());
+    }
+    std::string temp;
+    while (std::getline(file, temp, ',')) {
+        label_numbers.push_back(stoi(temp));
+        std::getline(file, temp);
+        temp.erase(std::remove(temp.begin(), temp.end(), '\r'), temp.end()); // Deal with rogue ^M characters
+        label_names.push_back(temp);
+        if (verbose) std::cout << "Read label: " << label_numbers.back() << ", name: " << label_names.back() << std::endl;
+    }
+}
+
+/*
+ * Helper function to find every label in any of the images, so the columns line up between subjects
+ */
+TLabels FoundLabels(const std::vector<TROIs> &rows) {
+    TLabels label_numbers;
+    for (const auto &row : rows) {
+        for (const auto &roi : row) {
+            label_numbers.push_back(roi.first);
+        }
+    }
+    std::sort(label_numbers.begin(), label_numbers.end());
+    label_numbers.erase(std::unique(label_numbers.begin(), label_numbers.end()), label_numbers.end());
+    if (verbose) {
+        std::cout << "Found the following labels:" << std::endl;
+        for (auto &l : label_numbers) std::cout << l << " ";
+        std::cout << std::endl;
+    }
+    return label_numbers;
 }
 
 /*
@@ -109,62 +387,27 @@ std::vector<std::vector<std::string>> GetHeaders(int n_files) {
     return headers;
 }
 
-/*
- * Helper function to actually work out all the values
- */
-void GetValues(const int n_files, const TLabels &labels, const std::vector<double> &scale_list,
-               std::vector<std::vector<double>> &mean_table, std::vector<std::vector<double>> &sigma_table, std::vector<std::vector<double>> &volume_table) {
-    mean_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
-    sigma_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
-    volume_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
-    TStatsFilter::Pointer label_filter = TStatsFilter::New();
-    QI::VolumeI::Pointer label_img = ITK_NULLPTR;
-    QI::VolumeF::Pointer value_img = ITK_NULLPTR;
-    for (int f = 0; f < n_files; f++) {
-        if (volumes) {
-            if (verbose) std::cout << "Reading label file: " << in_paths.Get().at(f) << std::endl;
-            label_img = QI::ReadImage<QI::VolumeI>(in_paths.Get().at(f));
-            value_img = QI::ReadImage(in_paths.Get().at(f)); // Dummy image
-        } else {
-            if (verbose) std::cout << "Reading label file: " << in_paths.Get().at(f) << std::endl;
-            label_img = QI::ReadImage<QI::VolumeI>(in_paths.Get().at(f));
-            if (verbose) std::cout << "Reading value file: " << in_paths.Get().at(f + n_files) << std::endl;
-            value_img = QI::ReadImage(in_paths.Get().at(f + n_files));
-        }
-        double vox_volume = QI::VoxelVolume(label_img);
-        label_filter->SetLabelInput(label_img);
-        label_filter->SetInput(value_img);
-        label_filter->Update();
-        for (int i = 0; i < labels.size(); i++) {
-            mean_table.at(f).at(i) = label_filter->GetMean(labels.at(i)) / scale_list.at(f);
-            sigma_table.at(f).at(i) = label_filter->GetSigma(labels.at(i)) / scale_list.at(f);
-            volume_table.at(f).at(i) = label_filter->GetCount(labels.at(i)) * vox_volume;
-        }
-    }
-}
-
 /*
  * MAIN
  */
 int main(int argc, char **argv) {
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
 
-    int n_files = QI::CheckList(in_paths).size();
+    const int n_inputs = QI::CheckList(in_paths).size();
+    int n_subjects = n_inputs, n_files = n_inputs;
     if (volumes) {
         if (verbose) std::cout << "There are " << n_files << " input images, finding ROI volumes" << std::endl;
     } else {
-        // For ROI values, we have label and value image pairs
-        if (n_files % 2 != 0) {
-            std::cerr << "Require an even number of input images when finding ROI values" << std::endl;
+        // For ROI values, we have label images followed by maps.Get() value images for each
+        if (maps.Get() < 1 || n_inputs % (maps.Get() + 1) != 0) {
+            std::cerr << "Require " << (maps.Get() + 1) << " images per subject when finding ROI values" << std::endl;
             return EXIT_FAILURE;
         }
-        n_files = n_files / 2;
-        if (verbose) std::cout << "There are " << n_files << " input image pairs, finding mean ROI values" << std::endl;
+        n_subjects = n_inputs / (maps.Get() + 1);
+        n_files = n_subjects * maps.Get();
+        if (verbose) std::cout << "There are " << n_subjects << " label images and " << n_files << " value images, finding ROI values" << std::endl;
     }
-    // Setup label number list
-    TLabels labels;
-    std::vector<std::string> label_names;
-    GetLabelList(labels, label_names);
 
     // Setup headers (if any)
     auto headers = GetHeaders(n_files);
@@ -184,13 +427,75 @@ int main(int argc, char **argv) {
         std::cout << std::endl;
     }
 
+    // Setup label number list, if not given then it comes from the images
+    TLabels labels;
+    std::vector<std::string> label_names;
+    if (label_list_path) {
+        ReadLabelList(labels, label_names);
+    }
+
     // Now get the values/volumes
-    std::vector<std::vector<double>> mean_table, sigma_table, volume_table;
-    GetValues(n_files, labels, scale_list, mean_table, sigma_table, volume_table);
+    std::vector<TROIs> rows;
+    std::vector<double> vox_volumes;
+    GetValues(n_subjects, labels, median || long_format, rows, vox_volumes);
+    if (!label_list_path) {
+        labels = FoundLabels(rows);
+    }
+    if (ignore_zero) {
+        if (verbose) std::cout << "Removing zero from label list." << std::endl;
+        for (size_t i = 0; i < labels.size(); i++) {
+            if (labels[i] == 0) {
+                labels.erase(labels.begin() + i);
+                if (label_list_path) label_names.erase(label_names.begin() + i);
+                break;
+            }
+        }
+    }
+
+    // Labels missing from an image get zeros
+    std::vector<std::vector<double>> mean_table(n_files, std::vector<double>(labels.size())),
+                                     sigma_table(mean_table), median_table(mean_table), volume_table(mean_table);
+    for (int f = 0; f < n_files; f++) {
+        for (int i = 0; i < labels.size(); i++) {
+            const auto roi = rows.at(f).find(labels.at(i));
+            if (roi != rows.at(f).end()) {
+                mean_table.at(f).at(i) = roi->second.mean() / scale_list.at(f);
+                sigma_table.at(f).at(i) = roi->second.sigma() / scale_list.at(f);
+                median_table.at(f).at(i) = roi->second.median / scale_list.at(f);
+                volume_table.at(f).at(i) = roi->second.count * vox_volumes.at(f % n_subjects);
+            }
+        }
+    }
+    const auto &value_table = median ? median_table : mean_table;
 
     if (verbose) std::cout << "Writing CSV: " << std::endl;
     if (precision) std::cout << std::fixed << std::setprecision(precision.Get());
-    if (transpose) {
+    if (long_format) {
+        for (int h = 0; h < headers.size(); ++h) {
+            std::cout << (header_names ? header_names.Get().at(h) : header_paths.Get().at(h)) << delim.Get();
+        }
+        std::cout << "label" << delim.Get();
+        if (label_list_path) std::cout << "name" << delim.Get();
+        std::cout << "volume";
+        if (!volumes) std::cout << delim.Get() << "mean" << delim.Get() << "sigma" << delim.Get() << "median";
+        std::cout << std::endl;
+        for (int row = 0; row < n_files; ++row) {
+            for (int l = 0; l < labels.size(); ++l) {
+                for (auto h = headers.begin(); h != headers.end(); h++) {
+                    std::cout << h->at(row) << delim.Get();
+                }
+                std::cout << labels.at(l) << delim.Get();
+                if (label_list_path) std::cout << label_names.at(l) << delim.Get();
+                std::cout << volume_table.at(row).at(l);
+                if (!volumes) {
+                    std::cout << delim.Get() << mean_table.at(row).at(l)
+                              << delim.Get() << sigma_table.at(row).at(l)
+                              << delim.Get() << median_table.at(row).at(l);
+                }
+                std::cout << std::endl;
+            }
+        }
+    } else if (transpose) {
         if (print_names) {
             for (int h = 0; h < headers.size(); ++h) {
                 if (header_names) {
@@ -213,7 +518,7 @@ int main(int argc, char **argv) {
             if (volumes) {
                 std::cout << volume_table.at(row).at(0);
             } else {
-                std::cout << mean_table.at(row).at(0);
+                std::cout << value_table.at(row).at(0);
                 if (sigma) std::cout << "±" << sigma_table.at(row).at(0);
             }
             for (int val = 1; val < labels.size(); ++val) {
@@ -221,7 +526,7 @@ int main(int argc, char **argv) {
                 if (volumes) {
                     std::cout << volume_table.at(row).at(val);
                 } else {
-                    std::cout << mean_table.at(row).at(val);
+                    std::cout << value_table.at(row).at(val);
                     if (sigma) std::cout << "±" << sigma_table.at(row).at(val);
                 }
             }
@@ -251,7 +556,7 @@ int main(int argc, char **argv) {
             if (volumes) {
                 std::cout << volume_table.at(0).at(l);
             } else {
-                std::cout << mean_table.at(0).at(l);
+                std::cout << value_table.at(0).at(l);
                 if (sigma) std::cout << "±" << sigma_table.at(0).at(l);
             }
             for (int file = 1; file < n_files; ++file) {
@@ -259,8 +564,8 @@ int main(int argc, char **argv) {
                 if (volumes) {
                     std::cout << volume_table.at(file).at(l);
                 } else {
-                    std::cout << mean_table.at(file).at(l);
-                    if (sigma) std::cout << "±" << sigma_table.at(0).at(l);
+                    std::cout << value_table.at(file).at(l);
+                    if (sigma) std::cout << "±" << sigma_table.at(file).at(l);
                 }
             }
             std::cout << std::endl;
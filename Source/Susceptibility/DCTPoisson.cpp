@@ -0,0 +1,117 @@
+/*
+ *  DCTPoisson.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <unsupported/Eigen/FFT>
+
+#include "DCTPoisson.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+
+namespace QI {
+
+DCTPoisson::DCTPoisson(const std::array<size_t, 3> &size, const std::array<double, 3> &spacing) :
+    m_size(size)
+{
+    size_t stride = 1;
+    for (int i = 0; i < 3; i++) {
+        if (size[i] == 0) {
+            QI_EXCEPTION("Cannot solve on a volume with a zero dimension");
+        }
+        Axis &axis = m_axes[i];
+        axis.n = size[i];
+        axis.stride = stride;
+        axis.eigenvalues.resize(axis.n);
+        axis.twiddles.resize(axis.n);
+        for (size_t k = 0; k < axis.n; k++) {
+            axis.eigenvalues[k] = (2. * cos(M_PI * k / axis.n) - 2.) / (spacing[i] * spacing[i]);
+            axis.twiddles[k] = std::polar(1., -M_PI * k / (2. * axis.n));
+        }
+        stride *= axis.n;
+    }
+}
+
+const std::array<size_t, 3> &DCTPoisson::size() const { return m_size; }
+
+/*
+ * Unnormalised DCT-II (and its exact inverse) along every line of one axis, each computed with
+ * an FFT of the same length after Makhoul, IEEE Trans. ASSP 28(1) 1980. The lines are shared
+ * between the threads of the global pool, each with its own FFT object because those cache
+ * their plans.
+ */
+void DCTPoisson::transform(std::vector<double> &volume, const Axis &axis, const bool inverse) const {
+    const size_t n = axis.n;
+    if (n == 1) {
+        return;
+    }
+    const size_t nLines = volume.size() / n;
+    ThreadPool &pool = ThreadPool::Global();
+    const size_t nTasks = std::min(pool.size(), nLines);
+    pool.run(nTasks, [&](const size_t t) {
+        Eigen::FFT<double> fft;
+        std::vector<double> v(n);
+        std::vector<std::complex<double>> V(n);
+        for (size_t l = (nLines * t) / nTasks; l < (nLines * (t + 1)) / nTasks; l++) {
+            double *x = volume.data() + (l / axis.stride) * axis.stride * n + (l % axis.stride);
+            const size_t s = axis.stride;
+            if (!inverse) {
+                for (size_t i = 0; i < (n + 1) / 2; i++) {
+                    v[i] = x[2*i*s];
+                }
+                for (size_t i = 0; i < n / 2; i++) {
+                    v[n - 1 - i] = x[(2*i + 1)*s];
+                }
+                fft.fwd(V.data(), v.data(), n);
+                for (size_t k = 0; k < n; k++) {
+                    x[k*s] = (axis.twiddles[k] * V[k]).real();
+                }
+            } else {
+                V[0] = x[0];
+                for (size_t k = 1; k < n; k++) {
+                    V[k] = std::conj(axis.twiddles[k]) * std::complex<double>(x[k*s], -x[(n - k)*s]);
+                }
+                fft.inv(v.data(), V.data(), n);
+                for (size_t i = 0; i < (n + 1) / 2; i++) {
+                    x[2*i*s] = v[i];
+                }
+                for (size_t i = 0; i < n / 2; i++) {
+                    x[(2*i + 1)*s] = v[n - 1 - i];
+                }
+            }
+        }
+    });
+}
+
+void DCTPoisson::solve(float *data) const {
+    const size_t nx = m_size[0], ny = m_size[1], nz = m_size[2];
+    std::vector<double> volume(data, data + nx * ny * nz);
+    for (int i = 0; i < 3; i++) {
+        transform(volume, m_axes[i], false);
+    }
+    // The DC term is the pole of the inverse, and sets the mean to zero
+    volume[0] = 0;
+    for (size_t k = 0; k < nz; k++) {
+        for (size_t j = 0; j < ny; j++) {
+            double *row = volume.data() + (k * ny + j) * nx;
+            const double yz = m_axes[1].eigenvalues[j] + m_axes[2].eigenvalues[k];
+            for (size_t i = (j == 0 && k == 0); i < nx; i++) {
+                row[i] /= m_axes[0].eigenvalues[i] + yz;
+            }
+        }
+    }
+    for (int i = 2; i >= 0; i--) {
+        transform(volume, m_axes[i], true);
+    }
+    std::copy(volume.begin(), volume.end(), data);
+}
+
+} // End namespace QI
@@ -0,0 +1,52 @@
+/*
+ *  DCTPoisson.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_DCTPOISSON_H
+#define QI_DCTPOISSON_H
+
+#include <array>
+#include <vector>
+#include <complex>
+
+namespace QI {
+
+/*
+ * Solves the discrete Poisson equation (the 7-point Laplacian) on a volume with zero-flux
+ * boundaries, i.e. the Laplacian with the edge voxels repeated outside the volume. The DCT-II
+ * diagonalises that operator exactly, so unlike an FFT there is no need to pad the volume and
+ * nothing wraps round from the far side. The eigenvalues are separable, so only one short array
+ * per axis is kept instead of a kernel image, and one solver can be re-used for every volume
+ * with the same size and spacing.
+ *
+ * The solution is only defined up to a constant, the one returned has zero mean.
+ */
+class DCTPoisson {
+public:
+    DCTPoisson(const std::array<size_t, 3> &size, const std::array<double, 3> &spacing);
+
+    const std::array<size_t, 3> &size() const;
+    void solve(float *data) const; // In-place, Laplacian in and solution out, x fastest
+
+protected:
+    struct Axis {
+        size_t n, stride;
+        std::vector<double> eigenvalues;              // Of the 1D Laplacian, divided by spacing^2
+        std::vector<std::complex<double>> twiddles;   // exp(-i pi k / 2n)
+    };
+    std::array<size_t, 3> m_size;
+    std::array<Axis, 3> m_axes;
+
+    void transform(std::vector<double> &volume, const Axis &axis, const bool inverse) const;
+};
+
+} // End namespace QI
+
+#endif // QI_DCTPOISSON_H
@@ -0,0 +1,96 @@
+/*
+ *  Dipole.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <cmath>
+
+#include "Dipole.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+typedef std::tuple<size_t, size_t, size_t, double, double, double, double, double, double> TKey;
+
+// Spatial frequency of each position along an axis, in cycles per mm, with the upper half negative
+std::vector<double> Frequencies(const size_t n, const double spacing) {
+    std::vector<double> k(n);
+    for (size_t q = 0; q < n; q++) {
+        const long f = (q < (n + 1) / 2) ? static_cast<long>(q) : static_cast<long>(q) - static_cast<long>(n);
+        k[q] = f / (n * spacing);
+    }
+    return k;
+}
+
+std::shared_ptr<const std::vector<double>> MakeDipole(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                      const std::array<double, 3> &b0) {
+    const double bn = std::sqrt(b0[0]*b0[0] + b0[1]*b0[1] + b0[2]*b0[2]);
+    if (bn == 0) {
+        QI_EXCEPTION("Field direction cannot be zero");
+    }
+    const std::array<size_t, 3> &size = fft.size();
+    const std::vector<double> kx = Frequencies(size[0], spacing[0]);
+    const std::vector<double> ky = Frequencies(size[1], spacing[1]);
+    const std::vector<double> kz = Frequencies(size[2], spacing[2]);
+    auto kernel = std::make_shared<std::vector<double>>(fft.count());
+    double *d = kernel->data();
+    for (size_t z = 0; z < size[2]; z++) {
+        for (size_t y = 0; y < size[1]; y++) {
+            for (size_t x = 0; x < size[0]; x++) {
+                const double k2 = kx[x]*kx[x] + ky[y]*ky[y] + kz[z]*kz[z];
+                const double kb = (kx[x]*b0[0] + ky[y]*b0[1] + kz[z]*b0[2]) / bn;
+                *d++ = (k2 > 0) ? 1./3. - (kb * kb) / k2 : 0.;
+            }
+        }
+    }
+    return kernel;
+}
+
+} // End anonymous namespace
+
+std::shared_ptr<const std::vector<double>> DipoleKernel(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                        const std::array<double, 3> &b0) {
+    static std::mutex mutex;
+    static std::map<TKey, std::shared_ptr<const std::vector<double>>> cache;
+    const TKey key{fft.size()[0], fft.size()[1], fft.size()[2], spacing[0], spacing[1], spacing[2], b0[0], b0[1], b0[2]};
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        it = cache.emplace(key, MakeDipole(fft, spacing, b0)).first;
+    }
+    return it->second;
+}
+
+std::vector<double> LaplaceKernel(const FFT3D &fft, const std::array<double, 3> &spacing) {
+    const std::array<size_t, 3> &size = fft.size();
+    std::array<std::vector<double>, 3> axes;
+    for (int a = 0; a < 3; a++) {
+        axes[a].resize(size[a]);
+        for (size_t q = 0; q < size[a]; q++) {
+            axes[a][q] = (2. - 2. * std::cos(2. * M_PI * q / size[a])) / (spacing[a] * spacing[a]);
+        }
+    }
+    std::vector<double> kernel(fft.count());
+    double *l = kernel.data();
+    for (size_t z = 0; z < size[2]; z++) {
+        for (size_t y = 0; y < size[1]; y++) {
+            for (size_t x = 0; x < size[0]; x++) {
+                *l++ = axes[0][x] + axes[1][y] + axes[2][z];
+            }
+        }
+    }
+    return kernel;
+}
+
+} // End namespace QI
@@ -0,0 +1,37 @@
+/*
+ *  Dipole.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_DIPOLE_H
+#define QI_DIPOLE_H
+
+#include <array>
+#include <vector>
+#include <memory>
+
+#include "FFT.h"
+
+namespace QI {
+
+/*
+ * The unit dipole kernel in k-space, D = 1/3 - (k.b)^2 / |k|^2, for volumes of the size of fft with
+ * the given spacing and field direction b (along the image axes, need not be normalised). D is 0 at
+ * the origin, and k is laid out as FFT3D leaves it, i.e. not shifted. As for SMVKernel, kernels are
+ * cached per size, spacing and direction.
+ */
+std::shared_ptr<const std::vector<double>> DipoleKernel(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                        const std::array<double, 3> &b0);
+
+// The eigenvalues of the Laplacian (a forward then backward difference), summed over the axes and laid out the same way
+std::vector<double> LaplaceKernel(const FFT3D &fft, const std::array<double, 3> &spacing);
+
+} // End namespace QI
+
+#endif // QI_DIPOLE_H
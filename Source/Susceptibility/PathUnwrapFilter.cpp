@@ -14,7 +14,13 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <array>
+
 #include "PathUnwrapFilter.h"
+#include "ThreadPool.h"
 #include "itkConstNeighborhoodIterator.h"
 #include "itkImageRegionIterator.h"
 
@@ -45,93 +51,165 @@ int UnwrapPathPhaseFilter::find_wrap(float phase1, float phase2) {
     }
 }
 
-// Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-void UnwrapPathPhaseFilter::merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                    std::shared_ptr<std::list<Voxel *>> group2,
-                    int wrap_delta) {
-    for (auto v : *group2) {
-        v->group = group1;
-        v->wraps += wrap_delta;
+UnwrapPathPhaseFilter::Groups::Groups(const size_t n) :
+    parent(n), wraps(n, 0), size(n, 1)
+{
+    for (size_t i = 0; i < n; i++) {
+        parent[i] = i;
     }
-    group1->splice(group1->end(), *group2);
 }
 
-void UnwrapPathPhaseFilter::GenerateData() {
-    //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
-    const auto region = this->GetInput()->GetLargestPossibleRegion();
-    const auto volume_size = region.GetSize()[0] * region.GetSize()[1] * region.GetSize()[2];
-    int volume_width = region.GetSize()[0];
-    int volume_height = region.GetSize()[1];
-    int volume_depth = region.GetSize()[2];
-
-    std::vector<Voxel> voxels;
-    voxels.reserve(volume_size);
-    ImageRegionConstIterator<TImage> phaseIter(this->GetInput(0), region);
-    ImageRegionConstIterator<TImage> relIter(this->GetInput(1), region);
-    while (!phaseIter.IsAtEnd()) {
-        voxels.emplace_back(Voxel{phaseIter.Get(), relIter.Get()});
-        voxels.back().group->push_front(&voxels.back());
-        ++phaseIter; ++relIter;
+uint32_t UnwrapPathPhaseFilter::Groups::find(const uint32_t v, int32_t &wraps_to_root) {
+    uint32_t root = v;
+    int32_t total = 0;
+    while (parent[root] != root) {
+        total += wraps[root];
+        root = parent[root];
     }
-    std::vector<Edge> edges;
-    edges.reserve(3 * volume_size);
-    std::vector<Voxel>::iterator v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width - 1; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + 1)->reliability,
-                                    &*v_it, &*(v_it + 1),
-                                    find_wrap(v_it->phase, (v_it + 1)->phase)});
-                v_it++;
-            }
-        v_it++;
-        }
+    // Point everything on the path straight at the root
+    uint32_t node = v;
+    int32_t remaining = total;
+    while (parent[node] != root && node != root) {
+        const uint32_t next = parent[node];
+        const int32_t step = wraps[node];
+        parent[node] = root;
+        wraps[node] = remaining;
+        remaining -= step;
+        node = next;
     }
+    wraps_to_root = total;
+    return root;
+}
+
+namespace {
 
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height - 1; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width)->reliability,
-                                    &*v_it, &*(v_it + volume_width),
-                                    find_wrap(v_it->phase, (v_it + volume_width)->phase)});
-                v_it++;
+/*
+ * Maps a float to an unsigned integer with the same ordering, so the edges can be radix sorted.
+ * -0 is folded into +0 first because the comparison sort treated them as equal.
+ */
+inline uint32_t SortKey(float f) {
+    f += 0.0f;
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+/*
+ * Stable LSD radix sort on the key, 8 bits per pass. Equal reliabilities therefore stay in the
+ * order the edges were created, exactly as with std::stable_sort. Each task counts and then
+ * scatters its own contiguous chunk, and the chunks are given their output positions in order
+ * within each digit, so the result does not depend on the number of tasks.
+ */
+template<typename TEdge> void RadixSort(std::vector<TEdge> &edges, const size_t nTasks) {
+    const size_t n = edges.size();
+    std::vector<TEdge> temp(n);
+    std::vector<std::array<size_t, 256>> counts(nTasks);
+    for (int shift = 0; shift < 32; shift += 8) {
+        QI::ThreadPool::Global().run(nTasks, [&](const size_t t) {
+            counts[t].fill(0);
+            for (size_t i = (n * t) / nTasks; i < (n * (t + 1)) / nTasks; i++) {
+                counts[t][(edges[i].key >> shift) & 0xFF]++;
             }
+        });
+        size_t offset = 0;
+        bool same = false;
+        for (int b = 0; b < 256; b++) {
+            const size_t start = offset;
+            for (size_t t = 0; t < nTasks; t++) {
+                const size_t c = counts[t][b];
+                counts[t][b] = offset;
+                offset += c;
+            }
+            if (offset - start == n) {
+                same = true; // Every key has the same byte here
+            }
+        }
+        if (same) {
+            continue;
         }
-        v_it+=volume_width;
+        QI::ThreadPool::Global().run(nTasks, [&](const size_t t) {
+            std::array<size_t, 256> &next = counts[t];
+            for (size_t i = (n * t) / nTasks; i < (n * (t + 1)) / nTasks; i++) {
+                temp[next[(edges[i].key >> shift) & 0xFF]++] = edges[i];
+            }
+        });
+        edges.swap(temp);
+    }
+}
+
+} // End anonymous namespace
+
+void UnwrapPathPhaseFilter::GenerateData() {
+    const auto region = this->GetInput()->GetLargestPossibleRegion();
+    const size_t volume_width = region.GetSize()[0];
+    const size_t volume_height = region.GetSize()[1];
+    const size_t volume_depth = region.GetSize()[2];
+    const size_t volume_size = volume_width * volume_height * volume_depth;
+    if (3 * volume_size > std::numeric_limits<uint32_t>::max()) {
+        itkExceptionMacro("Volume is too large for path unwrapping: " << region.GetSize());
+    }
+    if (volume_size == 0) {
+        return;
     }
+    const float *phase = this->GetInput(0)->GetBufferPointer();
+    const float *reliability = this->GetInput(1)->GetBufferPointer();
+
+    // Edge building and sorting are shared between threads, merging has to stay in order
+    const size_t nTasks = std::max<size_t>(1, std::min<size_t>(this->GetNumberOfThreads(), QI::ThreadPool::Global().size()));
 
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth - 1; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width*volume_height)->reliability,
-                                    &*v_it, &*(v_it + (volume_width*volume_height)),
-                                    find_wrap(v_it->phase, (v_it + volume_width*volume_height)->phase)});
-                v_it++;
+    /*
+     * Same order as the voxels, first all x edges, then y, then z. The number of edges in each
+     * slice is known, so every slab of slices can be filled in independently.
+     */
+    const size_t strides[3] = {1, volume_width, volume_width * volume_height};
+    const size_t per_slice[3] = {(volume_width - 1) * volume_height, volume_width * (volume_height - 1), volume_width * volume_height};
+    const size_t starts[3] = {0, volume_depth * per_slice[0], volume_depth * (per_slice[0] + per_slice[1])};
+    std::vector<Edge> edges(starts[2] + (volume_depth - 1) * per_slice[2]);
+    QI::ThreadPool::Global().run(nTasks, [&](const size_t t) {
+        for (int d = 0; d < 3; d++) {
+            const size_t end_slice = std::min((volume_depth * (t + 1)) / nTasks, volume_depth - (d == 2));
+            for (size_t n = (volume_depth * t) / nTasks; n < end_slice; n++) {
+                Edge *edge = &edges[starts[d] + n * per_slice[d]];
+                for (size_t i = 0; i < volume_height - (d == 1); i++) {
+                    for (size_t j = 0; j < volume_width - (d == 0); j++) {
+                        const size_t v = (n * volume_height + i) * volume_width + j;
+                        *edge++ = Edge{SortKey(reliability[v] + reliability[v + strides[d]]), static_cast<uint32_t>(3*v + d)};
+                    }
+                }
             }
         }
+    });
+    if (!edges.empty()) {
+        RadixSort(edges, nTasks);
     }
 
-    std::stable_sort(edges.begin(), edges.end(), [](Edge a, Edge b){ return a.reliability < b.reliability; });
-    for (auto &edge : edges) {
-        Voxel *voxel1 = edge.voxel1;
-        Voxel *voxel2 = edge.voxel2;
-        if (voxel2->group != voxel1->group) {
-            if (voxel1->group->size() > voxel2->group->size()) {
-                merge_groups(voxel1->group, voxel2->group, voxel1->wraps - edge.wrap - voxel2->wraps);
+    Groups groups(volume_size);
+    for (const auto &edge : edges) {
+        const uint32_t voxel1 = edge.index / 3;
+        const uint32_t voxel2 = voxel1 + strides[edge.index % 3];
+        int32_t wraps1, wraps2;
+        const uint32_t root1 = groups.find(voxel1, wraps1);
+        const uint32_t root2 = groups.find(voxel2, wraps2);
+        if (root1 != root2) {
+            const int wrap = find_wrap(phase[voxel1], phase[voxel2]);
+            if (groups.size[root1] > groups.size[root2]) {
+                groups.parent[root2] = root1;
+                groups.wraps[root2] = wraps1 - wrap - wraps2;
+                groups.size[root1] += groups.size[root2];
             } else {
-                merge_groups(voxel2->group, voxel1->group, voxel2->wraps + edge.wrap - voxel1->wraps);
+                groups.parent[root1] = root2;
+                groups.wraps[root1] = wraps2 + wrap - wraps1;
+                groups.size[root2] += groups.size[root1];
             }
         }
     }
 
     // Unwrap voxels and reassemble into image
     ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
-    v_it = voxels.begin();
-    while (!outputIter.IsAtEnd()) {
-        outputIter.Set(v_it->phase + 2*M_PI*v_it->wraps);
-        ++v_it; ++outputIter;
+    for (uint32_t v = 0; v < volume_size; v++, ++outputIter) {
+        int32_t wraps;
+        groups.find(v, wraps);
+        outputIter.Set(phase[v] + 2*M_PI*wraps);
     }
 }
 
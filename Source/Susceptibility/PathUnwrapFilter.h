@@ -17,6 +17,8 @@
 #ifndef PATH_UNWRAP_FILTER_H
 #define PATH_UNWRAP_FILTER_H
 
+#include <vector>
+#include <cstdint>
 #include "itkImageToImageFilter.h"
 #include "ImageTypes.h"
 
@@ -40,36 +42,27 @@ protected:
     UnwrapPathPhaseFilter();
     ~UnwrapPathPhaseFilter() {}
 
-    struct Voxel {
-        float phase;
-        float reliability;
-        int wraps;
-        std::shared_ptr<std::list<Voxel *>> group;
-
-        Voxel() {}
-        Voxel(float ph, float rel) {
-            phase = ph; reliability = rel;
-            wraps = 0;
-            group = std::make_shared<std::list<Voxel *>>();
-            // group->push_front(this);
-            // std::cout << "New Voxel " << this << " / " << group->front() << std::endl;
-        }
+    /*
+     * Groups of voxels are a union-find forest with the wraps stored relative to the parent, so
+     * the wraps of a voxel are the sum along its path to the root. Roots never move, so their
+     * wraps are always zero.
+     */
+    struct Groups {
+        std::vector<uint32_t> parent;
+        std::vector<int32_t> wraps;
+        std::vector<uint32_t> size; // Only valid for roots
+
+        Groups(const size_t n);
+        uint32_t find(const uint32_t v, int32_t &wraps_to_root); // With path compression
     };
 
     struct Edge {
-        float reliability;			//reliabilty of the edge and its equal to the sum of the reliability of the two voxels that it conntects
-        Voxel *voxel1;		//pointer to the first voxel
-        Voxel *voxel2;		//pointer to the second voxel
-        int wrap;			//No. of 2*pi to add to the voxel to unwrap it 
-    }; 
+        uint32_t key;   // Reliability (sum of the two voxels) as an integer that sorts the same way
+        uint32_t index; // 3 * first voxel + direction (0 = x, 1 = y, 2 = z)
+    };
 
     int find_wrap(float phase1, float phase2);
 
-    // Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-    void merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                      std::shared_ptr<std::list<Voxel *>> group2,
-                      int wrap_delta);
-
     void GenerateData() ITK_OVERRIDE;
 
 private:
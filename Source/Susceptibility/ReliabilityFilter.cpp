@@ -14,9 +14,10 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <algorithm>
+
 #include "ReliabilityFilter.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIterator.h"
+#include "CPU.h"
 
 namespace itk {
 
@@ -26,48 +27,114 @@ PhaseReliabilityFilter::PhaseReliabilityFilter() {
     this->SetNthOutput(0, this->MakeOutput(0));
 }
 
+namespace {
+
+inline float Wrap(const float voxel_value) {
+    // Arithmetic instead of branches so the rows vectorise, but the same result
+    const double v = voxel_value;
+    return v - (2*M_PI) * (double(v > M_PI) - double(v < -M_PI));
+}
+
+} // End anonymous namespace
+
 float PhaseReliabilityFilter::wrap(float voxel_value) {
-    if (voxel_value > M_PI) {
-        return voxel_value - (2*M_PI);
-    } else if (voxel_value < -M_PI) {
-        return voxel_value + (2*M_PI);
-    } else {
-        return voxel_value;
+    return Wrap(voxel_value);
+}
+
+namespace {
+
+/*
+ * The 13 backward neighbours, the forward neighbour of each is the opposite offset. Together
+ * they cover the 26-neighbourhood, and are summed in this order.
+ */
+const int Offsets[13][3] = { {-1, 0, 0}, { 0,-1, 0}, { 0, 0,-1},
+                             {-1,-1, 0}, { 1,-1, 0}, {-1,-1,-1},
+                             { 0,-1,-1}, { 1,-1,-1}, {-1, 0,-1},
+                             {-1, 1,-1}, { 1, 0,-1}, { 0, 1,-1},
+                             { 1, 1,-1} };
+
+inline long Clamp(const long i, const long size) {
+    return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+/*
+ * The interior of a row, where every neighbour is a fixed stride away. Most of the time goes
+ * here, so it is built for each instruction set (see QI_MULTIVERSION).
+ */
+QI_MULTIVERSION void InteriorRow(const float *centre, const long *strides, const long n, float *reliability) {
+    for (long x = 0; x < n; x++) {
+        reliability[x] = 0;
+    }
+    for (int j = 0; j < 13; j++) {
+        const float *back = centre + strides[j];
+        const float *fwrd = centre - strides[j];
+        for (long x = 0; x < n; x++) {
+            const float d = Wrap(back[x] - centre[x]) - Wrap(centre[x] - fwrd[x]);
+            reliability[x] += d*d;
+        }
     }
 }
 
+} // End anonymous namespace
+
+/*
+ * Works directly on the buffers. Voxels away from the edges of the buffer use fixed strides so
+ * whole rows can be vectorised, only the outer shell needs the neighbours clamped to the edge,
+ * which is what the neighbourhood iterator's default zero-flux boundary condition did.
+ */
 void PhaseReliabilityFilter::ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) {
-    using TIter = ImageRegionIterator<TImage>;
-    using TCNIter = ConstNeighborhoodIterator<TImage>;
-    using TOffset = TCNIter::OffsetType;
-    TCNIter::RadiusType radius; radius.Fill(1);
-    TCNIter inputIter(radius, this->GetInput(0), region);
-    TIter   outputIter(this->GetOutput(), region);
-    std::vector<TOffset> back = { {{-1, 0, 0}}, {{ 0,-1, 0}}, {{ 0, 0,-1}},
-                                    {{-1,-1, 0}}, {{ 1,-1, 0}}, {{-1,-1,-1}},
-                                    {{ 0,-1,-1}}, {{ 1,-1,-1}}, {{-1, 0,-1}},
-                                    {{-1, 1,-1}}, {{ 1, 0,-1}}, {{ 0, 1,-1}},
-                                    {{ 1, 1,-1}} };
-    std::vector<TOffset> fwrd = { {{ 1, 0, 0}}, {{ 0, 1, 0}}, {{ 0, 0, 1}},
-                                    {{ 1, 1, 0}}, {{-1, 1, 0}}, {{ 1, 1, 1}},
-                                    {{ 0, 1, 1}}, {{-1, 1, 1}}, {{ 1, 0, 1}},
-                                    {{ 1,-1, 1}}, {{-1, 0, 1}}, {{ 0,-1, 1}},
-                                    {{-1,-1, 1}} };
-
-    inputIter.GoToBegin();
-    outputIter.GoToBegin();
-
-    while (!inputIter.IsAtEnd()) {
-        const float phase = inputIter.GetCenterPixel();
-        float reliability = 0;
-        for (auto j = 0; j < back.size(); j++) {
-            const float d = wrap(inputIter.GetPixel(back[j]) - phase) -
-                            wrap(phase - inputIter.GetPixel(fwrd[j]));
-            reliability += d*d;
+    const TImage *input = this->GetInput(0);
+    TImage *output = this->GetOutput();
+    const TRegion buffer = input->GetBufferedRegion();
+    const long size[3] = {static_cast<long>(buffer.GetSize()[0]), static_cast<long>(buffer.GetSize()[1]), static_cast<long>(buffer.GetSize()[2])};
+    const float *in = input->GetBufferPointer();
+    float *out = output->GetBufferPointer();
+
+    long strides[13];
+    for (int j = 0; j < 13; j++) {
+        strides[j] = Offsets[j][0] + size[0] * (Offsets[j][1] + size[1] * Offsets[j][2]);
+    }
+
+    const long x0 = region.GetIndex()[0] - buffer.GetIndex()[0];
+    const long x1 = x0 + region.GetSize()[0];
+    for (size_t k = 0; k < region.GetSize()[2]; k++) {
+        for (size_t i = 0; i < region.GetSize()[1]; i++) {
+            TImage::IndexType index = region.GetIndex();
+            index[1] += i;
+            index[2] += k;
+            const long y = index[1] - buffer.GetIndex()[1];
+            const long z = index[2] - buffer.GetIndex()[2];
+            const float *in_row = in + size[0] * (y + size[1] * z);
+            float *out_row = out + output->ComputeOffset(index) - x0;
+
+            // Interior of the row, the same range for every offset so it can be vectorised
+            long inner0 = x1, inner1 = x1;
+            if (y > 0 && y < size[1] - 1 && z > 0 && z < size[2] - 1) {
+                inner0 = std::max(x0, 1L);
+                inner1 = std::max(inner0, std::min(x1, size[0] - 1));
+                InteriorRow(in_row + inner0, strides, inner1 - inner0, out_row + inner0);
+            }
+
+            // Everything else in the row, with the neighbours clamped into the buffer
+            auto clamped = [&](const long x) {
+                const float phase = in_row[x];
+                float reliability = 0;
+                for (int j = 0; j < 13; j++) {
+                    const float b = in[Clamp(x + Offsets[j][0], size[0]) + size[0] * (Clamp(y + Offsets[j][1], size[1]) + size[1] * Clamp(z + Offsets[j][2], size[2]))];
+                    const float f = in[Clamp(x - Offsets[j][0], size[0]) + size[0] * (Clamp(y - Offsets[j][1], size[1]) + size[1] * Clamp(z - Offsets[j][2], size[2]))];
+                    const float d = Wrap(b - phase) - Wrap(phase - f);
+                    reliability += d*d;
+                }
+                out_row[x] = reliability;
+            };
+            for (long x = x0; x < inner0; x++) {
+                clamped(x);
+            }
+            for (long x = inner1; x < x1; x++) {
+                clamped(x);
+            }
         }
-        outputIter.Set(reliability);
-        ++inputIter; ++outputIter;
     }
 }
 
-} // End namespace itk
\ No newline at end of file
+} // End namespace itk
@@ -0,0 +1,83 @@
+/*
+ *  SMV.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <cmath>
+
+#include "SMV.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+typedef std::tuple<size_t, size_t, size_t, double, double, double, double> TKey;
+
+std::shared_ptr<const std::vector<double>> MakeKernel(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                      const double radius, const size_t nThreads) {
+    const std::array<size_t, 3> &size = fft.size();
+    std::array<long, 3> reach;
+    for (int d = 0; d < 3; d++) {
+        reach[d] = static_cast<long>(std::floor(radius / spacing[d]));
+        if (2 * reach[d] + 1 > static_cast<long>(size[d])) {
+            QI_EXCEPTION("SMV radius " << radius << " mm does not fit inside the volume");
+        }
+    }
+    // Offsets are wrapped round so the sphere is centred on voxel 0
+    std::vector<FFT3D::TComplex> data(fft.count(), FFT3D::TComplex(0.));
+    size_t inside = 0;
+    for (long z = -reach[2]; z <= reach[2]; z++) {
+        for (long y = -reach[1]; y <= reach[1]; y++) {
+            for (long x = -reach[0]; x <= reach[0]; x++) {
+                const double dx = x * spacing[0], dy = y * spacing[1], dz = z * spacing[2];
+                if (dx*dx + dy*dy + dz*dz <= radius*radius) {
+                    const size_t i = (x < 0 ? x + size[0] : x) +
+                                     size[0] * ((y < 0 ? y + size[1] : y) + size[1] * (z < 0 ? z + size[2] : z));
+                    data[i] = 1.;
+                    inside++;
+                }
+            }
+        }
+    }
+    if (inside < 2) {
+        QI_EXCEPTION("SMV radius " << radius << " mm is smaller than a voxel");
+    }
+    fft.forward(data.data(), nThreads);
+    auto kernel = std::make_shared<std::vector<double>>(data.size());
+    for (size_t i = 0; i < data.size(); i++) {
+        (*kernel)[i] = data[i].real() / inside;
+    }
+    return kernel;
+}
+
+} // End anonymous namespace
+
+std::shared_ptr<const std::vector<double>> SMVKernel(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                     const double radius, const size_t nThreads) {
+    static std::mutex mutex;
+    static std::map<TKey, std::shared_ptr<const std::vector<double>>> cache;
+    const TKey key{fft.size()[0], fft.size()[1], fft.size()[2], spacing[0], spacing[1], spacing[2], radius};
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+    // Made outside the lock, since nThreads > 1 uses the pool. Two threads may race to make the same one.
+    auto kernel = MakeKernel(fft, spacing, radius, nThreads);
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.emplace(key, kernel).first->second;
+}
+
+} // End namespace QI
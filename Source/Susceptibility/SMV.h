@@ -0,0 +1,36 @@
+/*
+ *  SMV.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_SMV_H
+#define QI_SMV_H
+
+#include <array>
+#include <vector>
+#include <memory>
+
+#include "FFT.h"
+
+namespace QI {
+
+/*
+ * The Fourier transform of the spherical mean value kernel, i.e. a sphere of the given radius in mm
+ * holding 1/(number of voxels inside) and centred on voxel 0, for volumes of the size of fft. The
+ * kernel is symmetric so its transform is real. Kernels are cached per size, spacing and radius,
+ * so asking for the same one again (V-SHARP uses each radius on both the mask and the field, and
+ * the largest again to deconvolve) does not repeat the transform. Safe to call from several
+ * threads. Throws if the sphere is no bigger than one voxel.
+ */
+std::shared_ptr<const std::vector<double>> SMVKernel(const FFT3D &fft, const std::array<double, 3> &spacing,
+                                                     const double radius, const size_t nThreads = 1);
+
+} // End namespace QI
+
+#endif // QI_SMV_H
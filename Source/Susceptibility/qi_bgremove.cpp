@@ -0,0 +1,193 @@
+/*
+ *  qi_bgremove.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+
+#include "ImageTypes.h"
+#include "Util.h"
+#include "ImageIO.h"
+#include "Args.h"
+#include "ThreadPool.h"
+#include "ElementwiseMap.h"
+#include "FFT.h"
+#include "SMV.h"
+
+namespace {
+
+typedef std::array<size_t, 3> TSize;
+typedef QI::FFT3D::TComplex TComplex;
+
+std::vector<double> ReadRadii(const std::string &list) {
+    std::vector<double> radii;
+    std::istringstream iss(list);
+    std::string el;
+    while (std::getline(iss, el, ',')) {
+        const double r = std::stod(el);
+        if (r <= 0) QI_FAIL("SMV radii must be positive: " << list);
+        radii.push_back(r);
+    }
+    if (radii.empty()) QI_FAIL("No SMV radii given");
+    // Largest first, and each only once
+    std::sort(radii.begin(), radii.end(), std::greater<double>());
+    radii.erase(std::unique(radii.begin(), radii.end()), radii.end());
+    return radii;
+}
+
+// Copies a volume into the middle of the padded buffer, with zeros around it
+template<typename T>
+void Pad(const T *in, const TSize &size, const TSize &padded, const TSize &offset, TComplex *out) {
+    std::fill(out, out + padded[0] * padded[1] * padded[2], TComplex(0.));
+    for (size_t k = 0; k < size[2]; k++) {
+        for (size_t j = 0; j < size[1]; j++) {
+            TComplex *row = out + ((k + offset[2]) * padded[1] + j + offset[1]) * padded[0] + offset[0];
+            for (size_t i = 0; i < size[0]; i++) {
+                row[i] = TComplex(static_cast<double>(*in++));
+            }
+        }
+    }
+}
+
+} // End anonymous namespace
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("V-SHARP background field removal\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> input_path(parser, "FIELD", "Unwrapped phase or field map");
+    args::Positional<std::string> mask_path(parser, "MASK", "Brain mask");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
+    args::ValueFlag<std::string> radii_arg(parser, "RADII", "SMV kernel radii in mm (default 12,10,8,6,4,2)", {'r', "radii"}, "12,10,8,6,4,2");
+    args::ValueFlag<double> thresh(parser, "THRESH", "Truncation threshold for the deconvolution (default 0.05)", {'t', "thresh"}, 0.05);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    const std::vector<double> radii = ReadRadii(radii_arg.Get());
+    const size_t nRadii = radii.size();
+
+    if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
+    QI::VolumeF::Pointer field = QI::ReadImage(QI::CheckPos(input_path));
+    if (verbose) std::cout << "Opening mask file: " << QI::CheckPos(mask_path) << std::endl;
+    QI::VolumeUC::Pointer mask = QI::ReadImage<QI::VolumeUC>(QI::CheckPos(mask_path));
+    if (field->GetLargestPossibleRegion().GetSize() != mask->GetLargestPossibleRegion().GetSize()) {
+        QI_FAIL("Mask is not the same size as the field");
+    }
+    const std::string prefix = (outarg ? outarg.Get() : QI::StripExt(input_path.Get()));
+
+    /*
+     * The convolutions are circular, so the volume is zero-padded by the largest radius to stop
+     * spheres near one edge reaching round to the other, then up to a size that transforms fast.
+     */
+    TSize size, padded, offset;
+    std::array<double, 3> spacing;
+    for (int d = 0; d < 3; d++) {
+        size[d] = field->GetLargestPossibleRegion().GetSize()[d];
+        spacing[d] = field->GetSpacing()[d];
+        padded[d] = QI::FFT3D::GoodSize(size[d] + 2 * static_cast<size_t>(std::ceil(radii.front() / spacing[d])));
+        offset[d] = (padded[d] - size[d]) / 2;
+    }
+    if (verbose) std::cout << "Padded size: " << padded[0] << "," << padded[1] << "," << padded[2] << std::endl;
+    const QI::FFT3D fft(padded);
+    const size_t nThreads = QI::ThreadPool::Global().size();
+    const size_t count = fft.count();
+    std::vector<TComplex> kspace(count), work(count);
+
+    /*
+     * A voxel keeps its sphere of radius r if the whole sphere is inside the mask, i.e. the SMV
+     * of the mask is 1 there. The eroded masks are nested, so one byte per voxel records the
+     * largest radius that fits, or nRadii for none.
+     */
+    std::vector<unsigned char> level(count, static_cast<unsigned char>(nRadii));
+    Pad(mask->GetBufferPointer(), size, padded, offset, kspace.data());
+    fft.forward(kspace.data(), nThreads);
+    for (size_t r = 0; r < nRadii; r++) {
+        if (verbose) std::cout << "Eroding mask with radius " << radii[r] << " mm" << std::endl;
+        const std::vector<double> &smv = *QI::SMVKernel(fft, spacing, radii[r], nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) work[i] = kspace[i] * smv[i];
+        });
+        fft.inverse(work.data(), nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) {
+                if (level[i] == nRadii && work[i].real() > 0.999) level[i] = static_cast<unsigned char>(r);
+            }
+        });
+    }
+    mask = ITK_NULLPTR;
+
+    /*
+     * The field minus its SMV removes the harmonic background, and each voxel takes it from the
+     * largest sphere that fits. The result is then deconvolved with the largest kernel, leaving
+     * out the frequencies where 1 - SMV is below the threshold.
+     */
+    std::vector<TComplex> combined(count, TComplex(0.));
+    Pad(field->GetBufferPointer(), size, padded, offset, kspace.data());
+    fft.forward(kspace.data(), nThreads);
+    for (size_t r = 0; r < nRadii; r++) {
+        if (verbose) std::cout << "High-pass filtering with radius " << radii[r] << " mm" << std::endl;
+        const std::vector<double> &smv = *QI::SMVKernel(fft, spacing, radii[r], nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) work[i] = kspace[i] * (1. - smv[i]);
+        });
+        fft.inverse(work.data(), nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) {
+                if (level[i] == r) combined[i] = work[i].real();
+            }
+        });
+    }
+    std::vector<TComplex>().swap(kspace);
+    std::vector<TComplex>().swap(work);
+
+    if (verbose) std::cout << "Deconvolving with radius " << radii.front() << " mm, threshold " << thresh.Get() << std::endl;
+    fft.forward(combined.data(), nThreads);
+    const std::vector<double> &largest = *QI::SMVKernel(fft, spacing, radii.front(), nThreads);
+    QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+        for (size_t i = start; i < start + len; i++) {
+            const double k = 1. - largest[i];
+            combined[i] = (std::abs(k) > thresh.Get()) ? combined[i] / k : TComplex(0.);
+        }
+    });
+    fft.inverse(combined.data(), nThreads);
+
+    // The local field goes back into the input buffer, and the mask of the smallest radius is kept
+    QI::VolumeUC::Pointer eroded = QI::VolumeUC::New();
+    eroded->CopyInformation(field);
+    eroded->SetRegions(field->GetLargestPossibleRegion());
+    eroded->Allocate();
+    float *out = field->GetBufferPointer();
+    unsigned char *m = eroded->GetBufferPointer();
+    for (size_t k = 0; k < size[2]; k++) {
+        for (size_t j = 0; j < size[1]; j++) {
+            const size_t row = ((k + offset[2]) * padded[1] + j + offset[1]) * padded[0] + offset[0];
+            for (size_t i = 0; i < size[0]; i++) {
+                const bool inside = level[row + i] < nRadii;
+                *out++ = inside ? static_cast<float>(combined[row + i].real()) : 0.f;
+                *m++ = inside ? 1 : 0;
+            }
+        }
+    }
+
+    const std::string outname = prefix + "_local" + QI::OutExt();
+    if (verbose) std::cout << "Output filename: " << outname << std::endl;
+    QI::WriteImage(field, outname);
+    QI::WriteImage(eroded, prefix + "_mask" + QI::OutExt(), QI::AuxiliaryStorage());
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
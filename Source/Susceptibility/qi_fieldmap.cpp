@@ -0,0 +1,243 @@
+/*
+ *  qi_fieldmap.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <Eigen/Dense>
+
+#include "itkVectorIndexSelectionCastImageFilter.h"
+
+#include "Util.h"
+#include "ImageIO.h"
+#include "Args.h"
+#include "ApplyTypes.h"
+#include "ThreadPool.h"
+#include "Fit.h"
+#include "MultiEchoSequence.h"
+#include "SequenceCereal.h"
+#include "ReliabilityFilter.h"
+#include "PathUnwrapFilter.h"
+
+/*
+ * The phase of each echo is phi0 + 2 pi f0 TE. The echoes are unwrapped in time, each to within pi
+ * of the value predicted from the previous two, and then fitted with a straight line. Without
+ * weights the design matrix is the same for every voxel so one factorisation fits a whole block,
+ * with the magnitudes as weights the five sums of the weighted normal equations are found for the
+ * block at once and solved in closed form.
+ */
+class FieldmapAlgo : public QI::ApplyF::Algorithm {
+protected:
+    const Eigen::ArrayXd m_TE;
+    const bool m_weighted, m_unwrapped;
+    QI::LinearDesign<2> m_design;
+
+    static Eigen::ArrayXXd Wrap(const Eigen::ArrayXXd &p) {
+        return p - (2*M_PI) * (p / (2*M_PI)).round();
+    }
+
+public:
+    FieldmapAlgo(const QI::MultiEchoSequence &seq, const bool weighted, const bool unwrapped) :
+        m_TE(seq.TE), m_weighted(weighted), m_unwrapped(unwrapped)
+    {
+        if (m_TE.rows() < 2) {
+            QI_FAIL("Need at least 2 echoes to fit a field map");
+        }
+        if (m_unwrapped && m_TE[0] <= 0) {
+            QI_FAIL("The first TE must be positive to predict the second echo from the first");
+        }
+        QI::LinearDesign<2>::TDesign X(m_TE.rows(), 2);
+        X.col(0) = m_TE;
+        X.col(1).setOnes();
+        m_design = QI::LinearDesign<2>(X);
+    }
+
+    size_t numInputs() const override  { return m_weighted ? 2 : 1; }
+    size_t numConsts() const override  { return 1; }
+    size_t numOutputs() const override { return 2; }
+    size_t dataSize() const override   { return m_TE.rows() * numInputs(); }
+    float zero() const override { return 0.f; }
+
+    std::vector<float> defaultConsts() const override {
+        std::vector<float> def(1, 0.0); // Spatially unwrapped first echo
+        return def;
+    }
+
+    const std::vector<std::string> &names() const {
+        static std::vector<std::string> _names = {"f0", "phi0"};
+        return _names;
+    }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &, // Unused
+               std::vector<TOutput> &outputs, TOutput &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        std::vector<TInputBlock> input_blocks;
+        for (const auto &in : inputs) {
+            input_blocks.emplace_back(in.GetDataPointer(), in.Size(), 1);
+        }
+        const std::vector<TConstBlock> const_blocks{TConstBlock(&consts[0], 1, 1)};
+        std::vector<TOutputBlock> output_blocks;
+        for (auto &o : outputs) {
+            output_blocks.emplace_back(&o, 1, 1);
+        }
+        TOutputBlock residual_block(&residual, 1, 1);
+        const bool keep = (resids.Size() == dataSize());
+        TResidsBlock resids_block(keep ? resids.GetDataPointer() : nullptr, keep ? dataSize() : 0, keep ? 1 : 0);
+        TIterationsBlock its_block(&its, 1, 1);
+        return applyBatch(input_blocks, const_blocks, output_blocks, residual_block, resids_block, its_block);
+    }
+
+    bool hasBatch() const override { return true; }
+    bool applyBatch(const std::vector<TInputBlock> &inputs, const std::vector<TConstBlock> &consts,
+                    std::vector<TOutputBlock> &outputs, TOutputBlock &residual,
+                    TResidsBlock &resids, TIterationsBlock &its) const override
+    {
+        const Eigen::ArrayXXd phase = inputs[0].cast<double>().array();
+        const long nE = phase.rows(), nV = phase.cols();
+        Eigen::ArrayXXd U(nE, nV);
+        // With the first echo unwrapped in space, and assuming phi0 is small, it gives the first slope
+        Eigen::Array<double, 1, Eigen::Dynamic> slope = Eigen::Array<double, 1, Eigen::Dynamic>::Zero(nV);
+        if (m_unwrapped) {
+            U.row(0) = consts[0].cast<double>();
+            slope = U.row(0) / m_TE[0];
+        } else {
+            U.row(0) = phase.row(0);
+        }
+        for (long e = 1; e < nE; e++) {
+            if (e > 1) {
+                slope = (U.row(e - 1) - U.row(e - 2)) / (m_TE[e - 1] - m_TE[e - 2]);
+            }
+            const Eigen::Array<double, 1, Eigen::Dynamic> predicted = U.row(e - 1) + slope * (m_TE[e] - m_TE[e - 1]);
+            U.row(e) = predicted + Wrap(phase.row(e) - predicted);
+        }
+
+        Eigen::Array<double, 1, Eigen::Dynamic> f, phi0;
+        if (m_weighted) {
+            const Eigen::ArrayXXd W = inputs[1].cast<double>().array().square();
+            const Eigen::ArrayXXd WU = W * U;
+            const Eigen::Array<double, 1, Eigen::Dynamic> sw = W.colwise().sum();
+            const Eigen::Array<double, 1, Eigen::Dynamic> swx = m_TE.matrix().transpose() * W.matrix();
+            const Eigen::Array<double, 1, Eigen::Dynamic> swxx = m_TE.square().matrix().transpose() * W.matrix();
+            const Eigen::Array<double, 1, Eigen::Dynamic> swy = WU.colwise().sum();
+            const Eigen::Array<double, 1, Eigen::Dynamic> swxy = m_TE.matrix().transpose() * WU.matrix();
+            const Eigen::Array<double, 1, Eigen::Dynamic> det = sw * swxx - swx.square();
+            const Eigen::Array<bool, 1, Eigen::Dynamic> valid = det > 0;
+            f = valid.select((sw * swxy - swx * swy) / det, 0.);
+            phi0 = valid.select((swy - f * swx) / sw, 0.);
+        } else {
+            const QI::LinearDesign<2>::TCoeffs b = m_design.solve(U.matrix());
+            f = b.row(0).array();
+            phi0 = b.row(1).array();
+        }
+        const Eigen::ArrayXXd fit = (m_TE.matrix() * f.matrix()).array().rowwise() + phi0;
+        const Eigen::ArrayXXf r = (U - fit).cast<float>();
+        outputs[0] = (f / (2*M_PI)).cast<float>().matrix();
+        outputs[1] = Wrap(phi0).cast<float>().matrix();
+        residual = (r.square().colwise().sum() / nE).sqrt().matrix();
+        if (resids.rows() > 0) {
+            resids.topRows(nE) = r.matrix();
+            resids.bottomRows(resids.rows() - nE).setZero();
+        }
+        its.setOnes();
+        return true;
+    }
+};
+
+/*
+ * Main
+ */
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("Calculates a field map (f0) from multi-echo phase data.\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> input_path(parser, "PHASE_FILE", "Input multi-echo phase file (radians)");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filename", {'o', "out"});
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<std::string> mag_arg(parser, "MAGNITUDE", "Weight the fit by the magnitudes in this file", {'w', "mag"});
+    args::Flag     unwrap(parser, "UNWRAP", "Unwrap the first echo in space before unwrapping in time", {'u', "unwrap"});
+    args::Flag     resids(parser, "RESIDS", "Write out the phase residual of every echo", {'r', "resids"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
+    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
+    if (verbose) std::cout << "Reading phase data from: " << QI::CheckPos(input_path) << std::endl;
+    // Path unwrapping needs the whole of the first echo
+    auto phase = QI::ReadVectorImage(QI::CheckPos(input_path), unwrap ? QI::VolumeF::RegionType() : subregion.region());
+    auto sequence = QI::ReadSequence<QI::MultiEchoSequence>(std::cin, verbose);
+    if (phase->GetNumberOfComponentsPerPixel() != sequence.size()) {
+        QI_FAIL("Phase file has " << phase->GetNumberOfComponentsPerPixel() << " echoes but the sequence has " << sequence.size());
+    }
+    std::shared_ptr<FieldmapAlgo> algo = std::make_shared<FieldmapAlgo>(sequence, mag_arg, unwrap);
+    auto apply = QI::ApplyF::New();
+    apply->SetVerbose(verbose);
+    apply->SetAlgorithm(algo);
+    apply->SetOutputAllResiduals(resids);
+    apply->SetOutputResidual(true);
+    apply->SetPoolsize(threads.Get());
+    apply->SetInput(0, phase);
+    if (mag_arg) {
+        if (verbose) std::cout << "Reading magnitude data from: " << mag_arg.Get() << std::endl;
+        apply->SetInput(1, QI::ReadVectorImage(mag_arg.Get(), subregion.region()));
+    }
+    if (unwrap) {
+        if (verbose) std::cout << "Unwrapping first echo" << std::endl;
+        auto first = itk::VectorIndexSelectionCastImageFilter<QI::VectorVolumeF, QI::VolumeF>::New();
+        first->SetInput(phase);
+        first->SetIndex(0);
+        first->Update();
+        auto reliability = itk::PhaseReliabilityFilter::New();
+        reliability->SetInput(first->GetOutput());
+        reliability->Update();
+        auto unwrapFilter = itk::UnwrapPathPhaseFilter::New();
+        unwrapFilter->SetInput(first->GetOutput());
+        unwrapFilter->SetReliability(reliability->GetOutput());
+        unwrapFilter->Update();
+        QI::VolumeF::Pointer unwrapped = unwrapFilter->GetOutput();
+        unwrapped->DisconnectPipeline();
+        apply->SetConst(0, unwrapped);
+    }
+    if (mask) apply->SetMask(QI::ReadImage(mask.Get(), subregion.region()));
+    subregion.Apply(apply);
+    if (verbose) {
+        std::cout << "Processing" << std::endl;
+        auto monitor = QI::GenericMonitor::New();
+        apply->AddObserver(itk::ProgressEvent(), monitor);
+    }
+    checkpoint.Apply(apply, outarg.Get());
+    apply->Update();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (verbose) {
+        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+    }
+
+    for (size_t i = 0; i < algo->numOutputs(); i++) {
+        const std::string fname = outPrefix + "_" + algo->names()[i] + QI::OutExt();
+        if (verbose) std::cout << "Writing file: " << fname << std::endl;
+        QI::WriteImage(apply->GetOutput(i), fname);
+    }
+    QI::WriteImage(apply->GetResidualOutput(), outPrefix + "_residual" + QI::OutExt(), QI::AuxiliaryStorage());
+    if (resids) {
+        QI::WriteVectorImage(apply->GetAllResidualsOutput(), outPrefix + "_all_residuals" + QI::OutExt(), QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), outPrefix + "_failures" + QI::OutExt());
+    }
+    return EXIT_SUCCESS;
+}
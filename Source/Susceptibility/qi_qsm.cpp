@@ -0,0 +1,247 @@
+/*
+ *  qi_qsm.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <numeric>
+#include <algorithm>
+#include <cmath>
+
+#include "ImageTypes.h"
+#include "Util.h"
+#include "ImageIO.h"
+#include "Args.h"
+#include "ThreadPool.h"
+#include "ElementwiseMap.h"
+#include "FFT.h"
+#include "Dipole.h"
+
+namespace {
+
+typedef std::array<size_t, 3> TSize;
+typedef QI::FFT3D::TComplex TComplex;
+
+const double Gamma = 42.577478; // MHz / T
+
+// As ElementwiseMap, but f returns a partial sum for its block. The blocks are fixed, so the total is repeatable.
+template<typename F>
+double ElementwiseSum(const size_t n, const F &f) {
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), n / QI::ElementwiseBlockSize));
+    std::vector<double> partial(nTasks, 0.);
+    pool.run(nTasks, [&](const size_t t) {
+        const size_t end = (n * (t + 1)) / nTasks;
+        for (size_t i = (n * t) / nTasks; i < end; i += QI::ElementwiseBlockSize) {
+            partial[t] += f(i, std::min(QI::ElementwiseBlockSize, end - i));
+        }
+    });
+    return std::accumulate(partial.begin(), partial.end(), 0.);
+}
+
+std::array<double, 3> ReadDirection(const std::string &s) {
+    std::array<double, 3> b;
+    std::istringstream iss(s);
+    std::string el;
+    for (int i = 0; i < 3; i++) {
+        std::getline(iss, el, ',');
+        if (!iss) QI_FAIL("Failed to read field direction: " << s);
+        b[i] = std::stod(el);
+    }
+    return b;
+}
+
+} // End anonymous namespace
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("Dipole inversion for Quantitative Susceptibility Mapping\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> input_path(parser, "FIELD", "Local field map (Hz), e.g. from qi_bgremove");
+    args::Positional<std::string> mask_path(parser, "MASK", "Mask where the local field is valid");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
+    args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (t)kd/(c)g, default t", {'a', "algo"}, 't');
+    args::ValueFlag<double> B0(parser, "B0", "Field strength in Tesla (default 3)", {'B', "B0"}, 3.0);
+    args::ValueFlag<std::string> direction(parser, "DIR", "Field direction along the image axes (default 0,0,1)", {"dir"}, "0,0,1");
+    args::ValueFlag<int> pad(parser, "PAD", "Zero-pad each side by N voxels (default 8)", {'p', "pad"}, 8);
+    args::ValueFlag<double> thresh(parser, "THRESH", "TKD threshold (default 0.2)", {'t', "thresh"}, 0.2);
+    args::ValueFlag<double> lambda(parser, "LAMBDA", "CG gradient regularisation (default 1e-3)", {'l', "lambda"}, 1e-3);
+    args::ValueFlag<int> its(parser, "ITERS", "CG maximum iterations (default 50)", {'i', "its"}, 50);
+    args::ValueFlag<double> tol(parser, "TOL", "CG relative residual to stop at (default 1e-3)", {"tol"}, 1e-3);
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+    if (algorithm.Get() != 't' && algorithm.Get() != 'c') {
+        QI_FAIL("Unknown algorithm: " << algorithm.Get());
+    }
+    if (pad.Get() < 0) QI_FAIL("Padding cannot be negative");
+
+    if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
+    QI::VolumeF::Pointer field = QI::ReadImage(QI::CheckPos(input_path));
+    if (verbose) std::cout << "Opening mask file: " << QI::CheckPos(mask_path) << std::endl;
+    QI::VolumeUC::Pointer mask = QI::ReadImage<QI::VolumeUC>(QI::CheckPos(mask_path));
+    if (field->GetLargestPossibleRegion().GetSize() != mask->GetLargestPossibleRegion().GetSize()) {
+        QI_FAIL("Mask is not the same size as the field");
+    }
+    const std::string prefix = (outarg ? outarg.Get() : QI::StripExt(input_path.Get()));
+
+    TSize size, padded, offset;
+    std::array<double, 3> spacing;
+    for (int d = 0; d < 3; d++) {
+        size[d] = field->GetLargestPossibleRegion().GetSize()[d];
+        spacing[d] = field->GetSpacing()[d];
+        padded[d] = QI::FFT3D::GoodSize(size[d] + 2 * pad.Get());
+        offset[d] = (padded[d] - size[d]) / 2;
+    }
+    if (verbose) std::cout << "Padded size: " << padded[0] << "," << padded[1] << "," << padded[2] << std::endl;
+    const QI::FFT3D fft(padded);
+    const size_t nThreads = QI::ThreadPool::Global().size();
+    const size_t count = fft.count();
+    const std::vector<double> &dipole = *QI::DipoleKernel(fft, spacing, ReadDirection(direction.Get()));
+
+    /*
+     * The field is converted to ppm and masked as it is padded. The mask is also kept padded, so
+     * the 0/1 weights of the data term can be applied in one pass. Every buffer below is made once,
+     * the solver vectors are float as only the transforms need double precision.
+     */
+    const double scale = 1. / (Gamma * B0.Get());
+    std::vector<TComplex> w1(count, TComplex(0.));
+    std::vector<float> weight(count, 0.f);
+    {
+        const float *f = field->GetBufferPointer();
+        const unsigned char *m = mask->GetBufferPointer();
+        for (size_t k = 0; k < size[2]; k++) {
+            for (size_t j = 0; j < size[1]; j++) {
+                const size_t row = ((k + offset[2]) * padded[1] + j + offset[1]) * padded[0] + offset[0];
+                for (size_t i = 0; i < size[0]; i++, f++, m++) {
+                    weight[row + i] = *m ? 1.f : 0.f;
+                    w1[row + i] = *m ? TComplex(*f * scale) : TComplex(0.);
+                }
+            }
+        }
+    }
+    mask = ITK_NULLPTR;
+    std::vector<float> chi(count, 0.f);
+
+    if (algorithm.Get() == 't') {
+        /*
+         * Truncated k-space division, where |D| is below the threshold it is replaced by the
+         * threshold with the same sign.
+         */
+        if (verbose) std::cout << "TKD with threshold " << thresh.Get() << std::endl;
+        const double t = thresh.Get();
+        fft.forward(w1.data(), nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) {
+                const double d = dipole[i];
+                w1[i] = (d == 0) ? TComplex(0.) : w1[i] / ((std::abs(d) > t) ? d : std::copysign(t, d));
+            }
+        });
+        fft.inverse(w1.data(), nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) chi[i] = weight[i] * static_cast<float>(w1[i].real());
+        });
+    } else {
+        /*
+         * Conjugate gradients on the normal equations of min |M(F'DF chi - field)|^2 + lambda
+         * |grad chi|^2 with chi kept inside the mask, i.e. M(F'DF M F'DF + lambda F'LF)M chi =
+         * M F'DF M field. Without that, chi outside the mask is free to explain the field inside.
+         * D and L are real so applying the operator is four transforms over two complex buffers,
+         * with each scaling fused into the copy between them, and each vector update fused with
+         * the next dot product.
+         */
+        const std::vector<double> laplace = QI::LaplaceKernel(fft, spacing);
+        const double lam = lambda.Get();
+        std::vector<TComplex> w2(count);
+        std::vector<float> r(count), p(count), Ap(count);
+        auto apply = [&](const std::vector<float> &in, std::vector<float> &out) -> double {
+            QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+                for (size_t i = start; i < start + len; i++) w1[i] = TComplex(weight[i] * in[i]);
+            });
+            fft.forward(w1.data(), nThreads);
+            QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+                for (size_t i = start; i < start + len; i++) w2[i] = w1[i] * dipole[i];
+            });
+            fft.inverse(w2.data(), nThreads);
+            QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+                for (size_t i = start; i < start + len; i++) w2[i] = TComplex(weight[i] * w2[i].real());
+            });
+            fft.forward(w2.data(), nThreads);
+            QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+                for (size_t i = start; i < start + len; i++) w1[i] = w2[i] * dipole[i] + w1[i] * (lam * laplace[i]);
+            });
+            fft.inverse(w1.data(), nThreads);
+            return ElementwiseSum(count, [&](const size_t start, const size_t len) -> double {
+                double s = 0;
+                for (size_t i = start; i < start + len; i++) {
+                    out[i] = weight[i] * static_cast<float>(w1[i].real());
+                    s += double(in[i]) * out[i];
+                }
+                return s;
+            });
+        };
+
+        // The right hand side, starting from chi = 0
+        fft.forward(w1.data(), nThreads);
+        QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+            for (size_t i = start; i < start + len; i++) w1[i] *= dipole[i];
+        });
+        fft.inverse(w1.data(), nThreads);
+        double rr = ElementwiseSum(count, [&](const size_t start, const size_t len) -> double {
+            double s = 0;
+            for (size_t i = start; i < start + len; i++) {
+                r[i] = p[i] = weight[i] * static_cast<float>(w1[i].real());
+                s += double(r[i]) * r[i];
+            }
+            return s;
+        });
+        const double bb = rr;
+        if (verbose) std::cout << "CG with lambda " << lam << std::endl;
+        for (int it = 0; it < its.Get() && rr > 0; it++) {
+            const double alpha = rr / apply(p, Ap);
+            const double rr_new = ElementwiseSum(count, [&](const size_t start, const size_t len) -> double {
+                double s = 0;
+                for (size_t i = start; i < start + len; i++) {
+                    chi[i] += static_cast<float>(alpha * p[i]);
+                    r[i] -= static_cast<float>(alpha * Ap[i]);
+                    s += double(r[i]) * r[i];
+                }
+                return s;
+            });
+            const double residual = std::sqrt(rr_new / bb);
+            if (verbose) std::cout << "Iteration " << it + 1 << " relative residual " << residual << std::endl;
+            if (residual < tol.Get()) break;
+            const double beta = rr_new / rr;
+            QI::ElementwiseMap(count, [&](const size_t start, const size_t len) {
+                for (size_t i = start; i < start + len; i++) p[i] = r[i] + static_cast<float>(beta * p[i]);
+            });
+            rr = rr_new;
+        }
+    }
+
+    // The susceptibility goes back into the field buffer
+    float *out = field->GetBufferPointer();
+    for (size_t k = 0; k < size[2]; k++) {
+        for (size_t j = 0; j < size[1]; j++) {
+            const size_t row = ((k + offset[2]) * padded[1] + j + offset[1]) * padded[0] + offset[0];
+            out = std::copy(chi.begin() + row, chi.begin() + row + size[0], out);
+        }
+    }
+    const std::string outname = prefix + "_chi" + QI::OutExt();
+    if (verbose) std::cout << "Output filename: " << outname << std::endl;
+    QI::WriteImage(field, outname);
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
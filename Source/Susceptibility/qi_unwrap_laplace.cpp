@@ -10,29 +10,20 @@
  */
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
-#include "itkImageSource.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkMultiplyImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkForwardFFTImageFilter.h"
-#include "itkInverseFFTImageFilter.h"
-#include "itkFFTShiftImageFilter.h"
-#include "itkComplexToModulusImageFilter.h"
-#include "itkFFTPadImageFilter.h"
-#include "itkMaskImageFilter.h"
-#include "itkThresholdImageFilter.h"
-#include "itkBinaryThresholdImageFilter.h"
-#include "itkBinaryCrossStructuringElement.h"
+#include "itkImageToImageFilter.h"
 #include "itkBinaryBallStructuringElement.h"
 #include "itkBinaryErodeImageFilter.h"
-#include "itkExtractImageFilter.h"
 
 #include "ImageTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
 #include "Args.h"
+#include "ThreadPool.h"
+#include "DCTPoisson.h"
+#include "ElementwiseMap.h"
 
 namespace itk {
 
@@ -80,37 +71,48 @@ protected:
         }
     }
 
-    void ThreadedGenerateData(const RegionType &region, ThreadIdType threadId) ITK_OVERRIDE {
-        //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
-        ConstNeighborhoodIterator<TImage>::RadiusType radius;
-        radius.Fill(1);
-        ConstNeighborhoodIterator<TImage> inputIter(radius, this->GetInput(), region);
-        ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
-
-        std::vector<ConstNeighborhoodIterator<TImage>::OffsetType> back, fwrd;
-        back.push_back({{-1, 0, 0}});
-        fwrd.push_back({{ 1, 0, 0}});
-        back.push_back({{ 0,-1, 0}});
-        fwrd.push_back({{ 0, 1, 0}});
-        back.push_back({{ 0, 0,-1}});
-        fwrd.push_back({{ 0, 0, 1}});
+    /*
+     * The wrapped phase difference along an axis is arg(exp(i(f + b - 2c))), which is just
+     * f + b - 2c brought back into (-pi, pi], so there is no need for any complex exponentials.
+     * Neighbours outside the image are clamped to the edge, which is the zero-flux boundary that
+     * DCTPoisson assumes.
+     */
+    static double Wrap(const double d) {
+        return d - (2*M_PI) * std::round(d / (2*M_PI));
+    }
 
-        TImage::SpacingType spacing = this->GetInput()->GetSpacing();
-        TImage::SpacingType s_sqr = spacing * spacing;
-        while(!inputIter.IsAtEnd()) {
-            double sum = 0;
-            double cphase = inputIter.GetCenterPixel();
-            std::complex<double> c = std::polar(1., cphase);
-            for (int i = 0; i < fwrd.size(); ++i) {
-                double bphase = inputIter.GetPixel(back[i]);
-                double fphase = inputIter.GetPixel(fwrd[i]);
-                std::complex<double> b = std::polar(1., bphase);
-                std::complex<double> f = std::polar(1., fphase);
-                sum += std::arg((f*b)/(c*c)) / s_sqr[i];
+    void ThreadedGenerateData(const RegionType &region, ThreadIdType threadId) ITK_OVERRIDE {
+        const TImage *input = this->GetInput();
+        TImage *output = this->GetOutput();
+        const RegionType buffer = input->GetBufferedRegion();
+        const long nx = buffer.GetSize()[0], ny = buffer.GetSize()[1], nz = buffer.GetSize()[2];
+        const float *in = input->GetBufferPointer();
+        const TImage::SpacingType spacing = input->GetSpacing();
+        const double wx = 1. / (spacing[0] * spacing[0]);
+        const double wy = 1. / (spacing[1] * spacing[1]);
+        const double wz = 1. / (spacing[2] * spacing[2]);
+        const long x0 = region.GetIndex()[0] - buffer.GetIndex()[0];
+        const long x1 = x0 + region.GetSize()[0];
+        for (size_t k = 0; k < region.GetSize()[2]; k++) {
+            for (size_t j = 0; j < region.GetSize()[1]; j++) {
+                TImage::IndexType index = region.GetIndex();
+                index[1] += j;
+                index[2] += k;
+                const long y = index[1] - buffer.GetIndex()[1];
+                const long z = index[2] - buffer.GetIndex()[2];
+                auto row = [&](const long yy, const long zz) {
+                    return in + nx * (std::min(std::max(yy, 0L), ny - 1) + ny * std::min(std::max(zz, 0L), nz - 1));
+                };
+                const float *centre = row(y, z);
+                const float *ym = row(y - 1, z), *yp = row(y + 1, z);
+                const float *zm = row(y, z - 1), *zp = row(y, z + 1);
+                float *out = output->GetBufferPointer() + output->ComputeOffset(index) - x0;
+                for (long x = x0; x < x1; x++) {
+                    const double c2 = 2. * centre[x];
+                    const double xx = centre[std::max(x - 1, 0L)] + centre[std::min(x + 1, nx - 1)];
+                    out[x] = Wrap(xx - c2) * wx + Wrap(ym[x] + yp[x] - c2) * wy + Wrap(zm[x] + zp[x] - c2) * wz;
+                }
             }
-            outputIter.Set(sum / 7.);
-            ++inputIter;
-            ++outputIter;
         }
     }
 
@@ -119,138 +121,25 @@ private:
     void operator=(const Self &);  //purposely not implemented
 };
 
-class DiscreteInverseLaplace : public ImageSource<QI::VolumeF> {
-public:
-    typedef QI::VolumeF            TImage;
-    typedef DiscreteInverseLaplace Self;
-    typedef ImageSource<TImage>    Superclass;
-    typedef SmartPointer<Self>     Pointer;
+} // End namespace itk
 
-    itkNewMacro(Self);
-    itkTypeMacro(DiscreteInverseLaplace, ImageSource);
+namespace {
 
-    void SetImageProperties(const TImage *img) {
-        m_region = img->GetLargestPossibleRegion();
-        m_spacing = img->GetSpacing();
-        m_direction = img->GetDirection();
-        m_origin = img->GetOrigin();
+// Zeroes the voxels outside the mask in place, instead of copying the image with itk::MaskImageFilter
+void ApplyMask(QI::VolumeF *img, const QI::VolumeUC *mask) {
+    if (img->GetLargestPossibleRegion().GetSize() != mask->GetLargestPossibleRegion().GetSize()) {
+        QI_FAIL("Mask is not the same size as the phase image");
     }
-
-protected:
-    typename TImage::RegionType    m_region;
-    typename TImage::SpacingType   m_spacing;
-    typename TImage::DirectionType m_direction;
-    typename TImage::PointType     m_origin;
-
-    DiscreteInverseLaplace(){}
-    ~DiscreteInverseLaplace(){}
-    void GenerateData() ITK_OVERRIDE {
-        typename TImage::Pointer output = this->GetOutput();
-        output->SetRegions(m_region);
-        output->Allocate();
-        output->SetSpacing(m_spacing);
-        output->SetDirection(m_direction);
-        output->SetOrigin(m_origin);
-        itk::ImageRegionIteratorWithIndex<TImage> imageIt(output,output->GetLargestPossibleRegion());
-        imageIt.GoToBegin();
-        imageIt.Set(0.); // There is a pole here
-        ++imageIt;
-        while(!imageIt.IsAtEnd()) {
-            auto index = imageIt.GetIndex() - m_region.GetIndex(); // Might be padded to a negative start
-            double val = 0;
-            for (int i = 0; i < 3; i++) {
-                val += 2. - 2. * cos(index[i] * 2. * M_PI / m_region.GetSize()[i]);
-            }
-            val /= 7.;
-            imageIt.Set(1./val);
-            ++imageIt;
+    float *data = img->GetBufferPointer();
+    const unsigned char *m = mask->GetBufferPointer();
+    QI::ElementwiseMap(img->GetLargestPossibleRegion().GetNumberOfPixels(), [&](const size_t start, const size_t len) {
+        for (size_t i = start; i < start + len; i++) {
+            if (!m[i]) data[i] = 0;
         }
-    }
-
-private:
-    DiscreteInverseLaplace(const Self &);
-    void operator=(const Self &);
-};
-
-/*
- * Do it the hard way!
- */
-class DiscreteInverseLaplace2 : public ImageSource<QI::VolumeF> {
-public:
-    typedef QI::VolumeF             TImage;
-    typedef DiscreteInverseLaplace2 Self;
-    typedef ImageSource<TImage>     Superclass;
-    typedef SmartPointer<Self>      Pointer;
-
-    itkNewMacro(Self);
-    itkTypeMacro(DiscreteInverseLaplace2, ImageSource);
-
-    void SetImageProperties(const TImage *img) {
-        m_region = img->GetLargestPossibleRegion();
-        m_spacing = img->GetSpacing();
-        m_direction = img->GetDirection();
-        m_origin = img->GetOrigin();
-    }
-
-protected:
-    typename TImage::RegionType    m_region;
-    typename TImage::SpacingType   m_spacing;
-    typename TImage::DirectionType m_direction;
-    typename TImage::PointType     m_origin;
-
-    DiscreteInverseLaplace2(){}
-    ~DiscreteInverseLaplace2(){}
-    void GenerateData() ITK_OVERRIDE {
-        typename TImage::Pointer output = this->GetOutput();
-        output->SetRegions(m_region);
-        output->Allocate();
-        output->SetSpacing(m_spacing);
-        output->SetDirection(m_direction);
-        output->SetOrigin(m_origin);
-
-        typename TImage::Pointer filt = TImage::New();
-        filt->SetRegions(m_region);
-        filt->SetSpacing(m_spacing);
-        filt->SetDirection(m_direction);
-        filt->SetOrigin(m_origin);
-        filt->Allocate();
-        typename TImage::IndexType index = m_region.GetIndex();
-        index[0] += m_region.GetSize()[0] / 2;
-        index[1] += m_region.GetSize()[1] / 2;
-        index[2] += m_region.GetSize()[2] / 2;
-        filt->SetPixel(index, -6);
-        index[0] -= 1; filt->SetPixel(index, 1);
-        index[0] += 2; filt->SetPixel(index, 1); index[0] -= 1;
-        index[1] -= 1; filt->SetPixel(index, 1);
-        index[1] += 2; filt->SetPixel(index, 1); index[1] -= 1;
-        index[2] -= 1; filt->SetPixel(index, 1);
-        index[2] += 2; filt->SetPixel(index, 1); index[2] -= 1;
-        auto shift = itk::FFTShiftImageFilter<TImage, TImage>::New();
-        shift->SetInput(filt);
-        typedef itk::ForwardFFTImageFilter<TImage> FFFTType;
-        auto forwardFFT = FFFTType::New();
-        forwardFFT->SetInput(shift->GetOutput());
-        auto magFilt = itk::ComplexToModulusImageFilter<QI::VolumeXF, QI::VolumeF>::New();
-        magFilt->SetInput(forwardFFT->GetOutput());
-        magFilt->Update();
-        auto divFilt = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
-        divFilt->SetConstant1(1.);
-        divFilt->SetInput2(magFilt->GetOutput());
-        divFilt->Update();
-        QI::VolumeF::Pointer filt2 = divFilt->GetOutput();
-        filt2->DisconnectPipeline();
-        index = m_region.GetIndex();
-        filt2->SetPixel(index,0);
-        this->GraftOutput(filt2);
-    }
-
-private:
-    DiscreteInverseLaplace2(const Self &);
-    void operator=(const Self &);
-};
-
+    });
+}
 
-} // End namespace itk
+} // End anonymous namespace
 
 //******************************************************************************
 // Main
@@ -268,7 +157,7 @@ int main(int argc, char **argv) {
     args::Flag debug(parser, "DEBUG", "Output debugging images", {'d', "debug"});
     QI::ParseArgs(parser, argc, argv, verbose);
     
-    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
 
     if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
     auto inFile = QI::ReadImage(QI::CheckPos(input_path));
@@ -277,14 +166,13 @@ int main(int argc, char **argv) {
     auto calcLaplace = itk::DiscreteLaplacePhaseFilter::New();
     calcLaplace->SetInput(inFile);
     calcLaplace->Update();
-    if (debug) QI::WriteImage(calcLaplace->GetOutput(), prefix + "_step1_laplace" + QI::OutExt());
+    if (debug) QI::WriteImage(calcLaplace->GetOutput(), prefix + "_step1_laplace" + QI::OutExt(), QI::AuxiliaryStorage());
 
     QI::VolumeF::Pointer lap = calcLaplace->GetOutput();
+    lap->DisconnectPipeline();
     auto mask_img = mask ? QI::ReadImage<QI::VolumeUC>(mask.Get()) : ITK_NULLPTR;
     if (mask) {
-        auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeUC>::New();
-        masker->SetInput(calcLaplace->GetOutput());
-        
+        QI::VolumeUC::Pointer laplace_mask = mask_img;
         if (erode) {
             typedef itk::BinaryBallStructuringElement<QI::VolumeUC::PixelType, 3> ElementType;
             ElementType structuringElement;
@@ -302,67 +190,26 @@ int main(int argc, char **argv) {
             erodeFilter->SetErodeValue(1);
             erodeFilter->SetKernel(structuringElement);
             erodeFilter->Update();
-            masker->SetMaskImage(erodeFilter->GetOutput());
-            if (debug) QI::WriteImage(erodeFilter->GetOutput(), prefix + "_eroded_mask" + QI::OutExt());
-        } else {
-            masker->SetMaskImage(mask_img);
+            laplace_mask = erodeFilter->GetOutput();
+            if (debug) QI::WriteImage(laplace_mask, prefix + "_eroded_mask" + QI::OutExt(), QI::AuxiliaryStorage());
         }
         if (verbose) std::cout << "Applying mask" << std::endl;
-        masker->Update();
-        lap = masker->GetOutput();
-        lap->DisconnectPipeline();
-        if (debug) QI::WriteImage(lap, prefix + "_step1_laplace_masked" + QI::OutExt());
+        ApplyMask(lap, laplace_mask);
+        if (debug) QI::WriteImage(lap, prefix + "_step1_laplace_masked" + QI::OutExt(), QI::AuxiliaryStorage());
     }
 
-    if (verbose) std::cout << "Padding image to valid FFT size." << std::endl;
-    typedef itk::FFTPadImageFilter<QI::VolumeF> PadFFTType;
-    auto padFFT = PadFFTType::New();
-    padFFT->SetInput(lap);
-    padFFT->Update();
-    if (debug) QI::WriteImage(padFFT->GetOutput(), prefix + "_step2_padFFT" + QI::OutExt());
-    if (verbose) {
-        std::cout << "Padded image size: " << padFFT->GetOutput()->GetLargestPossibleRegion().GetSize() << std::endl;
-        std::cout << "Calculating Forward FFT." << std::endl;
-    }
-    typedef itk::ForwardFFTImageFilter<QI::VolumeF> FFFTType;
-    auto forwardFFT = FFFTType::New();
-    forwardFFT->SetInput(padFFT->GetOutput());
-    forwardFFT->Update();
-    if (debug) QI::WriteImage(forwardFFT->GetOutput(), prefix + "_step3_forwardFFT" + QI::OutExt());
-    if (verbose) std::cout << "Generating Inverse Laplace Kernel." << std::endl;
-    auto inverseLaplace = itk::DiscreteInverseLaplace::New();
-    inverseLaplace->SetImageProperties(padFFT->GetOutput());
-    inverseLaplace->Update();
-    if (debug) QI::WriteImage(inverseLaplace->GetOutput(), prefix + "_inverse_laplace_filter" + QI::OutExt());
-    if (verbose) std::cout << "Multiplying." << std::endl;
-    auto mult = itk::MultiplyImageFilter<QI::VolumeXF, QI::VolumeF, QI::VolumeXF>::New();
-    mult->SetInput1(forwardFFT->GetOutput());
-    mult->SetInput2(inverseLaplace->GetOutput());
-    if (debug) QI::WriteImage(mult->GetOutput(), prefix + "_step3_multFFT" + QI::OutExt());
-    if (verbose) std::cout << "Inverse FFT." << std::endl;
-    auto inverseFFT = itk::InverseFFTImageFilter<QI::VolumeXF, QI::VolumeF>::New();
-    inverseFFT->SetInput(mult->GetOutput());
-    inverseFFT->Update();
-    if (debug) QI::WriteImage(inverseFFT->GetOutput(), prefix + "_step4_inverseFFT" + QI::OutExt());
-    if (verbose) std::cout << "Extracting original size image" << std::endl;
-    auto extract = itk::ExtractImageFilter<QI::VolumeF, QI::VolumeF>::New();
-    extract->SetInput(inverseFFT->GetOutput());
-    extract->SetDirectionCollapseToSubmatrix();
-    extract->SetExtractionRegion(calcLaplace->GetOutput()->GetLargestPossibleRegion());
-    extract->Update();
-    if (debug) QI::WriteImage(extract->GetOutput(), prefix + "_step5_extract" + QI::OutExt());
+    if (verbose) std::cout << "Solving Poisson equation." << std::endl;
+    const auto size = lap->GetLargestPossibleRegion().GetSize();
+    const auto spacing = lap->GetSpacing();
+    const QI::DCTPoisson poisson({{size[0], size[1], size[2]}}, {{spacing[0], spacing[1], spacing[2]}});
+    poisson.solve(lap->GetBufferPointer());
     std::string outname = prefix + "_unwrap" + QI::OutExt();
     if (verbose) std::cout << "Output filename: " << outname << std::endl;
     if (mask) {
         if (verbose) std::cout << "Re-applying mask" << std::endl;
-        auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeUC>::New();
-        masker->SetMaskImage(mask_img);
-        masker->SetInput(extract->GetOutput());
-        masker->Update();
-        QI::WriteImage(masker->GetOutput(), outname);
-    } else {
-        QI::WriteImage(extract->GetOutput(), outname);
+        ApplyMask(lap, mask_img);
     }
+    QI::WriteImage(lap, outname);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
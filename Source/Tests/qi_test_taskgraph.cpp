@@ -0,0 +1,124 @@
+/*
+ *  qi_test_taskgraph.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <stdexcept>
+
+#include "ThreadPool.h"
+#include "TaskGraph.h"
+
+namespace {
+
+int failures = 0;
+
+void Check(const bool ok, const char *what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+/*
+ * Each caller counts itself in and waits for the others. If the callers ran one after another the
+ * first would never see the rest, so it gives up after a while and reports false.
+ */
+class Latch {
+public:
+    Latch(const size_t n) : m_n(n) {}
+    bool arriveAndWait() {
+        m_arrived++;
+        const auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (m_arrived < m_n) {
+            if (std::chrono::steady_clock::now() > giveUp) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+protected:
+    const size_t m_n;
+    std::atomic<size_t> m_arrived{0};
+};
+
+void IndependentSuccessorsOverlap() {
+    QI::ThreadPool pool(2);
+    QI::TaskGraph graph(pool);
+    Latch latch(2);
+    std::atomic<bool> together{true};
+    std::atomic<int> ran{0};
+    const auto first = graph.add([] { std::this_thread::sleep_for(std::chrono::milliseconds(10)); });
+    for (int i = 0; i < 2; i++) {
+        graph.add([&] {
+            if (!latch.arriveAndWait()) together = false;
+            ran++;
+        }, {first});
+    }
+    graph.wait();
+    Check(ran == 2, "Both successors ran");
+    Check(together, "Independent successors of one task ran at the same time");
+}
+
+void FailureSkipsSuccessors() {
+    QI::ThreadPool pool(2);
+    QI::TaskGraph graph(pool);
+    std::atomic<bool> after{false}, unrelated{false};
+    const auto fails = graph.add([] { throw std::runtime_error("Task failed"); });
+    const auto next = graph.add([&] { after = true; }, {fails});
+    graph.add([&] { after = true; }, {next});
+    graph.add([&] { unrelated = true; });
+    bool threw = false;
+    try {
+        graph.wait();
+    } catch (const std::runtime_error &) {
+        threw = true;
+    }
+    Check(threw, "wait() rethrows the failure");
+    Check(!after, "Tasks after a failed task are skipped");
+    Check(unrelated, "Tasks not after a failed task still run");
+}
+
+/*
+ * Chains of pastes on a one-thread pool as SlabWriter made them, where a finishing task used to
+ * wait on the queue of the worker it was running on.
+ */
+void ChainsOnOneThread() {
+    QI::ThreadPool pool(1);
+    QI::TaskGraph graph(pool);
+    std::atomic<int> ran{0};
+    const int chains = 4, links = 20;
+    std::vector<QI::TaskGraph::TTask> last(chains);
+    for (int l = 0; l < links; l++) {
+        for (int c = 0; c < chains; c++) {
+            auto f = [&] { std::this_thread::sleep_for(std::chrono::microseconds(200)); ran++; };
+            last[c] = (l == 0) ? graph.add(f) : graph.add(f, {last[c]});
+        }
+    }
+    graph.wait();
+    Check(ran == chains * links, "Every task of the chains ran");
+}
+
+} // End anonymous namespace
+
+int main() {
+    IndependentSuccessorsOverlap();
+    FailureSkipsSuccessors();
+    ChainsOnOneThread();
+    if (failures) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "All TaskGraph checks passed" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+/*
+ *  qi_calc.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <Eigen/Core>
+
+#include "Args.h"
+#include "ImageTypes.h"
+#include "Util.h"
+#include "ImageIO.h"
+#include "ThreadPool.h"
+#include "ElementwiseMap.h"
+
+namespace {
+
+/*
+ * The expression is compiled once to a program for a stack machine, which then runs over each
+ * block of voxels in turn. Every instruction works on a whole block, so the stack holds a few
+ * blocks instead of whole intermediate images, and stays in cache.
+ */
+struct Op {
+    enum Code { Load, Constant, Add, Sub, Mul, Div, Pow, Neg, Lt, Gt, Le, Ge, Eq, Ne,
+                Abs, Sqrt, Exp, Log, Min, Max };
+    Code code;
+    size_t input;
+    float value;
+};
+
+class Expression {
+public:
+    Expression(const std::string &text, const std::vector<std::string> &names) :
+        m_text(text), m_names(names)
+    {
+        parseComparison();
+        skipSpace();
+        if (m_pos != m_text.size()) {
+            fail("Unexpected character");
+        }
+    }
+
+    size_t depth() const { return m_maxDepth; }
+
+    // Evaluates the program for one block, stack must have depth() columns of at least len rows
+    void evaluate(const std::vector<const float *> &inputs, const size_t start, const size_t len,
+                  Eigen::ArrayXXf &stack, Eigen::Map<Eigen::ArrayXf> out) const
+    {
+        size_t sp = 0;
+        for (const Op &op : m_program) {
+            switch (op.code) {
+            case Op::Load:     stack.col(sp++).head(len) = Eigen::Map<const Eigen::ArrayXf>(inputs[op.input] + start, len); break;
+            case Op::Constant: stack.col(sp++).head(len).setConstant(op.value); break;
+            case Op::Neg:  stack.col(sp - 1).head(len) = -stack.col(sp - 1).head(len); break;
+            case Op::Abs:  stack.col(sp - 1).head(len) = stack.col(sp - 1).head(len).abs(); break;
+            case Op::Sqrt: stack.col(sp - 1).head(len) = stack.col(sp - 1).head(len).sqrt(); break;
+            case Op::Exp:  stack.col(sp - 1).head(len) = stack.col(sp - 1).head(len).exp(); break;
+            case Op::Log:  stack.col(sp - 1).head(len) = stack.col(sp - 1).head(len).log(); break;
+            default: {
+                // Binary operations, the result replaces the left operand
+                auto a = stack.col(sp - 2).head(len);
+                const auto b = stack.col(sp - 1).head(len);
+                switch (op.code) {
+                case Op::Add: a += b; break;
+                case Op::Sub: a -= b; break;
+                case Op::Mul: a *= b; break;
+                case Op::Div: a /= b; break;
+                case Op::Pow: a = a.pow(b); break;
+                case Op::Lt:  a = (a < b).cast<float>(); break;
+                case Op::Gt:  a = (a > b).cast<float>(); break;
+                case Op::Le:  a = (a <= b).cast<float>(); break;
+                case Op::Ge:  a = (a >= b).cast<float>(); break;
+                case Op::Eq:  a = (a == b).cast<float>(); break;
+                case Op::Ne:  a = (a != b).cast<float>(); break;
+                case Op::Min: a = a.min(b); break;
+                case Op::Max: a = a.max(b); break;
+                default: break;
+                }
+                sp--;
+            }
+            }
+        }
+        out = stack.col(0).head(len);
+    }
+
+protected:
+    const std::string m_text;
+    const std::vector<std::string> &m_names;
+    std::vector<Op> m_program;
+    size_t m_pos = 0, m_depth = 0, m_maxDepth = 0;
+
+    void fail(const std::string &message) const {
+        QI_FAIL(message << " at position " << m_pos << " of expression:\n" << m_text << "\n" << std::string(m_pos, ' ') << "^");
+    }
+
+    // Tracks the stack depth as well, loads push a block, functions of one block replace it, and the rest pop one
+    void emit(const Op::Code code, const size_t input = 0, const float value = 0.f) {
+        switch (code) {
+        case Op::Load: case Op::Constant: m_depth++; break;
+        case Op::Neg: case Op::Abs: case Op::Sqrt: case Op::Exp: case Op::Log: break;
+        default: m_depth--;
+        }
+        m_maxDepth = std::max(m_maxDepth, m_depth);
+        m_program.push_back(Op{code, input, value});
+    }
+
+    void skipSpace() {
+        while (m_pos < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_pos]))) m_pos++;
+    }
+
+    bool accept(const std::string &token) {
+        skipSpace();
+        if (m_text.compare(m_pos, token.size(), token) == 0) {
+            m_pos += token.size();
+            return true;
+        }
+        return false;
+    }
+
+    void expect(const std::string &token) {
+        if (!accept(token)) fail("Expected " + token);
+    }
+
+    void parseComparison() {
+        parseSum();
+        // Two character operators first
+        static const std::vector<std::pair<std::string, Op::Code>> ops = {
+            {"<=", Op::Le}, {">=", Op::Ge}, {"==", Op::Eq}, {"!=", Op::Ne}, {"<", Op::Lt}, {">", Op::Gt}};
+        for (const auto &op : ops) {
+            if (accept(op.first)) {
+                parseSum();
+                emit(op.second);
+                return;
+            }
+        }
+    }
+
+    void parseSum() {
+        parseProduct();
+        while (true) {
+            if (accept("+")) { parseProduct(); emit(Op::Add); }
+            else if (accept("-")) { parseProduct(); emit(Op::Sub); }
+            else return;
+        }
+    }
+
+    void parseProduct() {
+        parseUnary();
+        while (true) {
+            if (accept("*")) { parseUnary(); emit(Op::Mul); }
+            else if (accept("/")) { parseUnary(); emit(Op::Div); }
+            else return;
+        }
+    }
+
+    void parseUnary() {
+        if (accept("-")) {
+            parseUnary();
+            emit(Op::Neg);
+        } else {
+            parsePower();
+        }
+    }
+
+    void parsePower() {
+        parseAtom();
+        if (accept("^")) {
+            parseUnary(); // Right associative
+            emit(Op::Pow);
+        }
+    }
+
+    void parseAtom() {
+        skipSpace();
+        if (accept("(")) {
+            parseComparison();
+            expect(")");
+            return;
+        }
+        if (m_pos < m_text.size() && (std::isdigit(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '.')) {
+            const char *begin = m_text.c_str() + m_pos;
+            char *end;
+            const float value = std::strtof(begin, &end);
+            m_pos += end - begin;
+            emit(Op::Constant, 0, value);
+            return;
+        }
+        const size_t start = m_pos;
+        while (m_pos < m_text.size() && (std::isalnum(static_cast<unsigned char>(m_text[m_pos])) || m_text[m_pos] == '_')) m_pos++;
+        const std::string name = m_text.substr(start, m_pos - start);
+        if (name.empty()) {
+            fail("Expected a number, name or (");
+        }
+        static const std::map<std::string, Op::Code> unary = {{"abs", Op::Abs}, {"sqrt", Op::Sqrt}, {"exp", Op::Exp}, {"log", Op::Log}};
+        static const std::map<std::string, Op::Code> binary = {{"min", Op::Min}, {"max", Op::Max}};
+        if (accept("(")) {
+            if (unary.count(name)) {
+                parseComparison();
+                emit(unary.at(name));
+            } else if (binary.count(name)) {
+                parseComparison();
+                expect(",");
+                parseComparison();
+                emit(binary.at(name));
+            } else {
+                m_pos = start;
+                fail("Unknown function " + name);
+            }
+            expect(")");
+            return;
+        }
+        const auto it = std::find(m_names.begin(), m_names.end(), name);
+        if (it == m_names.end()) {
+            m_pos = start;
+            fail("No input image named " + name);
+        }
+        emit(Op::Load, it - m_names.begin());
+    }
+};
+
+} // End anonymous namespace
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Calculates an image from an expression of named input images, e.g.\n"
+                                "qi_calc out.nii \"100*(1-(a+b)/(2*c))*(m>0)\" a=sat1.nii b=sat2.nii c=ref.nii m=mask.nii\n"
+                                "Operators are + - * / ^, comparisons (giving 0 or 1) and abs, sqrt, exp, log, min & max.\n"
+                                "http://github.com/spinicist/QUIT");
+    args::Positional<std::string> output_path(parser, "OUTPUT", "Output file");
+    args::Positional<std::string> expression(parser, "EXPRESSION", "Expression to evaluate");
+    args::PositionalList<std::string> input_args(parser, "NAME=FILE", "Named input images");
+    args::HelpFlag help(parser, "HELP", "Show this help menu", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
+
+    std::vector<std::string> names;
+    std::vector<QI::VolumeF::Pointer> images;
+    for (const auto &arg : QI::CheckList(input_args)) {
+        const size_t equals = arg.find('=');
+        if (equals == std::string::npos || equals == 0) {
+            QI_FAIL("Inputs must be NAME=FILE, got " << arg);
+        }
+        names.push_back(arg.substr(0, equals));
+        const std::string path = arg.substr(equals + 1);
+        if (verbose) std::cout << "Reading " << names.back() << " from " << path << std::endl;
+        images.push_back(QI::ReadImage(path));
+        if (images.back()->GetLargestPossibleRegion().GetSize() != images.front()->GetLargestPossibleRegion().GetSize()) {
+            QI_FAIL("Image " << path << " is not the same size as " << names.front());
+        }
+    }
+    const Expression program(QI::CheckPos(expression), names);
+
+    QI::VolumeF::Pointer output = QI::VolumeF::New();
+    output->CopyInformation(images.front());
+    output->SetRegions(images.front()->GetLargestPossibleRegion());
+    output->Allocate();
+    std::vector<const float *> inputs;
+    for (const auto &img : images) {
+        inputs.push_back(img->GetBufferPointer());
+    }
+    if (verbose) std::cout << "Evaluating " << expression.Get() << std::endl;
+    QI::ElementwiseMap(output->GetLargestPossibleRegion().GetNumberOfPixels(), [&](const size_t i, const size_t len) {
+        Eigen::ArrayXXf stack(len, program.depth());
+        program.evaluate(inputs, i, len, stack, QI::VolumeBlock(output, i, len));
+    });
+    if (verbose) std::cout << "Writing " << QI::CheckPos(output_path) << std::endl;
+    QI::WriteImage(output, QI::CheckPos(output_path));
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
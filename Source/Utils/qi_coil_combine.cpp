@@ -9,11 +9,19 @@
  *
  */
 
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <Eigen/Eigenvalues>
+
 #include "Util.h"
 #include "ImageIO.h"
+#include "ParallelGzip.h"
 #include "ApplyTypes.h"
+#include "ThreadPool.h"
 #include "Args.h"
 
+#include "itkImageFileReader.h"
 #include "itkRegionOfInterestImageFilter.h"
 #include "itkStatisticsImageFilter.h"
 
@@ -149,11 +157,332 @@ private:
     void operator=(const Self &);  //purposely not implemented
 };
 
+//******************************************************************************
+// Streaming combination
+//******************************************************************************
+/*
+ * Reads a complex series a few volumes at a time, in the same way as ReadVectorImage but without
+ * interleaving them into one VectorImage. Formats that cannot stream (e.g. gzipped) are read in
+ * one go, unless they could be inflated to a temporary file by GzipInput.
+ */
+class CoilStream {
+public:
+    typedef std::complex<float> TPixel;
+    typedef itk::Image<TPixel, 4> TSeries;
+    typedef itk::ImageFileReader<TSeries> TReader;
+
+    CoilStream(const std::string &path) : m_input(path), m_path(path) {
+        m_file = TReader::New();
+        m_file->SetFileName(m_input.path());
+        m_file->UpdateOutputInformation();
+    }
+
+    const TSeries *header() const { return m_file->GetOutput(); }
+    size_t volumes() const { return header()->GetLargestPossibleRegion().GetSize()[3]; }
+    QI::VolumeF::RegionType region() const { return header()->GetLargestPossibleRegion().Slice(3); }
+
+    template<typename F>
+    void each(const F &f) { // Calls f(v, volume) for each volume v in order
+        const size_t ReadChunkBytes = 64 * 1024 * 1024;
+        const typename TSeries::RegionType largest = header()->GetLargestPossibleRegion();
+        const size_t nVols = volumes();
+        const size_t nVox = region().GetNumberOfPixels();
+        size_t chunk = nVols;
+        if (m_file->GetImageIO()->CanStreamRead()) {
+            chunk = std::max<size_t>(1, ReadChunkBytes / (nVox * sizeof(TPixel)));
+        }
+        TSeries *series = m_file->GetOutput();
+        for (size_t start = 0; start < nVols; start += chunk) {
+            const size_t n = std::min(chunk, nVols - start);
+            typename TSeries::RegionType request = largest;
+            request.SetIndex(3, largest.GetIndex()[3] + start);
+            request.SetSize(3, n);
+            series->SetRequestedRegion(request);
+            m_file->Update();
+            const typename TSeries::RegionType buffered = series->GetBufferedRegion();
+            if (!buffered.IsInside(request)) {
+                QI_EXCEPTION("Failed to read volumes " << start << " to " << (start + n) << " of file: " << m_path);
+            }
+            const TPixel *in = series->GetBufferPointer() + (request.GetIndex()[3] - buffered.GetIndex()[3]) * nVox;
+            for (size_t t = 0; t < n; t++) {
+                f(start + t, in + t * nVox);
+            }
+        }
+    }
+
+protected:
+    QI::GzipInput m_input;
+    std::string m_path;
+    typename TReader::Pointer m_file;
+};
+
+/*
+ * Same result as ComplexCombine, but the coil volumes are phase-corrected and added to the sum
+ * one at a time as they are read, so only the sum and the reference are held in memory instead of
+ * every coil. The volumes are ordered with the echoes fastest, and for the Hammond method each
+ * coil's reference phase is the mean over the region of its first echo. Every volume is split
+ * into slabs of slices for the threads of the global pool.
+ */
+QI::VectorVolumeXF::Pointer StreamCombine(CoilStream &stream, const size_t ncoils,
+                                          const QI::VectorVolumeF *composer,
+                                          const QI::VolumeF::RegionType &hammond,
+                                          const bool verbose)
+{
+    const size_t nVols = stream.volumes();
+    if (ncoils == 0 || nVols % ncoils != 0) {
+        QI_FAIL("Number of volumes " << nVols << " is not a multiple of the number of coils " << ncoils);
+    }
+    const size_t nEchoes = nVols / ncoils;
+    const QI::VolumeF::RegionType region = stream.region();
+    const auto size = region.GetSize();
+    const size_t nSlice = size[0] * size[1];
+    const size_t nSlices = size[2];
+    const size_t nVox = nSlice * nSlices;
+    if (composer) {
+        if (composer->GetLargestPossibleRegion().GetSize() != size) {
+            QI_FAIL("COMPOSER reference image is not the same size as the data");
+        }
+    } else if (!region.IsInside(hammond)) {
+        QI_FAIL("Reference region is not inside the image");
+    }
+
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nSlices));
+    auto slabs = [&](const size_t t, const size_t n) -> std::pair<size_t, size_t> {
+        return std::make_pair(((nSlices * t) / n) * nSlice, ((nSlices * (t + 1)) / n) * nSlice);
+    };
+    std::vector<std::complex<double>> sum(nEchoes * nVox, std::complex<double>(0, 0));
+    std::vector<std::complex<double>> correction(composer ? nVox : 1);
+    std::vector<double> phases(ncoils);
+    stream.each([&](const size_t vol, const std::complex<float> *data) {
+        const size_t coil = vol / nEchoes;
+        const size_t echo = vol % nEchoes;
+        if (echo == 0) {
+            if (composer) {
+                const float *ref = composer->GetBufferPointer();
+                pool.run(nTasks, [&](const size_t t) {
+                    const auto slab = slabs(t, nTasks);
+                    for (size_t v = slab.first; v < slab.second; v++) {
+                        correction[v] = std::polar(1., -double(ref[v * ncoils + coil]));
+                    }
+                });
+            } else {
+                std::complex<double> mean(0, 0);
+                for (auto k = hammond.GetIndex()[2]; k < hammond.GetUpperIndex()[2] + 1; k++) {
+                    for (auto j = hammond.GetIndex()[1]; j < hammond.GetUpperIndex()[1] + 1; j++) {
+                        const std::complex<float> *row = data + (k - region.GetIndex()[2]) * nSlice + (j - region.GetIndex()[1]) * size[0];
+                        for (auto i = hammond.GetIndex()[0]; i < hammond.GetUpperIndex()[0] + 1; i++) {
+                            mean += std::complex<double>(row[i - region.GetIndex()[0]]);
+                        }
+                    }
+                }
+                phases[coil] = std::arg(mean);
+                correction[0] = std::polar(1., -phases[coil]);
+            }
+        }
+        std::complex<double> *acc = sum.data() + echo * nVox;
+        pool.run(nTasks, [&](const size_t t) {
+            const auto slab = slabs(t, nTasks);
+            for (size_t v = slab.first; v < slab.second; v++) {
+                acc[v] += std::complex<double>(data[v]) * correction[composer ? v : 0];
+            }
+        });
+    });
+    if (verbose && !composer) {
+        std::cout << "Mean phase:";
+        for (const double p : phases) {
+            std::cout << " " << p;
+        }
+        std::cout << std::endl;
+    }
+
+    const CoilStream::TSeries *header = stream.header();
+    auto combined = QI::VectorVolumeXF::New();
+    combined->SetRegions(region);
+    QI::VectorVolumeXF::SpacingType spacing;
+    QI::VectorVolumeXF::PointType origin;
+    QI::VectorVolumeXF::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        spacing[i] = header->GetSpacing()[i];
+        origin[i] = header->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = header->GetDirection()[i][j];
+        }
+    }
+    combined->SetSpacing(spacing);
+    combined->SetOrigin(origin);
+    combined->SetDirection(direction);
+    combined->SetNumberOfComponentsPerPixel(nEchoes);
+    combined->Allocate();
+    std::complex<float> *out = combined->GetBufferPointer();
+    pool.run(nTasks, [&](const size_t t) {
+        const auto slab = slabs(t, nTasks);
+        for (size_t v = slab.first; v < slab.second; v++) {
+            for (size_t e = 0; e < nEchoes; e++) {
+                out[v * nEchoes + e] = std::complex<float>(sum[e * nVox + v] / double(ncoils));
+            }
+        }
+    });
+    return combined;
+}
+
+//******************************************************************************
+// Adaptive combination
+//******************************************************************************
+/*
+ * Adaptive combination after Walsh et al, 10.1002/(SICI)1522-2594(200005)43:5<682::AID-MRM10>3.0.CO;2-G
+ * The weights for each voxel are the dominant eigenvector of the coil covariance matrix summed
+ * over a patch around it, including every echo. Sensitivities vary slowly, so they are only
+ * solved for on a grid every step voxels (including the last voxel on each axis) and trilinearly
+ * interpolated in between. Each eigenvector is rotated so the strongest coil in the image has zero
+ * phase, which keeps the grid consistent for interpolation and gives the combined image that coil's
+ * phase. The grid is split into slabs for the global pool, and each task re-uses its own matrix
+ * and solver for all of its patches.
+ */
+class AdaptiveGrid {
+public:
+    AdaptiveGrid(const size_t n, const size_t step) {
+        const size_t count = (n + step - 2) / step + 1; // Enough points for the last one to be n - 1
+        for (size_t g = 0; g < count; g++) {
+            points.push_back(std::min(g * step, n - 1));
+        }
+        for (size_t x = 0; x < n; x++) {
+            const size_t g = std::min(x / step, count > 1 ? count - 2 : 0);
+            lower.push_back(g);
+            upper.push_back(std::min(g + 1, count - 1));
+            weight.push_back(upper[x] == g ? 0. : double(x - points[g]) / (points[upper[x]] - points[g]));
+        }
+    }
+    std::vector<size_t> points, lower, upper; // Grid lower & upper are per voxel
+    std::vector<double> weight;               // Of the upper grid point, per voxel
+};
+
+QI::VectorVolumeXF::Pointer AdaptiveCombine(const QI::VectorVolumeXF *input, const size_t ncoils,
+                                            const size_t patch, const size_t step,
+                                            const bool verbose)
+{
+    const size_t nVols = input->GetNumberOfComponentsPerPixel();
+    if (ncoils == 0 || nVols % ncoils != 0) {
+        QI_FAIL("Number of volumes " << nVols << " is not a multiple of the number of coils " << ncoils);
+    }
+    if (patch == 0 || step == 0) {
+        QI_FAIL("Adaptive combination patch size and grid step must be at least 1");
+    }
+    const size_t nEchoes = nVols / ncoils;
+    const auto size = input->GetLargestPossibleRegion().GetSize();
+    const size_t nx = size[0], ny = size[1], nz = size[2], nVox = nx * ny * nz;
+    const std::complex<float> *data = input->GetBufferPointer();
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+
+    std::vector<double> power(ncoils, 0);
+    for (size_t v = 0; v < nVox; v++) {
+        for (size_t c = 0; c < ncoils; c++) {
+            for (size_t e = 0; e < nEchoes; e++) {
+                power[c] += std::norm(data[v * nVols + c * nEchoes + e]);
+            }
+        }
+    }
+    const size_t refcoil = std::max_element(power.begin(), power.end()) - power.begin();
+    if (verbose) std::cout << "Adaptive combination, phase reference is coil " << refcoil << std::endl;
+
+    const AdaptiveGrid gx(nx, step), gy(ny, step), gz(nz, step);
+    const size_t gnx = gx.points.size(), gny = gy.points.size(), gnz = gz.points.size();
+    if (verbose) std::cout << "Solving for sensitivities on a " << gnx << "x" << gny << "x" << gnz << " grid" << std::endl;
+    const long lo = (long(patch) - 1) / 2, hi = long(patch) / 2;
+    std::vector<std::complex<double>> sens(gnx * gny * gnz * ncoils);
+    const size_t gTasks = std::max<size_t>(1, std::min(pool.size(), gnz));
+    pool.run(gTasks, [&](const size_t t) {
+        Eigen::MatrixXcd R(ncoils, ncoils);
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXcd> solver(ncoils);
+        Eigen::VectorXcd s(ncoils);
+        for (size_t k = (gnz * t) / gTasks; k < (gnz * (t + 1)) / gTasks; k++) {
+            const long z0 = std::max(0L, long(gz.points[k]) - lo), z1 = std::min(long(nz) - 1, long(gz.points[k]) + hi);
+            for (size_t j = 0; j < gny; j++) {
+                const long y0 = std::max(0L, long(gy.points[j]) - lo), y1 = std::min(long(ny) - 1, long(gy.points[j]) + hi);
+                for (size_t i = 0; i < gnx; i++) {
+                    const long x0 = std::max(0L, long(gx.points[i]) - lo), x1 = std::min(long(nx) - 1, long(gx.points[i]) + hi);
+                    R.setZero();
+                    for (long z = z0; z <= z1; z++) {
+                        for (long y = y0; y <= y1; y++) {
+                            for (long x = x0; x <= x1; x++) {
+                                const std::complex<float> *px = data + ((z * ny + y) * nx + x) * nVols;
+                                for (size_t e = 0; e < nEchoes; e++) {
+                                    for (size_t c = 0; c < ncoils; c++) {
+                                        s[c] = px[c * nEchoes + e];
+                                    }
+                                    R.selfadjointView<Eigen::Lower>().rankUpdate(s);
+                                }
+                            }
+                        }
+                    }
+                    std::complex<double> *w = sens.data() + ((k * gny + j) * gnx + i) * ncoils;
+                    if (R.diagonal().real().sum() > 0) {
+                        solver.compute(R);
+                        const Eigen::VectorXcd v = solver.eigenvectors().col(ncoils - 1);
+                        const double ref_mag = std::abs(v[refcoil]);
+                        const std::complex<double> rotate = ref_mag > 0 ? std::conj(v[refcoil]) / ref_mag : 1.;
+                        for (size_t c = 0; c < ncoils; c++) {
+                            w[c] = v[c] * rotate;
+                        }
+                    } else {
+                        std::fill(w, w + ncoils, std::complex<double>(0, 0));
+                    }
+                }
+            }
+        }
+    });
+
+    auto combined = QI::VectorVolumeXF::New();
+    combined->CopyInformation(input);
+    combined->SetRegions(input->GetLargestPossibleRegion());
+    combined->SetNumberOfComponentsPerPixel(nEchoes);
+    combined->Allocate();
+    std::complex<float> *out = combined->GetBufferPointer();
+    const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nz));
+    pool.run(nTasks, [&](const size_t t) {
+        std::vector<std::complex<double>> w(ncoils);
+        for (size_t z = (nz * t) / nTasks; z < (nz * (t + 1)) / nTasks; z++) {
+            for (size_t y = 0; y < ny; y++) {
+                for (size_t x = 0; x < nx; x++) {
+                    std::fill(w.begin(), w.end(), std::complex<double>(0, 0));
+                    for (int corner = 0; corner < 8; corner++) {
+                        const size_t gi = (corner & 1) ? gx.upper[x] : gx.lower[x];
+                        const size_t gj = (corner & 2) ? gy.upper[y] : gy.lower[y];
+                        const size_t gk = (corner & 4) ? gz.upper[z] : gz.lower[z];
+                        const double f = ((corner & 1) ? gx.weight[x] : 1. - gx.weight[x]) *
+                                         ((corner & 2) ? gy.weight[y] : 1. - gy.weight[y]) *
+                                         ((corner & 4) ? gz.weight[z] : 1. - gz.weight[z]);
+                        const std::complex<double> *g = sens.data() + ((gk * gny + gj) * gnx + gi) * ncoils;
+                        for (size_t c = 0; c < ncoils; c++) {
+                            w[c] += f * g[c];
+                        }
+                    }
+                    double norm = 0;
+                    for (size_t c = 0; c < ncoils; c++) {
+                        norm += std::norm(w[c]);
+                    }
+                    const size_t v = (z * ny + y) * nx + x;
+                    const std::complex<float> *px = data + v * nVols;
+                    for (size_t e = 0; e < nEchoes; e++) {
+                        std::complex<double> sum(0, 0);
+                        for (size_t c = 0; c < ncoils; c++) {
+                            sum += std::conj(w[c]) * std::complex<double>(px[c * nEchoes + e]);
+                        }
+                        out[v * nEchoes + e] = std::complex<float>(norm > 0 ? sum / sqrt(norm) : 0.);
+                    }
+                }
+            }
+        }
+    });
+    return combined;
+}
+
 int main(int argc, char **argv) {
     args::ArgumentParser parser(
         "Combine multiple coil images into a single image.\n"
         "Default method is that of Hammond, 10.1016/j.neuroimage.2007.10.037\n"
         "If the COMPOSER option is specified, see 10.1002/mrm.26093\n"
+        "For the adaptive method see 10.1002/(SICI)1522-2594(200005)43:5<682::AID-MRM10>3.0.CO;2-G\n"
         "http://github.com/spinicist/QUIT");
     args::Positional<std::string> input_path(parser, "INPUT_FILE", "Input file to coil-combine");
     args::HelpFlag help(parser, "HELP", "Show this help menu", {'h', "help"});
@@ -162,13 +491,85 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> region_arg(parser, "REGION", "Region to average phase for Hammond method, default is 8x8x8 cube at center", {'r', "region"});
     args::ValueFlag<std::string> ser_path(parser, "COMPOSER", "Short Echo Time reference file for COMPOSER method", {'c', "composer"});
+    args::ValueFlag<std::string> method(parser, "METHOD", "Choose combination method. H = Hammond, C = COMPOSER, W = Walsh adaptive. Default is C if a COMPOSER reference is given, otherwise H", {"method"});
+    args::ValueFlag<int> patch(parser, "PATCH", "Patch size for covariance matrices in the adaptive method (default 5)", {"patch"}, 5);
+    args::ValueFlag<int> step(parser, "STEP", "Grid step for sensitivities in the adaptive method (default 3)", {"step"}, 3);
     args::ValueFlag<int> coils_arg(parser, "COILS", "Number of coils (default is number of volumes)", {'C', "coils"});
     args::Flag     save_corrected(parser, "SAVE COILS", "Save the individual coil images after phase correction", {'s', "save"});
-    args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
+    QI::SubregionArgs subregion(parser);
+    QI::CheckpointArgs checkpoint(parser);
     QI::ParseArgs(parser, argc, argv, verbose);
 
+    auto hammond_region = [&](const QI::VolumeF::RegionType::SizeType &size) -> QI::VolumeF::RegionType {
+        if (verbose) std::cout << "Using Hammond method" << std::endl;
+        QI::VolumeF::RegionType region;
+        if (region_arg) {
+            region = QI::RegionArg<QI::VolumeF::RegionType>(region_arg.Get());
+        } else {
+            itk::Index<3> index;
+            for (auto i = 0; i < 3; i++) {
+                index[i] = size[i] / 2 - 4;
+            }
+            region.GetModifiableIndex() = index;
+            region.GetModifiableSize() = {{8, 8, 8}};
+        }
+        if (verbose) std::cout << "Reference region is:\n" << region << std::endl;
+        return region;
+    };
+    const std::string out_prefix = outarg ? outarg.Get() : QI::StripExt(QI::CheckPos(input_path));
+    const std::string combine_method = method ? method.Get() : (ser_path ? "C" : "H");
+    const bool composer = combine_method == "C";
+    if (composer && !ser_path) {
+        QI_FAIL("COMPOSER method needs a reference image (--composer)");
+    } else if (combine_method != "C" && combine_method != "H" && combine_method != "W") {
+        QI_FAIL("Unknown combination method " << combine_method);
+    }
+    const bool per_voxel = save_corrected || subregion.requested() || checkpoint.checkpoint || checkpoint.resume || checkpoint.shard;
+
+    if (combine_method == "W") {
+        if (per_voxel) {
+            QI_FAIL("The adaptive method does not support --save, --subregion or checkpoints");
+        }
+        QI::ThreadPool::SetGlobalThreads(threads.Get());
+        if (verbose) std::cout << "Reading input image: " << input_path.Get() << std::endl;
+        auto input_image = QI::ReadVectorImage<std::complex<float>>(input_path.Get());
+        const size_t ncoils = coils_arg ? coils_arg.Get() : input_image->GetNumberOfComponentsPerPixel();
+        auto combined = AdaptiveCombine(input_image, ncoils, patch.Get(), step.Get(), verbose);
+        const std::string out_name = out_prefix + "_combined" + QI::OutExt();
+        if (verbose) std::cout << "Writing output file " << out_name << std::endl;
+        QI::WriteVectorImage(combined, out_name);
+        return EXIT_SUCCESS;
+    }
+
+    // Only the per-voxel filter can save the coils, process a subregion, or checkpoint
+    if (!per_voxel) {
+        QI::ThreadPool::SetGlobalThreads(threads.Get());
+        if (verbose) std::cout << "Streaming input image: " << input_path.Get() << std::endl;
+        CoilStream stream(input_path.Get());
+        const size_t ncoils = coils_arg ? coils_arg.Get() : stream.volumes();
+        QI::VectorVolumeF::Pointer ser_image;
+        QI::VolumeF::RegionType region;
+        if (composer) {
+            if (verbose) std::cout << "Reading COMPOSER reference image: " << ser_path.Get() << std::endl;
+            ser_image = QI::ReadVectorImage(ser_path.Get());
+            if (ser_image->GetNumberOfComponentsPerPixel() != ncoils) {
+                QI_FAIL("Number of coil reference images does not match number of coils in data");
+            }
+        } else {
+            region = hammond_region(stream.region().GetSize());
+        }
+        if (verbose) std::cout << "Correcting phase & combining" << std::endl;
+        auto combined = StreamCombine(stream, ncoils, ser_image.GetPointer(), region, verbose);
+        const std::string out_name = out_prefix + "_combined" + QI::OutExt();
+        if (verbose) std::cout << "Writing output file " << out_name << std::endl;
+        QI::WriteVectorImage(combined, out_name);
+        return EXIT_SUCCESS;
+    }
+
     if (verbose) std::cout << "Reading input image: " << QI::CheckPos(input_path) << std::endl;
-    auto input_image = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(input_path));
+    // The Hammond method takes the phase from the middle of the image, so needs all of it
+    const QI::VolumeF::RegionType read_region = composer ? subregion.region() : QI::VolumeF::RegionType();
+    auto input_image = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(input_path), read_region);
     const auto sz = input_image->GetNumberOfComponentsPerPixel();
     const auto ncoils = coils_arg ? coils_arg.Get() : sz;
     auto combine = std::make_shared<ComplexCombine>(sz, ncoils);
@@ -178,31 +579,17 @@ int main(int argc, char **argv) {
     apply->SetOutputAllResiduals(save_corrected);
     apply->SetVerbose(verbose);
     apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
-    if (subregion) apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    if (ser_path) {
+    subregion.Apply(apply);
+    if (composer) {
         if (verbose) std::cout << "Reading COMPOSER reference image: " << ser_path.Get() << std::endl;
-        auto ser_image = QI::ReadVectorImage(ser_path.Get());
+        auto ser_image = QI::ReadVectorImage(ser_path.Get(), read_region);
         if (ser_image->GetNumberOfComponentsPerPixel() != ncoils) {
             QI_FAIL("Number of coil reference images does not match number of coils in data");
         }
         apply->SetConst(0, ser_image);
     } else {
         // Fall back to Hammond Method
-        if (verbose) std::cout << "Using Hammond method" << std::endl;
-        QI::VectorVolumeXF::RegionType region;
-        if (region_arg) {
-            region = QI::RegionArg<QI::VolumeF::RegionType>(region_arg.Get());
-        } else {
-            auto size = input_image->GetLargestPossibleRegion().GetSize();
-            itk::Index<3> index;
-            for (auto i = 0; i < 3; i++) {
-                index[i] = size[i] / 2 - 4;
-            }
-            region.GetModifiableIndex() = index;
-            region.GetModifiableSize() = {{8, 8, 8}};
-        }
-        if (verbose) std::cout << "Reference region is:\n" << region << std::endl;
+        const QI::VolumeF::RegionType region = hammond_region(input_image->GetLargestPossibleRegion().GetSize());
         auto roi = itk::RegionOfInterestImageFilter<QI::VectorVolumeXF, QI::VectorVolumeXF>::New();
         roi->SetRegionOfInterest(region);
         roi->SetInput(input_image);
@@ -219,14 +606,25 @@ int main(int argc, char **argv) {
         combine->setChannelPhases(phase);
     }
     if (verbose) std::cout << "Correcting phase & combining" << std::endl;
+    checkpoint.Apply(apply, outarg.Get());
     apply->Update();
-    const std::string out_name = (outarg ? outarg.Get() : QI::StripExt(input_path.Get())) + "_combined" + QI::OutExt();
+    if (subregion.inspecting()) {
+        return EXIT_SUCCESS;
+    }
+    if (checkpoint.sharded()) {
+        if (verbose) std::cout << "Shard complete" << std::endl;
+        return EXIT_SUCCESS;
+    }
+    const std::string out_name = out_prefix + "_combined" + QI::OutExt();
     if (verbose) std::cout << "Writing output file " << out_name << std::endl;
     QI::WriteVectorImage(apply->GetOutput(0), out_name);
     if (save_corrected) {
-        const std::string out_name = (outarg ? outarg.Get() : QI::StripExt(input_path.Get())) + "_corrected" + QI::OutExt();
+        const std::string out_name = out_prefix + "_corrected" + QI::OutExt();
         if (verbose) std::cout << "Writing corrected coil file " << out_name << std::endl;
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_name);
+        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_name, QI::AuxiliaryStorage());
+    }
+    if (checkpoint.failures) {
+        QI::WriteImage(apply->GetFailuresOutput(), out_prefix + "_failures" + QI::OutExt());
     }
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,72 @@
+/*
+ *  qi_merge_shards.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+
+#include "Util.h"
+#include "Args.h"
+#include "ApplyAlgorithmFilter.h"
+
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Merges the checkpoint files written by programs run with --shard I/N into a single checkpoint.\n"
+                                "Re-run the original program with --checkpoint=OUTPUT --resume to write the full maps.\n"
+                                "http://github.com/spinicist/QUIT");
+    args::PositionalList<std::string> shard_paths(parser, "SHARDS", "Shard checkpoint files");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<std::string> outarg(parser, "OUTPUT", "Merged checkpoint file (default merged.qik)", {'o', "out"}, "merged.qik");
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    const auto paths = QI::CheckList(shard_paths);
+    QI::CacheOutput(outarg.Get());
+    std::ofstream out(outarg.Get(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        QI_FAIL("Could not open output file " << outarg.Get());
+    }
+    char header[sizeof(itk::CheckpointMagic) + 2 * sizeof(uint64_t)];
+    char firstHeader[sizeof(header)];
+    uint64_t recordSize = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::ifstream in(paths[i], std::ios::binary);
+        if (!in) {
+            QI_FAIL("Could not open shard file " << paths[i]);
+        }
+        in.read(header, sizeof(header));
+        if (!in || !std::equal(header, header + sizeof(itk::CheckpointMagic), itk::CheckpointMagic)) {
+            QI_FAIL(paths[i] << " is not a checkpoint file");
+        }
+        if (i == 0) {
+            std::copy(header, header + sizeof(header), firstHeader);
+            std::copy(header + sizeof(header) - sizeof(uint64_t), header + sizeof(header), reinterpret_cast<char *>(&recordSize));
+            out.write(header, sizeof(header));
+        } else if (!std::equal(header, header + sizeof(header), firstHeader)) {
+            QI_FAIL(paths[i] << " was not written by the same program and image as " << paths[0]);
+        }
+        // Only copy complete records, a shard that was killed mid-write may have a partial one at the end
+        std::vector<char> record(recordSize);
+        size_t count = 0;
+        while (in.read(record.data(), record.size())) {
+            out.write(record.data(), record.size());
+            count++;
+        }
+        if (verbose) std::cout << "Read " << count << " voxels from " << paths[i] << std::endl;
+        total += count;
+    }
+    if (!out) {
+        QI_FAIL("Failed writing to " << outarg.Get());
+    }
+    if (verbose) std::cout << "Wrote " << total << " voxels to " << outarg.Get() << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -15,7 +15,7 @@
 #include <cereal/types/vector.hpp>
 
 #include "itkImageSource.h"
-#include "itkImageSliceIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
 #include "itkMaskImageFilter.h"
 #include "ImageTypes.h"
 #include "Util.h"
@@ -23,6 +23,7 @@
 #include "ImageIO.h"
 #include "IO.h"
 #include "Spline.h"
+#include "MaskSpans.h"
 #include "EigenCereal.h"
 
 namespace itk {
@@ -45,6 +46,7 @@ public:
         m_splines.clear();
         for (const auto &v : vals) {
             m_splines.push_back(QI::SplineInterpolator(pos, v));
+            m_splines.back().resample();
         }
     }
 
@@ -64,75 +66,64 @@ public:
 protected:
     SmartPointer<QI::VolumeF> m_reference;
     std::vector<QI::SplineInterpolator> m_splines;
+    Eigen::ArrayXXf m_slice_vals; // Profile values, one column per slice of the output
 
     ProfileImage(){
     }
     ~ProfileImage(){}
-    void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE {
-        auto output = this->GetOutput();
-        ImageSliceIteratorWithIndex<QI::VectorVolumeF> imageIt(output, region);
-        imageIt.SetFirstDirection(0);
-        imageIt.SetSecondDirection(1);
-        imageIt.GoToBegin();
-        ImageSliceIteratorWithIndex<QI::VolumeF> it_B1(m_reference, region);
-        it_B1.SetFirstDirection(0);
-        it_B1.SetSecondDirection(1);
-        it_B1.GoToBegin();
 
-        const auto mask = this->GetMask();
-        ImageSliceConstIteratorWithIndex<QI::VolumeF> maskIter;
-        if (mask) {
-            maskIter = ImageSliceConstIteratorWithIndex<QI::VolumeF>(mask, region);
-            maskIter.SetFirstDirection(0);
-            maskIter.SetSecondDirection(1);
-            maskIter.GoToBegin();
-        }
-
-        // Calculate geometric center
+    /*
+     * The profile only varies along the slab, so it is evaluated once per slice, at the first
+     * voxel of the slice, before the threads start. The threads then only scale these by B1+.
+     */
+    void BeforeThreadedGenerateData() ITK_OVERRIDE {
+        const auto region = this->GetOutput()->GetRequestedRegion();
         QI::VectorVolumeF::IndexType idx_center;
         for (int i = 0; i < 3; i++) {
             idx_center[i] = m_reference->GetLargestPossibleRegion().GetSize()[i] / 2;
         }
         QI::VectorVolumeF::PointType pt_center; m_reference->TransformIndexToPhysicalPoint(idx_center, pt_center);
-        itk::VariableLengthVector<float> zero(m_splines.size()); zero.Fill(0.);
-
-        ProgressReporter progress(this, threadId, region.GetNumberOfPixels(), 10);
-        while(!imageIt.IsAtEnd()) {
-            QI::VectorVolumeF::PointType pt, pt_rf;
-            m_reference->TransformIndexToPhysicalPoint(imageIt.GetIndex(), pt);
-            pt_rf = pt - pt_center;
-            itk::VariableLengthVector<float> vals(m_splines.size());
+        const size_t nSlices = region.GetSize()[2];
+        Eigen::ArrayXd slice_pos(nSlices);
+        for (size_t z = 0; z < nSlices; z++) {
+            QI::VectorVolumeF::IndexType first = region.GetIndex();
+            first[2] += z;
+            QI::VectorVolumeF::PointType pt;
+            m_reference->TransformIndexToPhysicalPoint(first, pt);
+            slice_pos[z] = (pt - pt_center)[2];
+        }
+        m_slice_vals.resize(m_splines.size(), nSlices);
+        for (size_t i = 0; i < m_splines.size(); i++) {
+            m_slice_vals.row(i) = m_splines[i](slice_pos).cast<float>().transpose();
+        }
+    }
 
-            for (int i = 0; i < m_splines.size(); i++) {
-                vals[i] = m_splines[i](pt_rf[2]);
+    void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE {
+        auto output = this->GetOutput();
+        const auto mask = this->GetMask();
+        const QI::MaskSpans<3> spans(mask.GetPointer(), region);
+        if (mask) {
+            itk::VariableLengthVector<float> zero(m_splines.size()); zero.Fill(0.);
+            ImageRegionIterator<QI::VectorVolumeF> zeroIt(output, region);
+            for (zeroIt.GoToBegin(); !zeroIt.IsAtEnd(); ++zeroIt) {
+                zeroIt.Set(zero);
             }
-            while (!imageIt.IsAtEndOfSlice()) {
-                while (!imageIt.IsAtEndOfLine()) {
-                    if (!mask || maskIter.Get()) {
-                        imageIt.Set(vals * it_B1.Get());
-                    } else {
-                        imageIt.Set(zero);
-                    }
-                    ++imageIt;
-                    ++it_B1;
-                    if (mask) {
-                        ++maskIter;
-                    }
-                    if (threadId == 0) {
-                        progress.CompletedPixel();
-                    }
-                }
-                imageIt.NextLine();
-                it_B1.NextLine();
-                if (mask)
-                    maskIter.NextLine();
+        }
+
+        ProgressReporter progress(this, threadId, spans.count(), 10);
+        const auto z0 = output->GetRequestedRegion().GetIndex()[2];
+        itk::VariableLengthVector<float> vals(m_splines.size());
+        spans.forEach([&](const QI::VectorVolumeF::IndexType &index) {
+            const float b1 = m_reference->GetPixel(index);
+            const auto slice = m_slice_vals.col(index[2] - z0);
+            for (size_t i = 0; i < m_splines.size(); i++) {
+                vals[i] = slice[i] * b1;
             }
-            imageIt.NextSlice();
-            it_B1.NextSlice();
-            if (mask) {
-                maskIter.NextSlice();
+            output->SetPixel(index, vals);
+            if (threadId == 0) {
+                progress.CompletedPixel();
             }
-        }
+        });
     }
 
 private:
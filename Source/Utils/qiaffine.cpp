@@ -10,14 +10,16 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <array>
+#include <algorithm>
+#include <functional>
 
 #include "itkImageIOFactory.h"
 #include "itkVersor.h"
 #include "itkVersorRigid3DTransform.h"
 #include "itkCenteredAffineTransform.h"
 #include "itkTransformFileWriter.h"
-#include "itkPermuteAxesImageFilter.h"
-#include "itkFlipImageFilter.h"
 #include "itkImageMomentsCalculator.h"
 
 #include "Util.h"
@@ -51,75 +53,149 @@ args::ValueFlag<double> rotZ(parser, "ROT_Z", "Rotate about Z-axis by angle (deg
 args::ValueFlag<std::string> permute(parser, "PERMUTE", "Permute axes, e.g. 2,0,1. Negative values mean flip as well", {"permute"});
 args::ValueFlag<std::string> flip(parser, "FLIP", "Flip an axis, e.g. 0,1,0. Occurs AFTER any permutation.", {"flip"});
 
-template<typename TImage>
-int Pipeline() {
-    auto image = QI::ReadImage<TImage>(QI::CheckPos(source_path));
-
-    // Permute if required
+/*
+ * Reads the permutation and flips of the spatial axes, which apply to the output axes, i.e. after
+ * the permutation. A minus sign in the permutation flips that axis as well.
+ */
+template<unsigned int D>
+void ReadAxes(itk::FixedArray<unsigned int, D> &order, itk::FixedArray<bool, D> &flips) {
+    for (unsigned int i = 0; i < D; i++) {
+        order[i] = i;
+        flips[i] = false;
+    }
     if (permute) {
-        auto permute_filter = itk::PermuteAxesImageFilter<TImage>::New();
-        itk::FixedArray<unsigned int, TImage::ImageDimension> permute_order;
         std::istringstream iss(permute.Get());
         std::string el;
         for (int i = 0; i < 3; i++) {
             std::getline(iss, el, ',');
-            permute_order[i] = std::stoi(el);
-        }
-        for (int i = 3; i < TImage::ImageDimension; i++) {
-            permute_order[i] = i;
+            if (!iss) break;
+            order[i] = std::abs(std::stoi(el));
+            flips[i] = (el.find('-') != std::string::npos);
         }
-        if (!iss)
+        std::array<unsigned int, 3> sorted{{order[0], order[1], order[2]}};
+        std::sort(sorted.begin(), sorted.end());
+        if (!iss || sorted[0] != 0 || sorted[1] != 1 || sorted[2] != 2)
             QI_FAIL("Failed to read permutation order: " << permute.Get());
-
-        permute_filter->SetInput(image);
-        permute_filter->SetOrder(permute_order);
-        permute_filter->Update();
-        image = permute_filter->GetOutput();
-        image->DisconnectPipeline();
     }
-
-    // Flip if required
     if (flip) {
-        auto flip_filter = itk::FlipImageFilter<TImage>::New();
-        itk::FixedArray<bool, TImage::ImageDimension> flip_axes; // Save this
         std::istringstream iss(flip.Get());
         std::string el;
         for (int i = 0; i < 3; i++) {
             std::getline(iss, el, ',');
-            flip_axes[i] = (std::stoi(el) > 0);
-        }
-        for (int i = 3; i < TImage::ImageDimension; i++) {
-            flip_axes[i] = false;
+            if (!iss) break;
+            flips[i] = (flips[i] != (std::stoi(el) > 0));
         }
         if (!iss)
             QI_FAIL("Failed to read flip: " << flip.Get());
-        if (verbose) std::cout << "Flipping: " << flip_axes << std::endl;
-        flip_filter->SetInput(image);
-        flip_filter->SetFlipAxes(flip_axes);
-        flip_filter->SetFlipAboutOrigin(false);
-        flip_filter->Update();
-        image = flip_filter->GetOutput();
-        image->DisconnectPipeline();
     }
+}
 
+/*
+ * Permutes and then flips the axes in one pass, with the same geometry as
+ * itk::PermuteAxesImageFilter followed by itk::FlipImageFilter (not about the origin). Each output
+ * axis j walks the input with the stride of axis order[j], backwards if flipped. If the fastest
+ * input axis becomes a slower output axis, each plane is transposed in square tiles so that the
+ * reads and writes both stay within a few cache lines.
+ */
+template<typename TImage>
+auto PermuteFlip(const TImage *input, const itk::FixedArray<unsigned int, TImage::ImageDimension> &order,
+                 const itk::FixedArray<bool, TImage::ImageDimension> &flips) -> typename TImage::Pointer
+{
+    typedef typename TImage::PixelType TPixel;
+    const unsigned int D = TImage::ImageDimension;
+    const ptrdiff_t Tile = 32;
+    const auto inRegion = input->GetLargestPossibleRegion();
+    std::array<ptrdiff_t, D> inStride, outStride, step;
+    for (unsigned int d = 0; d < D; d++) {
+        inStride[d] = (d == 0) ? 1 : inStride[d - 1] * inRegion.GetSize()[d - 1];
+    }
+    typename TImage::RegionType outRegion;
+    typename TImage::IndexType firstIndex; firstIndex.Fill(0); // Input index of the first output voxel
+    typename TImage::SpacingType spacing;
+    typename TImage::DirectionType direction;
+    ptrdiff_t start = 0;
+    unsigned int b = 0; // The output axis that walks the input contiguously
+    for (unsigned int j = 0; j < D; j++) {
+        const size_t n = inRegion.GetSize()[order[j]];
+        outRegion.SetSize(j, n);
+        outRegion.SetIndex(j, inRegion.GetIndex()[order[j]]);
+        outStride[j] = (j == 0) ? 1 : outStride[j - 1] * outRegion.GetSize()[j - 1];
+        step[j] = inStride[order[j]];
+        spacing[j] = input->GetSpacing()[order[j]];
+        for (unsigned int i = 0; i < D; i++) {
+            direction[i][j] = input->GetDirection()[i][order[j]];
+        }
+        if (flips[j]) {
+            start += static_cast<ptrdiff_t>(n - 1) * step[j];
+            step[j] = -step[j];
+            firstIndex[order[j]] += n - 1;
+            for (unsigned int i = 0; i < D; i++) {
+                direction[i][j] = -direction[i][j];
+            }
+        }
+        if (order[j] == 0) b = j;
+    }
+    typename TImage::PointType origin;
+    input->TransformIndexToPhysicalPoint(firstIndex, origin);
+    auto output = TImage::New();
+    output->SetRegions(outRegion);
+    output->SetSpacing(spacing);
+    output->SetOrigin(origin);
+    output->SetDirection(direction);
+    output->Allocate();
 
-    typename TImage::DirectionType fullDir = image->GetDirection();
-    typename TImage::SpacingType fullSpacing = image->GetSpacing();
-    typename TImage::PointType fullOrigin = image->GetOrigin();
-    typename TImage::SizeType fullSize = image->GetLargestPossibleRegion().GetSize();
-    QI::VolumeF::DirectionType direction;
-    QI::VolumeF::SpacingType spacing;
+    const TPixel *in = input->GetBufferPointer() + start;
+    TPixel *out = output->GetBufferPointer();
+    const ptrdiff_t nx = outRegion.GetSize()[0];
+    const ptrdiff_t ny = (b > 0) ? outRegion.GetSize()[b] : 1;
+    const size_t nPlanes = outRegion.GetNumberOfPixels() / (nx * ny);
+    for (size_t p = 0; p < nPlanes; p++) {
+        size_t rest = p;
+        ptrdiff_t inPlane = 0, outPlane = 0;
+        for (unsigned int j = 1; j < D; j++) {
+            if (j != b) {
+                const ptrdiff_t pj = rest % outRegion.GetSize()[j];
+                rest /= outRegion.GetSize()[j];
+                inPlane += pj * step[j];
+                outPlane += pj * outStride[j];
+            }
+        }
+        if (b == 0) {
+            for (ptrdiff_t x = 0; x < nx; x++) {
+                out[outPlane + x] = in[inPlane + x * step[0]];
+            }
+        } else {
+            for (ptrdiff_t y0 = 0; y0 < ny; y0 += Tile) {
+                const ptrdiff_t y1 = std::min(y0 + Tile, ny);
+                for (ptrdiff_t x0 = 0; x0 < nx; x0 += Tile) {
+                    const ptrdiff_t x1 = std::min(x0 + Tile, nx);
+                    for (ptrdiff_t y = y0; y < y1; y++) {
+                        TPixel *o = out + outPlane + y * outStride[b];
+                        const TPixel *i = in + inPlane + y * step[b];
+                        for (ptrdiff_t x = x0; x < x1; x++) {
+                            o[x] = i[x * step[0]];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return output;
+}
 
+/*
+ * Applies the scaling, rotations and translation to the spatial part of the image geometry, and
+ * writes out the transform if requested. The centre of gravity is only calculated (from the
+ * voxels) for --center=cog.
+ */
+void EditGeometry(QI::VolumeF::DirectionType &direction, QI::VolumeF::SpacingType &spacing,
+                  QI::VolumeF::PointType &newOrigin, const QI::VolumeF::SizeType &size,
+                  const std::function<itk::Versor<double>::VectorType()> &cog)
+{
     typedef itk::CenteredAffineTransform<double, 3> TAffine; 
     TAffine::OutputVectorType origin;
-    QI::VolumeF::SizeType size;
     for (int i = 0; i < 3; i++) {
-        for (int j = 0; j < 3; j++) {
-            direction[i][j] = fullDir[i][j];
-        }
-        origin[i] = fullOrigin[i];
-        spacing[i] = fullSpacing[i];
-        size[i] = fullSize[i];
+        origin[i] = newOrigin[i];
     }
 
     auto img_tfm = TAffine::New();
@@ -153,13 +229,7 @@ int Pipeline() {
             }
         } else if (center.Get() == "cog") {
             if (verbose) std::cout << "Setting center to center of gravity" << std::endl;
-            auto moments = itk::ImageMomentsCalculator<TImage>::New();
-            moments->SetImage(image);
-            moments->Compute();
-            // ITK seems to put a negative sign on the CoG
-            for (int i = 0; i < 3; i++) {
-                offset[i] = moments->GetCenterOfGravity()[i];
-            }
+            offset = cog();
         }
         std::cout << "Translation will be: " << offset << std::endl;
         tfm->Translate(-offset);
@@ -182,7 +252,7 @@ int Pipeline() {
     itk::CenteredAffineTransform<double, 3>::MatrixType fmat = img_tfm->GetMatrix();
     if (verbose) std::cout << "Final transform:\n" << fmat << std::endl;
     for (int i = 0; i < 3; i++) {
-        fullOrigin[i] = img_tfm->GetOffset()[i];
+        newOrigin[i] = img_tfm->GetOffset()[i];
     }
     for (int j = 0; j < 3; j++) {
         double scale = 0.;
@@ -191,10 +261,58 @@ int Pipeline() {
         }
         scale = sqrt(scale);
         
-        fullSpacing[j] = scale;
+        spacing[j] = scale;
+        for (int i = 0; i < 3; i++) {
+            direction[i][j] = fmat[i][j] / scale;
+        }
+    }
+}
+
+template<typename TImage>
+int Pipeline() {
+    auto image = QI::ReadImage<TImage>(QI::CheckPos(source_path));
+
+    if (permute || flip) {
+        itk::FixedArray<unsigned int, TImage::ImageDimension> order;
+        itk::FixedArray<bool, TImage::ImageDimension> flips;
+        ReadAxes<TImage::ImageDimension>(order, flips);
+        if (verbose) std::cout << "Permuting: " << order << " Flipping: " << flips << std::endl;
+        image = PermuteFlip<TImage>(image, order, flips);
+    }
+
+    typename TImage::DirectionType fullDir = image->GetDirection();
+    typename TImage::SpacingType fullSpacing = image->GetSpacing();
+    typename TImage::PointType fullOrigin = image->GetOrigin();
+    typename TImage::SizeType fullSize = image->GetLargestPossibleRegion().GetSize();
+    QI::VolumeF::DirectionType direction;
+    QI::VolumeF::SpacingType spacing;
+    QI::VolumeF::PointType origin;
+    QI::VolumeF::SizeType size;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = fullDir[i][j];
+        }
+        origin[i] = fullOrigin[i];
+        spacing[i] = fullSpacing[i];
+        size[i] = fullSize[i];
+    }
+    EditGeometry(direction, spacing, origin, size, [&]() -> itk::Versor<double>::VectorType {
+        auto moments = itk::ImageMomentsCalculator<TImage>::New();
+        moments->SetImage(image);
+        moments->Compute();
+        // ITK seems to put a negative sign on the CoG
+        itk::Versor<double>::VectorType cog;
         for (int i = 0; i < 3; i++) {
-            fullDir[i][j] = fmat[i][j] / scale;
+            cog[i] = moments->GetCenterOfGravity()[i];
         }
+        return cog;
+    });
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            fullDir[i][j] = direction[i][j];
+        }
+        fullOrigin[i] = origin[i];
+        fullSpacing[i] = spacing[i];
     }
     image->SetDirection(fullDir);
     image->SetOrigin(fullOrigin);
@@ -211,6 +329,43 @@ int Pipeline() {
     return EXIT_SUCCESS;
 }
 
+/*
+ * Edits that only change the geometry of an uncompressed NIfTI file are made by patching its header
+ * (after copying the file if there is a separate destination), so the voxels are never decoded.
+ * Returns false if this is not possible, in which case the whole image is read and re-written.
+ */
+bool HeaderOnly(const itk::ImageIOBase *header) {
+    const std::string &in_path = source_path.Get();
+    const std::string out_path = dest_path ? dest_path.Get() : in_path;
+    auto is_nii = [](const std::string &p) { return p.size() > 4 && p.compare(p.size() - 4, 4, ".nii") == 0; };
+    if (permute || flip || (center && center.Get() == "cog") || header->GetNumberOfDimensions() < 3 ||
+        std::string(header->GetNameOfClass()) != "NiftiImageIO" || !is_nii(in_path) || !is_nii(out_path)) {
+        return false;
+    }
+    QI::VolumeF::DirectionType direction;
+    QI::VolumeF::SpacingType spacing;
+    QI::VolumeF::PointType origin;
+    QI::VolumeF::SizeType size;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = header->GetDirection(j)[i];
+        }
+        origin[i] = header->GetOrigin(i);
+        spacing[i] = header->GetSpacing(i);
+        size[i] = header->GetDimensions(i);
+    }
+    EditGeometry(direction, spacing, origin, size, nullptr);
+    if (out_path != in_path) {
+        std::ifstream src(in_path, std::ios::binary);
+        QI::CacheOutput(out_path);
+        std::ofstream dst(out_path, std::ios::binary);
+        dst << src.rdbuf();
+        if (!dst) QI_FAIL("Failed to copy " << in_path << " to " << out_path);
+    }
+    if (verbose) std::cout << "Writing header: " << out_path << std::endl;
+    return QI::RewriteNiftiGeometry(out_path, direction, spacing, origin);
+}
+
 int main(int argc, char **argv) {
     QI::ParseArgs(parser, argc, argv, verbose);
     if (verbose) std::cout << "Reading header for: " << QI::CheckPos(source_path) << std::endl;
@@ -220,6 +375,9 @@ int main(int argc, char **argv) {
     }
     header->SetFileName(source_path.Get());
     header->ReadImageInformation();
+    if (HeaderOnly(header)) {
+        return EXIT_SUCCESS;
+    }
     auto dims  = header->GetNumberOfDimensions();
     auto dtype = header->GetComponentType();
     if (verbose) std::cout << "Datatype is " << header->GetComponentTypeAsString( dtype ) << std::endl;
@@ -10,85 +10,19 @@
  */
 
 #include <iostream>
+#include <complex>
+#include <vector>
+#include <algorithm>
 
 #include "itkImage.h"
 #include "itkImageFileReader.h"
-#include "itkImageFileWriter.h"
-#include "itkImageSliceConstIteratorWithIndex.h"
-#include "itkImageSliceIteratorWithIndex.h"
-#include "itkMultiplyImageFilter.h"
-#include "itkComplexToPhaseImageFilter.h"
-#include "itkComplexToModulusImageFilter.h"
-#include "itkComplexToRealImageFilter.h"
-#include "itkComplexToImaginaryImageFilter.h"
-#include "itkComposeImageFilter.h"
-#include "itkMagnitudeAndPhaseToComplexImageFilter.h"
-#include "itkRegionOfInterestImageFilter.h"
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "ImageStreaming.h"
+#include "ThreadPool.h"
 #include "Args.h"
 
-namespace itk {
-template<typename TImage>
-class NegateFilter : public InPlaceImageFilter<TImage> {
-public:
-    typedef NegateFilter                Self;
-    typedef InPlaceImageFilter<TImage>  Superclass;
-    typedef SmartPointer<Self>          Pointer;
-    typedef typename TImage::RegionType        TRegion;
-    typedef typename TImage::InternalPixelType TPixel;
-
-    itkNewMacro(Self);
-    itkTypeMacro(NegateFilter, InPlaceImageFilter);
-
-private:
-    NegateFilter(const Self &); //purposely not implemented
-    void operator=(const Self &);  //purposely not implemented
-    bool m_all = false, m_alternate = false;
-protected:
-    NegateFilter() {}
-    ~NegateFilter() {}
-
-public:
-    void SetNegate(const bool all, const bool alternate) {
-        m_all = all;
-        m_alternate = alternate;
-    }
-    void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE {
-        typedef typename TImage::PixelType PixelType;
-        ImageSliceConstIteratorWithIndex<TImage> inIt(this->GetInput(), region);
-        ImageSliceIteratorWithIndex<TImage>      outIt(this->GetOutput(), region);
-
-        inIt.SetFirstDirection(0);
-        inIt.SetSecondDirection(1);
-        outIt.SetFirstDirection(0);
-        outIt.SetSecondDirection(1);
-        inIt.GoToBegin();
-        outIt.GoToBegin();
-        PixelType mult(m_all ? -1 : 1, 0);
-        while(!inIt.IsAtEnd()) {
-            while (!inIt.IsAtEndOfSlice()) {
-                while (!inIt.IsAtEndOfLine()) {
-                    outIt.Set(mult * inIt.Get());
-                    ++inIt;
-                    ++outIt;
-                }
-                inIt.NextLine();
-                outIt.NextLine();
-            }
-            if (m_alternate) {
-                mult = mult * PixelType(-1, 0);
-            }
-            inIt.NextSlice();
-            outIt.NextSlice();
-        }
-        // std::std::cout << "End " << __PRETTY_FUNCTION__ << std::std::endl;
-    }
-};
-
-} // End namespace itk
-
 /* Arguments defined here so they are available in the templated run function */
 args::ArgumentParser parser(
     "Input is specified with lower case letters. A valid combination of inputs "
@@ -102,6 +36,7 @@ args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=har
 args::Flag     use_double(parser, "DOUBLE", "Process & output at double precision", {'d', "double"});
 args::Flag     fixge(parser, "FIX_GE", "Negate alternate slices (fixes lack of FFT shift)", {"fixge"});
 args::Flag     negate(parser, "NEGATE", "Negate entire volume", {"negate"});
+args::ValueFlag<int> stream(parser, "SLABS", "Read, convert and write the volumes in this many slabs to limit memory use", {"stream"});
 
 args::ValueFlag<std::string> in_mag(parser, "IN_MAG", "Input magnitude file", {'m', "mag"});
 args::ValueFlag<std::string> in_pha(parser, "IN_PHA", "Input phase file", {'p', "pha"});
@@ -116,127 +51,172 @@ args::ValueFlag<std::string> out_real(parser, "OUT_REAL", "Output real file", {'
 args::ValueFlag<std::string> out_imag(parser, "OUT_IMAG", "Output imaginary file", {'I', "IMAG"});
 args::ValueFlag<std::string> out_complex(parser, "OUT_CPLX", "Output complex file", {'X', "COMPLEX"});
 
+template<typename TOut>
+auto MakeSlab(const itk::ImageBase<4> *info, const typename TOut::RegionType &region,
+              const typename TOut::RegionType &slab) -> typename TOut::Pointer
+{
+    auto img = TOut::New();
+    img->SetLargestPossibleRegion(region);
+    img->SetBufferedRegion(slab);
+    img->SetRequestedRegion(slab);
+    img->SetSpacing(info->GetSpacing());
+    img->SetOrigin(info->GetOrigin());
+    img->SetDirection(info->GetDirection());
+    img->Allocate();
+    return img;
+}
+
+template<typename TOut>
+void WriteSlab(TOut *img, const typename TOut::RegionType &slab, const std::string &path, const bool whole) {
+    if (whole) {
+        QI::WriteImage(img, path);
+    } else {
+        QI::PasteRegion<TOut>(img, slab, path);
+    }
+}
+
+/*
+ * Every requested output is calculated in a single pass over the input, with the slices shared
+ * between the threads of the global pool. With --stream the series is read, converted and written
+ * a group of volumes at a time, otherwise in one go.
+ */
 template<typename TPixel>
 void Run() {
-    typedef itk::Image<TPixel, 4>          TImage;
+    typedef itk::Image<TPixel, 4>               TImage;
     typedef itk::Image<std::complex<TPixel>, 4> TXImage;
-    typedef itk::ImageFileWriter<TImage>   TWriter;
-
-    typename TImage::Pointer img1 = ITK_NULLPTR, img2 = ITK_NULLPTR;
-    typename TXImage::Pointer imgX = ITK_NULLPTR;
-
+    typedef itk::ImageFileReader<TImage>        TReader;
+    typedef itk::ImageFileReader<TXImage>       TXReader;
+    typedef typename TImage::RegionType         TRegion;
+    typedef std::complex<TPixel>                TComplex;
+
+    enum class Input { RealImag, MagPhase, Complex };
+    Input input = Input::Complex;
+    typename TReader::Pointer reader1 = TReader::New(), reader2 = TReader::New();
+    typename TXReader::Pointer readerX = TXReader::New();
+    size_t offset2 = 0; // Volume of the second input that matches the first, for --realimag
+    auto open = [&](typename TReader::Pointer &reader, const std::string &path, const std::string &name) {
+        if (verbose) std::cout << "Reading " << name << " file: " << path << std::endl;
+        reader->SetFileName(path);
+        reader->UpdateOutputInformation();
+    };
     if (in_real) {
-        if (verbose) std::cout << "Reading real file: " << in_real.Get() << std::endl;
-        img1 = QI::ReadImage<TImage>(in_real.Get());
-        if (in_imag) {
-            if (verbose) std::cout << "Reading imaginary file: " << in_imag.Get() << std::endl;
-            img2 = QI::ReadImage<TImage>(in_imag.Get());
-        } else {
-            QI_FAIL("Must set real and imaginary inputs together");
-        }
-        auto compose = itk::ComposeImageFilter<TImage, TXImage>::New();
-        compose->SetInput(0, img1);
-        compose->SetInput(1, img2);
-        compose->Update();
-        imgX = compose->GetOutput();
-        imgX->DisconnectPipeline();
+        if (!in_imag) QI_FAIL("Must set real and imaginary inputs together");
+        input = Input::RealImag;
+        open(reader1, in_real.Get(), "real");
+        open(reader2, in_imag.Get(), "imaginary");
     } else if (in_mag) {
-        if (verbose) std::cout << "Reading magnitude file: " << in_mag.Get() << std::endl;
-        img1 = QI::ReadImage<TImage>(in_mag.Get());
-        if (in_pha) {
-            if (verbose) std::cout << "Reading phase file: " << in_pha.Get() << std::endl;
-            img2 = QI::ReadImage<TImage>(in_pha.Get());
-        } else {
-            QI_FAIL("Must set magnitude and phase inputs together");
-        }
-        auto compose = itk::MagnitudeAndPhaseToComplexImageFilter<TImage, TImage, TXImage>::New();
-        compose->SetInput(0, img1);
-        compose->SetInput(1, img2);
-        compose->Update();
-        imgX = compose->GetOutput();
-        imgX->DisconnectPipeline();
+        if (!in_pha) QI_FAIL("Must set magnitude and phase inputs together");
+        input = Input::MagPhase;
+        open(reader1, in_mag.Get(), "magnitude");
+        open(reader2, in_pha.Get(), "phase");
     } else if (in_complex) {
         if (verbose) std::cout << "Reading complex file: " << in_complex.Get() << std::endl;
-        imgX = QI::ReadImage<TXImage>(in_complex.Get());
+        input = Input::Complex;
+        readerX->SetFileName(in_complex.Get());
+        readerX->UpdateOutputInformation();
     } else if (in_realimag) {
-        if (verbose) std::cout << "Reading real/imaginary file: " << in_realimag.Get() << std::endl;
-        auto img_both = QI::ReadImage<TImage>(in_realimag.Get());
-        auto real_region = img_both->GetLargestPossibleRegion();
-        auto imag_region = img_both->GetLargestPossibleRegion();
-        real_region.GetModifiableSize()[3] = real_region.GetSize()[3] / 2;
-        imag_region.GetModifiableSize()[3] = real_region.GetSize()[3];
-        imag_region.GetModifiableIndex()[3] = real_region.GetSize()[3];
-        auto extract_real = itk::RegionOfInterestImageFilter<TImage, TImage>::New();
-        extract_real->SetRegionOfInterest(real_region);
-        extract_real->SetInput(img_both);
-        extract_real->Update();
-        auto extract_imag = itk::RegionOfInterestImageFilter<TImage, TImage>::New();
-        extract_imag->SetRegionOfInterest(imag_region);
-        extract_imag->SetInput(img_both);
-        extract_imag->Update();
-        /* Hack round ITK changing the origin */
-        extract_imag->GetOutput()->SetOrigin(extract_real->GetOutput()->GetOrigin());
-        auto compose = itk::ComposeImageFilter<TImage, TXImage>::New();
-        compose->SetInput(0, extract_real->GetOutput());
-        compose->SetInput(1, extract_imag->GetOutput());
-        compose->Update();
-        imgX = compose->GetOutput();
-        imgX->DisconnectPipeline();
+        input = Input::RealImag;
+        open(reader1, in_realimag.Get(), "real/imaginary");
+        open(reader2, in_realimag.Get(), "real/imaginary");
+        offset2 = reader1->GetOutput()->GetLargestPossibleRegion().GetSize()[3] / 2;
     } else {
         QI_FAIL("No input files specified, use --help to see usage");
     }
-
-    if (fixge || negate) {
-        if (verbose && negate) std::cout << "Negating values" << std::endl;
-        if (verbose && fixge)  std::cout << "Fixing GE lack of FFT-shift bug" << std::endl;
-        auto fix = itk::NegateFilter<TXImage>::New();
-        fix->SetInput(imgX);
-        fix->SetNegate(negate, fixge);
-        fix->Update();
-        imgX = fix->GetOutput();
-        imgX->DisconnectPipeline();
+    const itk::ImageBase<4> *info = (input == Input::Complex) ?
+                                    static_cast<itk::ImageBase<4> *>(readerX->GetOutput()) :
+                                    static_cast<itk::ImageBase<4> *>(reader1->GetOutput());
+    TRegion region = info->GetLargestPossibleRegion();
+    if (offset2) {
+        region.SetSize(3, offset2);
+    } else if (input != Input::Complex && region != reader2->GetOutput()->GetLargestPossibleRegion()) {
+        QI_FAIL("Input images must be the same size");
     }
 
-    if (verbose) std::cout << "Writing output files" << std::endl;
-    typename TWriter::Pointer write = TWriter::New();
+    if (verbose && negate) std::cout << "Negating values" << std::endl;
+    if (verbose && fixge)  std::cout << "Fixing GE lack of FFT-shift bug" << std::endl;
+    const std::vector<std::string> real_paths{out_mag.Get(), out_pha.Get(), out_real.Get(), out_imag.Get()};
+    const size_t nvols = region.GetSize()[3];
+    const size_t slabs = stream ? std::max<size_t>(1, std::min<size_t>(stream.Get(), nvols)) : 1;
+    const size_t nx = region.GetSize()[0], ny = region.GetSize()[1], nz = region.GetSize()[2];
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    for (size_t s = 0; s < slabs; s++) {
+        TRegion slab = region;
+        slab.SetIndex(3, region.GetIndex()[3] + (nvols * s) / slabs);
+        slab.SetSize(3, (nvols * (s + 1)) / slabs - (nvols * s) / slabs);
+        if (verbose && slabs > 1) std::cout << "Processing slab " << (s + 1) << " of " << slabs << std::endl;
+        const TPixel *in1 = nullptr, *in2 = nullptr;
+        const TComplex *inX = nullptr;
+        if (input == Input::Complex) {
+            readerX->GetOutput()->SetRequestedRegion(slab);
+            readerX->Update();
+            const TXImage *img = readerX->GetOutput();
+            inX = img->GetBufferPointer() + img->GetBufferedRegion().ComputeOffset(slab.GetIndex());
+        } else {
+            TRegion slab2 = slab;
+            slab2.SetIndex(3, slab.GetIndex()[3] + offset2);
+            reader1->GetOutput()->SetRequestedRegion(slab);
+            reader2->GetOutput()->SetRequestedRegion(slab2);
+            reader1->Update();
+            reader2->Update();
+            const TImage *img1 = reader1->GetOutput(), *img2 = reader2->GetOutput();
+            in1 = img1->GetBufferPointer() + img1->GetBufferedRegion().ComputeOffset(slab.GetIndex());
+            in2 = img2->GetBufferPointer() + img2->GetBufferedRegion().ComputeOffset(slab2.GetIndex());
+        }
 
-    if (out_mag) {
-        auto o = itk::ComplexToModulusImageFilter<TXImage, TImage>::New();
-        o->SetInput(imgX);
-        o->Update();
-        QI::WriteImage(o->GetOutput(), out_mag.Get());
-        if (verbose) std::cout << "Wrote magnitude image " << out_mag.Get() << std::endl;
-    }
-    if (out_pha) {
-        auto o = itk::ComplexToPhaseImageFilter<TXImage, TImage>::New();
-        o->SetInput(imgX);
-        o->Update();
-        QI::WriteImage(o->GetOutput(), out_pha.Get());
-        if (verbose) std::cout << "Wrote phase image " << out_pha.Get() << std::endl;
-    }
-    if (out_real) {
-        auto o = itk::ComplexToRealImageFilter<TXImage, TImage>::New();
-        o->SetInput(imgX);
-        o->Update();
-        QI::WriteImage(o->GetOutput(), out_real.Get());
-        if (verbose) std::cout << "Wrote real image " << out_real.Get() << std::endl;
-    }
-    if (out_imag) {
-        auto o = itk::ComplexToImaginaryImageFilter<TXImage, TImage>::New();
-        o->SetInput(imgX);
-        o->Update();
-        QI::WriteImage(o->GetOutput(), out_imag.Get());
-        if (verbose) std::cout << "Wrote imaginary image " << out_imag.Get() << std::endl;
+        std::vector<typename TImage::Pointer> real_out(real_paths.size());
+        std::vector<TPixel *> real_ptr(real_paths.size(), nullptr);
+        for (size_t o = 0; o < real_paths.size(); o++) {
+            if (!real_paths[o].empty()) {
+                real_out[o] = MakeSlab<TImage>(info, region, slab);
+                real_ptr[o] = real_out[o]->GetBufferPointer();
+            }
+        }
+        typename TXImage::Pointer complex_out = ITK_NULLPTR;
+        TComplex *outX = nullptr;
+        if (out_complex) {
+            complex_out = MakeSlab<TXImage>(info, region, slab);
+            outX = complex_out->GetBufferPointer();
+        }
+        TPixel *const mag = real_ptr[0], *const pha = real_ptr[1], *const re = real_ptr[2], *const im = real_ptr[3];
+        const size_t nxy = nx * ny;
+        const size_t nSlices = nz * slab.GetSize()[3];
+        const size_t nTasks = std::max<size_t>(1, std::min(pool.size(), nSlices));
+        pool.run(nTasks, [&](const size_t t) {
+            for (size_t sl = (nSlices * t) / nTasks; sl < (nSlices * (t + 1)) / nTasks; sl++) {
+                const TPixel sign = ((negate ? -1 : 1) * ((fixge && ((sl % nz) % 2)) ? -1 : 1));
+                for (size_t i = sl * nxy; i < (sl + 1) * nxy; i++) {
+                    TComplex z;
+                    switch (input) {
+                    case Input::RealImag: z = TComplex(in1[i], in2[i]); break;
+                    case Input::MagPhase: z = std::polar(in1[i], in2[i]); break;
+                    case Input::Complex:  z = inX[i]; break;
+                    }
+                    z *= sign;
+                    if (mag) mag[i] = std::abs(z);
+                    if (pha) pha[i] = std::arg(z);
+                    if (re)  re[i] = z.real();
+                    if (im)  im[i] = z.imag();
+                    if (outX) outX[i] = z;
+                }
+            }
+        });
+        for (size_t o = 0; o < real_paths.size(); o++) {
+            if (real_out[o]) WriteSlab<TImage>(real_out[o], slab, real_paths[o], slabs == 1);
+        }
+        if (complex_out) WriteSlab<TXImage>(complex_out, slab, out_complex.Get(), slabs == 1);
     }
-    if (out_complex) {
-        if (verbose) std::cout << "Writing complex image " << out_complex.Get() << std::endl;
-        QI::WriteImage(imgX, out_complex.Get());
+    if (verbose) {
+        if (out_mag) std::cout << "Wrote magnitude image " << out_mag.Get() << std::endl;
+        if (out_pha) std::cout << "Wrote phase image " << out_pha.Get() << std::endl;
+        if (out_real) std::cout << "Wrote real image " << out_real.Get() << std::endl;
+        if (out_imag) std::cout << "Wrote imaginary image " << out_imag.Get() << std::endl;
+        if (out_complex) std::cout << "Wrote complex image " << out_complex.Get() << std::endl;
     }
 }
 
 int main(int argc, char **argv) {
     QI::ParseArgs(parser, argc, argv, verbose);
-    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
     if (use_double) {
         if (verbose) std::cout << "Using double precision" << std::endl;
         Run<double>();
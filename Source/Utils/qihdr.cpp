@@ -11,17 +11,17 @@
  */
 
 #include <iostream>
-#include "itkImageFileReader.h"
 #include "itkMetaDataObject.h"
 #include "ImageIO.h"
 #include "Args.h"
 #include "Util.h"
+#include "CPU.h"
 
 args::ArgumentParser parser(
 "Extracts information from image headers.\n"
 "By default, a summary of the header is printed. If any options are specified,"
 "only those parts of the header will be printed. Multiple files can be input"
-"in which case the header info is written for each in order.\n"
+"in which case the header info is written for each in order. Only the headers are read.\n"
 "http://github.com/spinicist/QUIT");
 
 args::PositionalList<std::string> filenames(parser, "FILES", "Input files");
@@ -35,6 +35,7 @@ args::Flag print_voxvol(parser, "VOLUME", "Calculate and print the volume of one
 args::Flag print_type(parser, "DTYPE", "Print the data type",{'T',"dtype"});
 args::Flag print_dims(parser, "DIMS", "Print the number of dimensions",{'D',"dims"});
 args::Flag dim3(parser, "3D", "Treat input as 3D (discard higher dimensions)", {'3',"3D"});
+args::Flag print_cpu(parser, "CPU", "Print which instruction set the QUIT kernels use on this CPU", {"cpu"});
 args::ValueFlagList<std::string> header_fields(parser, "METADATA", "Print a header metadata field (can be specified multiple times)", {'m', "meta"});
 
 //******************************************************************************
@@ -43,16 +44,25 @@ args::ValueFlagList<std::string> header_fields(parser, "METADATA", "Print a head
 int main(int argc, char **argv) {
 
     QI::ParseArgs(parser, argc, argv, verbose);
+    if (print_cpu) {
+        QI::CPUReport(std::cout);
+        if (!filenames) return EXIT_SUCCESS;
+    }
     bool print_all = !(print_direction || print_origin || print_spacing || print_size ||
                        print_voxvol || print_type || print_dims || header_fields);
+    int status = EXIT_SUCCESS;
     for (const std::string& fname : QI::CheckList(filenames)) {
-        itk::ImageIOBase::Pointer imageIO = itk::ImageIOFactory::CreateImageIO(fname.c_str(), itk::ImageIOFactory::ReadMode);
-        if (!imageIO) {
-            std::cerr << "Could not open: " << std::string(fname) << std::endl;
-            break;
+        itk::ImageIOBase::Pointer imageIO;
+        try {
+            imageIO = QI::ReadImageHeader(fname);
+        } catch (const std::exception &e) {
+            // Carry on with the other files, a batch should report every bad one
+            std::cerr << "Could not read header of: " << fname << std::endl;
+            if (verbose) std::cerr << e.what() << std::endl;
+            status = EXIT_FAILURE;
+            continue;
         }
-        imageIO->SetFileName(std::string(fname));
-        imageIO->ReadImageInformation();
+        const itk::MetaDataDictionary &header = imageIO->GetMetaDataDictionary();
         size_t dims = imageIO->GetNumberOfDimensions();
         if (verbose) std::cout << "File:       " << std::string(fname) << std::endl;
         if (print_all || verbose) std::cout << "Dimension:  "; if (print_all || print_dims) std::cout << dims << std::endl;
@@ -102,7 +112,6 @@ int main(int argc, char **argv) {
         }
         if (print_all || verbose) std::cout << "Voxel vol:  "; if (print_all || print_voxvol)   { double vol = imageIO->GetSpacing(0); for (int i = 1; i < dims; i++) vol *= imageIO->GetSpacing(i); std::cout << vol << std::endl; }
         for (const std::string &hf : header_fields.Get()) {
-            auto header = imageIO->GetMetaDataDictionary();
             if (header.HasKey(hf)) {
                 std::vector<std::string> string_array_value;
                 std::vector<std::vector<std::string> > string_array_array_value;
@@ -131,5 +140,5 @@ int main(int argc, char **argv) {
             }
         }
     }
-    return EXIT_SUCCESS;
+    return status;
 }
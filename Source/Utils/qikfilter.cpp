@@ -12,113 +12,178 @@
 #include <memory>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <map>
+#include <array>
+#include <vector>
+#include <complex>
+#include <algorithm>
 #include "Eigen/Dense"
 
-#include "itkImageSource.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkMultiplyImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkComplexToComplexFFTImageFilter.h"
-#include "itkInverseFFTImageFilter.h"
-#include "itkFFTShiftImageFilter.h"
-#include "itkComplexToModulusImageFilter.h"
-#include "itkFFTPadImageFilter.h"
-#include "itkConstantPadImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkPasteImageFilter.h"
-#include "itkCastImageFilter.h"
-#include "itkTileImageFilter.h"
-
 #include "ImageTypes.h"
 #include "Util.h"
 #include "Kernels.h"
 #include "ImageIO.h"
 #include "Args.h"
+#include "FFT.h"
+#include "ThreadPool.h"
 
-using namespace Eigen;
-
-namespace itk {
+namespace {
 
-template<typename TImage>
-class KernelSource : public ImageSource<TImage> {
-public:
-    typedef TImage                 ImageType;
-    typedef KernelSource           Self;
-    typedef ImageSource<ImageType> Superclass;
-    typedef SmartPointer<Self>     Pointer;
-    typedef typename ImageType::RegionType     RegionType;
-    typedef typename ImageType::IndexType      IndexType;
-    typedef typename ImageType::SizeType       SizeType;
-    typedef typename ImageType::SpacingType    SpacingType;
-    typedef typename ImageType::DirectionType  DirectionType;
-    typedef typename ImageType::PointType      PointType;
+typedef std::array<size_t, 3> TSize;
 
-protected:
-    KernelSource(){}
-    ~KernelSource(){}
-    RegionType    m_Region;
-    SpacingType   m_Spacing;
-    DirectionType m_Direction;
-    PointType     m_Origin;
-    std::vector<std::shared_ptr<QI::FilterKernel>> m_kernels;
-
-public:
-    itkNewMacro(Self);
-    itkTypeMacro(Self, ImageSource);
-    void SetKernel(const std::shared_ptr<QI::FilterKernel> &k) {
-        m_kernels.clear();
-        m_kernels.push_back(k);
-        this->Modified();
+/*
+ * The product of the kernels on the padded grid, with the origin in the corner as the FFT expects.
+ * Separable kernels are an outer product of their profiles, and radial kernels are interpolated
+ * from a table over r^2 (which is a sum of 1D terms), so neither needs per-voxel transcendentals.
+ */
+std::vector<double> MakeKernel(const std::vector<std::shared_ptr<QI::FilterKernel>> &kernels, const TSize &size, const Eigen::Array3d &sp) {
+    const Eigen::Array3d sz{static_cast<double>(size[0]), static_cast<double>(size[1]), static_cast<double>(size[2])};
+    const Eigen::Array3d hsz = sz / 2;
+    std::array<std::vector<double>, 3> pos;
+    for (int d = 0; d < 3; d++) {
+        pos[d].resize(size[d]);
+        for (size_t i = 0; i < size[d]; i++) {
+            pos[d][i] = fmod(i + hsz[d], sz[d]) - hsz[d];
+        }
     }
-    void SetKernels(const std::vector<std::shared_ptr<QI::FilterKernel>> &k) {
-        m_kernels = k;
-        this->Modified();
+    std::vector<double> kernel(size[0] * size[1] * size[2], 1.0);
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t nTasks = std::min(pool.size(), size[2]);
+    for (const auto &k : kernels) {
+        std::array<std::vector<double>, 3> axes; // Profiles, or the terms of r^2
+        std::vector<double> table;
+        double table_step = 0;
+        if (k->shape() == QI::FilterKernel::Shape::Separable) {
+            for (int d = 0; d < 3; d++) {
+                for (const double p : pos[d]) {
+                    axes[d].push_back(k->profile(d, p, hsz[d], sp[d]));
+                }
+            }
+        } else if (k->shape() == QI::FilterKernel::Shape::Radial) {
+            // The windows are smooth in r^2, this is far finer than the grid
+            double r2_max = 0;
+            for (int d = 0; d < 3; d++) {
+                double axis_max = 0;
+                for (const double p : pos[d]) {
+                    axes[d].push_back((p / hsz[d]) * (p / hsz[d]) / 3);
+                    axis_max = std::max(axis_max, axes[d].back());
+                }
+                r2_max += axis_max;
+            }
+            const size_t table_size = 16384;
+            table_step = r2_max / (table_size - 1);
+            table.resize(table_size + 1);
+            for (size_t i = 0; i < table_size; i++) {
+                table[i] = k->radial(sqrt(i * table_step));
+            }
+            table[table_size] = table[table_size - 1];
+        }
+        pool.run(nTasks, [&](const size_t t) {
+            for (size_t z = (size[2] * t) / nTasks; z < (size[2] * (t + 1)) / nTasks; z++) {
+                for (size_t y = 0; y < size[1]; y++) {
+                    double *row = kernel.data() + (z * size[1] + y) * size[0];
+                    switch (k->shape()) {
+                    case QI::FilterKernel::Shape::Separable: {
+                        const double yz = axes[1][y] * axes[2][z];
+                        for (size_t x = 0; x < size[0]; x++) {
+                            row[x] *= axes[0][x] * yz;
+                        }
+                    } break;
+                    case QI::FilterKernel::Shape::Radial: {
+                        const double yz = axes[1][y] + axes[2][z];
+                        for (size_t x = 0; x < size[0]; x++) {
+                            const double f = table_step > 0 ? (axes[0][x] + yz) / table_step : 0;
+                            const size_t i = std::min(static_cast<size_t>(f), table.size() - 2);
+                            const double w = f - i;
+                            row[x] *= (1 - w) * table[i] + w * table[i + 1];
+                        }
+                    } break;
+                    case QI::FilterKernel::Shape::General:
+                        for (size_t x = 0; x < size[0]; x++) {
+                            const Eigen::Array3d p{pos[0][x], pos[1][y], pos[2][z]};
+                            row[x] *= k->value(p, hsz, sp);
+                        }
+                        break;
+                    }
+                }
+            }
+        });
     }
-    itkSetMacro(Region, RegionType);
-    itkSetMacro(Spacing, SpacingType);
-    itkSetMacro(Direction, DirectionType);
-    itkSetMacro(Origin, PointType);
+    return kernel;
+}
 
-protected:
-    void GenerateOutputInformation() ITK_OVERRIDE {
-        auto output = this->GetOutput(0);
-        output->SetLargestPossibleRegion(m_Region);
-        output->SetSpacing(m_Spacing);
-        output->SetDirection(m_Direction);
-        output->SetOrigin(m_Origin);
+/*
+ * A volume on the padded grid, with the geometry of the input. Only used for the debugging
+ * images, so the k-space is shifted to put the origin in the centre.
+ */
+template<typename TVolume, typename TValue>
+typename TVolume::Pointer ShiftedVolume(const std::vector<TValue> &data, const TSize &size, const itk::ImageBase<4> *ref) {
+    typename TVolume::RegionType region;
+    typename TVolume::SpacingType spacing;
+    typename TVolume::PointType origin;
+    typename TVolume::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        region.SetSize(i, size[i]);
+        spacing[i] = ref->GetSpacing()[i];
+        origin[i] = ref->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction(i, j) = ref->GetDirection()(i, j);
+        }
     }
+    typename TVolume::Pointer vol = TVolume::New();
+    vol->SetRegions(region);
+    vol->SetSpacing(spacing);
+    vol->SetOrigin(origin);
+    vol->SetDirection(direction);
+    vol->Allocate();
+    typename TVolume::PixelType *out = vol->GetBufferPointer();
+    for (size_t k = 0; k < size[2]; k++) {
+        for (size_t j = 0; j < size[1]; j++) {
+            for (size_t i = 0; i < size[0]; i++) {
+                const size_t to = (((k + size[2] / 2) % size[2]) * size[1] + (j + size[1] / 2) % size[1]) * size[0] + (i + size[0] / 2) % size[0];
+                out[to] = static_cast<typename TVolume::PixelType>(data[(k * size[1] + j) * size[0] + i]);
+            }
+        }
+    }
+    return vol;
+}
 
-    void ThreadedGenerateData(const RegionType &region, ThreadIdType threadId) ITK_OVERRIDE {
-        const auto startIndex = m_Region.GetIndex();
-        const Eigen::Array3d sz{static_cast<double>(m_Region.GetSize()[0]),
-                                static_cast<double>(m_Region.GetSize()[1]),
-                                static_cast<double>(m_Region.GetSize()[2])};
-        const Eigen::Array3d hsz = sz / 2;
-        const Eigen::Array3d sp{m_Spacing[0], m_Spacing[1], m_Spacing[2]};
-        itk::ImageRegionIterator<ImageType> outIt(this->GetOutput(), m_Region);
-        outIt.GoToBegin();
-        while(!outIt.IsAtEnd()) {
-            const auto I = outIt.GetIndex() - startIndex; // Might be padded to a negative start
-            const double x = fmod(static_cast<double>(I[0]) + hsz[0], sz[0]) - hsz[0];
-            const double y = fmod(static_cast<double>(I[1]) + hsz[1], sz[1]) - hsz[1];
-            const double z = fmod(static_cast<double>(I[2]) + hsz[2], sz[2]) - hsz[2];
-            const Eigen::Array3d p{x, y, z};
-            typename ImageType::PixelType val = 1;
-            for (const auto &kernel : m_kernels) {
-                val *= kernel->value(p, hsz, sp);
+/*
+ * Copies one volume of the input to the padded grid, where source gives the input voxel for each
+ * padded position along each axis or -1 for zero. Real input is read directly, rather than cast
+ * to a complex copy of the whole series first.
+ */
+template<typename TIn>
+void Gather(const TIn *in, const TSize &size, const TSize &padded, const std::array<std::vector<long>, 3> &source, QI::FFT3D::TComplex *to) {
+    for (size_t k = 0; k < padded[2]; k++) {
+        for (size_t j = 0; j < padded[1]; j++) {
+            const long z = source[2][k], y = source[1][j];
+            for (size_t i = 0; i < padded[0]; i++) {
+                const long x = source[0][i];
+                *to++ = (x < 0 || y < 0 || z < 0) ? QI::FFT3D::TComplex(0.) : QI::FFT3D::TComplex(in[(z * size[1] + y) * size[0] + x]);
             }
-            outIt.Set(val);
-            ++outIt;
         }
     }
+}
+
+inline void Store(const QI::FFT3D::TComplex &c, std::complex<float> &out) { out = std::complex<float>(c); }
+inline void Store(const QI::FFT3D::TComplex &c, float &out) { out = static_cast<float>(std::abs(c)); }
 
-private:
-    KernelSource(const Self &);
-    void operator=(const Self &);
-};
+// Copies the original extent back out of the padded grid, taking the magnitude for real output
+template<typename TOut>
+void Crop(const QI::FFT3D::TComplex *data, const TSize &size, const TSize &padded, const TSize &offset, TOut *out) {
+    for (size_t k = 0; k < size[2]; k++) {
+        for (size_t j = 0; j < size[1]; j++) {
+            const QI::FFT3D::TComplex *row = data + ((k + offset[2]) * padded[1] + j + offset[1]) * padded[0] + offset[0];
+            for (size_t i = 0; i < size[0]; i++) {
+                Store(row[i], *out++);
+            }
+        }
+    }
+}
 
-} // End namespace itk
+} // End anonymous namespace
 
 //******************************************************************************
 // Main
@@ -141,7 +206,7 @@ int main(int argc, char **argv) {
     args::Flag filter_per_volume(parser, "FILTER_PER_VOL", "Instead of concatenating multiple filters, use one per volume", {"filter_per_volume"});
     args::ValueFlagList<std::string> filters(parser, "FILTER", "Specify a filter to use (can be multiple)", {'f', "filter"});
     QI::ParseArgs(parser, argc, argv, verbose);
-    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
 
     std::vector<std::shared_ptr<QI::FilterKernel>> kernels;
     if (filters) {
@@ -153,149 +218,148 @@ int main(int argc, char **argv) {
         kernels.push_back(std::make_shared<QI::TukeyKernel>());
     }
 
-    QI::SeriesXF::Pointer vols;
+    /*
+     * Each volume is copied to the padded grid before it is transformed, so the result can be
+     * written back over the input. Only complex output from real input needs a second series.
+     */
+    QI::SeriesXF::Pointer cvols;
+    QI::SeriesF::Pointer rvols;
     if (complex_in) {
         if (verbose) std::cout << "Reading complex file: " << QI::CheckPos(in_path) << std::endl;
-        vols = QI::ReadImage<QI::SeriesXF>(QI::CheckPos(in_path));
+        cvols = QI::ReadImage<QI::SeriesXF>(QI::CheckPos(in_path));
     } else {
         if (verbose) std::cout << "Reading real file: " << QI::CheckPos(in_path) << std::endl;
-        QI::SeriesF::Pointer rvols = QI::ReadImage<QI::SeriesF>(QI::CheckPos(in_path));
-        auto cast = itk::CastImageFilter<QI::SeriesF, QI::SeriesXF>::New();
-        cast->SetInput(rvols);
-        cast->Update();
-        vols = cast->GetOutput();
-        vols->DisconnectPipeline();
+        rvols = QI::ReadImage<QI::SeriesF>(QI::CheckPos(in_path));
+        if (complex_out) {
+            cvols = QI::SeriesXF::New();
+            cvols->CopyInformation(rvols);
+            cvols->SetRegions(rvols->GetLargestPossibleRegion());
+            cvols->Allocate();
+        }
     }
+    const itk::ImageBase<4> *vols = complex_in ? static_cast<const itk::ImageBase<4> *>(cvols.GetPointer()) : rvols.GetPointer();
     const std::string out_base = out_prefix ? out_prefix.Get() : QI::Basename(in_path.Get());
-    /*
-     * Main calculation starts hear.
-     * First a lot of typedefs.
-     */
-    typedef itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXD> TExtract;
-    typedef itk::TileImageFilter<QI::VolumeXF, QI::SeriesXF>    TTile;
-    typedef itk::ConstantPadImageFilter<QI::VolumeXD, QI::VolumeXD> TZeroPad;
-    typedef itk::FFTPadImageFilter<QI::VolumeXD>                TFFTPad;
-    typedef itk::FFTShiftImageFilter<QI::VolumeXD, QI::VolumeXD> TFFTShift;
-    typedef itk::ComplexToComplexFFTImageFilter<QI::VolumeXD>   TFFT;
-    typedef itk::MultiplyImageFilter<QI::VolumeXD, QI::VolumeD, QI::VolumeXD> TMult;
-    typedef itk::KernelSource<QI::VolumeD>                      TKernel;
-    typedef itk::ExtractImageFilter<QI::VolumeXD, QI::VolumeXF> TUnpad;
-    
-    auto region = vols->GetLargestPossibleRegion();
-    const size_t nvols = region.GetSize()[3]; // Save for the loop
+
+    const auto region = vols->GetLargestPossibleRegion();
+    const size_t nvols = region.GetSize()[3];
     if (filter_per_volume && nvols != kernels.size()) {
         std::cerr << "Number of volumes (" << nvols << ") and kernels (" << kernels.size() << ") do not match for filter_per_volume option" << std::endl;
         return EXIT_FAILURE;
     }
-    region.GetModifiableSize()[3] = 0;
-    QI::VolumeXD::RegionType unpad_region;
+    /*
+     * Zero-pad, then pad to a size with small prime factors by repeating the edges, with the
+     * extra split between the two sides the same way as itk::FFTPadImageFilter.
+     */
+    TSize size, padded, offset;
     for (int i = 0; i < 3; i++) {
-        unpad_region.GetModifiableSize()[i] = region.GetSize()[i];
+        size[i] = region.GetSize()[i];
+        const size_t zero_padded = size[i] + 2 * zero_padding.Get();
+        padded[i] = QI::FFT3D::GoodSize(zero_padded);
+        offset[i] = zero_padding.Get() + (padded[i] - zero_padded) / 2;
     }
+    if (verbose) std::cout << "Padded size: " << padded[0] << "," << padded[1] << "," << padded[2] << std::endl;
+    const QI::FFT3D fft(padded);
+    const Eigen::Array3d sp{vols->GetSpacing()[0], vols->GetSpacing()[1], vols->GetSpacing()[2]};
 
-    auto tkernel = TKernel::New();
-    if (!filter_per_volume) {
-        tkernel->SetKernels(kernels);
+    // The kernel only depends on the filters, so each different set is only made once
+    std::map<std::string, std::vector<double>> kernel_cache;
+    std::vector<const std::vector<double> *> vol_kernels(nvols);
+    for (size_t v = 0; v < nvols; v++) {
+        const std::vector<std::shared_ptr<QI::FilterKernel>> these = filter_per_volume ? std::vector<std::shared_ptr<QI::FilterKernel>>{kernels.at(v)} : kernels;
+        std::stringstream key;
+        key << std::setprecision(17);
+        for (const auto &k : these) {
+            key << *k << ";";
+        }
+        auto it = kernel_cache.find(key.str());
+        if (it == kernel_cache.end()) {
+            if (verbose) std::cout << "Making kernel: " << key.str() << std::endl;
+            it = kernel_cache.emplace(key.str(), MakeKernel(these, padded, sp)).first;
+        }
+        vol_kernels[v] = &it->second;
     }
 
-    auto tile   = TTile::New();
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = nvols;
-    tile->SetLayout(layout);
+    const size_t voxels = size[0] * size[1] * size[2];
+    const std::complex<float> *in_x = complex_in ? cvols->GetBufferPointer() : nullptr;
+    const float *in_r = complex_in ? nullptr : rvols->GetBufferPointer();
+    std::complex<float> *out_x = cvols ? cvols->GetBufferPointer() : nullptr;
+    float *out_r = cvols ? nullptr : rvols->GetBufferPointer();
+    std::vector<QI::FFT3D::TComplex> kspace_before, kspace_after;
 
-    for (int i = 0; i < nvols; i++) {
-        region.GetModifiableIndex()[3] = i;
-        if (verbose) std::cout << "Processing volume " << i << std::endl;
-
-        auto extract = TExtract::New();
-        extract->SetInput(vols);
-        extract->SetDirectionCollapseToSubmatrix();
-        extract->SetExtractionRegion(region);
-        auto zero_pad = TZeroPad::New();
-        auto fft_pad = TFFTPad::New();
-        fft_pad->SetSizeGreatestPrimeFactor(5); // This is the largest the VNL FFT supports
-        if (zero_padding > 0) {
-            QI::VolumeXD::SizeType padding;
-            padding.Fill(zero_padding);
-            zero_pad->SetInput(extract->GetOutput());
-            zero_pad->SetPadLowerBound(padding);
-            zero_pad->SetPadUpperBound(padding);
-            zero_pad->SetConstant(0);
-            fft_pad->SetInput(zero_pad->GetOutput());
+    /*
+     * Volumes are filtered in parallel, each on one thread, unless there is only one in which case
+     * its transforms are shared out instead.
+     */
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t vol_tasks = std::min(pool.size(), nvols);
+    const size_t fft_threads = (vol_tasks == 1) ? pool.size() : 1;
+    // For each padded position along each axis, the input voxel it is copied from or -1 for zero
+    std::array<std::vector<long>, 3> source;
+    for (int d = 0; d < 3; d++) {
+        const long n = size[d], zp = zero_padding.Get();
+        source[d].resize(padded[d]);
+        for (size_t q = 0; q < padded[d]; q++) {
+            const long index = std::min(std::max(static_cast<long>(q) - static_cast<long>(offset[d]), -zp), n + zp - 1);
+            source[d][q] = (index >= 0 && index < n) ? index : -1;
+        }
+    }
+    auto filter_volume = [&](const size_t v, std::vector<QI::FFT3D::TComplex> &data) {
+        if (in_x) {
+            Gather(in_x + v * voxels, size, padded, source, data.data());
         } else {
-            fft_pad->SetInput(extract->GetOutput());
+            Gather(in_r + v * voxels, size, padded, source, data.data());
         }
-        fft_pad->Update(); // Need to know the size of this to set up the kernel properly
-        if (i == 0) {
-            tkernel->SetRegion(fft_pad->GetOutput()->GetLargestPossibleRegion());
-            tkernel->SetSpacing(fft_pad->GetOutput()->GetSpacing());
-            tkernel->SetOrigin(fft_pad->GetOutput()->GetOrigin());
-            tkernel->SetDirection(fft_pad->GetOutput()->GetDirection());
+        fft.forward(data.data(), fft_threads);
+        const bool last = (v == nvols - 1);
+        if (save_kspace && last) kspace_before = data;
+        const std::vector<double> &kernel = *vol_kernels[v];
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] *= kernel[i];
         }
-        if (filter_per_volume) {
-            tkernel->SetKernel(kernels.at(i));
-            if (verbose) std::cout << "Setting kernel to: " << *kernels.at(i) << std::endl;
+        if (save_kspace && last) kspace_after = data;
+        fft.inverse(data.data(), fft_threads);
+        if (out_x) {
+            Crop(data.data(), size, padded, offset, out_x + v * voxels);
+        } else {
+            Crop(data.data(), size, padded, offset, out_r + v * voxels);
         }
-        auto forward = TFFT::New();
-        forward->SetInput(fft_pad->GetOutput());
-
-        auto mult    = TMult::New();
-        mult->SetInput1(forward->GetOutput());
-        mult->SetInput2(tkernel->GetOutput());
-
-        auto inverse = TFFT::New();
-        inverse->SetTransformDirection(TFFT::INVERSE);
-        inverse->SetInput(mult->GetOutput());
-
-        auto unpadder = TUnpad::New();
-        unpadder->SetDirectionCollapseToSubmatrix();
-        unpadder->SetExtractionRegion(unpad_region);
-        unpadder->SetInput(inverse->GetOutput());
-        unpadder->Update();
-
-        QI::VolumeXF::Pointer v = unpadder->GetOutput();
-        tile->SetInput(i, v);
-        v->DisconnectPipeline();
-
-        if (save_kspace) {
-            auto shift_filter = TFFTShift::New();
-            auto cast_filter = itk::CastImageFilter<QI::VolumeXD, QI::VolumeXF>::New();
-            shift_filter->SetInput(forward->GetOutput());
-            cast_filter->SetInput(shift_filter->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(cast_filter->GetOutput(), out_base + "_kspace_before" + QI::OutExt());
-            shift_filter->SetInput(mult->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(cast_filter->GetOutput(), out_base + "_kspace_after" + QI::OutExt());
+        if (verbose) std::cout << "Finished volume " << v << std::endl;
+    };
+    if (vol_tasks == 1) {
+        std::vector<QI::FFT3D::TComplex> data(fft.count());
+        for (size_t v = 0; v < nvols; v++) {
+            filter_volume(v, data);
         }
+    } else {
+        pool.run(vol_tasks, [&](const size_t t) {
+            std::vector<QI::FFT3D::TComplex> data(fft.count());
+            for (size_t v = t; v < nvols; v += vol_tasks) {
+                filter_volume(v, data);
+            }
+        });
     }
     if (verbose) std::cout << "Finished." << std::endl;
-    tile->Update();
-    auto dir = vols->GetDirection();
-    auto spc = vols->GetSpacing();
-    vols = tile->GetOutput();
-    vols->SetDirection(dir);
-    vols->SetSpacing(spc);
-    vols->DisconnectPipeline();
+
+    if (save_kspace) {
+        QI::WriteMagnitudeImage(ShiftedVolume<QI::VolumeXF>(kspace_before, padded, vols), out_base + "_kspace_before" + QI::OutExt());
+        QI::WriteMagnitudeImage(ShiftedVolume<QI::VolumeXF>(kspace_after, padded, vols), out_base + "_kspace_after" + QI::OutExt());
+    }
 
     const std::string out_path = out_base + "_filtered" + QI::OutExt();
     if (complex_out) {
         if (verbose) std::cout << "Saving complex output file: " << out_path << std::endl;
-        QI::WriteImage(vols, out_path);
+        QI::WriteImage(cvols, out_path);
+    } else if (cvols) {
+        if (verbose) std::cout << "Saving real output file: " << out_path << std::endl;
+        QI::WriteMagnitudeImage(cvols, out_path);
     } else {
         if (verbose) std::cout << "Saving real output file: " << out_path << std::endl;
-        QI::WriteMagnitudeImage(vols, out_path);
+        QI::WriteImage(rvols, out_path); // Already the magnitude
     }
     if (save_kernel) {
         const std::string kernel_path = out_base + "_kernel" + QI::OutExt();
         if (verbose) std::cout << "Saving filter kernel to: " << kernel_path << std::endl;
-        auto shift_filter = itk::FFTShiftImageFilter<QI::VolumeD, QI::VolumeD>::New();
-        shift_filter->SetInput(tkernel->GetOutput());
-        auto cast_filter = itk::CastImageFilter<QI::VolumeD, QI::VolumeF>::New();
-        cast_filter->SetInput(shift_filter->GetOutput());
-        cast_filter->Update();
-        QI::WriteImage(cast_filter->GetOutput(), kernel_path);
+        QI::WriteImage(ShiftedVolume<QI::VolumeF>(*vol_kernels.back(), padded, vols), kernel_path);
     }
     return EXIT_SUCCESS;
 }
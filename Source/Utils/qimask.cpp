@@ -13,14 +13,9 @@
 #include <iostream>
 #include <string>
 #include <complex>
+#include <cmath>
+#include <limits>
 
-#include "itkComplexToModulusImageFilter.h"
-#include "itkOtsuThresholdImageFilter.h"
-#include "itkVotingBinaryIterativeHoleFillingImageFilter.h"
-#include "itkBinaryCrossStructuringElement.h"
-#include "itkBinaryBallStructuringElement.h"
-#include "itkBinaryErodeImageFilter.h"
-#include "itkBinaryDilateImageFilter.h"
 #include "itkExtractImageFilter.h"
 
 #include "Args.h"
@@ -35,6 +30,7 @@ int main(int argc, char **argv) {
     "Stage 1 - Otsu thresholding to generate binary mask\n"
     "Stage 2 - RATs (optional)\n"
     "Stage 3 - Hole filling (optional)\n"
+    "All stages work on a one bit per voxel mask, and erosion, dilation and closing use exact distance maps\n"
     "http://github.com/spinicist/QUIT"
     );
 
@@ -48,7 +44,7 @@ int main(int argc, char **argv) {
     args::ValueFlag<float> lower_threshold(parser, "LOWER THRESHOLD", "Specify lower intensity threshold for 1st stage, otherwise Otsu's method is used", {'l', "lower"}, 0.);
     args::ValueFlag<float> upper_threshold(parser, "UPPER THRESHOLD", "Specify upper intensity threshold for 1st stage, otherwise Otsu's method is used", {'u', "upper"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> rats(parser, "RATS", "Perform the RATS step, argument is size threshold for connected component", {'r', "rats"}, 0.);
-    args::ValueFlag<int> fillh_radius(parser, "FILL HOLES", "Fill holes in thresholded mask with radius N", {'F', "fillh"}, 0);
+    args::ValueFlag<int> fillh_radius(parser, "FILL HOLES", "Fill holes in mask by closing with a ball of radius N voxels", {'F', "fillh"}, 0);
 
     QI::ParseArgs(parser, argc, argv, verbose);
 
@@ -89,74 +85,53 @@ int main(int argc, char **argv) {
     /*
      *  Stage 1 - Otsu or Threshold
      */
-    QI::VolumeI::Pointer mask_image = ITK_NULLPTR;
+    QI::BitMask mask({{intensity_image->GetBufferedRegion().GetSize()[0],
+                       intensity_image->GetBufferedRegion().GetSize()[1],
+                       intensity_image->GetBufferedRegion().GetSize()[2]}});
     if (lower_threshold || upper_threshold) {
         if (verbose) std::cout << "Thresholding range: " << lower_threshold.Get() << "-" << upper_threshold.Get() << std::endl;
-        mask_image = QI::ThresholdMask(intensity_image, lower_threshold.Get(), upper_threshold.Get());
+        mask = QI::ThresholdBits(intensity_image, lower_threshold.Get(), upper_threshold.Get());
     } else {
-        if (verbose) std::cout << "Generating Otsu mask" << std::endl;
-        mask_image = QI::OtsuMask(intensity_image);
+        const float otsu = QI::OtsuThreshold(intensity_image);
+        if (verbose) std::cout << "Generating Otsu mask, threshold is " << otsu << std::endl;
+        mask = QI::ThresholdBits(intensity_image, std::nextafter(otsu, std::numeric_limits<float>::infinity()));
     }
 
     /*
      *  Stage 2 - RATS
+     *  Every erosion is a threshold of the same distance map, so it is only computed once
      */
-     if (rats) {
-        typedef itk::BinaryBallStructuringElement<int, 3> TBall;
-        typedef itk::BinaryErodeImageFilter<QI::VolumeI, QI::VolumeI, TBall> TErode;
-        typedef itk::BinaryDilateImageFilter<QI::VolumeI, QI::VolumeI, TBall> TDilate;
-        float mask_volume = std::numeric_limits<float>::infinity();
-        float voxel_volume = QI::VoxelVolume(mask_image);
+    if (rats) {
+        const float voxel_volume = QI::VoxelVolume(intensity_image);
         if (verbose) std::cout << "Voxel volume: " << voxel_volume << std::endl;
+        const std::vector<float> distance = QI::SquaredDistance(mask, false);
+        float mask_volume = std::numeric_limits<float>::infinity();
         int radius = 0;
-        QI::VolumeI::Pointer mask_rats;
+        QI::BitMask mask_rats(mask.size());
         while (mask_volume > rats.Get()) {
             radius++;
-            TBall ball;
-            TBall::SizeType radii; radii.Fill(radius);
-            ball.SetRadius(radii);
-            ball.CreateStructuringElement();
-            TErode::Pointer erode = TErode::New();
-            erode->SetInput(mask_image);
-            erode->SetForegroundValue(1);
-            erode->SetBackgroundValue(0);
-            erode->SetKernel(ball);
-            erode->Update();
-            std::vector<float> kept_sizes = QI::FindLabels(erode->GetOutput(), 0, 1, mask_rats);
-            mask_volume = kept_sizes[0] * voxel_volume;
-            auto dilate = TDilate::New();
-            dilate->SetKernel(ball);
-            dilate->SetInput(mask_rats);
-            dilate->SetForegroundValue(1);
-            dilate->SetBackgroundValue(0);
-            dilate->Update();
-            mask_rats = dilate->GetOutput();
-            mask_rats->DisconnectPipeline();
+            size_t kept_size = 0;
+            const QI::BitMask largest = QI::LargestComponent(QI::BeyondDistance(distance, mask.size(), radius), kept_size);
+            if (kept_size == 0) {
+                std::cerr << "RATS eroded the whole mask at radius " << radius << std::endl;
+                return EXIT_FAILURE;
+            }
+            mask_volume = kept_size * voxel_volume;
+            mask_rats = QI::Dilate(largest, radius);
             if (verbose) std::cout << "Ran RATS iteration, current radius: " << radius << " volume is: " << mask_volume << std::endl;
-         }
-         mask_image = mask_rats;
-     }
+        }
+        mask = mask_rats;
+    }
 
     /*
      *  Stage 3 - Hole Filling
      */
-    QI::VolumeI::Pointer finalMask = ITK_NULLPTR;
     if (fillh_radius) {
         if (verbose) std::cout << "Filling holes" << std::endl;
-        auto fillHoles = itk::VotingBinaryIterativeHoleFillingImageFilter<QI::VolumeI>::New();
-        itk::VotingBinaryIterativeHoleFillingImageFilter<QI::VolumeI>::InputSizeType radius;
-        radius.Fill(fillh_radius.Get());
-        fillHoles->SetInput(mask_image);
-        fillHoles->SetRadius(radius);
-        fillHoles->SetMajorityThreshold(2); // Corresponds to (rad^3-1)/2 + 2 threshold
-        fillHoles->SetBackgroundValue(0);
-        fillHoles->SetForegroundValue(1);
-        fillHoles->SetMaximumNumberOfIterations(3);
-        fillHoles->Update();
-        mask_image = fillHoles->GetOutput();
-        mask_image->DisconnectPipeline();
+        mask = QI::Close(mask, fillh_radius.Get());
     }
 
+    QI::VolumeI::Pointer mask_image = QI::MaskImage(mask, intensity_image.GetPointer());
     if (verbose) std::cout << "Saving mask to: " << out_path << std::endl;
     QI::WriteImage(mask_image, out_path);
     if (verbose) std::cout << "Finished." << std::endl;
@@ -12,110 +12,14 @@
 #include <iostream>
 #include "Eigen/Dense"
 
-#include "itkImageToImageFilter.h"
-#include "itkImageRegionConstIterator.h"
-#include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkImageMomentsCalculator.h"
 #include "ImageTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
 #include "Polynomial.h"
+#include "PolynomialFilters.h"
 #include "Args.h"
-#include "Fit.h"
-
-namespace itk {
-
-class PolynomialFitImageFilter : public ImageToImageFilter<QI::VolumeF, QI::VolumeF> {
-public:
-    /** Standard class typedefs. */
-    typedef QI::VolumeF     TImage;
-
-    typedef PolynomialFitImageFilter           Self;
-    typedef ImageToImageFilter<TImage, TImage> Superclass;
-    typedef SmartPointer<Self>                 Pointer;
-    typedef typename TImage::RegionType        RegionType;
-
-    itkNewMacro(Self);
-    itkTypeMacro(Self, Superclass);
-
-    itkSetMacro(Robust, bool);
-    itkGetMacro(Robust, bool);
-
-    //void SetInput(const TImage *img) ITK_OVERRIDE      { this->SetNthInput(0, const_cast<TImage*>(img)); }
-    //typename TImage::ConstPointer GetInput() const { return static_cast<const TImage *>(this->ProcessObject::GetInput(0)); }
-
-    const QI::Polynomial<3> &GetPolynomial() const { return m_poly; } 
-    void SetPolynomial(const QI::Polynomial<3> &p) { m_poly = p; }
-    void SetMask(const TImage *mask) { this->SetNthInput(1, const_cast<TImage*>(mask)); }
-    void SetCenter(const itk::Point<double, 3>& v) { m_center = v; }
-    typename TImage::ConstPointer GetMask() const { return static_cast<const TImage *>(this->ProcessObject::GetInput(1)); }
-    void GenerateOutputInformation() ITK_OVERRIDE {
-        Superclass::GenerateOutputInformation();
-        auto op = this->GetOutput();
-        op->SetRegions(this->GetInput()->GetLargestPossibleRegion());
-        op->Allocate();
-    }
-
-protected:
-    QI::Polynomial<3> m_poly;
-    itk::Point<double, 3> m_center;
-    bool m_Robust;
-
-    PolynomialFitImageFilter() {
-        this->SetNumberOfRequiredInputs(1);
-        m_center.Fill(0.0);
-    }
-    ~PolynomialFitImageFilter() {}
-
-    void GenerateData() ITK_OVERRIDE {
-        typename TImage::ConstPointer input = this->GetInput();
-        auto region = input->GetLargestPossibleRegion();
-
-        const auto mask = this->GetMask();
-        ImageRegionConstIterator<TImage> maskIter;
-        int N = 0;
-        if (mask) {
-            //if (m_verbose) std::cout << "Counting voxels in mask..." << std::endl;
-            maskIter = ImageRegionConstIterator<TImage>(mask, region);
-            maskIter.GoToBegin();
-            while (!maskIter.IsAtEnd()) {
-                if (maskIter.Get())
-                    ++N;
-                ++maskIter;
-            }
-            maskIter.GoToBegin(); // Reset
-        } else {
-            N = region.GetNumberOfPixels();
-        }
-        Eigen::MatrixXd X(N, m_poly.nterms());
-        Eigen::VectorXd y(N);
-        itk::ImageRegionConstIteratorWithIndex<TImage> imageIt(input,region);
-        imageIt.GoToBegin();
-        int yi = 0;
-        while(!imageIt.IsAtEnd()) {
-            if (!mask || maskIter.Get()) {
-                TImage::PointType p, p2;
-                input->TransformIndexToPhysicalPoint(imageIt.GetIndex(), p);
-                p2 = p - m_center;
-                Eigen::Vector3d ep(p2[0], p2[1], p2[2]);
-                X.row(yi) = m_poly.terms(ep);
-                y[yi] = imageIt.Get();
-                ++yi;
-            }
-            ++imageIt;
-            if (mask)
-                ++maskIter;
-        }
-        Eigen::VectorXd b = m_Robust ? QI::RobustLeastSquares(X, y) : QI::LeastSquares(X, y);
-        m_poly.setCoeffs(b);
-    }
-
-private:
-    PolynomialFitImageFilter(const Self &); //purposely not implemented
-    void operator=(const Self &);  //purposely not implemented
-};
-
-} // End namespace itk
+#include "ThreadPool.h"
 
 int main(int argc, char **argv) {
     Eigen::initParallel();
@@ -130,8 +34,10 @@ int main(int argc, char **argv) {
     args::Flag                    robust(parser, "ROBUST", "Use a robust (Huber) fit", {'r', "robust"});
     args::ValueFlag<int>          order(parser, "ORDER", "Specify the polynomial order (default 4)", {'o',"order"}, 4);
     args::ValueFlag<std::string>  mask_path(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<int>          threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
 
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ThreadPool::SetGlobalThreads(threads.Get());
     if (verbose) std::cout << "Reading input from: " << QI::CheckPos(input_path) << std::endl;
     auto input = QI::ReadImage(QI::CheckPos(input_path));
     auto fit = itk::PolynomialFitImageFilter::New();
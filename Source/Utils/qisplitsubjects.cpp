@@ -13,11 +13,15 @@
 #include <iostream>
 #include <iomanip>
 #include <array>
+#include <sstream>
+#include <vector>
 
 #include "Util.h"
 #include "ImageTypes.h"
 #include "ImageIO.h"
 #include "Masking.h"
+#include "ThreadPool.h"
+#include "GridResampler.h"
 
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkThresholdImageFilter.h"
@@ -33,7 +37,6 @@
 #include "itkLinearInterpolateImageFunction.h"
 #include "itkWindowedSincInterpolateImageFunction.h"
 #include "itkConstantBoundaryCondition.h"
-#include "itkNearestNeighborInterpolateImageFunction.h"
 #include "itkShrinkImageFilter.h"
 #include "itkSmoothingRecursiveGaussianImageFilter.h"
 #include "itkMattesMutualInformationImageToImageMetric.h"
@@ -41,6 +44,8 @@
 #include "itkHistogramMatchingImageFilter.h"
 #include "itkRegularStepGradientDescentOptimizer.h"
 #include "itkImageRegistrationMethod.h"
+#include "itkImageDuplicator.h"
+#include "itkMultiThreader.h"
 
 using namespace std;
 
@@ -141,13 +146,28 @@ TPars MakePars(const TPars &ip, double ax, double ay, double az, double tx, doub
 }
 
 /*
- * Actual registration step
+ * Subjects are registered concurrently, and ITK pipelines are not safe to share between threads
+ * (even reading an image sets its requested region), so each one gets its own copy of the
+ * reference and labels.
+ */
+template<typename TImg>
+typename TImg::Pointer Duplicate(const typename TImg::Pointer &image) {
+    auto duplicator = itk::ImageDuplicator<TImg>::New();
+    duplicator->SetInputImage(image);
+    duplicator->Update();
+    return duplicator->GetOutput();
+}
+
+/*
+ * Actual registration step. The shrink factors make this a pyramid from gridSpacing down to the
+ * image voxel size, and the iterations are halved at each finer level so most of the work is
+ * done on the small, coarse images. Messages go to log so concurrent subjects do not interleave.
  */
 void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::VolumeF::Pointer &reference,
                                TRigid::Pointer tfm, double gridSpacing, double angleStep, int searchAngles,
-                               const int iterations, const bool verbose) {
+                               const int iterations, const bool verbose, std::ostream &log) {
     
-    if (verbose) cout << "Rescaling to matched intensity ranges" << endl;
+    if (verbose) log << "Rescaling to matched intensity ranges" << endl;
     typedef itk::RescaleIntensityImageFilter<QI::VolumeF,QI::VolumeF> TRescale;
     TRescale::Pointer scale_image = TRescale::New();
     TRescale::Pointer scale_ref   = TRescale::New();
@@ -162,7 +182,7 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
     scale_ref->SetOutputMaximum( desiredMaximum );
     scale_ref->UpdateLargestPossibleRegion();
 
-    if (verbose) cout << "Matching histograms" << endl;
+    if (verbose) log << "Matching histograms" << endl;
     typedef itk::HistogramMatchingImageFilter<QI::VolumeF,QI::VolumeF> THistMatch;
     THistMatch::Pointer hist_match = THistMatch::New();
     hist_match->SetReferenceImage(scale_ref->GetOutput());
@@ -190,7 +210,6 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
     opt->SetScales(MakeScales(1.0,1./1000.));
     opt->SetMaximumStepLength(1.0);
     opt->SetMinimumStepLength(0.01);
-    opt->SetNumberOfIterations(iterations);
 
     TReg::Pointer reg = TReg::New();
     reg->SetMetric(metric);
@@ -206,9 +225,11 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
     TPars initPars;
     TPars bestPars = tfm->GetParameters();
     
-    if (verbose) cout << "Starting registration" << endl;
+    if (verbose) log << "Starting registration" << endl;
     std::array<std::array<int, 3>, 7> translations{{ {{0,0,0}}, {{-1,0,0}}, {{1,0,0}}, {{0,-1,0}}, {{0,1,0}}, {{0,0,-1}}, {{0,0,1}} }};
+    int levelIterations = iterations;
     do {
+        opt->SetNumberOfIterations(levelIterations);
         TShrink::ShrinkFactorsType imageShrink = MakeShrink(gridSpacing, image);
         shrink_img->SetShrinkFactors(imageShrink);
         TShrink::ShrinkFactorsType refShrink = MakeShrink(gridSpacing, reference);
@@ -218,7 +239,7 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
         smooth_img->SetSigmaArray(smooth);
         smooth_ref->SetSigmaArray(smooth);
         
-        if (verbose) cout << "Grid: " << gridSpacing << " Image Shrink: " << imageShrink << " Ref Shrink:   " << refShrink << endl;
+        if (verbose) log << "Grid: " << gridSpacing << " Image Shrink: " << imageShrink << " Ref Shrink:   " << refShrink << " Iterations: " << levelIterations << endl;
         
         initPars = bestPars;
         reg->SetInitialTransformParameters(initPars);
@@ -227,9 +248,9 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
             initMetric = opt->GetValue();
             bestMetric = initMetric;
             bestPars = reg->GetLastTransformParameters();
-            if (verbose) cout << "Initial metric at this level: " << initMetric << endl;
+            if (verbose) log << "Initial metric at this level: " << initMetric << endl;
         } catch (itk::ExceptionObject &e) {
-            if (verbose) cout << "Initial registration failed with parameters: " << reg->GetLastTransformParameters() << endl;
+            if (verbose) log << "Initial registration failed with parameters: " << reg->GetLastTransformParameters() << endl;
         }
         for (double ax = -searchAngles*pangle; ax <= searchAngles*pangle; ax+=pangle) {
             for (double ay = -searchAngles*pangle; ay <= searchAngles*pangle; ay+=pangle) {
@@ -240,12 +261,12 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
                         try {
                             reg->Update();
                         } catch (itk::ExceptionObject &e) {
-                            if (verbose) cout << "Registration failed for parameters: " << reg->GetLastTransformParameters() << endl;
+                            if (verbose) log << "Registration failed for parameters: " << reg->GetLastTransformParameters() << endl;
                         }
                         if (opt->GetValue() < bestMetric) {
                             bestMetric = opt->GetValue();
                             bestPars = reg->GetLastTransformParameters();
-                            if (verbose) cout << "Metric improved to: " << bestMetric << " Iterations: " << opt->GetCurrentIteration() << endl;
+                            if (verbose) log << "Metric improved to: " << bestMetric << " Iterations: " << opt->GetCurrentIteration() << endl;
                         }
                     }
                 }
@@ -253,8 +274,9 @@ void RegisterImageToReference(const QI::VolumeF::Pointer &image, const QI::Volum
         }
         pangle /= 2;
         gridSpacing /= 2;
+        levelIterations = std::max(1, levelIterations / 2);
     } while ((gridSpacing >= image->GetSpacing()[0]) && (bestMetric != initMetric));
-    if (verbose) cout << "Finished" << endl;
+    if (verbose) log << "Finished" << endl;
     tfm->SetParameters(bestPars);
 }
 
@@ -267,10 +289,11 @@ Options:\n\
     --keep, -k N   : Keep N largest subjects\n\
     --size, -s N   : Only keep subjects with >N voxels (default 1000)\n\
     --oimgs        : Output images (default only transforms)\n\
+    --threads, -T N: Register up to N subjects at once (default 4, 0=hardware limit)\n\
 Reference Options:\n\
     --ref, -R FILE : Specify a reference image for output space\n\
     --grid, -G N   : Specify initial grid scale (default 1mm)\n\
-    --iters, -I N  : Specify the max number of iterations (default 25)\n\
+    --iters, -I N  : Max iterations at the initial grid, halved at each finer grid (default 25)\n\
     --angle, -A N  : Search angle step in degrees (default 30)\n\
     --nangle, -N N : Number of angle steps (default 1)\n\
 Masking options (default is generate a mask with Otsu's method):\n\
@@ -291,7 +314,7 @@ int main(int argc, char **argv) {
     bool verbose = false;
     int indexptr = 0, c;
     int keep = numeric_limits<int>::max(), size_threshold = 1000, output_images = false,
-        iterations = 25, angleSteps = 1;
+        iterations = 25, angleSteps = 1, threads = 4;
     ALIGN alignment = ALIGN::NONE;
     float intensity_threshold = 0;
     double angleX = 0., angleY = 0., angleZ = 0., angleStep = 30., gridSpacing = 1.0;
@@ -316,10 +339,11 @@ int main(int argc, char **argv) {
         {"rotX", required_argument, 0, 'X'},
         {"rotY", required_argument, 0, 'Y'},
         {"rotZ", required_argument, 0, 'Z'},
+        {"threads", required_argument, 0, 'T'},
         {"oimgs", no_argument, &output_images, true},
         {0, 0, 0, 0}
     };
-    const char* short_options = "hvR:G:I:A:N:c:k:s:";
+    const char* short_options = "hvR:G:I:A:N:c:k:s:T:";
 
     while ((c = getopt_long(argc, argv, short_options, long_options, &indexptr)) != -1) {
         switch (c) {
@@ -345,6 +369,7 @@ int main(int argc, char **argv) {
         case 'I': iterations = stoi(optarg); break;
         case 'A': angleStep = stod(optarg); break;
         case 'N': angleSteps = stoi(optarg); break;
+        case 'T': threads = stoi(optarg); break;
         case 's': size_threshold = atoi(optarg); break;
         case 't': intensity_threshold = stof(optarg); break;
         case 'X': angleX = stod(optarg)*M_PI/180.; break;
@@ -393,9 +418,24 @@ int main(int argc, char **argv) {
     else
         refCoG.Fill(0);
 
+    /*
+     * Masking and the initial transforms are quick and may read angles from stdin, so are done in
+     * order here. Registration and resampling are independent between subjects so are run on
+     * the thread pool, with ITK's own threads shared out between them, and then the outputs are
+     * written in order.
+     */
+    struct Subject {
+        QI::VolumeF::Pointer image, rimage;
+        QI::VolumeI::Pointer rmask;
+        TRigid::Pointer tfm;
+        std::ostringstream log;
+        std::string error;
+    };
+    std::vector<Subject> subjects(keep);
     for (auto i = 1; i <= keep; i++) {
-        QI::VolumeF::Pointer subject = MaskWithLabel(input, labels, i, true);
-        TMoments::VectorType CoG = GetCoG(subject);
+        Subject &s = subjects[i - 1];
+        s.image = MaskWithLabel(input, labels, i, true);
+        TMoments::VectorType CoG = GetCoG(s.image);
         TMoments::VectorType offset = refCoG - CoG;
         if (verbose) cout << "Subject " << i << " CoG is " << CoG << ", angle is " << (180./M_PI)*atan2(CoG[1], CoG[0]) << endl;
         double rotZ = 0.;        
@@ -411,44 +451,77 @@ int main(int argc, char **argv) {
         }
         if (verbose) cout << "Initial rotation angles are " << (angleX*180./M_PI) << " " << (angleY*180./M_PI) << " " << (angleZ*180./M_PI) << " degrees" << endl;
 
-        TRigid::Pointer tfm = TRigid::New();
-        tfm->SetIdentity();
-        tfm->SetRotation(angleX, angleY, angleZ + rotZ);
-        tfm->SetOffset(offset);
-        
-        if (reference) {
-            if (verbose) cout << "Registering to reference image..." << endl;
-            RegisterImageToReference(subject, reference, tfm, gridSpacing, angleStep, angleSteps, iterations, verbose);
+        s.tfm = TRigid::New();
+        s.tfm->SetIdentity();
+        s.tfm->SetRotation(angleX, angleY, angleZ + rotZ);
+        s.tfm->SetOffset(offset);
+    }
+
+    QI::ThreadPool::SetGlobalThreads(threads);
+    QI::ThreadPool &pool = QI::ThreadPool::Global();
+    const size_t concurrent = std::max<size_t>(1, std::min<size_t>(pool.size(), subjects.size()));
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(std::max<size_t>(1, pool.size() / concurrent));
+    if (verbose) cout << "Processing " << concurrent << " subjects at once" << endl;
+    pool.run(subjects.size(), [&](const size_t t) {
+        Subject &s = subjects[t];
+        const int label = t + 1;
+        try {
+            QI::VolumeF::Pointer subject_ref = reference ? Duplicate<QI::VolumeF>(reference) : QI::VolumeF::Pointer();
+            if (reference) {
+                if (verbose) s.log << "Registering subject " << label << " to reference image..." << endl;
+                RegisterImageToReference(s.image, subject_ref, s.tfm, gridSpacing, angleStep, angleSteps, iterations, verbose, s.log);
+            }
+            if (output_images) {
+                typedef itk::WindowedSincInterpolateImageFunction<QI::VolumeF, 5, itk::Function::LanczosWindowFunction<5>, itk::ConstantBoundaryCondition<QI::VolumeF>, double> TInterp;
+                if (verbose) s.log << "Resampling subject " << label << endl;
+                s.rimage = ResampleImage<QI::VolumeF, TInterp>(s.image, s.tfm, subject_ref);
+                // Not threaded, this is already a task on the global pool
+                Eigen::Matrix3d matrix;
+                Eigen::Vector3d offset;
+                for (int i = 0; i < 3; i++) {
+                    offset[i] = s.tfm->GetOffset()[i];
+                    for (int j = 0; j < 3; j++) matrix(i, j) = s.tfm->GetMatrix()(i, j);
+                }
+                const QI::GridResampler::TGeometry *grid = subject_ref ? static_cast<const QI::GridResampler::TGeometry *>(subject_ref.GetPointer()) : labels.GetPointer();
+                const QI::GridResampler resampler(labels.GetPointer(), grid, QI::GridResampler::Interpolation::Nearest, matrix, offset, false);
+                QI::VolumeI::Pointer rlabels = resampler.apply(labels.GetPointer(), false);
+                typedef itk::BinaryThresholdImageFilter<QI::VolumeI, QI::VolumeI> TThreshFilter;
+                auto rthresh = TThreshFilter::New();
+                rthresh->SetInput(rlabels);
+                rthresh->SetLowerThreshold(label);
+                rthresh->SetUpperThreshold(label);
+                rthresh->SetInsideValue(1);
+                rthresh->SetOutsideValue(0);
+                rthresh->Update();
+                s.rmask = rthresh->GetOutput();
+                s.rmask->DisconnectPipeline();
+            }
+        } catch (std::exception &e) {
+            s.error = e.what();
+        }
+    });
+
+    for (auto i = 1; i <= keep; i++) {
+        Subject &s = subjects[i - 1];
+        cout << s.log.str();
+        if (!s.error.empty()) {
+            QI_FAIL("Subject " << i << " failed: " << s.error);
         }
-        
         stringstream suffix; suffix << "_" << setfill('0') << setw(2) << i;
         fname = prefix + suffix.str() + ".tfm";
         if (verbose) cout << "Writing transform file " << fname << endl;
         auto tfmWriter = itk::TransformFileWriterTemplate<double>::New();
-        tfmWriter->SetInput(tfm);
+        tfmWriter->SetInput(s.tfm);
         tfmWriter->SetFileName(fname);
         tfmWriter->Update();
         
         if (output_images) {
-            typedef itk::WindowedSincInterpolateImageFunction<QI::VolumeF, 5, itk::Function::LanczosWindowFunction<5>, itk::ConstantBoundaryCondition<QI::VolumeF>, double> TInterp;
-            typedef itk::NearestNeighborInterpolateImageFunction<QI::VolumeI, double> TNNInterp;
-            if (verbose) cout << "Resampling image" << endl;
-            QI::VolumeF::Pointer rimage = ResampleImage<QI::VolumeF, TInterp>(subject, tfm, reference);
-            QI::VolumeI::Pointer rlabels = ResampleImage<QI::VolumeI, TNNInterp>(labels, tfm, reference);
-            typedef itk::BinaryThresholdImageFilter<QI::VolumeI, QI::VolumeI> TThreshFilter;
-            auto rthresh = TThreshFilter::New();
-            rthresh->SetInput(rlabels);
-            rthresh->SetLowerThreshold(i);
-            rthresh->SetUpperThreshold(i);
-            rthresh->SetInsideValue(1);
-            rthresh->SetOutsideValue(0);
-            rthresh->Update();
             fname = prefix + suffix.str() + QI::OutExt();
             if (verbose) cout << "Writing output file " << fname << endl;
-            QI::WriteImage(rimage, fname);
+            QI::WriteImage(s.rimage, fname);
             fname = prefix + suffix.str() + "_mask" + QI::OutExt();
             if (verbose) cout << "Writing output mask " << fname << endl;
-            QI::WriteImage(rthresh->GetOutput(), fname);
+            QI::WriteImage(s.rmask, fname);
         }
     }
     return EXIT_SUCCESS;
@@ -17,3 +17,38 @@ setup() {
     RESULT="$( qihdr "$IMAGE" --size=1 )"
     [ "$RESULT"  -eq "$ONE_SIZE" ]
 }
+
+@test "Stream Images" {
+    SIZE="32,32,32"
+    qinewimage --size "$SIZE" -g "2 0.5 1.5" whole_image.nii
+    qinewimage --size "$SIZE" -g "2 0.5 1.5" --slabs=4 slab_image.nii
+    qidiff --baseline=whole_image.nii --input=slab_image.nii --noise=1 --tolerance=0
+}
+
+@test "Result Cache" {
+    SIZE="16,16,16"
+    export QUIT_CACHE="$PWD/cache"
+    qinewimage --size "$SIZE" -g "0 1 2" cached.nii
+    [ -d "$QUIT_CACHE" ]
+    rm cached.nii
+    qinewimage --size "$SIZE" -g "0 1 2" cached.nii
+    [ "$( stat -c %h cached.nii )" -eq 2 ]
+    unset QUIT_CACHE
+    qinewimage --size "$SIZE" -g "0 1 2" uncached.nii
+    qidiff --baseline=uncached.nii --input=cached.nii --noise=1 --tolerance=0
+}
+
+@test "Write Vector Images" {
+    SIZE="16,16,16"
+    qinewimage --size "$SIZE" -g "1 0.8 1.0" vec_PD.nii
+    qinewimage --size "$SIZE" -g "0 0.5 1.5" vec_T1.nii
+    INPUT='{ "PD": "vec_PD.nii", "T1": "vec_T1.nii", "T2": "", "f0": "", "B1": "",
+             "SequenceGroup": { "sequences": [ { "SPGR": { "TR": 0.01, "FA": [3,6,12,20] } } ] } }'
+    # Uncompressed files are written a chunk of volumes at a time, compressed ones converted whole
+    echo "$INPUT" | qisignal --model=1 vec_spgr.nii
+    echo "$INPUT" | qisignal --model=1 vec_spgr.nii.gz
+    [ "$( qihdr vec_spgr.nii --size=4 )" -eq 4 ]
+    echo '{ "SPGR": { "TR": 0.01, "FA": [3,6,12,20] } }' | qidespot1 vec_spgr.nii --out=vec_nii_
+    echo '{ "SPGR": { "TR": 0.01, "FA": [3,6,12,20] } }' | qidespot1 vec_spgr.nii.gz --out=vec_gz_
+    qidiff --baseline=vec_gz_D1_T1$EXT --input=vec_nii_D1_T1$EXT --noise=1 --tolerance=0
+}
@@ -44,6 +44,101 @@ qidespot1 $SPGR_FILE --verbose <<OUT
 }
 OUT
 qidiff --baseline=T1.nii --input=D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
+# Re-fit with NLLS, starting from the maps just written as for the next time-point of a series
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 $SPGR_FILE --algo=n --initial=./ --out=next_ --stats=next_stats.json --verbose
+grep -q '"model_evaluations"' next_stats.json
+qidiff --baseline=T1.nii --input=next_D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
+# Gathering the voxels into blocks first fits the same, and still warm-starts and seeds from the lattice
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 $SPGR_FILE --algo=n --sparse --warm --multigrid=4 --out=sparse_ --verbose
+qidiff --baseline=T1.nii --input=sparse_D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
+# A memory limit below the whole fit streams it in slabs, one below a single plane refuses to start
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | QUIT_EXT=.nii qidespot1 $SPGR_FILE --mem-limit=0.05 --out=mem_ --verbose
+qidiff --baseline=D1_T1.nii --input=mem_D1_T1.nii --noise=$NOISE --tolerance=0 --verbose
+# Streaming one plane at a time with several outputs, where pasting the larger outputs is slower than
+# the LLS fit of the next plane, finishes instead of waiting on its own paste queue
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | QUIT_EXT=.nii timeout 120 qidespot1 $SPGR_FILE --stream=16 --resids --out=slab_
+qidiff --baseline=D1_T1.nii --input=slab_D1_T1.nii --noise=$NOISE --tolerance=0 --verbose
+[ -f slab_D1_all_residuals.nii ]
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --mem-limit=1K --out=tiny_"
+[ "$status" -ne 0 ]
+# A preview only fits every second voxel but still writes full maps and estimates the full time
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --preview=2 --out=preview_"
+[ "$status" -eq 0 ]
+[[ "$output" == *"a full fit should take about"* ]]
+qidiff --baseline=T1.nii --input=preview_D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
+# Failed voxels are summarised instead of listed, and can be mapped
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --failures --out=failures_"
+[ "$status" -eq 0 ]
+[[ "$output" != *"Algorithm failed for voxel"* ]]
+[ -f failures_D1_failures.nii ]
+# Screening with the known noise level skips nothing at a low SNR and everything at an impossible one
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --screen=1 --noise=$NOISE --out=screen_ --verbose"
+[ "$status" -eq 0 ]
+[[ "$output" == *"Screened out 0 of 4096 voxels"* ]]
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --screen=1e6 --noise=$NOISE --failures --out=screened_ --verbose"
+[ "$status" -eq 0 ]
+[[ "$output" == *"Screened out 4096 of 4096 voxels"* ]]
+# A subregion only fits (and reads) part of the input, --voxel prints one voxel's data and fit and writes no maps
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 $SPGR_FILE --subregion=4,4,4,8,8,8 --out=sub_
+[ -f sub_D1_T1.nii ]
+run bash -c "echo '{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }' | qidespot1 $SPGR_FILE --algo=n --voxel=8,8,8 --out=voxel_"
+[ "$status" -eq 0 ]
+[[ "$output" == *"Input 0:"* ]]
+[[ "$output" == *"Output 1:"* ]]
+[ ! -f voxel_D1_T1.nii ]
+# Fitting the mean signal of each of four labels gives a table with a row per label
+qinewimage --size "$SIZE" --step "0 1 4 4" labels$EXT
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 $SPGR_FILE --regions=labels$EXT --bootstrap=10 --out=regions_ --verbose
+[ "$(wc -l < regions_D1_regions.csv)" -eq 5 ]
+head -n 1 regions_D1_regions.csv | grep -q "T1_sd"
+
+}
+
+@test "DESPOT1-Shards" {
+
+# Setup parameters
+SPGR_FILE="spgr$EXT"
+SPGR_FLIP="3,3,20,20"
+SPGR_TR="0.01"
+SIZE="16,16,16"
+NOISE="0.01"
+SEQ="{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qisignal --model=1 -v --noise=$NOISE $SPGR_FILE << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [
+            {
+                "SPGR": {
+                    "TR": $SPGR_TR,
+                    "FA": [$SPGR_FLIP]
+                }
+            }
+        ]
+    }
+}
+OUT
+for SHARD in 0 1 2; do
+    echo "$SEQ" | qidespot1 $SPGR_FILE --shard=$SHARD/3 --verbose
+    [ -e shard${SHARD}of3.qik ]
+done
+qi_merge_shards shard0of3.qik shard1of3.qik shard2of3.qik --out=merged.qik --verbose
+echo "$SEQ" | qidespot1 $SPGR_FILE --checkpoint=merged.qik --resume --verbose
+qidiff --baseline=T1.nii --input=D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
+# Jobs sharing a queue fit whichever chunks they claim first, between them every voxel, and merge the same way
+echo "$SEQ" | qidespot1 $SPGR_FILE --queue=queue --checkpoint=queueA.qik --out=queue_ &
+echo "$SEQ" | qidespot1 $SPGR_FILE --queue=queue --checkpoint=queueB.qik --out=queue_
+wait
+[ -e queue/job ]
+qi_merge_shards queueA.qik queueB.qik --out=queue_merged.qik --verbose
+echo "$SEQ" | qidespot1 $SPGR_FILE --checkpoint=queue_merged.qik --resume --out=queue_ --verbose
+qidiff --baseline=T1.nii --input=queue_D1_T1.nii --noise=$NOISE --tolerance=30 --verbose
 
 }
 
@@ -56,4 +56,17 @@ END_FM
 
 qidiff --baseline=T2.nii --input=FM_T2.nii --noise=$NOISE --tolerance=50 --verbose
 
+# Fit the voxels that took the most iterations again, keeping the rest of the first fit
+qidespot2fm --verbose -bB1.nii T1.nii ${SSFP_FILE} --asym --refit=./ --select="its>=10" --its=150 --out=refit_ << END_FM
+{
+    "SSFP": {
+        "TR": $SSFP_TR,
+        "PhaseInc": [$SSFP_PINC],
+        "FA": [$SSFP_FLIP]
+    }
+}
+END_FM
+
+qidiff --baseline=T2.nii --input=refit_FM_T2.nii --noise=$NOISE --tolerance=50 --verbose
+
 }
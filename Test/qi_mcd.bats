@@ -72,6 +72,39 @@ $SEQUENCE_GROUP
 END_MCD
 qidiff --baseline=f_m$EXT --input=2C_f_m$EXT --noise=$NOISE --tolerance=250 --verbose
 
+# The batched backend must agree with the per-voxel fits it replaces
+qimcdespot $OPTS -M2 -bB1$EXT -ff0$EXT --batch -obatch_ -v $SPGR_FILE $SSFP_FILE << END_MCD
+{
+$SEQUENCE_GROUP
+}
+END_MCD
+qidiff --baseline=f_m$EXT --input=batch_2C_f_m$EXT --noise=$NOISE --tolerance=250 --verbose
+qidiff --baseline=2C_f_m$EXT --input=batch_2C_f_m$EXT --noise=$NOISE --tolerance=250 --verbose
+
+# Each voxel has its own random stream, so the maps do not depend on the number of threads
+qimcdespot $OPTS -M2 -bB1$EXT -ff0$EXT -T1 -oT1_ -v $SPGR_FILE $SSFP_FILE << END_MCD
+{
+$SEQUENCE_GROUP
+}
+END_MCD
+qidiff --baseline=2C_f_m$EXT --input=T1_2C_f_m$EXT --tolerance=0 --verbose
+
+# Packing the inputs is lossless, so it must not change the maps
+qimcdespot $OPTS -M2 -bB1$EXT -ff0$EXT --pack -opack_ -v $SPGR_FILE $SSFP_FILE << END_MCD
+{
+$SEQUENCE_GROUP
+}
+END_MCD
+qidiff --baseline=2C_f_m$EXT --input=pack_2C_f_m$EXT --tolerance=0 --verbose
+
+# The inputs are floats, so --int16 must fall back to reading them as usual
+qimcdespot $OPTS -M2 -bB1$EXT -ff0$EXT --int16 -oint16_ -v $SPGR_FILE $SSFP_FILE << END_MCD
+{
+$SEQUENCE_GROUP
+}
+END_MCD
+qidiff --baseline=2C_f_m$EXT --input=int16_2C_f_m$EXT --tolerance=0 --verbose
+
 }
 
 @test "3C mcDESPOT" {
@@ -144,4 +177,40 @@ qimcdespot $OPTS -M3 -bB1$EXT -ff0$EXT -r -v $SPGR_FILE $SSFP_FILE << END_MCD
 END_MCD
 qidiff --baseline=f_m$EXT --input=3C_f_m$EXT --noise=$NOISE --tolerance=250 --verbose
 
-}
\ No newline at end of file
+}
+@test "3C SPGR sums the pools" {
+
+# With equal T1s the pools recover together, so the three-pool SPGR signal is a single-pool signal
+SIZE="4,4,4"
+qinewimage --size "$SIZE" -g "0 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -f "1.0" T1$EXT
+qinewimage --size "$SIZE" -f "0.05" T2$EXT
+qinewimage --size "$SIZE" -f "0.18" tau_m$EXT
+qinewimage --size "$SIZE" -g "1 0.05 0.25" f_m$EXT
+qinewimage --size "$SIZE" -g "2 0.05 0.3" f_csf$EXT
+qinewimage --size "$SIZE" -f "0" f0$EXT
+qinewimage --size "$SIZE" -f "1" B1$EXT
+
+SPGR_TR="0.0065"
+SPGR_FLIP="3,4,5,6,7,9,13,18"
+SEQUENCE="\"SequenceGroup\": { \"sequences\": [ { \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } } ] }"
+qisignal --model=1 spgr_1c$EXT << END_SIG
+{ "PD": "PD$EXT", "T1": "T1$EXT", "T2": "T2$EXT", "f0": "f0$EXT", "B1": "B1$EXT", $SEQUENCE }
+END_SIG
+qisignal --model=3 spgr_3c$EXT << END_SIG
+{
+    "PD": "PD$EXT",
+    "T1_m": "T1$EXT", "T2_m": "T2$EXT",
+    "T1_ie": "T1$EXT", "T2_ie": "T2$EXT",
+    "T1_csf": "T1$EXT", "T2_csf": "T2$EXT",
+    "tau_m": "tau_m$EXT", "f_m": "f_m$EXT", "f_csf": "f_csf$EXT",
+    "f0": "f0$EXT", "B1": "B1$EXT",
+    $SEQUENCE
+}
+END_SIG
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 spgr_1c$EXT --out=1c_
+echo "{ \"SPGR\": { \"TR\": $SPGR_TR, \"FA\": [$SPGR_FLIP] } }" | qidespot1 spgr_3c$EXT --out=3c_
+# Adding the pools in quadrature would lower PD by up to a quarter
+qidiff --baseline=1c_D1_PD$EXT --input=3c_D1_PD$EXT --noise=1 --tolerance=0.001 --verbose
+
+}
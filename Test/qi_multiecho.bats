@@ -50,9 +50,11 @@ echo { "$SPIN_SEQUENCE" } > multiecho.in
 qimultiecho $SPIN_FILE -v -al -oLL_ < multiecho.in
 qimultiecho $SPIN_FILE -v -an -oLM_ < multiecho.in
 qimultiecho $SPIN_FILE -v -aa -oAR_   < multiecho.in
+qimultiecho $SPIN_FILE -v -am -oMW_ --nFA=1 --T2min=0.005 < multiecho.in
 
 qidiff --baseline=T2.nii --input=LL_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
 qidiff --baseline=T2.nii --input=LM_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
 qidiff --baseline=T2.nii --input=AR_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
+qidiff --baseline=T2.nii --input=MW_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
 
 }
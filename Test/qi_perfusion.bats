@@ -21,3 +21,22 @@ qi_asl --verbose asl.nii <<END_INPUT
 END_INPUT
 
 }
+
+@test "Perfusion (multi-PLD ASL)" {
+
+SIZE="16,16,16,6"
+qinewimage --verbose --dims=4 --size="$SIZE" --step="3 1 1.06 2" asl_multi.nii
+qi_asl --verbose --multipld asl_multi.nii <<END_INPUT
+{
+    "CASL" : {
+        "TR": 4.0,
+        "label_time": 1.8,
+        "post_label_delay": [0.5, 1.0, 1.5]
+    }
+}
+END_INPUT
+[ -e asl_multi_CBF$EXT ]
+[ -e asl_multi_ATT$EXT ]
+[ -e asl_multi_residual$EXT ]
+
+}
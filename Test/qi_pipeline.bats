@@ -0,0 +1,129 @@
+# Copyright Tobias Wood 2018
+# Tests for running programs in one process
+
+setup() {
+    load $BATS_TEST_DIRNAME/common.bash
+    init_tests
+}
+
+@test "Pipeline" {
+
+SIZE="16,16,16"
+NOISE="0.01"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qinewimage --size "$SIZE" -g "2 0.02 0.1" T2$EXT
+qisignal --model=1 -v --noise=$NOISE spgr$EXT << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [ { "SPGR": { "TR": 0.01, "FA": [3,3,20,20] } } ]
+    }
+}
+OUT
+qisignal --model=1 -v --noise=$NOISE ssfp$EXT << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "T2$EXT",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [ { "SSFP": { "TR": 0.01, "FA": [15,60], "PhaseInc": [180,180] } } ]
+    }
+}
+OUT
+cat > pipeline.json << OUT
+{
+    "stages": [
+        { "program": "qidespot1", "args": ["spgr$EXT", "--out=mem:"],
+          "sequence": { "SPGR": { "TR": 0.01, "FA": [3,3,20,20] } } },
+        { "program": "qipolyfit", "args": ["mem:D1_PD$EXT", "--order=2"], "stdout": "mem:poly" },
+        { "program": "qipolyimg", "args": ["mem:D1_PD$EXT", "pipe_PD$EXT", "--order=2"], "stdin": "mem:poly" },
+        { "program": "qidespot2", "args": ["mem:D1_T1$EXT", "ssfp$EXT", "--out=pipe_"],
+          "sequence": { "SSFP": { "TR": 0.01, "FA": [15,60], "PhaseInc": [180,180] } },
+          "forget": ["mem:D1_T1$EXT", "mem:D1_PD$EXT"] }
+    ]
+}
+OUT
+qi_pipeline pipeline.json --verbose
+# Nothing but the final outputs should be on disk
+[ ! -e D1_T1$EXT ]
+[ -e pipe_PD$EXT ]
+qidiff --baseline=T2$EXT --input=pipe_D2_T2$EXT --noise=$NOISE --tolerance=30 --verbose
+qidiff --baseline=PD$EXT --input=pipe_PD$EXT --noise=$NOISE --tolerance=30 --verbose
+
+# The same pipeline for a table of subjects in one run
+cp spgr$EXT spgr_b$EXT
+cat > batch.json << OUT
+{
+    "stages": [
+        { "program": "qidespot1", "args": ["\${spgr}", "--out=\${name}_"],
+          "sequence": { "SPGR": { "TR": 0.01, "FA": [3,3,20,20] } } }
+    ]
+}
+OUT
+cat > subjects.txt << OUT
+name spgr
+# Comments and blank lines are skipped
+
+a spgr$EXT
+b spgr_b$EXT
+OUT
+qi_pipeline batch.json --batch=subjects.txt --verbose
+qidiff --baseline=T1$EXT --input=a_D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+qidiff --baseline=a_D1_T1$EXT --input=b_D1_T1$EXT --tolerance=0 --verbose
+
+}
+
+@test "Pipeline server" {
+
+SIZE="16,16,16"
+NOISE="0.01"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qisignal --model=1 -v --noise=$NOISE spgr$EXT << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [ { "SPGR": { "TR": 0.01, "FA": [3,3,20,20] } } ]
+    }
+}
+OUT
+SOCKET="$QI_TEST_DIR/quit.sock"
+qi_pipeline --serve="$SOCKET" --threads=2 --verbose &
+for i in $(seq 100); do [ -S "$SOCKET" ] && break; sleep 0.1; done
+cat > job.json << OUT
+{
+    "stages": [
+        { "program": "qidespot1", "args": ["$QI_TEST_DIR/spgr$EXT", "--out=$QI_TEST_DIR/server_"],
+          "sequence": { "SPGR": { "TR": 0.01, "FA": [3,3,20,20] } } }
+    ]
+}
+OUT
+cat > bad.json << OUT
+{
+    "stages": [
+        { "program": "qidespot1", "args": ["$QI_TEST_DIR/missing$EXT"],
+          "sequence": { "SPGR": { "TR": 0.01, "FA": [3,20] } } }
+    ]
+}
+OUT
+# A failed job is reported but the server carries on
+run qi_pipeline bad.json --submit="$SOCKET"
+[ "$status" -ne 0 ]
+qi_pipeline job.json --submit="$SOCKET"
+qi_pipeline --submit="$SOCKET" --shutdown
+wait
+[ ! -e "$SOCKET" ]
+qidiff --baseline=T1$EXT --input=server_D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+
+}
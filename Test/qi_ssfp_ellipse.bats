@@ -107,4 +107,18 @@ INPUT
     qidiff --baseline=T1$EXT --input=EMT_T1f$EXT --noise=$NOISE --tolerance=40 --verbose
     qidiff --baseline=T2$EXT --input=EMT_T2f$EXT --noise=$NOISE --tolerance=35 --verbose
     qidiff --baseline=PD$EXT --input=EMT_M0$EXT --noise=$NOISE --tolerance=20 --verbose
+    # Fitting the ellipses in the same pass should agree with going through the files
+    qi_ssfp_emt --ssfp=ssfp$EXT --verbose -opipe_ << INPUT
+{
+    "SSFPMT": {
+        "TR": [0.01, 0.01],
+        "Trf": [0.001, 0.001],
+        "FA": [16, 32],
+        "intB1": [0.005904, 0.005904],
+        "PhaseInc": [180, 240, 300, 0, 60, 120]
+    }
+}
+INPUT
+    qidiff --baseline=EMT_T1f$EXT --input=pipe_EMT_T1f$EXT --noise=$NOISE --tolerance=1 --verbose
+    qidiff --baseline=EMT_M0$EXT --input=pipe_EMT_M0$EXT --noise=$NOISE --tolerance=1 --verbose
 }
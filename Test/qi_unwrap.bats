@@ -26,4 +26,44 @@ qidiff --baseline=ramp$EXT --input=wrapped_unwrapped$EXT --tolerance=1 --abs --v
 # qi_unwrap_laplace wrapped$EXT --verbose
 # qidiff --baseline=ramp$EXT --input=wrapped_unwrapped$EXT --tolerance=1 --abs --verbose
 
-# }
\ No newline at end of file
+# }
+
+@test "V-SHARP Background Field Removal" {
+
+SIZE="32,32,32"
+# A linear gradient is harmonic, so is all background and the local field should vanish
+qinewimage --size=$SIZE --grad="2 -3.1416 3.1416" bgfield$EXT
+qinewimage --size=$SIZE --fill=1 bgmask$EXT
+qinewimage --size=$SIZE --fill=0 bgzero$EXT
+qi_bgremove bgfield$EXT bgmask$EXT --radii=4,2 --verbose
+qidiff --baseline=bgzero$EXT --input=bgfield_local$EXT --tolerance=1 --abs --verbose
+
+}
+
+@test "Dipole Inversion" {
+
+SIZE="32,32,32"
+# With the background removed there is no local field, so no susceptibility
+qinewimage --size=$SIZE --grad="2 -3.1416 3.1416" qsmfield$EXT
+qinewimage --size=$SIZE --fill=1 qsmmask$EXT
+qinewimage --size=$SIZE --fill=0 qsmzero$EXT
+qi_bgremove qsmfield$EXT qsmmask$EXT --radii=4,2
+qi_qsm qsmfield_local$EXT qsmfield_mask$EXT --algo=t --out=qsm_tkd
+qidiff --baseline=qsmzero$EXT --input=qsm_tkd_chi$EXT --tolerance=1 --abs --verbose
+qi_qsm qsmfield_local$EXT qsmfield_mask$EXT --algo=c --out=qsm_cg --verbose
+qidiff --baseline=qsmzero$EXT --input=qsm_cg_chi$EXT --tolerance=1 --abs --verbose
+
+}
+
+@test "Multi-Echo Field Map" {
+
+SIZE="8,8,8,8"
+# 40 Hz with 5 ms echo spacing is 1.2566 radians per echo, so the later echoes wrap
+qinewimage --dims=4 --size=$SIZE --grad="3 1.2566 10.053" --wrap=6.2832 me_phase$EXT
+qinewimage --size="8,8,8" --fill=40 me_f0$EXT
+echo '{ "MultiEcho" : { "TR" : 0.05, "TE1" : 0.005, "ESP" : 0.005, "ETL" : 8 } }' > fieldmap.json
+qi_fieldmap me_phase$EXT --verbose < fieldmap.json
+qidiff --baseline=me_f0$EXT --input=me_phase_f0$EXT --tolerance=1 --verbose
+[ -f me_phase_residual$EXT ]
+
+}
@@ -24,4 +24,15 @@ INPUT
 SIZE="64,64,16,4"
 qinewimage --dims=4 --size="$SIZE" --step="0 0 8 4" steps$EXT
 qikfilter steps$EXT --threads=1 --filter_per_volume --filter=Gauss,2.0 --filter=Blackman --filter=Hamming --filter=Tukey --verbose
-}
\ No newline at end of file
+}
+@test "Image Calculator" {
+
+SIZE="16,16,16"
+qinewimage --size "$SIZE" --grad="0 1 2" a$EXT
+qinewimage --size "$SIZE" --fill=2 b$EXT
+qinewimage --size "$SIZE" --grad="0 2 4" twice$EXT
+qi_calc ratio$EXT "max(a * b, 0) / sqrt(b^2) + 2*a*(b > 5)" a=a$EXT b=b$EXT --verbose
+qi_calc sum$EXT "a + a" a=a$EXT
+qidiff --baseline=a$EXT --input=ratio$EXT --noise=1 --tolerance=0.01
+qidiff --baseline=twice$EXT --input=sum$EXT --noise=1 --tolerance=0.01
+}